@@ -11,6 +11,9 @@
 #include <linux/writeback.h>
 #include <linux/uio.h>
 #include <linux/xattr.h>
+#include <linux/mempool.h>
+#include <linux/llist.h>
+#include <linux/workqueue.h>
 #include <crypto/aead.h>
 
 #include "auth.h"
@@ -62,46 +65,43 @@ static inline void free_hmacsha256(struct cifsd_tcp_conn *conn)
 	conn->secmech.sdeschmacsha256 = NULL;
 }
 
-static inline void free_cmacaes(struct cifsd_tcp_conn *conn)
-{
-	crypto_free_shash(conn->secmech.cmacaes);
-	conn->secmech.cmacaes = NULL;
-	kfree(conn->secmech.sdesccmacaes);
-	conn->secmech.sdesccmacaes = NULL;
-}
-
-static inline void free_sha512(struct cifsd_tcp_conn *conn)
-{
-	crypto_free_shash(conn->secmech.sha512);
-	conn->secmech.sha512 = NULL;
-	kfree(conn->secmech.sdescsha512);
-	conn->secmech.sdescsha512 = NULL;
-}
-
 static inline void free_sdescmd5(struct cifsd_tcp_conn *conn)
 {
-	kfree(conn->secmech.md5);
+	crypto_free_shash(conn->secmech.md5);
 	conn->secmech.md5 = NULL;
 	kfree(conn->secmech.sdescmd5);
 	conn->secmech.sdescmd5 = NULL;
 }
 
-static inline void free_ccmaes(struct cifsd_tcp_conn *conn)
-{
-	crypto_free_aead(conn->secmech.ccmaesencrypt);
-	conn->secmech.ccmaesencrypt = NULL;
-	crypto_free_aead(conn->secmech.ccmaesdecrypt);
-	conn->secmech.ccmaesencrypt = NULL;
-}
-
 void cifsd_free_conn_secmech(struct cifsd_tcp_conn *conn)
 {
 	free_hmacmd5(conn);
 	free_hmacsha256(conn);
-	free_cmacaes(conn);
-	free_sha512(conn);
 	free_sdescmd5(conn);
-	free_ccmaes(conn);
+}
+
+/**
+ * cifsd_shrink_conn_secmech() - free hash contexts a connection isn't using
+ * @conn:	TCP server instance of connection
+ *
+ * Only the SMB1 signing context is freed, it is used under
+ * conn->secmech_lock and allocated again when it is needed. The NTLMv2 and
+ * key derivation contexts are used by commands with no lock held and are
+ * kept until the connection is freed. Doesn't sleep, a context in use is
+ * skipped.
+ *
+ * Return:	number of contexts freed
+ */
+unsigned int cifsd_shrink_conn_secmech(struct cifsd_tcp_conn *conn)
+{
+	unsigned int freed = 0;
+
+	if (mutex_trylock(&conn->secmech_lock)) {
+		freed += !!conn->secmech.md5;
+		free_sdescmd5(conn);
+		mutex_unlock(&conn->secmech_lock);
+	}
+	return freed;
 }
 
 static int crypto_hmacmd5_alloc(struct cifsd_tcp_conn *conn)
@@ -649,6 +649,7 @@ int cifsd_sign_smb1_pdu(struct cifsd_session *sess,
 	int rc;
 	int i;
 
+	mutex_lock(&sess->conn->secmech_lock);
 	rc = crypto_md5_alloc(sess->conn);
 	if (rc) {
 		cifsd_debug("could not crypto alloc md5 rc %d\n", rc);
@@ -683,6 +684,7 @@ int cifsd_sign_smb1_pdu(struct cifsd_session *sess,
 		cifsd_debug("md5 generation error %d\n", rc);
 
 out:
+	mutex_unlock(&sess->conn->secmech_lock);
 	return rc;
 }
 #else
@@ -725,120 +727,290 @@ static int crypto_hmacsha256_alloc(struct cifsd_tcp_conn *conn)
 	return 0;
 }
 
-static int crypto_cmac_alloc(struct cifsd_tcp_conn *conn)
+/*
+ * Signing and preauth integrity hash contexts are per CPU, keyed for each
+ * message, so that neither allocates nor serializes the requests of a
+ * connection. The mutex only covers a worker being preempted or migrated
+ * while using them.
+ */
+struct cifsd_sign_ctx {
+	struct mutex		lock;
+	struct sdesc		*hmacsha256;
+	struct sdesc		*cmacaes;
+	struct sdesc		*sha512;
+	struct crypto_aead	*gmacaes;
+	struct aead_request	*gmac_req;
+	u8			tag[SMB2_SIGNATURE_SIZE];
+};
+
+/* Signing algorithms a context of each CPU has */
+static bool sign_gmac_available;
+static struct cifsd_sign_ctx **sign_ctxs;
+
+static struct sdesc *cifsd_alloc_sdesc(const char *alg)
 {
-	int rc;
-	unsigned int size;
+	struct crypto_shash *tfm;
+	struct sdesc *sdesc;
 
-	/* check if already allocated */
-	if (conn->secmech.sdesccmacaes)
-		return 0;
+	tfm = crypto_alloc_shash(alg, 0, 0);
+	if (IS_ERR(tfm))
+		return NULL;
 
-	conn->secmech.cmacaes = crypto_alloc_shash("cmac(aes)", 0, 0);
-	if (IS_ERR(conn->secmech.cmacaes)) {
-		cifsd_debug("could not allocate crypto cmac-aes\n");
-		rc = PTR_ERR(conn->secmech.cmacaes);
-		conn->secmech.cmacaes = NULL;
-		return rc;
+	sdesc = kmalloc(sizeof(struct shash_desc) +
+			crypto_shash_descsize(tfm), GFP_KERNEL);
+	if (!sdesc) {
+		crypto_free_shash(tfm);
+		return NULL;
 	}
+	sdesc->shash.tfm = tfm;
+	sdesc->shash.flags = 0x0;
+	return sdesc;
+}
 
-	size = sizeof(struct shash_desc) +
-		crypto_shash_descsize(conn->secmech.cmacaes);
-	conn->secmech.sdesccmacaes = kmalloc(size, GFP_KERNEL);
-	if (!conn->secmech.sdesccmacaes) {
-		free_cmacaes(conn);
-		return -ENOMEM;
-	}
-	conn->secmech.sdesccmacaes->shash.tfm = conn->secmech.cmacaes;
-	conn->secmech.sdesccmacaes->shash.flags = 0x0;
+static void cifsd_free_sdesc(struct sdesc *sdesc)
+{
+	if (!sdesc)
+		return;
+	crypto_free_shash(sdesc->shash.tfm);
+	kfree(sdesc);
+}
 
-	return 0;
+static void cifsd_free_sign_ctx(struct cifsd_sign_ctx *ctx)
+{
+	if (!ctx)
+		return;
+	cifsd_free_sdesc(ctx->hmacsha256);
+	cifsd_free_sdesc(ctx->cmacaes);
+	cifsd_free_sdesc(ctx->sha512);
+	if (ctx->gmac_req)
+		aead_request_free(ctx->gmac_req);
+	if (ctx->gmacaes)
+		crypto_free_aead(ctx->gmacaes);
+	kfree(ctx);
 }
 
-static int crypto_sha512_alloc(struct cifsd_tcp_conn *conn)
+static struct cifsd_sign_ctx *cifsd_alloc_sign_ctx(int cpu)
 {
-	int rc;
-	unsigned int size;
+	struct cifsd_sign_ctx *ctx;
 
-	/* check if already allocated */
-	if (conn->secmech.sdescsha512)
-		return 0;
+	ctx = kzalloc_node(sizeof(*ctx), GFP_KERNEL, cpu_to_node(cpu));
+	if (!ctx)
+		return NULL;
 
-	cifsd_debug("Inside crypto_sha512_alloc\n");
-	conn->secmech.sha512 = crypto_alloc_shash("sha512", 0, 0);
-	if (IS_ERR(conn->secmech.sha512)) {
-		cifsd_debug("could not allocate crypto sha512\n");
-		rc = PTR_ERR(conn->secmech.sha512);
-		conn->secmech.sha512 = NULL;
-		return rc;
+	mutex_init(&ctx->lock);
+	ctx->hmacsha256 = cifsd_alloc_sdesc("hmac(sha256)");
+	ctx->cmacaes = cifsd_alloc_sdesc("cmac(aes)");
+	ctx->sha512 = cifsd_alloc_sdesc("sha512");
+	if (!ctx->hmacsha256 || !ctx->cmacaes || !ctx->sha512) {
+		cifsd_free_sign_ctx(ctx);
+		return NULL;
 	}
 
-	size = sizeof(struct shash_desc) +
-		crypto_shash_descsize(conn->secmech.sha512);
-	conn->secmech.sdescsha512 = kmalloc(size, GFP_KERNEL);
-	if (!conn->secmech.sdescsha512) {
-		free_sha512(conn);
+	/* GMAC is computed synchronously, on the worker */
+	ctx->gmacaes = crypto_alloc_aead("gcm(aes)", 0, CRYPTO_ALG_ASYNC);
+	if (IS_ERR(ctx->gmacaes)) {
+		ctx->gmacaes = NULL;
+		return ctx;
+	}
+	ctx->gmac_req = aead_request_alloc(ctx->gmacaes, GFP_KERNEL);
+	if (!ctx->gmac_req ||
+	    crypto_aead_setauthsize(ctx->gmacaes, SMB2_SIGNATURE_SIZE)) {
+		if (ctx->gmac_req)
+			aead_request_free(ctx->gmac_req);
+		ctx->gmac_req = NULL;
+		crypto_free_aead(ctx->gmacaes);
+		ctx->gmacaes = NULL;
+	}
+	return ctx;
+}
+
+static void cifsd_sign_ctxs_destroy(void)
+{
+	int cpu;
+
+	if (!sign_ctxs)
+		return;
+	for_each_possible_cpu(cpu)
+		cifsd_free_sign_ctx(sign_ctxs[cpu]);
+	kfree(sign_ctxs);
+	sign_ctxs = NULL;
+}
+
+static int cifsd_sign_ctxs_init(void)
+{
+	int cpu;
+
+	sign_ctxs = kcalloc(nr_cpu_ids, sizeof(*sign_ctxs), GFP_KERNEL);
+	if (!sign_ctxs)
 		return -ENOMEM;
+
+	sign_gmac_available = true;
+	for_each_possible_cpu(cpu) {
+		sign_ctxs[cpu] = cifsd_alloc_sign_ctx(cpu);
+		if (!sign_ctxs[cpu]) {
+			cifsd_sign_ctxs_destroy();
+			return -ENOMEM;
+		}
+		if (!sign_ctxs[cpu]->gmacaes)
+			sign_gmac_available = false;
 	}
-	conn->secmech.sdescsha512->shash.tfm = conn->secmech.sha512;
-	conn->secmech.sdescsha512->shash.flags = 0x0;
 
+	if (!sign_gmac_available)
+		cifsd_debug("gcm(aes) not available, no AES-GMAC signing\n");
 	return 0;
 }
 
+static struct cifsd_sign_ctx *cifsd_get_sign_ctx(void)
+{
+	struct cifsd_sign_ctx *ctx = sign_ctxs[raw_smp_processor_id()];
+
+	mutex_lock(&ctx->lock);
+	return ctx;
+}
+
+static void cifsd_put_sign_ctx(struct cifsd_sign_ctx *ctx)
+{
+	mutex_unlock(&ctx->lock);
+}
+
 /**
- * cifsd_sign_smb2_pdu() - function to generate packet signing
- * @conn:	connection
- * @key:	signing key
- * @iov:        buffer iov array
- * @n_vec:	number of iovecs
- * @sig:	signature value generated for client request packet
+ * cifsd_sign_gmac_available() - check if AES-GMAC signing can be offered
  *
+ * Return:	true if every CPU has an AES-GMAC signing context
  */
-int cifsd_sign_smb2_pdu(struct cifsd_tcp_conn *conn,
-			char *key,
-			struct kvec *iov,
-			int n_vec,
-			char *sig)
+bool cifsd_sign_gmac_available(void)
+{
+	return sign_gmac_available;
+}
+
+static int cifsd_shash_sign(struct sdesc *sdesc,
+			    char *key,
+			    unsigned int key_size,
+			    struct kvec *iov,
+			    int n_vec,
+			    char *sig)
 {
 	int rc;
 	int i;
 
-	rc = crypto_hmacsha256_alloc(conn);
+	rc = crypto_shash_setkey(sdesc->shash.tfm, key, key_size);
 	if (rc) {
-		cifsd_debug("could not crypto alloc hmacmd5 rc %d\n", rc);
-		goto out;
-	}
-
-	rc = crypto_shash_setkey(conn->secmech.hmacsha256, key,
-		SMB2_NTLMV2_SESSKEY_SIZE);
-	if (rc) {
-		cifsd_debug("hmacsha256 update error %d\n", rc);
-		goto out;
+		cifsd_debug("setkey error %d\n", rc);
+		return rc;
 	}
 
-	rc = crypto_shash_init(&conn->secmech.sdeschmacsha256->shash);
+	rc = crypto_shash_init(&sdesc->shash);
 	if (rc) {
-		cifsd_debug("hmacsha256 init error %d\n", rc);
-		goto out;
+		cifsd_debug("init error %d\n", rc);
+		return rc;
 	}
 
 	for (i = 0; i < n_vec; i++) {
-		rc = crypto_shash_update(
-				&conn->secmech.sdeschmacsha256->shash,
+		rc = crypto_shash_update(&sdesc->shash,
 				iov[i].iov_base, iov[i].iov_len);
 		if (rc) {
-			cifsd_debug("hmacsha256 update error %d\n", rc);
-			goto out;
+			cifsd_debug("update error %d\n", rc);
+			return rc;
 		}
 	}
 
-	rc = crypto_shash_final(&conn->secmech.sdeschmacsha256->shash,
-		sig);
+	rc = crypto_shash_final(&sdesc->shash, sig);
 	if (rc)
-		cifsd_debug("hmacsha256 generation error %d\n", rc);
+		cifsd_debug("generation error %d\n", rc);
+	return rc;
+}
 
-out:
+/* A signed message is the header and at most the read data */
+#define CIFSD_SIGN_MAX_VEC	2
+
+/*
+ * AES-GMAC is AES-GCM over no plaintext, with the whole message as
+ * associated data. The nonce is the MessageId, followed by the direction
+ * of the message and whether it is a CANCEL request.
+ */
+static int cifsd_gmac_sign(struct cifsd_sign_ctx *ctx,
+			   char *key,
+			   struct kvec *iov,
+			   int n_vec,
+			   char *sig)
+{
+	struct smb2_hdr *hdr = container_of((__le32 *)iov[0].iov_base,
+					    struct smb2_hdr, ProtocolId);
+	struct aead_request *req = ctx->gmac_req;
+	struct scatterlist sg[CIFSD_SIGN_MAX_VEC + 1];
+	u8 iv[SMB3_AES128GCM_NONCE];
+	unsigned int assoc_len = 0;
+	__le32 role = 0;
+	int rc, i;
+
+	if (n_vec > CIFSD_SIGN_MAX_VEC)
+		return -EINVAL;
+
+	rc = crypto_aead_setkey(ctx->gmacaes, key, SMB3_SIGN_KEY_SIZE);
+	if (rc) {
+		cifsd_debug("gmac setkey error %d\n", rc);
+		return rc;
+	}
+
+	memcpy(iv, &hdr->MessageId, sizeof(hdr->MessageId));
+	if (hdr->Flags & SMB2_FLAGS_SERVER_TO_REDIR)
+		role |= cpu_to_le32(1);
+	if (hdr->Command == SMB2_CANCEL)
+		role |= cpu_to_le32(2);
+	memcpy(iv + sizeof(hdr->MessageId), &role, sizeof(role));
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 2, 0)
+	sg_init_table(sg, n_vec);
+	for (i = 0; i < n_vec; i++) {
+		sg_set_buf(&sg[i], iov[i].iov_base, iov[i].iov_len);
+		assoc_len += iov[i].iov_len;
+	}
+	sg_init_one(&sg[n_vec], ctx->tag, SMB2_SIGNATURE_SIZE);
+	aead_request_set_assoc(req, sg, assoc_len);
+	aead_request_set_crypt(req, &sg[n_vec], &sg[n_vec], 0, iv);
+#else
+	sg_init_table(sg, n_vec + 1);
+	for (i = 0; i < n_vec; i++) {
+		sg_set_buf(&sg[i], iov[i].iov_base, iov[i].iov_len);
+		assoc_len += iov[i].iov_len;
+	}
+	sg_set_buf(&sg[n_vec], ctx->tag, SMB2_SIGNATURE_SIZE);
+	aead_request_set_crypt(req, sg, sg, 0, iv);
+	aead_request_set_ad(req, assoc_len);
+#endif
+	aead_request_set_callback(req, 0, NULL, NULL);
+
+	rc = crypto_aead_encrypt(req);
+	if (rc) {
+		cifsd_debug("gmac generation error %d\n", rc);
+		return rc;
+	}
+
+	memcpy(sig, ctx->tag, SMB2_SIGNATURE_SIZE);
+	return 0;
+}
+
+/**
+ * cifsd_sign_smb2_pdu() - function to generate packet signing
+ * @conn:	connection
+ * @key:	signing key
+ * @iov:        buffer iov array
+ * @n_vec:	number of iovecs
+ * @sig:	signature value generated for client request packet
+ *
+ */
+int cifsd_sign_smb2_pdu(struct cifsd_tcp_conn *conn,
+			char *key,
+			struct kvec *iov,
+			int n_vec,
+			char *sig)
+{
+	struct cifsd_sign_ctx *ctx = cifsd_get_sign_ctx();
+	int rc;
+
+	rc = cifsd_shash_sign(ctx->hmacsha256, key, SMB2_NTLMV2_SESSKEY_SIZE,
+			      iov, n_vec, sig);
+	cifsd_put_sign_ctx(ctx);
 	return rc;
 }
 
@@ -850,6 +1022,8 @@ out:
  * @n_vec:	number of iovecs
  * @sig:	signature value generated for client request packet
  *
+ * Uses the signing algorithm negotiated by the connection, AES-CMAC
+ * unless SMB 3.1.1 negotiated another one.
  */
 int cifsd_sign_smb3_pdu(struct cifsd_tcp_conn *conn,
 			char *key,
@@ -857,38 +1031,19 @@ int cifsd_sign_smb3_pdu(struct cifsd_tcp_conn *conn,
 			int n_vec,
 			char *sig)
 {
+	struct cifsd_sign_ctx *ctx;
 	int rc;
-	int i;
 
-	rc = crypto_shash_setkey(conn->secmech.cmacaes, key,
-		SMB2_CMACAES_SIZE);
-	if (rc) {
-		cifsd_debug("cmaces update error %d\n", rc);
-		goto out;
-	}
-
-	rc = crypto_shash_init(&conn->secmech.sdesccmacaes->shash);
-	if (rc) {
-		cifsd_debug("cmaces init error %d\n", rc);
-		goto out;
-	}
-
-	for (i = 0; i < n_vec; i++) {
-		rc = crypto_shash_update(
-				&conn->secmech.sdesccmacaes->shash,
-				iov[i].iov_base, iov[i].iov_len);
-		if (rc) {
-			cifsd_debug("cmaces update error %d\n", rc);
-			goto out;
-		}
-	}
-
-	rc = crypto_shash_final(&conn->secmech.sdesccmacaes->shash,
-		sig);
-	if (rc)
-		cifsd_debug("cmaces generation error %d\n", rc);
+	if (conn->signing_algorithm == SIGNING_ALG_HMAC_SHA256)
+		return cifsd_sign_smb2_pdu(conn, key, iov, n_vec, sig);
 
-out:
+	ctx = cifsd_get_sign_ctx();
+	if (conn->signing_algorithm == SIGNING_ALG_AES_GMAC)
+		rc = cifsd_gmac_sign(ctx, key, iov, n_vec, sig);
+	else
+		rc = cifsd_shash_sign(ctx->cmacaes, key, SMB2_CMACAES_SIZE,
+				      iov, n_vec, sig);
+	cifsd_put_sign_ctx(ctx);
 	return rc;
 }
 
@@ -898,12 +1053,13 @@ struct derivation {
 	bool binding;
 };
 
-static int generate_key(struct cifsd_session *sess, struct kvec label,
+static int generate_key(struct cifsd_session *sess,
+	struct cifsd_tcp_conn *conn, struct kvec label,
 	struct kvec context, __u8 *key, unsigned int key_size)
 {
 	unsigned char zero = 0x0;
 	__u8 i[4] = {0, 0, 0, 1};
-	__u8 L[4] = {0, 0, 0, 128};
+	__u8 L[4] = {0, 0, (key_size * 8) >> 8, (key_size * 8) & 0xff};
 	int rc = 0;
 	unsigned char prfhash[SMB2_HMACSHA256_SIZE];
 	unsigned char *hashptr = prfhash;
@@ -911,67 +1067,61 @@ static int generate_key(struct cifsd_session *sess, struct kvec label,
 	memset(prfhash, 0x0, SMB2_HMACSHA256_SIZE);
 	memset(key, 0x0, key_size);
 
-	rc = crypto_hmacsha256_alloc(sess->conn);
+	rc = crypto_hmacsha256_alloc(conn);
 	if (rc) {
 		cifsd_debug("could not crypto alloc hmacmd5 rc %d\n", rc);
 		goto smb3signkey_ret;
 	}
 
-	rc = crypto_cmac_alloc(sess->conn);
-	if (rc) {
-		cifsd_debug("could not crypto alloc cmac rc %d\n", rc);
-		goto smb3signkey_ret;
-	}
-
-	rc = crypto_shash_setkey(sess->conn->secmech.hmacsha256,
+	rc = crypto_shash_setkey(conn->secmech.hmacsha256,
 			sess->sess_key, SMB2_NTLMV2_SESSKEY_SIZE);
 	if (rc) {
 		cifsd_debug("could not set with session key\n");
 		goto smb3signkey_ret;
 	}
 
-	rc = crypto_shash_init(&sess->conn->secmech.sdeschmacsha256->shash);
+	rc = crypto_shash_init(&conn->secmech.sdeschmacsha256->shash);
 	if (rc) {
 		cifsd_debug("could not init sign hmac\n");
 		goto smb3signkey_ret;
 	}
 
-	rc = crypto_shash_update(&sess->conn->secmech.sdeschmacsha256->shash,
+	rc = crypto_shash_update(&conn->secmech.sdeschmacsha256->shash,
 			i, 4);
 	if (rc) {
 		cifsd_debug("could not update with n\n");
 		goto smb3signkey_ret;
 	}
 
-	rc = crypto_shash_update(&sess->conn->secmech.sdeschmacsha256->shash,
+	rc = crypto_shash_update(&conn->secmech.sdeschmacsha256->shash,
 			label.iov_base, label.iov_len);
 	if (rc) {
 		cifsd_debug("could not update with label\n");
 		goto smb3signkey_ret;
 	}
 
-	rc = crypto_shash_update(&sess->conn->secmech.sdeschmacsha256->shash,
+	rc = crypto_shash_update(&conn->secmech.sdeschmacsha256->shash,
 			&zero, 1);
 	if (rc) {
 		cifsd_debug("could not update with zero\n");
 		goto smb3signkey_ret;
 	}
 
-	rc = crypto_shash_update(&sess->conn->secmech.sdeschmacsha256->shash,
+	rc = crypto_shash_update(&conn->secmech.sdeschmacsha256->shash,
 			context.iov_base, context.iov_len);
 	if (rc) {
 		cifsd_debug("could not update with context\n");
 		goto smb3signkey_ret;
 	}
 
-	rc = crypto_shash_update(&sess->conn->secmech.sdeschmacsha256->shash,
+	rc = crypto_shash_update(&conn->secmech.sdeschmacsha256->shash,
 			L, 4);
 	if (rc) {
 		cifsd_debug("could not update with L\n");
 		goto smb3signkey_ret;
 	}
 
-	rc = crypto_shash_final(&sess->conn->secmech.sdeschmacsha256->shash,
+	rc = crypto_shash_final(&conn->secmech.sdeschmacsha256->shash,
 			hashptr);
 	if (rc) {
 		cifsd_debug("Could not generate hmacmd5 hash error %d\n", rc);
@@ -985,27 +1135,28 @@ smb3signkey_ret:
 }
 
 static int generate_smb3signingkey(struct cifsd_session *sess,
-	const struct derivation *signing)
+	struct cifsd_tcp_conn *conn, const struct derivation *signing)
 {
 	int rc;
 	struct channel *chann;
 	char *key;
 
-	chann = lookup_chann_list(sess);
+	chann = lookup_chann_list(sess, conn);
 	if (!chann)
 		return 0;
 
-	if (sess->conn->dialect >= SMB30_PROT_ID && signing->binding)
+	/* A bound channel signs with its own key, the session key stays */
+	if (conn->dialect >= SMB30_PROT_ID && signing->binding)
 		key = chann->smb3signingkey;
 	else
 		key = sess->smb3signingkey;
 
-	rc = generate_key(sess, signing->label, signing->context, key,
+	rc = generate_key(sess, conn, signing->label, signing->context, key,
 		SMB3_SIGN_KEY_SIZE);
 	if (rc)
 		return rc;
 
-	if (!(sess->conn->dialect >= SMB30_PROT_ID && signing->binding))
+	if (!(conn->dialect >= SMB30_PROT_ID && signing->binding))
 		memcpy(chann->smb3signingkey, key, SMB3_SIGN_KEY_SIZE);
 
 	cifsd_debug("%s: dumping generated AES signing keys\n", __func__);
@@ -1023,6 +1174,7 @@ static int generate_smb3signingkey(struct cifsd_session *sess,
 }
 
 int cifsd_gen_smb30_signingkey(struct cifsd_session *sess,
+			       struct cifsd_tcp_conn *conn,
 			       bool binding,
 			       char *hash_value)
 {
@@ -1034,10 +1186,11 @@ int cifsd_gen_smb30_signingkey(struct cifsd_session *sess,
 	d.context.iov_len = 8;
 	d.binding = binding;
 
-	return generate_smb3signingkey(sess, &d);
+	return generate_smb3signingkey(sess, conn, &d);
 }
 
 int cifsd_gen_smb311_signingkey(struct cifsd_session *sess,
+				struct cifsd_tcp_conn *conn,
 				bool binding,
 				char *hash_value)
 {
@@ -1052,7 +1205,7 @@ int cifsd_gen_smb311_signingkey(struct cifsd_session *sess,
 	d.context.iov_len = 64;
 	d.binding = binding;
 
-	return generate_smb3signingkey(sess, &d);
+	return generate_smb3signingkey(sess, conn, &d);
 }
 
 struct derivation_twin {
@@ -1060,20 +1213,310 @@ struct derivation_twin {
 	struct derivation decryption;
 };
 
+/*
+ * The state, request, IV and scatterlist of a message are carved from one
+ * mempool element, sized at module init for the ccm(aes) and gcm(aes)
+ * implementations then available. Transforms with a larger request
+ * context fall back to kmalloc.
+ */
+#define CIFSD_CRYPT_MAX_SG	8
+#define CIFSD_CRYPT_POOL_MIN	16
+
+struct cifsd_crypt_ctx {
+	struct smb2_transform_hdr	*tr_hdr;
+	/* references on the session and its transform, until it is done */
+	struct cifsd_session		*sess;
+	struct cifsd_aead		*aead;
+	int				enc;
+	bool				pooled;
+	/* asynchronous completion, or NULL to wait for the transform */
+	void				(*complete)(void *data, int err);
+	void				*data;
+	struct completion		done;
+	int				err;
+	u8				sign[SMB2_SIGNATURE_SIZE];
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 2, 0)
+	struct scatterlist		assoc;
+#endif
+};
+
+static mempool_t *crypt_req_pool;
+static unsigned int crypt_req_size;
+
+static inline unsigned int cifsd_crypt_req_size(struct crypto_aead *tfm,
+						unsigned int nr_sg)
+{
+	return ALIGN(sizeof(struct cifsd_crypt_ctx), CRYPTO_MINALIGN) +
+	       ALIGN(sizeof(struct aead_request) + crypto_aead_reqsize(tfm),
+		     CRYPTO_MINALIGN) +
+	       ALIGN(crypto_aead_ivsize(tfm), CRYPTO_MINALIGN) +
+	       nr_sg * sizeof(struct scatterlist);
+}
+
+static struct cifsd_crypt_ctx *cifsd_crypt_req_alloc(struct crypto_aead *tfm,
+						     unsigned int nr_sg,
+						     struct aead_request **req,
+						     char **iv,
+						     struct scatterlist **sg)
+{
+	unsigned int size = cifsd_crypt_req_size(tfm, nr_sg);
+	struct cifsd_crypt_ctx *ctx;
+	bool pooled = crypt_req_pool && size <= crypt_req_size;
+	char *p;
+
+	if (pooled)
+		p = mempool_alloc(crypt_req_pool, GFP_KERNEL);
+	else
+		p = kmalloc(size, GFP_KERNEL);
+	if (!p)
+		return NULL;
+
+	ctx = (struct cifsd_crypt_ctx *)p;
+	memset(ctx, 0, sizeof(*ctx));
+	ctx->pooled = pooled;
+	p += ALIGN(sizeof(struct cifsd_crypt_ctx), CRYPTO_MINALIGN);
+	*req = (struct aead_request *)p;
+	aead_request_set_tfm(*req, tfm);
+	p += ALIGN(sizeof(struct aead_request) + crypto_aead_reqsize(tfm),
+		   CRYPTO_MINALIGN);
+	*iv = p;
+	memset(*iv, 0, crypto_aead_ivsize(tfm));
+	p += ALIGN(crypto_aead_ivsize(tfm), CRYPTO_MINALIGN);
+	*sg = (struct scatterlist *)p;
+	return ctx;
+}
+
+static void cifsd_aead_put(struct cifsd_aead *aead);
+
+static void cifsd_crypt_req_free(struct cifsd_crypt_ctx *ctx)
+{
+	cifsd_aead_put(ctx->aead);
+	if (ctx->sess)
+		cifsd_session_put(ctx->sess);
+	if (ctx->pooled)
+		mempool_free(ctx, crypt_req_pool);
+	else
+		kfree(ctx);
+}
+
+static inline bool cifsd_cipher_gcm(__le16 cipher)
+{
+	return cipher == SMB2_ENCRYPTION_AES128_GCM ||
+		cipher == SMB2_ENCRYPTION_AES256_GCM;
+}
+
+/* AEAD implementations found by cifsd_crypto_init() */
+static bool crypt_ccm_available, crypt_gcm_available;
+
+/**
+ * cifsd_cipher_available() - check if a cipher can be negotiated
+ * @cipher:	SMB2_ENCRYPTION_* cipher id
+ *
+ * Return:	true if the AEAD transform of @cipher could be allocated
+ */
+bool cifsd_cipher_available(__le16 cipher)
+{
+	return cifsd_cipher_gcm(cipher) ? crypt_gcm_available :
+					  crypt_ccm_available;
+}
+
+/* SMB 3.0 and 3.0.2 have no cipher negotiation and use AES-128-CCM */
+static inline unsigned int cifsd_cipher_key_size(__le16 cipher)
+{
+	if (cipher == SMB2_ENCRYPTION_AES256_CCM ||
+	    cipher == SMB2_ENCRYPTION_AES256_GCM)
+		return SMB3_ENC_KEY_SIZE_MAX;
+	return SMB3_SIGN_KEY_SIZE;
+}
+
+/*
+ * A keyed SMB3 transform of a session. New keys get new transforms, so a
+ * message keeps the transform it started with while the keys change.
+ */
+struct cifsd_aead {
+	struct crypto_aead	*tfm;
+	__le16			cipher;
+	atomic_t		refcnt;
+	struct llist_node	free_node;
+};
+
+/* Transforms whose last reference was dropped by a completion */
+static LLIST_HEAD(aead_free_list);
+
+static void cifsd_aead_free(struct cifsd_aead *aead)
+{
+	crypto_free_aead(aead->tfm);
+	kfree(aead);
+}
+
+static void cifsd_aead_free_work_fn(struct work_struct *wk)
+{
+	struct llist_node *list = llist_del_all(&aead_free_list);
+	struct cifsd_aead *aead, *tmp;
+
+	llist_for_each_entry_safe(aead, tmp, list, free_node)
+		cifsd_aead_free(aead);
+}
+
+static DECLARE_WORK(aead_free_work, cifsd_aead_free_work_fn);
+
+static void cifsd_aead_put(struct cifsd_aead *aead)
+{
+	if (!aead || !atomic_dec_and_test(&aead->refcnt))
+		return;
+
+	/* freeing a transform may sleep */
+	if (in_interrupt()) {
+		llist_add(&aead->free_node, &aead_free_list);
+		schedule_work(&aead_free_work);
+		return;
+	}
+	cifsd_aead_free(aead);
+}
+
+static struct cifsd_aead *cifsd_aead_alloc(__le16 cipher, u8 *key)
+{
+	struct cifsd_aead *aead;
+	int rc;
+
+	aead = kzalloc(sizeof(struct cifsd_aead), GFP_KERNEL);
+	if (!aead)
+		return ERR_PTR(-ENOMEM);
+
+	aead->tfm = crypto_alloc_aead(cifsd_cipher_gcm(cipher) ?
+				      "gcm(aes)" : "ccm(aes)", 0, 0);
+	if (IS_ERR(aead->tfm)) {
+		rc = PTR_ERR(aead->tfm);
+		cifsd_err("Failed to alloc aead\n");
+		kfree(aead);
+		return ERR_PTR(rc);
+	}
+	aead->cipher = cipher;
+	atomic_set(&aead->refcnt, 1);
+
+	rc = crypto_aead_setkey(aead->tfm, key, cifsd_cipher_key_size(cipher));
+	if (rc) {
+		cifsd_err("Failed to set aead key %d\n", rc);
+		goto err;
+	}
+
+	rc = crypto_aead_setauthsize(aead->tfm, SMB2_SIGNATURE_SIZE);
+	if (rc) {
+		cifsd_err("Failed to set authsize %d\n", rc);
+		goto err;
+	}
+	return aead;
+err:
+	cifsd_aead_free(aead);
+	return ERR_PTR(rc);
+}
+
+/* Get the encryption or decryption transform of @sess, with a reference */
+static struct cifsd_aead *cifsd_session_get_aead(struct cifsd_session *sess,
+						 int enc)
+{
+	struct cifsd_aead *aead;
+
+	spin_lock(&sess->aead_lock);
+	aead = enc ? sess->enc_aead : sess->dec_aead;
+	if (aead)
+		atomic_inc(&aead->refcnt);
+	spin_unlock(&sess->aead_lock);
+	return aead;
+}
+
+/* Replace the transforms of @sess, messages in flight drop the old ones */
+static void cifsd_session_set_aead(struct cifsd_session *sess,
+				   struct cifsd_aead *enc,
+				   struct cifsd_aead *dec)
+{
+	spin_lock(&sess->aead_lock);
+	swap(sess->enc_aead, enc);
+	swap(sess->dec_aead, dec);
+	spin_unlock(&sess->aead_lock);
+
+	cifsd_aead_put(enc);
+	cifsd_aead_put(dec);
+}
+
+/**
+ * cifsd_session_free_aead() - free the SMB3 transforms of a session
+ * @sess:	session
+ */
+void cifsd_session_free_aead(struct cifsd_session *sess)
+{
+	cifsd_session_set_aead(sess, NULL, NULL);
+}
+
+void cifsd_crypto_destroy(void)
+{
+	flush_work(&aead_free_work);
+	cifsd_sign_ctxs_destroy();
+	mempool_destroy(crypt_req_pool);
+	crypt_req_pool = NULL;
+}
+
+int cifsd_crypto_init(void)
+{
+	static const char * const algs[] = { "ccm(aes)", "gcm(aes)" };
+	struct crypto_aead *tfm;
+	int i, rc;
+
+	rc = cifsd_sign_ctxs_init();
+	if (rc)
+		return rc;
+
+	crypt_req_size = 0;
+	crypt_ccm_available = false;
+	crypt_gcm_available = false;
+	for (i = 0; i < ARRAY_SIZE(algs); i++) {
+		tfm = crypto_alloc_aead(algs[i], 0, 0);
+		if (IS_ERR(tfm)) {
+			/* the ciphers using it aren't negotiated */
+			cifsd_debug("%s not available: %ld\n", algs[i],
+				    PTR_ERR(tfm));
+			continue;
+		}
+
+		if (i)
+			crypt_gcm_available = true;
+		else
+			crypt_ccm_available = true;
+
+		crypt_req_size = max(crypt_req_size,
+			cifsd_crypt_req_size(tfm, CIFSD_CRYPT_MAX_SG));
+		crypto_free_aead(tfm);
+	}
+
+	if (!crypt_req_size)
+		return 0;
+
+	crypt_req_pool = mempool_create_kmalloc_pool(CIFSD_CRYPT_POOL_MIN,
+						     crypt_req_size);
+	if (!crypt_req_pool) {
+		cifsd_sign_ctxs_destroy();
+		return -ENOMEM;
+	}
+	return 0;
+}
+
 static int generate_smb3encryptionkey(struct cifsd_session *sess,
 	const struct derivation_twin *ptwin)
 {
+	__le16 cipher = sess->conn->cipher_type;
+	unsigned int key_size = cifsd_cipher_key_size(cipher);
+	struct cifsd_aead *enc, *dec;
 	int rc;
 
-	rc = generate_key(sess, ptwin->encryption.label,
+	rc = generate_key(sess, sess->conn, ptwin->encryption.label,
 			ptwin->encryption.context, sess->smb3encryptionkey,
-			SMB3_SIGN_KEY_SIZE);
+			key_size);
 	if (rc)
 		return rc;
 
-	rc = generate_key(sess, ptwin->decryption.label,
+	rc = generate_key(sess, sess->conn, ptwin->decryption.label,
 			ptwin->decryption.context,
-			sess->smb3decryptionkey, SMB3_SIGN_KEY_SIZE);
+			sess->smb3decryptionkey, key_size);
 	if (rc)
 		return rc;
 
@@ -1087,10 +1530,31 @@ static int generate_smb3encryptionkey(struct cifsd_session *sess,
 	cifsd_debug("Session Key   %*ph\n",
 			SMB2_NTLMV2_SESSKEY_SIZE, sess->sess_key);
 	cifsd_debug("ServerIn Key  %*ph\n",
-			SMB3_SIGN_KEY_SIZE, sess->smb3encryptionkey);
+			key_size, sess->smb3encryptionkey);
 	cifsd_debug("ServerOut Key %*ph\n",
-			SMB3_SIGN_KEY_SIZE, sess->smb3decryptionkey);
-	return rc;
+			key_size, sess->smb3decryptionkey);
+
+	/*
+	 * Key new transforms here rather than the ones other workers may be
+	 * encrypting or decrypting with, cifsd_crypt_message() uses them
+	 * without changing their state.
+	 */
+	sess->cipher_type = cipher;
+	enc = cifsd_aead_alloc(cipher, sess->smb3encryptionkey);
+	if (IS_ERR(enc)) {
+		cifsd_session_free_aead(sess);
+		return PTR_ERR(enc);
+	}
+
+	dec = cifsd_aead_alloc(cipher, sess->smb3decryptionkey);
+	if (IS_ERR(dec)) {
+		cifsd_aead_put(enc);
+		cifsd_session_free_aead(sess);
+		return PTR_ERR(dec);
+	}
+
+	cifsd_session_set_aead(sess, enc, dec);
+	return 0;
 }
 
 int cifsd_gen_smb30_encryptionkey(struct cifsd_session *sess)
@@ -1133,243 +1597,221 @@ int cifsd_gen_smb311_encryptionkey(struct cifsd_session *sess)
 	return generate_smb3encryptionkey(sess, &twin);
 }
 
+/**
+ * cifsd_gen_preauth_integrity_hash() - chain a message into a preauth hash
+ * @conn:	connection the message was received or is sent on
+ * @buf:	message, starting with its RFC1002 length
+ * @pi_hash:	preauth integrity hash value, replaced by
+ *		SHA-512(@pi_hash || message)
+ *
+ * Return:	0 on success, otherwise error
+ */
 int cifsd_gen_preauth_integrity_hash(struct cifsd_tcp_conn *conn,
 				     char *buf,
 				     __u8 *pi_hash)
 {
-	int rc = -1;
-	struct crypto_shash *c_shash;
-	struct sdesc *c_sdesc;
 	struct smb2_hdr *rcv_hdr = (struct smb2_hdr *)buf;
 	char *all_bytes_msg = (char *)&rcv_hdr->ProtocolId;
 	int msg_size = be32_to_cpu(rcv_hdr->smb2_buf_length);
+	struct cifsd_sign_ctx *ctx;
+	struct shash_desc *desc;
+	int rc;
 
-	if (conn->preauth_info->Preauth_HashId ==
-		SMB2_PREAUTH_INTEGRITY_SHA512) {
-		rc = crypto_sha512_alloc(conn);
-		if (rc) {
-			cifsd_debug("could not alloc sha512 rc %d\n", rc);
-			goto out;
-		}
-
-		c_shash = conn->secmech.sha512;
-		c_sdesc = conn->secmech.sdescsha512;
-	} else
-		goto out;
-
-	rc = crypto_shash_init(&c_sdesc->shash);
-	if (rc) {
-		cifsd_debug("could not init shashn");
-		goto out;
-	}
-
-	rc = crypto_shash_update(&c_sdesc->shash,
-				pi_hash, 64);
-	if (rc) {
-		cifsd_debug("could not update with n\n");
-		goto out;
-	}
-
-	rc = crypto_shash_update(&c_sdesc->shash, all_bytes_msg, msg_size);
-	if (rc) {
-		cifsd_debug("could not update with n\n");
-		goto out;
-	}
+	if (conn->preauth_info->Preauth_HashId !=
+		SMB2_PREAUTH_INTEGRITY_SHA512)
+		return -EINVAL;
 
-	rc = crypto_shash_final(&c_sdesc->shash, pi_hash);
-	if (rc) {
+	ctx = cifsd_get_sign_ctx();
+	desc = &ctx->sha512->shash;
+	rc = crypto_shash_init(desc);
+	if (!rc)
+		rc = crypto_shash_update(desc, pi_hash,
+					 PREAUTH_HASHVALUE_SIZE);
+	if (!rc)
+		rc = crypto_shash_update(desc, all_bytes_msg, msg_size);
+	if (!rc)
+		rc = crypto_shash_final(desc, pi_hash);
+	cifsd_put_sign_ctx(ctx);
+	if (rc)
 		cifsd_debug("Could not generate hash err : %d\n", rc);
-		goto out;
-	}
-out:
 	return rc;
 }
 
-static int cifsd_alloc_aead(struct cifsd_tcp_conn *conn)
-{
-	struct crypto_aead *tfm;
-
-	if (!conn->secmech.ccmaesencrypt) {
-		tfm = crypto_alloc_aead("ccm(aes)", 0, 0);
-		if (IS_ERR(tfm)) {
-			cifsd_err("Failed to alloc encrypt aead\n");
-			return PTR_ERR(tfm);
-		}
-		conn->secmech.ccmaesencrypt = tfm;
-	}
-
-	if (!conn->secmech.ccmaesdecrypt) {
-		tfm = crypto_alloc_aead("ccm(aes)", 0, 0);
-		if (IS_ERR(tfm)) {
-			cifsd_err("Failed to alloc decrypt aead\n");
-			free_ccmaes(conn);
-			return PTR_ERR(tfm);
-		}
-		conn->secmech.ccmaesdecrypt = tfm;
-	}
-
-	return 0;
-}
-
-static int cifsd_get_encryption_key(struct cifsd_tcp_conn *conn,
-				    __u64 ses_id,
-				    int enc,
-				    u8 *key)
-{
-	struct cifsd_session *sess;
-	u8 *ses_enc_key;
-
-	sess = cifsd_session_lookup(conn, ses_id);
-	if (!sess)
-		return 1;
-
-	ses_enc_key = enc ? sess->smb3encryptionkey :
-		sess->smb3decryptionkey;
-	memcpy(key, ses_enc_key, SMB3_SIGN_KEY_SIZE);
-
-	return 0;
-}
-
 #if LINUX_VERSION_CODE < KERNEL_VERSION(4, 2, 0)
-static struct scatterlist *cifsd_init_sg(struct kvec *iov,
-					 unsigned int nvec,
-					 u8 *sign)
+#define CIFSD_CRYPT_NR_SG(nvec)	(nvec)
+
+static void cifsd_init_sg(struct scatterlist *sg,
+			  struct kvec *iov,
+			  unsigned int nvec,
+			  u8 *sign)
 {
-	struct scatterlist *sg;
 	unsigned int i = 0;
 
-	sg = kmalloc_array(nvec, sizeof(struct scatterlist), GFP_KERNEL);
-	if (!sg)
-		return NULL;
-
 	sg_init_table(sg, nvec);
 	for (i = 0; i < nvec - 1; i++)
 		sg_set_buf(&sg[i], iov[i + 1].iov_base, iov[i + 1].iov_len);
 	sg_set_buf(&sg[nvec - 1], sign, SMB2_SIGNATURE_SIZE);
-	return sg;
 }
 #else
-static struct scatterlist *cifsd_init_sg(struct kvec *iov,
-					 unsigned int nvec,
-					 u8 *sign)
+#define CIFSD_CRYPT_NR_SG(nvec)	((nvec) + 1)
+
+static void cifsd_init_sg(struct scatterlist *sg,
+			  struct kvec *iov,
+			  unsigned int nvec,
+			  u8 *sign)
 {
-	struct scatterlist *sg;
 	unsigned int i = 0;
 	unsigned int assoc_data_len = sizeof(struct smb2_transform_hdr) - 24;
 
-	sg = kmalloc_array(nvec + 1, sizeof(struct scatterlist), GFP_KERNEL);
-	if (!sg)
-		return NULL;
-
 	sg_init_table(sg, nvec + 1);
 	sg_set_buf(&sg[0], iov[0].iov_base + 24, assoc_data_len);
 	for (i = 1; i < nvec; i++)
 		sg_set_buf(&sg[i], iov[i].iov_base, iov[i].iov_len);
 	sg_set_buf(&sg[nvec], sign, SMB2_SIGNATURE_SIZE);
-	return sg;
 }
 #endif
 
+static int cifsd_crypt_finish(struct cifsd_crypt_ctx *ctx, int rc)
+{
+	if (!rc && ctx->enc)
+		memcpy(&ctx->tr_hdr->Signature, ctx->sign,
+		       SMB2_SIGNATURE_SIZE);
+	cifsd_crypt_req_free(ctx);
+	return rc;
+}
+
+static void cifsd_crypt_done(struct crypto_async_request *areq, int err)
+{
+	struct cifsd_crypt_ctx *ctx = areq->data;
+	void (*done_fn)(void *data, int err) = ctx->complete;
+	void *data = ctx->data;
+
+	/* a backlogged request was started, the result comes later */
+	if (err == -EINPROGRESS)
+		return;
+
+	if (!done_fn) {
+		ctx->err = err;
+		complete(&ctx->done);
+		return;
+	}
+
+	done_fn(data, cifsd_crypt_finish(ctx, err));
+}
+
+/**
+ * cifsd_crypt_message() - encrypt or decrypt an SMB3 message in place
+ * @conn:	connection the message belongs to
+ * @iov:	transform header, followed by the message
+ * @nvec:	number of entries in @iov
+ * @enc:	encrypt if set, otherwise decrypt
+ * @complete:	completion of an asynchronous transform, or NULL
+ * @data:	argument of @complete
+ *
+ * Without @complete, waits for an asynchronous transform to finish.
+ * Otherwise, if the transform goes asynchronous, @complete is called with
+ * its result, possibly from softirq context, and @iov, the buffers it
+ * describes and the transform header must stay until then.
+ *
+ * Return:	0 on success, -EINPROGRESS if @complete will be called,
+ *		otherwise error
+ */
 int cifsd_crypt_message(struct cifsd_tcp_conn *conn,
 			struct kvec *iov,
 			unsigned int nvec,
-			int enc)
+			int enc,
+			void (*complete)(void *data, int err),
+			void *data)
 {
 	struct smb2_transform_hdr *tr_hdr =
 		(struct smb2_transform_hdr *)iov[0].iov_base;
 	unsigned int assoc_data_len = sizeof(struct smb2_transform_hdr) - 24;
+	unsigned int nr_sg = CIFSD_CRYPT_NR_SG(nvec);
 	int rc = 0;
 	struct scatterlist *sg;
-	u8 sign[SMB2_SIGNATURE_SIZE] = {};
-	u8 key[SMB3_SIGN_KEY_SIZE];
+	struct cifsd_crypt_ctx *ctx;
+	struct cifsd_session *sess;
 	struct aead_request *req;
 	char *iv;
-	unsigned int iv_len;
-	struct crypto_aead *tfm;
+	struct cifsd_aead *aead;
 	unsigned int crypt_len = le32_to_cpu(tr_hdr->OriginalMessageSize);
-#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 2, 0)
-	struct scatterlist assoc;
-#endif
 
-	rc = cifsd_get_encryption_key(conn, tr_hdr->SessionId, enc, key);
-	if (rc) {
+	sess = cifsd_session_lookup(conn, le64_to_cpu(tr_hdr->SessionId));
+	if (!sess) {
 		cifsd_err("%s: Could not get %scryption key\n", __func__,
 				enc ? "en" : "de");
 		return 0;
 	}
 
-	rc = cifsd_alloc_aead(conn);
-	if (rc) {
-		cifsd_err("%s: crypto alloc failed\n", __func__);
-		return rc;
-	}
-
-	tfm = enc ? conn->secmech.ccmaesencrypt :
-		conn->secmech.ccmaesdecrypt;
-	rc = crypto_aead_setkey(tfm, key, SMB3_SIGN_KEY_SIZE);
-	if (rc) {
-		cifsd_err("%s: Failed to set aead key %d\n", __func__, rc);
-		return rc;
-	}
-
-	rc = crypto_aead_setauthsize(tfm, SMB2_SIGNATURE_SIZE);
-	if (rc) {
-		cifsd_err("%s: Failed to set authsize %d\n", __func__, rc);
-		return rc;
+	aead = cifsd_session_get_aead(sess, enc);
+	if (!aead) {
+		cifsd_err("%s: session has no %scryption transform\n",
+				__func__, enc ? "en" : "de");
+		cifsd_session_put(sess);
+		return -EINVAL;
 	}
 
-	req = aead_request_alloc(tfm, GFP_KERNEL);
-	if (!req) {
+	ctx = cifsd_crypt_req_alloc(aead->tfm, nr_sg, &req, &iv, &sg);
+	if (!ctx) {
 		cifsd_err("%s: Failed to alloc aead request", __func__);
+		cifsd_aead_put(aead);
+		cifsd_session_put(sess);
 		return -ENOMEM;
 	}
 
+	/*
+	 * The work of an asynchronous transform holds the session too, so
+	 * this isn't the last reference when the completion drops it.
+	 */
+	ctx->sess = sess;
+	ctx->aead = aead;
+	ctx->tr_hdr = tr_hdr;
+	ctx->enc = enc;
+	ctx->complete = complete;
+	ctx->data = data;
+	init_completion(&ctx->done);
+
 	if (!enc) {
-		memcpy(sign, &tr_hdr->Signature, SMB2_SIGNATURE_SIZE);
+		memcpy(ctx->sign, &tr_hdr->Signature, SMB2_SIGNATURE_SIZE);
 		crypt_len += SMB2_SIGNATURE_SIZE;
 	}
 
 #if LINUX_VERSION_CODE < KERNEL_VERSION(4, 2, 0)
-	sg_init_one(&assoc, iov[0].iov_base + 24, assoc_data_len);
+	sg_init_one(&ctx->assoc, iov[0].iov_base + 24, assoc_data_len);
 #endif
 
-	sg = cifsd_init_sg(iov, nvec, sign);
-	if (!sg) {
-		cifsd_err("%s: Failed to init sg", __func__);
-		rc = -ENOMEM;
-		goto free_req;
-	}
+	cifsd_init_sg(sg, iov, nvec, ctx->sign);
 
-	iv_len = crypto_aead_ivsize(tfm);
-	iv = kzalloc(iv_len, GFP_KERNEL);
-	if (!iv) {
-		cifsd_err("%s: Failed to alloc IV", __func__);
-		rc = -ENOMEM;
-		goto free_sg;
+	if (cifsd_cipher_gcm(aead->cipher)) {
+		memcpy(iv, (char *)tr_hdr->Nonce, SMB3_AES128GCM_NONCE);
+	} else {
+		iv[0] = 3;
+		memcpy(iv + 1, (char *)tr_hdr->Nonce, SMB3_AES128CMM_NONCE);
 	}
-	iv[0] = 3;
-	memcpy(iv + 1, (char *)tr_hdr->Nonce, SMB3_AES128CMM_NONCE);
 
 #if LINUX_VERSION_CODE < KERNEL_VERSION(4, 2, 0)
-	aead_request_set_assoc(req, &assoc, assoc_data_len);
+	aead_request_set_assoc(req, &ctx->assoc, assoc_data_len);
 	aead_request_set_crypt(req, sg, sg, crypt_len, iv);
 #else
 	aead_request_set_crypt(req, sg, sg, crypt_len, iv);
 	aead_request_set_ad(req, assoc_data_len);
 #endif
-	aead_request_set_callback(req, CRYPTO_TFM_REQ_MAY_SLEEP, NULL, NULL);
+	aead_request_set_callback(req,
+				  CRYPTO_TFM_REQ_MAY_SLEEP |
+				  CRYPTO_TFM_REQ_MAY_BACKLOG,
+				  cifsd_crypt_done, ctx);
 
 	if (enc)
 		rc = crypto_aead_encrypt(req);
 	else
 		rc = crypto_aead_decrypt(req);
-	if (!rc && enc)
-		memcpy(&tr_hdr->Signature, sign, SMB2_SIGNATURE_SIZE);
-
-	kfree(iv);
-free_sg:
-	kfree(sg);
-free_req:
-	kfree(req);
-	return rc;
+	if (rc == -EINPROGRESS || rc == -EBUSY) {
+		if (complete)
+			return -EINPROGRESS;
+
+		wait_for_completion(&ctx->done);
+		rc = ctx->err;
+	}
+
+	return cifsd_crypt_finish(ctx, rc);
 }
@@ -21,11 +21,20 @@ struct kvec;
 int cifsd_crypt_message(struct cifsd_tcp_conn *conn,
 			struct kvec *iov,
 			unsigned int nvec,
-			int enc);
+			int enc,
+			void (*complete)(void *data, int err),
+			void *data);
 
 void cifsd_copy_gss_neg_header(void *buf);
 
 void cifsd_free_conn_secmech(struct cifsd_tcp_conn *conn);
+unsigned int cifsd_shrink_conn_secmech(struct cifsd_tcp_conn *conn);
+void cifsd_session_free_aead(struct cifsd_session *sess);
+bool cifsd_sign_gmac_available(void);
+bool cifsd_cipher_available(__le16 cipher);
+
+int cifsd_crypto_init(void);
+void cifsd_crypto_destroy(void);
 
 int cifsd_auth_ntlm(struct cifsd_session *sess,
 		    char *pw_buf);
@@ -62,9 +71,11 @@ int cifsd_sign_smb3_pdu(struct cifsd_tcp_conn *conn,
 			char *sig);
 
 int cifsd_gen_smb30_signingkey(struct cifsd_session *sess,
+			       struct cifsd_tcp_conn *conn,
 			       bool binding,
 			       char *hash_value);
 int cifsd_gen_smb311_signingkey(struct cifsd_session *sess,
+				struct cifsd_tcp_conn *conn,
 				bool binding,
 				char *hash_value);
 int cifsd_gen_smb30_encryptionkey(struct cifsd_session *sess);
@@ -6,15 +6,90 @@
 #include <linux/mm.h>
 #include <linux/slab.h>
 #include <linux/vmalloc.h>
+#include <linux/bvec.h>
+#include <linux/percpu.h>
+#include <linux/shrinker.h>
 
 #include "glob.h"
 #include "buffer_pool.h"
 #include "transport_tcp.h"
+#include "smb_common.h"
 #include "mgmt/cifsd_ida.h"
 
 static struct kmem_cache *work_cache;
 static struct kmem_cache *filp_cache;
 
+/*
+ * Request and response buffers are recycled through free lists of a few
+ * size classes. Each buffer is prefixed with a header recording its class,
+ * so the free functions don't need the buffer size, followed by
+ * CIFSD_BUF_HEADROOM bytes the buffer user can prepend to its data.
+ *
+ * The small classes are cached per CPU. The I/O classes are megabytes per
+ * buffer, they share a single list per class capped in bytes instead, so
+ * an idle server doesn't pin them on every CPU.
+ */
+enum {
+	CIFSD_BUF_SMALL,	/* small response */
+	CIFSD_BUF_PAGE,		/* right-sized metadata response */
+	CIFSD_BUF_MSG,		/* max message size, large responses */
+	CIFSD_BUF_IO,		/* default I/O size, read and write data */
+	CIFSD_BUF_LARGE_IO,	/* max I/O size, LargeMTU read and write data */
+	CIFSD_BUF_NR_CLASSES,
+};
+
+#define CIFSD_BUF_NO_CLASS	CIFSD_BUF_NR_CLASSES
+
+struct cifsd_buf_hdr {
+	unsigned int		class;
+} __aligned(16);
+
+#define CIFSD_BUF_OVERHEAD	(sizeof(struct cifsd_buf_hdr) + CIFSD_BUF_HEADROOM)
+
+static inline struct cifsd_buf_hdr *cifsd_buf_hdr(void *ptr)
+{
+	return (struct cifsd_buf_hdr *)(ptr - CIFSD_BUF_OVERHEAD);
+}
+
+static inline void *cifsd_buf_data(struct cifsd_buf_hdr *hdr)
+{
+	return (void *)hdr + CIFSD_BUF_OVERHEAD;
+}
+
+struct cifsd_buf_list {
+	spinlock_t		lock;
+	/*
+	 * free buffers, linked through a list_head in the headroom right
+	 * after their header, see cifsd_buf_get()/cifsd_buf_put()
+	 */
+	struct list_head	bufs;
+	unsigned int		count;
+	unsigned long		hits;
+	unsigned long		misses;
+};
+
+struct cifsd_buf_class {
+	const char			*name;
+	size_t				size;
+	/* limit of cached buffers per list */
+	unsigned int			max_cached;
+	/* a single @global list instead of per-CPU @lists */
+	bool				shared;
+	struct cifsd_buf_list __percpu	*lists;
+	struct cifsd_buf_list		*global;
+};
+
+/* bytes cached in the list of a shared class, at least one buffer */
+#define CIFSD_BUF_SHARED_CACHE	(8 << 20)
+
+static struct cifsd_buf_class buf_classes[CIFSD_BUF_NR_CLASSES] = {
+	[CIFSD_BUF_SMALL]	= { .name = "small",	.max_cached = 64 },
+	[CIFSD_BUF_PAGE]	= { .name = "page",	.max_cached = 32 },
+	[CIFSD_BUF_MSG]		= { .name = "msg",	.max_cached = 16 },
+	[CIFSD_BUF_IO]		= { .name = "io",	.shared = true },
+	[CIFSD_BUF_LARGE_IO]	= { .name = "large_io",	.shared = true },
+};
+
 /*
  * A simple kvmalloc()/kvfree() implemenation.
  */
@@ -54,6 +129,271 @@ static inline void __free(void *addr)
 
 }
 
+static unsigned int cifsd_buf_class_of(size_t size)
+{
+	unsigned int i;
+
+	for (i = 0; i < CIFSD_BUF_NR_CLASSES; i++) {
+		if (size <= buf_classes[i].size)
+			return i;
+	}
+	return CIFSD_BUF_NO_CLASS;
+}
+
+static inline bool cifsd_buf_class_ready(struct cifsd_buf_class *c)
+{
+	return c->shared ? c->global != NULL : c->lists != NULL;
+}
+
+static struct cifsd_buf_list *cifsd_buf_list_get(struct cifsd_buf_class *c)
+{
+	if (c->shared)
+		return c->global;
+	return get_cpu_ptr(c->lists);
+}
+
+static void cifsd_buf_list_put(struct cifsd_buf_class *c)
+{
+	if (!c->shared)
+		put_cpu_ptr(c->lists);
+}
+
+static struct cifsd_buf_hdr *cifsd_buf_get(unsigned int class)
+{
+	struct cifsd_buf_class *c = &buf_classes[class];
+	struct cifsd_buf_list *list;
+	struct cifsd_buf_hdr *hdr = NULL;
+
+	if (!cifsd_buf_class_ready(c))
+		return NULL;
+
+	list = cifsd_buf_list_get(c);
+	spin_lock(&list->lock);
+	if (!list_empty(&list->bufs)) {
+		struct list_head *entry = list->bufs.next;
+
+		list_del(entry);
+		list->count--;
+		list->hits++;
+		hdr = (struct cifsd_buf_hdr *)entry - 1;
+	} else {
+		list->misses++;
+	}
+	spin_unlock(&list->lock);
+	cifsd_buf_list_put(c);
+	return hdr;
+}
+
+static bool cifsd_buf_put(struct cifsd_buf_hdr *hdr)
+{
+	struct cifsd_buf_class *c = &buf_classes[hdr->class];
+	struct cifsd_buf_list *list;
+	bool cached = false;
+
+	if (!cifsd_buf_class_ready(c))
+		return false;
+
+	list = cifsd_buf_list_get(c);
+	spin_lock(&list->lock);
+	if (list->count < c->max_cached) {
+		list_add((struct list_head *)(hdr + 1), &list->bufs);
+		list->count++;
+		cached = true;
+	}
+	spin_unlock(&list->lock);
+	cifsd_buf_list_put(c);
+	return cached;
+}
+
+/*
+ * Only the requested @size is zeroed, the class slack of a recycled
+ * buffer keeps whatever its previous user left there.
+ */
+static void *cifsd_buf_alloc(size_t size, bool zero)
+{
+	unsigned int class = cifsd_buf_class_of(size);
+	struct cifsd_buf_hdr *hdr = NULL;
+	size_t alloc_size = size;
+
+	if (class != CIFSD_BUF_NO_CLASS) {
+		hdr = cifsd_buf_get(class);
+		alloc_size = buf_classes[class].size;
+	}
+
+	if (!hdr) {
+		hdr = __alloc(CIFSD_BUF_OVERHEAD + alloc_size, GFP_KERNEL);
+		if (!hdr)
+			return NULL;
+	}
+
+	hdr->class = class;
+	if (zero)
+		memset(cifsd_buf_data(hdr), 0, size);
+	return cifsd_buf_data(hdr);
+}
+
+static void cifsd_buf_free(void *ptr)
+{
+	struct cifsd_buf_hdr *hdr;
+
+	if (!ptr)
+		return;
+
+	hdr = cifsd_buf_hdr(ptr);
+	if (hdr->class != CIFSD_BUF_NO_CLASS && cifsd_buf_put(hdr))
+		return;
+	__free(hdr);
+}
+
+static unsigned long cifsd_buf_list_drain(struct cifsd_buf_list *list,
+					  unsigned long nr_to_free)
+{
+	unsigned long freed = 0;
+	struct list_head *entry;
+
+	spin_lock(&list->lock);
+	while (freed < nr_to_free && !list_empty(&list->bufs)) {
+		entry = list->bufs.next;
+		list_del(entry);
+		list->count--;
+		spin_unlock(&list->lock);
+
+		__free((struct cifsd_buf_hdr *)entry - 1);
+		freed++;
+
+		spin_lock(&list->lock);
+	}
+	spin_unlock(&list->lock);
+	return freed;
+}
+
+static unsigned long cifsd_buf_drain(unsigned long nr_to_free)
+{
+	unsigned long freed = 0;
+	unsigned int i;
+	int cpu;
+
+	for (i = 0; i < CIFSD_BUF_NR_CLASSES; i++) {
+		struct cifsd_buf_class *c = &buf_classes[i];
+
+		if (!cifsd_buf_class_ready(c))
+			continue;
+
+		if (c->shared) {
+			freed += cifsd_buf_list_drain(c->global,
+						      nr_to_free - freed);
+			continue;
+		}
+
+		for_each_possible_cpu(cpu)
+			freed += cifsd_buf_list_drain(per_cpu_ptr(c->lists, cpu),
+						      nr_to_free - freed);
+	}
+	return freed;
+}
+
+static void cifsd_buf_list_sum(struct cifsd_buf_list *list,
+			       unsigned long *cached, unsigned long *hits,
+			       unsigned long *misses)
+{
+	*cached += READ_ONCE(list->count);
+	*hits += READ_ONCE(list->hits);
+	*misses += READ_ONCE(list->misses);
+}
+
+/* Counters of all the lists of a size class */
+static void cifsd_buf_class_sum(struct cifsd_buf_class *c,
+				unsigned long *cached, unsigned long *hits,
+				unsigned long *misses)
+{
+	int cpu;
+
+	*cached = *hits = *misses = 0;
+	if (!cifsd_buf_class_ready(c))
+		return;
+
+	if (c->shared) {
+		cifsd_buf_list_sum(c->global, cached, hits, misses);
+		return;
+	}
+
+	for_each_possible_cpu(cpu)
+		cifsd_buf_list_sum(per_cpu_ptr(c->lists, cpu),
+				   cached, hits, misses);
+}
+
+/* When reclaim last looked at the pool, 0 if it never did */
+static unsigned long buf_reclaim_stamp;
+
+static unsigned long cifsd_buf_shrink_count(struct shrinker *shrink,
+					    struct shrink_control *sc)
+{
+	unsigned long count = 0, cached, hits, misses;
+	unsigned int i;
+
+	WRITE_ONCE(buf_reclaim_stamp, jiffies ?: 1);
+	for (i = 0; i < CIFSD_BUF_NR_CLASSES; i++) {
+		cifsd_buf_class_sum(&buf_classes[i], &cached, &hits, &misses);
+		count += cached;
+	}
+	return count;
+}
+
+static unsigned long cifsd_buf_shrink_scan(struct shrinker *shrink,
+					   struct shrink_control *sc)
+{
+	unsigned long freed = cifsd_buf_drain(sc->nr_to_scan);
+
+	return freed ? freed : SHRINK_STOP;
+}
+
+static struct shrinker cifsd_buf_shrinker = {
+	.count_objects	= cifsd_buf_shrink_count,
+	.scan_objects	= cifsd_buf_shrink_scan,
+	.seeks		= DEFAULT_SEEKS,
+};
+
+/**
+ * cifsd_buffer_pool_pressure() - check if the system is short of memory
+ *
+ * Return:	true if reclaim ran during the last second
+ */
+bool cifsd_buffer_pool_pressure(void)
+{
+	unsigned long stamp = READ_ONCE(buf_reclaim_stamp);
+
+	return stamp && time_before(jiffies, stamp + HZ);
+}
+
+/**
+ * cifsd_buffer_pool_stats() - format buffer pool counters
+ * @buf:	output buffer
+ * @size:	size of @buf
+ *
+ * One line per size class: name, buffer size, cached buffers, hits and
+ * misses of the free lists.
+ *
+ * Return:	number of bytes written to @buf
+ */
+ssize_t cifsd_buffer_pool_stats(char *buf, size_t size)
+{
+	ssize_t sz = 0;
+	unsigned int i;
+
+	for (i = 0; i < CIFSD_BUF_NR_CLASSES; i++) {
+		struct cifsd_buf_class *c = &buf_classes[i];
+		unsigned long cached, hits, misses;
+
+		if (!cifsd_buf_class_ready(c))
+			continue;
+
+		cifsd_buf_class_sum(c, &cached, &hits, &misses);
+		sz += scnprintf(buf + sz, size - sz, "%s %zu %lu %lu %lu\n",
+				c->name, c->size, cached, hits, misses);
+	}
+	return sz;
+}
+
 void *cifsd_alloc(size_t size)
 {
 	return __alloc(size, GFP_KERNEL | __GFP_ZERO);
@@ -66,29 +406,42 @@ void cifsd_free(void *ptr)
 
 void cifsd_free_request(void *addr)
 {
-	__free(addr);
+	cifsd_buf_free(addr);
 }
 
+/*
+ * Request buffers are not zeroed, they are filled from the socket or by
+ * the file read they are allocated for.
+ */
 void *cifsd_alloc_request(size_t size)
 {
-	return __alloc(size, GFP_KERNEL | __GFP_ZERO);
+	return cifsd_buf_alloc(size, false);
 }
 
 void cifsd_free_response(void *buffer)
 {
-	__free(buffer);
+	cifsd_buf_free(buffer);
 }
 
 void *cifsd_alloc_response(size_t size)
 {
-	return __alloc(size, GFP_KERNEL | __GFP_ZERO);
+	return cifsd_buf_alloc(size, true);
 }
 
 void *cifsd_realloc_response(void *ptr, size_t old_sz, size_t new_sz)
 {
+	struct cifsd_buf_hdr *hdr = ptr ? cifsd_buf_hdr(ptr) : NULL;
 	size_t sz = min(old_sz, new_sz);
 	void *nptr;
 
+	/* grow in place while the size class of the buffer has room */
+	if (hdr && hdr->class != CIFSD_BUF_NO_CLASS &&
+	    new_sz <= buf_classes[hdr->class].size) {
+		if (new_sz > old_sz)
+			memset(ptr + old_sz, 0, new_sz - old_sz);
+		return ptr;
+	}
+
 	nptr = cifsd_alloc_response(new_sz);
 	if (!nptr)
 		return ptr;
@@ -97,6 +450,53 @@ void *cifsd_realloc_response(void *ptr, size_t old_sz, size_t new_sz)
 	return nptr;
 }
 
+/**
+ * cifsd_alloc_pages() - allocate a page vector for bulk data
+ * @size:	number of bytes the vector has to hold
+ * @nr_bvec:	number of allocated vector entries, one page each
+ *
+ * Pages are not zeroed, the caller is expected to fill all of @size.
+ *
+ * Return:	page vector on success, otherwise NULL
+ */
+struct bio_vec *cifsd_alloc_pages(size_t size, unsigned int *nr_bvec)
+{
+	unsigned int i, nr = DIV_ROUND_UP(size, PAGE_SIZE);
+	struct bio_vec *bvec;
+
+	bvec = cifsd_alloc(nr * sizeof(struct bio_vec));
+	if (!bvec)
+		return NULL;
+
+	for (i = 0; i < nr; i++) {
+		bvec[i].bv_page = alloc_page(GFP_KERNEL);
+		if (!bvec[i].bv_page) {
+			cifsd_free_pages(bvec, i);
+			return NULL;
+		}
+		bvec[i].bv_offset = 0;
+		bvec[i].bv_len = min_t(size_t, size, PAGE_SIZE);
+		size -= bvec[i].bv_len;
+	}
+
+	*nr_bvec = nr;
+	return bvec;
+}
+
+/**
+ * cifsd_free_pages() - drop page references and free a page vector
+ * @bvec:	page vector, can be NULL
+ * @nr_bvec:	number of vector entries holding a page reference
+ */
+void cifsd_free_pages(struct bio_vec *bvec, unsigned int nr_bvec)
+{
+	unsigned int i;
+
+	for (i = 0; i < nr_bvec; i++)
+		put_page(bvec[i].bv_page);
+	cifsd_free(bvec);
+}
+
 struct cifsd_work *cifsd_alloc_work_struct(void)
 {
 	return kmem_cache_zalloc(work_cache, GFP_KERNEL);
@@ -104,10 +504,11 @@ struct cifsd_work *cifsd_alloc_work_struct(void)
 
 void cifsd_free_work_struct(struct cifsd_work *work)
 {
+	cifsd_free_pages(work->aux_payload_bvec, work->aux_payload_nr_bvec);
+	cifsd_free_pages(work->request_bvec, work->request_nr_bvec);
 	cifsd_free_response(RESPONSE_BUF(work));
 	cifsd_free_response(AUX_PAYLOAD(work));
-	cifsd_free_response(TRANSFORM_BUF(work));
-	cifsd_free_request(REQUEST_BUF(work));
+	cifsd_free_request(work->request_buf);
 	if (work->async_id)
 		cifds_release_id(work->conn->async_ida, work->async_id);
 	kmem_cache_free(work_cache, work);
@@ -123,14 +524,94 @@ void *cifsd_alloc_file_struct(void)
 	return kmem_cache_zalloc(filp_cache, GFP_KERNEL);
 }
 
+static void cifsd_free_buf_lists(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < CIFSD_BUF_NR_CLASSES; i++) {
+		free_percpu(buf_classes[i].lists);
+		buf_classes[i].lists = NULL;
+		kfree(buf_classes[i].global);
+		buf_classes[i].global = NULL;
+	}
+}
+
+static void cifsd_destroy_buf_classes(void)
+{
+	if (buf_classes[0].lists)
+		unregister_shrinker(&cifsd_buf_shrinker);
+
+	cifsd_buf_drain(ULONG_MAX);
+	cifsd_free_buf_lists();
+}
+
+static void cifsd_init_buf_list(struct cifsd_buf_list *list)
+{
+	spin_lock_init(&list->lock);
+	INIT_LIST_HEAD(&list->bufs);
+}
+
+static int cifsd_init_buf_classes(void)
+{
+	size_t hdr_sz = CIFSD_BUF_OVERHEAD;
+	unsigned int i;
+	int cpu;
+
+	buf_classes[CIFSD_BUF_SMALL].size = cifsd_small_buffer_size();
+	buf_classes[CIFSD_BUF_PAGE].size = PAGE_SIZE - hdr_sz;
+	/* large classes round up to whole pages, including the header */
+	buf_classes[CIFSD_BUF_MSG].size = PAGE_ALIGN(cifsd_max_msg_size() +
+			MAX_SMB2_HDR_SIZE + hdr_sz) - hdr_sz;
+	buf_classes[CIFSD_BUF_IO].size = PAGE_ALIGN(cifsd_default_io_size() +
+			MAX_SMB2_HDR_SIZE + hdr_sz) - hdr_sz;
+	buf_classes[CIFSD_BUF_LARGE_IO].size = PAGE_ALIGN(cifsd_max_io_size() +
+			MAX_SMB2_HDR_SIZE + hdr_sz) - hdr_sz;
+
+	for (i = 0; i < CIFSD_BUF_NR_CLASSES; i++) {
+		struct cifsd_buf_class *c = &buf_classes[i];
+		struct cifsd_buf_list __percpu *lists;
+
+		if (c->shared) {
+			c->global = kzalloc(sizeof(*c->global), GFP_KERNEL);
+			if (!c->global)
+				goto out;
+
+			cifsd_init_buf_list(c->global);
+			c->max_cached = max_t(size_t, 1, CIFSD_BUF_SHARED_CACHE /
+					      (CIFSD_BUF_OVERHEAD + c->size));
+			continue;
+		}
+
+		lists = alloc_percpu(struct cifsd_buf_list);
+		if (!lists)
+			goto out;
+
+		for_each_possible_cpu(cpu)
+			cifsd_init_buf_list(per_cpu_ptr(lists, cpu));
+		c->lists = lists;
+	}
+
+	if (register_shrinker(&cifsd_buf_shrinker))
+		goto out;
+	return 0;
+
+out:
+	cifsd_free_buf_lists();
+	return -ENOMEM;
+}
+
 void cifsd_destroy_buffer_pools(void)
 {
+	cifsd_destroy_buf_classes();
 	kmem_cache_destroy(work_cache);
 	kmem_cache_destroy(filp_cache);
 }
 
 int cifsd_init_buffer_pools(void)
 {
+	if (cifsd_init_buf_classes())
+		goto out;
+
 	work_cache = kmem_cache_create("cifsd_work_cache",
 					sizeof(struct cifsd_work), 0,
 					SLAB_HWCACHE_ALIGN, NULL);
@@ -7,6 +7,14 @@
 #define __CIFSD_BUFFER_POOL_H__
 
 struct cifsd_work;
+struct bio_vec;
+
+/*
+ * Request and response buffers can be extended this many bytes in front
+ * of their start, e.g. by the SMB3 transform header of an encrypted
+ * response.
+ */
+#define CIFSD_BUF_HEADROOM	64
 
 void *cifsd_alloc(size_t size);
 void cifsd_free(void *ptr);
@@ -18,12 +26,18 @@ void *cifsd_alloc_response(size_t size);
 
 void *cifsd_realloc_response(void *ptr, size_t old_sz, size_t new_sz);
 
+struct bio_vec *cifsd_alloc_pages(size_t size, unsigned int *nr_bvec);
+void cifsd_free_pages(struct bio_vec *bvec, unsigned int nr_bvec);
+
 struct cifsd_work *cifsd_alloc_work_struct(void);
 void cifsd_free_work_struct(struct cifsd_work *work);
 
 void cifsd_free_file_struct(void *filp);
 void *cifsd_alloc_file_struct(void);
 
+bool cifsd_buffer_pool_pressure(void);
+ssize_t cifsd_buffer_pool_stats(char *buf, size_t size);
+
 void cifsd_destroy_buffer_pools(void);
 int cifsd_init_buffer_pools(void);
 
@@ -8,11 +8,14 @@
  */
 #include <linux/keyctl.h>
 #include <linux/key-type.h>
+#include <linux/hashtable.h>
+#include <linux/jhash.h>
 #include <keys/user-type.h>
 
 #include "glob.h"
 #include "smb_common.h"
 #include "cifsacl.h"
+#include "vfs_cache.h"
 
 /* security id for everyone/world system group */
 static const struct cifs_sid sid_everyone = {
@@ -307,7 +310,7 @@ static void mode_to_access_flags(umode_t mode, umode_t bits_to_use,
 	if (mode & 0111)
 		*pace_flags |= SET_FILE_EXEC_RIGHTS;
 
-	cifsd_err("mode: 0x%x, access flags now 0x%x\n",
+	cifsd_debug("mode: 0x%x, access flags now 0x%x\n",
 			mode, *pace_flags);
 }
 
@@ -374,18 +377,18 @@ static int parse_sid(struct cifs_sid *psid, char *end_of_acl)
 	if (psid->num_subauth) {
 		int i;
 
-		cifsd_err("SID revision %d num_auth %d\n",
+		cifsd_debug("SID revision %d num_auth %d\n",
 				psid->revision, psid->num_subauth);
 
 		for (i = 0; i < psid->num_subauth; i++) {
-			cifsd_err("SID sub_auth[%d]: 0x%x\n",
+			cifsd_debug("SID sub_auth[%d]: 0x%x\n",
 					i, le32_to_cpu(psid->sub_auth[i]));
 		}
 
 		/* BB add length check to make sure that we do not have huge
 		 * num auths and therefore go off the end
 		 */
-		cifsd_err("RID 0x%x\n",
+		cifsd_debug("RID 0x%x\n",
 			le32_to_cpu(psid->sub_auth[psid->num_subauth-1]));
 	}
 
@@ -517,6 +520,159 @@ out:
 	return rc;
 }
 
+/*
+ * SID <-> uid/gid mappings resolved by the idmap upcall, in a bounded LRU
+ * so that ACL heavy clients don't upcall for every SID. The keyring caches
+ * them too, but each request_key() still goes through the key search.
+ */
+#define CIFSD_IDMAP_HASH_BITS	8
+#define CIFSD_IDMAP_TTL		(600 * HZ)
+
+static unsigned int idmap_cache_size = 1024;
+module_param(idmap_cache_size, uint, 0644);
+MODULE_PARM_DESC(idmap_cache_size,
+	"Number of SID to uid/gid mappings cached, 0 to upcall for every SID. Default: 1024");
+
+struct cifsd_idmap_ent {
+	struct hlist_node	hlist;
+	struct list_head	lru;
+	unsigned long		expires;
+	/* mapping of @sid to @id, or of @id to @sid */
+	bool			by_sid;
+	uint			sidtype;
+	unsigned int		id;
+	struct cifs_sid		sid;
+};
+
+static DEFINE_HASHTABLE(idmap_hash, CIFSD_IDMAP_HASH_BITS);
+static LIST_HEAD(idmap_lru);
+static unsigned int idmap_nr;
+static DEFINE_SPINLOCK(idmap_lock);
+
+static unsigned int cifs_sid_size(const struct cifs_sid *sid)
+{
+	return CIFS_SID_BASE_SIZE + sid->num_subauth * sizeof(__le32);
+}
+
+static u32 idmap_key(bool by_sid, uint sidtype, unsigned int id,
+		     const struct cifs_sid *sid)
+{
+	if (by_sid)
+		return jhash(sid, cifs_sid_size(sid), sidtype);
+	return jhash_2words(id, sidtype, 0);
+}
+
+static struct cifsd_idmap_ent *idmap_find(bool by_sid, uint sidtype,
+					  unsigned int id,
+					  const struct cifs_sid *sid, u32 key)
+{
+	struct cifsd_idmap_ent *ent;
+
+	hash_for_each_possible(idmap_hash, ent, hlist, key) {
+		if (ent->by_sid != by_sid || ent->sidtype != sidtype)
+			continue;
+		if (by_sid ? !memcmp(&ent->sid, sid, cifs_sid_size(sid)) :
+		    ent->id == id)
+			return ent;
+	}
+	return NULL;
+}
+
+static void idmap_remove(struct cifsd_idmap_ent *ent)
+{
+	hash_del(&ent->hlist);
+	list_del(&ent->lru);
+	idmap_nr--;
+	kfree(ent);
+}
+
+/**
+ * idmap_lookup() - look up a cached mapping
+ * @by_sid:	map @sid to @id, otherwise @id to @sid
+ * @sidtype:	SIDOWNER or SIDGROUP
+ * @id:		uid or gid, set on a hit if @by_sid
+ * @sid:	SID, set on a hit unless @by_sid
+ *
+ * Return:	true on a hit
+ */
+static bool idmap_lookup(bool by_sid, uint sidtype, unsigned int *id,
+			 struct cifs_sid *sid)
+{
+	u32 key = idmap_key(by_sid, sidtype, *id, sid);
+	struct cifsd_idmap_ent *ent;
+	bool hit = false;
+
+	spin_lock(&idmap_lock);
+	ent = idmap_find(by_sid, sidtype, *id, sid, key);
+	if (ent && time_after(jiffies, ent->expires)) {
+		idmap_remove(ent);
+		ent = NULL;
+	}
+	if (ent) {
+		if (by_sid)
+			*id = ent->id;
+		else
+			cifs_copy_sid(sid, &ent->sid);
+		list_move(&ent->lru, &idmap_lru);
+		hit = true;
+	}
+	spin_unlock(&idmap_lock);
+	return hit;
+}
+
+static void idmap_insert(bool by_sid, uint sidtype, unsigned int id,
+			 const struct cifs_sid *sid)
+{
+	unsigned int max = READ_ONCE(idmap_cache_size);
+	u32 key = idmap_key(by_sid, sidtype, id, sid);
+	struct cifsd_idmap_ent *ent, *old;
+
+	if (!max)
+		return;
+
+	ent = kmalloc(sizeof(struct cifsd_idmap_ent), GFP_KERNEL);
+	if (!ent)
+		return;
+
+	ent->expires = jiffies + CIFSD_IDMAP_TTL;
+	ent->by_sid = by_sid;
+	ent->sidtype = sidtype;
+	ent->id = id;
+	cifs_copy_sid(&ent->sid, sid);
+
+	spin_lock(&idmap_lock);
+	old = idmap_find(by_sid, sidtype, id, sid, key);
+	if (old)
+		idmap_remove(old);
+	hash_add(idmap_hash, &ent->hlist, key);
+	list_add(&ent->lru, &idmap_lru);
+	idmap_nr++;
+	while (idmap_nr > max)
+		idmap_remove(list_last_entry(&idmap_lru,
+					     struct cifsd_idmap_ent, lru));
+	spin_unlock(&idmap_lock);
+}
+
+#if IS_ENABLED(CONFIG_CIFSD_KUNIT_TEST)
+/* Map @id to @sid and back without an upcall, for the KUnit suite */
+void cifsd_idmap_seed(uint sidtype, unsigned int id,
+		      const struct cifs_sid *sid)
+{
+	idmap_insert(false, sidtype, id, sid);
+	idmap_insert(true, sidtype, id, sid);
+}
+#endif
+
+static void idmap_flush(void)
+{
+	struct cifsd_idmap_ent *ent, *tmp;
+
+	spin_lock(&idmap_lock);
+	list_for_each_entry_safe(ent, tmp, &idmap_lru, lru)
+		idmap_remove(ent);
+	spin_unlock(&idmap_lock);
+}
+
 static int id_to_sid(unsigned int cid, uint sidtype, struct cifs_sid *ssid)
 {
 	int rc;
@@ -526,6 +682,9 @@ static int id_to_sid(unsigned int cid, uint sidtype, struct cifs_sid *ssid)
 	char desc[3 + 10 + 1]; /* 3 byte prefix + 10 bytes for value + NULL */
 	const struct cred *saved_cred;
 
+	if (idmap_lookup(false, sidtype, &cid, ssid))
+		return 0;
+
 	rc = snprintf(desc, sizeof(desc), "%ci:%u",
 			sidtype == SIDOWNER ? 'o' : 'g', cid);
 	if (rc >= sizeof(desc))
@@ -570,6 +729,7 @@ static int id_to_sid(unsigned int cid, uint sidtype, struct cifs_sid *ssid)
 	}
 
 	cifs_copy_sid(ssid, ksid);
+	idmap_insert(false, sidtype, cid, ssid);
 out_key_put:
 	key_put(sidkey);
 out_revert_creds:
@@ -591,6 +751,7 @@ static int sid_to_id(struct cifs_sid *psid,
 	const struct cred *saved_cred;
 	kuid_t fuid = INVALID_UID;
 	kgid_t fgid = INVALID_GID;
+	unsigned int id;
 
 	/*
 	 * If we have too many subauthorities, then something is really wrong.
@@ -602,6 +763,9 @@ static int sid_to_id(struct cifs_sid *psid,
 		return -EIO;
 	}
 
+	if (idmap_lookup(true, sidtype, &id, psid))
+		goto map_id;
+
 	sidstr = sid_to_key_str(psid, sidtype);
 	if (!sidstr)
 		return -ENOMEM;
@@ -629,30 +793,29 @@ static int sid_to_id(struct cifs_sid *psid,
 		goto out_key_put;
 	}
 
-	if (sidtype == SIDOWNER) {
-		kuid_t uid;
-		uid_t id;
-
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 2, 0)
-		memcpy(&id, &sidkey->payload.data[0], sizeof(uid_t));
+	memcpy(&id, &sidkey->payload.data[0], sizeof(uid_t));
 #else
-		memcpy(&id, &sidkey->payload.value, sizeof(uid_t));
+	memcpy(&id, &sidkey->payload.value, sizeof(uid_t));
 #endif
-		uid = make_kuid(&init_user_ns, id);
+	idmap_insert(true, sidtype, id, psid);
+	key_put(sidkey);
+	revert_creds(saved_cred);
+	kfree(sidstr);
+
+map_id:
+	if (sidtype == SIDOWNER) {
+		kuid_t uid = make_kuid(&init_user_ns, id);
+
 		if (uid_valid(uid))
 			fuid = uid;
 	} else {
-		kgid_t gid;
-		gid_t id;
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 2, 0)
-		memcpy(&id, &sidkey->payload.data[0], sizeof(gid_t));
-#else
-		memcpy(&id, &sidkey->payload.value, sizeof(gid_t));
-#endif
-		gid = make_kgid(&init_user_ns, id);
+		kgid_t gid = make_kgid(&init_user_ns, id);
+
 		if (gid_valid(gid))
 			fgid = gid;
 	}
+	goto out;
 
 out_key_put:
 	key_put(sidkey);
@@ -660,6 +823,7 @@ out_revert_creds:
 	revert_creds(saved_cred);
 	kfree(sidstr);
 
+out:
 	/*
 	 * Note that we return 0 here unconditionally. If the mapping
 	 * fails then we just fall back to using the mnt_uid/mnt_gid.
@@ -725,7 +889,7 @@ static void access_flags_to_mode(__le32 ace_flags, int type, umode_t *pmode,
 
 	if (flags & GENERIC_ALL) {
 		*pmode |= (0777 & (*pbits_to_set));
-		cifsd_err("all perms\n");
+		cifsd_debug("all perms\n");
 		return;
 	}
 	if ((flags & GENERIC_WRITE) ||
@@ -738,7 +902,7 @@ static void access_flags_to_mode(__le32 ace_flags, int type, umode_t *pmode,
 		((flags & FILE_EXEC_RIGHTS) == FILE_EXEC_RIGHTS))
 		*pmode |= (0111 & (*pbits_to_set));
 
-	cifsd_err("access flags 0x%x mode now 0x%x\n", flags, *pmode);
+	cifsd_debug("access flags 0x%x mode now 0x%x\n", flags, *pmode);
 }
 
 static void parse_dacl(struct cifs_acl *pdacl, char *end_of_acl,
@@ -767,7 +931,7 @@ static void parse_dacl(struct cifs_acl *pdacl, char *end_of_acl,
 		return;
 	}
 
-	cifsd_err("DACL revision %d size %d num aces %d\n",
+	cifsd_debug("DACL revision %d size %d num aces %d\n",
 			le16_to_cpu(pdacl->revision), le16_to_cpu(pdacl->size),
 			le32_to_cpu(pdacl->num_aces));
 
@@ -846,7 +1010,7 @@ int parse_sec_desc(struct cifs_ntsd *pntsd, int acl_len,
 		le32_to_cpu(pntsd->gsidoffset));
 	dacloffset = le32_to_cpu(pntsd->dacloffset);
 	dacl_ptr = (struct cifs_acl *)((char *)pntsd + dacloffset);
-	cifsd_err("revision %d type 0x%x ooffset 0x%x goffset 0x%x sacloffset 0x%x dacloffset 0x%x\n",
+	cifsd_debug("revision %d type 0x%x ooffset 0x%x goffset 0x%x sacloffset 0x%x dacloffset 0x%x\n",
 		pntsd->revision, pntsd->type, le32_to_cpu(pntsd->osidoffset),
 		le32_to_cpu(pntsd->gsidoffset),
 		le32_to_cpu(pntsd->sacloffset), dacloffset);
@@ -888,7 +1052,7 @@ int parse_sec_desc(struct cifs_ntsd *pntsd, int acl_len,
 	return rc;
 }
 
-int build_sec_desc(struct cifs_ntsd *pntsd, int addition_info,
+static int __build_sec_desc(struct cifs_ntsd *pntsd, int addition_info,
 	struct inode *inode)
 {
 	struct cifs_sid *owner_sid_ptr = NULL, *group_sid_ptr = NULL;
@@ -984,6 +1148,82 @@ int build_sec_desc(struct cifs_ntsd *pntsd, int addition_info,
 	return offset;
 }
 
+/*
+ * A built descriptor is cached as CIFSD_META_SEC_DESC behind the inputs it
+ * was built from, a chown or chmod that didn't move ctime doesn't match.
+ */
+struct cifsd_sd_key {
+	int	addition_info;
+	uid_t	uid;
+	gid_t	gid;
+	umode_t	mode;
+};
+
+#define CIFSD_SD_CACHE_MAX	(sizeof(struct cifsd_sd_key) + \
+				 MAX_SEC_DESC_LEN)
+
+static int sd_cache_get(struct cifs_ntsd *pntsd, struct inode *inode,
+			struct cifsd_sd_key *key, u64 *stamp)
+{
+	char *buf = NULL;
+	ssize_t len;
+
+	len = cifsd_inode_meta_get(inode, CIFSD_META_SEC_DESC, &buf,
+				   CIFSD_SD_CACHE_MAX, stamp);
+	if (len <= (ssize_t)sizeof(*key) || memcmp(buf, key, sizeof(*key))) {
+		kfree(buf);
+		return 0;
+	}
+
+	len -= sizeof(*key);
+	memcpy(pntsd, buf + sizeof(*key), len);
+	kfree(buf);
+	return len;
+}
+
+static void sd_cache_set(struct cifs_ntsd *pntsd, int len,
+			 struct inode *inode, struct cifsd_sd_key *key,
+			 u64 stamp)
+{
+	char *buf;
+
+	if (!stamp || sizeof(*key) + len > CIFSD_SD_CACHE_MAX)
+		return;
+
+	buf = kmalloc(sizeof(*key) + len, GFP_KERNEL);
+	if (!buf)
+		return;
+
+	memcpy(buf, key, sizeof(*key));
+	memcpy(buf + sizeof(*key), pntsd, len);
+	cifsd_inode_meta_set(inode, CIFSD_META_SEC_DESC, stamp, buf,
+			     sizeof(*key) + len);
+	kfree(buf);
+}
+
+int build_sec_desc(struct cifs_ntsd *pntsd, int addition_info,
+	struct inode *inode)
+{
+	struct cifsd_sd_key key;
+	u64 stamp;
+	int len;
+
+	memset(&key, 0, sizeof(key));
+	key.addition_info = addition_info;
+	key.uid = from_kuid(&init_user_ns, inode->i_uid);
+	key.gid = from_kgid(&init_user_ns, inode->i_gid);
+	key.mode = inode->i_mode;
+
+	len = sd_cache_get(pntsd, inode, &key, &stamp);
+	if (len > 0)
+		return len;
+
+	len = __build_sec_desc(pntsd, addition_info, inode);
+	if (len > 0)
+		sd_cache_set(pntsd, len, inode, &key, stamp);
+	return len;
+}
+
 int init_cifsd_idmap(void)
 {
 	struct cred *cred;
@@ -1045,6 +1285,7 @@ failed_put_cred:
 
 void exit_cifsd_idmap(void)
 {
+	idmap_flush();
 	key_revoke(root_cred->thread_keyring);
 	unregister_key_type(&cifsd_idmap_key_type);
 	put_cred(root_cred);
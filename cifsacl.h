@@ -54,6 +54,10 @@
 			      sizeof(struct cifs_acl) + \
 			      (sizeof(struct cifs_ace) * 3))
 
+/* Largest descriptor build_sec_desc() returns, with an owner and group SID */
+#define MAX_SEC_DESC_LEN (DEFAULT_SEC_DESC_LEN + \
+			  (sizeof(struct cifs_sid) * 2))
+
 /*
  * Maximum size of a string representation of a SID:
  *
@@ -126,6 +130,11 @@ void cifsd_fattr_to_inode(struct inode *inode,
 void exit_cifsd_idmap(void);
 
 int init_cifsd_idmap(void);
+
+#if IS_ENABLED(CONFIG_CIFSD_KUNIT_TEST)
+void cifsd_idmap_seed(uint sidtype, unsigned int id,
+		      const struct cifs_sid *sid);
+#endif
 #else
 static inline int parse_sec_desc(struct cifs_ntsd *pntsd,
 		   int acl_len,
@@ -0,0 +1,786 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ *   Copyright (C) 2018 Samsung Electronics Co., Ltd.
+ */
+
+#include <kunit/test.h>
+#include <linux/atomic.h>
+#include <linux/completion.h>
+#include <linux/kthread.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/net.h>
+#include <linux/nls.h>
+#include <linux/random.h>
+#include <linux/slab.h>
+#include <linux/sort.h>
+#include <linux/uio.h>
+#include <net/net_namespace.h>
+
+#include "glob.h"
+#include "auth.h"
+#include "cifsacl.h"
+#include "misc.h"
+#include "server.h"
+#include "smb2pdu.h"
+#include "smb_common.h"
+#include "transport_tcp.h"
+#include "unicode.h"
+#include "mgmt/user_session.h"
+
+/*
+ * Microbenchmarks of the request hot paths. Every case checks the result
+ * of the code it runs, so a broken fast path fails instead of getting
+ * faster, and reports its speed with kunit_info(). Numbers are only
+ * comparable between builds on the same machine.
+ *
+ * The suite is linked into the module and runs once the module is
+ * initialized, with the crypto contexts and session table of the module.
+ */
+
+#define CIFSD_BENCH_ITERS	1000
+/* bytes processed by each size of the sized cases */
+#define CIFSD_BENCH_BYTES	(16 << 20)
+
+struct cifsd_bench {
+	struct cifsd_tcp_conn	*conn;
+	struct cifsd_session	*sess;
+	struct nls_table	*nls;
+};
+
+static void cifsd_bench_report(struct kunit *test, const char *name,
+			       unsigned int iters, u64 ns, size_t bytes)
+{
+	u64 per_op = div_u64(ns, iters);
+
+	if (!bytes || !ns) {
+		kunit_info(test, "%s: %llu ns/op\n", name, per_op);
+		return;
+	}
+
+	kunit_info(test, "%s: %llu ns/op, %llu MB/s\n", name, per_op,
+		   div64_u64((u64)bytes * iters * NSEC_PER_SEC,
+			     ns * (1 << 20)));
+}
+
+static unsigned int cifsd_bench_iters(size_t size)
+{
+	return max_t(unsigned int, 16, CIFSD_BENCH_BYTES / size);
+}
+
+static int cifsd_bench_init(struct kunit *test)
+{
+	struct cifsd_bench *b;
+
+	b = kunit_kzalloc(test, sizeof(*b), GFP_KERNEL);
+	if (!b)
+		return -ENOMEM;
+
+	b->conn = kunit_kzalloc(test, sizeof(*b->conn), GFP_KERNEL);
+	if (!b->conn)
+		return -ENOMEM;
+
+	INIT_LIST_HEAD(&b->conn->sessions);
+	mutex_init(&b->conn->secmech_lock);
+
+	b->nls = load_nls("utf8");
+	if (!b->nls)
+		b->nls = load_nls_default();
+
+	test->priv = b;
+	return 0;
+}
+
+/* Also runs when a case failed an assertion half way */
+static void cifsd_bench_exit(struct kunit *test)
+{
+	struct cifsd_bench *b = test->priv;
+
+	cifsd_session_destroy(b->sess);
+	cifsd_free_conn_secmech(b->conn);
+	unload_nls(b->nls);
+}
+
+/*
+ * A session of the test connection, with SMB3 transforms of @cipher. A
+ * later call keys new transforms of the same session.
+ */
+static void cifsd_bench_session(struct kunit *test, __le16 cipher)
+{
+	struct cifsd_bench *b = test->priv;
+
+	b->conn->cipher_type = cipher;
+	if (!b->sess) {
+		b->sess = cifsd_smb2_session_create();
+		KUNIT_ASSERT_NOT_NULL(test, b->sess);
+
+		cifsd_session_register(b->conn, b->sess);
+		get_random_bytes(b->sess->sess_key, SMB2_NTLMV2_SESSKEY_SIZE);
+	}
+	KUNIT_ASSERT_EQ(test, cifsd_gen_smb30_encryptionkey(b->sess), 0);
+}
+
+static const char * const bench_names[] = {
+	"file.txt",
+	"dir\\subdir\\Document name 01.docx",
+	"Répertoire\\fichier été.txt",
+};
+
+/* A CREATE request of @name, as received, starting with its RFC1002 length */
+static struct smb2_create_req *cifsd_bench_create_req(struct kunit *test,
+						      const char *name,
+						      unsigned int *len)
+{
+	struct cifsd_bench *b = test->priv;
+	struct smb2_create_req *req;
+	size_t name_sz = (strlen(name) + 1) * sizeof(__le16);
+	int nr;
+
+	req = kunit_kzalloc(test, sizeof(*req) + name_sz, GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, req);
+
+	nr = smb_strtoUTF16((__le16 *)req->Buffer, name, strlen(name),
+			    b->nls);
+	*len = sizeof(*req) + nr * sizeof(__le16);
+
+	req->hdr.smb2_buf_length = cpu_to_be32(*len - 4);
+	req->hdr.ProtocolId = SMB2_PROTO_NUMBER;
+	req->hdr.StructureSize = SMB2_HEADER_STRUCTURE_SIZE;
+	req->hdr.Command = SMB2_CREATE;
+	req->hdr.CreditRequest = cpu_to_le16(1);
+	req->StructureSize = cpu_to_le16(57);
+	req->NameOffset = cpu_to_le16(offsetof(struct smb2_create_req,
+					       Buffer) - 4);
+	req->NameLength = cpu_to_le16(nr * sizeof(__le16));
+	return req;
+}
+
+static void cifsd_bench_smb2_decode(struct kunit *test)
+{
+	struct smb2_req_view view;
+	struct smb2_create_req *req;
+	struct cifsd_work *work;
+	unsigned int len, i;
+	u64 start, ns;
+
+	req = cifsd_bench_create_req(test, bench_names[1], &len);
+
+	KUNIT_ASSERT_EQ(test, smb2_decode_req(&req->hdr, len - 4, &view), 0);
+	KUNIT_EXPECT_EQ(test, view.area[SMB2_CREATE_NAME].len,
+			(unsigned int)le16_to_cpu(req->NameLength));
+
+	start = ktime_get_ns();
+	for (i = 0; i < CIFSD_BENCH_ITERS; i++)
+		smb2_decode_req(&req->hdr, len - 4, &view);
+	ns = ktime_get_ns() - start;
+	cifsd_bench_report(test, "smb2_decode_req create", i, ns, 0);
+
+	work = kunit_kzalloc(test, sizeof(*work), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, work);
+	work->request_buf = (char *)req;
+
+	KUNIT_ASSERT_EQ(test, cifsd_smb2_check_message(work), 0);
+	start = ktime_get_ns();
+	for (i = 0; i < CIFSD_BENCH_ITERS; i++)
+		cifsd_smb2_check_message(work);
+	ns = ktime_get_ns() - start;
+	cifsd_bench_report(test, "cifsd_smb2_check_message create", i, ns, 0);
+
+	/* a name running past the end of the request */
+	req->NameLength = cpu_to_le16(len);
+	KUNIT_EXPECT_NE(test, smb2_decode_req(&req->hdr, len - 4, &view), 0);
+	KUNIT_EXPECT_NE(test, cifsd_smb2_check_message(work), 0);
+}
+
+static void cifsd_bench_unicode(struct kunit *test)
+{
+	struct cifsd_bench *b = test->priv;
+	__le16 *utf16;
+	unsigned int n, i;
+	u64 start, ns;
+	char *name;
+	int len;
+
+	utf16 = kunit_kmalloc(test, PATH_MAX * sizeof(__le16), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, utf16);
+
+	for (n = 0; n < ARRAY_SIZE(bench_names); n++) {
+		const char *s = bench_names[n];
+		int slen = strlen(s);
+
+		len = smb_strtoUTF16(utf16, s, slen, b->nls);
+		KUNIT_ASSERT_GT(test, len, 0);
+		name = smb_strndup_from_utf16((char *)utf16,
+					      len * sizeof(__le16), true,
+					      b->nls);
+		KUNIT_ASSERT_FALSE(test, IS_ERR(name));
+		KUNIT_EXPECT_STREQ(test, name, s);
+		kfree(name);
+
+		start = ktime_get_ns();
+		for (i = 0; i < CIFSD_BENCH_ITERS; i++)
+			smb_strtoUTF16(utf16, s, slen, b->nls);
+		ns = ktime_get_ns() - start;
+		kunit_info(test, "\"%s\"\n", s);
+		cifsd_bench_report(test, "  smb_strtoUTF16", i, ns, slen);
+
+		start = ktime_get_ns();
+		for (i = 0; i < CIFSD_BENCH_ITERS; i++)
+			smbConvertToUTF16(utf16, s, slen, b->nls, 1);
+		ns = ktime_get_ns() - start;
+		cifsd_bench_report(test, "  smbConvertToUTF16", i, ns, slen);
+
+		len = smb_strtoUTF16(utf16, s, slen, b->nls);
+		start = ktime_get_ns();
+		for (i = 0; i < CIFSD_BENCH_ITERS; i++) {
+			name = smb_strndup_from_utf16((char *)utf16,
+						      len * sizeof(__le16),
+						      true, b->nls);
+			if (!IS_ERR(name))
+				kfree(name);
+		}
+		ns = ktime_get_ns() - start;
+		cifsd_bench_report(test, "  smb_strndup_from_utf16", i, ns,
+				   slen);
+	}
+}
+
+static const struct {
+	const char	*pattern;
+	const char	*name;
+	bool		match;
+} bench_patterns[] = {
+	{ "*",			"Document name 01.docx",	true },
+	{ "*.docx",		"Document name 01.docx",	true },
+	{ "document*.DOCX",	"Document name 01.docx",	true },
+	{ "*name??1*",		"Document name 01.docx",	true },
+	{ "*.txt",		"Document name 01.docx",	false },
+	{ "*a*b*c*d*e",		"aaaaaaaaaaaaaaaaaaaaaaaa",	false },
+};
+
+static void cifsd_bench_match_pattern(struct kunit *test)
+{
+	struct cifsd_search_pattern *sp;
+	unsigned int n, i;
+	u64 start, ns;
+
+	for (n = 0; n < ARRAY_SIZE(bench_patterns); n++) {
+		const char *p = bench_patterns[n].pattern;
+		const char *s = bench_patterns[n].name;
+
+		KUNIT_EXPECT_EQ(test, (bool)match_pattern(s, p),
+				bench_patterns[n].match);
+		sp = cifsd_search_pattern_compile(p);
+		KUNIT_ASSERT_NOT_NULL(test, sp);
+		KUNIT_EXPECT_EQ(test, cifsd_search_pattern_match(sp, s),
+				bench_patterns[n].match);
+
+		kunit_info(test, "\"%s\" ~ \"%s\"\n", s, p);
+		start = ktime_get_ns();
+		for (i = 0; i < CIFSD_BENCH_ITERS; i++)
+			match_pattern(s, p);
+		ns = ktime_get_ns() - start;
+		cifsd_bench_report(test, "  match_pattern", i, ns, 0);
+
+		start = ktime_get_ns();
+		for (i = 0; i < CIFSD_BENCH_ITERS; i++)
+			cifsd_search_pattern_match(sp, s);
+		ns = ktime_get_ns() - start;
+		cifsd_bench_report(test, "  cifsd_search_pattern_match", i, ns,
+				   0);
+		cifsd_search_pattern_free(sp);
+	}
+}
+
+static const size_t bench_sign_sizes[] = { 4096, 65536 };
+
+static const struct {
+	const char	*name;
+	__le16		alg;
+} bench_sign_algs[] = {
+	{ "hmac(sha256)",	SIGNING_ALG_HMAC_SHA256 },
+	{ "cmac(aes)",		SIGNING_ALG_AES_CMAC },
+	{ "gmac(aes)",		SIGNING_ALG_AES_GMAC },
+};
+
+/* SMB2 signing is HMAC-SHA256, the SMB3 algorithms are per connection */
+static int cifsd_bench_sign_one(struct cifsd_tcp_conn *conn, char *key,
+				struct kvec *iov, char *sig)
+{
+	if (conn->signing_algorithm == SIGNING_ALG_HMAC_SHA256)
+		return cifsd_sign_smb2_pdu(conn, key, iov, 1, sig);
+	return cifsd_sign_smb3_pdu(conn, key, iov, 1, sig);
+}
+
+static void cifsd_bench_sign(struct kunit *test)
+{
+	struct cifsd_bench *b = test->priv;
+	char key[SMB3_SIGN_KEY_SIZE];
+	char sig[SMB2_SIGNATURE_SIZE], sig2[SMB2_SIGNATURE_SIZE];
+	struct smb2_hdr *hdr;
+	struct kvec iov;
+	unsigned int a, n, i, iters;
+	u64 start, ns;
+	size_t size;
+
+	get_random_bytes(key, sizeof(key));
+	for (a = 0; a < ARRAY_SIZE(bench_sign_algs); a++) {
+		if (bench_sign_algs[a].alg == SIGNING_ALG_AES_GMAC &&
+		    !cifsd_sign_gmac_available()) {
+			kunit_info(test, "%s not available\n",
+				   bench_sign_algs[a].name);
+			continue;
+		}
+		b->conn->signing_algorithm = bench_sign_algs[a].alg;
+
+		for (n = 0; n < ARRAY_SIZE(bench_sign_sizes); n++) {
+			size = bench_sign_sizes[n];
+			hdr = kunit_kzalloc(test, size + 4, GFP_KERNEL);
+			KUNIT_ASSERT_NOT_NULL(test, hdr);
+			hdr->ProtocolId = SMB2_PROTO_NUMBER;
+			hdr->StructureSize = SMB2_HEADER_STRUCTURE_SIZE;
+			hdr->Command = SMB2_WRITE;
+			iov.iov_base = &hdr->ProtocolId;
+			iov.iov_len = size;
+
+			KUNIT_ASSERT_EQ(test, cifsd_bench_sign_one(b->conn, key,
+					&iov, sig), 0);
+			KUNIT_ASSERT_EQ(test, cifsd_bench_sign_one(b->conn, key,
+					&iov, sig2), 0);
+			KUNIT_EXPECT_EQ(test, memcmp(sig, sig2, sizeof(sig)),
+					0);
+
+			iters = cifsd_bench_iters(size);
+			start = ktime_get_ns();
+			for (i = 0; i < iters; i++)
+				cifsd_bench_sign_one(b->conn, key, &iov, sig);
+			ns = ktime_get_ns() - start;
+			kunit_info(test, "%s %zu bytes\n",
+				   bench_sign_algs[a].name, size);
+			cifsd_bench_report(test, "  sign", iters, ns, size);
+			kunit_kfree(test, hdr);
+		}
+	}
+}
+
+/* A message of @size following its transform header, to encrypt in place */
+struct cifsd_bench_msg {
+	struct smb2_transform_hdr	*tr_hdr;
+	struct kvec			iov[2];
+	size_t				size;
+};
+
+static void cifsd_bench_msg_init(struct kunit *test,
+				 struct cifsd_bench_msg *m, size_t size)
+{
+	struct cifsd_bench *b = test->priv;
+	char *msg;
+
+	/* the AEAD runs on a scatterlist, the data must not be vmalloc()ed */
+	m->tr_hdr = kunit_kzalloc(test, sizeof(*m->tr_hdr), GFP_KERNEL);
+	msg = kunit_kmalloc(test, size, GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, m->tr_hdr);
+	KUNIT_ASSERT_NOT_NULL(test, msg);
+	memset(msg, 0x5a, size);
+
+	m->tr_hdr->ProtocolId = SMB2_TRANSFORM_PROTO_NUM;
+	m->tr_hdr->OriginalMessageSize = cpu_to_le32(size);
+	m->tr_hdr->Flags = cpu_to_le16(0x01);
+	m->tr_hdr->SessionId = cpu_to_le64(b->sess->id);
+	get_random_bytes(&m->tr_hdr->Nonce, SMB3_AES128GCM_NONCE);
+
+	m->iov[0].iov_base = m->tr_hdr;
+	m->iov[0].iov_len = sizeof(*m->tr_hdr);
+	m->iov[1].iov_base = msg;
+	m->iov[1].iov_len = size;
+	m->size = size;
+}
+
+static void cifsd_bench_msg_free(struct kunit *test,
+				 struct cifsd_bench_msg *m)
+{
+	kunit_kfree(test, m->iov[1].iov_base);
+	kunit_kfree(test, m->tr_hdr);
+}
+
+static const size_t bench_crypt_sizes[] = { 4096, 65536, 1 << 20 };
+
+static void cifsd_bench_crypt(struct kunit *test)
+{
+	struct cifsd_bench *b = test->priv;
+	struct cifsd_bench_msg m;
+	unsigned int n, i, iters;
+	u8 plain[64];
+	u64 start, ns;
+	size_t size;
+
+	cifsd_bench_session(test, SMB2_ENCRYPTION_AES128_CCM);
+
+	for (n = 0; n < ARRAY_SIZE(bench_crypt_sizes); n++) {
+		size = bench_crypt_sizes[n];
+		cifsd_bench_msg_init(test, &m, size);
+
+		memcpy(plain, m.iov[1].iov_base, sizeof(plain));
+		KUNIT_ASSERT_EQ(test, cifsd_crypt_message(b->conn, m.iov, 2, 1,
+							  NULL, NULL), 0);
+		KUNIT_EXPECT_NE(test, memcmp(plain, m.iov[1].iov_base,
+					     sizeof(plain)), 0);
+
+		iters = cifsd_bench_iters(size);
+		start = ktime_get_ns();
+		for (i = 0; i < iters; i++)
+			cifsd_crypt_message(b->conn, m.iov, 2, 1, NULL, NULL);
+		ns = ktime_get_ns() - start;
+		kunit_info(test, "aes-128-ccm %zu bytes\n", size);
+		cifsd_bench_report(test, "  encrypt", iters, ns, size);
+		cifsd_bench_msg_free(test, &m);
+	}
+}
+
+static const struct {
+	const char	*name;
+	__le16		cipher;
+} bench_ciphers[] = {
+	{ "aes-128-ccm",	SMB2_ENCRYPTION_AES128_CCM },
+	{ "aes-128-gcm",	SMB2_ENCRYPTION_AES128_GCM },
+	{ "aes-256-ccm",	SMB2_ENCRYPTION_AES256_CCM },
+	{ "aes-256-gcm",	SMB2_ENCRYPTION_AES256_GCM },
+};
+
+/* Throughput of the negotiable ciphers on a full size READ response */
+static void cifsd_bench_cipher(struct kunit *test)
+{
+	struct cifsd_bench *b = test->priv;
+	struct cifsd_bench_msg m;
+	unsigned int c, i, iters;
+	size_t size = 1 << 20;
+	u64 start, ns;
+
+	for (c = 0; c < ARRAY_SIZE(bench_ciphers); c++) {
+		if (!cifsd_cipher_available(bench_ciphers[c].cipher)) {
+			kunit_info(test, "%s not available\n",
+				   bench_ciphers[c].name);
+			continue;
+		}
+		cifsd_bench_session(test, bench_ciphers[c].cipher);
+		cifsd_bench_msg_init(test, &m, size);
+		KUNIT_ASSERT_EQ(test, cifsd_crypt_message(b->conn, m.iov, 2, 1,
+							  NULL, NULL), 0);
+
+		iters = cifsd_bench_iters(size);
+		start = ktime_get_ns();
+		for (i = 0; i < iters; i++)
+			cifsd_crypt_message(b->conn, m.iov, 2, 1, NULL, NULL);
+		ns = ktime_get_ns() - start;
+		cifsd_bench_report(test, bench_ciphers[c].name, iters, ns,
+				   size);
+		cifsd_bench_msg_free(test, &m);
+	}
+}
+
+#define CIFSD_BENCH_CRYPT_DEPTH	8
+
+struct cifsd_bench_inflight {
+	atomic_t		pending;
+	atomic_t		async;
+	int			err;
+	struct completion	done;
+};
+
+/* Completion of a transform, possibly from softirq context */
+static void cifsd_bench_crypt_done(void *data, int err)
+{
+	struct cifsd_bench_inflight *fl = data;
+
+	if (err)
+		WRITE_ONCE(fl->err, err);
+	if (atomic_dec_and_test(&fl->pending))
+		complete(&fl->done);
+}
+
+/* Start a transform of every message, wait until all of them finished */
+static int cifsd_bench_crypt_batch(struct cifsd_tcp_conn *conn,
+				   struct cifsd_bench_msg *m,
+				   struct cifsd_bench_inflight *fl)
+{
+	unsigned int n;
+	int rc;
+
+	/* the bias keeps an early completion from finishing the batch */
+	atomic_set(&fl->pending, 1);
+	fl->err = 0;
+	reinit_completion(&fl->done);
+
+	for (n = 0; n < CIFSD_BENCH_CRYPT_DEPTH; n++) {
+		atomic_inc(&fl->pending);
+		rc = cifsd_crypt_message(conn, m[n].iov, 2, 1,
+					 cifsd_bench_crypt_done, fl);
+		if (rc == -EINPROGRESS)
+			atomic_inc(&fl->async);
+		else
+			cifsd_bench_crypt_done(fl, rc);
+	}
+
+	if (!atomic_dec_and_test(&fl->pending))
+		wait_for_completion(&fl->done);
+	return READ_ONCE(fl->err);
+}
+
+/*
+ * Several large responses encrypted at once through the completion
+ * callback, against the same messages encrypted one after the other.
+ * Only an asynchronous AEAD implementation overlaps the transforms, a
+ * synchronous one completes every call before it returns.
+ */
+static void cifsd_bench_crypt_async(struct kunit *test)
+{
+	struct cifsd_bench *b = test->priv;
+	struct cifsd_bench_msg m[CIFSD_BENCH_CRYPT_DEPTH];
+	struct cifsd_bench_inflight fl;
+	__le16 cipher = SMB2_ENCRYPTION_AES128_GCM;
+	size_t size = 1 << 20;
+	unsigned int n, i, iters;
+	u64 start, ns;
+
+	if (!cifsd_cipher_available(cipher))
+		cipher = SMB2_ENCRYPTION_AES128_CCM;
+	cifsd_bench_session(test, cipher);
+	for (n = 0; n < CIFSD_BENCH_CRYPT_DEPTH; n++)
+		cifsd_bench_msg_init(test, &m[n], size);
+
+	atomic_set(&fl.async, 0);
+	init_completion(&fl.done);
+	KUNIT_ASSERT_EQ(test, cifsd_bench_crypt_batch(b->conn, m, &fl), 0);
+
+	iters = DIV_ROUND_UP(cifsd_bench_iters(size), CIFSD_BENCH_CRYPT_DEPTH);
+	start = ktime_get_ns();
+	for (i = 0; i < iters; i++)
+		cifsd_bench_crypt_batch(b->conn, m, &fl);
+	ns = ktime_get_ns() - start;
+	kunit_info(test, "%u x %zu bytes, %d of %u transforms asynchronous\n",
+		   CIFSD_BENCH_CRYPT_DEPTH, size, atomic_read(&fl.async),
+		   (iters + 1) * CIFSD_BENCH_CRYPT_DEPTH);
+	cifsd_bench_report(test, "  async", iters, ns,
+			   size * CIFSD_BENCH_CRYPT_DEPTH);
+
+	start = ktime_get_ns();
+	for (i = 0; i < iters; i++)
+		for (n = 0; n < CIFSD_BENCH_CRYPT_DEPTH; n++)
+			cifsd_crypt_message(b->conn, m[n].iov, 2, 1,
+					    NULL, NULL);
+	ns = ktime_get_ns() - start;
+	cifsd_bench_report(test, "  sync", iters, ns,
+			   size * CIFSD_BENCH_CRYPT_DEPTH);
+
+	for (n = 0; n < CIFSD_BENCH_CRYPT_DEPTH; n++)
+		cifsd_bench_msg_free(test, &m[n]);
+}
+
+/* PDU the peer sends, stamped right before it goes to the socket */
+struct cifsd_bench_ping {
+	__be32	len;
+	u64	stamp;
+	char	pad[52];
+};
+
+struct cifsd_bench_peer {
+	struct socket		*sock;
+	struct completion	go;
+};
+
+static int cifsd_bench_peer_fn(void *p)
+{
+	struct cifsd_bench_peer *peer = p;
+	struct cifsd_bench_ping ping;
+	struct msghdr msg = {};
+	struct kvec iov;
+
+	memset(&ping, 0, sizeof(ping));
+	ping.len = cpu_to_be32(sizeof(ping) - 4);
+	while (!kthread_should_stop()) {
+		if (wait_for_completion_interruptible_timeout(&peer->go,
+							      HZ / 10) <= 0)
+			continue;
+
+		iov.iov_base = &ping;
+		iov.iov_len = sizeof(ping);
+		ping.stamp = ktime_get_ns();
+		if (kernel_sendmsg(peer->sock, &msg, &iov, 1,
+				   sizeof(ping)) != sizeof(ping))
+			break;
+	}
+
+	while (!kthread_should_stop())
+		schedule_timeout_interruptible(HZ / 10);
+	return 0;
+}
+
+static int cifsd_bench_cmp_u64(const void *a, const void *b)
+{
+	u64 x = *(const u64 *)a, y = *(const u64 *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/*
+ * Latency of the blocking receive: the time from the peer sending a PDU
+ * to cifsd_tcp_read() returning it, with the reader already asleep in
+ * the socket. One PDU is in flight at a time.
+ */
+static void cifsd_bench_recv_latency(struct kunit *test)
+{
+	struct cifsd_bench_peer peer;
+	struct cifsd_bench_ping ping;
+	struct cifsd_tcp_conn *conn;
+	struct task_struct *task;
+	struct socket *sock;
+	unsigned int i;
+	u64 *lat;
+	int rc;
+
+	/* cifsd_tcp_read() gives up on a connection of a stopped server */
+	if (!cifsd_server_running()) {
+		kunit_info(test, "server not running, skipped\n");
+		return;
+	}
+
+	lat = kunit_kmalloc_array(test, CIFSD_BENCH_ITERS, sizeof(*lat),
+				  GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, lat);
+
+	KUNIT_ASSERT_EQ(test, sock_create_kern(&init_net, PF_UNIX,
+					       SOCK_STREAM, 0, &sock), 0);
+	rc = sock_create_kern(&init_net, PF_UNIX, SOCK_STREAM, 0, &peer.sock);
+	if (rc) {
+		sock_release(sock);
+		KUNIT_ASSERT_EQ(test, rc, 0);
+	}
+
+	rc = sock->ops->socketpair(sock, peer.sock);
+	conn = rc ? NULL : cifsd_tcp_test_conn_alloc(sock);
+	if (!conn) {
+		sock_release(peer.sock);
+		sock_release(sock);
+		KUNIT_ASSERT_EQ(test, rc, 0);
+		KUNIT_ASSERT_NOT_NULL(test, conn);
+	}
+	conn->last_active = jiffies;
+
+	init_completion(&peer.go);
+	task = kthread_run(cifsd_bench_peer_fn, &peer, "cifsd-bench-peer");
+	if (IS_ERR(task)) {
+		cifsd_tcp_test_conn_free(conn);
+		sock_release(peer.sock);
+		KUNIT_ASSERT_EQ(test, PTR_ERR_OR_ZERO(task), 0);
+	}
+
+	for (i = 0; i < CIFSD_BENCH_ITERS; i++) {
+		complete(&peer.go);
+		rc = cifsd_tcp_read(conn, (char *)&ping, sizeof(ping));
+		if (rc != sizeof(ping))
+			break;
+		lat[i] = ktime_get_ns() - ping.stamp;
+	}
+
+	kthread_stop(task);
+	cifsd_tcp_test_conn_free(conn);
+	sock_release(peer.sock);
+
+	KUNIT_ASSERT_EQ(test, rc, (int)sizeof(ping));
+	KUNIT_EXPECT_EQ(test, be32_to_cpu(ping.len),
+			(u32)sizeof(ping) - 4);
+
+	sort(lat, i, sizeof(*lat), cifsd_bench_cmp_u64, NULL);
+	kunit_info(test, "receive: p50 %llu ns, p99 %llu ns, max %llu ns\n",
+		   lat[i / 2], lat[i * 99 / 100], lat[i - 1]);
+}
+
+#ifdef CONFIG_CIFSD_ACL
+/* S-1-5-21-1-2-3-<rid>, mapped without an idmap upcall */
+static void cifsd_bench_sid(struct cifs_sid *sid, u32 rid)
+{
+	memset(sid, 0, sizeof(*sid));
+	sid->revision = 1;
+	sid->num_subauth = 5;
+	sid->authority[5] = 5;
+	sid->sub_auth[0] = cpu_to_le32(21);
+	sid->sub_auth[1] = cpu_to_le32(1);
+	sid->sub_auth[2] = cpu_to_le32(2);
+	sid->sub_auth[3] = cpu_to_le32(3);
+	sid->sub_auth[4] = cpu_to_le32(rid);
+}
+
+static void cifsd_bench_sec_desc(struct kunit *test)
+{
+	int info = OWNER_SECINFO | GROUP_SECINFO | DACL_SECINFO;
+	struct cifsd_fattr fattr;
+	struct cifs_ntsd *pntsd;
+	struct cifs_sid sid;
+	struct inode *inode;
+	unsigned int i;
+	u64 start, ns;
+	int len;
+
+	cifsd_bench_sid(&sid, 1000);
+	cifsd_idmap_seed(SIDOWNER, 1000, &sid);
+	cifsd_bench_sid(&sid, 2000);
+	cifsd_idmap_seed(SIDGROUP, 1000, &sid);
+
+	/* not a cifsd inode, so the descriptor is built every time */
+	inode = kunit_kzalloc(test, sizeof(*inode), GFP_KERNEL);
+	pntsd = kunit_kzalloc(test, MAX_SEC_DESC_LEN, GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, inode);
+	KUNIT_ASSERT_NOT_NULL(test, pntsd);
+	inode->i_uid = KUIDT_INIT(1000);
+	inode->i_gid = KGIDT_INIT(1000);
+	inode->i_mode = S_IFREG | 0640;
+
+	len = build_sec_desc(pntsd, info, inode);
+	KUNIT_ASSERT_GT(test, len, 0);
+	KUNIT_ASSERT_LE(test, (size_t)len, MAX_SEC_DESC_LEN);
+
+	memset(&fattr, 0, sizeof(fattr));
+	KUNIT_ASSERT_EQ(test, parse_sec_desc(pntsd, len, &fattr), 0);
+	KUNIT_EXPECT_EQ(test, from_kuid(&init_user_ns, fattr.cf_uid), 1000u);
+	KUNIT_EXPECT_EQ(test, from_kgid(&init_user_ns, fattr.cf_gid), 1000u);
+	KUNIT_EXPECT_EQ(test, fattr.cf_mode & 0777, 0640);
+
+	start = ktime_get_ns();
+	for (i = 0; i < CIFSD_BENCH_ITERS; i++) {
+		memset(pntsd, 0, MAX_SEC_DESC_LEN);
+		build_sec_desc(pntsd, info, inode);
+	}
+	ns = ktime_get_ns() - start;
+	cifsd_bench_report(test, "build_sec_desc", i, ns, 0);
+
+	start = ktime_get_ns();
+	for (i = 0; i < CIFSD_BENCH_ITERS; i++)
+		parse_sec_desc(pntsd, len, &fattr);
+	ns = ktime_get_ns() - start;
+	cifsd_bench_report(test, "parse_sec_desc", i, ns, 0);
+}
+#endif
+
+static struct kunit_case cifsd_bench_cases[] = {
+	KUNIT_CASE(cifsd_bench_smb2_decode),
+	KUNIT_CASE(cifsd_bench_unicode),
+	KUNIT_CASE(cifsd_bench_match_pattern),
+	KUNIT_CASE(cifsd_bench_sign),
+	KUNIT_CASE(cifsd_bench_crypt),
+	KUNIT_CASE(cifsd_bench_cipher),
+	KUNIT_CASE(cifsd_bench_crypt_async),
+	KUNIT_CASE(cifsd_bench_recv_latency),
+#ifdef CONFIG_CIFSD_ACL
+	KUNIT_CASE(cifsd_bench_sec_desc),
+#endif
+	{}
+};
+
+static struct kunit_suite cifsd_bench_suite = {
+	.name		= "cifsd-bench",
+	.init		= cifsd_bench_init,
+	.exit		= cifsd_bench_exit,
+	.test_cases	= cifsd_bench_cases,
+};
+
+kunit_test_suites(&cifsd_bench_suite);
@@ -11,7 +11,15 @@
 #include <linux/types.h>
 
 #define CIFSD_GENL_NAME      "CIFSD_GENL"
-#define CIFSD_GENL_VERSION    0x01
+/*
+ * Bumped on every change of the layout of a message, the kernel and the
+ * daemon only talk to the same version.
+ *
+ * 0x02: cifsd_share_config_response carries the share QoS limits,
+ *	 cifsd_startup_request the global flags, max_active and
+ *	 tcp_backlog
+ */
+#define CIFSD_GENL_VERSION    0x02
 
 #ifndef __align
 #define __align		__attribute__((__aligned__(4)))
@@ -36,11 +44,22 @@ struct cifsd_startup_request {
 	__u16	ipc_timeout;
 	__u32	deadtime;
 	__u32	file_max;
+	__u32	flags;
+	__u32	max_active;
+	__u32	tcp_backlog;
 	__s8	____payload[0];
 } __align;
 
 #define CIFSD_STARTUP_CONFIG_INTERFACES(s)	((s)->____payload)
 
+/*
+ * Global config flags.
+ */
+#define CIFSD_GLOBAL_FLAG_INVALID		(0)
+#define CIFSD_GLOBAL_FLAG_PERCPU_WORKQUEUE	(1 << 0)
+/* Keep connections and open handles when the daemon goes away */
+#define CIFSD_GLOBAL_FLAG_SOFT_RESET		(1 << 1)
+
 struct cifsd_shutdown_request {
 	__s32	reserved;
 } __align;
@@ -72,6 +91,9 @@ struct cifsd_share_config_response {
 	__u16	directory_mask;
 	__u16	force_uid;
 	__u16	force_gid;
+	__u32	qos_max_iops;
+	__u32	qos_max_kbps;
+	__u32	qos_weight;
 	__u32	veto_list_sz;
 	__s8	____payload[0];
 } __align;
@@ -111,6 +133,70 @@ struct cifsd_logout_request {
 	__s8	account[CIFSD_REQ_MAX_ACCOUNT_NAME_SZ];
 } __align;
 
+struct cifsd_cache_invalidate_request {
+	__u32	flags;
+	__s8	account[CIFSD_REQ_MAX_ACCOUNT_NAME_SZ];
+	__s8	share[CIFSD_REQ_MAX_SHARE_NAME];
+} __align;
+
+/*
+ * Pushed by the daemon at startup for every share, and again when a
+ * share changes, so that tree connects don't have to upcall.
+ */
+struct cifsd_share_config_preload {
+	__s8	share_name[CIFSD_REQ_MAX_SHARE_NAME];
+	struct cifsd_share_config_response config;
+} __align;
+
+/*
+ * I/O stats request flags and sort keys, and the op classes of an entry.
+ */
+#define CIFSD_IO_STATS_SESSIONS		(0)
+#define CIFSD_IO_STATS_SHARES		(1 << 0)
+
+#define CIFSD_IO_STATS_SORT_BYTES	0
+#define CIFSD_IO_STATS_SORT_OPS		1
+#define CIFSD_IO_STATS_SORT_VFS_TIME	2
+
+#define CIFSD_IO_STATS_MAX_ENTRIES	64
+
+#define CIFSD_IO_OP_READ		0
+#define CIFSD_IO_OP_WRITE		1
+#define CIFSD_IO_OP_META		2
+#define CIFSD_IO_OP_OTHER		3
+#define CIFSD_IO_NR_OPS			4
+
+/*
+ * Top-N sessions or shares by I/O, queried by the daemon. Session
+ * entries carry the session id, share entries the share name.
+ */
+struct cifsd_io_stats_request {
+	__u32	handle;
+	__u32	flags;
+	__u32	sort;
+	__u32	top_n;
+} __align;
+
+struct cifsd_io_stats_entry {
+	__u64	session_id;
+	__s8	name[CIFSD_REQ_MAX_SHARE_NAME];
+	__u64	bytes_read;
+	__u64	bytes_written;
+	__u64	ops[CIFSD_IO_NR_OPS];
+	__u64	vfs_ns;
+} __align;
+
+struct cifsd_io_stats_response {
+	__u32	handle;
+	__u32	flags;
+	__u32	nr_entries;
+	__u32	reserved;
+	__s8	____payload[0];
+} __align;
+
+#define CIFSD_IO_STATS_ENTRIES(s)					\
+	((struct cifsd_io_stats_entry *)(s)->____payload)
+
 struct cifsd_rpc_command {
 	__u32	handle;
 	__u32	flags;
@@ -148,6 +234,13 @@ enum cifsd_event {
 	CIFSD_EVENT_RPC_REQUEST,
 	CIFSD_EVENT_RPC_RESPONSE,
 
+	CIFSD_EVENT_CACHE_INVALIDATE,
+
+	CIFSD_EVENT_SHARE_CONFIG_PRELOAD,
+
+	CIFSD_EVENT_IO_STATS_REQUEST,
+	CIFSD_EVENT_IO_STATS_RESPONSE,
+
 	CIFSD_EVENT_MAX
 };
 
@@ -188,6 +281,7 @@ enum CIFSD_TREE_CONN_STATUS {
 #define CIFSD_SHARE_FLAG_OPLOCKS		(1 << 7)
 #define CIFSD_SHARE_FLAG_PIPE			(1 << 8)
 #define CIFSD_SHARE_FLAG_HIDE_DOT_FILES		(1 << 9)
+#define CIFSD_SHARE_FLAG_COMPRESSION		(1 << 10)
 
 /*
  * Tree connect request flags.
@@ -204,6 +298,13 @@ enum CIFSD_TREE_CONN_STATUS {
 #define CIFSD_TREE_CONN_FLAG_WRITABLE		(1 << 2)
 #define CIFSD_TREE_CONN_FLAG_ADMIN_ACCOUNT	(1 << 3)
 
+/*
+ * Cache invalidate flags, an empty account or share matches all.
+ */
+#define CIFSD_CACHE_INVALIDATE_LOGIN		(1 << 0)
+#define CIFSD_CACHE_INVALIDATE_TREE_CONNECT	(1 << 1)
+#define CIFSD_CACHE_INVALIDATE_SHARE		(1 << 2)
+
 /*
  * RPC over IPC.
  */
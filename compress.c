@@ -0,0 +1,515 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ *   Copyright (C) 2018 Samsung Electronics Co., Ltd.
+ */
+
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/mutex.h>
+#include <linux/string.h>
+#include <asm-generic/unaligned.h>
+
+#include "glob.h"
+#include "compress.h"
+
+/*
+ * Kernels of the SMB 3.1.1 compression algorithms, see MS-XCA. Responses
+ * are compressed with plain LZ77 only, which is cheap enough to run on the
+ * worker sending them; LZ77+Huffman is decoded for clients preferring it.
+ */
+
+#define LZ77_HASH_BITS		12
+#define LZ77_MIN_MATCH		3
+/* Longest match token: 16 bit match, half byte, byte, 16 and 32 bit length */
+#define LZ77_MAX_TOKEN		10
+
+/* Every 64KiB of LZ77+Huffman output starts with a new code table */
+#define HUFF_BLOCK_SIZE		65536
+#define HUFF_TABLE_SIZE		256
+#define HUFF_SYMBOLS		512
+#define HUFF_MAX_BITS		15
+
+struct cifsd_compress_ws {
+	struct mutex	lock;
+	/* Input position + 1 of the last string of each hash, 0 if none */
+	u32		*hash;
+	/* Huffman symbol of each HUFF_MAX_BITS code prefix */
+	u16		*decode;
+};
+
+static struct cifsd_compress_ws **compress_ws;
+
+static struct cifsd_compress_ws *cifsd_get_compress_ws(bool huff)
+{
+	struct cifsd_compress_ws *ws = compress_ws[raw_smp_processor_id()];
+
+	mutex_lock(&ws->lock);
+	/* Allocated on first use, most connections never compress */
+	if (!huff && !ws->hash)
+		ws->hash = vmalloc(sizeof(u32) << LZ77_HASH_BITS);
+	if (huff && !ws->decode)
+		ws->decode = vmalloc(sizeof(u16) << HUFF_MAX_BITS);
+
+	if ((!huff && !ws->hash) || (huff && !ws->decode)) {
+		mutex_unlock(&ws->lock);
+		return NULL;
+	}
+	return ws;
+}
+
+static void cifsd_put_compress_ws(struct cifsd_compress_ws *ws)
+{
+	mutex_unlock(&ws->lock);
+}
+
+static inline u32 lz77_hash(const u8 *p)
+{
+	return ((get_unaligned_le32(p) & 0xffffff) * 2654435761U) >>
+		(32 - LZ77_HASH_BITS);
+}
+
+/* Length of the common prefix of @match and @ip, up to @end */
+static unsigned int lz77_match_len(const u8 *match, const u8 *ip,
+				   const u8 *end)
+{
+	const u8 *p = ip;
+	u64 diff;
+
+	while (p + 8 <= end) {
+		diff = get_unaligned_le64(p) ^
+			get_unaligned_le64(match + (p - ip));
+		if (diff)
+			return p - ip + (__ffs64(diff) >> 3);
+		p += 8;
+	}
+
+	while (p < end && *p == match[p - ip])
+		p++;
+	return p - ip;
+}
+
+/*
+ * Encode a match, @off being its distance - 1 and @len its length - 3.
+ * Every other length needing more than 3 bits shares a byte with the
+ * previous one, @half points to it while its upper half is free.
+ */
+static u8 *lz77_put_match(u8 *op, u8 **half, unsigned int off,
+			  unsigned int len)
+{
+	unsigned int l;
+
+	if (len < 7) {
+		put_unaligned_le16(off << 3 | len, op);
+		return op + 2;
+	}
+
+	put_unaligned_le16(off << 3 | 7, op);
+	op += 2;
+
+	l = min(len - 7, 15U);
+	if (!*half) {
+		*half = op;
+		*op++ = l;
+	} else {
+		**half |= l << 4;
+		*half = NULL;
+	}
+
+	if (len - 7 < 15)
+		return op;
+
+	l = len - 7 - 15;
+	if (l < 255) {
+		*op++ = l;
+		return op;
+	}
+
+	*op++ = 255;
+	if (len < 65536) {
+		put_unaligned_le16(len, op);
+		return op + 2;
+	}
+	put_unaligned_le16(0, op);
+	put_unaligned_le32(len, op + 2);
+	return op + 6;
+}
+
+/**
+ * cifsd_lz77_compress() - compress a buffer with plain LZ77
+ * @in:		data to compress
+ * @in_len:	length of @in
+ * @out:	buffer for the compressed data
+ * @out_len:	size of @out, compression gives up once it is exceeded
+ *
+ * Return:	length of the compressed data, -E2BIG if it doesn't fit in
+ *		@out, otherwise error
+ */
+int cifsd_lz77_compress(const void *in, unsigned int in_len,
+			void *out, unsigned int out_len)
+{
+	struct cifsd_compress_ws *ws;
+	const u8 *start = in, *ip = in, *end = ip + in_len;
+	const u8 *match = NULL;
+	u8 *op = out, *out_end = op + out_len;
+	u8 *flags_pos, *half = NULL;
+	u32 flags = 0, flag_count = 0, h;
+	unsigned int len;
+	int rc;
+
+	if (out_len < 4)
+		return -E2BIG;
+
+	ws = cifsd_get_compress_ws(false);
+	if (!ws)
+		return -ENOMEM;
+	memset(ws->hash, 0, sizeof(u32) << LZ77_HASH_BITS);
+
+	flags_pos = op;
+	op += 4;
+	while (ip < end) {
+		/* room for the token and the next flags */
+		if (op + LZ77_MAX_TOKEN + 4 > out_end) {
+			rc = -E2BIG;
+			goto out;
+		}
+
+		len = 0;
+		if (ip + 4 <= end) {
+			h = lz77_hash(ip);
+			if (ws->hash[h]) {
+				match = start + ws->hash[h] - 1;
+				if (ip - match <= CIFSD_LZ77_WINDOW)
+					len = lz77_match_len(match, ip, end);
+			}
+			ws->hash[h] = ip - start + 1;
+		}
+
+		if (len >= LZ77_MIN_MATCH) {
+			op = lz77_put_match(op, &half, ip - match - 1,
+					    len - LZ77_MIN_MATCH);
+			flags = flags << 1 | 1;
+			ip += len;
+		} else {
+			*op++ = *ip++;
+			flags <<= 1;
+		}
+
+		if (++flag_count == 32) {
+			put_unaligned_le32(flags, flags_pos);
+			flags = 0;
+			flag_count = 0;
+			flags_pos = op;
+			op += 4;
+		}
+	}
+
+	/* Unused flags are matches, so decoding stops at the end of input */
+	if (flag_count)
+		flags = flags << (32 - flag_count) |
+			((1U << (32 - flag_count)) - 1);
+	else
+		flags = 0xffffffff;
+	put_unaligned_le32(flags, flags_pos);
+	rc = op - (u8 *)out;
+out:
+	cifsd_put_compress_ws(ws);
+	return rc;
+}
+
+static inline void lz77_copy_match(u8 *op, unsigned int dist,
+				   unsigned int len)
+{
+	const u8 *src = op - dist;
+
+	if (dist >= len) {
+		memcpy(op, src, len);
+		return;
+	}
+
+	/* overlapping matches repeat the last dist bytes */
+	while (len--)
+		*op++ = *src++;
+}
+
+/**
+ * cifsd_lz77_decompress() - decompress plain LZ77 data
+ * @in:		compressed data
+ * @in_len:	length of @in
+ * @out:	buffer for the decompressed data
+ * @out_len:	size of @out
+ *
+ * Return:	length of the decompressed data, otherwise error
+ */
+int cifsd_lz77_decompress(const void *in, unsigned int in_len,
+			  void *out, unsigned int out_len)
+{
+	const u8 *ip = in, *in_end = ip + in_len, *half = NULL;
+	u8 *op = out, *out_end = op + out_len;
+	u32 flags = 0;
+	int flag_count = 0;
+	unsigned int len, dist;
+
+	for (;;) {
+		if (!flag_count) {
+			if (ip + 4 > in_end)
+				break;
+			flags = get_unaligned_le32(ip);
+			ip += 4;
+			flag_count = 32;
+		}
+
+		flag_count--;
+		if (!(flags & (1U << flag_count))) {
+			if (ip >= in_end)
+				break;
+			if (op >= out_end)
+				return -EINVAL;
+			*op++ = *ip++;
+			continue;
+		}
+
+		if (ip == in_end)
+			break;
+		if (ip + 2 > in_end)
+			return -EINVAL;
+		len = get_unaligned_le16(ip);
+		ip += 2;
+		dist = (len >> 3) + 1;
+		len &= 7;
+
+		if (len == 7) {
+			if (!half) {
+				if (ip >= in_end)
+					return -EINVAL;
+				half = ip;
+				len = *ip++ & 15;
+			} else {
+				len = *half >> 4;
+				half = NULL;
+			}
+
+			if (len == 15) {
+				if (ip >= in_end)
+					return -EINVAL;
+				len = *ip++;
+				if (len == 255) {
+					if (ip + 2 > in_end)
+						return -EINVAL;
+					len = get_unaligned_le16(ip);
+					ip += 2;
+					if (!len) {
+						if (ip + 4 > in_end)
+							return -EINVAL;
+						len = get_unaligned_le32(ip);
+						ip += 4;
+					}
+					if (len < 15 + 7)
+						return -EINVAL;
+					len -= 15 + 7;
+				}
+				len += 15;
+			}
+			len += 7;
+		}
+		len += LZ77_MIN_MATCH;
+
+		if (dist > op - (u8 *)out || len > out_end - op)
+			return -EINVAL;
+		lz77_copy_match(op, dist, len);
+		op += len;
+	}
+
+	return op - (u8 *)out;
+}
+
+static inline unsigned int huff_sym_len(const u8 *lens, unsigned int sym)
+{
+	return (lens[sym >> 1] >> ((sym & 1) * 4)) & 15;
+}
+
+/* Build the canonical code prefix table of 4 bit symbol lengths @lens */
+static int huff_build_table(u16 *table, const u8 *lens)
+{
+	unsigned int entry = 0, bits, sym, n;
+
+	for (bits = 1; bits <= HUFF_MAX_BITS; bits++) {
+		for (sym = 0; sym < HUFF_SYMBOLS; sym++) {
+			if (huff_sym_len(lens, sym) != bits)
+				continue;
+
+			n = 1 << (HUFF_MAX_BITS - bits);
+			if (entry + n > 1 << HUFF_MAX_BITS)
+				return -EINVAL;
+			while (n--)
+				table[entry++] = sym;
+		}
+	}
+
+	return entry == 1 << HUFF_MAX_BITS ? 0 : -EINVAL;
+}
+
+/* The bit stream may be read ahead past the end of input, as zeroes */
+static inline u32 huff_read16(const u8 **ip, const u8 *in_end)
+{
+	u32 v;
+
+	if (*ip + 2 > in_end)
+		return 0;
+	v = get_unaligned_le16(*ip);
+	*ip += 2;
+	return v;
+}
+
+/**
+ * cifsd_lz77_huff_decompress() - decompress LZ77+Huffman data
+ * @in:		compressed data
+ * @in_len:	length of @in
+ * @out:	buffer for the decompressed data
+ * @out_len:	length of the decompressed data
+ *
+ * Return:	length of the decompressed data, otherwise error
+ */
+int cifsd_lz77_huff_decompress(const void *in, unsigned int in_len,
+			       void *out, unsigned int out_len)
+{
+	struct cifsd_compress_ws *ws;
+	const u8 *ip = in, *in_end = ip + in_len, *lens;
+	u8 *op = out, *out_end = op + out_len, *block_end;
+	unsigned int sym, n, len, obits, dist;
+	u32 bits;
+	int extra, rc = -EINVAL;
+
+	ws = cifsd_get_compress_ws(true);
+	if (!ws)
+		return -ENOMEM;
+
+	while (op < out_end) {
+		if (ip + HUFF_TABLE_SIZE + 4 > in_end)
+			goto out;
+		lens = ip;
+		if (huff_build_table(ws->decode, lens))
+			goto out;
+		ip += HUFF_TABLE_SIZE;
+
+		bits = (u32)get_unaligned_le16(ip) << 16 |
+			get_unaligned_le16(ip + 2);
+		ip += 4;
+		extra = 16;
+
+		block_end = op + min_t(size_t, HUFF_BLOCK_SIZE, out_end - op);
+		while (op < block_end) {
+			sym = ws->decode[bits >> (32 - HUFF_MAX_BITS)];
+			n = huff_sym_len(lens, sym);
+			bits <<= n;
+			extra -= n;
+			if (extra < 0) {
+				bits |= huff_read16(&ip, in_end) << -extra;
+				extra += 16;
+			}
+
+			if (sym < 256) {
+				*op++ = sym;
+				continue;
+			}
+
+			sym -= 256;
+			len = sym & 15;
+			obits = sym >> 4;
+			if (len == 15) {
+				if (ip >= in_end)
+					goto out;
+				len = *ip++;
+				if (len == 255) {
+					if (ip + 2 > in_end)
+						goto out;
+					len = get_unaligned_le16(ip);
+					ip += 2;
+					if (len < 15)
+						goto out;
+					len -= 15;
+				}
+				len += 15;
+			}
+			len += LZ77_MIN_MATCH;
+
+			dist = obits ? bits >> (32 - obits) : 0;
+			dist += 1 << obits;
+			bits <<= obits;
+			extra -= obits;
+			if (extra < 0) {
+				bits |= huff_read16(&ip, in_end) << -extra;
+				extra += 16;
+			}
+
+			if (dist > op - (u8 *)out || len > out_end - op)
+				goto out;
+			lz77_copy_match(op, dist, len);
+			op += len;
+		}
+	}
+	rc = op - (u8 *)out;
+out:
+	cifsd_put_compress_ws(ws);
+	return rc;
+}
+
+/**
+ * cifsd_pattern_v1_detect() - check if a buffer repeats a single byte
+ * @buf:	data to check
+ * @len:	length of @buf
+ * @pattern:	the repeated byte, if any
+ *
+ * Return:	true if @buf can be sent as a Pattern_V1 payload
+ */
+bool cifsd_pattern_v1_detect(const void *buf, unsigned int len, u8 *pattern)
+{
+	const u8 *p = buf;
+
+	if (!len || memchr_inv(p + 1, p[0], len - 1))
+		return false;
+
+	*pattern = p[0];
+	return true;
+}
+
+void cifsd_compress_destroy(void)
+{
+	struct cifsd_compress_ws *ws;
+	int cpu;
+
+	if (!compress_ws)
+		return;
+
+	for_each_possible_cpu(cpu) {
+		ws = compress_ws[cpu];
+		if (!ws)
+			continue;
+		vfree(ws->hash);
+		vfree(ws->decode);
+		kfree(ws);
+	}
+	kfree(compress_ws);
+	compress_ws = NULL;
+}
+
+int cifsd_compress_init(void)
+{
+	struct cifsd_compress_ws *ws;
+	int cpu;
+
+	compress_ws = kcalloc(nr_cpu_ids, sizeof(*compress_ws), GFP_KERNEL);
+	if (!compress_ws)
+		return -ENOMEM;
+
+	for_each_possible_cpu(cpu) {
+		ws = kzalloc_node(sizeof(*ws), GFP_KERNEL, cpu_to_node(cpu));
+		if (!ws) {
+			cifsd_compress_destroy();
+			return -ENOMEM;
+		}
+		mutex_init(&ws->lock);
+		compress_ws[cpu] = ws;
+	}
+	return 0;
+}
@@ -0,0 +1,25 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ *   Copyright (C) 2018 Samsung Electronics Co., Ltd.
+ */
+
+#ifndef __CIFSD_COMPRESS_H__
+#define __CIFSD_COMPRESS_H__
+
+#include <linux/types.h>
+
+/* Largest match distance of the plain LZ77 format, see MS-XCA 2.3 */
+#define CIFSD_LZ77_WINDOW	8192
+
+int cifsd_lz77_compress(const void *in, unsigned int in_len,
+			void *out, unsigned int out_len);
+int cifsd_lz77_decompress(const void *in, unsigned int in_len,
+			  void *out, unsigned int out_len);
+int cifsd_lz77_huff_decompress(const void *in, unsigned int in_len,
+			       void *out, unsigned int out_len);
+bool cifsd_pattern_v1_detect(const void *buf, unsigned int len, u8 *pattern);
+
+void cifsd_compress_destroy(void);
+int cifsd_compress_init(void);
+
+#endif /* __CIFSD_COMPRESS_H__ */
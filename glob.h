@@ -46,6 +46,7 @@ extern int cifsd_debugging;
 extern int cifsd_caseless_search;
 extern bool oplocks_enable;
 extern bool lease_enable;
+extern bool dir_lease_enable;
 extern bool durable_enable;
 extern bool multi_channel_enable;
 
@@ -79,12 +80,16 @@ extern bool multi_channel_enable;
  *  * Size of the smb3 signing key
  *   */
 #define SMB3_SIGN_KEY_SIZE (16)
+/* AES-256 encryption keys */
+#define SMB3_ENC_KEY_SIZE_MAX (32)
 
 #define CIFS_CLIENT_CHALLENGE_SIZE (8)
 #define CIFS_SERVER_CHALLENGE_SIZE (8)
 
 /* SMB2 Max Credits */
 #define SMB2_MAX_CREDITS 8192
+/* Credits a connection may have outstanding at first */
+#define SMB2_INIT_CREDIT_WINDOW	(SMB2_MAX_CREDITS >> 4)
 
 #define SMB2_CLIENT_GUID_SIZE		16
 #define SMB2_CREATE_GUID_SIZE		16
@@ -119,6 +124,23 @@ enum asyncEnum {
 
 struct cifsd_tcp_conn;
 
+#define SMB2_REQ_MAX_AREAS	2
+
+/* Variable area of a request, the offset is from its ProtocolId */
+struct smb2_req_area {
+	unsigned int	off;
+	unsigned int	len;
+};
+
+/* SMB2 request being processed, decoded by cifsd_smb2_check_message() */
+struct smb2_req_view {
+	/* struct smb2_hdr of the request, within a compound */
+	void			*hdr;
+	/* up to the next command */
+	unsigned int		len;
+	struct smb2_req_area	area[SMB2_REQ_MAX_AREAS];
+};
+
 /* one of these for every pending CIFS request at the connection */
 struct cifsd_work {
 	/* Server corresponding to this mid */
@@ -128,6 +150,11 @@ struct cifsd_work {
 
 	/* Pointer to received SMB header */
 	char				*request_buf;
+	/* Offset of the SMB message in request_buf, e.g. after decryption */
+	unsigned int			request_offset;
+	/* Bulk write data received into pages, following request_buf */
+	struct bio_vec			*request_bvec;
+	unsigned int			request_nr_bvec;
 	/* Response buffer */
 	char				*response_buf;
 	unsigned int			response_sz;
@@ -138,13 +165,18 @@ struct cifsd_work {
 	unsigned int			aux_payload_sz;
 	/* response smb header size */
 	unsigned int			resp_hdr_sz;
+	/* Read data pages spliced from the page cache, instead of the buffer */
+	struct bio_vec			*aux_payload_bvec;
+	unsigned int			aux_payload_nr_bvec;
 
 	/* Next cmd hdr in compound req buf*/
 	int				next_smb2_rcv_hdr_off;
+	/* Current cmd in compound req buf */
+	struct smb2_req_view		req_view;
 	/* Next cmd hdr in compound rsp buf*/
 	int				next_smb2_rsp_hdr_off;
 
-	/* Transform header buffer */
+	/* Transform header, in the headroom of the response buffer */
 	void				*tr_buf;
 	int				type;
 
@@ -155,6 +187,8 @@ struct cifsd_work {
 	unsigned int			compound_fid;
 	unsigned int			compound_pfid;
 	unsigned int			compound_sid;
+	/* Handle of compound_fid, referenced */
+	struct cifsd_file		*compound_fp;
 
 	int				state;
 
@@ -168,6 +202,18 @@ struct cifsd_work {
 	bool				on_request_list:1;
 	/* Request is encrypted */
 	bool				encrypted:1;
+	/* Request is processed under conn->srv_mutex */
+	bool				serialized:1;
+	/* Request was queued by cifsd_qos_admit(), resumes processing */
+	bool				qos_queued:1;
+	/* Response is being encrypted, resumes sending */
+	bool				crypt_pending:1;
+	/* Response may be sent compressed, see smb3_compress_resp() */
+	bool				compress_rsp:1;
+	/* Response is completed outside of the worker, resumes sending */
+	bool				async_pending:1;
+	/* An async_pending request resumes processing instead of sending */
+	bool				async_retry:1;
 
 	/* smb command code */
 	__le16				command;
@@ -176,24 +222,45 @@ struct cifsd_work {
 	struct list_head		request_entry;
 	struct work_struct		work;
 
+	/* QoS cost and entry on the session queue, see cifsd_qos_admit() */
+	struct list_head		qos_entry;
+	unsigned int			qos_ios;
+	unsigned int			qos_bytes;
+
+	/* Credits charged by the requests of the compound */
+	unsigned int			credit_charge;
+
+	/* cifsd_stats_clock() when received, until processing started */
+	u64				queued_ns;
+
+	/* Result of the asynchronous response encryption */
+	int				crypt_err;
+
 	/* cancel works */
 	int				async_id;
 	void				**cancel_argv;
 	void				(*cancel_fn)(void **argv);
+	/* Starts the completion of an async_pending request */
+	void				(*async_start)(struct cifsd_work *work);
+	void				*async_data;
 	struct list_head		fp_entry;
 	struct list_head		interim_entry;
+	/* Entry on the break_waiters of an oplock, see smb_break_oplock_wait() */
+	struct list_head		break_entry;
 };
 
 #define RESPONSE_BUF(w)		(void *)((w)->response_buf)
 #define RESPONSE_SZ(w)		((w)->response_sz)
 
-#define REQUEST_BUF(w)		(void *)((w)->request_buf)
+#define REQUEST_BUF(w)		(void *)((w)->request_buf + (w)->request_offset)
+#define HAS_REQUEST_PAGES(w)	((w)->request_nr_bvec != 0)
 
 #define INIT_AUX_PAYLOAD(w)	((w)->aux_payload_buf = NULL)
 #define HAS_AUX_PAYLOAD(w)	((w)->aux_payload_sz != 0)
 #define AUX_PAYLOAD(w)		(void *)((w)->aux_payload_buf)
 #define AUX_PAYLOAD_SIZE(w)	((w)->aux_payload_sz)
 #define RESP_HDR_SIZE(w)	((w)->resp_hdr_sz)
+#define HAS_AUX_PAYLOAD_PAGES(w)	((w)->aux_payload_nr_bvec != 0)
 
 #define HAS_TRANSFORM_BUF(w)	((w)->tr_buf != NULL)
 #define TRANSFORM_BUF(w)	(void *)((w)->tr_buf)
@@ -8,8 +8,12 @@
 #include <linux/slab.h>
 #include <linux/rwsem.h>
 #include <linux/parser.h>
+#include <linux/module.h>
+#include <linux/jiffies.h>
+#include <linux/err.h>
 
 #include "share_config.h"
+#include "veto_matcher.h"
 #include "../buffer_pool.h"
 #include "../transport_ipc.h"
 #include "../cifsd_server.h" /* FIXME */
@@ -18,9 +22,24 @@
 static DEFINE_HASHTABLE(shares_table, SHARE_HASH_BITS);
 static DECLARE_RWSEM(shares_table_lock);
 
-struct cifsd_veto_pattern {
-	char			*pattern;
-	struct list_head	list;
+/*
+ * Names the daemon reported as unknown, so that clients probing for
+ * shares don't upcall on every tree connect. Protected by
+ * shares_table_lock.
+ */
+#define SHARE_NEGATIVE_MAX	256
+static DEFINE_HASHTABLE(negative_table, SHARE_HASH_BITS);
+static unsigned int negative_nr;
+
+static unsigned int share_negative_ttl = 5;
+module_param(share_negative_ttl, uint, 0644);
+MODULE_PARM_DESC(share_negative_ttl,
+	"Seconds unknown share names are remembered, 0 to disable. Default: 5");
+
+struct share_negative_entry {
+	struct hlist_node	hlist;
+	unsigned long		expires;
+	char			name[0];
 };
 
 static unsigned int share_name_hash(char *name)
@@ -30,19 +49,11 @@ static unsigned int share_name_hash(char *name)
 
 static void kill_share(struct cifsd_share_config *share)
 {
-	while (!list_empty(&share->veto_list)) {
-		struct cifsd_veto_pattern *p;
-
-		p = list_entry(share->veto_list.next,
-			       struct cifsd_veto_pattern,
-			       list);
-		list_del(&p->list);
-		kfree(p->pattern);
-		kfree(p);
-	}
+	cifsd_veto_matcher_free(share->veto);
 
 	if (share->path)
 		path_put(&share->vfs_path);
+	cifsd_io_stats_free(share->io_stats);
 	kfree(share->name);
 	kfree(share->path);
 	kfree(share);
@@ -86,64 +97,112 @@ static struct cifsd_share_config *__share_lookup(char *name)
 	return NULL;
 }
 
-static int parse_veto_list(struct cifsd_share_config *share,
-			   char *veto_list,
-			   int veto_list_sz)
+/*
+ * Remove @share from the table, dropping the reference a preloaded
+ * share is held by. Called with shares_table_lock held for write.
+ */
+static void __share_unhash(struct cifsd_share_config *share)
 {
-	int sz = 0;
-
-	if (!veto_list_sz)
-		return 0;
+	hash_del(&share->hlist);
+	if (!share->preloaded)
+		return;
 
-	while (veto_list_sz > 0) {
-		struct cifsd_veto_pattern *p;
+	share->preloaded = false;
+	if (atomic_dec_and_test(&share->refcount))
+		schedule_work(&share->free_work);
+}
 
-		p = cifsd_alloc(sizeof(struct cifsd_veto_pattern));
-		if (!p)
-			return -ENOMEM;
+static struct share_negative_entry *__negative_lookup(char *name)
+{
+	struct share_negative_entry *e;
 
-		sz = strlen(veto_list);
-		if (!sz)
-			break;
+	hash_for_each_possible(negative_table, e, hlist,
+			       share_name_hash(name)) {
+		if (!strcmp(name, e->name))
+			return e;
+	}
+	return NULL;
+}
 
-		p->pattern = kstrdup(veto_list, GFP_KERNEL);
-		if (!p->pattern) {
-			cifsd_free(p);
-			return -ENOMEM;
-		}
+static void __negative_del(struct share_negative_entry *e)
+{
+	hash_del(&e->hlist);
+	negative_nr--;
+	kfree(e);
+}
 
-		list_add(&p->list, &share->veto_list);
+static void __negative_prune(void)
+{
+	struct share_negative_entry *e;
+	struct hlist_node *tmp;
+	int i;
 
-		veto_list += sz + 1;
-		veto_list_sz -= (sz + 1);
+	hash_for_each_safe(negative_table, i, tmp, e, hlist) {
+		if (time_after_eq(jiffies, e->expires))
+			__negative_del(e);
 	}
+}
 
-	return 0;
+static bool share_negative_cached(char *name)
+{
+	struct share_negative_entry *e;
+	bool cached;
+
+	down_read(&shares_table_lock);
+	e = __negative_lookup(name);
+	cached = e && time_before(jiffies, e->expires);
+	up_read(&shares_table_lock);
+	return cached;
 }
 
-static struct cifsd_share_config *share_config_request(char *name)
+static void share_negative_add(char *name)
 {
-	struct cifsd_share_config_response *resp;
-	struct cifsd_share_config *share = NULL;
-	struct cifsd_share_config *lookup;
-	int ret;
+	struct share_negative_entry *e, *old;
+	size_t len = strlen(name) + 1;
 
-	resp = cifsd_ipc_share_config_request(name);
-	if (!resp)
-		return NULL;
+	if (!share_negative_ttl)
+		return;
 
-	if (resp->flags == CIFSD_SHARE_FLAG_INVALID)
-		goto out;
+	e = kmalloc(sizeof(struct share_negative_entry) + len, GFP_KERNEL);
+	if (!e)
+		return;
+	memcpy(e->name, name, len);
+	e->expires = jiffies + share_negative_ttl * HZ;
+
+	down_write(&shares_table_lock);
+	if (negative_nr >= SHARE_NEGATIVE_MAX)
+		__negative_prune();
+	old = __negative_lookup(name);
+	if (old)
+		old->expires = e->expires;
+	if (old || __share_lookup(name) ||
+	    negative_nr >= SHARE_NEGATIVE_MAX) {
+		up_write(&shares_table_lock);
+		kfree(e);
+		return;
+	}
+	hash_add(negative_table, &e->hlist, share_name_hash(name));
+	negative_nr++;
+	up_write(&shares_table_lock);
+}
+
+static struct cifsd_share_config *
+share_config_build(char *name, struct cifsd_share_config_response *resp)
+{
+	struct cifsd_share_config *share;
+	int ret = 0;
 
 	share = cifsd_alloc(sizeof(struct cifsd_share_config));
 	if (!share)
-		goto out;
+		return NULL;
 
 	share->flags = resp->flags;
 	atomic_set(&share->refcount, 1);
 	INIT_WORK(&share->free_work, deferred_share_free);
-	INIT_LIST_HEAD(&share->veto_list);
 	share->name = kstrdup(name, GFP_KERNEL);
+	share->io_stats = cifsd_io_stats_alloc();
+	if (!share->io_stats)
+		ret = -ENOMEM;
 
 	if (!test_share_config_flag(share, CIFSD_SHARE_FLAG_PIPE)) {
 		share->path = kstrdup(CIFSD_SHARE_CONFIG_PATH(resp),
@@ -154,9 +213,16 @@ static struct cifsd_share_config *share_config_request(char *name)
 		share->directory_mask = resp->directory_mask;
 		share->force_uid = resp->force_uid;
 		share->force_gid = resp->force_gid;
-		ret = parse_veto_list(share,
-				      CIFSD_SHARE_CONFIG_VETO_LIST(resp),
-				      resp->veto_list_sz);
+		cifsd_qos_bucket_init(&share->qos, resp->qos_max_iops,
+				      (u64)resp->qos_max_kbps * 1024);
+		share->qos_weight = resp->qos_weight;
+		share->veto = cifsd_veto_matcher_compile(
+					CIFSD_SHARE_CONFIG_VETO_LIST(resp),
+					resp->veto_list_sz);
+		if (IS_ERR(share->veto)) {
+			ret = PTR_ERR(share->veto);
+			share->veto = NULL;
+		}
 		if (!ret && share->path) {
 			ret = kern_path(share->path, 0, &share->vfs_path);
 			if (ret) {
@@ -165,13 +231,34 @@ static struct cifsd_share_config *share_config_request(char *name)
 				share->path = NULL;
 			}
 		}
-		if (ret || !share->name) {
-			kill_share(share);
-			share = NULL;
-			goto out;
-		}
 	}
 
+	if (ret || !share->name) {
+		kill_share(share);
+		return NULL;
+	}
+	return share;
+}
+
+static struct cifsd_share_config *share_config_request(char *name)
+{
+	struct cifsd_share_config_response *resp;
+	struct cifsd_share_config *share = NULL;
+	struct cifsd_share_config *lookup;
+
+	resp = cifsd_ipc_share_config_request(name);
+	if (!resp)
+		return NULL;
+
+	if (resp->flags == CIFSD_SHARE_FLAG_INVALID) {
+		share_negative_add(name);
+		goto out;
+	}
+
+	share = share_config_build(name, resp);
+	if (!share)
+		goto out;
+
 	down_write(&shares_table_lock);
 	lookup = __share_lookup(name);
 	if (lookup)
@@ -211,24 +298,106 @@ struct cifsd_share_config *cifsd_share_config_get(char *name)
 
 	if (share)
 		return share;
+	if (share_negative_cached(name))
+		return NULL;
 	return share_config_request(name);
 }
 
+/**
+ * cifsd_share_config_preload() - install a share pushed by the daemon
+ * @name:	share name
+ * @resp:	share configuration
+ *
+ * The share replaces any cached config of the same name and stays in
+ * the table until it is invalidated, a share with no flags is removed.
+ *
+ * Return:	0 on success, otherwise error
+ */
+int cifsd_share_config_preload(char *name,
+			       struct cifsd_share_config_response *resp)
+{
+	struct cifsd_share_config *share = NULL;
+	struct cifsd_share_config *lookup;
+	struct share_negative_entry *e;
+
+	strtolower(name);
+
+	if (resp->flags != CIFSD_SHARE_FLAG_INVALID) {
+		share = share_config_build(name, resp);
+		if (!share)
+			return -ENOMEM;
+		share->preloaded = true;
+	}
+
+	down_write(&shares_table_lock);
+	lookup = __share_lookup(name);
+	if (lookup)
+		__share_unhash(lookup);
+	e = __negative_lookup(name);
+	if (e)
+		__negative_del(e);
+	if (share)
+		hash_add(shares_table, &share->hlist, share_name_hash(name));
+	up_write(&shares_table_lock);
+	return 0;
+}
+
+/**
+ * cifsd_share_config_invalidate() - forget cached share configs
+ * @name:	share name, NULL or empty for all shares
+ *
+ * Connected trees keep their config, the next tree connect of the
+ * share asks the daemon again.
+ */
+void cifsd_share_config_invalidate(const char *name)
+{
+	struct cifsd_share_config *share;
+	struct share_negative_entry *e;
+	struct hlist_node *tmp;
+	int i;
+
+	down_write(&shares_table_lock);
+	hash_for_each_safe(shares_table, i, tmp, share, hlist) {
+		if (name && name[0] && strcasecmp(name, share->name))
+			continue;
+		__share_unhash(share);
+	}
+	hash_for_each_safe(negative_table, i, tmp, e, hlist) {
+		if (name && name[0] && strcasecmp(name, e->name))
+			continue;
+		__negative_del(e);
+	}
+	up_write(&shares_table_lock);
+}
+
 bool cifsd_share_veto_filename(struct cifsd_share_config *share,
 			       const char *filename)
 {
-	struct cifsd_veto_pattern *p;
+	return share->veto && cifsd_veto_matcher_match(share->veto, filename);
+}
 
-	list_for_each_entry(p, &share->veto_list, list) {
-		if (match_wildcard(p->pattern, filename))
-			return true;
-	}
-	return false;
+/**
+ * cifsd_shares_io_top() - collect the shares with the most I/O
+ * @top:	top-N collection
+ *
+ * Only the shares in the table are looked at, an invalidated share
+ * still used by tree connects is not.
+ */
+void cifsd_shares_io_top(struct cifsd_io_top *top)
+{
+	struct cifsd_share_config *share;
+	int i;
+
+	down_read(&shares_table_lock);
+	hash_for_each(shares_table, i, share, hlist)
+		cifsd_io_top_add(top, 0, share->name, share->io_stats);
+	up_read(&shares_table_lock);
 }
 
 void cifsd_share_configs_cleanup(void)
 {
 	struct cifsd_share_config *share;
+	struct share_negative_entry *e;
 	struct hlist_node *tmp;
 	int i;
 
@@ -237,5 +406,7 @@ void cifsd_share_configs_cleanup(void)
 		hash_del(&share->hlist);
 		kill_share(share);
 	}
+	hash_for_each_safe(negative_table, i, tmp, e, hlist)
+		__negative_del(e);
 	up_write(&shares_table_lock);
 }
@@ -11,6 +11,11 @@
 #include <linux/path.h>
 
 #include "../glob.h"  /* FIXME */
+#include "../qos.h"
+#include "../stats.h"
+
+struct cifsd_veto_matcher;
+struct cifsd_share_config_response;
 
 struct cifsd_share_config {
 	char			*name;
@@ -18,7 +23,9 @@ struct cifsd_share_config {
 
 	unsigned int		path_sz;
 	unsigned int		flags;
-	struct list_head	veto_list;
+	struct cifsd_veto_matcher *veto;
+	/* held by the table until invalidated */
+	bool			preloaded;
 
 	struct path		vfs_path;
 
@@ -29,6 +36,12 @@ struct cifsd_share_config {
 	unsigned short		directory_mask;
 	unsigned short		force_uid;
 	unsigned short		force_gid;
+
+	/* Rate limit of all sessions on the share */
+	struct cifsd_qos_bucket	qos;
+	unsigned int		qos_weight;
+
+	struct cifsd_io_stats __percpu *io_stats;
 };
 
 static inline int share_config_create_mask(struct cifsd_share_config *share)
@@ -57,8 +70,12 @@ static inline void cifsd_share_config_put(struct cifsd_share_config *share)
 }
 
 struct cifsd_share_config *cifsd_share_config_get(char *name);
+int cifsd_share_config_preload(char *name,
+			       struct cifsd_share_config_response *resp);
+void cifsd_share_config_invalidate(const char *name);
 bool cifsd_share_veto_filename(struct cifsd_share_config *share,
 			       const char *filename);
 void cifsd_share_configs_cleanup(void);
+void cifsd_shares_io_top(struct cifsd_io_top *top);
 
 #endif /* __SHARE_CONFIG_MANAGEMENT_H__ */
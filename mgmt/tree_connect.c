@@ -5,11 +5,14 @@
 
 #include <linux/list.h>
 #include <linux/slab.h>
+#include <linux/namei.h>
+#include <linux/dcache.h>
 
 #include "../cifsd_server.h" /* FIXME */
 #include "../buffer_pool.h"
 #include "../transport_ipc.h"
 #include "../transport_tcp.h"
+#include "../vfs_cache.h"
 
 #include "tree_connect.h"
 #include "user_config.h"
@@ -58,6 +61,11 @@ cifsd_tree_conn_connect(struct cifsd_session *sess, char *share_name)
 	tree_conn->flags = resp->connection_flags;
 	tree_conn->user = sess->user;
 	tree_conn->share_conf = sc;
+	spin_lock_init(&tree_conn->dir_cache_lock);
+	/* without the share root, names are looked up from / */
+	if (sc->path && kern_path(sc->path, LOOKUP_FOLLOW | LOOKUP_DIRECTORY,
+				  &tree_conn->share_path))
+		tree_conn->share_path.dentry = NULL;
 	status.tree_conn = tree_conn;
 
 	list_add(&tree_conn->list, &sess->tree_conn_list);
@@ -74,6 +82,23 @@ out_error:
 	return status;
 }
 
+static void tree_conn_dir_release(struct cifsd_tree_conn_dir *dir)
+{
+	kfree(dir->name);
+	dir->name = NULL;
+	path_put(&dir->path);
+}
+
+static void tree_conn_dir_cache_free(struct cifsd_tree_connect *tree_conn)
+{
+	int i;
+
+	for (i = 0; i < CIFSD_TREE_CONN_DIR_CACHE; i++) {
+		if (tree_conn->dir_cache[i].name)
+			tree_conn_dir_release(&tree_conn->dir_cache[i]);
+	}
+}
+
 int cifsd_tree_conn_disconnect(struct cifsd_session *sess,
 			       struct cifsd_tree_connect *tree_conn)
 {
@@ -81,7 +106,12 @@ int cifsd_tree_conn_disconnect(struct cifsd_session *sess,
 
 	ret = cifsd_ipc_tree_disconnect_request(sess->id, tree_conn->id);
 	cifsd_release_tree_conn_id(sess, tree_conn->id);
+	cmpxchg(&sess->last_tcon, tree_conn, NULL);
 	list_del(&tree_conn->list);
+	cifsd_deferred_close_flush(tree_conn);
+	tree_conn_dir_cache_free(tree_conn);
+	if (tree_conn->share_path.dentry)
+		path_put(&tree_conn->share_path);
 	cifsd_share_config_put(tree_conn->share_conf);
 	cifsd_free(tree_conn);
 	return ret;
@@ -93,10 +123,17 @@ struct cifsd_tree_connect *cifsd_tree_conn_lookup(struct cifsd_session *sess,
 	struct cifsd_tree_connect *tree_conn;
 	struct list_head *tmp;
 
+	/* requests of a session mostly go to the same tree */
+	tree_conn = READ_ONCE(sess->last_tcon);
+	if (tree_conn && tree_conn->id == id)
+		return tree_conn;
+
 	list_for_each(tmp, &sess->tree_conn_list) {
 		tree_conn = list_entry(tmp, struct cifsd_tree_connect, list);
-		if (tree_conn->id == id)
+		if (tree_conn->id == id) {
+			WRITE_ONCE(sess->last_tcon, tree_conn);
 			return tree_conn;
+		}
 	}
 	return NULL;
 }
@@ -127,3 +164,77 @@ int cifsd_tree_conn_session_logoff(struct cifsd_session *sess)
 
 	return ret;
 }
+
+/**
+ * cifsd_tree_conn_lookup_dir() - look up a recently used parent directory
+ * @tree_conn:	tree connect
+ * @name:	directory, relative to the share root
+ * @name_len:	length of @name
+ * @path:	set to the directory, to be released with path_put()
+ *
+ * An entry is only used while no rename happened since its lookup and
+ * while its directory isn't removed, so that it is still what @name
+ * resolves to.
+ *
+ * Return:	0 on success, otherwise -ENOENT
+ */
+int cifsd_tree_conn_lookup_dir(struct cifsd_tree_connect *tree_conn,
+			       const char *name, unsigned int name_len,
+			       struct path *path)
+{
+	struct cifsd_tree_conn_dir *dir;
+	int i, ret = -ENOENT;
+
+	spin_lock(&tree_conn->dir_cache_lock);
+	for (i = 0; i < CIFSD_TREE_CONN_DIR_CACHE; i++) {
+		dir = &tree_conn->dir_cache[i];
+		if (!dir->name || dir->name_len != name_len ||
+		    memcmp(dir->name, name, name_len))
+			continue;
+
+		if (!read_seqretry(&rename_lock, dir->seq) &&
+		    !d_unhashed(dir->path.dentry)) {
+			*path = dir->path;
+			path_get(path);
+			ret = 0;
+		}
+		break;
+	}
+	spin_unlock(&tree_conn->dir_cache_lock);
+	return ret;
+}
+
+/**
+ * cifsd_tree_conn_cache_dir() - keep a parent directory for later lookups
+ * @tree_conn:	tree connect
+ * @name:	directory, relative to the share root
+ * @name_len:	length of @name
+ * @path:	directory @name resolved to
+ * @seq:	rename_lock sequence sampled before @name was looked up
+ */
+void cifsd_tree_conn_cache_dir(struct cifsd_tree_connect *tree_conn,
+			       const char *name, unsigned int name_len,
+			       struct path *path, unsigned int seq)
+{
+	struct cifsd_tree_conn_dir *dir, old = { .name = NULL };
+	char *dup;
+
+	dup = kmemdup(name, name_len, GFP_KERNEL);
+	if (!dup)
+		return;
+
+	spin_lock(&tree_conn->dir_cache_lock);
+	dir = &tree_conn->dir_cache[tree_conn->dir_cache_next];
+	tree_conn->dir_cache_next = (tree_conn->dir_cache_next + 1) %
+		CIFSD_TREE_CONN_DIR_CACHE;
+	old = *dir;
+	dir->name = dup;
+	dir->name_len = name_len;
+	dir->path = *path;
+	path_get(&dir->path);
+	dir->seq = seq;
+	spin_unlock(&tree_conn->dir_cache_lock);
+
+	if (old.name)
+		tree_conn_dir_release(&old);
+}
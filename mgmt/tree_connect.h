@@ -7,12 +7,26 @@
 #define __TREE_CONNECT_MANAGEMENT_H__
 
 #include <linux/hashtable.h>
+#include <linux/path.h>
+#include <linux/spinlock.h>
 
 #include "../cifsd_server.h" /* FIXME */
 
 struct cifsd_share_config;
 struct cifsd_user;
 
+/* Parent directories of recent CREATEs kept by a tree connect */
+#define CIFSD_TREE_CONN_DIR_CACHE	8
+
+struct cifsd_tree_conn_dir {
+	/* directory, relative to the share root */
+	char				*name;
+	unsigned int			name_len;
+	struct path			path;
+	/* rename_lock sequence the lookup of the directory was done at */
+	unsigned int			seq;
+};
+
 struct cifsd_tree_connect {
 	int				id;
 
@@ -23,6 +37,12 @@ struct cifsd_tree_connect {
 	struct list_head		list;
 
 	int				maximal_access;
+
+	/* share root, lookups of share names start from it */
+	struct path			share_path;
+	spinlock_t			dir_cache_lock;
+	unsigned int			dir_cache_next;
+	struct cifsd_tree_conn_dir	dir_cache[CIFSD_TREE_CONN_DIR_CACHE];
 };
 
 struct cifsd_tree_conn_status {
@@ -52,4 +72,11 @@ struct cifsd_share_config *cifsd_tree_conn_share(struct cifsd_session *sess,
 
 int cifsd_tree_conn_session_logoff(struct cifsd_session *sess);
 
+int cifsd_tree_conn_lookup_dir(struct cifsd_tree_connect *tree_conn,
+			       const char *name, unsigned int name_len,
+			       struct path *path);
+void cifsd_tree_conn_cache_dir(struct cifsd_tree_connect *tree_conn,
+			       const char *name, unsigned int name_len,
+			       struct path *path, unsigned int seq);
+
 #endif /* __TREE_CONNECT_MANAGEMENT_H__ */
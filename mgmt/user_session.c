@@ -5,7 +5,7 @@
 
 #include <linux/list.h>
 #include <linux/slab.h>
-#include <linux/rwsem.h>
+#include <linux/rcupdate.h>
 
 #include "cifsd_ida.h"
 #include "user_session.h"
@@ -14,14 +14,17 @@
 #include "../transport_ipc.h"
 #include "../transport_tcp.h"
 #include "../buffer_pool.h"
+#include "../auth.h"
 #include "../cifsd_server.h" /* FIXME */
 #include "../vfs_cache.h"
+#include "../qos.h"
 
 static struct cifsd_ida *session_ida;
 
 #define SESSION_HASH_BITS		3
 static DEFINE_HASHTABLE(sessions_table, SESSION_HASH_BITS);
-static DECLARE_RWSEM(sessions_table_lock);
+/* Serializes writers of sessions_table, lookups walk it under RCU */
+static DEFINE_SPINLOCK(sessions_table_lock);
 
 struct cifsd_session_rpc {
 	int			id;
@@ -34,6 +37,7 @@ static void free_channel_list(struct cifsd_session *sess)
 	struct channel *chann;
 	struct list_head *tmp, *t;
 
+	write_lock(&sess->chann_lock);
 	list_for_each_safe(tmp, t, &sess->cifsd_chann_list) {
 		chann = list_entry(tmp, struct channel, chann_list);
 		if (chann) {
@@ -41,6 +45,117 @@ static void free_channel_list(struct cifsd_session *sess)
 			kfree(chann);
 		}
 	}
+	write_unlock(&sess->chann_lock);
+}
+
+static struct channel *__chann_lookup(struct cifsd_session *sess,
+				      struct cifsd_tcp_conn *conn)
+{
+	struct channel *chann;
+
+	list_for_each_entry(chann, &sess->cifsd_chann_list, chann_list) {
+		if (chann->conn == conn)
+			return chann;
+	}
+	return NULL;
+}
+
+/**
+ * cifsd_session_add_channel() - add the channel of a connection to a session
+ * @sess:	session being set up or bound
+ * @conn:	connection of the channel
+ *
+ * Return:	channel of @conn, which may already have existed, or NULL
+ */
+struct channel *cifsd_session_add_channel(struct cifsd_session *sess,
+					  struct cifsd_tcp_conn *conn)
+{
+	struct channel *chann, *new;
+
+	new = kzalloc(sizeof(struct channel), GFP_KERNEL);
+	if (!new)
+		return NULL;
+
+	new->conn = conn;
+	INIT_LIST_HEAD(&new->chann_list);
+
+	write_lock(&sess->chann_lock);
+	chann = __chann_lookup(sess, conn);
+	if (!chann) {
+		list_add_tail(&new->chann_list, &sess->cifsd_chann_list);
+		chann = new;
+		new = NULL;
+	}
+	write_unlock(&sess->chann_lock);
+
+	kfree(new);
+	return chann;
+}
+
+/**
+ * cifsd_session_del_channel() - remove the channel of a connection
+ * @sess:	session the connection is bound to
+ * @conn:	connection of the channel
+ */
+void cifsd_session_del_channel(struct cifsd_session *sess,
+			       struct cifsd_tcp_conn *conn)
+{
+	struct channel *chann;
+
+	write_lock(&sess->chann_lock);
+	chann = __chann_lookup(sess, conn);
+	if (chann)
+		list_del(&chann->chann_list);
+	write_unlock(&sess->chann_lock);
+
+	kfree(chann);
+}
+
+/*
+ * Pin @conn unless it is going away. cifsd_tcp_conn_release() marks the
+ * connection exiting before it waits for r_count, so either it sees our
+ * reference or we see the connection exiting.
+ */
+static bool __conn_get_live(struct cifsd_tcp_conn *conn)
+{
+	atomic_inc(&conn->r_count);
+	smp_mb__after_atomic();
+	if (READ_ONCE(conn->tcp_status) == CIFSD_SESS_GOOD)
+		return true;
+
+	atomic_dec(&conn->r_count);
+	return false;
+}
+
+/**
+ * cifsd_session_get_conn() - pick a live channel to notify a client on
+ * @sess:	session of the client
+ * @conn:	preferred connection, usually the one the file was opened on
+ *
+ * Oplock and lease breaks may be sent on any channel of the session, so
+ * if @conn is going away another live channel is used instead.
+ *
+ * Return:	connection with r_count held, @conn if no channel is live
+ */
+struct cifsd_tcp_conn *cifsd_session_get_conn(struct cifsd_session *sess,
+					      struct cifsd_tcp_conn *conn)
+{
+	struct channel *chann;
+
+	if (__conn_get_live(conn))
+		return conn;
+
+	read_lock(&sess->chann_lock);
+	list_for_each_entry(chann, &sess->cifsd_chann_list, chann_list) {
+		if (chann->conn != conn && __conn_get_live(chann->conn)) {
+			read_unlock(&sess->chann_lock);
+			return chann->conn;
+		}
+	}
+	read_unlock(&sess->chann_lock);
+
+	atomic_inc(&conn->r_count);
+	return conn;
 }
 
 static void __session_rpc_close(struct cifsd_session *sess,
@@ -140,35 +255,104 @@ int cifsd_session_rpc_method(struct cifsd_session *sess, int id)
 	return 0;
 }
 
-void cifsd_session_destroy(struct cifsd_session *sess)
+static void __session_teardown(struct cifsd_session *sess)
 {
-	if (!sess)
+	cifsd_destroy_file_table(&sess->file_table);
+	cifsd_session_rpc_clear_list(sess);
+	cifsd_session_free_aead(sess);
+	cifds_release_id(session_ida, sess->id);
+	cifsd_ida_free(sess->tree_conn_ida);
+	sess->tree_conn_ida = NULL;
+}
+
+static void session_free_rcu(struct rcu_head *rcu)
+{
+	struct cifsd_session *sess = container_of(rcu, struct cifsd_session,
+						  rcu);
+
+	cifsd_io_stats_free(sess->io_stats);
+	cifsd_free(sess);
+}
+
+/**
+ * cifsd_session_put() - drop a session reference
+ * @sess:	session from cifsd_session_lookup() or
+ *		cifsd_session_lookup_slowpath()
+ *
+ * What a reference holder may still look at, the user and the channels,
+ * is freed with the last reference, the session itself after the RCU
+ * lookups which may have found it are done.
+ */
+void cifsd_session_put(struct cifsd_session *sess)
+{
+	if (!atomic_dec_and_test(&sess->refcnt))
 		return;
 
 	if (sess->user)
 		cifsd_free_user(sess->user);
-
-	cifsd_destroy_file_table(&sess->file_table);
-	cifsd_session_rpc_clear_list(sess);
 	free_channel_list(sess);
 	kfree(sess->Preauth_HashValue);
-	cifds_release_id(session_ida, sess->id);
+	call_rcu(&sess->rcu, session_free_rcu);
+}
 
-	list_del(&sess->sessions_entry);
-	down_write(&sessions_table_lock);
-	hash_del(&sess->hlist);
-	up_write(&sessions_table_lock);
+/* Forget @sess as the last session of @conn */
+static void __session_uncache(struct cifsd_tcp_conn *conn,
+			      struct cifsd_session *sess)
+{
+	cmpxchg(&conn->last_sess, sess, NULL);
+}
 
-	cifsd_ida_free(sess->tree_conn_ida);
-	cifsd_free(sess);
+/* Remember @sess as the last session of @conn, called under RCU */
+static void __session_cache(struct cifsd_tcp_conn *conn,
+			    struct cifsd_session *sess)
+{
+	WRITE_ONCE(conn->last_sess, sess);
+	/*
+	 * Either cifsd_session_destroy() sees the session cached or we see
+	 * it unhashed, pairs with the barrier there.
+	 */
+	smp_mb();
+	if (hlist_unhashed(&sess->hlist))
+		__session_uncache(conn, sess);
+}
+
+void cifsd_session_destroy(struct cifsd_session *sess)
+{
+	struct channel *chann;
+	bool hashed;
+
+	if (!sess)
+		return;
+
+	/* The session may be destroyed as the previous session of another */
+	spin_lock(&sessions_table_lock);
+	hashed = !hlist_unhashed(&sess->hlist);
+	if (hashed)
+		hash_del_rcu(&sess->hlist);
+	spin_unlock(&sessions_table_lock);
+	if (!hashed)
+		return;
+
+	smp_mb();
+	if (sess->conn)
+		__session_uncache(sess->conn, sess);
+	read_lock(&sess->chann_lock);
+	list_for_each_entry(chann, &sess->cifsd_chann_list, chann_list)
+		__session_uncache(chann->conn, sess);
+	read_unlock(&sess->chann_lock);
+
+	list_del_init(&sess->sessions_entry);
+	__session_teardown(sess);
+	cifsd_session_put(sess);
 }
 
 static struct cifsd_session *__session_lookup(unsigned long long id)
 {
 	struct cifsd_session *sess;
 
-	hash_for_each_possible(sessions_table, sess, hlist, id) {
-		if (id == sess->id)
+	hash_for_each_possible_rcu(sessions_table, sess, hlist, id) {
+		/* a destroyed session may still be walked through */
+		if (id == sess->id && !hlist_unhashed(&sess->hlist))
 			return sess;
 	}
 	return NULL;
@@ -184,6 +368,17 @@ void cifsd_session_register(struct cifsd_tcp_conn *conn,
 void cifsd_sessions_deregister(struct cifsd_tcp_conn *conn)
 {
 	struct cifsd_session *sess;
+	int bkt;
+
+	WRITE_ONCE(conn->last_sess, NULL);
+
+	/* Unbind the connection from sessions of other connections */
+	rcu_read_lock();
+	hash_for_each_rcu(sessions_table, bkt, sess, hlist) {
+		if (sess->conn != conn)
+			cifsd_session_del_channel(sess, conn);
+	}
+	rcu_read_unlock();
 
 	while (!list_empty(&conn->sessions)) {
 		sess = list_entry(conn->sessions.next,
@@ -194,34 +389,225 @@ void cifsd_sessions_deregister(struct cifsd_tcp_conn *conn)
 	}
 }
 
+/**
+ * cifsd_sessions_io_top() - collect the sessions with the most I/O
+ * @top:	top-N collection
+ */
+void cifsd_sessions_io_top(struct cifsd_io_top *top)
+{
+	struct cifsd_session *sess;
+	int bkt;
+
+	rcu_read_lock();
+	hash_for_each_rcu(sessions_table, bkt, sess, hlist)
+		cifsd_io_top_add(top, sess->id, NULL, sess->io_stats);
+	rcu_read_unlock();
+}
+
 bool cifsd_session_id_match(struct cifsd_session *sess, unsigned long long id)
 {
 	return sess->id == id;
 }
 
+/**
+ * cifsd_session_lookup() - look up the session of a request
+ * @conn:	connection the request was received on
+ * @id:		session id of the request
+ *
+ * Most connections carry requests of a single session, which is kept as
+ * the last session of the connection, so a lookup takes no shared lock.
+ *
+ * Return:	session of @conn, or bound to @conn, with a reference held
+ *		to be dropped with cifsd_session_put(), otherwise NULL
+ */
 struct cifsd_session *cifsd_session_lookup(struct cifsd_tcp_conn *conn,
 					   unsigned long long id)
 {
-	struct cifsd_session *sess = NULL;
+	struct cifsd_session *sess;
+	bool bound;
+
+	rcu_read_lock();
+	sess = READ_ONCE(conn->last_sess);
+	if (sess && cifsd_session_id_match(sess, id) &&
+	    !hlist_unhashed(&sess->hlist))
+		goto out;
 
 	list_for_each_entry(sess, &conn->sessions, sessions_entry) {
 		if (cifsd_session_id_match(sess, id))
-			return sess;
+			goto found;
 	}
-	return NULL;
+
+	/* A session of another connection this one is bound to */
+	sess = NULL;
+	if (!multi_channel_enable)
+		goto out;
+
+	sess = __session_lookup(id);
+	if (!sess)
+		goto out;
+
+	read_lock(&sess->chann_lock);
+	bound = __chann_lookup(sess, conn) != NULL;
+	read_unlock(&sess->chann_lock);
+	if (!bound) {
+		sess = NULL;
+		goto out;
+	}
+found:
+	__session_cache(conn, sess);
+out:
+	/* LOGOFF or a new session of the client may destroy it meanwhile */
+	if (sess && !atomic_inc_not_zero(&sess->refcnt))
+		sess = NULL;
+	rcu_read_unlock();
+	return sess;
 }
 
+/**
+ * cifsd_session_lookup_slowpath() - look up a session of any connection
+ * @id:		session id
+ *
+ * Return:	session with a reference held, to be dropped with
+ *		cifsd_session_put(), otherwise NULL
+ */
 struct cifsd_session *cifsd_session_lookup_slowpath(unsigned long long id)
 {
 	struct cifsd_session *sess;
 
-	down_read(&sessions_table_lock);
+	rcu_read_lock();
 	sess = __session_lookup(id);
-	up_read(&sessions_table_lock);
+	if (sess && !atomic_inc_not_zero(&sess->refcnt))
+		sess = NULL;
+	rcu_read_unlock();
 
 	return sess;
 }
 
+/*
+ * Preauth sessions hold the preauth integrity hash of SMB 3.1.1 session
+ * binds in progress on a connection. SESSION_SETUP runs without
+ * srv_mutex, so the table is under conn->preauth_sess_lock, and binds
+ * hash on a copy which is stored back with cifsd_preauth_session_update().
+ */
+
+/* Caller holds conn->preauth_sess_lock */
+static struct preauth_session *__preauth_session_lookup(
+		struct cifsd_tcp_conn *conn, uint64_t sess_id)
+{
+	struct preauth_session *p_sess;
+
+	hash_for_each_possible(conn->preauth_sess_table, p_sess, hlist,
+			       sess_id) {
+		if (p_sess->sess_id == sess_id)
+			return p_sess;
+	}
+	return NULL;
+}
+
+/**
+ * cifsd_preauth_session_lookup() - copy the preauth hash of a bind
+ * @conn:	connection of the bind
+ * @sess_id:	session being bound
+ * @hash:	set to the preauth hash, PREAUTH_HASHVALUE_SIZE bytes
+ *
+ * Return:	0 on success, -ENOENT if no bind of @sess_id is in progress
+ */
+int cifsd_preauth_session_lookup(struct cifsd_tcp_conn *conn,
+				 uint64_t sess_id, __u8 *hash)
+{
+	struct preauth_session *p_sess;
+
+	spin_lock(&conn->preauth_sess_lock);
+	p_sess = __preauth_session_lookup(conn, sess_id);
+	if (p_sess)
+		memcpy(hash, p_sess->Preauth_HashValue,
+		       PREAUTH_HASHVALUE_SIZE);
+	spin_unlock(&conn->preauth_sess_lock);
+	return p_sess ? 0 : -ENOENT;
+}
+
+/**
+ * cifsd_preauth_session_alloc() - start a bind on a connection
+ * @conn:	connection of the bind
+ * @sess_id:	session being bound
+ *
+ * The preauth hash of a new bind starts from the one of the NEGOTIATE
+ * of @conn. A bind already in progress is kept.
+ *
+ * Return:	0 on success, otherwise -ENOMEM
+ */
+int cifsd_preauth_session_alloc(struct cifsd_tcp_conn *conn,
+				uint64_t sess_id)
+{
+	struct preauth_session *p_sess;
+
+	p_sess = kmalloc(sizeof(struct preauth_session), GFP_KERNEL);
+	if (!p_sess)
+		return -ENOMEM;
+
+	p_sess->sess_id = sess_id;
+	memcpy(p_sess->Preauth_HashValue,
+	       conn->preauth_info->Preauth_HashValue,
+	       PREAUTH_HASHVALUE_SIZE);
+
+	spin_lock(&conn->preauth_sess_lock);
+	if (!__preauth_session_lookup(conn, sess_id)) {
+		hash_add(conn->preauth_sess_table, &p_sess->hlist, sess_id);
+		p_sess = NULL;
+	}
+	spin_unlock(&conn->preauth_sess_lock);
+	kfree(p_sess);
+	return 0;
+}
+
+/**
+ * cifsd_preauth_session_update() - store the preauth hash of a bind
+ * @conn:	connection of the bind
+ * @sess_id:	session being bound
+ * @hash:	preauth hash, PREAUTH_HASHVALUE_SIZE bytes
+ *
+ * Nothing is stored if the bind completed or failed meanwhile.
+ */
+void cifsd_preauth_session_update(struct cifsd_tcp_conn *conn,
+				  uint64_t sess_id, const __u8 *hash)
+{
+	struct preauth_session *p_sess;
+
+	spin_lock(&conn->preauth_sess_lock);
+	p_sess = __preauth_session_lookup(conn, sess_id);
+	if (p_sess)
+		memcpy(p_sess->Preauth_HashValue, hash,
+		       PREAUTH_HASHVALUE_SIZE);
+	spin_unlock(&conn->preauth_sess_lock);
+}
+
+void cifsd_preauth_session_free(struct cifsd_tcp_conn *conn,
+				uint64_t sess_id)
+{
+	struct preauth_session *p_sess;
+
+	spin_lock(&conn->preauth_sess_lock);
+	p_sess = __preauth_session_lookup(conn, sess_id);
+	if (p_sess)
+		hash_del(&p_sess->hlist);
+	spin_unlock(&conn->preauth_sess_lock);
+	kfree(p_sess);
+}
+
+void cifsd_preauth_sessions_free(struct cifsd_tcp_conn *conn)
+{
+	struct preauth_session *p_sess;
+	struct hlist_node *tmp;
+	int bkt;
+
+	spin_lock(&conn->preauth_sess_lock);
+	hash_for_each_safe(conn->preauth_sess_table, bkt, tmp, p_sess, hlist) {
+		hash_del(&p_sess->hlist);
+		kfree(p_sess);
+	}
+	spin_unlock(&conn->preauth_sess_lock);
+}
+
 #ifdef CONFIG_CIFS_INSECURE_SERVER
 static int __init_smb1_session(struct cifsd_session *sess)
 {
@@ -264,9 +650,17 @@ static struct cifsd_session *__session_create(int protocol)
 	set_session_flag(sess, protocol);
 	INIT_LIST_HEAD(&sess->sessions_entry);
 	INIT_LIST_HEAD(&sess->tree_conn_list);
+	rwlock_init(&sess->chann_lock);
+	spin_lock_init(&sess->aead_lock);
 	INIT_LIST_HEAD(&sess->cifsd_chann_list);
 	INIT_LIST_HEAD(&sess->rpc_handle_list);
 	sess->sequence_number = 1;
+	atomic_set(&sess->refcnt, 1);
+	cifsd_qos_session_init(sess);
+
+	sess->io_stats = cifsd_io_stats_alloc();
+	if (!sess->io_stats)
+		goto error;
 
 	switch (protocol) {
 	case CIFDS_SESSION_FLAG_SMB1:
@@ -287,13 +681,15 @@ static struct cifsd_session *__session_create(int protocol)
 	if (!sess->tree_conn_ida)
 		goto error;
 
-	down_read(&sessions_table_lock);
-	hash_add(sessions_table, &sess->hlist, sess->id);
-	up_read(&sessions_table_lock);
+	spin_lock(&sessions_table_lock);
+	hash_add_rcu(sessions_table, &sess->hlist, sess->id);
+	spin_unlock(&sessions_table_lock);
 	return sess;
 
 error:
-	cifsd_session_destroy(sess);
+	__session_teardown(sess);
+	cifsd_io_stats_free(sess->io_stats);
+	cifsd_free(sess);
 	return NULL;
 }
 
@@ -335,5 +731,7 @@ int cifsd_init_session_table(void)
 
 void cifsd_free_session_table(void)
 {
+	/* wait for the sessions freed after RCU lookups */
+	rcu_barrier();
 	cifsd_ida_free(session_ida);
 }
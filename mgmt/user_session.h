@@ -7,9 +7,13 @@
 #define __USER_SESSION_MANAGEMENT_H__
 
 #include <linux/hashtable.h>
+#include <linux/spinlock.h>
+#include <linux/rcupdate.h>
 
 #include "../glob.h"  /* FIXME */
 #include "../ntlmssp.h"
+#include "../qos.h"
+#include "../stats.h"
 
 #define CIFDS_SESSION_FLAG_SMB1		(1 << 0)
 #define CIFDS_SESSION_FLAG_SMB2		(1 << 1)
@@ -17,7 +21,9 @@
 #define PREAUTH_HASHVALUE_SIZE		64
 
 struct cifsd_ida;
+struct cifsd_aead;
 struct cifsd_file_table;
+struct cifsd_tree_connect;
 
 struct channel {
 	__u8			smb3signingkey[SMB3_SIGN_KEY_SIZE];
@@ -28,7 +34,7 @@ struct channel {
 struct preauth_session {
 	__u8			Preauth_HashValue[PREAUTH_HASHVALUE_SIZE];
 	uint64_t		sess_id;
-	struct list_head	list_entry;
+	struct hlist_node	hlist;
 };
 
 struct cifsd_session {
@@ -50,18 +56,40 @@ struct cifsd_session {
 	struct ntlmssp_auth		ntlmssp;
 	char				sess_key[CIFS_KEY_SIZE];
 
+	/* sessions_table entry, looked up under RCU */
 	struct hlist_node		hlist;
+	/* Held by the owning connection and by session lookup callers */
+	atomic_t			refcnt;
+	struct rcu_head			rcu;
+	/* Connections bound to the session, sess->conn among them */
+	rwlock_t			chann_lock;
 	struct list_head		cifsd_chann_list;
 	struct list_head		tree_conn_list;
+	/* Tree connect of the last request, see cifsd_tree_conn_lookup() */
+	struct cifsd_tree_connect	*last_tcon;
 	struct cifsd_ida		*tree_conn_ida;
 	struct list_head		rpc_handle_list;
 
-	__u8				smb3encryptionkey[SMB3_SIGN_KEY_SIZE];
-	__u8				smb3decryptionkey[SMB3_SIGN_KEY_SIZE];
+	__u8				smb3encryptionkey[SMB3_ENC_KEY_SIZE_MAX];
+	__u8				smb3decryptionkey[SMB3_ENC_KEY_SIZE_MAX];
 	__u8				smb3signingkey[SMB3_SIGN_KEY_SIZE];
+	/*
+	 * SMB3 transforms, keyed with the keys above at session setup and
+	 * replaced under aead_lock when the keys change
+	 */
+	__le16				cipher_type;
+	spinlock_t			aead_lock;
+	struct cifsd_aead		*enc_aead;
+	struct cifsd_aead		*dec_aead;
 
 	struct list_head		sessions_entry;
 	struct cifsd_file_table		file_table;
+
+	/* Rate limit and queue of requests waiting for admission */
+	struct cifsd_qos_flow		qos;
+
+	/* Freed with the session, after RCU walkers of sessions_table */
+	struct cifsd_io_stats __percpu	*io_stats;
 };
 
 static inline int test_session_flag(struct cifsd_session *sess, int bit)
@@ -83,6 +111,15 @@ struct cifsd_session *cifsd_smb1_session_create(void);
 struct cifsd_session *cifsd_smb2_session_create(void);
 
 void cifsd_session_destroy(struct cifsd_session *sess);
+void cifsd_session_put(struct cifsd_session *sess);
+
+/* Take another reference on a session a reference is held on */
+static inline struct cifsd_session *
+cifsd_session_get(struct cifsd_session *sess)
+{
+	atomic_inc(&sess->refcnt);
+	return sess;
+}
 
 bool cifsd_session_id_match(struct cifsd_session *sess, unsigned long long id);
 struct cifsd_session *cifsd_session_lookup_slowpath(unsigned long long id);
@@ -91,10 +128,28 @@ struct cifsd_session *cifsd_session_lookup(struct cifsd_tcp_conn *conn,
 void cifsd_session_register(struct cifsd_tcp_conn *conn,
 			    struct cifsd_session *sess);
 void cifsd_sessions_deregister(struct cifsd_tcp_conn *conn);
+void cifsd_sessions_io_top(struct cifsd_io_top *top);
+
+struct channel *cifsd_session_add_channel(struct cifsd_session *sess,
+					  struct cifsd_tcp_conn *conn);
+void cifsd_session_del_channel(struct cifsd_session *sess,
+			       struct cifsd_tcp_conn *conn);
+struct cifsd_tcp_conn *cifsd_session_get_conn(struct cifsd_session *sess,
+					      struct cifsd_tcp_conn *conn);
 
 int cifsd_acquire_tree_conn_id(struct cifsd_session *sess);
 void cifsd_release_tree_conn_id(struct cifsd_session *sess, int id);
 
+int cifsd_preauth_session_lookup(struct cifsd_tcp_conn *conn,
+				 uint64_t sess_id, __u8 *hash);
+int cifsd_preauth_session_alloc(struct cifsd_tcp_conn *conn,
+				uint64_t sess_id);
+void cifsd_preauth_session_update(struct cifsd_tcp_conn *conn,
+				  uint64_t sess_id, const __u8 *hash);
+void cifsd_preauth_session_free(struct cifsd_tcp_conn *conn,
+				uint64_t sess_id);
+void cifsd_preauth_sessions_free(struct cifsd_tcp_conn *conn);
+
 int cifsd_session_rpc_open(struct cifsd_session *sess, char *rpc_name);
 void cifsd_session_rpc_close(struct cifsd_session *sess, int id);
 int cifsd_session_rpc_method(struct cifsd_session *sess, int id);
@@ -0,0 +1,357 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ *   Copyright (C) 2018 Samsung Electronics Co., Ltd.
+ */
+
+#include <linux/slab.h>
+#include <linux/jhash.h>
+#include <linux/limits.h>
+#include <linux/bitmap.h>
+#include <linux/hashtable.h>
+#include <linux/parser.h>
+#include <linux/err.h>
+
+#include "veto_matcher.h"
+#include "../buffer_pool.h"
+
+/*
+ * A veto list is compiled into a single matcher, so that a name is not
+ * run through match_wildcard() once per pattern:
+ *
+ *  - names without wildcards and "*suffix" patterns are kept in a hash
+ *    table, and a name is looked up once per distinct suffix length;
+ *  - the remaining globs are simulated together as one bit parallel
+ *    NFA, a bit per pattern position, advanced a word at a time for
+ *    every character of the name;
+ *  - globs which don't fit the NFA fall back to match_wildcard().
+ */
+#define VETO_HASH_BITS		6
+#define VETO_NFA_MAX_BITS	512
+#define VETO_NFA_MAX_LONGS	BITS_TO_LONGS(VETO_NFA_MAX_BITS)
+
+struct veto_literal {
+	struct hlist_node	hlist;
+	unsigned int		len;
+	char			str[0];
+};
+
+struct cifsd_veto_matcher {
+	bool			match_all;
+	DECLARE_HASHTABLE(literals, VETO_HASH_BITS);
+	DECLARE_BITMAP(suffix_lens, NAME_MAX + 1);
+
+	/* start, '*' self loop, followed by '*', final, then char masks */
+	unsigned int		nlongs;
+	unsigned long		*nfa;
+
+	unsigned int		nr_slow;
+	char			**slow;
+};
+
+#define VETO_NFA_INIT(m)	((m)->nfa)
+#define VETO_NFA_STAR(m)	((m)->nfa + (m)->nlongs)
+#define VETO_NFA_EPS(m)		((m)->nfa + 2 * (m)->nlongs)
+#define VETO_NFA_FINAL(m)	((m)->nfa + 3 * (m)->nlongs)
+#define VETO_NFA_CHAR(m, c)	((m)->nfa + (4 + (c)) * (m)->nlongs)
+
+enum {
+	VETO_EXACT,
+	VETO_SUFFIX,
+	VETO_ALL,
+	VETO_GLOB,
+};
+
+/* Kind of @pattern, and for a glob the number of its NFA states */
+static int veto_classify(const char *pattern, unsigned int len,
+			 unsigned int *nr_states)
+{
+	unsigned int i;
+
+	if (!strpbrk(pattern, "*?"))
+		return VETO_EXACT;
+
+	/* consecutive '*' are one state */
+	*nr_states = 1;
+	for (i = 0; i < len; i++) {
+		if (pattern[i] == '*' && pattern[i + 1] == '*')
+			continue;
+		(*nr_states)++;
+	}
+
+	if (pattern[0] == '*' && !strpbrk(pattern + 1, "*?"))
+		return len == 1 ? VETO_ALL : VETO_SUFFIX;
+	return VETO_GLOB;
+}
+
+static struct veto_literal *veto_literal_find(
+		const struct cifsd_veto_matcher *m, const char *str,
+		unsigned int len, bool suffix)
+{
+	struct veto_literal *lit;
+
+	hash_for_each_possible(m->literals, lit, hlist,
+			       jhash(str, len, suffix)) {
+		if (lit->len == len && !memcmp(lit->str, str, len))
+			return lit;
+	}
+	return NULL;
+}
+
+static int veto_literal_add(struct cifsd_veto_matcher *m, const char *str,
+			    unsigned int len, bool suffix)
+{
+	struct veto_literal *lit;
+
+	if (veto_literal_find(m, str, len, suffix))
+		return 0;
+
+	lit = kmalloc(sizeof(struct veto_literal) + len, GFP_KERNEL);
+	if (!lit)
+		return -ENOMEM;
+
+	lit->len = len;
+	memcpy(lit->str, str, len);
+	hash_add(m->literals, &lit->hlist, jhash(str, len, suffix));
+	if (suffix)
+		__set_bit(len, m->suffix_lens);
+	return 0;
+}
+
+/* Add the states of @pattern to the NFA, from bit @base on */
+static void veto_nfa_add(struct cifsd_veto_matcher *m, const char *pattern,
+			 unsigned int base)
+{
+	unsigned int state = base;
+	int c;
+
+	__set_bit(base, VETO_NFA_INIT(m));
+	for (; *pattern; pattern++) {
+		if (pattern[0] == '*' && pattern[1] == '*')
+			continue;
+
+		/* the state after the character */
+		state++;
+		if (*pattern == '*') {
+			__set_bit(state, VETO_NFA_STAR(m));
+			__set_bit(state - 1, VETO_NFA_EPS(m));
+		} else if (*pattern == '?') {
+			for (c = 1; c < 256; c++)
+				__set_bit(state, VETO_NFA_CHAR(m, c));
+		} else {
+			__set_bit(state,
+				  VETO_NFA_CHAR(m, (unsigned char)*pattern));
+		}
+	}
+	__set_bit(state, VETO_NFA_FINAL(m));
+}
+
+/* Enter the '*' states following active states, '*' matches empty */
+static void veto_nfa_close(const struct cifsd_veto_matcher *m,
+			   unsigned long *d)
+{
+	const unsigned long *eps = VETO_NFA_EPS(m);
+	unsigned long v, carry = 0;
+	unsigned int i;
+
+	for (i = 0; i < m->nlongs; i++) {
+		v = d[i] & eps[i];
+		d[i] |= (v << 1) | carry;
+		carry = v >> (BITS_PER_LONG - 1);
+	}
+}
+
+static bool veto_nfa_match(const struct cifsd_veto_matcher *m,
+			   const char *name)
+{
+	const unsigned long *star = VETO_NFA_STAR(m);
+	const unsigned long *final = VETO_NFA_FINAL(m);
+	const unsigned long *chars;
+	unsigned long d[VETO_NFA_MAX_LONGS];
+	unsigned long v, carry, active;
+	unsigned int i;
+
+	memcpy(d, VETO_NFA_INIT(m), m->nlongs * sizeof(unsigned long));
+	for (; *name; name++) {
+		chars = VETO_NFA_CHAR(m, (unsigned char)*name);
+		carry = 0;
+		for (i = 0; i < m->nlongs; i++) {
+			v = d[i];
+			d[i] = (((v << 1) | carry) & chars[i]) | (v & star[i]);
+			carry = v >> (BITS_PER_LONG - 1);
+		}
+		veto_nfa_close(m, d);
+
+		active = 0;
+		for (i = 0; i < m->nlongs; i++)
+			active |= d[i];
+		if (!active)
+			return false;
+	}
+
+	for (i = 0; i < m->nlongs; i++) {
+		if (d[i] & final[i])
+			return true;
+	}
+	return false;
+}
+
+/*
+ * Walk the veto list. Without @fill only the NFA bits and fallback
+ * patterns are counted, with @fill the patterns are added.
+ */
+static int veto_compile_pass(struct cifsd_veto_matcher *m, char *veto_list,
+			     int veto_list_sz, bool fill,
+			     unsigned int *nbits)
+{
+	unsigned int len, nr_states = 0;
+	int ret = 0;
+
+	*nbits = 0;
+	m->nr_slow = 0;
+	for (; veto_list_sz > 0; veto_list += len + 1,
+	     veto_list_sz -= len + 1) {
+		len = strnlen(veto_list, veto_list_sz);
+		if (!len || len == veto_list_sz)
+			break;
+
+		switch (veto_classify(veto_list, len, &nr_states)) {
+		case VETO_ALL:
+			m->match_all = true;
+			break;
+		case VETO_EXACT:
+			if (fill)
+				ret = veto_literal_add(m, veto_list, len,
+						       false);
+			break;
+		case VETO_SUFFIX:
+			if (len - 1 <= NAME_MAX) {
+				if (fill)
+					ret = veto_literal_add(m, veto_list + 1,
+							       len - 1, true);
+				break;
+			}
+			/* fall through */
+		case VETO_GLOB:
+			if (*nbits + nr_states <= VETO_NFA_MAX_BITS) {
+				if (fill)
+					veto_nfa_add(m, veto_list, *nbits);
+				*nbits += nr_states;
+				break;
+			}
+
+			if (fill) {
+				m->slow[m->nr_slow] = kstrdup(veto_list,
+							      GFP_KERNEL);
+				if (!m->slow[m->nr_slow])
+					ret = -ENOMEM;
+			}
+			m->nr_slow++;
+			break;
+		}
+
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
+/**
+ * cifsd_veto_matcher_compile() - compile the veto list of a share
+ * @veto_list:		NUL separated patterns
+ * @veto_list_sz:	size of @veto_list
+ *
+ * Return:	matcher, NULL if the list is empty, otherwise error ptr
+ */
+struct cifsd_veto_matcher *cifsd_veto_matcher_compile(char *veto_list,
+						      int veto_list_sz)
+{
+	struct cifsd_veto_matcher *m;
+	unsigned int nbits;
+	int ret;
+
+	if (!veto_list_sz)
+		return NULL;
+
+	m = kzalloc(sizeof(struct cifsd_veto_matcher), GFP_KERNEL);
+	if (!m)
+		return ERR_PTR(-ENOMEM);
+	hash_init(m->literals);
+
+	veto_compile_pass(m, veto_list, veto_list_sz, false, &nbits);
+	if (nbits) {
+		m->nlongs = BITS_TO_LONGS(nbits);
+		m->nfa = cifsd_alloc((4 + 256) * m->nlongs *
+				     sizeof(unsigned long));
+		if (!m->nfa)
+			goto nomem;
+	}
+	if (m->nr_slow) {
+		m->slow = kcalloc(m->nr_slow, sizeof(char *), GFP_KERNEL);
+		if (!m->slow)
+			goto nomem;
+	}
+
+	ret = veto_compile_pass(m, veto_list, veto_list_sz, true, &nbits);
+	if (ret)
+		goto err;
+	if (m->nfa)
+		veto_nfa_close(m, VETO_NFA_INIT(m));
+	return m;
+
+nomem:
+	ret = -ENOMEM;
+err:
+	cifsd_veto_matcher_free(m);
+	return ERR_PTR(ret);
+}
+
+bool cifsd_veto_matcher_match(const struct cifsd_veto_matcher *m,
+			      const char *name)
+{
+	unsigned int len = strlen(name);
+	unsigned int i, l;
+
+	if (m->match_all)
+		return true;
+
+	if (veto_literal_find(m, name, len, false))
+		return true;
+
+	for_each_set_bit(l, m->suffix_lens,
+			 min_t(unsigned int, len, NAME_MAX) + 1) {
+		if (veto_literal_find(m, name + len - l, l, true))
+			return true;
+	}
+
+	if (m->nfa && veto_nfa_match(m, name))
+		return true;
+
+	for (i = 0; i < m->nr_slow; i++) {
+		if (match_wildcard(m->slow[i], name))
+			return true;
+	}
+	return false;
+}
+
+void cifsd_veto_matcher_free(struct cifsd_veto_matcher *m)
+{
+	struct veto_literal *lit;
+	struct hlist_node *tmp;
+	unsigned int i;
+
+	if (IS_ERR_OR_NULL(m))
+		return;
+
+	hash_for_each_safe(m->literals, i, tmp, lit, hlist) {
+		hash_del(&lit->hlist);
+		kfree(lit);
+	}
+
+	if (m->slow) {
+		for (i = 0; i < m->nr_slow; i++)
+			kfree(m->slow[i]);
+		kfree(m->slow);
+	}
+	cifsd_free(m->nfa);
+	kfree(m);
+}
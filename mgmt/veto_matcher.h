@@ -0,0 +1,19 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ *   Copyright (C) 2018 Samsung Electronics Co., Ltd.
+ */
+
+#ifndef __VETO_MATCHER_MANAGEMENT_H__
+#define __VETO_MATCHER_MANAGEMENT_H__
+
+#include <linux/types.h>
+
+struct cifsd_veto_matcher;
+
+struct cifsd_veto_matcher *cifsd_veto_matcher_compile(char *veto_list,
+						      int veto_list_sz);
+bool cifsd_veto_matcher_match(const struct cifsd_veto_matcher *m,
+			      const char *name);
+void cifsd_veto_matcher_free(struct cifsd_veto_matcher *m);
+
+#endif /* __VETO_MATCHER_MANAGEMENT_H__ */
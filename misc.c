@@ -8,6 +8,8 @@
 #include <linux/version.h>
 #include <linux/xattr.h>
 #include <linux/fs.h>
+#include <linux/slab.h>
+#include <linux/bitops.h>
 
 #include "misc.h"
 #include "smb_common.h"
@@ -111,6 +113,318 @@ int match_pattern(const char *str, const char *pattern)
 	return !*p;
 }
 
+/*
+ * Search patterns of QUERY_DIRECTORY are compiled once per directory
+ * handle. "*", "*.ext" and names without wildcards are compared
+ * directly, other patterns run as an NFA with a bit per pattern
+ * position, so a name is matched in a single pass whatever the pattern.
+ *
+ * Besides '*' and '?', '<' (DOS_STAR), '>' (DOS_QM) and '"' (DOS_DOT)
+ * match as FsRtlIsNameInExpression() does, case insensitively.
+ */
+#define DOS_STAR		'<'
+#define DOS_QM			'>'
+#define DOS_DOT			'"'
+
+#define SEARCH_NFA_MAX_BITS	1024
+#define SEARCH_NFA_MAX_LONGS	BITS_TO_LONGS(SEARCH_NFA_MAX_BITS)
+
+enum {
+	SEARCH_ALL,
+	SEARCH_EXACT,
+	SEARCH_SUFFIX,
+	SEARCH_NFA,
+	/* too long for the NFA */
+	SEARCH_BACKTRACK,
+};
+
+/* Position masks of the NFA, followed by a mask for every character */
+enum {
+	/* '*' and '<' consume a character and stay */
+	SEARCH_MASK_STAR,
+	SEARCH_MASK_DOS_STAR,
+	/* '?', '>' and '"' consume a character and advance */
+	SEARCH_MASK_QM,
+	SEARCH_MASK_DOS_QM,
+	SEARCH_MASK_DOS_DOT,
+	/* advancing without consuming: '*', '<', '>' before a dot or the
+	 * end of the name, '"' at the end of the name
+	 */
+	SEARCH_MASK_EPS,
+	SEARCH_MASK_EPS_DOS_QM,
+	SEARCH_MASK_EPS_DOS_DOT,
+	SEARCH_MASK_CHARS,
+};
+
+struct cifsd_search_pattern {
+	int			type;
+	char			*pattern;
+	/* SEARCH_SUFFIX, the literal after the '*' */
+	const char		*suffix;
+	unsigned int		suffix_len;
+	/* SEARCH_NFA, the position reached by the whole pattern */
+	unsigned int		final;
+	unsigned int		nlongs;
+	unsigned long		*masks;
+};
+
+#define SEARCH_MASK(sp, m)	((sp)->masks + (m) * (sp)->nlongs)
+#define SEARCH_CHAR_MASK(sp, c)	SEARCH_MASK(sp, SEARCH_MASK_CHARS + (c))
+
+static inline bool is_search_wildcard(char c)
+{
+	return c == '*' || c == '?' || c == DOS_STAR || c == DOS_QM ||
+		c == DOS_DOT;
+}
+
+static bool has_search_wildcard(const char *p)
+{
+	for (; *p; p++) {
+		if (is_search_wildcard(*p))
+			return true;
+	}
+	return false;
+}
+
+static int search_pattern_compile_nfa(struct cifsd_search_pattern *sp)
+{
+	const char *p;
+	unsigned int pos = 0;
+	int mask, c;
+
+	for (p = sp->pattern; *p; p++) {
+		if (p[0] == '*' && p[1] == '*')
+			continue;
+		pos++;
+	}
+	if (pos >= SEARCH_NFA_MAX_BITS) {
+		sp->type = SEARCH_BACKTRACK;
+		return 0;
+	}
+
+	sp->final = pos;
+	sp->nlongs = BITS_TO_LONGS(pos + 1);
+	sp->masks = kcalloc((SEARCH_MASK_CHARS + 256) * sp->nlongs,
+			    sizeof(unsigned long), GFP_KERNEL);
+	if (!sp->masks)
+		return -ENOMEM;
+
+	/* token at position pos moves the NFA to pos + 1 */
+	for (pos = 0, p = sp->pattern; *p; p++) {
+		if (p[0] == '*' && p[1] == '*')
+			continue;
+
+		switch (*p) {
+		case '*':
+			__set_bit(pos, SEARCH_MASK(sp, SEARCH_MASK_STAR));
+			__set_bit(pos, SEARCH_MASK(sp, SEARCH_MASK_EPS));
+			break;
+		case DOS_STAR:
+			__set_bit(pos, SEARCH_MASK(sp, SEARCH_MASK_DOS_STAR));
+			__set_bit(pos, SEARCH_MASK(sp, SEARCH_MASK_EPS));
+			break;
+		case '?':
+			__set_bit(pos, SEARCH_MASK(sp, SEARCH_MASK_QM));
+			break;
+		case DOS_QM:
+			__set_bit(pos, SEARCH_MASK(sp, SEARCH_MASK_DOS_QM));
+			__set_bit(pos, SEARCH_MASK(sp, SEARCH_MASK_EPS_DOS_QM));
+			break;
+		case DOS_DOT:
+			__set_bit(pos, SEARCH_MASK(sp, SEARCH_MASK_DOS_DOT));
+			__set_bit(pos, SEARCH_MASK(sp, SEARCH_MASK_EPS_DOS_DOT));
+			break;
+		default:
+			for (c = 1; c < 256; c++) {
+				if (tolower(c) == tolower(*p))
+					__set_bit(pos, SEARCH_CHAR_MASK(sp, c));
+			}
+			break;
+		}
+		pos++;
+	}
+
+	/* '?' consumes any character, fold it into the character masks */
+	for (c = 1; c < 256; c++) {
+		for (mask = 0; mask < sp->nlongs; mask++)
+			SEARCH_CHAR_MASK(sp, c)[mask] |=
+				SEARCH_MASK(sp, SEARCH_MASK_QM)[mask];
+	}
+	return 0;
+}
+
+/**
+ * cifsd_search_pattern_compile() - compile a directory search pattern
+ * @pattern:	search pattern of the client
+ *
+ * Return:	compiled pattern, NULL if out of memory
+ */
+struct cifsd_search_pattern *cifsd_search_pattern_compile(const char *pattern)
+{
+	struct cifsd_search_pattern *sp;
+
+	sp = kzalloc(sizeof(struct cifsd_search_pattern), GFP_KERNEL);
+	if (!sp)
+		return NULL;
+
+	sp->pattern = kstrdup(pattern, GFP_KERNEL);
+	if (!sp->pattern)
+		goto err;
+
+	if (!strcmp(pattern, "*") || !strcmp(pattern, "**")) {
+		sp->type = SEARCH_ALL;
+	} else if (!has_search_wildcard(pattern)) {
+		sp->type = SEARCH_EXACT;
+	} else if (pattern[0] == '*' && !has_search_wildcard(pattern + 1)) {
+		sp->type = SEARCH_SUFFIX;
+		sp->suffix = sp->pattern + 1;
+		sp->suffix_len = strlen(sp->suffix);
+	} else {
+		sp->type = SEARCH_NFA;
+		if (search_pattern_compile_nfa(sp))
+			goto err;
+	}
+	return sp;
+
+err:
+	cifsd_search_pattern_free(sp);
+	return NULL;
+}
+
+void cifsd_search_pattern_free(struct cifsd_search_pattern *sp)
+{
+	if (!sp)
+		return;
+
+	kfree(sp->masks);
+	kfree(sp->pattern);
+	kfree(sp);
+}
+
+/**
+ * cifsd_search_pattern_update() - compile a search pattern unless cached
+ * @sp:		compiled pattern of a directory handle, replaced if it
+ *		isn't compiled from @pattern
+ * @pattern:	search pattern of the request
+ *
+ * Return:	0 on success, otherwise -ENOMEM
+ */
+int cifsd_search_pattern_update(struct cifsd_search_pattern **sp,
+				const char *pattern)
+{
+	struct cifsd_search_pattern *new;
+
+	if (*sp && !strcmp((*sp)->pattern, pattern))
+		return 0;
+
+	new = cifsd_search_pattern_compile(pattern);
+	if (!new)
+		return -ENOMEM;
+
+	cifsd_search_pattern_free(*sp);
+	*sp = new;
+	return 0;
+}
+
+/* Follow the moves which consume no character of the name */
+static void search_nfa_close(const struct cifsd_search_pattern *sp,
+			     unsigned long *d, char next)
+{
+	const unsigned long *eps = SEARCH_MASK(sp, SEARCH_MASK_EPS);
+	const unsigned long *eps_qm = SEARCH_MASK(sp, SEARCH_MASK_EPS_DOS_QM);
+	const unsigned long *eps_dot = SEARCH_MASK(sp, SEARCH_MASK_EPS_DOS_DOT);
+	unsigned long e, v, carry, changed;
+	unsigned int i;
+
+	do {
+		changed = 0;
+		carry = 0;
+		for (i = 0; i < sp->nlongs; i++) {
+			e = eps[i];
+			if (next == '.' || !next)
+				e |= eps_qm[i];
+			if (!next)
+				e |= eps_dot[i];
+
+			v = d[i] & e;
+			e = d[i] | (v << 1) | carry;
+			carry = v >> (BITS_PER_LONG - 1);
+			changed |= e ^ d[i];
+			d[i] = e;
+		}
+	} while (changed);
+}
+
+static bool search_nfa_match(const struct cifsd_search_pattern *sp,
+			     const char *name)
+{
+	const unsigned long *star = SEARCH_MASK(sp, SEARCH_MASK_STAR);
+	const unsigned long *dos_star = SEARCH_MASK(sp, SEARCH_MASK_DOS_STAR);
+	const unsigned long *dos_qm = SEARCH_MASK(sp, SEARCH_MASK_DOS_QM);
+	const unsigned long *dos_dot = SEARCH_MASK(sp, SEARCH_MASK_DOS_DOT);
+	const char *last_dot = strrchr(name, '.');
+	const unsigned long *chars;
+	unsigned long d[SEARCH_NFA_MAX_LONGS];
+	unsigned long adv, stay, v, carry, active;
+	unsigned int i;
+
+	memset(d, 0, sp->nlongs * sizeof(unsigned long));
+	d[0] = 1;
+	for (; *name; name++) {
+		search_nfa_close(sp, d, *name);
+
+		chars = SEARCH_CHAR_MASK(sp, (unsigned char)*name);
+		carry = 0;
+		active = 0;
+		for (i = 0; i < sp->nlongs; i++) {
+			adv = chars[i];
+			adv |= *name == '.' ? dos_dot[i] : dos_qm[i];
+			stay = star[i];
+			/* '<' stops before the last dot of the name */
+			if (name != last_dot)
+				stay |= dos_star[i];
+
+			v = d[i] & adv;
+			d[i] = (v << 1) | carry | (d[i] & stay);
+			carry = v >> (BITS_PER_LONG - 1);
+			active |= d[i];
+		}
+		if (!active)
+			return false;
+	}
+
+	search_nfa_close(sp, d, 0);
+	return test_bit(sp->final, d);
+}
+
+/**
+ * cifsd_search_pattern_match() - match a directory entry name
+ * @sp:		compiled search pattern
+ * @name:	name of the entry
+ *
+ * Return:	true if @name matches the pattern
+ */
+bool cifsd_search_pattern_match(const struct cifsd_search_pattern *sp,
+				const char *name)
+{
+	size_t len;
+
+	switch (sp->type) {
+	case SEARCH_ALL:
+		return true;
+	case SEARCH_EXACT:
+		return !strcasecmp(name, sp->pattern);
+	case SEARCH_SUFFIX:
+		len = strlen(name);
+		return len >= sp->suffix_len &&
+			!strcasecmp(name + len - sp->suffix_len, sp->suffix);
+	case SEARCH_NFA:
+		return search_nfa_match(sp, name);
+	default:
+		return match_pattern(name, sp->pattern);
+	}
+}
+
 /*
  * is_char_allowed() - check for valid character
  * @ch:		input character to be checked
@@ -15,6 +15,14 @@ void dump_smb_msg(void *buf, int smb_buf_length);
 
 int match_pattern(const char *str, const char *pattern);
 
+struct cifsd_search_pattern;
+struct cifsd_search_pattern *cifsd_search_pattern_compile(const char *pattern);
+bool cifsd_search_pattern_match(const struct cifsd_search_pattern *sp,
+				const char *name);
+int cifsd_search_pattern_update(struct cifsd_search_pattern **sp,
+				const char *pattern);
+void cifsd_search_pattern_free(struct cifsd_search_pattern *sp);
+
 int cifsd_validate_filename(char *filename);
 
 int parse_stream_name(char *filename, char **stream_name, int *s_type);
@@ -0,0 +1,648 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ *   Copyright (C) 2018 Samsung Electronics Co., Ltd.
+ */
+
+#include <linux/moduleparam.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/mutex.h>
+#include <linux/workqueue.h>
+#include <linux/version.h>
+#include <linux/fsnotify_backend.h>
+
+#include "glob.h"
+#include "notify.h"
+#include "smb2pdu.h"
+#include "unicode.h"
+#include "vfs_cache.h"
+#include "transport_tcp.h"
+
+/*
+ * CHANGE_NOTIFY requests of all handles on a directory share one fsnotify
+ * mark on it. Events on the entries of the directory which match the
+ * completion filter of a handle are buffered on the handle until one of
+ * its requests picks them up. A request waiting for events is completed
+ * a little after the first one arrives, so that a burst of changes goes
+ * out in one response.
+ */
+static unsigned int notify_delay_ms = 10;
+module_param(notify_delay_ms, uint, 0644);
+MODULE_PARM_DESC(notify_delay_ms,
+	"Delay in ms to collect events before completing CHANGE_NOTIFY. Default: 10");
+
+/* Events buffered per handle before the client is told to rescan */
+#define CIFSD_NOTIFY_MAX_EVENTS	1024
+
+/*
+ * Events are taken from ->handle_inode_event, or from ->handle_event on
+ * kernels with the mark connectors but before 5.9, which changed what
+ * ->handle_event is passed.
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 10, 0) || \
+	(LINUX_VERSION_CODE >= KERNEL_VERSION(4, 12, 0) && \
+	 LINUX_VERSION_CODE < KERNEL_VERSION(5, 9, 0))
+
+#define CIFSD_NOTIFY_MASK	(FS_CREATE | FS_DELETE | FS_MOVED_FROM | \
+				 FS_MOVED_TO | FS_MODIFY | FS_ATTRIB | \
+				 FS_EVENT_ON_CHILD)
+
+struct cifsd_notify_watch {
+	struct fsnotify_mark	mark;
+	/* handles watching the directory, under lock */
+	spinlock_t		lock;
+	struct list_head	handles;
+};
+
+struct cifsd_notify_event {
+	struct list_head	entry;
+	u32			action;
+	unsigned int		len;
+	char			name[];
+};
+
+struct cifsd_notify_handle {
+	struct cifsd_file	*fp;
+	struct cifsd_notify_watch *watch;
+	/* entry on the handles of the watch */
+	struct list_head	entry;
+
+	spinlock_t		lock;
+	u32			filter;
+	struct list_head	events;
+	unsigned int		nr_events;
+	/* events were dropped, the client has to enumerate the directory */
+	bool			overflow;
+
+	/* request waiting for events */
+	struct cifsd_work	*pending;
+	cifsd_notify_done_fn	done;
+	int			reason;
+	/* entry on notify_pending while a request waits */
+	struct list_head	pending_entry;
+	struct delayed_work	dwork;
+	void			*cancel_argv[1];
+};
+
+static struct fsnotify_group *notify_group;
+/* serializes looking up, creating and destroying the marks */
+static DEFINE_MUTEX(notify_mutex);
+/* handles with a waiting request */
+static DEFINE_SPINLOCK(notify_pending_lock);
+static LIST_HEAD(notify_pending);
+
+static bool notify_event_action(u32 mask, u32 *action, u32 *filter)
+{
+	u32 name_filter = mask & FS_ISDIR ? FILE_NOTIFY_CHANGE_DIR_NAME :
+					    FILE_NOTIFY_CHANGE_FILE_NAME;
+
+	if (mask & FS_CREATE) {
+		*action = FILE_ACTION_ADDED;
+		*filter = name_filter;
+	} else if (mask & FS_DELETE) {
+		*action = FILE_ACTION_REMOVED;
+		*filter = name_filter;
+	} else if (mask & FS_MOVED_FROM) {
+		*action = FILE_ACTION_RENAMED_OLD_NAME;
+		*filter = name_filter;
+	} else if (mask & FS_MOVED_TO) {
+		*action = FILE_ACTION_RENAMED_NEW_NAME;
+		*filter = name_filter;
+	} else if (mask & FS_MODIFY) {
+		*action = FILE_ACTION_MODIFIED;
+		*filter = FILE_NOTIFY_CHANGE_LAST_WRITE |
+			  FILE_NOTIFY_CHANGE_SIZE;
+	} else if (mask & FS_ATTRIB) {
+		*action = FILE_ACTION_MODIFIED;
+		*filter = FILE_NOTIFY_CHANGE_ATTRIBUTES |
+			  FILE_NOTIFY_CHANGE_LAST_WRITE |
+			  FILE_NOTIFY_CHANGE_LAST_ACCESS |
+			  FILE_NOTIFY_CHANGE_CREATION |
+			  FILE_NOTIFY_CHANGE_EA |
+			  FILE_NOTIFY_CHANGE_SECURITY;
+	} else {
+		return false;
+	}
+	return true;
+}
+
+/* Called with h->lock held */
+static void notify_free_events(struct cifsd_notify_handle *h)
+{
+	struct cifsd_notify_event *ev, *tmp;
+
+	list_for_each_entry_safe(ev, tmp, &h->events, entry) {
+		list_del(&ev->entry);
+		kfree(ev);
+	}
+	h->nr_events = 0;
+}
+
+static void notify_queue_event(struct cifsd_notify_handle *h, u32 action,
+			       const struct qstr *name)
+{
+	struct cifsd_notify_event *ev;
+
+	spin_lock(&h->lock);
+	if (h->overflow)
+		goto kick;
+
+	/* a write is reported once until the client picks it up */
+	if (!list_empty(&h->events)) {
+		ev = list_last_entry(&h->events, struct cifsd_notify_event,
+				     entry);
+		if (ev->action == action && ev->len == name->len &&
+		    !memcmp(ev->name, name->name, name->len))
+			goto kick;
+	}
+
+	ev = NULL;
+	if (h->nr_events < CIFSD_NOTIFY_MAX_EVENTS)
+		ev = kmalloc(sizeof(*ev) + name->len + 1, GFP_ATOMIC);
+	if (!ev) {
+		notify_free_events(h);
+		h->overflow = true;
+		goto kick;
+	}
+
+	ev->action = action;
+	ev->len = name->len;
+	memcpy(ev->name, name->name, name->len);
+	ev->name[name->len] = '\0';
+	list_add_tail(&ev->entry, &h->events);
+	h->nr_events++;
+kick:
+	if (h->pending)
+		queue_delayed_work(system_wq, &h->dwork,
+				   msecs_to_jiffies(READ_ONCE(notify_delay_ms)));
+	spin_unlock(&h->lock);
+}
+
+static int notify_mark_event(struct fsnotify_mark *mark, u32 mask,
+			     const struct qstr *file_name)
+{
+	struct cifsd_notify_watch *watch;
+	struct cifsd_notify_handle *h;
+	u32 action, filter;
+
+	/* only changes of entries are reported, not of the directory */
+	if (!mark || !file_name ||
+	    !notify_event_action(mask, &action, &filter))
+		return 0;
+
+	watch = container_of(mark, struct cifsd_notify_watch, mark);
+
+	spin_lock(&watch->lock);
+	list_for_each_entry(h, &watch->handles, entry) {
+		if (h->filter & filter)
+			notify_queue_event(h, action, file_name);
+	}
+	spin_unlock(&watch->lock);
+	return 0;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 10, 0)
+static int notify_handle_event(struct fsnotify_mark *mark, u32 mask,
+			       struct inode *inode, struct inode *dir,
+			       const struct qstr *file_name, u32 cookie)
+{
+	return notify_mark_event(mark, mask, file_name);
+}
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(5, 7, 0)
+static int notify_handle_event(struct fsnotify_group *group,
+			       struct inode *inode, u32 mask,
+			       const void *data, int data_type,
+			       const struct qstr *file_name, u32 cookie,
+			       struct fsnotify_iter_info *iter_info)
+{
+	return notify_mark_event(fsnotify_iter_inode_mark(iter_info), mask,
+				 file_name);
+}
+#else
+/* Before 5.7 the name of the entry comes as a plain string */
+static int notify_name_event(struct fsnotify_mark *mark, u32 mask,
+			     const unsigned char *file_name)
+{
+	struct qstr name;
+
+	if (!file_name)
+		return 0;
+	name = (struct qstr)QSTR_INIT(file_name, strlen(file_name));
+	return notify_mark_event(mark, mask, &name);
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 19, 0)
+static int notify_handle_event(struct fsnotify_group *group,
+			       struct inode *inode, u32 mask,
+			       const void *data, int data_type,
+			       const unsigned char *file_name, u32 cookie,
+			       struct fsnotify_iter_info *iter_info)
+{
+	return notify_name_event(fsnotify_iter_inode_mark(iter_info), mask,
+				 file_name);
+}
+#else
+static int notify_handle_event(struct fsnotify_group *group,
+			       struct inode *inode,
+			       struct fsnotify_mark *inode_mark,
+			       struct fsnotify_mark *vfsmount_mark,
+			       u32 mask, const void *data, int data_type,
+			       const unsigned char *file_name, u32 cookie,
+			       struct fsnotify_iter_info *iter_info)
+{
+	return notify_name_event(inode_mark, mask, file_name);
+}
+#endif
+#endif
+
+static void notify_free_mark(struct fsnotify_mark *mark)
+{
+	kfree(container_of(mark, struct cifsd_notify_watch, mark));
+}
+
+static const struct fsnotify_ops notify_ops = {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 10, 0)
+	.handle_inode_event	= notify_handle_event,
+#else
+	.handle_event		= notify_handle_event,
+#endif
+	.free_mark		= notify_free_mark,
+};
+
+static struct cifsd_notify_watch *notify_watch_get(struct inode *inode)
+{
+	struct cifsd_notify_watch *watch;
+	struct fsnotify_mark *mark;
+	int err;
+
+	mark = fsnotify_find_inode_mark(inode, notify_group);
+	if (mark)
+		return container_of(mark, struct cifsd_notify_watch, mark);
+
+	watch = kzalloc(sizeof(struct cifsd_notify_watch), GFP_KERNEL);
+	if (!watch)
+		return ERR_PTR(-ENOMEM);
+
+	spin_lock_init(&watch->lock);
+	INIT_LIST_HEAD(&watch->handles);
+	fsnotify_init_mark(&watch->mark, notify_group);
+	watch->mark.mask = CIFSD_NOTIFY_MASK;
+	err = fsnotify_add_inode_mark(&watch->mark, inode, 0);
+	if (err) {
+		fsnotify_put_mark(&watch->mark);
+		return ERR_PTR(err);
+	}
+	return watch;
+}
+
+/* The request is off the lists it was parked on */
+static void notify_unpark(struct cifsd_notify_handle *h,
+			  struct cifsd_work *work)
+{
+	struct cifsd_file *fp = h->fp;
+
+	spin_lock(&notify_pending_lock);
+	list_del_init(&h->pending_entry);
+	spin_unlock(&notify_pending_lock);
+
+	/* closing the handle already took it off blocked_works */
+	spin_lock(&fp->f_lock);
+	if (work->state != WORK_STATE_CLOSED)
+		list_del_init(&work->fp_entry);
+	spin_unlock(&fp->f_lock);
+	work->cancel_fn = NULL;
+	work->cancel_argv = NULL;
+}
+
+static void notify_complete_work(struct work_struct *wk)
+{
+	struct cifsd_notify_handle *h = container_of(to_delayed_work(wk),
+			struct cifsd_notify_handle, dwork);
+	struct cifsd_work *work;
+	cifsd_notify_done_fn done;
+	int reason;
+
+	spin_lock(&h->lock);
+	work = h->pending;
+	done = h->done;
+	reason = h->reason;
+	h->pending = NULL;
+	spin_unlock(&h->lock);
+
+	if (!work)
+		return;
+	notify_unpark(h, work);
+	done(work, h->fp, reason);
+}
+
+/**
+ * cifsd_notify_attach() - watch the entries of a directory handle
+ * @fp:		cifsd file pointer of the directory
+ * @filter:	FILE_NOTIFY_CHANGE_* completion filter
+ *
+ * Handles on the same directory share one fsnotify mark. Changes are
+ * buffered on the handle from the first request on, a later request
+ * only updates the filter.
+ *
+ * Return:	0 on success, otherwise error
+ */
+int cifsd_notify_attach(struct cifsd_file *fp, u32 filter)
+{
+	struct cifsd_notify_watch *watch;
+	struct cifsd_notify_handle *h;
+
+	if (!notify_group)
+		return -EOPNOTSUPP;
+
+	mutex_lock(&notify_mutex);
+	h = fp->notify;
+	if (h) {
+		spin_lock(&h->lock);
+		h->filter = filter;
+		spin_unlock(&h->lock);
+		mutex_unlock(&notify_mutex);
+		return 0;
+	}
+
+	h = kzalloc(sizeof(struct cifsd_notify_handle), GFP_KERNEL);
+	if (!h) {
+		mutex_unlock(&notify_mutex);
+		return -ENOMEM;
+	}
+
+	watch = notify_watch_get(FP_INODE(fp));
+	if (IS_ERR(watch)) {
+		mutex_unlock(&notify_mutex);
+		kfree(h);
+		return PTR_ERR(watch);
+	}
+
+	h->fp = fp;
+	h->watch = watch;
+	h->filter = filter;
+	spin_lock_init(&h->lock);
+	INIT_LIST_HEAD(&h->events);
+	INIT_LIST_HEAD(&h->pending_entry);
+	INIT_DELAYED_WORK(&h->dwork, notify_complete_work);
+	h->cancel_argv[0] = h;
+
+	spin_lock(&watch->lock);
+	list_add_tail(&h->entry, &watch->handles);
+	spin_unlock(&watch->lock);
+	fp->notify = h;
+	mutex_unlock(&notify_mutex);
+	return 0;
+}
+
+/**
+ * cifsd_notify_detach() - stop watching for a handle being freed
+ * @fp:		cifsd file pointer
+ *
+ * A request still waiting on the handle is completed with cleanup.
+ */
+void cifsd_notify_detach(struct cifsd_file *fp)
+{
+	struct cifsd_notify_handle *h = fp->notify;
+	struct cifsd_notify_watch *watch;
+	struct cifsd_work *work;
+	cifsd_notify_done_fn done;
+	bool last;
+
+	if (!h)
+		return;
+
+	watch = h->watch;
+	mutex_lock(&notify_mutex);
+	spin_lock(&watch->lock);
+	list_del(&h->entry);
+	last = list_empty(&watch->handles);
+	spin_unlock(&watch->lock);
+	if (last)
+		fsnotify_destroy_mark(&watch->mark, notify_group);
+	fsnotify_put_mark(&watch->mark);
+	fp->notify = NULL;
+	mutex_unlock(&notify_mutex);
+
+	/*
+	 * Take the request first, so that cancel or flush can't queue the
+	 * completion again once it has been cancelled.
+	 */
+	spin_lock(&h->lock);
+	work = h->pending;
+	done = h->done;
+	h->pending = NULL;
+	notify_free_events(h);
+	spin_unlock(&h->lock);
+	cancel_delayed_work_sync(&h->dwork);
+
+	if (work) {
+		notify_unpark(h, work);
+		done(work, fp, CIFSD_NOTIFY_CLEANUP);
+	}
+	kfree(h);
+}
+
+/**
+ * cifsd_notify_read() - encode the buffered changes of a handle
+ * @fp:		cifsd file pointer the changes are watched on
+ * @buf:	buffer for FILE_NOTIFY_INFORMATION entries
+ * @len:	size of @buf
+ * @nls:	codepage of the file names
+ *
+ * The buffered changes are dropped whether they fit or not.
+ *
+ * Return:	bytes of entries, 0 if there were no changes, -ENOSPC if
+ *		they didn't fit or were dropped before
+ */
+int cifsd_notify_read(struct cifsd_file *fp, void *buf, unsigned int len,
+		      const struct nls_table *nls)
+{
+	struct cifsd_notify_handle *h = fp->notify;
+	struct file_notify_information *info, *prev = NULL;
+	struct cifsd_notify_event *ev, *tmp;
+	unsigned int off = 0, name_len;
+	LIST_HEAD(events);
+	bool overflow;
+	int used = 0;
+
+	spin_lock(&h->lock);
+	list_splice_init(&h->events, &events);
+	h->nr_events = 0;
+	overflow = h->overflow;
+	h->overflow = false;
+	spin_unlock(&h->lock);
+
+	list_for_each_entry_safe(ev, tmp, &events, entry) {
+		/* a byte never takes more than one UTF-16 unit, plus the nul */
+		if (!overflow &&
+		    off + sizeof(*info) + (ev->len + 1) * 2 > len)
+			overflow = true;
+
+		if (!overflow) {
+			info = (struct file_notify_information *)(buf + off);
+			name_len = smbConvertToUTF16((__le16 *)info->FileName,
+						     ev->name, ev->len,
+						     nls, 0) * 2;
+			info->NextEntryOffset = 0;
+			info->Action = cpu_to_le32(ev->action);
+			info->FileNameLength = cpu_to_le32(name_len);
+			if (prev)
+				prev->NextEntryOffset =
+					cpu_to_le32((char *)info - (char *)prev);
+			prev = info;
+			used = off + sizeof(*info) + name_len;
+			off = ALIGN(used, 4);
+		}
+		list_del(&ev->entry);
+		kfree(ev);
+	}
+
+	return overflow ? -ENOSPC : used;
+}
+
+static void cifsd_notify_cancel(void **argv)
+{
+	struct cifsd_notify_handle *h = argv[0];
+
+	spin_lock(&h->lock);
+	if (h->pending) {
+		if (h->pending->state == WORK_STATE_CLOSED)
+			h->reason = CIFSD_NOTIFY_CLEANUP;
+		else
+			h->reason = CIFSD_NOTIFY_CANCELLED;
+		mod_delayed_work(system_wq, &h->dwork, 0);
+	}
+	spin_unlock(&h->lock);
+}
+
+/**
+ * cifsd_notify_wait() - park a request until changes are buffered
+ * @fp:		cifsd file pointer the changes are watched on
+ * @work:	smb work of the request, completed asynchronously
+ * @done:	called from a workqueue to complete @work
+ *
+ * The request is woken by changes, cancel or close of the handle, and
+ * cifsd_notify_flush() of its connection.
+ *
+ * Return:	0 if the request was parked, -EAGAIN if changes are already
+ *		buffered, otherwise error
+ */
+int cifsd_notify_wait(struct cifsd_file *fp, struct cifsd_work *work,
+		      cifsd_notify_done_fn done)
+{
+	struct cifsd_notify_handle *h = fp->notify;
+
+	if (work->state == WORK_STATE_CANCELLED)
+		return -ECANCELED;
+
+	spin_lock(&h->lock);
+	if (h->pending) {
+		spin_unlock(&h->lock);
+		return -EBUSY;
+	}
+	if (!list_empty(&h->events) || h->overflow) {
+		spin_unlock(&h->lock);
+		return -EAGAIN;
+	}
+	h->pending = work;
+	h->done = done;
+	h->reason = CIFSD_NOTIFY_EVENTS;
+	work->cancel_argv = h->cancel_argv;
+	work->cancel_fn = cifsd_notify_cancel;
+	spin_unlock(&h->lock);
+
+	spin_lock(&notify_pending_lock);
+	list_add_tail(&h->pending_entry, &notify_pending);
+	spin_unlock(&notify_pending_lock);
+
+	spin_lock(&fp->f_lock);
+	list_add(&work->fp_entry, &fp->blocked_works);
+	spin_unlock(&fp->f_lock);
+	return 0;
+}
+
+/**
+ * cifsd_notify_flush() - complete the waiting requests of a connection
+ * @conn:	connection going away
+ */
+void cifsd_notify_flush(struct cifsd_tcp_conn *conn)
+{
+	struct cifsd_notify_handle *h;
+
+	spin_lock(&notify_pending_lock);
+	list_for_each_entry(h, &notify_pending, pending_entry) {
+		spin_lock(&h->lock);
+		if (h->pending && h->pending->conn == conn) {
+			h->reason = CIFSD_NOTIFY_CLEANUP;
+			mod_delayed_work(system_wq, &h->dwork, 0);
+		}
+		spin_unlock(&h->lock);
+	}
+	spin_unlock(&notify_pending_lock);
+}
+
+void cifsd_notify_destroy(void)
+{
+	if (!notify_group)
+		return;
+	fsnotify_destroy_group(notify_group);
+	notify_group = NULL;
+}
+
+int cifsd_notify_init(void)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 19, 0)
+	notify_group = fsnotify_alloc_group(&notify_ops, 0);
+#else
+	notify_group = fsnotify_alloc_group(&notify_ops);
+#endif
+	if (IS_ERR(notify_group)) {
+		cifsd_err("Failed to allocate fsnotify group : %ld\n",
+			  PTR_ERR(notify_group));
+		notify_group = NULL;
+		return -ENOMEM;
+	}
+	return 0;
+}
+
+#else
+
+/*
+ * Kernels before 4.12, and 5.9, are not hooked up to fsnotify, so
+ * smb2_notify() keeps answering with an interim response only.
+ */
+int cifsd_notify_attach(struct cifsd_file *fp, u32 filter)
+{
+	return -EOPNOTSUPP;
+}
+
+void cifsd_notify_detach(struct cifsd_file *fp)
+{
+}
+
+int cifsd_notify_read(struct cifsd_file *fp, void *buf, unsigned int len,
+		      const struct nls_table *nls)
+{
+	return 0;
+}
+
+int cifsd_notify_wait(struct cifsd_file *fp, struct cifsd_work *work,
+		      cifsd_notify_done_fn done)
+{
+	return -EOPNOTSUPP;
+}
+
+void cifsd_notify_flush(struct cifsd_tcp_conn *conn)
+{
+}
+
+void cifsd_notify_destroy(void)
+{
+}
+
+int cifsd_notify_init(void)
+{
+	return 0;
+}
+
+#endif
@@ -0,0 +1,37 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ *   Copyright (C) 2018 Samsung Electronics Co., Ltd.
+ */
+
+#ifndef __CIFSD_NOTIFY_H__
+#define __CIFSD_NOTIFY_H__
+
+#include <linux/types.h>
+
+struct cifsd_work;
+struct cifsd_file;
+struct cifsd_tcp_conn;
+struct nls_table;
+
+/* Reasons passed to the completion of a parked request */
+enum {
+	CIFSD_NOTIFY_EVENTS = 0,
+	CIFSD_NOTIFY_CANCELLED,
+	CIFSD_NOTIFY_CLEANUP,
+};
+
+typedef void (*cifsd_notify_done_fn)(struct cifsd_work *work,
+				     struct cifsd_file *fp, int reason);
+
+int cifsd_notify_attach(struct cifsd_file *fp, u32 filter);
+void cifsd_notify_detach(struct cifsd_file *fp);
+int cifsd_notify_read(struct cifsd_file *fp, void *buf, unsigned int len,
+		      const struct nls_table *nls);
+int cifsd_notify_wait(struct cifsd_file *fp, struct cifsd_work *work,
+		      cifsd_notify_done_fn done);
+void cifsd_notify_flush(struct cifsd_tcp_conn *conn);
+
+void cifsd_notify_destroy(void);
+int cifsd_notify_init(void);
+
+#endif /* __CIFSD_NOTIFY_H__ */
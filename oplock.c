@@ -4,20 +4,54 @@
  *   Copyright (C) 2018 Samsung Electronics Co., Ltd.
  */
 
+#include <linux/jhash.h>
+#include <linux/hashtable.h>
+#include <linux/math64.h>
+
 #include "glob.h"
 #include "oplock.h"
 
 #include "smb_common.h"
 #include "buffer_pool.h"
+#include "server.h"
 #include "transport_tcp.h"
 #include "mgmt/user_session.h"
+#include "trace.h"
 
 bool oplocks_enable;
 bool lease_enable;
+bool dir_lease_enable = true;
 bool durable_enable;
 
-LIST_HEAD(lease_table_list);
-static DEFINE_RWLOCK(lease_list_lock);
+/*
+ * Lease tables are hashed by ClientGUID and the leases of all of them by
+ * ClientGUID and lease key, both are looked up under RCU. Inserts and
+ * removals of tables are done under lease_table_lock, of leases under
+ * the lb_lock of their table and lease_hash_lock, in this order.
+ */
+#define LEASE_TABLE_HASH_BITS	8
+#define LEASE_HASH_BITS		12
+
+static DEFINE_HASHTABLE(lease_table_hash, LEASE_TABLE_HASH_BITS);
+static DEFINE_HASHTABLE(lease_hash, LEASE_HASH_BITS);
+static DEFINE_SPINLOCK(lease_table_lock);
+static DEFINE_SPINLOCK(lease_hash_lock);
+static atomic_t lease_table_nr;
+static atomic_t lease_nr;
+
+struct cifsd_lease_stats {
+	u64	lookups;
+	u64	hits;
+	u64	probes;
+};
+
+static DEFINE_PER_CPU(struct cifsd_lease_stats, lease_stats);
+/* protects break_waiters of all oplocks */
+static DEFINE_SPINLOCK(break_waiters_lock);
+/* runs the break timeouts, drained at shutdown before the module goes */
+static struct workqueue_struct *oplock_wq;
+
+static void opinfo_break_timeout(struct work_struct *wk);
 
 module_param(oplocks_enable, bool, 0644);
 MODULE_PARM_DESC(oplocks_enable, "Enable or disable oplocks. Default: y/Y/1");
@@ -25,6 +59,10 @@ MODULE_PARM_DESC(oplocks_enable, "Enable or disable oplocks. Default: y/Y/1");
 module_param(lease_enable, bool, 0644);
 MODULE_PARM_DESC(lease_enable, "Enable or disable lease. Default: y/Y/1");
 
+module_param(dir_lease_enable, bool, 0644);
+MODULE_PARM_DESC(dir_lease_enable,
+	"Enable or disable directory leases of SMB3. Default: y/Y/1");
+
 /**
  * get_new_opinfo() - allocate a new opinfo object for oplock info
  * @conn:     TCP server instance of connection
@@ -53,6 +91,8 @@ static struct oplock_info *alloc_opinfo(struct cifsd_work *work,
 	opinfo->is_smb2 = IS_SMB2(sess->conn);
 	INIT_LIST_HEAD(&opinfo->op_entry);
 	INIT_LIST_HEAD(&opinfo->interim_list);
+	INIT_LIST_HEAD(&opinfo->break_waiters);
+	INIT_DELAYED_WORK(&opinfo->break_timeout, opinfo_break_timeout);
 	init_waitqueue_head(&opinfo->oplock_q);
 	init_waitqueue_head(&opinfo->oplock_brk);
 	atomic_set(&opinfo->refcount, 1);
@@ -61,29 +101,75 @@ static struct oplock_info *alloc_opinfo(struct cifsd_work *work,
 	return opinfo;
 }
 
+static inline u32 lease_table_hashval(const char *client_guid)
+{
+	return jhash(client_guid, SMB2_CLIENT_GUID_SIZE, 0);
+}
+
+static inline u32 lease_hashval(const char *client_guid, const char *lease_key)
+{
+	return jhash(lease_key, SMB2_LEASE_KEY_SIZE,
+		     lease_table_hashval(client_guid));
+}
+
+/* Caller holds rcu_read_lock() or lease_table_lock */
+static struct lease_table *lease_table_lookup(const char *client_guid)
+{
+	struct lease_table *lb;
+
+	hash_for_each_possible_rcu(lease_table_hash, lb, l_hnode,
+				   lease_table_hashval(client_guid)) {
+		if (!memcmp(lb->client_guid, client_guid,
+			    SMB2_CLIENT_GUID_SIZE))
+			return lb;
+	}
+	return NULL;
+}
+
 static void lease_add_list(struct oplock_info *opinfo)
 {
 	struct lease_table *lb = opinfo->o_lease->l_lb;
 
 	spin_lock(&lb->lb_lock);
 	list_add_rcu(&opinfo->lease_entry, &lb->lease_list);
+	spin_lock(&lease_hash_lock);
+	hash_add_rcu(lease_hash, &opinfo->lease_hnode,
+		     lease_hashval(lb->client_guid,
+				   opinfo->o_lease->lease_key));
+	spin_unlock(&lease_hash_lock);
 	spin_unlock(&lb->lb_lock);
+	atomic_inc(&lease_nr);
 }
 
-static void lease_del_list(struct oplock_info *opinfo)
+/* Caller holds the lb_lock of the lease table of @opinfo */
+static void __lease_del_list(struct oplock_info *opinfo)
 {
-	struct lease_table *lb = opinfo->o_lease->l_lb;
-
-	spin_lock(&lb->lb_lock);
 	list_del_rcu(&opinfo->lease_entry);
-	spin_unlock(&lb->lb_lock);
+	spin_lock(&lease_hash_lock);
+	hash_del_rcu(&opinfo->lease_hnode);
+	spin_unlock(&lease_hash_lock);
+	atomic_dec(&lease_nr);
 }
 
-static void lb_add(struct lease_table *lb)
+static void lease_del_list(struct oplock_info *opinfo)
 {
-	write_lock(&lease_list_lock);
-	list_add(&lb->l_entry, &lease_table_list);
-	write_unlock(&lease_list_lock);
+	struct lease_table *lb;
+
+	/* destroy_lease_table() frees the table after a grace period */
+	rcu_read_lock();
+	lb = READ_ONCE(opinfo->o_lease->l_lb);
+	if (!lb)
+		goto out;
+
+	spin_lock(&lb->lb_lock);
+	/* the lease table may have been destroyed with its connection */
+	if (opinfo->o_lease->l_lb == lb) {
+		__lease_del_list(opinfo);
+		WRITE_ONCE(opinfo->o_lease->l_lb, NULL);
+	}
+	spin_unlock(&lb->lb_lock);
+out:
+	rcu_read_unlock();
 }
 
 static int alloc_lease(struct oplock_info *opinfo,
@@ -100,7 +186,13 @@ static int alloc_lease(struct oplock_info *opinfo,
 	lease->new_state = 0;
 	lease->flags = lctx->flags;
 	lease->duration = lctx->duration;
+	memcpy(lease->parent_lease_key, lctx->parent_lease_key,
+	       SMB2_LEASE_KEY_SIZE);
+	lease->version = lctx->version;
+	lease->epoch = le16_to_cpu(lctx->epoch) + 1;
+	lease->l_lb = NULL;
 	INIT_LIST_HEAD(&opinfo->lease_entry);
+	INIT_HLIST_NODE(&opinfo->lease_hnode);
 	opinfo->o_lease = lease;
 
 	return 0;
@@ -369,7 +461,7 @@ void close_id_del_oplock(struct cifsd_file *fp)
 {
 	struct oplock_info *opinfo;
 
-	if (!oplocks_enable || S_ISDIR(file_inode(fp->filp)->i_mode))
+	if (!oplocks_enable)
 		return;
 
 	opinfo = fp->f_opinfo;
@@ -386,6 +478,7 @@ void close_id_del_oplock(struct cifsd_file *fp)
 			atomic_set(&opinfo->breaking_cnt, 0);
 			wake_up_interruptible(&opinfo->oplock_brk);
 		}
+		opinfo_break_done(opinfo);
 	}
 
 	atomic_dec(&fp->f_ci->op_count);
@@ -411,6 +504,7 @@ static void smb2_send_lease_break_notification(struct work_struct *wk)
 		cifsd_debug("smb2_allocate_rsp_buf failed! ");
 		cifsd_tcp_conn_unlock(conn);
 		cifsd_free_work_struct(work);
+		atomic_dec(&conn->r_count);
 		return;
 	}
 
@@ -431,7 +525,7 @@ static void smb2_send_lease_break_notification(struct work_struct *wk)
 
 	rsp = (struct smb2_lease_break *)RESPONSE_BUF(work);
 	rsp->StructureSize = cpu_to_le16(44);
-	rsp->Reserved = 0;
+	rsp->Epoch = br_info->epoch;
 	rsp->Flags = 0;
 
 	if (br_info->curr_state & (SMB2_LEASE_WRITE_CACHING |
@@ -449,6 +543,7 @@ static void smb2_send_lease_break_notification(struct work_struct *wk)
 	cifsd_tcp_write(work);
 	cifsd_tcp_conn_unlock(conn);
 	cifsd_free_work_struct(work);
+	atomic_dec(&conn->r_count);
 }
 
 /**
@@ -493,6 +588,7 @@ static int smb1_oplock_break_notification(struct oplock_info *opinfo,
 		if (!rc) {
 			opinfo->level = OPLOCK_NONE;
 			opinfo->op_state = OPLOCK_STATE_NONE;
+			opinfo_break_done(opinfo);
 		}
 	} else {
 		smb1_send_oplock_break_notification(&work->work);
@@ -502,29 +598,19 @@ static int smb1_oplock_break_notification(struct oplock_info *opinfo,
 	return ret;
 }
 
-/**
- * smb2_oplock_break_notification() - send smb2 exclusive/batch to level2 oplock
- *		break command from server to client
- * @opinfo:		oplock info object
- * @ack_required	if requiring ack
- *
- * Return:      0 on success, otherwise error
- */
-static int smb2_oplock_break_notification(struct oplock_info *opinfo,
-	int ack_required)
+/* Build the work sending an oplock break of @opinfo to its client */
+static struct cifsd_work *smb2_oplock_break_work(struct oplock_info *opinfo)
 {
-	struct cifsd_tcp_conn *conn = opinfo->conn;
 	struct oplock_break_info *br_info;
-	int ret = 0;
 	struct cifsd_work *work = cifsd_alloc_work_struct();
 
 	if (!work)
-		return -ENOMEM;
+		return NULL;
 
-	br_info = kmalloc(sizeof(struct oplock_break_info), GFP_KERNEL);
+	br_info = cifsd_alloc_request(sizeof(struct oplock_break_info));
 	if (!br_info) {
 		cifsd_free_work_struct(work);
-		return -ENOMEM;
+		return NULL;
 	}
 
 	br_info->level = opinfo->level;
@@ -532,13 +618,32 @@ static int smb2_oplock_break_notification(struct oplock_info *opinfo,
 	br_info->open_trunc = opinfo->open_trunc;
 
 	work->request_buf = (char *)br_info;
-	work->conn = conn;
+	work->conn = cifsd_session_get_conn(opinfo->sess, opinfo->conn);
 	work->sess = opinfo->sess;
+	INIT_WORK(&work->work, smb2_send_oplock_break_notification);
+	return work;
+}
+
+/**
+ * smb2_oplock_break_notification() - send smb2 exclusive/batch to level2 oplock
+ *		break command from server to client
+ * @opinfo:		oplock info object
+ * @ack_required	if requiring ack
+ *
+ * Return:      0 on success, otherwise error
+ */
+static int smb2_oplock_break_notification(struct oplock_info *opinfo,
+	int ack_required)
+{
+	int ret = 0;
+	struct cifsd_work *work = smb2_oplock_break_work(opinfo);
+
+	if (!work)
+		return -ENOMEM;
 
 	if (ack_required) {
 		int rc;
 
-		INIT_WORK(&work->work, smb2_send_oplock_break_notification);
 		schedule_work(&work->work);
 
 		rc = wait_event_interruptible_timeout(opinfo->oplock_q,
@@ -550,6 +655,7 @@ static int smb2_oplock_break_notification(struct oplock_info *opinfo,
 		if (!rc) {
 			opinfo->level = SMB2_OPLOCK_LEVEL_NONE;
 			opinfo->op_state = OPLOCK_STATE_NONE;
+			opinfo_break_done(opinfo);
 		}
 	} else {
 		smb2_send_oplock_break_notification(&work->work);
@@ -742,42 +848,58 @@ static void wait_for_lease_break_ack(struct oplock_info *opinfo)
 			opinfo->o_lease->state = SMB2_LEASE_NONE;
 		opinfo->level = SMB2_OPLOCK_LEVEL_NONE;
 		opinfo->op_state = OPLOCK_STATE_NONE;
+		opinfo_break_done(opinfo);
 	}
 }
 
-/**
- * smb2_break_lease_notification() - break lease when a new client request
- *			write lease
- * @opinfo:		conains lease state information
- * @ack_required:	if requring ack
- *
- * Return:	0 on success, otherwise error
- */
-static int smb2_break_lease_notification(struct oplock_info *opinfo, int ack_required)
+/* Build the work sending a lease break of @opinfo to its client */
+static struct cifsd_work *smb2_lease_break_work(struct oplock_info *opinfo)
 {
-	struct cifsd_tcp_conn *conn = opinfo->conn;
-	struct list_head *tmp, *t;
 	struct cifsd_work *work;
 	struct lease_break_info *br_info;
 	struct lease *lease = opinfo->o_lease;
 
 	work = cifsd_alloc_work_struct();
 	if (!work)
-		return -ENOMEM;
+		return NULL;
 
-	br_info = kmalloc(sizeof(struct lease_break_info), GFP_KERNEL);
+	br_info = cifsd_alloc_request(sizeof(struct lease_break_info));
 	if (!br_info) {
 		cifsd_free_work_struct(work);
-		return -ENOMEM;
+		return NULL;
 	}
 
 	br_info->curr_state = lease->state;
 	br_info->new_state = lease->new_state;
+	if (lease->version == 2)
+		br_info->epoch = cpu_to_le16(++lease->epoch);
+	else
+		br_info->epoch = 0;
 	memcpy(br_info->lease_key, lease->lease_key, SMB2_LEASE_KEY_SIZE);
 
 	work->request_buf = (char *)br_info;
-	work->conn = conn;
+	work->conn = cifsd_session_get_conn(opinfo->sess, opinfo->conn);
 	work->sess = opinfo->sess;
+	INIT_WORK(&work->work, smb2_send_lease_break_notification);
+	return work;
+}
+
+/**
+ * smb2_break_lease_notification() - break lease when a new client request
+ *			write lease
+ * @opinfo:		conains lease state information
+ * @ack_required:	if requring ack
+ *
+ * Return:	0 on success, otherwise error
+ */
+static int smb2_break_lease_notification(struct oplock_info *opinfo, int ack_required)
+{
+	struct list_head *tmp, *t;
+	struct cifsd_work *work;
+
+	work = smb2_lease_break_work(opinfo);
+	if (!work)
+		return -ENOMEM;
 
 	if (ack_required) {
 		list_for_each_safe(tmp, t, &opinfo->interim_list) {
@@ -788,7 +910,6 @@ static int smb2_break_lease_notification(struct oplock_info *opinfo, int ack_req
 			smb2_send_interim_resp(in_work, STATUS_PENDING);
 			list_del(&in_work->interim_entry);
 		}
-		INIT_WORK(&work->work, smb2_send_lease_break_notification);
 		schedule_work(&work->work);
 		wait_for_lease_break_ack(opinfo);
 
@@ -814,6 +935,40 @@ static int smb2_break_lease_notification(struct oplock_info *opinfo, int ack_req
 	return 0;
 }
 
+/* Pick the state a lease is broken to and wait for the ack if needed */
+static void lease_set_break_state(struct oplock_info *brk_opinfo)
+{
+	struct lease *lease = brk_opinfo->o_lease;
+
+	if (brk_opinfo->open_trunc) {
+		/*
+		 * Create overwrite break trigger the lease break to
+		 * none.
+		 */
+		lease->new_state = SMB2_LEASE_NONE;
+	} else {
+		if (lease->state & SMB2_LEASE_WRITE_CACHING) {
+			if (lease->state & SMB2_LEASE_HANDLE_CACHING)
+				lease->new_state =
+					SMB2_LEASE_READ_CACHING |
+					SMB2_LEASE_HANDLE_CACHING;
+			else
+				lease->new_state =
+					SMB2_LEASE_READ_CACHING;
+		} else {
+			if (lease->state & SMB2_LEASE_HANDLE_CACHING)
+				lease->new_state =
+					SMB2_LEASE_READ_CACHING;
+			else
+				lease->new_state = SMB2_LEASE_NONE;
+		}
+	}
+
+	if (lease->state & (SMB2_LEASE_WRITE_CACHING |
+			SMB2_LEASE_HANDLE_CACHING))
+		brk_opinfo->op_state = OPLOCK_ACK_WAIT;
+}
+
 static int smb_send_oplock_break_notification(struct oplock_info *brk_opinfo)
 {
 	int err = 0;
@@ -822,6 +977,7 @@ static int smb_send_oplock_break_notification(struct oplock_info *brk_opinfo)
 	/* Need to break exclusive/batch oplock, write lease or overwrite_if */
 	cifsd_debug("request to send oplock(level : 0x%x) break notification\n",
 		brk_opinfo->level);
+	trace_cifsd_oplock_break_send(brk_opinfo);
 
 	if (brk_opinfo->is_lease) {
 		struct lease *lease = brk_opinfo->o_lease;
@@ -837,33 +993,7 @@ static int smb_send_oplock_break_notification(struct oplock_info *brk_opinfo)
 			brk_opinfo->open_trunc = 0;
 		}
 
-		if (brk_opinfo->open_trunc) {
-			/*
-			 * Create overwrite break trigger the lease break to
-			 * none.
-			 */
-			lease->new_state = SMB2_LEASE_NONE;
-		} else {
-			if (lease->state & SMB2_LEASE_WRITE_CACHING) {
-				if (lease->state & SMB2_LEASE_HANDLE_CACHING)
-					lease->new_state =
-						SMB2_LEASE_READ_CACHING |
-						SMB2_LEASE_HANDLE_CACHING;
-				else
-					lease->new_state =
-						SMB2_LEASE_READ_CACHING;
-			} else {
-				if (lease->state & SMB2_LEASE_HANDLE_CACHING)
-					lease->new_state =
-						SMB2_LEASE_READ_CACHING;
-				else
-					lease->new_state = SMB2_LEASE_NONE;
-			}
-		}
-
-		if (lease->state & (SMB2_LEASE_WRITE_CACHING |
-				SMB2_LEASE_HANDLE_CACHING))
-			brk_opinfo->op_state = OPLOCK_ACK_WAIT;
+		lease_set_break_state(brk_opinfo);
 	} else if (brk_opinfo->level == SMB2_OPLOCK_LEVEL_BATCH ||
 		brk_opinfo->level == SMB2_OPLOCK_LEVEL_EXCLUSIVE)
 		brk_opinfo->op_state = OPLOCK_ACK_WAIT;
@@ -907,87 +1037,333 @@ static int smb_send_oplock_break_notification(struct oplock_info *brk_opinfo)
 	return err;
 }
 
-void destroy_lease_table(struct cifsd_tcp_conn *conn)
+/* Put the requests parked on the break of @opinfo back on the work queue */
+static void opinfo_break_resume(struct oplock_info *opinfo)
 {
-	struct lease_table *lb, *lbtmp;
-	struct oplock_info *opinfo;
+	struct cifsd_work *work, *tmp;
+	LIST_HEAD(ready);
+
+	spin_lock(&break_waiters_lock);
+	list_splice_init(&opinfo->break_waiters, &ready);
+	spin_unlock(&break_waiters_lock);
+
+	list_for_each_entry_safe(work, tmp, &ready, break_entry) {
+		struct smb2_hdr *rsp = RESPONSE_BUF(work);
+
+		list_del_init(&work->break_entry);
+		rsp->smb2_buf_length =
+			cpu_to_be32(HEADER_SIZE_NO_BUF_LEN(work->conn));
+		rsp->Status = 0;
+		cifsd_requeue_work(work);
+		opinfo_put(opinfo);
+	}
+}
+
+/**
+ * opinfo_break_done() - finish a break of an oplock or lease
+ * @opinfo:	oplock info object whose break was acked, timed out or closed
+ *
+ * Wakes up the waiters of a blocking break and puts the requests parked
+ * by smb_break_oplock_wait() back on the work queue.
+ */
+void opinfo_break_done(struct oplock_info *opinfo)
+{
+	wake_up_interruptible(&opinfo->oplock_q);
+	/* a running timeout drops its own reference */
+	if (cancel_delayed_work_sync(&opinfo->break_timeout))
+		opinfo_put(opinfo);
+	opinfo_break_resume(opinfo);
+}
+
+static void opinfo_break_timeout(struct work_struct *wk)
+{
+	struct oplock_info *opinfo = container_of(to_delayed_work(wk),
+		struct oplock_info, break_timeout);
+
+	if (opinfo->op_state == OPLOCK_ACK_WAIT) {
+		cifsd_debug("oplock break ack timed out\n");
+		if (opinfo->is_lease) {
+			opinfo->o_lease->state = SMB2_LEASE_NONE;
+			atomic_set(&opinfo->breaking_cnt, 0);
+			wake_up_interruptible(&opinfo->oplock_brk);
+		}
+		opinfo->level = SMB2_OPLOCK_LEVEL_NONE;
+		opinfo->op_state = OPLOCK_STATE_NONE;
+		wake_up_interruptible(&opinfo->oplock_q);
+	}
+
+	opinfo_break_resume(opinfo);
+	opinfo_put(opinfo);
+}
+
+static void opinfo_break_arm(struct oplock_info *opinfo)
+{
+	atomic_inc(&opinfo->refcount);
+	if (!queue_delayed_work(oplock_wq, &opinfo->break_timeout,
+			OPLOCK_WAIT_TIME))
+		opinfo_put(opinfo);
+}
+
+/*
+ * Send the break of a batch oplock or a write/handle lease without
+ * waiting for the ack, the timeout of an unanswered break is run from
+ * the break_timeout work instead.
+ */
+static int smb2_break_oplock_nowait(struct oplock_info *brk_opinfo)
+{
+	struct cifsd_work *work;
+
+	if (brk_opinfo->is_lease) {
+		lease_set_break_state(brk_opinfo);
+		work = smb2_lease_break_work(brk_opinfo);
+	} else {
+		brk_opinfo->op_state = OPLOCK_ACK_WAIT;
+		work = smb2_oplock_break_work(brk_opinfo);
+	}
+
+	if (!work) {
+		brk_opinfo->op_state = OPLOCK_STATE_NONE;
+		return -ENOMEM;
+	}
+
+	if (brk_opinfo->op_state != OPLOCK_ACK_WAIT) {
+		/* a read caching lease is broken without an ack */
+		brk_opinfo->level = SMB2_OPLOCK_LEVEL_NONE;
+		brk_opinfo->o_lease->state = brk_opinfo->o_lease->new_state;
+		schedule_work(&work->work);
+		return 0;
+	}
+
+	if (brk_opinfo->is_lease)
+		atomic_inc(&brk_opinfo->breaking_cnt);
+	opinfo_break_arm(brk_opinfo);
+	schedule_work(&work->work);
+	return 0;
+}
+
+/**
+ * smb_break_dir_lease() - break the directory leases of a changed child
+ * @dir:	directory whose child was created, renamed, deleted or had
+ *		its attributes set
+ * @fp:		handle the change was done through, or NULL
+ *
+ * The read caching of the leases is broken to none without waiting for
+ * the acks. The lease whose key is the parent lease key of the lease of
+ * @fp is kept, its client made the change itself.
+ */
+void smb_break_dir_lease(struct inode *dir, struct cifsd_file *fp)
+{
+	struct cifsd_inode *ci;
+	struct oplock_info *brk_op, *op = NULL;
+
+	if (!oplocks_enable || !dir_lease_enable)
+		return;
+
+	ci = cifsd_inode_lookup_by_vfsinode(dir);
+	if (!ci)
+		return;
+
+	if (!atomic_read(&ci->op_count))
+		goto out;
+
+	if (fp && fp->f_opinfo && fp->f_opinfo->is_lease &&
+	    fp->f_opinfo->o_lease->flags & SMB2_LEASE_FLAG_PARENT_LEASE_KEY_SET)
+		op = fp->f_opinfo;
+
+	rcu_read_lock();
+	list_for_each_entry_rcu(brk_op, &ci->m_op_list, op_entry) {
+		if (!brk_op->is_lease ||
+		    brk_op->o_lease->state == SMB2_LEASE_NONE ||
+		    brk_op->op_state == OPLOCK_ACK_WAIT)
+			continue;
+		if (op && compare_guid_key(brk_op, op->conn->ClientGUID,
+					   op->o_lease->parent_lease_key))
+			continue;
+		if (!atomic_inc_not_zero(&brk_op->refcount))
+			continue;
+		rcu_read_unlock();
+
+		brk_op->open_trunc = 1;
+		smb2_break_oplock_nowait(brk_op);
+
+		opinfo_put(brk_op);
+		rcu_read_lock();
+	}
+	rcu_read_unlock();
+out:
+	cifsd_inode_put(ci);
+}
+
+/**
+ * smb_break_oplock_async() - start the break needed by an open without
+ *		waiting for it
+ * @work:	smb work of the open
+ * @inode:	inode being opened
+ * @lctx:	lease context of the open, or NULL
+ *
+ * Return:	oplock info of the oplock or lease being broken, with a
+ *		reference held, or NULL if the open has nothing to wait for
+ *		and goes on with smb_grant_oplock() as before
+ */
+struct oplock_info *smb_break_oplock_async(struct cifsd_work *work,
+		struct inode *inode, struct lease_ctx_info *lctx)
+{
+	struct cifsd_inode *ci;
+	struct oplock_info *opinfo, *prev = NULL;
+
+	ci = cifsd_inode_lookup_by_vfsinode(inode);
+	if (!ci)
+		return NULL;
+
+	if (!atomic_read(&ci->op_count))
+		goto out;
+
+	/* the break to a lease of the same client is done by grant */
+	if (lctx) {
+		bool same = false;
+
+		read_lock(&ci->m_lock);
+		list_for_each_entry(opinfo, &ci->m_op_list, op_entry) {
+			if (opinfo->is_lease &&
+			    compare_guid_key(opinfo, work->sess->conn->ClientGUID,
+					lctx->lease_key)) {
+				same = true;
+				break;
+			}
+		}
+		read_unlock(&ci->m_lock);
+		if (same)
+			goto out;
+	}
+
+	prev = opinfo_get_list(ci);
+	if (!prev)
+		goto out;
+
+	/*
+	 * Only a batch oplock or handle caching lease is broken before the
+	 * sharing mode check, the open fails on an exclusive one instead.
+	 */
+	if (!prev->is_smb2 || prev->level != SMB2_OPLOCK_LEVEL_BATCH)
+		goto put;
+
+	if (prev->op_state != OPLOCK_ACK_WAIT &&
+	    smb2_break_oplock_nowait(prev))
+		goto put;
+	goto out;
 
-	write_lock(&lease_list_lock);
-	if (list_empty(&lease_table_list)) {
-		write_unlock(&lease_list_lock);
+put:
+	opinfo_put(prev);
+	prev = NULL;
+out:
+	cifsd_inode_put(ci);
+	return prev;
+}
+
+/**
+ * smb_break_oplock_wait() - park an open until a break has finished
+ * @opinfo:	oplock info returned by smb_break_oplock_async()
+ * @work:	smb work of the open
+ *
+ * The work is put back on the work queue, to be processed again from
+ * the start, once the break is acked, times out or the broken handle is
+ * closed. The reference on @opinfo is consumed.
+ */
+void smb_break_oplock_wait(struct oplock_info *opinfo, struct cifsd_work *work)
+{
+	spin_lock(&break_waiters_lock);
+	if (opinfo->op_state != OPLOCK_ACK_WAIT) {
+		struct smb2_hdr *rsp = RESPONSE_BUF(work);
+
+		spin_unlock(&break_waiters_lock);
+		rsp->smb2_buf_length =
+			cpu_to_be32(HEADER_SIZE_NO_BUF_LEN(work->conn));
+		rsp->Status = 0;
+		cifsd_requeue_work(work);
+		opinfo_put(opinfo);
 		return;
 	}
 
-	list_for_each_entry_safe(lb, lbtmp, &lease_table_list, l_entry) {
+	/* the parked work keeps the reference until it is resumed */
+	list_add_tail(&work->break_entry, &opinfo->break_waiters);
+	spin_unlock(&break_waiters_lock);
+}
+
+int cifsd_oplock_init(void)
+{
+	oplock_wq = alloc_workqueue("kcifsd-oplock", 0, 0);
+	if (!oplock_wq)
+		return -ENOMEM;
+	return 0;
+}
+
+/*
+ * Called once all the files are closed, their close cancels the pending
+ * break timeouts, so this only waits for the running ones.
+ */
+void cifsd_oplock_destroy(void)
+{
+	if (!oplock_wq)
+		return;
+
+	destroy_workqueue(oplock_wq);
+	oplock_wq = NULL;
+}
+
+void destroy_lease_table(struct cifsd_tcp_conn *conn)
+{
+	struct lease_table *lb;
+	struct hlist_node *tmp;
+	struct oplock_info *opinfo, *optmp;
+	int bkt;
+
+	spin_lock(&lease_table_lock);
+	hash_for_each_safe(lease_table_hash, bkt, tmp, lb, l_hnode) {
 		if (conn && memcmp(lb->client_guid, conn->ClientGUID,
 			SMB2_CLIENT_GUID_SIZE))
 			continue;
-again:
-		rcu_read_lock();
-		list_for_each_entry_rcu(opinfo, &lb->lease_list,
+
+		spin_lock(&lb->lb_lock);
+		list_for_each_entry_safe(opinfo, optmp, &lb->lease_list,
 				lease_entry) {
-			rcu_read_unlock();
-			lease_del_list(opinfo);
-			goto again;
+			__lease_del_list(opinfo);
+			WRITE_ONCE(opinfo->o_lease->l_lb, NULL);
 		}
-		rcu_read_unlock();
-		list_del(&lb->l_entry);
-		kfree(lb);
+		spin_unlock(&lb->lb_lock);
+
+		hash_del_rcu(&lb->l_hnode);
+		atomic_dec(&lease_table_nr);
+		kfree_rcu(lb, l_rcu);
 	}
-	write_unlock(&lease_list_lock);
+	spin_unlock(&lease_table_lock);
 }
 
 int find_same_lease_key(struct cifsd_session *sess, struct cifsd_inode *ci,
 		struct lease_ctx_info *lctx)
 {
 	struct oplock_info *opinfo;
+	const char *client_guid = sess->conn->ClientGUID;
 	int err = 0;
-	struct lease_table *lb;
 
-	if (!lctx)
+	if (!lctx || !atomic_read(&lease_nr))
 		return err;
 
-	read_lock(&lease_list_lock);
-	if (list_empty(&lease_table_list)) {
-		read_unlock(&lease_list_lock);
-		return 0;
-	}
-
-	list_for_each_entry(lb, &lease_table_list, l_entry) {
-		if (!memcmp(lb->client_guid, sess->conn->ClientGUID,
-					SMB2_CLIENT_GUID_SIZE))
-			goto found;
-	}
-	read_unlock(&lease_list_lock);
-
-	return 0;
-
-found:
+	this_cpu_inc(lease_stats.lookups);
 	rcu_read_lock();
-	list_for_each_entry_rcu(opinfo, &lb->lease_list,
-			lease_entry) {
-		if (!atomic_inc_not_zero(&opinfo->refcount))
+	hash_for_each_possible_rcu(lease_hash, opinfo, lease_hnode,
+				   lease_hashval(client_guid, lctx->lease_key)) {
+		this_cpu_inc(lease_stats.probes);
+		if (!compare_guid_key(opinfo, client_guid, lctx->lease_key))
 			continue;
-		rcu_read_unlock();
 		if (opinfo->o_fp->f_ci == ci)
-			goto op_next;
-		err = compare_guid_key(opinfo,
-				sess->conn->ClientGUID,
-				lctx->lease_key);
-		if (err) {
-			err = -EINVAL;
-			cifsd_debug("found same lease key is already used in other files\n");
-			opinfo_put(opinfo);
-			goto out;
-		}
-op_next:
-		opinfo_put(opinfo);
-		rcu_read_lock();
+			continue;
+
+		this_cpu_inc(lease_stats.hits);
+		cifsd_debug("found same lease key is already used in other files\n");
+		err = -EINVAL;
+		break;
 	}
 	rcu_read_unlock();
-
-out:
-	read_unlock(&lease_list_lock);
 	return err;
 }
 
@@ -1006,28 +1382,39 @@ static void copy_lease(struct oplock_info *op1, struct oplock_info *op2)
 
 static void add_lease_global_list(struct oplock_info *opinfo)
 {
-	struct lease_table *lb;
-
-	read_lock(&lease_list_lock);
-	list_for_each_entry(lb, &lease_table_list, l_entry) {
-		if (!memcmp(lb->client_guid, opinfo->conn->ClientGUID,
-			SMB2_CLIENT_GUID_SIZE)) {
-			opinfo->o_lease->l_lb = lb;
-			lease_add_list(opinfo);
-			read_unlock(&lease_list_lock);
-			return;
-		}
+	const char *client_guid = opinfo->conn->ClientGUID;
+	struct lease_table *lb, *new_lb;
+
+	spin_lock(&lease_table_lock);
+	lb = lease_table_lookup(client_guid);
+	if (lb)
+		goto add;
+	spin_unlock(&lease_table_lock);
+
+	new_lb = kmalloc(sizeof(struct lease_table), GFP_KERNEL);
+	if (!new_lb) {
+		cifsd_err("lease table allocation failed\n");
+		return;
 	}
-	read_unlock(&lease_list_lock);
-
-	lb = kmalloc(sizeof(struct lease_table), GFP_KERNEL);
-	memcpy(lb->client_guid, opinfo->conn->ClientGUID,
-			SMB2_CLIENT_GUID_SIZE);
-	INIT_LIST_HEAD(&lb->lease_list);
-	spin_lock_init(&lb->lb_lock);
+	memcpy(new_lb->client_guid, client_guid, SMB2_CLIENT_GUID_SIZE);
+	INIT_LIST_HEAD(&new_lb->lease_list);
+	spin_lock_init(&new_lb->lb_lock);
+
+	spin_lock(&lease_table_lock);
+	/* another open of the client may have added it meanwhile */
+	lb = lease_table_lookup(client_guid);
+	if (lb) {
+		kfree(new_lb);
+	} else {
+		lb = new_lb;
+		hash_add_rcu(lease_table_hash, &lb->l_hnode,
+			     lease_table_hashval(client_guid));
+		atomic_inc(&lease_table_nr);
+	}
+add:
 	opinfo->o_lease->l_lb = lb;
 	lease_add_list(opinfo);
-	lb_add(lb);
+	spin_unlock(&lease_table_lock);
 }
 
 static void set_oplock_level(struct oplock_info *opinfo, int level,
@@ -1071,11 +1458,20 @@ int smb_grant_oplock(struct cifsd_work *work, int req_op_level, uint64_t pid,
 	struct cifsd_inode *ci = fp->f_ci;
 	int prev_op_has_lease = 0, prev_op_state = 0;
 
-	/* not support directory lease */
 	if (S_ISDIR(file_inode(fp->filp)->i_mode)) {
-		if (lctx)
-			lctx->dlease = 1;
-		return 0;
+		/* directory leases are v2 leases of R or RH */
+		if (!lctx || !dir_lease_enable || lctx->version != 2 ||
+		    !(sess->conn->srv_cap & SMB2_GLOBAL_CAP_DIRECTORY_LEASING) ||
+		    !(lctx->req_state & SMB2_LEASE_READ_CACHING)) {
+			if (lctx)
+				lctx->dlease = 1;
+			return 0;
+		}
+		lctx->req_state &= SMB2_LEASE_READ_CACHING |
+			SMB2_LEASE_HANDLE_CACHING;
+		req_op_level = SMB2_OPLOCK_LEVEL_II;
+		/* the sharing mode of directories isn't enforced */
+		share_ret = 0;
 	}
 
 	opinfo = alloc_opinfo(work, pid, tid);
@@ -1304,9 +1700,13 @@ void smb1_send_oplock_break_notification(struct work_struct *wk)
 	struct smb_hdr *rsp_hdr;
 	LOCK_REQ *req;
 	struct oplock_info *opinfo = (struct oplock_info *)REQUEST_BUF(work);
+	int rc;
 
 	cifsd_tcp_conn_lock(conn);
-	if (conn->ops->allocate_rsp_buf(work)) {
+	rc = conn->ops->allocate_rsp_buf(work);
+	/* opinfo is not owned by the work, don't free it with the work */
+	work->request_buf = NULL;
+	if (rc) {
 		cifsd_err("smb_allocate_rsp_buf failed! ");
 		cifsd_tcp_conn_unlock(conn);
 		cifsd_free_work_struct(work);
@@ -1383,6 +1783,7 @@ void smb2_send_oplock_break_notification(struct work_struct *wk)
 	if (!fp) {
 		cifsd_tcp_conn_unlock(conn);
 		cifsd_free_work_struct(work);
+		atomic_dec(&conn->r_count);
 		return;
 	}
 
@@ -1390,6 +1791,7 @@ void smb2_send_oplock_break_notification(struct work_struct *wk)
 		cifsd_err("smb2_allocate_rsp_buf failed! ");
 		cifsd_tcp_conn_unlock(conn);
 		cifsd_free_work_struct(work);
+		atomic_dec(&conn->r_count);
 		return;
 	}
 
@@ -1430,6 +1832,7 @@ void smb2_send_oplock_break_notification(struct work_struct *wk)
 	cifsd_tcp_write(work);
 	cifsd_tcp_conn_unlock(conn);
 	cifsd_free_work_struct(work);
+	atomic_dec(&conn->r_count);
 }
 
 /**
@@ -1452,6 +1855,35 @@ __u8 smb2_map_lease_to_oplock(__le32 lease_state)
 	return 0;
 }
 
+static void create_lease_v2_buf(u8 *rbuf, struct lease *lease)
+{
+	struct create_lease_v2 *buf = (struct create_lease_v2 *)rbuf;
+	char *LeaseKey = (char *)&lease->lease_key;
+	char *ParentLeaseKey = (char *)&lease->parent_lease_key;
+
+	memset(buf, 0, sizeof(struct create_lease_v2));
+	buf->lcontext.LeaseKeyLow = *((u64 *)LeaseKey);
+	buf->lcontext.LeaseKeyHigh = *((u64 *)(LeaseKey + 8));
+	buf->lcontext.LeaseFlags = lease->flags;
+	buf->lcontext.LeaseState = lease->state;
+	if (lease->flags & SMB2_LEASE_FLAG_PARENT_LEASE_KEY_SET) {
+		buf->lcontext.ParentLeaseKeyLow = *((u64 *)ParentLeaseKey);
+		buf->lcontext.ParentLeaseKeyHigh =
+			*((u64 *)(ParentLeaseKey + 8));
+	}
+	buf->lcontext.Epoch = cpu_to_le16(lease->epoch);
+	buf->ccontext.DataOffset = cpu_to_le16(offsetof
+					(struct create_lease_v2, lcontext));
+	buf->ccontext.DataLength = cpu_to_le32(sizeof(struct lease_context_v2));
+	buf->ccontext.NameOffset = cpu_to_le16(offsetof
+				(struct create_lease_v2, Name));
+	buf->ccontext.NameLength = cpu_to_le16(4);
+	buf->Name[0] = 'R';
+	buf->Name[1] = 'q';
+	buf->Name[2] = 'L';
+	buf->Name[3] = 's';
+}
+
 /**
  * create_lease_buf() - create lease context for open cmd response
  * @rbuf:	buffer to create lease context response
@@ -1462,6 +1894,11 @@ void create_lease_buf(u8 *rbuf, struct lease *lease)
 	struct create_lease *buf = (struct create_lease *)rbuf;
 	char *LeaseKey = (char *)&lease->lease_key;
 
+	if (lease->version == 2) {
+		create_lease_v2_buf(rbuf, lease);
+		return;
+	}
+
 	memset(buf, 0, sizeof(struct create_lease));
 	buf->lcontext.LeaseKeyLow = *((u64 *)LeaseKey);
 	buf->lcontext.LeaseKeyHigh = *((u64 *)(LeaseKey + 8));
@@ -1479,6 +1916,45 @@ void create_lease_buf(u8 *rbuf, struct lease *lease)
 	buf->Name[3] = 's';
 }
 
+/*
+ * Walk the create contexts of an open request. The contexts area was
+ * checked to lie within the request when it was decoded, each context
+ * is checked to lie within the area.
+ *
+ * Return:	first context for a NULL @cc, otherwise the one after @cc,
+ *		NULL after the last one, or error ptr for a bad context
+ */
+static struct create_context *next_create_context(struct smb2_create_req *req,
+						  struct create_context *cc,
+						  unsigned int *remain)
+{
+	unsigned int next;
+
+	if (!cc) {
+		*remain = le32_to_cpu(req->CreateContextsLength);
+		if (!*remain)
+			return NULL;
+		cc = (struct create_context *)((char *)req + 4 +
+				le32_to_cpu(req->CreateContextsOffset));
+	} else {
+		next = le32_to_cpu(cc->Next);
+		if (!next)
+			return NULL;
+		if (next > *remain)
+			return ERR_PTR(-EINVAL);
+		cc = (struct create_context *)((char *)cc + next);
+		*remain -= next;
+	}
+
+	if (*remain < sizeof(struct create_context) ||
+	    le16_to_cpu(cc->NameOffset) + le16_to_cpu(cc->NameLength) >
+	    *remain ||
+	    (u64)le16_to_cpu(cc->DataOffset) + le32_to_cpu(cc->DataLength) >
+	    *remain)
+		return ERR_PTR(-EINVAL);
+	return cc;
+}
+
 /**
  * parse_lease_state() - parse lease context containted in file open request
  * @open_req:	buffer containing smb2 file open(create) request
@@ -1488,9 +1964,8 @@ void create_lease_buf(u8 *rbuf, struct lease *lease)
  */
 struct lease_ctx_info *parse_lease_state(void *open_req)
 {
-	char *data_offset;
-	struct create_context *cc;
-	unsigned int next = 0;
+	struct create_context *cc = NULL;
+	unsigned int remain;
 	char *name;
 	bool found = false;
 	struct smb2_create_req *req = (struct smb2_create_req *)open_req;
@@ -1499,19 +1974,14 @@ struct lease_ctx_info *parse_lease_state(void *open_req)
 	if (!lreq)
 		return NULL;
 
-	data_offset = (char *)req + 4 + le32_to_cpu(req->CreateContextsOffset);
-	cc = (struct create_context *)data_offset;
-	do {
-		cc = (struct create_context *)((char *)cc + next);
+	while (!IS_ERR_OR_NULL(cc = next_create_context(req, cc, &remain))) {
 		name = le16_to_cpu(cc->NameOffset) + (char *)cc;
 		if (le16_to_cpu(cc->NameLength) != 4 ||
-				strncmp(name, SMB2_CREATE_REQUEST_LEASE, 4)) {
-			next = le32_to_cpu(cc->Next);
+				strncmp(name, SMB2_CREATE_REQUEST_LEASE, 4))
 			continue;
-		}
-		found = true;
+		found = remain >= sizeof(struct create_lease);
 		break;
-	} while (next != 0);
+	}
 
 	if (found) {
 		struct create_lease *lc = (struct create_lease *)cc;
@@ -1520,9 +1990,27 @@ struct lease_ctx_info *parse_lease_state(void *open_req)
 		lreq->req_state = lc->lcontext.LeaseState;
 		lreq->flags = lc->lcontext.LeaseFlags;
 		lreq->duration = lc->lcontext.LeaseDuration;
+		lreq->version = 1;
+
+		if (le32_to_cpu(cc->DataLength) >=
+				sizeof(struct lease_context_v2) &&
+		    remain >= sizeof(struct create_lease_v2)) {
+			struct create_lease_v2 *lc2 =
+				(struct create_lease_v2 *)cc;
+
+			lreq->version = 2;
+			lreq->epoch = lc2->lcontext.Epoch;
+			if (lreq->flags & SMB2_LEASE_FLAG_PARENT_LEASE_KEY_SET) {
+				*((u64 *)lreq->parent_lease_key) =
+					lc2->lcontext.ParentLeaseKeyLow;
+				*((u64 *)(lreq->parent_lease_key + 8)) =
+					lc2->lcontext.ParentLeaseKeyHigh;
+			}
+		}
 		return lreq;
 	}
 
+	kfree(lreq);
 	return NULL;
 }
 
@@ -1531,31 +2019,30 @@ struct lease_ctx_info *parse_lease_state(void *open_req)
  * @open_req:	buffer containing smb2 file open(create) request
  * @str:	context name to search for
  *
- * Return:      pointer to requested context, NULL if @str context not found
+ * Return:      pointer to requested context, -ENOENT if @str context not
+ *		found, -EINVAL for a malformed context
  */
 struct create_context *smb2_find_context_vals(void *open_req, const char *str)
 {
-	char *data_offset;
-	struct create_context *cc;
-	unsigned int next = 0;
-	char *name;
+	struct create_context *cc = NULL;
 	struct smb2_create_req *req = (struct smb2_create_req *)open_req;
+	unsigned int remain, len = strlen(str);
+	char *name;
 
-	data_offset = (char *)req + 4 + le32_to_cpu(req->CreateContextsOffset);
-	cc = (struct create_context *)data_offset;
-	do {
+	while ((cc = next_create_context(req, cc, &remain))) {
 		int val;
 
-		cc = (struct create_context *)((char *)cc + next);
+		if (IS_ERR(cc))
+			return cc;
+
 		name = le16_to_cpu(cc->NameOffset) + (char *)cc;
 		val = le16_to_cpu(cc->NameLength);
 		if (val < 4)
 			return ERR_PTR(-EINVAL);
 
-		if (strcmp(name, str) == 0)
+		if (val == len && !memcmp(name, str, len))
 			return cc;
-		next = le32_to_cpu(cc->Next);
-	} while (next != 0);
+	}
 
 	return ERR_PTR(-ENOENT);
 }
@@ -1676,51 +2163,63 @@ void create_disk_id_rsp_buf(char *cc, __u64 file_id, __u64 vol_id)
 struct oplock_info *lookup_lease_in_table(struct cifsd_tcp_conn *conn,
 	char *lease_key)
 {
-	struct oplock_info *opinfo = NULL, *ret_op = NULL;
-	struct lease_table *lt;
-	int ret;
-
-	read_lock(&lease_list_lock);
-	list_for_each_entry(lt, &lease_table_list, l_entry) {
-		if (!memcmp(lt->client_guid, conn->ClientGUID,
-			SMB2_CLIENT_GUID_SIZE))
-			goto found;
-	}
+	struct oplock_info *opinfo, *ret_op = NULL;
 
-	read_unlock(&lease_list_lock);
-	return NULL;
-
-found:
+	this_cpu_inc(lease_stats.lookups);
 	rcu_read_lock();
-	list_for_each_entry_rcu(opinfo, &lt->lease_list, lease_entry) {
-		if (!atomic_inc_not_zero(&opinfo->refcount))
-			continue;
-		rcu_read_unlock();
+	hash_for_each_possible_rcu(lease_hash, opinfo, lease_hnode,
+				   lease_hashval(conn->ClientGUID, lease_key)) {
+		this_cpu_inc(lease_stats.probes);
 		if (!opinfo->op_state ||
 			opinfo->op_state == OPLOCK_CLOSING)
-			goto op_next;
+			continue;
 		if (!(opinfo->o_lease->state &
 			(SMB2_LEASE_HANDLE_CACHING |
 			 SMB2_LEASE_WRITE_CACHING)))
-			goto op_next;
-		ret = compare_guid_key(opinfo, conn->ClientGUID,
-			lease_key);
-		if (ret) {
-			cifsd_debug("found opinfo\n");
-			ret_op = opinfo;
-			goto out;
-		}
-op_next:
-		opinfo_put(opinfo);
-		rcu_read_lock();
+			continue;
+		if (!compare_guid_key(opinfo, conn->ClientGUID, lease_key))
+			continue;
+		if (!atomic_inc_not_zero(&opinfo->refcount))
+			continue;
+
+		cifsd_debug("found opinfo\n");
+		this_cpu_inc(lease_stats.hits);
+		ret_op = opinfo;
+		break;
 	}
 	rcu_read_unlock();
-
-out:
-	read_unlock(&lease_list_lock);
 	return ret_op;
 }
 
+/**
+ * cifsd_lease_stats() - print statistics of the lease hash
+ * @buf:	output buffer
+ * @size:	size of @buf
+ *
+ * One line: lease tables, hashed leases, lookups, lookups which found a
+ * lease and the average number of leases looked at per lookup.
+ *
+ * Return:	number of bytes written to @buf
+ */
+ssize_t cifsd_lease_stats(char *buf, size_t size)
+{
+	struct cifsd_lease_stats *st, sum = {0};
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		st = per_cpu_ptr(&lease_stats, cpu);
+		sum.lookups += st->lookups;
+		sum.hits += st->hits;
+		sum.probes += st->probes;
+	}
+
+	return scnprintf(buf, size, "%d %d %llu %llu %llu\n",
+			 atomic_read(&lease_table_nr),
+			 atomic_read(&lease_nr),
+			 sum.lookups, sum.hits,
+			 sum.lookups ? div64_u64(sum.probes, sum.lookups) : 0);
+}
+
 int smb2_check_durable_oplock(struct cifsd_file *fp,
 	struct lease_ctx_info *lctx, char *name)
 {
@@ -7,6 +7,8 @@
 #ifndef __CIFSD_OPLOCK_H
 #define __CIFSD_OPLOCK_H
 
+#include <linux/workqueue.h>
+
 #define OPLOCK_WAIT_TIME	(35*HZ)
 
 /* SMB Oplock levels */
@@ -39,14 +41,19 @@ struct lease_ctx_info {
 	__le32	req_state;
 	__le32	flags;
 	__le64	duration;
+	__u8	parent_lease_key[SMB2_LEASE_KEY_SIZE];
+	__le16	epoch;
+	int	version;
 	int dlease;
 };
 
 struct lease_table {
 	char			client_guid[SMB2_CLIENT_GUID_SIZE];
 	struct list_head	lease_list;
-	struct list_head	l_entry;
+	/* entry on the lease table hash, by client_guid */
+	struct hlist_node	l_hnode;
 	spinlock_t		lb_lock;
+	struct rcu_head		l_rcu;
 };
 
 struct lease {
@@ -55,6 +62,10 @@ struct lease {
 	__le32			new_state;
 	__le32			flags;
 	__le64			duration;
+	/* lease key of the directory of a v2 lease, see flags */
+	__u8			parent_lease_key[SMB2_LEASE_KEY_SIZE];
+	unsigned short		epoch;
+	int			version;
 	struct lease_table	*l_lb;
 };
 
@@ -75,8 +86,13 @@ struct oplock_info {
 	struct list_head        interim_list;
 	struct list_head        op_entry;
 	struct list_head        lease_entry;
+	/* entry on the lease hash, by ClientGUID and lease key */
+	struct hlist_node	lease_hnode;
 	wait_queue_head_t oplock_q; /* Other server threads */
 	wait_queue_head_t oplock_brk; /* oplock breaking wait */
+	/* requests waiting for the break, see smb_break_oplock_async() */
+	struct list_head	break_waiters;
+	struct delayed_work	break_timeout;
 	bool			open_trunc:1;	/* truncate on open */
 	struct rcu_head		rcu_head;
 };
@@ -84,6 +100,7 @@ struct oplock_info {
 struct lease_break_info {
 	int curr_state;
 	int new_state;
+	__le16 epoch;
 	char lease_key[SMB2_LEASE_KEY_SIZE];
 };
 
@@ -100,6 +117,11 @@ extern void smb1_send_oplock_break_notification(struct work_struct *wk);
 extern void smb2_send_oplock_break_notification(struct work_struct *wk);
 extern void smb_break_all_levII_oplock(struct cifsd_tcp_conn *conn,
 	struct cifsd_file *fp, int is_trunc);
+struct oplock_info *smb_break_oplock_async(struct cifsd_work *work,
+	struct inode *inode, struct lease_ctx_info *lctx);
+void smb_break_oplock_wait(struct oplock_info *opinfo,
+	struct cifsd_work *work);
+void opinfo_break_done(struct oplock_info *opinfo);
 
 int opinfo_write_to_read(struct oplock_info *opinfo);
 int opinfo_read_handle_to_read(struct oplock_info *opinfo);
@@ -130,7 +152,11 @@ struct oplock_info *lookup_lease_in_table(struct cifsd_tcp_conn *conn,
 	char *lease_key);
 int find_same_lease_key(struct cifsd_session *sess, struct cifsd_inode *ci,
 	struct lease_ctx_info *lctx);
+int cifsd_oplock_init(void);
+void cifsd_oplock_destroy(void);
 void destroy_lease_table(struct cifsd_tcp_conn *conn);
+ssize_t cifsd_lease_stats(char *buf, size_t size);
+void smb_break_dir_lease(struct inode *dir, struct cifsd_file *fp);
 int smb2_check_durable_oplock(struct cifsd_file *fp,
 	struct lease_ctx_info *lctx, char *name);
 
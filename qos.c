@@ -0,0 +1,308 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ *   Copyright (C) 2018 Samsung Electronics Co., Ltd.
+ */
+
+#include <linux/moduleparam.h>
+#include <linux/spinlock.h>
+#include <linux/hrtimer.h>
+#include <linux/workqueue.h>
+#include <linux/math64.h>
+
+#include "glob.h"
+#include "qos.h"
+#include "server.h"
+#include "smb_common.h"
+#include "transport_tcp.h"
+#include "mgmt/user_session.h"
+#include "mgmt/tree_connect.h"
+#include "mgmt/share_config.h"
+
+/*
+ * Requests of a tree connect are admitted against the token bucket of
+ * their session and of their share. Requests which don't fit wait on the
+ * queue of their session, and the queues are served round robin, each
+ * session dispatching as many requests per round as the weight of the
+ * share its next request goes to.
+ */
+static unsigned int qos_session_max_iops;
+module_param(qos_session_max_iops, uint, 0644);
+MODULE_PARM_DESC(qos_session_max_iops,
+	"Request rate limit of new sessions, 0 for unlimited. Default: 0");
+
+static unsigned int qos_session_max_kbps;
+module_param(qos_session_max_kbps, uint, 0644);
+MODULE_PARM_DESC(qos_session_max_kbps,
+	"Read and write KiB/s limit of new sessions, 0 for unlimited. Default: 0");
+
+/* Requests more than this ahead of their bucket don't start a burst */
+#define CIFSD_QOS_BURST_NS	(100 * NSEC_PER_MSEC)
+/* Queued requests are looked at again after at most this long */
+#define CIFSD_QOS_MAX_DELAY_NS	(100 * NSEC_PER_MSEC)
+
+static DEFINE_SPINLOCK(qos_lock);
+static LIST_HEAD(qos_flows);
+static struct hrtimer qos_timer;
+static struct work_struct qos_dispatch_work;
+
+void cifsd_qos_bucket_init(struct cifsd_qos_bucket *b,
+			   unsigned int max_iops,
+			   unsigned long long max_bytes_per_sec)
+{
+	b->max_iops = max_iops;
+	b->max_bytes_per_sec = max_bytes_per_sec;
+	b->tat_ios = 0;
+	b->tat_bytes = 0;
+}
+
+void cifsd_qos_session_init(struct cifsd_session *sess)
+{
+	struct cifsd_qos_flow *flow = &sess->qos;
+
+	cifsd_qos_bucket_init(&flow->bucket,
+			      READ_ONCE(qos_session_max_iops),
+			      (u64)READ_ONCE(qos_session_max_kbps) * 1024);
+	INIT_LIST_HEAD(&flow->works);
+	INIT_LIST_HEAD(&flow->entry);
+	flow->nr_queued = 0;
+}
+
+static inline struct cifsd_qos_bucket *work_share_bucket(
+		struct cifsd_work *work)
+{
+	if (!work->tcon || !work->tcon->share_conf)
+		return NULL;
+	return &work->tcon->share_conf->qos;
+}
+
+static unsigned int work_share_weight(struct cifsd_work *work)
+{
+	if (!work->tcon || !work->tcon->share_conf ||
+	    !work->tcon->share_conf->qos_weight)
+		return 1;
+	return work->tcon->share_conf->qos_weight;
+}
+
+static ktime_t tat_charge(ktime_t tat, ktime_t now, u64 cost, u64 rate)
+{
+	ktime_t floor = ktime_sub_ns(now, CIFSD_QOS_BURST_NS);
+
+	if (ktime_before(tat, floor))
+		tat = floor;
+	return ktime_add_ns(tat, div64_u64(cost * NSEC_PER_SEC, rate));
+}
+
+/* Time left until @b admits a request, 0 if it does now */
+static s64 bucket_wait(struct cifsd_qos_bucket *b, ktime_t now)
+{
+	s64 wait = 0;
+
+	if (!b)
+		return 0;
+	if (b->max_iops)
+		wait = max(wait, ktime_to_ns(ktime_sub(b->tat_ios, now)));
+	if (b->max_bytes_per_sec)
+		wait = max(wait, ktime_to_ns(ktime_sub(b->tat_bytes, now)));
+	return wait;
+}
+
+static void bucket_charge(struct cifsd_qos_bucket *b, ktime_t now,
+			  unsigned int ios, unsigned int bytes)
+{
+	if (!b)
+		return;
+	if (b->max_iops)
+		b->tat_ios = tat_charge(b->tat_ios, now, ios, b->max_iops);
+	if (b->max_bytes_per_sec && bytes)
+		b->tat_bytes = tat_charge(b->tat_bytes, now, bytes,
+					  b->max_bytes_per_sec);
+}
+
+static s64 work_wait(struct cifsd_work *work, ktime_t now)
+{
+	return max(bucket_wait(&work->sess->qos.bucket, now),
+		   bucket_wait(work_share_bucket(work), now));
+}
+
+static void work_charge(struct cifsd_work *work, ktime_t now)
+{
+	bucket_charge(&work->sess->qos.bucket, now,
+		      work->qos_ios, work->qos_bytes);
+	bucket_charge(work_share_bucket(work), now,
+		      work->qos_ios, work->qos_bytes);
+}
+
+static void qos_arm_timer(ktime_t now, s64 wait)
+{
+	ktime_t expires;
+
+	wait = clamp_t(s64, wait, 0, CIFSD_QOS_MAX_DELAY_NS);
+	expires = ktime_add_ns(now, wait);
+	if (!hrtimer_active(&qos_timer) ||
+	    ktime_before(expires, hrtimer_get_expires(&qos_timer)))
+		hrtimer_start(&qos_timer, expires, HRTIMER_MODE_ABS);
+}
+
+/**
+ * cifsd_qos_admit() - admit a request to processing
+ * @work:	smb work with session and tree connect looked up
+ *
+ * Return:	true if the request can be processed now, false if it was
+ *		queued and will be put back on the work queue once admitted
+ */
+bool cifsd_qos_admit(struct cifsd_work *work)
+{
+	struct cifsd_session *sess = work->sess;
+	struct cifsd_qos_bucket *share_bucket = work_share_bucket(work);
+	struct cifsd_tcp_conn *conn = work->conn;
+	struct cifsd_qos_flow *flow;
+	ktime_t now;
+	s64 wait;
+
+	if (!sess || !work->tcon)
+		return true;
+
+	flow = &sess->qos;
+	if (!cifsd_qos_bucket_limited(&flow->bucket) &&
+	    !(share_bucket && cifsd_qos_bucket_limited(share_bucket)))
+		return true;
+
+	work->qos_ios = 1;
+	work->qos_bytes = 0;
+	if (conn->ops->qos_cost)
+		work->qos_bytes = conn->ops->qos_cost(work, &work->qos_ios);
+
+	spin_lock(&qos_lock);
+	now = ktime_get();
+	wait = work_wait(work, now);
+	if (list_empty(&flow->works) && wait <= 0) {
+		work_charge(work, now);
+		spin_unlock(&qos_lock);
+		return true;
+	}
+
+	work->qos_queued = true;
+	list_add_tail(&work->qos_entry, &flow->works);
+	flow->nr_queued++;
+	if (list_empty(&flow->entry))
+		list_add_tail(&flow->entry, &qos_flows);
+	qos_arm_timer(now, wait);
+	spin_unlock(&qos_lock);
+	return false;
+}
+
+/**
+ * cifsd_qos_throttled() - check if the session of a request is throttled
+ * @work:	smb work
+ *
+ * Return:	true if requests of the session are waiting for admission
+ */
+bool cifsd_qos_throttled(struct cifsd_work *work)
+{
+	return work->sess && READ_ONCE(work->sess->qos.nr_queued);
+}
+
+static void qos_dispatch(struct work_struct *wk)
+{
+	struct cifsd_qos_flow *flow, *tmp;
+	struct cifsd_work *work;
+	LIST_HEAD(ready);
+	bool progress;
+	ktime_t now;
+	s64 wait = CIFSD_QOS_MAX_DELAY_NS;
+	unsigned int n;
+
+	spin_lock(&qos_lock);
+	now = ktime_get();
+	do {
+		progress = false;
+		list_for_each_entry_safe(flow, tmp, &qos_flows, entry) {
+			for (n = 0; !list_empty(&flow->works); n++) {
+				work = list_first_entry(&flow->works,
+							struct cifsd_work,
+							qos_entry);
+				if (n >= work_share_weight(work) ||
+				    work_wait(work, now) > 0)
+					break;
+
+				work_charge(work, now);
+				list_move_tail(&work->qos_entry, &ready);
+				flow->nr_queued--;
+				progress = true;
+			}
+
+			if (list_empty(&flow->works))
+				list_del_init(&flow->entry);
+		}
+	} while (progress);
+
+	list_for_each_entry(flow, &qos_flows, entry) {
+		work = list_first_entry(&flow->works, struct cifsd_work,
+					qos_entry);
+		wait = min(wait, work_wait(work, now));
+	}
+	if (!list_empty(&qos_flows))
+		qos_arm_timer(now, wait);
+	spin_unlock(&qos_lock);
+
+	while (!list_empty(&ready)) {
+		work = list_first_entry(&ready, struct cifsd_work, qos_entry);
+		list_del_init(&work->qos_entry);
+		cifsd_requeue_work(work);
+	}
+}
+
+static enum hrtimer_restart qos_timer_fn(struct hrtimer *timer)
+{
+	schedule_work(&qos_dispatch_work);
+	return HRTIMER_NORESTART;
+}
+
+/**
+ * cifsd_qos_flush() - put queued requests back on the work queue
+ * @conn:	connection whose requests are flushed, or NULL
+ * @sess:	session whose requests are flushed, or NULL
+ *
+ * Queued requests are dispatched without being charged, so that a
+ * connection or session going away doesn't wait for its rate limit.
+ */
+void cifsd_qos_flush(struct cifsd_tcp_conn *conn, struct cifsd_session *sess)
+{
+	struct cifsd_qos_flow *flow, *tmp;
+	struct cifsd_work *work;
+	LIST_HEAD(ready);
+
+	spin_lock(&qos_lock);
+	list_for_each_entry_safe(flow, tmp, &qos_flows, entry) {
+		work = list_first_entry(&flow->works, struct cifsd_work,
+					qos_entry);
+		if ((sess && work->sess != sess) ||
+		    (conn && work->conn != conn))
+			continue;
+
+		list_splice_tail_init(&flow->works, &ready);
+		flow->nr_queued = 0;
+		list_del_init(&flow->entry);
+	}
+	spin_unlock(&qos_lock);
+
+	while (!list_empty(&ready)) {
+		work = list_first_entry(&ready, struct cifsd_work, qos_entry);
+		list_del_init(&work->qos_entry);
+		cifsd_requeue_work(work);
+	}
+}
+
+void cifsd_qos_destroy(void)
+{
+	hrtimer_cancel(&qos_timer);
+	cancel_work_sync(&qos_dispatch_work);
+	cifsd_qos_flush(NULL, NULL);
+}
+
+void cifsd_qos_init(void)
+{
+	hrtimer_init(&qos_timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+	qos_timer.function = qos_timer_fn;
+	INIT_WORK(&qos_dispatch_work, qos_dispatch);
+}
@@ -0,0 +1,55 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ *   Copyright (C) 2018 Samsung Electronics Co., Ltd.
+ */
+
+#ifndef __CIFSD_QOS_H__
+#define __CIFSD_QOS_H__
+
+#include <linux/ktime.h>
+#include <linux/list.h>
+
+struct cifsd_work;
+struct cifsd_session;
+struct cifsd_tcp_conn;
+
+/*
+ * Token bucket, kept as the theoretical arrival time of each limit: a
+ * request is admitted once the clock reaches it, and pushes it forward by
+ * its cost at the configured rate.
+ */
+struct cifsd_qos_bucket {
+	/* 0 means unlimited */
+	unsigned int		max_iops;
+	unsigned long long	max_bytes_per_sec;
+	ktime_t			tat_ios;
+	ktime_t			tat_bytes;
+};
+
+/* Per session queue of requests waiting for the session or share bucket */
+struct cifsd_qos_flow {
+	struct cifsd_qos_bucket	bucket;
+	struct list_head	works;
+	unsigned int		nr_queued;
+	/* Entry on the list of flows with queued requests */
+	struct list_head	entry;
+};
+
+static inline bool cifsd_qos_bucket_limited(struct cifsd_qos_bucket *b)
+{
+	return b->max_iops || b->max_bytes_per_sec;
+}
+
+void cifsd_qos_bucket_init(struct cifsd_qos_bucket *b,
+			   unsigned int max_iops,
+			   unsigned long long max_bytes_per_sec);
+void cifsd_qos_session_init(struct cifsd_session *sess);
+
+bool cifsd_qos_admit(struct cifsd_work *work);
+bool cifsd_qos_throttled(struct cifsd_work *work);
+void cifsd_qos_flush(struct cifsd_tcp_conn *conn, struct cifsd_session *sess);
+
+void cifsd_qos_destroy(void);
+void cifsd_qos_init(void);
+
+#endif /* __CIFSD_QOS_H__ */
@@ -17,14 +17,32 @@
 #include "server.h"
 #include "smb_common.h"
 #include "buffer_pool.h"
+#include "auth.h"
 #include "transport_tcp.h"
 #include "transport_ipc.h"
+#include "qos.h"
+#include "compress.h"
+#include "notify.h"
+#include "stats.h"
+#include "trace.h"
 #include "mgmt/user_session.h"
 
 int cifsd_debugging;
 
+/*
+ * Run independent SMB2 requests of one connection without conn->srv_mutex.
+ * Requests which change connection or session state are still serialized.
+ */
+static bool parallel_requests_enable;
+module_param(parallel_requests_enable, bool, 0644);
+MODULE_PARM_DESC(parallel_requests_enable,
+	"Process independent SMB2 requests in parallel. Default: n/N/0");
+
 struct cifsd_server_config server_conf;
 
+/* SMB request processing, steered to the connection receive CPU */
+static struct workqueue_struct *cifsd_wq;
+
 enum SERVER_CTRL_TYPE {
 	SERVER_CTRL_TYPE_INIT,
 	SERVER_CTRL_TYPE_RESET,
@@ -155,6 +173,7 @@ static int __process_request(struct cifsd_work *work,
 {
 	struct smb_version_cmds *cmds;
 	unsigned int command;
+	u64 start;
 	int ret;
 
 	if (check_conn_state(work))
@@ -168,6 +187,19 @@ static int __process_request(struct cifsd_work *work,
 	command = conn->ops->get_cmd_val(work);
 	*cmd = command;
 
+	/* received until the first command is processed */
+	if (work->queued_ns) {
+		cifsd_stats_phase(work, command, CIFSD_STATS_QUEUE,
+				  work->queued_ns);
+		work->queued_ns = 0;
+	}
+
+	if (conn->ops->check_credit_charge &&
+	    conn->ops->check_credit_charge(work)) {
+		conn->ops->set_rsp_status(work, STATUS_INVALID_PARAMETER);
+		return TCP_HANDLER_CONTINUE;
+	}
+
 andx_again:
 	if (command >= conn->max_cmds) {
 		conn->ops->set_rsp_status(work, STATUS_INVALID_PARAMETER);
@@ -190,9 +222,15 @@ andx_again:
 		}
 	}
 
-	mutex_unlock(&conn->srv_mutex);
+	if (work->serialized)
+		mutex_unlock(&conn->srv_mutex);
+	trace_cifsd_cmd_start(work, command, 0);
+	start = cifsd_stats_clock();
 	ret = cmds->proc(work);
-	mutex_lock(&conn->srv_mutex);
+	cifsd_stats_command(work, command, start, ret);
+	trace_cifsd_cmd_done(work, command, ret);
+	if (work->serialized)
+		mutex_lock(&conn->srv_mutex);
 
 	if (ret < 0)
 		cifsd_debug("Failed to process %u [%d]\n", command, ret);
@@ -208,24 +246,169 @@ andx_again:
 	return TCP_HANDLER_CONTINUE;
 }
 
-static void __handle_cifsd_work(struct cifsd_work *work,
-				struct cifsd_tcp_conn *conn)
+static bool smb2_parallel_cmd(unsigned int command)
 {
-	unsigned int command = 0;
+	switch (command) {
+	case SMB2_NEGOTIATE_HE:
+	case SMB2_SESSION_SETUP_HE:
+	case SMB2_LOGOFF_HE:
+	case SMB2_TREE_CONNECT_HE:
+	case SMB2_TREE_DISCONNECT_HE:
+		return false;
+	}
+	return true;
+}
+
+/**
+ * cifsd_work_serialized() - check if request must hold conn->srv_mutex
+ * @work:	smb work containing (decrypted) request buffer
+ *
+ * SMB1 requests, requests on a not yet negotiated connection and any
+ * compound containing a command that changes connection, session or tree
+ * connect state are processed under conn->srv_mutex.
+ *
+ * Return:	true if request must be serialized, otherwise false
+ */
+static bool cifsd_work_serialized(struct cifsd_work *work)
+{
+	char *buf = REQUEST_BUF(work);
+	unsigned int len = get_rfc1002_length(buf) + 4;
+	unsigned int off = 0;
+	struct smb2_hdr *hdr;
 	int rc;
 
-	if (conn->ops->allocate_rsp_buf(work))
-		return;
+	if (!cifsd_tcp_good(work) || len < sizeof(struct smb2_hdr))
+		return true;
 
-	if (conn->ops->is_transform_hdr &&
-		conn->ops->is_transform_hdr(REQUEST_BUF(work))) {
-		rc = conn->ops->decrypt_req(work);
+	do {
+		hdr = (struct smb2_hdr *)(buf + off);
+		if (hdr->ProtocolId != SMB2_PROTO_NUMBER)
+			return true;
+		if (!smb2_parallel_cmd(le16_to_cpu(hdr->Command)))
+			return true;
+
+		rc = smb2_next_compound_cmd(buf, &off);
+	} while (rc > 0);
+
+	/* a malformed compound is failed by the validation under the mutex */
+	return rc < 0;
+}
+
+/*
+ * Return:	true if the response is being encrypted asynchronously, it is
+ *		sent by handle_cifsd_work() once the work is queued again
+ */
+static bool __send_cifsd_work(struct cifsd_work *work,
+			      struct cifsd_tcp_conn *conn,
+			      unsigned int command)
+{
+	u64 start = cifsd_stats_clock();
+	int rc;
+
+send:
+	/*
+	 * Call set_rsp_credits() function to set number of credits granted in
+	 * hdr of smb2 response.
+	 */
+	if (is_smb2_rsp(work))
+		conn->ops->set_rsp_credits(work);
+
+	smb3_preauth_hash_rsp(work);
+	if (work->sess && work->sess->enc && work->encrypted &&
+		conn->ops->encrypt_resp) {
+		/* messages are compressed before they are encrypted */
+		if (conn->ops->compress_resp)
+			conn->ops->compress_resp(work);
+		rc = conn->ops->encrypt_resp(work);
+		if (rc == -EINPROGRESS)
+			return true;
 		if (rc < 0) {
 			conn->ops->set_rsp_status(work, STATUS_DATA_ERROR);
 			goto send;
 		}
+	} else {
+		if (work->sess && (work->sess->sign ||
+			smb3_final_sess_setup_resp(work) ||
+			(conn->ops->is_sign_req &&
+			conn->ops->is_sign_req(work, command))))
+			conn->ops->set_sign_rsp(work);
+
+		/* and after they are signed */
+		if (conn->ops->compress_resp)
+			conn->ops->compress_resp(work);
+	}
+
+	cifsd_tcp_write(work);
+	cifsd_stats_phase(work, command, CIFSD_STATS_SEND, start);
+	return false;
+}
+
+static bool __process_cifsd_work(struct cifsd_work *work,
+				 struct cifsd_tcp_conn *conn)
+{
+	unsigned int command = 0;
+	int rc;
+
+	do {
+		rc = __process_request(work, conn, &command);
+		if (rc == TCP_HANDLER_ABORT) {
+			cifsd_compound_fp_put(work);
+			return false;
+		}
+		if (work->async_pending) {
+			/* the completing thread can't release srv_mutex */
+			if (work->serialized) {
+				work->serialized = false;
+				mutex_unlock(&conn->srv_mutex);
+			}
+			/* which may even be done before this returns */
+			if (work->async_start)
+				work->async_start(work);
+			return true;
+		}
+	} while (is_chained_smb2_message(work));
+
+	cifsd_compound_fp_put(work);
+	return __send_cifsd_work(work, conn, command);
+}
+
+/*
+ * Return:	true if the request was queued by cifsd_qos_admit(), is
+ *		completed asynchronously or its response is being encrypted,
+ *		it is completed by handle_cifsd_work() once it is queued again
+ */
+static bool __handle_cifsd_work(struct cifsd_work *work,
+				struct cifsd_tcp_conn *conn)
+{
+	unsigned int command = 0;
+	bool state_change;
+	int rc = 0;
 
-		work->encrypted = true;
+	if (conn->ops->is_transform_hdr &&
+		conn->ops->is_transform_hdr(REQUEST_BUF(work))) {
+		rc = conn->ops->decrypt_req(work);
+		if (!rc)
+			work->encrypted = true;
+	}
+
+	if (!rc && conn->ops->is_compress_hdr &&
+		conn->ops->is_compress_hdr(REQUEST_BUF(work)))
+		rc = conn->ops->decompress_req(work);
+
+	/* The response is sized by the decrypted, uncompressed request */
+	if (conn->ops->allocate_rsp_buf(work))
+		return false;
+
+	if (rc < 0) {
+		conn->ops->set_rsp_status(work, STATUS_DATA_ERROR);
+		goto send;
+	}
+
+	/* The request is already accounted in req_running */
+	state_change = cifsd_work_serialized(work);
+	if (!work->serialized && state_change) {
+		mutex_lock(&conn->srv_mutex);
+		work->serialized = true;
 	}
 
 	rc = conn->ops->init_rsp_hdr(work);
@@ -252,35 +435,23 @@ static void __handle_cifsd_work(struct cifsd_work *work,
 		}
 	}
 
-	do {
-		rc = __process_request(work, conn, &command);
-		if (rc == TCP_HANDLER_ABORT)
-			return;
-	} while (is_chained_smb2_message(work));
-
-send:
 	/*
-	 * Call set_rsp_credits() function to set number of credits granted in
-	 * hdr of smb2 response.
+	 * Requests changing connection or session state are never held
+	 * back. The others wait for admission without conn->srv_mutex, also
+	 * when parallel_requests_enable is off, and take it back once they
+	 * are admitted, see handle_cifsd_work(). The work may already run
+	 * again when this unlocks.
 	 */
-	if (is_smb2_rsp(work))
-		conn->ops->set_rsp_credits(work);
+	if (!state_change && !cifsd_qos_admit(work)) {
+		if (work->serialized)
+			mutex_unlock(&conn->srv_mutex);
+		return true;
+	}
 
-	smb3_preauth_hash_rsp(work);
-	if (work->sess && work->sess->enc && work->encrypted &&
-		conn->ops->encrypt_resp) {
-		rc = conn->ops->encrypt_resp(work);
-		if (rc < 0) {
-			conn->ops->set_rsp_status(work, STATUS_DATA_ERROR);
-			goto send;
-		}
-	} else if (work->sess && (work->sess->sign ||
-		smb3_final_sess_setup_resp(work) ||
-		(conn->ops->is_sign_req &&
-		conn->ops->is_sign_req(work, command))))
-		conn->ops->set_sign_rsp(work);
+	return __process_cifsd_work(work, conn);
 
-	cifsd_tcp_write(work);
+send:
+	return __send_cifsd_work(work, conn, command);
 }
 
 /**
@@ -294,17 +465,82 @@ static void handle_cifsd_work(struct work_struct *wk)
 	struct cifsd_work *work = container_of(wk, struct cifsd_work, work);
 	struct cifsd_tcp_conn *conn = work->conn;
 
-	cifsd_tcp_conn_lock(conn);
+	if (work->crypt_pending) {
+		/* The request is still accounted in req_running */
+		if (conn->ops->encrypt_resp_done(work)) {
+			conn->ops->set_rsp_status(work, STATUS_DATA_ERROR);
+			if (__send_cifsd_work(work, conn, 0))
+				return;
+		} else {
+			cifsd_tcp_write(work);
+		}
+		goto done;
+	}
+
+	if (work->async_pending) {
+		/* Completed, the request is still accounted in req_running */
+		work->async_pending = false;
+		if (work->async_retry) {
+			/* Processed again from the start, e.g. after a break */
+			work->async_retry = false;
+			if (__process_cifsd_work(work, conn))
+				return;
+			goto done;
+		}
+		if (__send_cifsd_work(work, conn, conn->ops->get_cmd_val(work)))
+			return;
+		goto done;
+	}
+
+	if (work->qos_queued) {
+		/* Admitted, the request is still accounted in req_running */
+		work->qos_queued = false;
+		if (work->serialized)
+			mutex_lock(&conn->srv_mutex);
+		if (__process_cifsd_work(work, conn))
+			return;
+		goto done;
+	}
+
+	work->serialized = !parallel_requests_enable;
+	if (work->serialized)
+		cifsd_tcp_conn_lock(conn);
+	else
+		cifsd_tcp_conn_start_request(conn);
 	conn->stats.request_served++;
 
-	__handle_cifsd_work(work, conn);
+	if (__handle_cifsd_work(work, conn))
+		return;
 
+done:
+	cifsd_compound_fp_put(work);
 	cifsd_tcp_try_dequeue_request(work);
-	cifsd_tcp_conn_unlock(conn);
+	if (work->serialized)
+		cifsd_tcp_conn_unlock(conn);
+	else
+		cifsd_tcp_conn_end_request(conn);
+	/* the reference taken by the session lookup of the request */
+	if (work->sess)
+		cifsd_session_put(work->sess);
 	cifsd_free_work_struct(work);
 	atomic_dec(&conn->r_count);
 }
 
+/**
+ * cifsd_requeue_work() - put a request back on the worker thread queue
+ * @work:	smb work which was queued by cifsd_qos_admit(), or whose
+ *		response encryption completed
+ */
+void cifsd_requeue_work(struct cifsd_work *work)
+{
+	int cpu = cifsd_tcp_conn_rx_cpu(work->conn);
+
+	if (cpu >= 0)
+		queue_work_on(cpu, cifsd_wq, &work->work);
+	else
+		queue_work(cifsd_wq, &work->work);
+}
+
 /**
  * queue_cifsd_work() - queue a smb request to worker thread queue
  *		for proccessing smb command and sending response
@@ -315,6 +551,7 @@ static void handle_cifsd_work(struct work_struct *wk)
 static int queue_cifsd_work(struct cifsd_tcp_conn *conn)
 {
 	struct cifsd_work *work;
+	int cpu;
 
 	work = cifsd_alloc_work_struct();
 	if (!work) {
@@ -325,6 +562,11 @@ static int queue_cifsd_work(struct cifsd_tcp_conn *conn)
 	work->conn = conn;
 	work->request_buf = conn->request_buf;
 	conn->request_buf = NULL;
+	work->request_bvec = conn->request_bvec;
+	work->request_nr_bvec = conn->request_nr_bvec;
+	conn->request_bvec = NULL;
+	conn->request_nr_bvec = 0;
+	work->queued_ns = cifsd_stats_clock();
 
 	if (cifsd_init_smb_server(work)) {
 		cifsd_free_work_struct(work);
@@ -336,7 +578,17 @@ static int queue_cifsd_work(struct cifsd_tcp_conn *conn)
 	/* update activity on connection */
 	conn->last_active = jiffies;
 	INIT_WORK(&work->work, handle_cifsd_work);
-	schedule_work(&work->work);
+
+	/*
+	 * For the unbound workqueue the CPU only selects the NUMA node's
+	 * worker pool, for the per-CPU one it is the CPU the work runs on.
+	 */
+	cpu = cifsd_tcp_conn_rx_cpu(conn);
+	trace_cifsd_work_queue(work, cpu);
+	if (cpu >= 0)
+		queue_work_on(cpu, cifsd_wq, &work->work);
+	else
+		queue_work(cifsd_wq, &work->work);
 	return 0;
 }
 
@@ -390,10 +642,43 @@ static int server_conf_init(void)
 	return 0;
 }
 
+static int cifsd_workqueue_init(void)
+{
+	unsigned int flags = WQ_UNBOUND | WQ_SYSFS;
+
+	if (cifsd_wq)
+		return 0;
+
+	if (server_conf.flags & CIFSD_GLOBAL_FLAG_PERCPU_WORKQUEUE)
+		flags = WQ_HIGHPRI;
+
+	cifsd_wq = alloc_workqueue("kcifsd-worker", flags,
+				   server_conf.max_active);
+	if (!cifsd_wq)
+		return -ENOMEM;
+	return 0;
+}
+
+static void cifsd_workqueue_destroy(void)
+{
+	if (!cifsd_wq)
+		return;
+
+	destroy_workqueue(cifsd_wq);
+	cifsd_wq = NULL;
+}
+
 static void server_ctrl_handle_init(struct server_ctrl_struct *ctrl)
 {
 	int ret;
 
+	ret = cifsd_workqueue_init();
+	if (ret) {
+		pr_err("Failed to allocate workqueue: %d\n", ret);
+		server_queue_ctrl_reset_work();
+		return;
+	}
+
 	ret = cifsd_tcp_init();
 	if (ret) {
 		pr_err("Failed to init TCP subsystem: %d\n", ret);
@@ -407,6 +692,8 @@ static void server_ctrl_handle_init(struct server_ctrl_struct *ctrl)
 static void server_ctrl_handle_reset(struct server_ctrl_struct *ctrl)
 {
 	cifsd_tcp_destroy();
+	cifsd_qos_destroy();
+	cifsd_workqueue_destroy();
 	server_conf.state = SERVER_STATE_STARTING_UP;
 }
 
@@ -494,11 +781,96 @@ static ssize_t stats_show(struct class *class,
 	return sz;
 }
 
+static ssize_t buffers_show(struct class *class,
+			    struct class_attribute *attr,
+			    char *buf)
+{
+	return cifsd_buffer_pool_stats(buf, PAGE_SIZE);
+}
+
+static ssize_t listeners_show(struct class *class,
+			      struct class_attribute *attr,
+			      char *buf)
+{
+	return cifsd_tcp_listener_stats(buf, PAGE_SIZE);
+}
+
+static ssize_t credits_show(struct class *class,
+			    struct class_attribute *attr,
+			    char *buf)
+{
+	return cifsd_tcp_credit_stats(buf, PAGE_SIZE);
+}
+
+static ssize_t inodes_show(struct class *class,
+			   struct class_attribute *attr,
+			   char *buf)
+{
+	return cifsd_inode_hash_stats(buf, PAGE_SIZE);
+}
+
+static ssize_t leases_show(struct class *class,
+			   struct class_attribute *attr,
+			   char *buf)
+{
+	return cifsd_lease_stats(buf, PAGE_SIZE);
+}
+
+static ssize_t readahead_show(struct class *class,
+			      struct class_attribute *attr,
+			      char *buf)
+{
+	return cifsd_readahead_stats(buf, PAGE_SIZE);
+}
+
+static ssize_t commands_show(struct class *class,
+			     struct class_attribute *attr,
+			     char *buf)
+{
+	return cifsd_cmd_stats(buf, PAGE_SIZE);
+}
+
+static ssize_t latency_show(struct class *class,
+			    struct class_attribute *attr,
+			    char *buf)
+{
+	return cifsd_cmd_latency_stats(buf, PAGE_SIZE);
+}
+
+static ssize_t memory_show(struct class *class,
+			   struct class_attribute *attr,
+			   char *buf)
+{
+	ssize_t sz;
+
+	sz = cifsd_fd_memory_stats(buf, PAGE_SIZE);
+	sz += cifsd_tcp_memory_stats(buf + sz, PAGE_SIZE - sz);
+	return sz;
+}
+
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 10, 0)
 static CLASS_ATTR_RO(stats);
+static CLASS_ATTR_RO(buffers);
+static CLASS_ATTR_RO(listeners);
+static CLASS_ATTR_RO(credits);
+static CLASS_ATTR_RO(inodes);
+static CLASS_ATTR_RO(readahead);
+static CLASS_ATTR_RO(leases);
+static CLASS_ATTR_RO(commands);
+static CLASS_ATTR_RO(latency);
+static CLASS_ATTR_RO(memory);
 
 static struct attribute *cifsd_control_class_attrs[] = {
 	&class_attr_stats.attr,
+	&class_attr_buffers.attr,
+	&class_attr_listeners.attr,
+	&class_attr_credits.attr,
+	&class_attr_inodes.attr,
+	&class_attr_readahead.attr,
+	&class_attr_leases.attr,
+	&class_attr_commands.attr,
+	&class_attr_latency.attr,
+	&class_attr_memory.attr,
 	NULL,
 };
 ATTRIBUTE_GROUPS(cifsd_control_class);
@@ -511,6 +883,15 @@ static struct class cifsd_control_class = {
 #else
 static struct class_attribute cifsd_control_class_attrs[] = {
 	__ATTR_RO(stats),
+	__ATTR_RO(buffers),
+	__ATTR_RO(listeners),
+	__ATTR_RO(credits),
+	__ATTR_RO(inodes),
+	__ATTR_RO(readahead),
+	__ATTR_RO(leases),
+	__ATTR_RO(commands),
+	__ATTR_RO(latency),
+	__ATTR_RO(memory),
 	__ATTR_NULL,
 };
 
@@ -528,11 +909,18 @@ static int cifsd_server_shutdown(void)
 	class_unregister(&cifsd_control_class);
 	cifsd_ipc_release();
 	cifsd_tcp_destroy();
+	cifsd_qos_destroy();
+	cifsd_workqueue_destroy();
+	cifsd_stats_destroy();
 	cifsd_free_session_table();
 
 	cifsd_free_global_file_table();
+	cifsd_notify_destroy();
+	cifsd_oplock_destroy();
 	destroy_lease_table(NULL);
 	cifsd_destroy_buffer_pools();
+	cifsd_compress_destroy();
+	cifsd_crypto_destroy();
 	exit_cifsd_idmap();
 	server_conf_free();
 	return 0;
@@ -549,6 +937,7 @@ static int __init cifsd_server_init(void)
 	}
 
 	cifsd_server_tcp_callbacks_init();
+	cifsd_qos_init();
 
 	ret = server_conf_init();
 	if (ret)
@@ -558,6 +947,26 @@ static int __init cifsd_server_init(void)
 	if (ret)
 		return ret;
 
+	ret = cifsd_stats_init();
+	if (ret)
+		goto error;
+
+	ret = cifsd_crypto_init();
+	if (ret)
+		goto error;
+
+	ret = cifsd_compress_init();
+	if (ret)
+		goto error;
+
+	ret = cifsd_notify_init();
+	if (ret)
+		goto error;
+
+	ret = cifsd_oplock_init();
+	if (ret)
+		goto error;
+
 	ret = cifsd_init_session_table();
 	if (ret)
 		goto error;
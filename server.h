@@ -34,6 +34,9 @@ struct cifsd_server_config {
 	unsigned short		ipc_timeout;
 	unsigned long		ipc_last_active;
 	unsigned long		deadtime;
+	unsigned int		flags;
+	unsigned int		max_active;
+	unsigned int		tcp_backlog;
 	struct list_head	iface_list;
 };
 
@@ -62,4 +65,7 @@ int server_queue_ctrl_init_work(void);
 int server_queue_ctrl_reset_work(void);
 
 int cifsd_server_daemon_heartbeat(void);
+
+struct cifsd_work;
+void cifsd_requeue_work(struct cifsd_work *work);
 #endif /* __SERVER_H__ */
@@ -305,6 +305,7 @@ int smb_session_disconnect(struct cifsd_work *work)
 
 	cifsd_tree_conn_session_logoff(sess);
 	cifsd_session_destroy(sess);
+	cifsd_session_put(sess);
 	work->sess = NULL;
 
 	/* let start_tcp_sess free conn info now */
@@ -1221,6 +1222,8 @@ int smb_session_setup_andx(struct cifsd_work *work)
 		}
 
 		cifsd_session_register(conn, sess);
+		/* as a looked up one, for work->sess */
+		cifsd_session_get(sess);
 		rsp->resp.hdr.Uid = sess->id;
 		cifsd_debug("generate session(%p) ID : %llu, Uid : %u\n",
 				sess, sess->id, uid);
@@ -1248,6 +1251,7 @@ out_err:
 	rsp->resp.ByteCount = 0;
 	if (rc < 0 && sess) {
 		cifsd_session_destroy(sess);
+		cifsd_session_put(sess);
 		work->sess = NULL;
 	}
 	return rc;
@@ -1455,7 +1459,7 @@ lock_oplock_release(struct cifsd_file *fp, int type, int oplock_level)
 	}
 
 	opinfo->op_state = OPLOCK_STATE_NONE;
-	wake_up_interruptible(&opinfo->oplock_q);
+	opinfo_break_done(opinfo);
 
 	return 0;
 }
@@ -1479,6 +1483,8 @@ static struct cifsd_lock *smb_lock_init(struct file_lock *flock,
 		lock->zero_len = 1;
 	INIT_LIST_HEAD(&lock->llist);
 	INIT_LIST_HEAD(&lock->glist);
+	INIT_LIST_HEAD(&lock->clist);
+	RB_CLEAR_NODE(&lock->rb);
 	list_add_tail(&lock->llist, lock_list);
 
 	return lock;
@@ -1629,7 +1635,9 @@ int smb_locking_andx(struct cifsd_work *work)
 		int same_zero_lock = 0;
 
 		list_del(&smb_lock->llist);
+		err = 0;
 		/* check locks in global list */
+		spin_lock(&global_lock_list_lock);
 		list_for_each_entry(cmp_lock, &global_lock_list, glist) {
 			if (file_inode(cmp_lock->fl->fl_file) !=
 				file_inode(smb_lock->fl->fl_file))
@@ -1662,35 +1670,38 @@ int smb_locking_andx(struct cifsd_work *work)
 				err = -EPERM;
 			}
 
-			if (err) {
-				/* Clean error cache */
-				if ((smb_lock->zero_len &&
-						fp->cflock_cnt > 1) ||
-					(timeout && (fp->llock_fstart ==
-							smb_lock->start))) {
-					cifsd_debug("clean error cache\n");
-					fp->cflock_cnt = 0;
-				}
+			if (err)
+				break;
+		}
+		spin_unlock(&global_lock_list_lock);
 
-				if (timeout > 0 ||
-					(fp->cflock_cnt > 0 &&
-					fp->llock_fstart == smb_lock->start) ||
-					((smb_lock->start >> 63) == 0 &&
-					smb_lock->start >= 0xEF000000)) {
-					if (timeout) {
-						cifsd_debug("waiting error response for timeout : %d\n",
-							timeout);
-						msleep(timeout);
-					}
-					rsp->hdr.Status.CifsError =
-						STATUS_FILE_LOCK_CONFLICT;
-				} else
-					rsp->hdr.Status.CifsError =
-						STATUS_LOCK_NOT_GRANTED;
-				fp->cflock_cnt++;
-				fp->llock_fstart = smb_lock->start;
-				goto out;
+		if (err) {
+			/* Clean error cache */
+			if ((smb_lock->zero_len && fp->cflock_cnt > 1) ||
+				(timeout && (fp->llock_fstart ==
+						smb_lock->start))) {
+				cifsd_debug("clean error cache\n");
+				fp->cflock_cnt = 0;
 			}
+
+			if (timeout > 0 ||
+				(fp->cflock_cnt > 0 &&
+				fp->llock_fstart == smb_lock->start) ||
+				((smb_lock->start >> 63) == 0 &&
+				smb_lock->start >= 0xEF000000)) {
+				if (timeout) {
+					cifsd_debug("waiting error response for timeout : %d\n",
+						timeout);
+					msleep(timeout);
+				}
+				rsp->hdr.Status.CifsError =
+					STATUS_FILE_LOCK_CONFLICT;
+			} else
+				rsp->hdr.Status.CifsError =
+					STATUS_LOCK_NOT_GRANTED;
+			fp->cflock_cnt++;
+			fp->llock_fstart = smb_lock->start;
+			goto out;
 		}
 
 		if (same_zero_lock)
@@ -1705,23 +1716,30 @@ retry:
 		err = cifsd_vfs_lock(filp, smb_lock->cmd, flock);
 		if (err == FILE_LOCK_DEFERRED) {
 			cifsd_err("would have to wait for getting lock\n");
+			spin_lock(&global_lock_list_lock);
 			list_add_tail(&smb_lock->glist,
 					&global_lock_list);
+			spin_unlock(&global_lock_list_lock);
 			list_add(&smb_lock->llist, &rollback_list);
 wait:
 			err = cifsd_vfs_posix_lock_wait_timeout(flock,
 							msecs_to_jiffies(10));
 			if (err) {
 				list_del(&smb_lock->llist);
+				spin_lock(&global_lock_list_lock);
 				list_del(&smb_lock->glist);
+				spin_unlock(&global_lock_list_lock);
 				goto retry;
 			} else
 				goto wait;
 		} else if (!err) {
 skip:
+			spin_lock(&global_lock_list_lock);
 			list_add_tail(&smb_lock->glist,
 					&global_lock_list);
+			spin_unlock(&global_lock_list_lock);
 			list_add(&smb_lock->llist, &rollback_list);
+			cifsd_brl_grant(fp, smb_lock);
 			cifsd_err("successful in taking lock\n");
 		} else if (err < 0) {
 			rsp->hdr.Status.CifsError = STATUS_LOCK_NOT_GRANTED;
@@ -1772,7 +1790,9 @@ skip:
 		else
 			flock->fl_end = offset + length;
 
+		/* the lock found is taken off the list while it is unlocked */
 		locked = 0;
+		spin_lock(&global_lock_list_lock);
 		list_for_each_entry(cmp_lock, &global_lock_list, glist) {
 			if (file_inode(cmp_lock->fl->fl_file) !=
 				file_inode(flock->fl_file))
@@ -1780,10 +1800,12 @@ skip:
 
 			if ((cmp_lock->start == offset &&
 				 cmp_lock->end == offset + length)) {
+				list_del(&cmp_lock->glist);
 				locked = 1;
 				break;
 			}
 		}
+		spin_unlock(&global_lock_list_lock);
 
 		if (!locked) {
 			locks_free_lock(flock);
@@ -1794,13 +1816,20 @@ skip:
 		err = cifsd_vfs_lock(filp, cmd, flock);
 		if (!err) {
 			cifsd_debug("File unlocked\n");
-			list_del(&cmp_lock->glist);
+			cifsd_brl_release(fp, cmp_lock);
 			locks_free_lock(cmp_lock->fl);
 			kfree(cmp_lock);
 			fp->cflock_cnt = 0;
-		} else if (err == -ENOENT) {
-			rsp->hdr.Status.CifsError = STATUS_RANGE_NOT_LOCKED;
-			goto out;
+		} else {
+			spin_lock(&global_lock_list_lock);
+			list_add_tail(&cmp_lock->glist, &global_lock_list);
+			spin_unlock(&global_lock_list_lock);
+			if (err == -ENOENT) {
+				locks_free_lock(flock);
+				rsp->hdr.Status.CifsError =
+					STATUS_RANGE_NOT_LOCKED;
+				goto out;
+			}
 		}
 		locks_free_lock(flock);
 	}
@@ -1815,10 +1844,12 @@ skip:
 	if (req->AndXCommand != 0xFF) {
 		/* adjust response */
 		rsp->AndXCommand = req->AndXCommand;
+		cifsd_fd_put(fp);
 		return rsp->AndXCommand; /* More processing required */
 	}
 	rsp->AndXCommand = SMB_NO_MORE_ANDX_COMMAND;
 
+	cifsd_fd_put(fp);
 	return err;
 
 out:
@@ -1840,13 +1871,17 @@ out:
 		if (err)
 			cifsd_err("rollback unlock fail : %d\n", err);
 		list_del(&smb_lock->llist);
+		spin_lock(&global_lock_list_lock);
 		list_del(&smb_lock->glist);
+		spin_unlock(&global_lock_list_lock);
+		cifsd_brl_release(fp, smb_lock);
 		locks_free_lock(smb_lock->fl);
 		locks_free_lock(rlock);
 		kfree(smb_lock);
 	}
 
 	cifsd_err("failed in taking lock\n");
+	cifsd_fd_put(fp);
 	return err;
 }
 
@@ -2126,7 +2161,7 @@ int smb_nt_create_andx(struct cifsd_work *work)
 	char *root = NULL;
 	bool is_unicode;
 	bool is_relative_root = false;
-	struct cifsd_file *fp = NULL;
+	struct cifsd_file *fp = NULL, *root_fp = NULL;
 	int oplock_rsp = OPLOCK_NONE;
 	int share_ret;
 
@@ -2170,9 +2205,10 @@ int smb_nt_create_andx(struct cifsd_work *work)
 		cifsd_debug("path lookup relative to RootDirectoryFid\n");
 
 		is_relative_root = true;
-		fp = cifsd_lookup_fd_fast(work, req->RootDirectoryFid);
-		if (fp)
-			root = (char *)fp->filp->f_path.dentry->d_name.name;
+		root_fp = cifsd_lookup_fd_fast(work, req->RootDirectoryFid);
+		if (root_fp)
+			root = (char *)
+				root_fp->filp->f_path.dentry->d_name.name;
 		else {
 			rsp->hdr.Status.CifsError = STATUS_INVALID_HANDLE;
 			memset(&rsp->hdr.WordCount, 0, 3);
@@ -2188,6 +2224,7 @@ int smb_nt_create_andx(struct cifsd_work *work)
 		rsp->hdr.Status.CifsError =
 			STATUS_NO_MEMORY;
 
+		cifsd_fd_put(root_fp);
 		return -ENOMEM;
 	}
 
@@ -2212,6 +2249,7 @@ int smb_nt_create_andx(struct cifsd_work *work)
 			rsp->hdr.Status.CifsError =
 				STATUS_OBJECT_NAME_INVALID;
 
+		cifsd_fd_put(root_fp);
 		return PTR_ERR(name);
 	}
 
@@ -2224,6 +2262,7 @@ int smb_nt_create_andx(struct cifsd_work *work)
 		full_name = kzalloc(org_len + add_len + 3, GFP_KERNEL);
 		if (!full_name) {
 			kfree(name);
+			cifsd_fd_put(root_fp);
 			rsp->hdr.Status.CifsError = STATUS_NO_MEMORY;
 			return -ENOMEM;
 		}
@@ -2232,6 +2271,7 @@ int smb_nt_create_andx(struct cifsd_work *work)
 		strncat(full_name, name, org_len);
 		kfree(name);
 		name = full_name;
+		cifsd_fd_put(root_fp);
 	}
 
 	root = strrchr(name, '\\');
@@ -2740,6 +2780,24 @@ static int smb_read_andx_pipe(struct cifsd_work *work)
 	return ret;
 }
 
+/*
+ * Read data is sent from the page cache when the response isn't signed
+ * and ends the AndX chain, since the data pages go last, see
+ * cifsd_tcp_write().
+ */
+static bool smb_read_zerocopy(struct cifsd_work *work, READ_REQ *req,
+			      struct cifsd_file *fp)
+{
+	if (work->sess->sign ||
+	    req->hdr.Flags2 & SMBFLG2_SECURITY_SIGNATURE)
+		return false;
+
+	if (req->AndXCommand != SMB_NO_MORE_ANDX_COMMAND)
+		return false;
+
+	return cifsd_vfs_zerocopy_read(fp);
+}
+
 /**
  * smb_read_andx() - read request handler
  * @work:	smb work containing read command
@@ -2795,13 +2853,17 @@ int smb_read_andx(struct cifsd_work *work)
 	cifsd_debug("filename %s, offset %lld, count %zu\n", FP_FILENAME(fp),
 		pos, count);
 
-	work->aux_payload_buf = cifsd_alloc_request(count);
-	if (!work->aux_payload_buf) {
-		err = -ENOMEM;
-		goto out;
-	}
+	if (smb_read_zerocopy(work, req, fp)) {
+		nbytes = cifsd_vfs_splice_read(work, fp, count, &pos);
+	} else {
+		work->aux_payload_buf = cifsd_alloc_request(count);
+		if (!work->aux_payload_buf) {
+			err = -ENOMEM;
+			goto out;
+		}
 
-	nbytes = cifsd_vfs_read(work, fp, count, &pos);
+		nbytes = cifsd_vfs_read(work, fp, count, &pos);
+	}
 	if (nbytes < 0) {
 		err = nbytes;
 		goto out;
@@ -2832,6 +2894,7 @@ int smb_read_andx(struct cifsd_work *work)
 	if (req->AndXCommand != 0xFF) {
 		/* adjust response */
 		rsp->AndXCommand = req->AndXCommand;
+		cifsd_fd_put(fp);
 		return rsp->AndXCommand; /* More processing required */
 	}
 	rsp->AndXCommand = SMB_NO_MORE_ANDX_COMMAND;
@@ -2839,6 +2902,7 @@ int smb_read_andx(struct cifsd_work *work)
 out:
 	if (err)
 		rsp->hdr.Status.CifsError = STATUS_INVALID_HANDLE;
+	cifsd_fd_put(fp);
 	return err;
 }
 
@@ -2878,6 +2942,7 @@ int smb_write(struct cifsd_work *work)
 	} else
 		err = cifsd_vfs_write(work, fp, data_buf,
 				      count, &pos, 0, &nbytes);
+	cifsd_fd_put(fp);
 
 	rsp->hdr.WordCount = 1;
 	rsp->Written = cpu_to_le16(nbytes & 0xFFFF);
@@ -2954,6 +3019,37 @@ static int smb_write_andx_pipe(struct cifsd_work *work)
 	return ret;
 }
 
+/**
+ * smb1_bulk_write_len() - check if write data can be received into pages
+ * @buf:	first SMB1_WRITE_HDR_SIZE bytes of the PDU
+ *
+ * Only an unsigned WRITE_ANDX ending the AndX chain, whose data directly
+ * follows the fixed request part, qualifies. Everything else has to be
+ * received into one linear request buffer.
+ *
+ * Return:	write data length, or 0 if the PDU must be received linearly
+ */
+unsigned int smb1_bulk_write_len(char *buf)
+{
+	WRITE_REQ *req = (WRITE_REQ *)buf;
+	unsigned int len = get_rfc1002_length(buf) + 4;
+	unsigned int data_len;
+
+	if (req->hdr.Command != SMB_COM_WRITE_ANDX ||
+	    req->hdr.WordCount != 14 ||
+	    req->hdr.Flags2 & SMBFLG2_SECURITY_SIGNATURE ||
+	    req->AndXCommand != SMB_NO_MORE_ANDX_COMMAND)
+		return 0;
+
+	data_len = le16_to_cpu(req->DataLengthLow) |
+		le16_to_cpu(req->DataLengthHigh) << 16;
+	if (le16_to_cpu(req->DataOffset) != SMB1_WRITE_HDR_SIZE - 4 ||
+	    data_len != len - SMB1_WRITE_HDR_SIZE)
+		return 0;
+
+	return data_len;
+}
+
 /**
  * smb_write_andx() - andx write request handler
  * @work:	smb work containing write command
@@ -2976,6 +3072,11 @@ int smb_write_andx(struct cifsd_work *work)
 	if (test_share_config_flag(work->tcon->share_conf,
 				   CIFSD_SHARE_FLAG_PIPE)) {
 		cifsd_debug("Write ANDX called for IPC$");
+		/* pipe data is only taken from the request buffer */
+		if (HAS_REQUEST_PAGES(work)) {
+			rsp->hdr.Status.CifsError = STATUS_INVALID_PARAMETER;
+			return -EINVAL;
+		}
 		return smb_write_andx_pipe(work);
 	}
 
@@ -3024,8 +3125,13 @@ int smb_write_andx(struct cifsd_work *work)
 
 	cifsd_debug("filname %s, offset %lld, count %zu\n", FP_FILENAME(fp),
 		pos, count);
-	err = cifsd_vfs_write(work, fp, data_buf, count, &pos,
-			      writethrough, &nbytes);
+	if (HAS_REQUEST_PAGES(work))
+		err = cifsd_vfs_write_pages(work, fp, work->request_bvec,
+					    work->request_nr_bvec, count,
+					    &pos, writethrough, &nbytes);
+	else
+		err = cifsd_vfs_write(work, fp, data_buf, count, &pos,
+				      writethrough, &nbytes);
 	if (err < 0)
 		goto out;
 
@@ -3045,13 +3151,16 @@ int smb_write_andx(struct cifsd_work *work)
 	if (req->AndXCommand != 0xFF) {
 		/* adjust response */
 		rsp->AndXCommand = req->AndXCommand;
+		cifsd_fd_put(fp);
 		return rsp->AndXCommand; /* More processing required */
 	}
 	rsp->AndXCommand = SMB_NO_MORE_ANDX_COMMAND;
 
+	cifsd_fd_put(fp);
 	return 0;
 
 out:
+	cifsd_fd_put(fp);
 	if (err == -ENOSPC || err == -EFBIG)
 		rsp->hdr.Status.CifsError = STATUS_DISK_FULL;
 	else
@@ -5724,7 +5833,6 @@ static int find_first(struct cifsd_work *work)
 	TRANSACTION2_FFIRST_REQ_PARAMS *req_params;
 	T2_FFIRST_RSP_PARMS *params = NULL;
 	struct path path;
-	struct cifsd_dirent *de;
 	struct cifsd_file *dir_fp = NULL;
 	struct kstat kstat;
 	struct cifsd_kstat cifsd_kstat;
@@ -5735,17 +5843,8 @@ static int find_first(struct cifsd_work *work)
 	int srch_cnt = 0;
 	char *dirpath = NULL;
 	char *srch_ptr = NULL;
-	struct cifsd_readdir_data r_data = {
-		.ctx.actor = cifsd_fill_dirent,
-		.dirent = (void *)__get_free_page(GFP_KERNEL)
-	};
 	int header_size;
 
-	if (!r_data.dirent) {
-		rsp->hdr.Status.CifsError = STATUS_NO_MEMORY;
-		return -ENOMEM;
-	}
-
 	req_params = (TRANSACTION2_FFIRST_REQ_PARAMS *)(REQUEST_BUF(work) +
 			req->ParameterOffset + 4);
 	dirpath = smb_get_dir_name(share, req_params->FileName, PATH_MAX,
@@ -5774,13 +5873,22 @@ static int find_first(struct cifsd_work *work)
 	}
 
 	dir_fp->filename = dirpath;
-	dir_fp->readdir_data.dirent = r_data.dirent;
+	dir_fp->readdir_data.dirent = NULL;
 	dir_fp->readdir_data.used = 0;
 	dir_fp->readdir_data.full = 0;
 	dir_fp->dirent_offset = 0;
 	dir_fp->readdir_data.file_attr =
 		le16_to_cpu(req_params->SearchAttributes);
 
+	rc = cifsd_search_pattern_update(&dir_fp->search_pattern, srch_ptr);
+	if (rc) {
+		rsp->hdr.Status.CifsError = STATUS_NO_MEMORY;
+		goto err_out;
+	}
+
+	/* the search starts at the beginning, read it from the cache */
+	cifsd_dir_enum_attach(work, dir_fp);
+
 	if (params_count % 4)
 		data_alignment_offset = 4 - params_count % 4;
 
@@ -5806,7 +5914,7 @@ static int find_first(struct cifsd_work *work)
 						req_params->InformationLevel,
 						dir_fp,
 						&d_info,
-						srch_ptr,
+						dir_fp->search_pattern,
 						smb_populate_readdir_entry);
 		if (rc)
 			goto err_out;
@@ -5815,58 +5923,25 @@ static int find_first(struct cifsd_work *work)
 	d_info.name = NULL;
 	do {
 		kfree(d_info.name);
-		d_info.name = NULL;
-
-		if (dir_fp->dirent_offset >= dir_fp->readdir_data.used) {
-			dir_fp->dirent_offset = 0;
-			r_data.used = 0;
-			r_data.full = 0;
-			rc = cifsd_vfs_readdir(dir_fp->filp,
-					       &r_data);
-			if (rc < 0) {
-				cifsd_debug("err : %d\n", rc);
-				goto err_out;
-			}
-
-			dir_fp->readdir_data.used = r_data.used;
-			dir_fp->readdir_data.full = r_data.full;
-			if (!dir_fp->readdir_data.used) {
-				free_page((unsigned long)
-						(dir_fp->readdir_data.dirent));
-				dir_fp->readdir_data.dirent = NULL;
-				break;
-			}
+		cifsd_kstat.kstat = &kstat;
 
-			de = (struct cifsd_dirent *)
-				((char *)dir_fp->readdir_data.dirent);
-		} else {
-			de = (struct cifsd_dirent *)
-				((char *)dir_fp->readdir_data.dirent +
-				 dir_fp->dirent_offset);
+		rc = cifsd_dir_read_entry(work, dir_fp, dirpath, &cifsd_kstat,
+					  &d_info.name, &reclen);
+		if (rc == -ENODATA) {
+			rc = 0;
+			break;
 		}
-
-		reclen = ALIGN(sizeof(struct cifsd_dirent) + de->namelen,
-				sizeof(__le64));
-		dir_fp->dirent_offset += reclen;
-
-		if (dir_fp->readdir_data.file_attr &
-			SMB_SEARCH_ATTRIBUTE_DIRECTORY && de->d_type != DT_DIR)
+		if (rc)
+			goto err_out;
+		if (!d_info.name)
 			continue;
 
-		cifsd_kstat.kstat = &kstat;
-		d_info.name = cifsd_vfs_readdir_name(work,
-						     &cifsd_kstat,
-						     de,
-						     dirpath);
-		if (IS_ERR(d_info.name)) {
-			cifsd_debug("Cannot read dirent: %d\n",
-				    (int)PTR_ERR(d_info.name));
-			d_info.name = NULL;
+		if (dir_fp->readdir_data.file_attr &
+			SMB_SEARCH_ATTRIBUTE_DIRECTORY &&
+			!S_ISDIR(cifsd_kstat.kstat->mode))
 			continue;
-		}
 
-		if (!strncmp(de->name, ".", de->namelen) ||
-			!strncmp(de->name, "..", de->namelen))
+		if (!strcmp(d_info.name, ".") || !strcmp(d_info.name, ".."))
 			continue;
 
 		if (cifsd_share_veto_filename(share, d_info.name)) {
@@ -5874,7 +5949,8 @@ static int find_first(struct cifsd_work *work)
 			continue;
 		}
 
-		if (match_pattern(d_info.name, srch_ptr)) {
+		if (cifsd_search_pattern_match(dir_fp->search_pattern,
+					       d_info.name)) {
 			rc = smb_populate_readdir_entry(conn,
 						req_params->InformationLevel,
 						&d_info,
@@ -5895,7 +5971,7 @@ static int find_first(struct cifsd_work *work)
 	}
 
 	if (d_info.out_buf_len < 0)
-		dir_fp->dirent_offset -= reclen;
+		cifsd_dir_unread_entry(dir_fp, reclen);
 
 	params = (T2_FFIRST_RSP_PARMS *)((char *)rsp +
 			sizeof(TRANSACTION2_RSP));
@@ -5906,6 +5982,7 @@ static int find_first(struct cifsd_work *work)
 	if (d_info.out_buf_len < 0) {
 		cifsd_debug("%s continue search\n", __func__);
 		params->EndofSearch = cpu_to_le16(0);
+		cifsd_dir_release_page(dir_fp);
 	} else {
 		cifsd_debug("%s end of search\n", __func__);
 		params->EndofSearch = cpu_to_le16(1);
@@ -5973,7 +6050,6 @@ static int find_next(struct cifsd_work *work)
 	TRANSACTION2_RSP *rsp = (TRANSACTION2_RSP *)RESPONSE_BUF(work);
 	TRANSACTION2_FNEXT_REQ_PARAMS *req_params;
 	T2_FNEXT_RSP_PARMS *params = NULL;
-	struct cifsd_dirent *de;
 	struct cifsd_file *dir_fp;
 	struct kstat kstat;
 	struct cifsd_kstat cifsd_kstat;
@@ -5985,9 +6061,6 @@ static int find_next(struct cifsd_work *work)
 	char *dirpath = NULL;
 	char *name = NULL;
 	char *pathname = NULL;
-	struct cifsd_readdir_data r_data = {
-		.ctx.actor = cifsd_fill_dirent,
-	};
 	int header_size;
 
 	req_params = (TRANSACTION2_FNEXT_REQ_PARAMS *)(REQUEST_BUF(work) +
@@ -6011,7 +6084,6 @@ static int find_next(struct cifsd_work *work)
 		goto err_out;
 	}
 
-	r_data.dirent = dir_fp->readdir_data.dirent;
 	pathname = kmalloc(PATH_MAX, GFP_KERNEL);
 	if (!pathname) {
 		cifsd_debug("Failed to allocate memory\n");
@@ -6041,76 +6113,56 @@ static int find_next(struct cifsd_work *work)
 	d_info.out_buf_len = min((int)(le16_to_cpu(req_params->SearchCount) *
 					sizeof(FILE_UNIX_INFO)) + header_size,
 				MAX_CIFS_LOOKUP_BUFFER_SIZE - header_size);
+	d_info.name = NULL;
 	do {
-		if (dir_fp->dirent_offset >= dir_fp->readdir_data.used) {
-			dir_fp->dirent_offset = 0;
-			r_data.used = 0;
-			r_data.full = 0;
-			rc = cifsd_vfs_readdir(dir_fp->filp,
-					       &r_data);
-			if (rc < 0) {
-				cifsd_debug("err : %d\n", rc);
-				goto err_out;
-			}
-
-			dir_fp->readdir_data.used = r_data.used;
-			dir_fp->readdir_data.full = r_data.full;
-			if (!dir_fp->readdir_data.used) {
-				free_page((unsigned long)
-						(dir_fp->readdir_data.dirent));
-				dir_fp->readdir_data.dirent = NULL;
-				break;
-			}
+		kfree(d_info.name);
+		cifsd_kstat.kstat = &kstat;
 
-			de = (struct cifsd_dirent *)
-				((char *)dir_fp->readdir_data.dirent);
-		} else {
-			de = (struct cifsd_dirent *)
-				((char *)dir_fp->readdir_data.dirent +
-				 dir_fp->dirent_offset);
+		rc = cifsd_dir_read_entry(work, dir_fp, dirpath, &cifsd_kstat,
+					  &d_info.name, &reclen);
+		if (rc == -ENODATA) {
+			rc = 0;
+			break;
 		}
-
-		reclen = ALIGN(sizeof(struct cifsd_dirent) + de->namelen,
-				sizeof(__le64));
-		dir_fp->dirent_offset += reclen;
-
-		if (dir_fp->readdir_data.file_attr &
-			SMB_SEARCH_ATTRIBUTE_DIRECTORY && de->d_type != DT_DIR)
+		if (rc)
+			goto err_out;
+		if (!d_info.name)
 			continue;
 
 		if (dir_fp->readdir_data.file_attr &
-			SMB_SEARCH_ATTRIBUTE_ARCHIVE && (de->d_type == DT_DIR ||
-			(!strcmp(de->name, ".") || !strcmp(de->name, ".."))))
+			SMB_SEARCH_ATTRIBUTE_DIRECTORY &&
+			!S_ISDIR(cifsd_kstat.kstat->mode))
 			continue;
 
-		cifsd_kstat.kstat = &kstat;
-		d_info.name = cifsd_vfs_readdir_name(work, &cifsd_kstat, de,
-			dirpath);
-		if (IS_ERR(d_info.name)) {
-			rc = PTR_ERR(d_info.name);
-			cifsd_debug("Err while dirent read rc = %d\n", rc);
-			rc = 0;
+		if (dir_fp->readdir_data.file_attr &
+			SMB_SEARCH_ATTRIBUTE_ARCHIVE &&
+			(S_ISDIR(cifsd_kstat.kstat->mode) ||
+			 !strcmp(d_info.name, ".") ||
+			 !strcmp(d_info.name, "..")))
 			continue;
-		}
 
 		if (cifsd_share_veto_filename(share, d_info.name)) {
 			cifsd_debug("file(%s) is invisible by setting as veto file\n",
 				d_info.name);
-			kfree(d_info.name);
 			continue;
 		}
 
+		if (!cifsd_search_pattern_match(dir_fp->search_pattern,
+						d_info.name))
+			continue;
+
 		cifsd_debug("filename string = %s\n", d_info.name);
 		rc = smb_populate_readdir_entry(conn,
 			req_params->InformationLevel, &d_info, &cifsd_kstat);
-		kfree(d_info.name);
-		if (rc)
+		if (rc) {
+			kfree(d_info.name);
 			goto err_out;
-
+		}
 	} while (d_info.out_buf_len >= 0);
 
+	kfree(d_info.name);
 	if (d_info.out_buf_len < 0)
-		dir_fp->dirent_offset -= reclen;
+		cifsd_dir_unread_entry(dir_fp, reclen);
 
 	params = (T2_FNEXT_RSP_PARMS *)((char *)rsp + sizeof(TRANSACTION2_RSP));
 	params->SearchCount = cpu_to_le16(d_info.num_entry);
@@ -6119,6 +6171,7 @@ static int find_next(struct cifsd_work *work)
 		cifsd_debug("%s continue search\n", __func__);
 		params->EndofSearch = cpu_to_le16(0);
 		params->LastNameOffset = cpu_to_le16(d_info.last_entry_offset);
+		cifsd_dir_release_page(dir_fp);
 	} else {
 		cifsd_debug("%s end of search\n", __func__);
 		params->EndofSearch = cpu_to_le16(1);
@@ -6149,6 +6202,7 @@ static int find_next(struct cifsd_work *work)
 	inc_rfc1001_len(rsp_hdr, (10 * 2 + d_info.data_count +
 		params_count + 1 + data_alignment_offset));
 	kfree(pathname);
+	cifsd_fd_put(dir_fp);
 	return 0;
 
 err_out:
@@ -6166,6 +6220,7 @@ err_out:
 			STATUS_UNEXPECTED_IO_ERROR;
 
 	kfree(pathname);
+	cifsd_fd_put(dir_fp);
 	return 0;
 }
 
@@ -6216,6 +6271,7 @@ static int smb_set_alloc_size(struct cifsd_work *work)
 	}
 
 	err = cifsd_vfs_truncate(work, NULL, fp, newsize);
+	cifsd_fd_put(fp);
 	if (err) {
 		rsp->hdr.Status.CifsError = STATUS_INVALID_PARAMETER;
 		return err;
@@ -6279,6 +6335,7 @@ static int smb_set_file_size_finfo(struct cifsd_work *work)
 
 	newsize = le64_to_cpu(eofinfo->FileSize);
 	err = cifsd_vfs_truncate(work, NULL, fp, newsize);
+	cifsd_fd_put(fp);
 	if (err) {
 		rsp->hdr.Status.CifsError = STATUS_INVALID_PARAMETER;
 		return err;
@@ -6640,6 +6697,7 @@ static int query_file_info(struct cifsd_work *work)
 	}
 
 err_out:
+	cifsd_fd_put(fp);
 	return rc;
 }
 
@@ -6731,11 +6789,13 @@ static int smb_set_dispostion(struct cifsd_work *work)
 	if (*disp_info) {
 		if (!fp->is_nt_open) {
 			rsp->hdr.Status.CifsError = STATUS_ACCESS_DENIED;
+			cifsd_fd_put(fp);
 			return -EPERM;
 		}
 
 		if (!(fp->filp->f_path.dentry->d_inode->i_mode & 0222)) {
 			rsp->hdr.Status.CifsError = STATUS_CANNOT_DELETE;
+			cifsd_fd_put(fp);
 			return -EPERM;
 		}
 
@@ -6743,6 +6803,7 @@ static int smb_set_dispostion(struct cifsd_work *work)
 				!cifsd_vfs_empty_dir(fp)) {
 			rsp->hdr.Status.CifsError =
 				STATUS_DIRECTORY_NOT_EMPTY;
+			cifsd_fd_put(fp);
 			return -ENOTEMPTY;
 		}
 
@@ -6750,6 +6811,7 @@ static int smb_set_dispostion(struct cifsd_work *work)
 	} else {
 		cifsd_clear_inode_pending_delete(fp);
 	}
+	cifsd_fd_put(fp);
 
 	rsp->hdr.Status.CifsError = STATUS_SUCCESS;
 	rsp->hdr.WordCount = 10;
@@ -6881,6 +6943,7 @@ static int smb_fileinfo_rename(struct cifsd_work *work)
 		rc = cifsd_vfs_truncate(work, NULL, fp, 0);
 		if (rc) {
 			rsp->hdr.Status.CifsError = STATUS_INVALID_PARAMETER;
+			cifsd_fd_put(fp);
 			return rc;
 		}
 	}
@@ -6889,6 +6952,7 @@ static int smb_fileinfo_rename(struct cifsd_work *work)
 	if (IS_ERR(newname)) {
 		rsp->hdr.Status.CifsError =
 			STATUS_OBJECT_NAME_INVALID;
+		cifsd_fd_put(fp);
 		return PTR_ERR(newname);
 	}
 
@@ -6921,6 +6985,7 @@ static int smb_fileinfo_rename(struct cifsd_work *work)
 
 out:
 	kfree(newname);
+	cifsd_fd_put(fp);
 	return rc;
 }
 
@@ -254,6 +254,9 @@ typedef struct smb_com_write_req {
 	char Data[0];
 } __attribute__((packed)) WRITE_REQ;
 
+/* Fixed part of a WRITE_ANDX whose data directly follows it */
+#define SMB1_WRITE_HDR_SIZE	offsetof(struct smb_com_write_req, Data)
+
 typedef struct smb_com_write_req_32bit {
 	struct smb_hdr hdr;	/* wct = 5 */
 	__u16 Fid;
@@ -1933,11 +1936,17 @@ typedef struct smb_com_setattr_rsp {
 
 #ifdef CONFIG_CIFS_INSECURE_SERVER
 extern int init_smb1_server(struct cifsd_tcp_conn *conn);
+extern unsigned int smb1_bulk_write_len(char *buf);
 #else
 static inline int init_smb1_server(struct cifsd_tcp_conn *conn)
 {
 	return -ENOTSUPP;
 }
+
+static inline unsigned int smb1_bulk_write_len(char *buf)
+{
+	return 0;
+}
 #endif
 
 /* function prototypes */
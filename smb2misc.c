@@ -4,390 +4,404 @@
  *   Copyright (C) 2018 Samsung Electronics Co., Ltd.
  */
 
+#include <asm-generic/unaligned.h>
+
 #include "glob.h"
 #include "nterr.h"
 #include "smb2pdu.h"
 #include "smb_common.h"
+#include "transport_tcp.h"
 #include "mgmt/user_session.h"
 
-static int check_smb2_hdr(struct smb2_hdr *hdr)
-{
-	/*
-	 * Make sure that this really is an SMB, that it is a response.
-	 */
-	if (hdr->Flags & SMB2_FLAGS_SERVER_TO_REDIR)
-		return 1;
-	return 0;
-}
-
 /*
- *  The following table defines the expected "StructureSize" of SMB2 requests
- *  in order by SMB2 command.  This is similar to "wct" in SMB/CIFS requests.
- *
- *  Note that commands are defined in smb2pdu.h in le16 but the array below is
- *  indexed by command in host byte order
+ * Every request is decoded once, by cifsd_smb2_check_message(), into a
+ * struct smb2_req_view of the request and its variable areas. The areas
+ * of a command are described by the table below and are checked to lie
+ * within the request, after its fixed part, so that the handlers can use
+ * them without walking the header or checking the lengths again.
  */
-static const __le16 smb2_req_struct_sizes[NUMBER_OF_SMB2_COMMANDS] = {
-	/* SMB2_NEGOTIATE */ cpu_to_le16(36),
-	/* SMB2_SESSION_SETUP */ cpu_to_le16(25),
-	/* SMB2_LOGOFF */ cpu_to_le16(4),
-	/* SMB2_TREE_CONNECT */ cpu_to_le16(9),
-	/* SMB2_TREE_DISCONNECT */ cpu_to_le16(4),
-	/* SMB2_CREATE */ cpu_to_le16(57),
-	/* SMB2_CLOSE */ cpu_to_le16(24),
-	/* SMB2_FLUSH */ cpu_to_le16(24),
-	/* SMB2_READ */ cpu_to_le16(49),
-	/* SMB2_WRITE */ cpu_to_le16(49),
-	/* SMB2_LOCK */ cpu_to_le16(48),
-	/* SMB2_IOCTL */ cpu_to_le16(57),
-	/* SMB2_CANCEL */ cpu_to_le16(4),
-	/* SMB2_ECHO */ cpu_to_le16(4),
-	/* SMB2_QUERY_DIRECTORY */ cpu_to_le16(33),
-	/* SMB2_CHANGE_NOTIFY */ cpu_to_le16(32),
-	/* SMB2_QUERY_INFO */ cpu_to_le16(41),
-	/* SMB2_SET_INFO */ cpu_to_le16(33),
-	/* use 44 for lease break */
-	/* SMB2_OPLOCK_BREAK */ cpu_to_le16(36)
+struct smb2_area_desc {
+	/* of the offset field, or the offset itself without off_size */
+	unsigned char	off;
+	unsigned char	off_size;
+	/* of the length field, or of the count field with unit */
+	unsigned char	len;
+	unsigned char	len_size;
+	/* bytes per count, 0 if the area runs up to the end of the request */
+	unsigned char	unit;
 };
 
-/*
- * The size of the variable area depends on the offset and length fields
- * located in different fields for various SMB2 requests. SMB2 requests
- * with no variable length info, show an offset of zero for the offset field.
- */
-static const bool has_smb2_data_area[NUMBER_OF_SMB2_COMMANDS] = {
-	/* SMB2_NEGOTIATE */ true,
-	/* SMB2_SESSION_SETUP */ true,
-	/* SMB2_LOGOFF */ false,
-	/* SMB2_TREE_CONNECT */	true,
-	/* SMB2_TREE_DISCONNECT */ false,
-	/* SMB2_CREATE */ true,
-	/* SMB2_CLOSE */ false,
-	/* SMB2_FLUSH */ false,
-	/* SMB2_READ */	true,
-	/* SMB2_WRITE */ true,
-	/* SMB2_LOCK */	true,
-	/* SMB2_IOCTL */ true,
-	/* SMB2_CANCEL */ false, /* BB CHECK this not listed in documentation */
-	/* SMB2_ECHO */ false,
-	/* SMB2_QUERY_DIRECTORY */ true,
-	/* SMB2_CHANGE_NOTIFY */ false,
-	/* SMB2_QUERY_INFO */ true,
-	/* SMB2_SET_INFO */ true,
-	/* SMB2_OPLOCK_BREAK */ false
+struct smb2_req_decoder {
+	/* StructureSize of the request, a little endian constant */
+	__le16			struct_size;
+	unsigned char		nr_areas;
+	struct smb2_area_desc	area[SMB2_REQ_MAX_AREAS];
 };
 
-static int get_neg_context_size(char *buf, int *off, int *len)
-{
-	int i = 0;
-	struct smb2_negotiate_req *req = (struct smb2_negotiate_req *)buf;
-	char *pneg_ctxt;
-	__le16 *ContextType;
-	int neg_ctxt_cnt = le16_to_cpu(req->NegotiateContextCount);
-
-	*off = le32_to_cpu(req->NegotiateContextOffset);
-	if (*off == 0 || neg_ctxt_cnt == 0)
-		return 0;
-
-	pneg_ctxt = buf + le32_to_cpu(req->NegotiateContextOffset) + 4;
-	ContextType = (__le16 *)pneg_ctxt;
-	while (i++ < neg_ctxt_cnt) {
-		if (*ContextType == SMB2_PREAUTH_INTEGRITY_CAPABILITIES) {
-			pneg_ctxt +=
-				sizeof(struct smb2_preauth_neg_context) + 2;
-			*len += sizeof(struct smb2_preauth_neg_context) + 2;
-			ContextType = (__le16 *)pneg_ctxt;
-		} else if (*ContextType == SMB2_ENCRYPTION_CAPABILITIES) {
-			pneg_ctxt +=
-				sizeof(struct smb2_encryption_neg_context) + 2;
-			*len += sizeof(struct smb2_encryption_neg_context) + 2;
-			ContextType = (__le16 *)pneg_ctxt;
-		}
-	}
-	*len -= 2;
+/* Offsets in the request, from its ProtocolId */
+#define SMB2_FIELD(type, f)	(offsetof(type, f) - 4)
+#define SMB2_FIELD_SIZE(type, f) sizeof(((type *)0)->f)
+
+#define SMB2_AREA(type, off_f, len_f)					\
+	{ SMB2_FIELD(type, off_f), SMB2_FIELD_SIZE(type, off_f),	\
+	  SMB2_FIELD(type, len_f), SMB2_FIELD_SIZE(type, len_f), 1 }
+#define SMB2_COUNTED_AREA(type, first, count_f, size)			\
+	{ SMB2_FIELD(type, first), 0,					\
+	  SMB2_FIELD(type, count_f), SMB2_FIELD_SIZE(type, count_f), size }
+#define SMB2_TRAILING_AREA(type, off_f, count_f)			\
+	{ SMB2_FIELD(type, off_f), SMB2_FIELD_SIZE(type, off_f),	\
+	  SMB2_FIELD(type, count_f), SMB2_FIELD_SIZE(type, count_f), 0 }
+
+#define SMB2_DECODER(cmd, size, n, ...)					\
+	[cmd] = { cpu_to_le16(size), n, { __VA_ARGS__ } }
+
+static const struct smb2_req_decoder smb2_req_decoders[NUMBER_OF_SMB2_COMMANDS] = {
+	SMB2_DECODER(SMB2_NEGOTIATE_HE, 36, 2,
+		SMB2_COUNTED_AREA(struct smb2_negotiate_req, Dialects,
+				  DialectCount, sizeof(__le16)),
+		SMB2_TRAILING_AREA(struct smb2_negotiate_req,
+				   NegotiateContextOffset,
+				   NegotiateContextCount)),
+	SMB2_DECODER(SMB2_SESSION_SETUP_HE, 25, 1,
+		SMB2_AREA(struct smb2_sess_setup_req, SecurityBufferOffset,
+			  SecurityBufferLength)),
+	SMB2_DECODER(SMB2_LOGOFF_HE, 4, 0),
+	SMB2_DECODER(SMB2_TREE_CONNECT_HE, 9, 1,
+		SMB2_AREA(struct smb2_tree_connect_req, PathOffset,
+			  PathLength)),
+	SMB2_DECODER(SMB2_TREE_DISCONNECT_HE, 4, 0),
+	SMB2_DECODER(SMB2_CREATE_HE, 57, 2,
+		SMB2_AREA(struct smb2_create_req, NameOffset, NameLength),
+		SMB2_AREA(struct smb2_create_req, CreateContextsOffset,
+			  CreateContextsLength)),
+	SMB2_DECODER(SMB2_CLOSE_HE, 24, 0),
+	SMB2_DECODER(SMB2_FLUSH_HE, 24, 0),
+	SMB2_DECODER(SMB2_READ_HE, 49, 1,
+		SMB2_AREA(struct smb2_read_req, ReadChannelInfoOffset,
+			  ReadChannelInfoLength)),
+	SMB2_DECODER(SMB2_WRITE_HE, 49, 2,
+		SMB2_AREA(struct smb2_write_req, DataOffset, Length),
+		SMB2_AREA(struct smb2_write_req, WriteChannelInfoOffset,
+			  WriteChannelInfoLength)),
+	/* the first lock element is part of the fixed size */
+	SMB2_DECODER(SMB2_LOCK_HE, 48, 1,
+		SMB2_COUNTED_AREA(struct smb2_lock_req, locks, LockCount,
+				  sizeof(struct smb2_lock_element))),
+	SMB2_DECODER(SMB2_IOCTL_HE, 57, 1,
+		SMB2_AREA(struct smb2_ioctl_req, InputOffset, InputCount)),
+	SMB2_DECODER(SMB2_CANCEL_HE, 4, 0),
+	SMB2_DECODER(SMB2_ECHO_HE, 4, 0),
+	SMB2_DECODER(SMB2_QUERY_DIRECTORY_HE, 33, 1,
+		SMB2_AREA(struct smb2_query_directory_req, FileNameOffset,
+			  FileNameLength)),
+	SMB2_DECODER(SMB2_CHANGE_NOTIFY_HE, 32, 0),
+	SMB2_DECODER(SMB2_QUERY_INFO_HE, 41, 1,
+		SMB2_AREA(struct smb2_query_info_req, InputBufferOffset,
+			  InputBufferLength)),
+	SMB2_DECODER(SMB2_SET_INFO_HE, 33, 1,
+		SMB2_AREA(struct smb2_set_info_req, BufferOffset,
+			  BufferLength)),
+	/* use 44 for lease break */
+	SMB2_DECODER(SMB2_OPLOCK_BREAK_HE, 36, 0),
+};
 
-	if (*len <= 0)
-		return 0;
-	return 1;
+static unsigned int smb2_req_field(const char *pdu, unsigned int off,
+				   unsigned int size)
+{
+	if (size == sizeof(__le16))
+		return get_unaligned_le16(pdu + off);
+	return get_unaligned_le32(pdu + off);
 }
 
-/*
- * Returns the pointer to the beginning of the data area. Length of the data
- * area and the offset to it (from the beginning of the smb are also returned.
- */
-static char *smb2_get_data_area_len(int *off, int *len, struct smb2_hdr *hdr)
+static int smb2_decode_area(const char *pdu, unsigned int len,
+			    unsigned int fixed_len,
+			    const struct smb2_area_desc *desc,
+			    struct smb2_req_area *area)
 {
-	*off = 0;
-	*len = 0;
-
-	/* error reqeusts do not have data area */
-	if (hdr->Status && hdr->Status != STATUS_MORE_PROCESSING_REQUIRED &&
-			(((struct smb2_err_rsp *)hdr)->StructureSize) ==
-			SMB2_ERROR_STRUCTURE_SIZE2)
-		return NULL;
+	unsigned int off, count;
 
-	/*
-	 * Following commands have data areas so we have to get the location
-	 * of the data buffer offset and data buffer length for the particular
-	 * command.
-	 */
-	switch (hdr->Command) {
-	case SMB2_NEGOTIATE:
-		if (!get_neg_context_size((char *)hdr, off, len)) {
-			*off = __SMB2_HEADER_STRUCTURE_SIZE + 36;
-			*len = le16_to_cpu(((struct smb2_negotiate_req *)
-				hdr)->DialectCount) * 2;
-		}
-		break;
-	case SMB2_SESSION_SETUP:
-		*off = le16_to_cpu(
-		     ((struct smb2_sess_setup_req *)hdr)->SecurityBufferOffset);
-		*len = le16_to_cpu(
-		     ((struct smb2_sess_setup_req *)hdr)->SecurityBufferLength);
-		break;
-	case SMB2_TREE_CONNECT:
-		*off = le16_to_cpu(
-		     ((struct smb2_tree_connect_req *)hdr)->PathOffset);
-		*len = le16_to_cpu(
-		     ((struct smb2_tree_connect_req *)hdr)->PathLength);
-		break;
-	case SMB2_CREATE:
-	{
-		if (((struct smb2_create_req *)hdr)->CreateContextsLength) {
-			*off = le32_to_cpu(((struct smb2_create_req *)
-				hdr)->CreateContextsOffset);
-			*len = le32_to_cpu(((struct smb2_create_req *)
-				hdr)->CreateContextsLength);
-			break;
-		}
+	area->off = 0;
+	area->len = 0;
 
-		*off = le16_to_cpu(
-		     ((struct smb2_create_req *)hdr)->NameOffset);
-		*len = le16_to_cpu(
-		     ((struct smb2_create_req *)hdr)->NameLength);
-		break;
+	count = smb2_req_field(pdu, desc->len, desc->len_size);
+	off = desc->off;
+	if (desc->off_size)
+		off = smb2_req_field(pdu, desc->off, desc->off_size);
+	if (!count)
+		return 0;
+	if (!off) {
+		if (desc->unit)
+			cifsd_err("data area of %u without offset\n", count);
+		return desc->unit ? -EINVAL : 0;
 	}
-	case SMB2_QUERY_INFO:
-		*off = le16_to_cpu(
-		     ((struct smb2_query_info_req *)hdr)->InputBufferOffset);
-		*len = le32_to_cpu(
-		     ((struct smb2_query_info_req *)hdr)->InputBufferLength);
-		break;
-	case SMB2_SET_INFO:
-		*off = le16_to_cpu(
-		     ((struct smb2_set_info_req *)hdr)->BufferOffset);
-		*len = le32_to_cpu(
-		     ((struct smb2_set_info_req *)hdr)->BufferLength);
-		break;
-	case SMB2_READ:
-		*off = le16_to_cpu(
-		     ((struct smb2_read_req *)hdr)->ReadChannelInfoOffset);
-		*len = le16_to_cpu(
-		     ((struct smb2_read_req *)hdr)->ReadChannelInfoLength);
-		break;
-	case SMB2_WRITE:
-		if (((struct smb2_write_req *)hdr)->DataOffset) {
-			*off = le16_to_cpu(
-			     ((struct smb2_write_req *)hdr)->DataOffset);
-			*len = le32_to_cpu(
-				((struct smb2_write_req *)hdr)->Length);
-			break;
-		}
 
-		*off = le16_to_cpu(
-		     ((struct smb2_write_req *)hdr)->WriteChannelInfoOffset);
-		*len = le16_to_cpu(
-		     ((struct smb2_write_req *)hdr)->WriteChannelInfoLength);
-		break;
-	case SMB2_QUERY_DIRECTORY:
-		*off = le16_to_cpu(
-		     ((struct smb2_query_directory_req *)hdr)->FileNameOffset);
-		*len = le16_to_cpu(
-		     ((struct smb2_query_directory_req *)hdr)->FileNameLength);
-		break;
-	case SMB2_LOCK:
-	{
-		int lock_count;
-
-		/*
-		 * smb2_lock request size is 48 included single
-		 * smb2_lock_element structure size.
-		 */
-		lock_count = le16_to_cpu(
-			((struct smb2_lock_req *)hdr)->LockCount) - 1;
-		if (lock_count > 0) {
-			*off = __SMB2_HEADER_STRUCTURE_SIZE + 48;
-			*len = sizeof(struct smb2_lock_element) * lock_count;
+	/*
+	 * The negotiate contexts are checked as they are parsed, and their
+	 * offset was ClientStartTime before SMB3.1.1, so don't fail on it.
+	 */
+	if (!desc->unit) {
+		if (off >= fixed_len && off <= len) {
+			area->off = off;
+			area->len = len - off;
 		}
-		break;
-	}
-	case SMB2_IOCTL:
-		*off = le32_to_cpu(
-		     ((struct smb2_ioctl_req *)hdr)->InputOffset);
-		*len = le32_to_cpu(((struct smb2_ioctl_req *)hdr)->InputCount);
-		break;
-	default:
-		cifsd_debug("no length check for command\n");
-		break;
+		return 0;
 	}
 
 	/*
-	 * Invalid length or offset probably means data area is invalid, but
-	 * we have little choice but to ignore the data area in this case.
+	 * Areas located by an offset field follow the fixed part. Note that
+	 * the last byte of the fixed part is part of the data area for the
+	 * commands with an odd StructureSize.
 	 */
-	if (*off > 4096) {
-		cifsd_debug("offset %d too large, data area ignored\n", *off);
-		*len = 0;
-		*off = 0;
-	} else if (*off < 0) {
-		cifsd_debug("negative offset %d to data invalid ignore data area\n",
-			*off);
-		*off = 0;
-		*len = 0;
-	} else if (*len < 0) {
-		cifsd_debug("negative data length %d invalid, data area ignored\n",
-			*len);
-		*len = 0;
-	} else if (*len > 128 * 1024) {
-		cifsd_debug("data area larger than 128K: %d\n", *len);
-		*len = 0;
+	if (desc->off_size && off < fixed_len) {
+		cifsd_err("data area offset %u overlaps fixed area %u\n",
+			  off, fixed_len);
+		return -EINVAL;
+	}
+	if (off > len) {
+		cifsd_err("data area offset %u beyond request len %u\n",
+			  off, len);
+		return -EINVAL;
 	}
 
-	/* return pointer to beginning of data area, ie offset from SMB start */
-	if ((*off != 0) && (*len != 0))
-		return (char *)hdr + *off;
-	else
-		return NULL;
+	if ((u64)count * desc->unit > len - off) {
+		cifsd_err("data area %u+%llu beyond request len %u\n",
+			  off, (u64)count * desc->unit, len);
+		return -EINVAL;
+	}
+	area->off = off;
+	area->len = count * desc->unit;
+	return 0;
 }
 
-/*
- * Calculate the size of the SMB message based on the fixed header
- * portion, the number of word parameters and the data portion of the message.
+/**
+ * smb2_decode_req() - check an SMB2 request and locate its variable areas
+ * @hdr:	request, which may be a command within a compound
+ * @len:	bytes available from the ProtocolId of @hdr on
+ * @view:	decoded request
+ *
+ * This depends on the request alone, so it also serves as a fuzzing and
+ * benchmarking entry point.
+ *
+ * Return:	0 on success, otherwise -EINVAL
  */
-static unsigned int smb2_calc_size(void *buf)
+int smb2_decode_req(struct smb2_hdr *hdr, unsigned int len,
+		    struct smb2_req_view *view)
 {
-	struct smb2_pdu *pdu = (struct smb2_pdu *)buf;
-	struct smb2_hdr *hdr = &pdu->hdr;
-	int offset; /* the offset from the beginning of SMB to data area */
-	int data_length; /* the length of the variable length data area */
-	/* Structure Size has already been checked to make sure it is 64 */
-	int len = le16_to_cpu(hdr->StructureSize);
+	const struct smb2_req_decoder *dec;
+	struct smb2_pdu *pdu = (struct smb2_pdu *)hdr;
+	const char *base = (const char *)&hdr->ProtocolId;
+	unsigned int next, fixed_len, size2, i;
+	int command, ret;
+
+	if (len < sizeof(struct smb2_pdu) - 4) {
+		cifsd_err("request too short, len %u\n", len);
+		return -EINVAL;
+	}
 
 	/*
-	 * StructureSize2, ie length of fixed parameter area has already
-	 * been checked to make sure it is the correct length.
+	 * Make sure that this really is an SMB, that it is a request.
 	 */
-	len += le16_to_cpu(pdu->StructureSize2);
-
-	if (has_smb2_data_area[le16_to_cpu(hdr->Command)] == false)
-		goto calc_size_exit;
-
-	smb2_get_data_area_len(&offset, &data_length, hdr);
-	cifsd_debug("SMB2 data length %d offset %d\n", data_length, offset);
-
-	if (data_length > 0) {
-		/*
-		 * Check to make sure that data area begins after fixed area,
-		 * Note that last byte of the fixed area is part of data area
-		 * for some commands, typically those with odd StructureSize,
-		 * so we must add one to the calculation.
-		 */
-		if (offset + 1 < len)
-			cifsd_debug("data area offset %d overlaps SMB2 header %d\n",
-					offset + 1, len);
-		else
-			len = offset + data_length;
-	}
-calc_size_exit:
-	cifsd_debug("SMB2 len %d\n", len);
-	return len;
-}
-
-int cifsd_smb2_check_message(struct cifsd_work *work)
-{
-	char *buf = REQUEST_BUF(work);
-	struct smb2_pdu *pdu = (struct smb2_pdu *)buf;
-	struct smb2_hdr *hdr = &pdu->hdr;
-	int command;
-	__u32 clc_len;  /* calculated length */
-	__u32 len = get_rfc1002_length(buf);
-
-	if (work->next_smb2_rcv_hdr_off) {
-		pdu = (struct smb2_pdu *)(buf + work->next_smb2_rcv_hdr_off);
-		hdr = &pdu->hdr;
-	}
-
-	if (le32_to_cpu(hdr->NextCommand) > 0)
-		len = le32_to_cpu(hdr->NextCommand);
-	else if (work->next_smb2_rcv_hdr_off) {
-		len -= work->next_smb2_rcv_hdr_off;
-		len = round_up(len, 8);
-	}
-
-	if (check_smb2_hdr(hdr))
-		return 1;
+	if (hdr->Flags & SMB2_FLAGS_SERVER_TO_REDIR)
+		return -EINVAL;
 
 	if (hdr->StructureSize != SMB2_HEADER_STRUCTURE_SIZE) {
 		cifsd_err("Illegal structure size %u\n",
 			le16_to_cpu(hdr->StructureSize));
-		return 1;
+		return -EINVAL;
 	}
 
 	command = le16_to_cpu(hdr->Command);
 	if (command >= NUMBER_OF_SMB2_COMMANDS) {
 		cifsd_err("Illegal SMB2 command %d\n", command);
-		return 1;
+		return -EINVAL;
 	}
 
-	if (smb2_req_struct_sizes[command] != pdu->StructureSize2) {
+	next = le32_to_cpu(hdr->NextCommand);
+	if (next) {
+		if (next < sizeof(struct smb2_pdu) - 4 || next > len) {
+			cifsd_err("Illegal next command offset %u, len %u\n",
+				  next, len);
+			return -EINVAL;
+		}
+		len = next;
+	}
+
+	dec = &smb2_req_decoders[command];
+	size2 = le16_to_cpu(pdu->StructureSize2);
+	if (dec->struct_size != pdu->StructureSize2) {
 		if (command != SMB2_OPLOCK_BREAK_HE && (hdr->Status == 0 ||
 			pdu->StructureSize2 != SMB2_ERROR_STRUCTURE_SIZE2)) {
 			/* error packets have 9 byte structure size */
 			cifsd_err("Illegal request size %u for command %d\n",
-				le16_to_cpu(pdu->StructureSize2), command);
-			return 1;
+				size2, command);
+			return -EINVAL;
 		} else if (command == SMB2_OPLOCK_BREAK_HE
 				&& (hdr->Status == 0)
-				&& (le16_to_cpu(pdu->StructureSize2) != 44)
-				&& (le16_to_cpu(pdu->StructureSize2) != 36)) {
+				&& (size2 != 44)
+				&& (size2 != 36)) {
 			/* special case for SMB2.1 lease break message */
 			cifsd_err("Illegal request size %d for oplock break\n",
-				le16_to_cpu(pdu->StructureSize2));
-			return 1;
+				size2);
+			return -EINVAL;
 		}
 	}
 
-	clc_len = smb2_calc_size(hdr);
-	if (len != clc_len) {
-		__u64 mid = le64_to_cpu(hdr->MessageId);
-		/* server can return one byte more due to implied bcc[0] */
-		if (clc_len == len + 1)
-			return 0;
-
-		/*
-		 * Some windows servers (win2016) will pad also the final
-		 * PDU in a compound to 8 bytes.
-		 */
-		if (((clc_len + 7) & ~7) == len)
-			return 0;
-
-		/*
-		 * windows client also pad up to 8 bytes when compounding.
-		 * If pad is longer than eight bytes, log the server behavior
-		 * (once), since may indicate a problem but allow it and
-		 * continue since the frame is parseable.
-		 */
-		if (clc_len < len) {
-			cifsd_debug(
-				"cli req padded more than expected. Length %d not %d for cmd:%d mid:%llu\n",
-					len, clc_len, command, mid);
-			return 0;
-		}
-		cifsd_err(
-			"cli req too short, len %d not %d. cmd:%d mid:%llu\n",
-				len, clc_len, command, mid);
+	fixed_len = __SMB2_HEADER_STRUCTURE_SIZE + (size2 & ~1);
+	if (fixed_len > len) {
+		cifsd_err("cli req too short, len %u not %u. cmd:%d mid:%llu\n",
+			  len, fixed_len, command,
+			  le64_to_cpu(hdr->MessageId));
+		return -EINVAL;
+	}
+
+	view->hdr = hdr;
+	view->len = len;
+	memset(view->area, 0, sizeof(view->area));
+
+	/* error requests do not have data area */
+	if (dec->struct_size != pdu->StructureSize2)
+		return 0;
+
+	for (i = 0; i < dec->nr_areas; i++) {
+		ret = smb2_decode_area(base, len, fixed_len, &dec->area[i],
+				       &view->area[i]);
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
+int cifsd_smb2_check_message(struct cifsd_work *work)
+{
+	char *buf = REQUEST_BUF(work);
+	unsigned int off = work->next_smb2_rcv_hdr_off;
+	unsigned int len = get_rfc1002_length(buf);
+
+	if (off >= len)
+		return 1;
 
+	if (smb2_decode_req((struct smb2_hdr *)(buf + off), len - off,
+			    &work->req_view))
 		return 1;
+	return 0;
+}
+
+/**
+ * smb2_req_area() - variable area of the current request
+ * @work:	smb work containing smb request buffer
+ * @area:	area of the command, e.g. SMB2_CREATE_NAME
+ * @len:	length of the area
+ *
+ * Return:	start of the area, NULL if the request doesn't carry it
+ */
+void *smb2_req_area(struct cifsd_work *work, int area, unsigned int *len)
+{
+	struct smb2_req_view *view = &work->req_view;
+
+	*len = view->area[area].len;
+	if (!*len)
+		return NULL;
+	return (char *)&((struct smb2_hdr *)view->hdr)->ProtocolId +
+		view->area[area].off;
+}
+
+/*
+ * Larger of the payload a request carries and the payload its response
+ * may carry, which is what its CreditCharge pays for.
+ */
+static unsigned int smb2_credit_payload(struct smb2_hdr *hdr)
+{
+	unsigned int req_len = 0, rsp_len = 0;
+
+	switch (hdr->Command) {
+	case SMB2_READ:
+	{
+		struct smb2_read_req *req = (struct smb2_read_req *)hdr;
+
+		req_len = le16_to_cpu(req->ReadChannelInfoLength);
+		rsp_len = le32_to_cpu(req->Length);
+		break;
+	}
+	case SMB2_WRITE:
+	{
+		struct smb2_write_req *req = (struct smb2_write_req *)hdr;
+
+		req_len = le32_to_cpu(req->Length) +
+			le16_to_cpu(req->WriteChannelInfoLength);
+		break;
+	}
+	case SMB2_IOCTL:
+	{
+		struct smb2_ioctl_req *req = (struct smb2_ioctl_req *)hdr;
+
+		req_len = le32_to_cpu(req->InputCount) +
+			le32_to_cpu(req->OutputCount);
+		rsp_len = le32_to_cpu(req->MaxInputResponse) +
+			le32_to_cpu(req->MaxOutputResponse);
+		break;
+	}
+	case SMB2_QUERY_DIRECTORY:
+	{
+		struct smb2_query_directory_req *req =
+			(struct smb2_query_directory_req *)hdr;
+
+		req_len = le16_to_cpu(req->FileNameLength);
+		rsp_len = le32_to_cpu(req->OutputBufferLength);
+		break;
+	}
+	case SMB2_QUERY_INFO:
+	{
+		struct smb2_query_info_req *req =
+			(struct smb2_query_info_req *)hdr;
+
+		req_len = le32_to_cpu(req->InputBufferLength);
+		rsp_len = le32_to_cpu(req->OutputBufferLength);
+		break;
+	}
+	case SMB2_SET_INFO:
+	{
+		struct smb2_set_info_req *req = (struct smb2_set_info_req *)hdr;
+
+		req_len = le32_to_cpu(req->BufferLength);
+		break;
+	}
+	case SMB2_CHANGE_NOTIFY:
+	{
+		struct smb2_notify_req *req = (struct smb2_notify_req *)hdr;
+
+		rsp_len = le32_to_cpu(req->OutputBufferLength);
+		break;
+	}
+	}
+
+	return max(req_len, rsp_len);
+}
+
+/**
+ * smb2_check_credit_charge() - check the CreditCharge of a request
+ * @work:	smb work containing smb request buffer
+ *
+ * With LargeMTU a request is charged one credit per 64KB of payload, see
+ * MS-SMB2 3.3.5.2.5. Requests of SMB2.0 carry at most 64KB and are always
+ * charged one credit.
+ *
+ * Return:	0 on success, otherwise -EINVAL
+ */
+int smb2_check_credit_charge(struct cifsd_work *work)
+{
+	struct smb2_hdr *hdr = work->req_view.hdr;
+	unsigned int charge, needed;
+
+	if (!(work->conn->srv_cap & SMB2_GLOBAL_CAP_LARGE_MTU))
+		return 0;
+
+	charge = max_t(unsigned int, le16_to_cpu(hdr->CreditCharge), 1);
+	needed = DIV_ROUND_UP(smb2_credit_payload(hdr),
+			      SMB2_CREDIT_PAYLOAD_SIZE);
+	if (charge < needed) {
+		cifsd_err("Insufficient credit charge %u, needed %u\n",
+			  charge, needed);
+		return -EINVAL;
 	}
 	return 0;
 }
@@ -71,6 +71,7 @@ struct smb_version_values smb30_server_values = {
 	.cap_nt_find = SMB2_NT_FIND,
 	.cap_large_files = SMB2_LARGE_FILES,
 	.create_lease_size = sizeof(struct create_lease),
+	.create_lease_v2_size = sizeof(struct create_lease_v2),
 	.create_durable_size = sizeof(struct create_durable_rsp),
 	.create_durable_v2_size = sizeof(struct create_durable_v2_rsp),
 	.create_mxac_size = sizeof(struct create_mxac_rsp),
@@ -94,6 +95,7 @@ struct smb_version_values smb302_server_values = {
 	.cap_nt_find = SMB2_NT_FIND,
 	.cap_large_files = SMB2_LARGE_FILES,
 	.create_lease_size = sizeof(struct create_lease),
+	.create_lease_v2_size = sizeof(struct create_lease_v2),
 	.create_durable_size = sizeof(struct create_durable_rsp),
 	.create_durable_v2_size = sizeof(struct create_durable_v2_rsp),
 	.create_mxac_size = sizeof(struct create_mxac_rsp),
@@ -117,6 +119,7 @@ struct smb_version_values smb311_server_values = {
 	.cap_nt_find = SMB2_NT_FIND,
 	.cap_large_files = SMB2_LARGE_FILES,
 	.create_lease_size = sizeof(struct create_lease),
+	.create_lease_v2_size = sizeof(struct create_lease_v2),
 	.create_durable_size = sizeof(struct create_durable_rsp),
 	.create_durable_v2_size = sizeof(struct create_durable_v2_rsp),
 	.create_mxac_size = sizeof(struct create_mxac_rsp),
@@ -129,8 +132,10 @@ struct smb_version_ops smb2_0_server_ops = {
 	.set_rsp_status		=	set_smb2_rsp_status,
 	.allocate_rsp_buf       =       smb2_allocate_rsp_buf,
 	.set_rsp_credits        =       smb2_set_rsp_credits,
+	.check_credit_charge	=	smb2_check_credit_charge,
 	.check_user_session	=	smb2_check_user_session,
 	.get_cifsd_tcon		=	smb2_get_cifsd_tcon,
+	.qos_cost		=	smb2_qos_cost,
 	.is_sign_req		=	smb2_is_sign_req,
 	.check_sign_req		=	smb2_check_sign_req,
 	.set_sign_rsp		=	smb2_set_sign_rsp
@@ -142,8 +147,10 @@ struct smb_version_ops smb3_0_server_ops = {
 	.set_rsp_status		=	set_smb2_rsp_status,
 	.allocate_rsp_buf       =       smb2_allocate_rsp_buf,
 	.set_rsp_credits        =       smb2_set_rsp_credits,
+	.check_credit_charge	=	smb2_check_credit_charge,
 	.check_user_session	=	smb2_check_user_session,
 	.get_cifsd_tcon		=	smb2_get_cifsd_tcon,
+	.qos_cost		=	smb2_qos_cost,
 	.is_sign_req		=	smb2_is_sign_req,
 	.check_sign_req		=	smb3_check_sign_req,
 	.set_sign_rsp		=	smb3_set_sign_rsp,
@@ -151,7 +158,11 @@ struct smb_version_ops smb3_0_server_ops = {
 	.generate_encryptionkey	=	cifsd_gen_smb30_encryptionkey,
 	.is_transform_hdr	=	smb3_is_transform_hdr,
 	.decrypt_req		=	smb3_decrypt_req,
-	.encrypt_resp		=	smb3_encrypt_resp
+	.encrypt_resp		=	smb3_encrypt_resp,
+	.encrypt_resp_done	=	smb3_encrypt_resp_done,
+	.is_compress_hdr	=	smb3_is_compress_hdr,
+	.decompress_req		=	smb3_decompress_req,
+	.compress_resp		=	smb3_compress_resp
 };
 
 struct smb_version_ops smb3_11_server_ops = {
@@ -160,8 +171,10 @@ struct smb_version_ops smb3_11_server_ops = {
 	.set_rsp_status		=	set_smb2_rsp_status,
 	.allocate_rsp_buf       =       smb2_allocate_rsp_buf,
 	.set_rsp_credits        =       smb2_set_rsp_credits,
+	.check_credit_charge	=	smb2_check_credit_charge,
 	.check_user_session	=	smb2_check_user_session,
 	.get_cifsd_tcon		=	smb2_get_cifsd_tcon,
+	.qos_cost		=	smb2_qos_cost,
 	.is_sign_req		=	smb2_is_sign_req,
 	.check_sign_req		=	smb3_check_sign_req,
 	.set_sign_rsp		=	smb3_set_sign_rsp,
@@ -169,7 +182,11 @@ struct smb_version_ops smb3_11_server_ops = {
 	.generate_encryptionkey	=	cifsd_gen_smb311_encryptionkey,
 	.is_transform_hdr	=	smb3_is_transform_hdr,
 	.decrypt_req		=	smb3_decrypt_req,
-	.encrypt_resp		=	smb3_encrypt_resp
+	.encrypt_resp		=	smb3_encrypt_resp,
+	.encrypt_resp_done	=	smb3_encrypt_resp_done,
+	.is_compress_hdr	=	smb3_is_compress_hdr,
+	.decompress_req		=	smb3_decompress_req,
+	.compress_resp		=	smb3_compress_resp
 };
 
 struct smb_version_cmds smb2_0_server_cmds[NUMBER_OF_SMB2_COMMANDS] = {
@@ -207,6 +224,7 @@ int init_smb2_0_server(struct cifsd_tcp_conn *conn)
 	conn->cmds = smb2_0_server_cmds;
 	conn->max_cmds = ARRAY_SIZE(smb2_0_server_cmds);
 	conn->max_credits = SMB2_MAX_CREDITS;
+	conn->credit_window = SMB2_INIT_CREDIT_WINDOW;
 	conn->credits_granted = 0;
 	conn->srv_cap = 0;
 	return 0;
@@ -230,6 +248,7 @@ void init_smb2_1_server(struct cifsd_tcp_conn *conn)
 	conn->cmds = smb2_0_server_cmds;
 	conn->max_cmds = ARRAY_SIZE(smb2_0_server_cmds);
 	conn->max_credits = SMB2_MAX_CREDITS;
+	conn->credit_window = SMB2_INIT_CREDIT_WINDOW;
 	conn->srv_cap = SMB2_GLOBAL_CAP_LARGE_MTU;
 
 	if (lease_enable)
@@ -248,11 +267,15 @@ void init_smb3_0_server(struct cifsd_tcp_conn *conn)
 	conn->cmds = smb2_0_server_cmds;
 	conn->max_cmds = ARRAY_SIZE(smb2_0_server_cmds);
 	conn->max_credits = SMB2_MAX_CREDITS;
+	conn->credit_window = SMB2_INIT_CREDIT_WINDOW;
 	conn->srv_cap = SMB2_GLOBAL_CAP_LARGE_MTU;
 
 	if (lease_enable)
 		conn->srv_cap |= SMB2_GLOBAL_CAP_LEASING;
 
+	if (lease_enable && dir_lease_enable)
+		conn->srv_cap |= SMB2_GLOBAL_CAP_DIRECTORY_LEASING;
+
 	if (multi_channel_enable)
 		conn->srv_cap |= SMB2_GLOBAL_CAP_MULTI_CHANNEL;
 
@@ -272,11 +295,15 @@ void init_smb3_02_server(struct cifsd_tcp_conn *conn)
 	conn->cmds = smb2_0_server_cmds;
 	conn->max_cmds = ARRAY_SIZE(smb2_0_server_cmds);
 	conn->max_credits = SMB2_MAX_CREDITS;
+	conn->credit_window = SMB2_INIT_CREDIT_WINDOW;
 	conn->srv_cap = SMB2_GLOBAL_CAP_LARGE_MTU;
 
 	if (lease_enable)
 		conn->srv_cap |= SMB2_GLOBAL_CAP_LEASING;
 
+	if (lease_enable && dir_lease_enable)
+		conn->srv_cap |= SMB2_GLOBAL_CAP_DIRECTORY_LEASING;
+
 	if (multi_channel_enable)
 		conn->srv_cap |= SMB2_GLOBAL_CAP_MULTI_CHANNEL;
 
@@ -296,17 +323,20 @@ int init_smb3_11_server(struct cifsd_tcp_conn *conn)
 	conn->cmds = smb2_0_server_cmds;
 	conn->max_cmds = ARRAY_SIZE(smb2_0_server_cmds);
 	conn->max_credits = SMB2_MAX_CREDITS;
+	conn->credit_window = SMB2_INIT_CREDIT_WINDOW;
 	conn->srv_cap = SMB2_GLOBAL_CAP_LARGE_MTU;
 
 	if (lease_enable)
 		conn->srv_cap |= SMB2_GLOBAL_CAP_LEASING;
 
+	if (lease_enable && dir_lease_enable)
+		conn->srv_cap |= SMB2_GLOBAL_CAP_DIRECTORY_LEASING;
+
 	if (multi_channel_enable)
 		conn->srv_cap |= SMB2_GLOBAL_CAP_MULTI_CHANNEL;
 
 	if (conn->preauth_info->CipherId)
 		conn->srv_cap |= SMB2_GLOBAL_CAP_ENCRYPTION;
 
-	INIT_LIST_HEAD(&conn->preauth_sess_table);
 	return 0;
 }
@@ -5,8 +5,10 @@
  */
 
 #include <linux/inetdevice.h>
+#include <linux/ethtool.h>
 #include <net/addrconf.h>
 #include <linux/syscalls.h>
+#include <asm-generic/unaligned.h>
 
 #include "glob.h"
 #include "smb2pdu.h"
@@ -19,6 +21,7 @@
 #include "encrypt.h"
 #include "buffer_pool.h"
 #include "transport_tcp.h"
+#include "transport_rdma.h"
 #include "transport_ipc.h"
 #include "vfs.h"
 #include "vfs_cache.h"
@@ -27,16 +30,52 @@
 #include "time_wrappers.h"
 #include "server.h"
 #include "smb_common.h"
+#include "qos.h"
+#include "compress.h"
+#include "notify.h"
 #include "mgmt/user_config.h"
 #include "mgmt/share_config.h"
 #include "mgmt/tree_connect.h"
 #include "mgmt/user_session.h"
 #include "mgmt/cifsd_ida.h"
+#include "trace.h"
 
 bool multi_channel_enable;
+module_param(multi_channel_enable, bool, 0644);
+MODULE_PARM_DESC(multi_channel_enable,
+	"Enable or disable binding SMB3 channels to sessions. Default: n/N/0");
+
 bool encryption_enable;
 bool stream_file_enable;
 
+/*
+ * Offer SMB 3.1.1 compression. Responses are only compressed on shares
+ * with compression enabled in their share config.
+ */
+static bool compression_enable;
+module_param(compression_enable, bool, 0644);
+MODULE_PARM_DESC(compression_enable,
+	"Negotiate SMB 3.1.1 compression. Default: n/N/0");
+
+/*
+ * COPYCHUNK requests copying more than this are answered STATUS_PENDING
+ * and copied by a job outside of the request workers.
+ */
+static unsigned int copychunk_async_kb = 8192;
+module_param(copychunk_async_kb, uint, 0644);
+MODULE_PARM_DESC(copychunk_async_kb,
+	"Server-side copies of more KiB than this run asynchronously, 0 to never. Default: 8192");
+
+/*
+ * READ and WRITE requests still in the VFS after this many milliseconds
+ * are answered STATUS_PENDING, so that a slow backend doesn't hold the
+ * request worker, or with serialized requests the connection.
+ */
+static unsigned int async_io_msecs;
+module_param(async_io_msecs, uint, 0644);
+MODULE_PARM_DESC(async_io_msecs,
+	"Reads and writes taking longer than this many ms complete asynchronously, 0 to never. Default: 0");
+
 /**
  * check_session_id() - check for valid session id in smb header
  * @conn:	TCP server instance of connection
@@ -52,22 +91,46 @@ static inline int check_session_id(struct cifsd_tcp_conn *conn, uint64_t id)
 		return 0;
 
 	sess = cifsd_session_lookup(conn, id);
-	if (sess)
+	if (sess) {
+		cifsd_session_put(sess);
 		return 1;
+	}
 	cifsd_err("Invalid user session id: %llu\n", id);
 	return 0;
 }
 
-struct channel *lookup_chann_list(struct cifsd_session *sess)
+/* Is @hdr a session setup request binding a new channel to its session */
+static inline bool smb2_sess_setup_binding(struct smb2_hdr *hdr)
+{
+	struct smb2_sess_setup_req *req = (struct smb2_sess_setup_req *)hdr;
+
+	return multi_channel_enable &&
+		req->Flags & SMB2_SESSION_REQ_FLAG_BINDING;
+}
+
+/**
+ * lookup_chann_list() - find the channel of a connection in a session
+ * @sess:	session the connection may be bound to
+ * @conn:	connection of the channel
+ *
+ * The channel stays valid until @conn is released, so the result may be
+ * used while processing a request of @conn.
+ *
+ * Return:	channel of @conn, otherwise NULL
+ */
+struct channel *lookup_chann_list(struct cifsd_session *sess,
+				  struct cifsd_tcp_conn *conn)
 {
 	struct channel *chann;
-	struct list_head *t;
 
-	list_for_each(t, &sess->cifsd_chann_list) {
-		chann = list_entry(t, struct channel, chann_list);
-		if (chann && chann->conn == sess->conn)
+	read_lock(&sess->chann_lock);
+	list_for_each_entry(chann, &sess->cifsd_chann_list, chann_list) {
+		if (chann->conn == conn) {
+			read_unlock(&sess->chann_lock);
 			return chann;
+		}
 	}
+	read_unlock(&sess->chann_lock);
 
 	return NULL;
 }
@@ -281,6 +344,28 @@ int init_smb2_neg_rsp(struct cifsd_work *work)
 	return 0;
 }
 
+/**
+ * smb2_charge_credits() - charge the credits of a request to its connection
+ * @work:	smb work containing smb request buffer
+ * @hdr:	header of the request, the first or a later one of a compound
+ *
+ * A CreditCharge of 0, and any charge without LargeMTU, is one credit.
+ * The credits are given back by smb2_set_rsp_credits() with the response.
+ */
+static void smb2_charge_credits(struct cifsd_work *work, struct smb2_hdr *hdr)
+{
+	struct cifsd_tcp_conn *conn = work->conn;
+	unsigned int charge = 1;
+
+	if (conn->srv_cap & SMB2_GLOBAL_CAP_LARGE_MTU)
+		charge = max_t(unsigned int, le16_to_cpu(hdr->CreditCharge), 1);
+
+	spin_lock(&conn->credits_lock);
+	conn->credits_granted -= min_t(int, charge, conn->credits_granted);
+	spin_unlock(&conn->credits_lock);
+	work->credit_charge += charge;
+}
+
 /**
  * init_chained_smb2_rsp() - initialize smb2 chained response
  * @work:	smb work containing smb response buffer
@@ -343,6 +428,7 @@ static void init_chained_smb2_rsp(struct cifsd_work *work)
 		cifsd_debug("related flag should be set\n");
 		work->compound_fid = CIFSD_NO_FID;
 		work->compound_pfid = CIFSD_NO_FID;
+		cifsd_compound_fp_put(work);
 	}
 	memset((char *)rsp_hdr + 4, 0, sizeof(struct smb2_hdr) + 2);
 	rsp_hdr->ProtocolId = rcv_hdr->ProtocolId;
@@ -361,6 +447,37 @@ static void init_chained_smb2_rsp(struct cifsd_work *work)
 	rsp_hdr->Id.SyncId.TreeId = rcv_hdr->Id.SyncId.TreeId;
 	rsp_hdr->SessionId = rcv_hdr->SessionId;
 	memcpy(rsp_hdr->Signature, rcv_hdr->Signature, 16);
+
+	smb2_charge_credits(work, rcv_hdr);
+}
+
+/**
+ * smb2_next_compound_cmd() - step to the next command of a compound request
+ * @buf:	request buffer, starting with the RFC1002 length
+ * @off:	offset in @buf of a command whose header is within @buf,
+ *		moved to the next command
+ *
+ * The walkers of a request that run before cifsd_verify_smb_message()
+ * use this, so a NextCommand that is not 8 byte aligned, is shorter than
+ * a header or leaves no header before the end of @buf is rejected.
+ *
+ * Return:	1 if @off is the next command, 0 after the last command,
+ *		otherwise -EINVAL
+ */
+int smb2_next_compound_cmd(char *buf, unsigned int *off)
+{
+	struct smb2_hdr *hdr = (struct smb2_hdr *)(buf + *off);
+	unsigned int len = get_rfc1002_length(buf) + 4;
+	unsigned int next = le32_to_cpu(hdr->NextCommand);
+
+	if (!next)
+		return 0;
+	if (next < sizeof(struct smb2_hdr) || next & 7 ||
+	    next > len - *off || len - *off - next < sizeof(struct smb2_hdr))
+		return -EINVAL;
+
+	*off += next;
+	return 1;
 }
 
 /**
@@ -400,6 +517,40 @@ bool is_chained_smb2_message(struct cifsd_work *work)
 	return false;
 }
 
+/**
+ * smb2_qos_cost() - get the QoS cost of a request
+ * @work:	smb work containing smb request buffer
+ * @nr_ios:	number of commands in the compound
+ *
+ * Return:      number of bytes the READ and WRITE commands transfer
+ */
+unsigned int smb2_qos_cost(struct cifsd_work *work, unsigned int *nr_ios)
+{
+	char *buf = REQUEST_BUF(work);
+	unsigned int len = get_rfc1002_length(buf) + 4;
+	unsigned int off = 0, bytes = 0;
+	struct smb2_hdr *hdr;
+
+	*nr_ios = 0;
+	if (len < sizeof(struct smb2_hdr))
+		return 0;
+
+	do {
+		hdr = (struct smb2_hdr *)(buf + off);
+		(*nr_ios)++;
+		if (hdr->Command == SMB2_READ &&
+		    off + sizeof(struct smb2_read_req) <= len)
+			bytes += le32_to_cpu(
+				((struct smb2_read_req *)hdr)->Length);
+		else if (hdr->Command == SMB2_WRITE &&
+			 off + sizeof(struct smb2_write_req) <= len)
+			bytes += le32_to_cpu(
+				((struct smb2_write_req *)hdr)->Length);
+	} while (smb2_next_compound_cmd(buf, &off) > 0);
+
+	return bytes;
+}
+
 /**
  * init_smb2_rsp_hdr() - initialize smb2 response
  * @work:	smb work containing smb request buffer
@@ -436,13 +587,7 @@ int init_smb2_rsp_hdr(struct cifsd_work *work)
 	rsp_hdr->SessionId = rcv_hdr->SessionId;
 	memcpy(rsp_hdr->Signature, rcv_hdr->Signature, 16);
 
-	if (conn->credits_granted) {
-		if (le16_to_cpu(rcv_hdr->CreditCharge))
-			conn->credits_granted -=
-				le16_to_cpu(rcv_hdr->CreditCharge);
-		else
-			conn->credits_granted -= 1;
-	}
+	smb2_charge_credits(work, rcv_hdr);
 
 	work->type = SYNC;
 	if (work->async_id) {
@@ -453,36 +598,121 @@ int init_smb2_rsp_hdr(struct cifsd_work *work)
 	return 0;
 }
 
+/**
+ * smb2_max_read_write_size() - largest READ and WRITE payload of a dialect
+ * @conn:	TCP server instance of connection
+ *
+ * Return:	max_io_size with LargeMTU above SMB2.0, else the message size
+ */
+static unsigned int smb2_max_read_write_size(struct cifsd_tcp_conn *conn)
+{
+	if (conn->dialect > SMB20_PROT_ID)
+		return cifsd_max_io_size();
+	return cifsd_max_msg_size();
+}
+
+/**
+ * smb2_output_rsp_size() - response buffer size for a client output length
+ * @out_len:	OutputBufferLength of the request
+ *
+ * Return:	buffer size, between the small and the large response size
+ */
+static size_t smb2_output_rsp_size(__le32 out_len)
+{
+	size_t sz = (size_t)le32_to_cpu(out_len) + MAX_SMB2_HDR_SIZE;
+
+	sz = max_t(size_t, sz, cifsd_small_buffer_size());
+	return min_t(size_t, sz, cifsd_max_msg_size() + MAX_SMB2_HDR_SIZE);
+}
+
+/*
+ * Response size needed by the command of @hdr, @avail bytes of which were
+ * received. Truncated requests are failed with a small error response.
+ */
+static size_t smb2_cmd_rsp_size(struct smb2_hdr *hdr, unsigned int avail)
+{
+	struct smb2_query_info_req *req = (struct smb2_query_info_req *)hdr;
+	size_t large_sz = cifsd_max_msg_size() + MAX_SMB2_HDR_SIZE;
+	int cmd = le16_to_cpu(hdr->Command);
+
+	if (cmd == SMB2_IOCTL_HE)
+		return large_sz;
+
+	if ((cmd == SMB2_QUERY_DIRECTORY_HE &&
+	     avail < sizeof(struct smb2_query_directory_req)) ||
+	    (cmd == SMB2_CHANGE_NOTIFY_HE &&
+	     avail < sizeof(struct smb2_notify_req)) ||
+	    (cmd == SMB2_QUERY_INFO_HE &&
+	     avail < sizeof(struct smb2_query_info_req)))
+		return cifsd_small_buffer_size();
+
+	/*
+	 * Directory entries and EAs are only encoded while they fit in the
+	 * response buffer, so size it to what the client can take.
+	 */
+	if (cmd == SMB2_QUERY_DIRECTORY_HE)
+		return smb2_output_rsp_size(((struct smb2_query_directory_req *)
+					     hdr)->OutputBufferLength);
+
+	/* and so are the changes returned by CHANGE_NOTIFY */
+	if (cmd == SMB2_CHANGE_NOTIFY_HE)
+		return smb2_output_rsp_size(((struct smb2_notify_req *)
+					     hdr)->OutputBufferLength);
+
+	/*
+	 * and so are streams, but a security descriptor is built whole
+	 * whatever the client can take
+	 */
+	if (cmd == SMB2_QUERY_INFO_HE) {
+		if (req->InfoType == SMB2_O_INFO_FILE &&
+		    req->FileInfoClass == FILE_ALL_INFORMATION)
+			return large_sz;
+		if (req->InfoType == SMB2_O_INFO_SECURITY)
+			return max_t(size_t, MAX_SMB2_HDR_SIZE +
+				     MAX_SEC_DESC_LEN,
+				     smb2_output_rsp_size(
+					req->OutputBufferLength));
+		return smb2_output_rsp_size(req->OutputBufferLength);
+	}
+	return cifsd_small_buffer_size();
+}
+
 /**
  * smb2_allocate_rsp_buf() - allocate smb2 response buffer
  * @work:	smb work containing smb request buffer
  *
+ * The responses of a compound request are built one after another in the
+ * same buffer, which is sized by the sum of what every command needs.
+ *
  * Return:      0 on success, otherwise -ENOMEM
  */
 int smb2_allocate_rsp_buf(struct cifsd_work *work)
 {
 	struct smb2_hdr *hdr = (struct smb2_hdr *)REQUEST_BUF(work);
-	struct smb2_query_info_req *req;
-	size_t small_sz = cifsd_small_buffer_size();
 	size_t large_sz = cifsd_max_msg_size() + MAX_SMB2_HDR_SIZE;
-	size_t sz = small_sz;
-	int cmd = le16_to_cpu(hdr->Command);
-
-	req = (struct smb2_query_info_req *)REQUEST_BUF(work);
+	unsigned int len = get_rfc1002_length(REQUEST_BUF(work)) + 4;
+	unsigned int off = 0;
+	size_t sz = 0;
+	int rc;
 
-	if (cmd == SMB2_IOCTL_HE || cmd == SMB2_QUERY_DIRECTORY_HE)
-		sz = large_sz;
+	/* leave malformed chains to the validation of the commands */
+	if (len < sizeof(struct smb2_hdr)) {
+		sz = cifsd_small_buffer_size();
+		goto alloc;
+	}
 
-	if (cmd == SMB2_QUERY_INFO_HE) {
-		if (req->InfoType == SMB2_O_INFO_FILE &&
-			(req->FileInfoClass == FILE_FULL_EA_INFORMATION ||
-				req->FileInfoClass == FILE_ALL_INFORMATION))
+	do {
+		hdr = (struct smb2_hdr *)(REQUEST_BUF(work) + off);
+		sz += ALIGN(smb2_cmd_rsp_size(hdr, len - off), 8);
+		if (sz >= large_sz)
+			break;
+		rc = smb2_next_compound_cmd(REQUEST_BUF(work), &off);
+		if (rc < 0)
 			sz = large_sz;
-	}
+	} while (rc > 0);
+	sz = min_t(size_t, sz, large_sz);
 
-	/* allocate large response buf for chained commands */
-	if (le32_to_cpu(hdr->NextCommand) > 0)
-		sz = large_sz;
+alloc:
 
 	work->response_buf = cifsd_alloc_response(sz);
 	work->response_sz = sz;
@@ -495,6 +725,45 @@ int smb2_allocate_rsp_buf(struct cifsd_work *work)
 	return 0;
 }
 
+/*
+ * Credit windows. A connection may have up to credit_window credits
+ * outstanding. The window grows while the client spends the credits it is
+ * granted and asks for more, and shrinks while it holds far more credits
+ * than it has requests running, or while the server is short of memory or
+ * workers.
+ */
+#define SMB2_MIN_CREDIT_WINDOW		16
+/* Extra credits granted by a response are at least this many */
+#define SMB2_MIN_CREDITS_PER_RSP	32
+
+static bool smb2_credit_pressure(void)
+{
+	unsigned int max_active = server_conf.max_active ?: WQ_DFL_ACTIVE;
+
+	return cifsd_buffer_pool_pressure() ||
+		cifsd_tcp_requests_running() > max_active;
+}
+
+/* Called under conn->credits_lock with the credits of the request charged */
+static void smb2_update_credit_window(struct cifsd_tcp_conn *conn,
+				      unsigned int credits_requested)
+{
+	int window = conn->credit_window;
+	int outstanding = conn->credits_granted;
+
+	if (smb2_credit_pressure())
+		window -= window >> 4;
+	else if (outstanding + (int)credits_requested > window &&
+		 outstanding < window >> 2)
+		window += window >> 2;
+	else if (outstanding > window >> 1 &&
+		 atomic_read(&conn->req_running) * 4 < outstanding)
+		window -= window >> 5;
+
+	conn->credit_window = clamp(window, SMB2_MIN_CREDIT_WINDOW,
+				    conn->max_credits - 1);
+}
+
 /**
  * smb2_set_rsp_credits() - set number of credits in response buffer
  * @work:	smb work containing smb response buffer
@@ -507,19 +776,25 @@ void smb2_set_rsp_credits(struct cifsd_work *work)
 	unsigned int flags = hdr->Flags;
 	unsigned short credits_requested = le16_to_cpu(hdr->CreditRequest);
 	unsigned short cmd = le16_to_cpu(hdr->Command);
-	unsigned short credit_charge = 1, credits_granted = 0;
-	unsigned short aux_max, aux_credits, min_credits;
+	unsigned int credit_charge, credits_granted = 0;
+	unsigned int aux_max, aux_credits;
+	int window;
 
+	/* give back what the requests were charged, at least one credit */
+	credit_charge = max_t(unsigned int, work->credit_charge, 1);
+
+	spin_lock(&conn->credits_lock);
 	BUG_ON(conn->credits_granted >= conn->max_credits);
 
-	/* get default minimum credits by shifting maximum credits by 4 */
-	min_credits = conn->max_credits >> 4;
+	smb2_update_credit_window(conn, credits_requested);
+	window = conn->credit_window;
 
 	if (flags & SMB2_FLAGS_ASYNC_COMMAND) {
 		credits_granted = 0;
 	} else if (credits_requested > 0) {
 		aux_max = 0;
-		aux_credits = credits_requested - 1;
+		aux_credits = credits_requested > credit_charge ?
+			credits_requested - credit_charge : 0;
 		switch (cmd) {
 		case SMB2_NEGOTIATE:
 			break;
@@ -527,26 +802,33 @@ void smb2_set_rsp_credits(struct cifsd_work *work)
 			aux_max = (status) ? 0 : 32;
 			break;
 		default:
-			aux_max = 32;
+			/*
+			 * Don't grow the credit window of a session which
+			 * is over its rate, so the client sends no faster
+			 * than requests are admitted.
+			 */
+			aux_max = cifsd_qos_throttled(work) ? 0 :
+				max(window >> 3, SMB2_MIN_CREDITS_PER_RSP);
 			break;
 		}
 		aux_credits = (aux_credits < aux_max) ? aux_credits : aux_max;
 		credits_granted = aux_credits + credit_charge;
 
-		/* if credits granted per client is getting bigger than default
-		 * minimum credits then we should wrap it up within the limits.
-		 */
-		if ((conn->credits_granted + credits_granted) > min_credits)
-			credits_granted = min_credits -	conn->credits_granted;
-
+		/* keep the credits of the client within its window */
+		if (conn->credits_granted + credits_granted > window)
+			credits_granted = conn->credits_granted < window ?
+				window - conn->credits_granted : 0;
+		if (!conn->credits_granted && !credits_granted)
+			credits_granted = 1;
 	} else if (conn->credits_granted == 0) {
 		credits_granted = 1;
 	}
 
 	conn->credits_granted += credits_granted;
-	cifsd_debug("credits: requested[%d] granted[%d] total_granted[%d]\n",
+	cifsd_debug("credits: requested[%d] granted[%u] total_granted[%d]\n",
 			credits_requested, credits_granted,
 			conn->credits_granted);
+	spin_unlock(&conn->credits_lock);
 	/* set number of credits granted in SMB2 hdr */
 	hdr->CreditRequest = cpu_to_le16(credits_granted);
 
@@ -589,7 +871,13 @@ int smb2_check_user_session(struct cifsd_work *work)
 
 static void destroy_previous_session(uint64_t id)
 {
-	cifsd_session_destroy(cifsd_session_lookup_slowpath(id));
+	struct cifsd_session *prev_sess = cifsd_session_lookup_slowpath(id);
+
+	if (!prev_sess)
+		return;
+
+	cifsd_session_destroy(prev_sess);
+	cifsd_session_put(prev_sess);
 }
 
 /**
@@ -727,6 +1015,54 @@ build_encrypt_ctxt(struct smb2_encryption_neg_context *pneg_ctxt,
 	pneg_ctxt->Ciphers[0] = cipher_id;
 }
 
+static void
+build_sign_cap_ctxt(struct smb2_signing_capabilities *pneg_ctxt,
+	__le16 sign_algo)
+{
+	pneg_ctxt->ContextType = SMB2_SIGNING_CAPABILITIES;
+	pneg_ctxt->DataLength = cpu_to_le16(4);
+	pneg_ctxt->Reserved = cpu_to_le32(0);
+	pneg_ctxt->SigningAlgorithmCount = cpu_to_le16(1);
+	pneg_ctxt->SigningAlgorithms[0] = sign_algo;
+}
+
+/* Compression algorithms in the order the server prefers them */
+static const __le16 smb2_compress_algos[] = {
+	SMB3_COMPRESS_LZ77,
+	SMB3_COMPRESS_LZ77_HUFF,
+	SMB3_COMPRESS_PATTERN,
+};
+
+#define SMB3_COMPRESS_BIT(algo)	BIT(le16_to_cpu(algo))
+
+static unsigned int
+build_compress_ctxt(struct smb2_compression_ctx *pneg_ctxt,
+	struct cifsd_tcp_conn *conn)
+{
+	unsigned int i, n = 0;
+
+	pneg_ctxt->ContextType = SMB2_COMPRESSION_CAPABILITIES;
+	pneg_ctxt->Reserved = cpu_to_le32(0);
+	pneg_ctxt->Padding = 0;
+	pneg_ctxt->Flags = conn->compress_chained ?
+		SMB2_COMPRESSION_CAPABILITIES_FLAG_CHAINED :
+		SMB2_COMPRESSION_CAPABILITIES_FLAG_NONE;
+
+	for (i = 0; i < ARRAY_SIZE(smb2_compress_algos); i++) {
+		if (conn->compress_algos &
+		    SMB3_COMPRESS_BIT(smb2_compress_algos[i]))
+			pneg_ctxt->CompressionAlgorithms[n++] =
+				smb2_compress_algos[i];
+	}
+	/* no algorithm in common */
+	if (!n)
+		pneg_ctxt->CompressionAlgorithms[n++] = SMB3_COMPRESS_NONE;
+
+	pneg_ctxt->CompressionAlgorithmCount = cpu_to_le16(n);
+	pneg_ctxt->DataLength = cpu_to_le16(8 + n * 2);
+	return sizeof(struct smb2_compression_ctx) + n * 2;
+}
+
 static void
 assemble_neg_contexts(struct cifsd_tcp_conn *conn,
 	struct smb2_negotiate_rsp *rsp)
@@ -734,26 +1070,51 @@ assemble_neg_contexts(struct cifsd_tcp_conn *conn,
 	/* +4 is to account for the RFC1001 len field */
 	char *pneg_ctxt = (char *)rsp +
 			le32_to_cpu(rsp->NegotiateContextOffset) + 4;
+	unsigned int ctxt_size, ctxt_count = 1, pad;
 
 	cifsd_debug("assemble SMB2_PREAUTH_INTEGRITY_CAPABILITIES context\n");
 	build_preauth_ctxt((struct smb2_preauth_neg_context *)pneg_ctxt,
 		conn->preauth_info->Preauth_HashId);
-	rsp->NegotiateContextCount = cpu_to_le16(1);
-	inc_rfc1001_len(rsp,
-		AUTH_GSS_PADDING + sizeof(struct smb2_preauth_neg_context));
+	ctxt_size = sizeof(struct smb2_preauth_neg_context);
+	inc_rfc1001_len(rsp, AUTH_GSS_PADDING + ctxt_size);
 
 	if (conn->preauth_info->CipherId) {
 		cifsd_debug("assemble SMB2_ENCRYPTION_CAPABILITIES context\n");
-		/* Add 2 to size to round to 8 byte boundary */
-		pneg_ctxt += sizeof(struct smb2_preauth_neg_context) + 2;
+		/* contexts are 8 byte aligned */
+		pad = round_up(ctxt_size, 8) - ctxt_size;
+		pneg_ctxt += ctxt_size + pad;
 		build_encrypt_ctxt(
 			(struct smb2_encryption_neg_context *)pneg_ctxt,
 			conn->preauth_info->CipherId);
-		rsp->NegotiateContextCount = cpu_to_le16(2);
+		ctxt_count++;
 		/* Subtract 2 to remove unused Ciphers[1] */
-		inc_rfc1001_len(rsp,
-			2 + sizeof(struct smb2_encryption_neg_context) - 2);
+		ctxt_size = sizeof(struct smb2_encryption_neg_context) - 2;
+		inc_rfc1001_len(rsp, pad + ctxt_size);
+	}
+
+	if (conn->signing_negotiated) {
+		cifsd_debug("assemble SMB2_SIGNING_CAPABILITIES context\n");
+		pad = round_up(ctxt_size, 8) - ctxt_size;
+		pneg_ctxt += ctxt_size + pad;
+		build_sign_cap_ctxt(
+			(struct smb2_signing_capabilities *)pneg_ctxt,
+			conn->signing_algorithm);
+		ctxt_count++;
+		ctxt_size = sizeof(struct smb2_signing_capabilities) + 2;
+		inc_rfc1001_len(rsp, pad + ctxt_size);
 	}
+
+	if (conn->compress_negotiated) {
+		cifsd_debug("assemble SMB2_COMPRESSION_CAPABILITIES context\n");
+		pad = round_up(ctxt_size, 8) - ctxt_size;
+		pneg_ctxt += ctxt_size + pad;
+		ctxt_size = build_compress_ctxt(
+			(struct smb2_compression_ctx *)pneg_ctxt, conn);
+		ctxt_count++;
+		inc_rfc1001_len(rsp, pad + ctxt_size);
+	}
+
+	rsp->NegotiateContextCount = cpu_to_le16(ctxt_count);
 }
 
 static int
@@ -772,28 +1133,128 @@ decode_preauth_ctxt(struct cifsd_tcp_conn *conn,
 	return err;
 }
 
+/* Ciphers in the order the server prefers them */
+static const __le16 smb2_ciphers[] = {
+	SMB2_ENCRYPTION_AES128_GCM,
+	SMB2_ENCRYPTION_AES128_CCM,
+	SMB2_ENCRYPTION_AES256_GCM,
+	SMB2_ENCRYPTION_AES256_CCM,
+};
+
 static void
 decode_encrypt_ctxt(struct cifsd_tcp_conn *conn,
 	struct smb2_encryption_neg_context *pneg_ctxt)
 {
-	int i;
-	int cph_cnt = pneg_ctxt->CipherCount;
+	int i, j;
+	int cph_cnt = le16_to_cpu(pneg_ctxt->CipherCount);
 
 	conn->preauth_info->CipherId = 0;
+	conn->cipher_type = 0;
 
 	if (!encryption_enable)
 		return;
 
-	/* Support only AES CCM cipher now */
-	for (i = 0; i < cph_cnt; i++) {
-		if (pneg_ctxt->Ciphers[i] ==
-			SMB2_ENCRYPTION_AES128_CCM) {
-			cifsd_debug("Cipher ID = SMB2_ENCRYPTION_AES128_CCM\n");
-			conn->preauth_info->CipherId =
-				SMB2_ENCRYPTION_AES128_CCM;
+	/* DataLength covers CipherCount and the cipher list */
+	cph_cnt = min_t(int, cph_cnt,
+			(le16_to_cpu(pneg_ctxt->DataLength) - 2) / 2);
+	for (j = 0; j < ARRAY_SIZE(smb2_ciphers); j++) {
+		/* e.g. a kernel without gcm(aes) */
+		if (!cifsd_cipher_available(smb2_ciphers[j]))
+			continue;
+
+		for (i = 0; i < cph_cnt; i++) {
+			if (pneg_ctxt->Ciphers[i] == smb2_ciphers[j])
+				break;
+		}
+		if (i < cph_cnt)
 			break;
+	}
+
+	if (j == ARRAY_SIZE(smb2_ciphers))
+		return;
+
+	cifsd_debug("Cipher ID = 0x%x\n", le16_to_cpu(smb2_ciphers[j]));
+	conn->preauth_info->CipherId = smb2_ciphers[j];
+	conn->cipher_type = smb2_ciphers[j];
+}
+
+/* Signing algorithms in the order the server prefers them */
+static const __le16 smb2_sign_algos[] = {
+	SIGNING_ALG_AES_GMAC,
+	SIGNING_ALG_AES_CMAC,
+	SIGNING_ALG_HMAC_SHA256,
+};
+
+static void
+decode_sign_cap_ctxt(struct cifsd_tcp_conn *conn,
+	struct smb2_signing_capabilities *pneg_ctxt)
+{
+	int i, j;
+	int algo_cnt = le16_to_cpu(pneg_ctxt->SigningAlgorithmCount);
+
+	/* AES-CMAC if none of the client algorithms is supported */
+	conn->signing_negotiated = true;
+	conn->signing_algorithm = SIGNING_ALG_AES_CMAC;
+
+	/* DataLength covers SigningAlgorithmCount and the algorithm list */
+	algo_cnt = min_t(int, algo_cnt,
+			 (le16_to_cpu(pneg_ctxt->DataLength) - 2) / 2);
+	for (j = 0; j < ARRAY_SIZE(smb2_sign_algos); j++) {
+		if (smb2_sign_algos[j] == SIGNING_ALG_AES_GMAC &&
+		    !cifsd_sign_gmac_available())
+			continue;
+
+		for (i = 0; i < algo_cnt; i++) {
+			if (pneg_ctxt->SigningAlgorithms[i] ==
+			    smb2_sign_algos[j]) {
+				conn->signing_algorithm = smb2_sign_algos[j];
+				cifsd_debug("Signing algorithm = 0x%x\n",
+					    le16_to_cpu(smb2_sign_algos[j]));
+				return;
+			}
+		}
+	}
+}
+
+static void
+decode_compress_ctxt(struct cifsd_tcp_conn *conn,
+	struct smb2_compression_ctx *pneg_ctxt)
+{
+	int i, j;
+	int algo_cnt = le16_to_cpu(pneg_ctxt->CompressionAlgorithmCount);
+
+	conn->compress_algos = 0;
+	conn->compress_chained = false;
+
+	/* Ignored, without a response context, unless enabled */
+	if (!compression_enable)
+		return;
+
+	conn->compress_negotiated = true;
+	conn->compress_chained = !!(pneg_ctxt->Flags &
+			SMB2_COMPRESSION_CAPABILITIES_FLAG_CHAINED);
+
+	/* DataLength covers the count, padding, flags and algorithm list */
+	algo_cnt = min_t(int, algo_cnt,
+			 (le16_to_cpu(pneg_ctxt->DataLength) - 8) / 2);
+	for (j = 0; j < ARRAY_SIZE(smb2_compress_algos); j++) {
+		/* Pattern_V1 is only sent as a chained payload */
+		if (smb2_compress_algos[j] == SMB3_COMPRESS_PATTERN &&
+		    !conn->compress_chained)
+			continue;
+
+		for (i = 0; i < algo_cnt; i++) {
+			if (pneg_ctxt->CompressionAlgorithms[i] ==
+			    smb2_compress_algos[j]) {
+				conn->compress_algos |=
+					SMB3_COMPRESS_BIT(smb2_compress_algos[j]);
+				break;
+			}
 		}
 	}
+
+	cifsd_debug("Compression algorithms = 0x%x, chained %d\n",
+		    conn->compress_algos, conn->compress_chained);
 }
 
 static int
@@ -804,12 +1265,21 @@ deassemble_neg_contexts(struct cifsd_tcp_conn *conn,
 	/* +4 is to account for the RFC1001 len field */
 	char *pneg_ctxt = (char *)req +
 			le32_to_cpu(req->NegotiateContextOffset) + 4;
+	char *end = (char *)req + get_rfc1002_length(req) + 4;
 	__le16 *ContextType = (__le16 *)pneg_ctxt;
 	int neg_ctxt_cnt = le16_to_cpu(req->NegotiateContextCount);
+	unsigned int ctxt_len;
 
 	cifsd_debug("negotiate context count = %d\n", neg_ctxt_cnt);
 	status = STATUS_INVALID_PARAMETER;
 	while (i++ < neg_ctxt_cnt) {
+		/* ContextType, DataLength and Reserved precede the data */
+		if (pneg_ctxt + 8 > end)
+			break;
+		ctxt_len = 8 + le16_to_cpu(*(__le16 *)(pneg_ctxt + 2));
+		if (pneg_ctxt + ctxt_len > end)
+			break;
+
 		if (*ContextType == SMB2_PREAUTH_INTEGRITY_CAPABILITIES) {
 			cifsd_debug("deassemble SMB2_PREAUTH_INTEGRITY_CAPABILITIES context\n");
 			if (conn->preauth_info->Preauth_HashId)
@@ -817,9 +1287,6 @@ deassemble_neg_contexts(struct cifsd_tcp_conn *conn,
 
 			status = decode_preauth_ctxt(conn,
 				(struct smb2_preauth_neg_context *)pneg_ctxt);
-			pneg_ctxt +=
-				sizeof(struct smb2_preauth_neg_context) + 2;
-			ContextType = (__le16 *)pneg_ctxt;
 		} else if (*ContextType == SMB2_ENCRYPTION_CAPABILITIES) {
 			cifsd_debug("deassemble SMB2_ENCRYPTION_CAPABILITIES context\n");
 			if (conn->preauth_info->CipherId)
@@ -828,12 +1295,30 @@ deassemble_neg_contexts(struct cifsd_tcp_conn *conn,
 			decode_encrypt_ctxt(conn,
 					(struct smb2_encryption_neg_context *)
 					pneg_ctxt);
-			pneg_ctxt +=
-				sizeof(struct smb2_encryption_neg_context) + 2;
+		} else if (*ContextType == SMB2_SIGNING_CAPABILITIES) {
+			cifsd_debug("deassemble SMB2_SIGNING_CAPABILITIES context\n");
+			if (conn->signing_negotiated)
+				break;
+
+			decode_sign_cap_ctxt(conn,
+					(struct smb2_signing_capabilities *)
+					pneg_ctxt);
+		} else if (*ContextType == SMB2_COMPRESSION_CAPABILITIES) {
+			cifsd_debug("deassemble SMB2_COMPRESSION_CAPABILITIES context\n");
+			if (conn->compress_negotiated)
+				break;
+
+			decode_compress_ctxt(conn,
+					(struct smb2_compression_ctx *)
+					pneg_ctxt);
 		}
 
 		if (status != STATUS_SUCCESS)
 			break;
+
+		/* contexts are 8 byte aligned */
+		pneg_ctxt += round_up(ctxt_len, 8);
+		ContextType = (__le16 *)pneg_ctxt;
 	}
 	return status;
 }
@@ -871,6 +1356,11 @@ int smb2_handle_negotiate(struct cifsd_work *work)
 	}
 
 	conn->cli_cap = le32_to_cpu(req->Capabilities);
+	conn->signing_algorithm = SIGNING_ALG_AES_CMAC;
+	conn->signing_negotiated = false;
+	conn->compress_algos = 0;
+	conn->compress_chained = false;
+	conn->compress_negotiated = false;
 	switch (conn->dialect) {
 	case SMB311_PROT_ID:
 		conn->preauth_info =
@@ -933,13 +1423,13 @@ int smb2_handle_negotiate(struct cifsd_work *work)
 		memcpy(conn->ClientGUID, req->ClientGUID,
 				SMB2_CLIENT_GUID_SIZE);
 		conn->cli_sec_mode = le16_to_cpu(req->SecurityMode);
-		/* With LargeMTU above SMB2.0, default message limit is 1MB */
-		rsp->MaxReadSize = cpu_to_le32(cifsd_default_io_size());
-		rsp->MaxWriteSize = cpu_to_le32(cifsd_default_io_size());
-	} else {
-		rsp->MaxReadSize = cpu_to_le32(cifsd_max_msg_size());
-		rsp->MaxWriteSize = cpu_to_le32(cifsd_max_msg_size());
 	}
+	/*
+	 * With LargeMTU above SMB2.0, READ and WRITE carry up to
+	 * max_io_size bytes, one credit charged per 64KB.
+	 */
+	rsp->MaxReadSize = cpu_to_le32(smb2_max_read_write_size(conn));
+	rsp->MaxWriteSize = cpu_to_le32(smb2_max_read_write_size(conn));
 
 	rsp->StructureSize = cpu_to_le16(65);
 	rsp->DialectRevision = cpu_to_le16(conn->dialect);
@@ -999,27 +1489,6 @@ static int match_conn_by_dialect(struct cifsd_tcp_conn *conn, void *arg)
 	return 0;
 }
 
-static struct preauth_session *get_preauth_session(struct cifsd_tcp_conn *conn,
-		uint64_t sess_id)
-{
-	struct preauth_session *p_sess;
-
-	list_for_each_entry(p_sess, &conn->preauth_sess_table, list_entry)
-		if (p_sess->sess_id == sess_id)
-			return p_sess;
-
-	p_sess = kmalloc(sizeof(struct preauth_session), GFP_KERNEL);
-	if (!p_sess)
-		return NULL;
-	p_sess->sess_id = sess_id;
-	memcpy(p_sess->Preauth_HashValue,
-		conn->preauth_info->Preauth_HashValue,
-		PREAUTH_HASHVALUE_SIZE);
-	list_add(&p_sess->list_entry, &conn->preauth_sess_table);
-
-	return p_sess;
-}
-
 /**
  * smb2_sess_setup() - handler for smb2 session setup command
  * @work:	smb work containing smb request buffer
@@ -1033,14 +1502,19 @@ int smb2_sess_setup(struct cifsd_work *work)
 	struct smb2_sess_setup_rsp *rsp;
 	struct cifsd_session *sess;
 	NEGOTIATE_MESSAGE *negblob;
+	unsigned int blob_len;
 	struct channel *chann = NULL;
 	int rc = 0;
 	unsigned char *spnego_blob;
 	u16 spnego_blob_len;
 	char *neg_blob;
 	int neg_blob_len;
-	struct preauth_session *p_sess = NULL;
+	/* SMB 3.1.1 bind, hashing on a copy of its preauth hash */
+	__u8 preauth_hash[PREAUTH_HASHVALUE_SIZE];
+	bool preauth_bind = false;
 	bool binding_flags = false;
+	bool new_chann = false;
+	char sess_key[CIFS_KEY_SIZE];
 
 	req = (struct smb2_sess_setup_req *)REQUEST_BUF(work);
 	rsp = (struct smb2_sess_setup_rsp *)RESPONSE_BUF(work);
@@ -1066,25 +1540,47 @@ int smb2_sess_setup(struct cifsd_work *work)
 		}
 		rsp->hdr.SessionId = cpu_to_le64(sess->id);
 		cifsd_session_register(conn, sess);
+		/* as a looked up one, for work->sess */
+		cifsd_session_get(sess);
 	} else {
-		if (multi_channel_enable &&
-			req->hdr.Flags & SMB2_SESSION_REQ_FLAG_BINDING) {
+		if (smb2_sess_setup_binding(&req->hdr)) {
+			binding_flags = true;
 			sess = cifsd_session_lookup_slowpath(
 					le64_to_cpu(req->hdr.SessionId));
-			if (!(req->hdr.Flags & SMB2_FLAGS_SIGNED)) {
+			if (!sess) {
+				rc = -ENOENT;
+				rsp->hdr.Status =
+					STATUS_USER_SESSION_DELETED;
+				goto out_err;
+			}
+			/* the session key of the bind must not replace it */
+			memcpy(sess_key, sess->sess_key, CIFS_KEY_SIZE);
+
+			if (conn->dialect < SMB30_PROT_ID ||
+			    conn->dialect != sess->conn->dialect ||
+			    !(req->hdr.Flags & SMB2_FLAGS_SIGNED)) {
 				rc = -EINVAL;
 				rsp->hdr.Status = STATUS_INVALID_PARAMETER;
 				goto out_err;
 			}
 
-			if (sess->state & SMB2_SESSION_IN_PROGRESS) {
+			if (memcmp(conn->ClientGUID, sess->conn->ClientGUID,
+				   SMB2_CLIENT_GUID_SIZE)) {
+				rc = -ENOENT;
+				rsp->hdr.Status =
+					STATUS_USER_SESSION_DELETED;
+				goto out_err;
+			}
+
+			if (sess->conn == conn ||
+			    sess->state == SMB2_SESSION_IN_PROGRESS) {
 				rc = -EINVAL;
 				rsp->hdr.Status =
 					STATUS_REQUEST_NOT_ACCEPTED;
 				goto out_err;
 			}
 
-			if (sess->state & SMB2_SESSION_EXPIRED) {
+			if (sess->state == SMB2_SESSION_EXPIRED) {
 				rc = -EINVAL;
 				rsp->hdr.Status =
 					STATUS_NETWORK_SESSION_EXPIRED;
@@ -1097,27 +1593,27 @@ int smb2_sess_setup(struct cifsd_work *work)
 				goto out_err;
 			}
 
-			sess = cifsd_session_lookup(conn,
-					le64_to_cpu(req->hdr.SessionId));
-			if (!sess) {
-				rc = -EINVAL;
-				rsp->hdr.Status =
-					STATUS_REQUEST_NOT_ACCEPTED;
+			/* a bind is signed with the key of the session */
+			work->sess = sess;
+			if (!conn->ops->check_sign_req(work)) {
+				rc = -EACCES;
+				rsp->hdr.Status = STATUS_ACCESS_DENIED;
 				goto out_err;
 			}
 
 			if (conn->dialect >= SMB311_PROT_ID) {
-				p_sess = get_preauth_session(conn,
-					le64_to_cpu(req->hdr.SessionId));
-				if (!p_sess) {
+				u64 id = le64_to_cpu(req->hdr.SessionId);
+
+				if (cifsd_preauth_session_alloc(conn, id) ||
+				    cifsd_preauth_session_lookup(conn, id,
+						preauth_hash)) {
 					rc = -EINVAL;
 					rsp->hdr.Status =
 						STATUS_INVALID_PARAMETER;
 					goto out_err;
 				}
+				preauth_bind = true;
 			}
-
-			binding_flags = true;
 		} else {
 			sess = cifsd_session_lookup(conn,
 					le64_to_cpu(req->hdr.SessionId));
@@ -1131,20 +1627,21 @@ int smb2_sess_setup(struct cifsd_work *work)
 	}
 	work->sess = sess;
 
-	if (sess->state & SMB2_SESSION_EXPIRED)
+	if (!binding_flags && sess->state & SMB2_SESSION_EXPIRED)
 		sess->state = SMB2_SESSION_IN_PROGRESS;
 
-	negblob = (NEGOTIATE_MESSAGE *)((char *)&req->hdr.ProtocolId +
-			le16_to_cpu(req->SecurityBufferOffset));
+	/* checked to lie within the request when it was decoded */
+	negblob = smb2_req_area(work, SMB2_SESSION_SETUP_BLOB, &blob_len) ?:
+		(NEGOTIATE_MESSAGE *)req->Buffer;
 
 	if (conn->use_spnego) {
 		rc = cifsd_decode_negTokenInit((char *)negblob,
-				le16_to_cpu(req->SecurityBufferLength), conn);
+				blob_len, conn);
 		if (!rc) {
 			cifsd_debug("negTokenInit parse err %d\n", rc);
 			/* If failed, it might be negTokenTarg */
 			rc = cifsd_decode_negTokenTarg((char *)negblob,
-					le16_to_cpu(req->SecurityBufferLength),
+					blob_len,
 					conn);
 			if (!rc) {
 				cifsd_debug("negTokenTarg parse err %d\n",
@@ -1161,8 +1658,8 @@ int smb2_sess_setup(struct cifsd_work *work)
 	if (conn->dialect == SMB311_PROT_ID) {
 		__u8 *preauth_hashvalue;
 
-		if (p_sess)
-			preauth_hashvalue = p_sess->Preauth_HashValue;
+		if (preauth_bind)
+			preauth_hashvalue = preauth_hash;
 		else {
 			if (negblob->MessageType == NtLmNegotiate) {
 				if (!sess->Preauth_HashValue) {
@@ -1182,6 +1679,9 @@ int smb2_sess_setup(struct cifsd_work *work)
 		}
 		cifsd_gen_preauth_integrity_hash(conn, REQUEST_BUF(work),
 			preauth_hashvalue);
+		if (preauth_bind)
+			cifsd_preauth_session_update(conn,
+				le64_to_cpu(req->hdr.SessionId), preauth_hash);
 	}
 
 	if (negblob->MessageType == NtLmNegotiate) {
@@ -1189,7 +1689,7 @@ int smb2_sess_setup(struct cifsd_work *work)
 
 		cifsd_debug("negotiate phase\n");
 		rc = cifsd_decode_ntlmssp_neg_blob(negblob,
-			le16_to_cpu(req->SecurityBufferLength),
+			blob_len,
 			sess);
 		if (rc)
 			goto out_err;
@@ -1256,19 +1756,14 @@ int smb2_sess_setup(struct cifsd_work *work)
 		char *username;
 
 		if (conn->dialect >= SMB30_PROT_ID) {
-			chann = lookup_chann_list(sess);
+			chann = lookup_chann_list(sess, conn);
 			if (!chann) {
-				chann = kmalloc(sizeof(struct channel),
-					GFP_KERNEL);
+				chann = cifsd_session_add_channel(sess, conn);
 				if (!chann) {
 					rc = -ENOMEM;
 					goto out_err;
 				}
-
-				chann->conn = conn;
-				INIT_LIST_HEAD(&chann->chann_list);
-				list_add(&chann->chann_list,
-					&sess->cifsd_chann_list);
+				new_chann = true;
 			}
 		}
 
@@ -1276,9 +1771,7 @@ int smb2_sess_setup(struct cifsd_work *work)
 		if (conn->use_spnego && conn->mechToken)
 			authblob = (AUTHENTICATE_MESSAGE *)conn->mechToken;
 		else
-			authblob = (AUTHENTICATE_MESSAGE *)
-				((char *)&req->hdr.ProtocolId +
-				 le16_to_cpu(req->SecurityBufferOffset));
+			authblob = (AUTHENTICATE_MESSAGE *)negblob;
 
 		username = smb_strndup_from_utf16((const char *)authblob +
 				le32_to_cpu(authblob->UserName.BufferOffset),
@@ -1293,8 +1786,20 @@ int smb2_sess_setup(struct cifsd_work *work)
 		}
 
 		cifsd_debug("session setup request for user %s\n", username);
-		sess->user = cifsd_alloc_user(username);
-		kfree(username);
+		if (binding_flags) {
+			/* only the user of the session may bind to it */
+			rc = strcasecmp(username, user_name(sess->user));
+			kfree(username);
+			if (rc) {
+				cifsd_debug("bind by another user refused\n");
+				rc = -EACCES;
+				rsp->hdr.Status = STATUS_ACCESS_DENIED;
+				goto out_err;
+			}
+		} else {
+			sess->user = cifsd_alloc_user(username);
+			kfree(username);
+		}
 
 		if (!sess->user) {
 			cifsd_debug("Unknown user name or an error\n");
@@ -1315,7 +1820,7 @@ int smb2_sess_setup(struct cifsd_work *work)
 			sess->is_guest = true;
 		} else {
 			rc = cifsd_decode_ntlmssp_auth_blob(authblob,
-				le16_to_cpu(req->SecurityBufferLength),
+				blob_len,
 				sess);
 			if (rc) {
 				set_user_flag(sess->user,
@@ -1326,13 +1831,16 @@ int smb2_sess_setup(struct cifsd_work *work)
 				goto out_err;
 			}
 
-			if (!sess->sign && sess->is_guest == false &&
+			/* a bound channel keeps the keys of the session */
+			if (!binding_flags && !sess->sign &&
+				sess->is_guest == false &&
 				((req->SecurityMode &
 				SMB2_NEGOTIATE_SIGNING_REQUIRED_LE) ||
 				(conn->sign || server_conf.enforced_signing)))
 				sess->sign = true;
 
-			if (conn->srv_cap & SMB2_GLOBAL_CAP_ENCRYPTION &&
+			if (!binding_flags &&
+				conn->srv_cap & SMB2_GLOBAL_CAP_ENCRYPTION &&
 					conn->ops->generate_encryptionkey) {
 				rc = conn->ops->generate_encryptionkey(sess);
 				if (rc) {
@@ -1355,8 +1863,8 @@ int smb2_sess_setup(struct cifsd_work *work)
 
 		if (conn->ops->generate_signingkey) {
 			rc = conn->ops->generate_signingkey(
-					sess, binding_flags,
-					p_sess->Preauth_HashValue);
+					sess, conn, binding_flags,
+					preauth_bind ? preauth_hash : NULL);
 			if (rc) {
 				cifsd_debug("SMB3 signing key generation failed\n");
 				rsp->hdr.Status =
@@ -1398,6 +1906,12 @@ int smb2_sess_setup(struct cifsd_work *work)
 		work->sess = sess;
 		kfree(sess->Preauth_HashValue);
 		sess->Preauth_HashValue = NULL;
+		/* the bind is complete */
+		if (preauth_bind) {
+			cifsd_preauth_session_free(conn,
+				le64_to_cpu(req->hdr.SessionId));
+			preauth_bind = false;
+		}
 	} else {
 		cifsd_err("%s Invalid phase\n", __func__);
 		rc = -EINVAL;
@@ -1410,9 +1924,23 @@ out_err:
 		conn->mechToken = NULL;
 	}
 
-	if (rc < 0 && sess) {
+	if (rc < 0 && preauth_bind)
+		cifsd_preauth_session_free(conn,
+					   le64_to_cpu(req->hdr.SessionId));
+
+	if (binding_flags && sess) {
+		memcpy(sess->sess_key, sess_key, CIFS_KEY_SIZE);
+		/* a failed bind leaves the session to its other channels */
+		if (rc < 0 && new_chann)
+			cifsd_session_del_channel(sess, conn);
+	} else if (rc < 0 && sess) {
 		cifsd_session_destroy(sess);
+	}
+
+	/* the reference on the session is kept by work->sess on success */
+	if (rc < 0 && sess) {
 		work->sess = NULL;
+		cifsd_session_put(sess);
 	}
 
 	return rc;
@@ -1430,7 +1958,8 @@ int smb2_tree_connect(struct cifsd_work *work)
 	struct smb2_tree_connect_req *req;
 	struct smb2_tree_connect_rsp *rsp;
 	struct cifsd_session *sess = work->sess;
-	char *treename = NULL, *name = NULL;
+	char *treename = NULL, *name = NULL, *path_buf;
+	unsigned int path_len;
 	struct cifsd_tree_conn_status status;
 	struct cifsd_share_config *share;
 	int rc = -EINVAL;
@@ -1438,8 +1967,9 @@ int smb2_tree_connect(struct cifsd_work *work)
 	req = (struct smb2_tree_connect_req *)REQUEST_BUF(work);
 	rsp = (struct smb2_tree_connect_rsp *)RESPONSE_BUF(work);
 
-	treename = smb_strndup_from_utf16(req->Buffer,
-			le16_to_cpu(req->PathLength), true, conn->local_nls);
+	path_buf = smb2_req_area(work, SMB2_TREE_CONNECT_PATH, &path_len);
+	treename = smb_strndup_from_utf16(path_buf ?: (char *)req->Buffer,
+			path_len, true, conn->local_nls);
 	if (IS_ERR(treename)) {
 		cifsd_err("treename is NULL\n");
 		status.ret = CIFSD_TREE_CONN_STATUS_ERROR;
@@ -1489,6 +2019,10 @@ out_err1:
 	rsp->Reserved = 0;
 	/* default manual caching */
 	rsp->ShareFlags = SMB2_SHAREFLAG_MANUAL_CACHING;
+	if (status.ret == CIFSD_TREE_CONN_STATUS_OK && conn->compress_algos &&
+	    test_share_config_flag(status.tree_conn->share_conf,
+				   CIFSD_SHARE_FLAG_COMPRESSION))
+		rsp->ShareFlags |= cpu_to_le32(SMB2_SHAREFLAG_COMPRESS_DATA);
 	inc_rfc1001_len(rsp, 16);
 
 	if (!IS_ERR(treename))
@@ -1613,6 +2147,9 @@ int smb2_tree_disconnect(struct cifsd_work *work)
 	}
 
 	cifsd_close_tree_conn_fds(work);
+	/* queued requests may still refer to the tree connect */
+	cifsd_qos_flush(NULL, sess);
+	cifsd_tcp_conn_wait_idle(work->conn);
 	cifsd_tree_conn_disconnect(sess, tcon);
 	return 0;
 }
@@ -1644,6 +2181,7 @@ int smb2_session_logoff(struct cifsd_work *work)
 	/* setting CifsExiting here may race with start_tcp_sess */
 	cifsd_tcp_set_need_reconnect(work);
 	cifsd_close_session_fds(work);
+	cifsd_qos_flush(NULL, sess);
 	cifsd_tcp_conn_wait_idle(conn);
 
 	if (cifsd_tree_conn_session_logoff(sess)) {
@@ -1676,13 +2214,15 @@ static noinline int create_smb2_pipe(struct cifsd_work *work)
 	struct smb2_create_req *req;
 	int id;
 	int err;
-	char *name;
+	char *name, *name_buf;
+	unsigned int name_len;
 
 	rsp = (struct smb2_create_rsp *)RESPONSE_BUF(work);
-	req = (struct smb2_create_req *)REQUEST_BUF(work);
+	req = work->req_view.hdr;
 
-	name = smb_strndup_from_utf16(req->Buffer, le16_to_cpu(req->NameLength),
-			1, work->conn->local_nls);
+	name_buf = smb2_req_area(work, SMB2_CREATE_NAME, &name_len);
+	name = smb_strndup_from_utf16(name_buf ?: (char *)req->Buffer,
+			name_len, 1, work->conn->local_nls);
 	if (IS_ERR(name)) {
 		rsp->hdr.Status = STATUS_NO_MEMORY;
 		err = PTR_ERR(name);
@@ -1828,21 +2368,18 @@ static int parse_durable_handle_context(struct cifsd_work *work,
 				(struct create_durable_req_v2 *)context;
 			cifsd_debug("Request for durable v2 open\n");
 			d_info->fp =
-				cifsd_lookup_fd_cguid(durable_v2_blob->CreateGuid);
+				cifsd_lookup_fd_cguid(conn->ClientGUID,
+						durable_v2_blob->CreateGuid);
 			if (d_info->fp) {
-				if (!memcmp(conn->ClientGUID,
-					d_info->fp->client_guid,
-					SMB2_CLIENT_GUID_SIZE)) {
-					if (!(le32_to_cpu(req->hdr.Flags) &
-						SMB2_FLAGS_REPLAY_OPERATIONS)) {
-						err = -ENOEXEC;
-						goto out;
-					}
-
-					d_info->fp->conn = conn;
-					d_info->reconnected = 1;
+				if (!(le32_to_cpu(req->hdr.Flags) &
+					SMB2_FLAGS_REPLAY_OPERATIONS)) {
+					err = -ENOEXEC;
 					goto out;
 				}
+
+				d_info->fp->conn = conn;
+				d_info->reconnected = 1;
+				goto out;
 			}
 			if (((lc &&
 				(lc->req_state & SMB2_LEASE_HANDLE_CACHING)) ||
@@ -2140,7 +2677,7 @@ static int smb2_creat(struct cifsd_work *work,
 		}
 	}
 
-	rc = cifsd_vfs_kern_path(name, 0, path, 0);
+	rc = cifsd_vfs_share_kern_path(work, name, 0, path, 0);
 	if (rc) {
 		cifsd_err("cannot get linux path (%s), err = %d\n",
 				name, rc);
@@ -2150,24 +2687,91 @@ static int smb2_creat(struct cifsd_work *work,
 	return 0;
 }
 
+static void smb2_open_break_wait(struct cifsd_work *work)
+{
+	smb_break_oplock_wait(work->async_data, work);
+}
+
 /**
- * smb2_open() - handler for smb file open request
- * @work:	smb work containing request buffer
+ * smb2_open_break_async() - wait for the break of an open asynchronously
+ * @work:	smb work containing create command
+ * @req:	create request
+ * @lc:		lease context of the request, or NULL
+ * @inode:	inode being opened
  *
- * Return:      0 on success, otherwise error
+ * The worker doesn't wait for the client holding a batch oplock or
+ * handle caching lease to ack its break, the create goes pending and
+ * is processed again once the break is done.
+ *
+ * Return:	true if the create went pending
  */
-int smb2_open(struct cifsd_work *work)
+static bool smb2_open_break_async(struct cifsd_work *work,
+				  struct smb2_create_req *req,
+				  struct lease_ctx_info *lc,
+				  struct inode *inode)
 {
-	struct cifsd_tcp_conn *conn = work->conn;
-	struct cifsd_session *sess = work->sess;
-	struct cifsd_tree_connect *tcon = work->tcon;
-	struct smb2_create_req *req;
-	struct smb2_create_rsp *rsp, *rsp_org;
-	struct path path;
-	struct cifsd_share_config *share = tcon->share_conf;
-	struct cifsd_file *fp = NULL;
-	struct file *filp = NULL;
-	struct kstat stat;
+	struct oplock_info *opinfo;
+
+	/* a compound is answered at once */
+	if (work->next_smb2_rcv_hdr_off || req->hdr.NextCommand)
+		return false;
+
+	/* attribute only opens don't break, see ATTR_FP() */
+	if (!(req->DesiredAccess & ~(FILE_READ_ATTRIBUTES_LE |
+			FILE_WRITE_ATTRIBUTES_LE | FILE_SYNCHRONIZE_LE)) &&
+	    req->CreateDisposition != FILE_OVERWRITE_IF_LE &&
+	    req->CreateDisposition != FILE_OVERWRITE_LE &&
+	    req->CreateDisposition != FILE_SUPERSEDE_LE)
+		return false;
+
+	if (req->RequestedOplockLevel == SMB2_OPLOCK_LEVEL_LEASE &&
+	    !(work->conn->srv_cap & SMB2_GLOBAL_CAP_LEASING))
+		return false;
+
+	opinfo = smb_break_oplock_async(work, inode, lc);
+	if (!opinfo)
+		return false;
+
+	/*
+	 * An encrypted request waits without an interim response, which
+	 * couldn't be encrypted. A create processed again after a break
+	 * has already been answered with one.
+	 */
+	if (!work->encrypted && work->type != ASYNC) {
+		smb2_set_rsp_credits(work);
+		if (setup_async_work(work, NULL, NULL)) {
+			opinfo_put(opinfo);
+			return false;
+		}
+		smb2_send_interim_resp(work, STATUS_PENDING);
+	}
+
+	/* smb2_open_break_wait() parks it and drops the oplock reference */
+	work->async_pending = true;
+	work->async_retry = true;
+	work->async_start = smb2_open_break_wait;
+	work->async_data = opinfo;
+	return true;
+}
+
+/**
+ * smb2_open() - handler for smb file open request
+ * @work:	smb work containing request buffer
+ *
+ * Return:      0 on success, otherwise error
+ */
+int smb2_open(struct cifsd_work *work)
+{
+	struct cifsd_tcp_conn *conn = work->conn;
+	struct cifsd_session *sess = work->sess;
+	struct cifsd_tree_connect *tcon = work->tcon;
+	struct smb2_create_req *req;
+	struct smb2_create_rsp *rsp, *rsp_org;
+	struct path path;
+	struct cifsd_share_config *share = tcon->share_conf;
+	struct cifsd_file *fp = NULL;
+	struct file *filp = NULL;
+	struct kstat stat;
 	struct create_context *context;
 	struct lease_ctx_info *lc = NULL;
 	struct create_context *lease_ccontext = NULL, *durable_ccontext = NULL,
@@ -2179,20 +2783,19 @@ int smb2_open(struct cifsd_work *work)
 	int maximal_access = 0, contxt_cnt = 0, query_disk_id = 0;
 	int s_type = 0;
 	int next_off = 0;
-	char *name = NULL;
+	char *name = NULL, *name_buf;
 	char *stream_name = NULL;
+	unsigned int name_len;
 	bool file_present = false, created = false;
 	struct durable_info d_info;
 	int share_ret, need_truncate = 0;
 	u64 time;
 
-	req = (struct smb2_create_req *)REQUEST_BUF(work);
+	req = work->req_view.hdr;
 	rsp = (struct smb2_create_rsp *)RESPONSE_BUF(work);
 	rsp_org = rsp;
 
 	if (work->next_smb2_rcv_hdr_off) {
-		req = (struct smb2_create_req *)((char *)req +
-					work->next_smb2_rcv_hdr_off);
 		rsp = (struct smb2_create_rsp *)((char *)rsp +
 					work->next_smb2_rsp_hdr_off);
 	}
@@ -2211,17 +2814,18 @@ int smb2_open(struct cifsd_work *work)
 		return create_smb2_pipe(work);
 	}
 
-	if (req->NameLength) {
+	name_buf = smb2_req_area(work, SMB2_CREATE_NAME, &name_len);
+	if (name_buf) {
 		if ((req->CreateOptions & FILE_DIRECTORY_FILE_LE) &&
-			*(char *)req->Buffer == '\\') {
+			*name_buf == '\\') {
 			cifsd_err("not allow directory name included leadning slash\n");
 			rc = -EINVAL;
 			goto err_out1;
 		}
 
 		name = smb2_get_name(share,
-				     req->Buffer,
-				     le16_to_cpu(req->NameLength),
+				     name_buf,
+				     name_len,
 				     work->conn->local_nls);
 		if (IS_ERR(name)) {
 			rc = PTR_ERR(name);
@@ -2292,6 +2896,10 @@ int smb2_open(struct cifsd_work *work)
 			lc = parse_lease_state(req);
 	}
 
+	/* v2 lease contexts are answered in kind by SMB3 only */
+	if (lc && lc->version == 2 && !conn->vals->create_lease_v2_size)
+		lc->version = 1;
+
 	if (req->ImpersonationLevel > IL_DELEGATE) {
 		cifsd_err("Invalid impersonationlevel : 0x%x\n",
 			le32_to_cpu(req->ImpersonationLevel));
@@ -2398,15 +3006,16 @@ int smb2_open(struct cifsd_work *work)
 		 * On delete request, instead of following up, need to
 		 * look the current entity
 		 */
-		rc = cifsd_vfs_kern_path(name, 0, &path, 1);
+		rc = cifsd_vfs_share_kern_path(work, name, 0, &path, 1);
 	} else {
 		/*
 		 * Use LOOKUP_FOLLOW to follow the path of
 		 * symlink in path buildup
 		 */
-		rc = cifsd_vfs_kern_path(name, LOOKUP_FOLLOW, &path, 1);
+		rc = cifsd_vfs_share_kern_path(work, name, LOOKUP_FOLLOW,
+					       &path, 1);
 		if (rc) { /* Case for broken link ?*/
-			rc = cifsd_vfs_kern_path(name, 0, &path, 1);
+			rc = cifsd_vfs_share_kern_path(work, name, 0, &path, 1);
 		}
 	}
 
@@ -2469,6 +3078,15 @@ int smb2_open(struct cifsd_work *work)
 		file_present = cifsd_close_inode_fds(work,
 						     path.dentry->d_inode);
 
+	if (file_present && oplocks_enable && !stream_name &&
+	    !S_ISDIR(stat.mode) &&
+	    smb2_open_break_async(work, req, lc, path.dentry->d_inode)) {
+		path_put(&path);
+		kfree(name);
+		kfree(lc);
+		return 0;
+	}
+
 	if (test_tree_conn_flag(tcon, CIFSD_TREE_CONN_FLAG_WRITABLE))
 		open_flags = smb2_create_open_flags(file_present,
 			req->DesiredAccess, req->CreateDisposition);
@@ -2500,7 +3118,11 @@ int smb2_open(struct cifsd_work *work)
 	}
 
 	rc = 0;
-	filp = dentry_open(&path, open_flags | O_LARGEFILE, current_cred());
+	if (file_present)
+		filp = cifsd_deferred_close_reuse(tcon, &path, open_flags);
+	if (!filp)
+		filp = dentry_open(&path, open_flags | O_LARGEFILE,
+				   current_cred());
 	if (IS_ERR(filp)) {
 		rc = PTR_ERR(filp);
 		cifsd_err("dentry open for dir failed, rc %d\n", rc);
@@ -2674,6 +3296,9 @@ int smb2_open(struct cifsd_work *work)
 			goto err_out;
 	}
 
+	if (file_info != FILE_OPENED && !stream_name)
+		smb_break_dir_lease(PARENT_INODE(fp), fp);
+
 	if ((file_info != FILE_OPENED) && !S_ISDIR(file_inode(filp)->i_mode)) {
 		/* Create default data stream in xattr */
 		cifsd_vfs_setxattr(path.dentry, XATTR_NAME_STREAM,
@@ -2708,6 +3333,7 @@ int smb2_open(struct cifsd_work *work)
 			if (d_info.app_id)
 				memcpy(fp->app_instance_id,
 					d_info.app_id, 16);
+			cifsd_index_durable_fd(fp);
 		}
 	}
 
@@ -2741,18 +3367,22 @@ reconnected:
 
 	/* If lease is request send lease context response */
 	if (fp->f_opinfo && fp->f_opinfo->is_lease) {
+		struct lease *lease = fp->f_opinfo->o_lease;
+		size_t lease_size = conn->vals->create_lease_size;
+
 		cifsd_debug("lease granted on(%s) lease state 0x%x\n",
-				name, fp->f_opinfo->o_lease->state);
+				name, lease->state);
 		rsp->OplockLevel = SMB2_OPLOCK_LEVEL_LEASE;
 
+		if (lease->version == 2)
+			lease_size = conn->vals->create_lease_v2_size;
 		lease_ccontext = (struct create_context *)rsp->Buffer;
 		contxt_cnt++;
-		create_lease_buf(rsp->Buffer, fp->f_opinfo->o_lease);
-		rsp->CreateContextsLength =
-			cpu_to_le32(conn->vals->create_lease_size);
-		inc_rfc1001_len(rsp_org, conn->vals->create_lease_size);
+		create_lease_buf(rsp->Buffer, lease);
+		rsp->CreateContextsLength = cpu_to_le32(lease_size);
+		inc_rfc1001_len(rsp_org, lease_size);
 		next_ptr = &lease_ccontext->Next;
-		next_off = conn->vals->create_lease_size;
+		next_off = lease_size;
 	}
 
 	if (d_info.type == DURABLE_REQ || d_info.type == DURABLE_REQ_V2) {
@@ -2849,8 +3479,12 @@ err_out1:
 			cifsd_close_fd(work, fp->volatile_id);
 		smb2_set_err_rsp(work);
 		cifsd_debug("Error response: %x\n", rsp->hdr.Status);
-	} else
+	} else {
 		conn->stats.open_files_count++;
+		/* related operations of the compound use fp directly */
+		if (fp && (work->next_smb2_rcv_hdr_off || req->hdr.NextCommand))
+			cifsd_compound_fp_set(work, fp);
+	}
 
 	return 0;
 }
@@ -3043,26 +3677,21 @@ int smb2_query_dir(struct cifsd_work *work)
 	struct smb2_query_directory_req *req;
 	struct smb2_query_directory_rsp *rsp, *rsp_org;
 	struct cifsd_share_config *share = work->tcon->share_conf;
-	struct cifsd_dirent *de;
 	struct cifsd_file *dir_fp;
 	struct cifsd_dir_info d_info;
 	int reclen = 0;
 	int rc = 0;
 	struct kstat kstat;
 	struct cifsd_kstat cifsd_kstat;
-	char *dirpath, *srch_ptr = NULL, *path = NULL;
+	char *dirpath, *srch_ptr = NULL, *path = NULL, *name_buf;
+	unsigned int name_len;
 	unsigned char srch_flag;
-	struct cifsd_readdir_data r_data = {
-		.ctx.actor = cifsd_fill_dirent,
-	};
 
-	req = (struct smb2_query_directory_req *)REQUEST_BUF(work);
+	req = work->req_view.hdr;
 	rsp = (struct smb2_query_directory_rsp *)RESPONSE_BUF(work);
 	rsp_org = rsp;
 
 	if (work->next_smb2_rcv_hdr_off) {
-		req = (struct smb2_query_directory_req *)((char *)req +
-				work->next_smb2_rcv_hdr_off);
 		rsp = (struct smb2_query_directory_rsp *)((char *)rsp +
 				work->next_smb2_rsp_hdr_off);
 	}
@@ -3092,9 +3721,9 @@ int smb2_query_dir(struct cifsd_work *work)
 	}
 
 	srch_flag = req->Flags;
-	srch_ptr = smb_strndup_from_utf16(req->Buffer,
-			le32_to_cpu(req->FileNameLength), 1,
-			conn->local_nls);
+	name_buf = smb2_req_area(work, SMB2_QUERY_DIRECTORY_NAME, &name_len);
+	srch_ptr = smb_strndup_from_utf16(name_buf ?: (char *)req->Buffer,
+			name_len, 1, conn->local_nls);
 	if (IS_ERR(srch_ptr)) {
 		cifsd_debug("Search Pattern not found\n");
 		rsp->hdr.Status = STATUS_INVALID_PARAMETER;
@@ -3120,18 +3749,10 @@ int smb2_query_dir(struct cifsd_work *work)
 	}
 	cifsd_debug("Directory name is %s\n", dirpath);
 
-	if (!dir_fp->readdir_data.dirent) {
-		dir_fp->readdir_data.dirent =
-			(void *)__get_free_page(GFP_KERNEL);
-		if (!dir_fp->readdir_data.dirent) {
-			cifsd_err("Failed to allocate memory\n");
-			rsp->hdr.Status = STATUS_NO_MEMORY;
-			rc = -ENOMEM;
-			goto err_out;
-		}
-		dir_fp->readdir_data.used = 0;
-		dir_fp->readdir_data.full = 0;
-		dir_fp->dirent_offset = 0;
+	rc = cifsd_search_pattern_update(&dir_fp->search_pattern, srch_ptr);
+	if (rc) {
+		rsp->hdr.Status = STATUS_NO_MEMORY;
+		goto err_out;
 	}
 
 	if (srch_flag & SMB2_REOPEN) {
@@ -3162,10 +3783,17 @@ int smb2_query_dir(struct cifsd_work *work)
 		dir_fp->dirent_offset = le32_to_cpu(req->FileIndex);
 	}
 
-	r_data.dirent = dir_fp->readdir_data.dirent;
+	if (srch_flag & (SMB2_REOPEN | SMB2_RESTART_SCANS) ||
+	    (srch_flag & SMB2_INDEX_SPECIFIED && le32_to_cpu(req->FileIndex)))
+		cifsd_dir_enum_detach(dir_fp);
+	/* a handle at the start of the directory reads it from the cache */
+	if (!dir_fp->dir_enum && !dir_fp->filp->f_pos &&
+	    !dir_fp->readdir_data.used)
+		cifsd_dir_enum_attach(work, dir_fp);
+
 	memset(&d_info, 0, sizeof(struct cifsd_dir_info));
 	d_info.bufptr = (char *)rsp->Buffer;
-	d_info.out_buf_len = (cifsd_max_msg_size() + MAX_HEADER_SIZE(conn) -
+	d_info.out_buf_len = (RESPONSE_SZ(work) -
 				(get_rfc1002_length(rsp_org) + 4));
 	d_info.out_buf_len = min_t(int, d_info.out_buf_len,
 				le32_to_cpu(req->OutputBufferLength)) -
@@ -3180,7 +3808,7 @@ int smb2_query_dir(struct cifsd_work *work)
 						req->FileInformationClass,
 						dir_fp,
 						&d_info,
-						srch_ptr,
+						dir_fp->search_pattern,
 						smb2_populate_readdir_entry);
 		if (rc)
 			goto err_out;
@@ -3196,51 +3824,18 @@ int smb2_query_dir(struct cifsd_work *work)
 	d_info.name = NULL;
 	while (d_info.out_buf_len > 0) {
 		kfree(d_info.name);
-		d_info.name = NULL;
-
-		if (dir_fp->dirent_offset >= dir_fp->readdir_data.used) {
-			dir_fp->dirent_offset = 0;
-			r_data.used = 0;
-			r_data.full = 0;
-			rc = cifsd_vfs_readdir(dir_fp->filp,
-					       &r_data);
-			if (rc < 0) {
-				cifsd_debug("err : %d\n", rc);
-				goto err_out;
-			}
-
-			dir_fp->readdir_data.used = r_data.used;
-			dir_fp->readdir_data.full = r_data.full;
-			if (!dir_fp->readdir_data.used) {
-				free_page((unsigned long)
-						(dir_fp->readdir_data.dirent));
-				dir_fp->readdir_data.dirent = NULL;
-				break;
-			}
+		cifsd_kstat.kstat = &kstat;
 
-			de = (struct cifsd_dirent *)
-				((char *)dir_fp->readdir_data.dirent);
-		} else {
-			de = (struct cifsd_dirent *)
-				((char *)dir_fp->readdir_data.dirent +
-				 dir_fp->dirent_offset);
+		rc = cifsd_dir_read_entry(work, dir_fp, dirpath, &cifsd_kstat,
+					  &d_info.name, &reclen);
+		if (rc == -ENODATA) {
+			rc = 0;
+			break;
 		}
-
-		reclen = ALIGN(sizeof(struct cifsd_dirent) + de->namelen,
-				sizeof(__le64));
-		dir_fp->dirent_offset += reclen;
-
-		cifsd_kstat.kstat = &kstat;
-		d_info.name = cifsd_vfs_readdir_name(work,
-						     &cifsd_kstat,
-						     de,
-						     dirpath);
-		if (IS_ERR(d_info.name)) {
-			cifsd_debug("Can't read dirent: %d\n",
-				    (int)PTR_ERR(d_info.name));
-			d_info.name = NULL;
+		if (rc)
+			goto err_out;
+		if (!d_info.name)
 			continue;
-		}
 
 		/* dot and dotdot entries are already reserved */
 		if (!strcmp(".", d_info.name) || !strcmp("..", d_info.name))
@@ -3251,7 +3846,8 @@ int smb2_query_dir(struct cifsd_work *work)
 			continue;
 		}
 
-		if (match_pattern(d_info.name, srch_ptr)) {
+		if (cifsd_search_pattern_match(dir_fp->search_pattern,
+					       d_info.name)) {
 			rc = smb2_populate_readdir_entry(conn,
 						req->FileInformationClass,
 						&d_info,
@@ -3269,7 +3865,7 @@ int smb2_query_dir(struct cifsd_work *work)
 
 	kfree(d_info.name);
 	if (d_info.out_buf_len < 0)
-		dir_fp->dirent_offset -= reclen;
+		cifsd_dir_unread_entry(dir_fp, reclen);
 
 	if (!d_info.data_count && d_info.out_buf_len >= 0) {
 		if (srch_flag & SMB2_RETURN_SINGLE_ENTRY)
@@ -3297,8 +3893,10 @@ int smb2_query_dir(struct cifsd_work *work)
 		inc_rfc1001_len(rsp_org, 8 + d_info.data_count);
 	}
 
+	cifsd_dir_release_page(dir_fp);
 	kfree(path);
 	kfree(srch_ptr);
+	cifsd_fd_put(dir_fp);
 	return 0;
 
 err_out:
@@ -3317,6 +3915,7 @@ err_out2:
 		rsp->hdr.Status = STATUS_NOT_IMPLEMENTED;
 	smb2_set_err_rsp(work);
 
+	cifsd_fd_put(dir_fp);
 	return 0;
 }
 
@@ -3433,7 +4032,7 @@ static int smb2_get_info_file_pipe(struct cifsd_session *sess,
  *
  * Return:	0 on success, otherwise error
  */
-static int smb2_get_ea(struct cifsd_tcp_conn *conn, struct path *path,
+static int smb2_get_ea(struct cifsd_work *work, struct path *path,
 	struct smb2_query_info_req *req, struct smb2_query_info_rsp *rsp,
 	void *rsp_org)
 {
@@ -3442,11 +4041,19 @@ static int smb2_get_ea(struct cifsd_tcp_conn *conn, struct path *path,
 	int rc, name_len, value_len, xattr_list_len;
 	ssize_t buf_free_len, alignment_bytes, next_offset, rsp_data_cnt = 0;
 	struct smb2_ea_info_req *ea_req = NULL;
+	unsigned int in_len;
 
 	/* single EA entry is requested with given user.* name */
-	if (req->InputBufferLength)
-		ea_req = (struct smb2_ea_info_req *)req->Buffer;
-	else {
+	if (req->InputBufferLength) {
+		ea_req = smb2_req_area(work, SMB2_QUERY_INFO_INPUT, &in_len);
+		if (!ea_req ||
+		    in_len < offsetof(struct smb2_ea_info_req, name) ||
+		    ea_req->EaNameLength >
+		    in_len - offsetof(struct smb2_ea_info_req, name)) {
+			rsp->hdr.Status = STATUS_INVALID_PARAMETER;
+			return -EINVAL;
+		}
+	} else {
 		/* need to send all EAs, if no specific EA is requested*/
 		if (le32_to_cpu(req->Flags) & SL_RETURN_SINGLE_ENTRY)
 			cifsd_debug("Ambiguous, all EAs are requested but "
@@ -3454,7 +4061,7 @@ static int smb2_get_ea(struct cifsd_tcp_conn *conn, struct path *path,
 				"flags 0x%x\n", le32_to_cpu(req->Flags));
 	}
 
-	buf_free_len = cifsd_max_msg_size() + MAX_HEADER_SIZE(conn) -
+	buf_free_len = RESPONSE_SZ(work) -
 		(get_rfc1002_length(rsp_org) + 4)
 		- sizeof(struct smb2_query_info_rsp);
 
@@ -3574,17 +4181,10 @@ out:
 	return rc;
 }
 
-/**
- * smb2_get_info_file() - handler for smb2 query info command
- * @work:	smb work containing query info request buffer
- *
- * Return:	0 on success, otherwise error
- */
-static int smb2_get_info_file(struct cifsd_work *work,
-	struct smb2_query_info_req *req, struct smb2_query_info_rsp *rsp,
-	void *rsp_org)
+static int __smb2_get_info_file(struct cifsd_work *work,
+	struct cifsd_file *fp, struct smb2_query_info_req *req,
+	struct smb2_query_info_rsp *rsp, void *rsp_org)
 {
-	struct cifsd_file *fp;
 	struct cifsd_tcp_conn *conn = work->conn;
 	int fileinfoclass = 0;
 	struct file *filp;
@@ -3594,18 +4194,6 @@ static int smb2_get_info_file(struct cifsd_work *work,
 	struct inode *inode;
 	u64 time;
 
-	if (test_share_config_flag(work->tcon->share_conf,
-				   CIFSD_SHARE_FLAG_PIPE)) {
-		/* smb2 info file called for pipe */
-		return smb2_get_info_file_pipe(work->sess, req, rsp);
-	}
-
-	fp = cifsd_lookup_fd_slow(work,
-			le64_to_cpu(req->VolatileFileId),
-			le64_to_cpu(req->PersistentFileId));
-	if (!fp)
-		return -ENOENT;
-
 	filp = fp->filp;
 	inode = filp->f_path.dentry->d_inode;
 	generic_fillattr(inode, &stat);
@@ -3781,10 +4369,15 @@ static int smb2_get_info_file(struct cifsd_work *work,
 		char *stream_name, *xattr_list = NULL, *stream_buf;
 		char *stream_type;
 		struct path *path = &filp->f_path;
-		ssize_t xattr_list_len;
+		ssize_t xattr_list_len, buf_free_len;
 		int nbytes = 0, streamlen, stream_name_len, next;
 
 		file_info = (struct smb2_file_stream_info *)rsp->Buffer;
+		buf_free_len = RESPONSE_SZ(work) -
+			(get_rfc1002_length(rsp_org) + 4) -
+			sizeof(struct smb2_query_info_rsp);
+		if (le32_to_cpu(req->OutputBufferLength) < buf_free_len)
+			buf_free_len = le32_to_cpu(req->OutputBufferLength);
 
 		if (stream_file_enable == false) {
 			file_info->NextEntryOffset = 0;
@@ -3837,6 +4430,15 @@ static int smb2_get_info_file(struct cifsd_work *work,
 
 			/* plus :: size */
 			streamlen += 2;
+
+			/* bailout if the UTF-16 name can't fit in buf_free_len */
+			if (nbytes + streamlen * 2 +
+			    (ssize_t)sizeof(struct smb2_file_stream_info) >
+			    buf_free_len) {
+				rsp->hdr.Status = STATUS_BUFFER_OVERFLOW;
+				break;
+			}
+
 			stream_buf = kmalloc(streamlen + 1, GFP_KERNEL);
 			if (!stream_buf)
 				break;
@@ -3943,7 +4545,7 @@ out:
 			return -EACCES;
 		}
 
-		rc = smb2_get_ea(work->conn, &filp->f_path, req, rsp,
+		rc = smb2_get_ea(work, &filp->f_path, req, rsp,
 			rsp_org);
 		file_infoclass_size = FILE_FULL_EA_INFORMATION_SIZE;
 		if (rc < 0)
@@ -4018,6 +4620,36 @@ out:
 	return rc;
 }
 
+/**
+ * smb2_get_info_file() - handler for smb2 query info command
+ * @work:	smb work containing query info request buffer
+ *
+ * Return:	0 on success, otherwise error
+ */
+static int smb2_get_info_file(struct cifsd_work *work,
+	struct smb2_query_info_req *req, struct smb2_query_info_rsp *rsp,
+	void *rsp_org)
+{
+	struct cifsd_file *fp;
+	int rc;
+
+	if (test_share_config_flag(work->tcon->share_conf,
+				   CIFSD_SHARE_FLAG_PIPE)) {
+		/* smb2 info file called for pipe */
+		return smb2_get_info_file_pipe(work->sess, req, rsp);
+	}
+
+	fp = cifsd_lookup_fd_slow(work,
+			le64_to_cpu(req->VolatileFileId),
+			le64_to_cpu(req->PersistentFileId));
+	if (!fp)
+		return -ENOENT;
+
+	rc = __smb2_get_info_file(work, fp, req, rsp, rsp_org);
+	cifsd_fd_put(fp);
+	return rc;
+}
+
 /**
  * smb2_get_info_filesystem() - handler for smb2 query info command
  * @work:	smb work containing query info request buffer
@@ -4072,6 +4704,9 @@ static int smb2_get_info_filesystem(struct cifsd_session *sess,
 
 			fs_info = (FILE_SYSTEM_ATTRIBUTE_INFO *)rsp->Buffer;
 			fs_info->Attributes = cpu_to_le32(0x0001002f);
+			if (cifsd_vfs_can_clone(path.dentry->d_sb))
+				fs_info->Attributes |=
+					FILE_SUPPORTS_BLOCK_REFCOUNTING;
 			fs_info->MaxPathNameComponentLength =
 				cpu_to_le32(stfs.f_namelen);
 			len = smbConvertToUTF16((__le16 *)
@@ -4270,6 +4905,14 @@ static int smb2_get_info_sec(struct cifsd_work *work,
 	filp = fp->filp;
 	inode = FP_INODE(fp);
 
+	if ((ssize_t)(RESPONSE_SZ(work) - (get_rfc1002_length(rsp_org) + 4) -
+		      sizeof(struct smb2_query_info_rsp)) <
+	    (ssize_t)MAX_SEC_DESC_LEN) {
+		rsp->hdr.Status = STATUS_BUFFER_TOO_SMALL;
+		cifsd_fd_put(fp);
+		return -ENOSPC;
+	}
+
 	pntsd = (struct cifs_ntsd *) rsp->Buffer;
 
 	out_len = build_sec_desc(pntsd, le32_to_cpu(req->AdditionalInformation),
@@ -4278,6 +4921,7 @@ static int smb2_get_info_sec(struct cifsd_work *work,
 	rsp->OutputBufferLength = cpu_to_le32(out_len);
 	inc_rfc1001_len(rsp_org, out_len);
 
+	cifsd_fd_put(fp);
 	return rc;
 }
 #else
@@ -4320,13 +4964,11 @@ int smb2_query_info(struct cifsd_work *work)
 	struct cifsd_session *sess = work->sess;
 	int rc = 0;
 
-	req = (struct smb2_query_info_req *)REQUEST_BUF(work);
+	req = work->req_view.hdr;
 	rsp = (struct smb2_query_info_rsp *)RESPONSE_BUF(work);
 	rsp_org = rsp;
 
 	if (work->next_smb2_rcv_hdr_off) {
-		req = (struct smb2_query_info_req *)((char *)req +
-				work->next_smb2_rcv_hdr_off);
 		rsp = (struct smb2_query_info_rsp *)((char *)rsp +
 				work->next_smb2_rsp_hdr_off);
 	}
@@ -4384,8 +5026,7 @@ static noinline int smb2_close_pipe(struct cifsd_work *work)
 {
 	uint64_t id;
 
-	struct smb2_close_req *req =
-		(struct smb2_close_req *)REQUEST_BUF(work);
+	struct smb2_close_req *req = work->req_view.hdr;
 	struct smb2_close_rsp *rsp =
 		(struct smb2_close_rsp *)RESPONSE_BUF(work);
 
@@ -4416,8 +5057,7 @@ int smb2_close(struct cifsd_work *work)
 {
 	unsigned int volatile_id = CIFSD_NO_FID;
 	uint64_t sess_id;
-	struct smb2_close_req *req =
-		(struct smb2_close_req *)REQUEST_BUF(work);
+	struct smb2_close_req *req = work->req_view.hdr;
 	struct smb2_close_rsp *rsp =
 		(struct smb2_close_rsp *)RESPONSE_BUF(work);
 	struct smb2_close_rsp *rsp_org;
@@ -4426,8 +5066,6 @@ int smb2_close(struct cifsd_work *work)
 
 	rsp_org = rsp;
 	if (work->next_smb2_rcv_hdr_off) {
-		req = (struct smb2_close_req *)((char *)req +
-					work->next_smb2_rcv_hdr_off);
 		rsp = (struct smb2_close_rsp *)((char *)rsp +
 					work->next_smb2_rsp_hdr_off);
 	}
@@ -4470,13 +5108,14 @@ int smb2_close(struct cifsd_work *work)
 			/* file closed, stored id is not valid anymore */
 			work->compound_fid = CIFSD_NO_FID;
 			work->compound_pfid = CIFSD_NO_FID;
+			cifsd_compound_fp_put(work);
 		}
 	} else {
 		volatile_id = le64_to_cpu(req->VolatileFileId);
 	}
 	cifsd_debug("volatile_id = %u \n", volatile_id);
 
-	err = cifsd_close_fd(work, volatile_id);
+	err = cifsd_close_fd_deferred(work, volatile_id);
 	if (err)
 		goto out;
 
@@ -4909,6 +5548,7 @@ static int smb2_set_info_file(struct cifsd_work *work, struct cifsd_file *fp,
 			setattr_copy(inode, &attrs);
 			mark_inode_dirty(inode);
 		}
+		smb_break_dir_lease(PARENT_INODE(fp), fp);
 		break;
 	}
 	case FILE_ALLOCATION_INFORMATION:
@@ -4964,6 +5604,7 @@ static int smb2_set_info_file(struct cifsd_work *work, struct cifsd_file *fp,
 				i_size_write(inode, size);
 		}
 
+		smb_break_dir_lease(PARENT_INODE(fp), fp);
 		break;
 	}
 	case FILE_END_OF_FILE_INFORMATION:
@@ -5003,6 +5644,7 @@ static int smb2_set_info_file(struct cifsd_work *work, struct cifsd_file *fp,
 				goto out;
 			}
 		}
+		smb_break_dir_lease(PARENT_INODE(fp), fp);
 		break;
 	}
 	case FILE_RENAME_INFORMATION:
@@ -5144,15 +5786,15 @@ int smb2_set_info(struct cifsd_work *work)
 	struct smb2_set_info_rsp *rsp, *rsp_org;
 	struct cifsd_file *fp;
 	uint64_t id, pid;
+	unsigned int buf_len;
+	char *buf;
 	int rc = 0;
 
-	req = (struct smb2_set_info_req *)REQUEST_BUF(work);
+	req = work->req_view.hdr;
 	rsp = (struct smb2_set_info_rsp *)RESPONSE_BUF(work);
 	rsp_org = rsp;
 
 	if (work->next_smb2_rcv_hdr_off) {
-		req = (struct smb2_set_info_req *)((char *)req +
-				work->next_smb2_rcv_hdr_off);
 		rsp = (struct smb2_set_info_rsp *)((char *)rsp +
 				work->next_smb2_rsp_hdr_off);
 	}
@@ -5169,17 +5811,23 @@ int smb2_set_info(struct cifsd_work *work)
 		goto err_out;
 	}
 
+	buf = smb2_req_area(work, SMB2_SET_INFO_BUFFER, &buf_len);
+	if (!buf) {
+		rc = -EINVAL;
+		goto err_out;
+	}
+
 	switch (req->InfoType) {
 	case SMB2_O_INFO_FILE:
 		cifsd_debug("GOT SMB2_O_INFO_FILE\n");
 		rc = smb2_set_info_file(work, fp, req->FileInfoClass,
-					req->Buffer, work->tcon->share_conf);
+					buf, work->tcon->share_conf);
 		break;
 	case SMB2_O_INFO_SECURITY:
 		cifsd_debug("GOT SMB2_O_INFO_SECURITY\n");
 		rc = smb2_set_info_sec(fp,
-			le32_to_cpu(req->AdditionalInformation), req->Buffer,
-			le32_to_cpu(req->BufferLength));
+			le32_to_cpu(req->AdditionalInformation), buf,
+			buf_len);
 		break;
 	default:
 		rc = -EOPNOTSUPP;
@@ -5191,9 +5839,11 @@ int smb2_set_info(struct cifsd_work *work)
 	rsp->StructureSize = cpu_to_le16(2);
 	inc_rfc1001_len(rsp_org, 2);
 
+	cifsd_fd_put(fp);
 	return 0;
 
 err_out:
+	cifsd_fd_put(fp);
 	if (rc == -EACCES || rc == -EPERM)
 		rsp->hdr.Status = STATUS_ACCESS_DENIED;
 	else if (rc == -EINVAL)
@@ -5266,73 +5916,153 @@ static noinline int smb2_read_pipe(struct cifsd_work *work)
 	return 0;
 }
 
+/*
+ * Read data of shares with compression enabled may be sent compressed, see
+ * smb3_compress_resp().
+ */
+static bool smb2_read_compressible(struct cifsd_work *work,
+				   struct smb2_read_req *req)
+{
+	if (!(work->conn->compress_algos &
+	      (SMB3_COMPRESS_BIT(SMB3_COMPRESS_LZ77) |
+	       SMB3_COMPRESS_BIT(SMB3_COMPRESS_PATTERN))))
+		return false;
+
+	if (!test_share_config_flag(work->tcon->share_conf,
+				    CIFSD_SHARE_FLAG_COMPRESSION))
+		return false;
+
+	/* Compound responses are padded after the read data */
+	return !work->next_smb2_rcv_hdr_off && !req->hdr.NextCommand;
+}
+
 /**
- * smb2_read() - handler for smb2 read from file
+ * smb2_read_zerocopy() - check if read data can be sent from page cache
  * @work:	smb work containing read command buffer
+ * @req:	read request
+ * @fp:		file to read from
  *
- * Return:	0 on success, otherwise error
+ * Return:	true if the read response needs no linear data buffer
  */
-int smb2_read(struct cifsd_work *work)
+static bool smb2_read_zerocopy(struct cifsd_work *work,
+			       struct smb2_read_req *req,
+			       struct cifsd_file *fp)
 {
-	struct smb2_read_req *req;
-	struct smb2_read_rsp *rsp, *rsp_org;
-	struct cifsd_file *fp;
-	loff_t offset;
-	size_t length, mincount;
-	ssize_t nbytes = 0;
-	int err = 0;
+	/* Signing, encryption and compression run over a linear response */
+	if (work->encrypted || work->sess->sign ||
+	    req->hdr.Flags & SMB2_FLAGS_SIGNED || work->compress_rsp)
+		return false;
 
-	req = (struct smb2_read_req *)REQUEST_BUF(work);
-	rsp = (struct smb2_read_rsp *)RESPONSE_BUF(work);
+	/* Compound responses are padded after the read data */
+	if (work->next_smb2_rcv_hdr_off || req->hdr.NextCommand)
+		return false;
 
-	rsp_org = rsp;
+	return cifsd_vfs_zerocopy_read(fp);
+}
 
-	if (work->next_smb2_rcv_hdr_off) {
-		req = (struct smb2_read_req *)((char *)req +
-					work->next_smb2_rcv_hdr_off);
-		rsp = (struct smb2_read_rsp *)((char *)rsp +
-					work->next_smb2_rsp_hdr_off);
-	}
+/**
+ * smb2_channel_rdma() - check the channel of a read or write request
+ * @work:	smb work containing read or write command buffer
+ * @channel:	Channel field of the request
+ *
+ * RDMA_V1_INVALIDATE is served like RDMA_V1, the client invalidates its
+ * memory registration itself when no send carries the remote invalidate.
+ *
+ * Return:	1 for an RDMA channel, 0 for none, otherwise -EINVAL
+ */
+static int smb2_channel_rdma(struct cifsd_work *work, __le32 channel)
+{
+	if (channel == SMB2_CHANNEL_NONE)
+		return 0;
 
-	if (test_share_config_flag(work->tcon->share_conf,
-				   CIFSD_SHARE_FLAG_PIPE)) {
-		cifsd_debug("IPC pipe read request\n");
-		return smb2_read_pipe(work);
-	}
+	if (channel != SMB2_CHANNEL_RDMA_V1 &&
+	    channel != SMB2_CHANNEL_RDMA_V1_INVALIDATE)
+		return -EINVAL;
 
-	fp = cifsd_lookup_fd_slow(work,
-			le64_to_cpu(req->VolatileFileId),
-			le64_to_cpu(req->PersistentFileId));
-	if (!fp) {
-		rsp->hdr.Status = STATUS_FILE_CLOSED;
-		return -ENOENT;
-	}
+	/* only SMB Direct has one, and encrypted data can't go around it */
+	if (!work->conn->t_ops->rdma_read || work->encrypted)
+		return -EINVAL;
+	return 1;
+}
 
-	offset = le64_to_cpu(req->Offset);
-	length = le32_to_cpu(req->Length);
-	mincount = le32_to_cpu(req->MinimumCount);
+/**
+ * smb2_rdma_channel() - move read or write data over the RDMA channel
+ * @work:	smb work containing read or write command buffer
+ * @area:	SMB2_READ_CHANNEL or SMB2_WRITE_CHANNEL
+ * @buf:	data buffer
+ * @len:	data length
+ * @push:	RDMA write @buf to the client, instead of reading into it
+ *
+ * Return:	0 on success, otherwise error
+ */
+static int smb2_rdma_channel(struct cifsd_work *work, int area, void *buf,
+			     unsigned int len, bool push)
+{
+	struct cifsd_tcp_conn *conn = work->conn;
+	struct smb2_buffer_desc_v1 *desc;
+	unsigned int desc_len;
 
-	if (length > cifsd_default_io_size()) {
-		cifsd_debug("read size(%zu) exceeds max size(%u)\n",
-				length, cifsd_default_io_size());
-		cifsd_debug("limiting read size to max size(%u)\n",
-				cifsd_default_io_size());
-		length = cifsd_default_io_size();
-	}
+	if (!len)
+		return 0;
 
-	cifsd_debug("filename %s, offset %lld, len %zu\n", FP_FILENAME(fp),
-		offset, length);
+	/* checked to lie within the request when it was decoded */
+	desc = smb2_req_area(work, area, &desc_len);
+	if (!desc || desc_len % sizeof(*desc))
+		return -EINVAL;
 
-	work->aux_payload_buf = cifsd_alloc_response(length);
-	if (!work->aux_payload_buf) {
-		err = nbytes;
-		goto out;
+	if (push)
+		return conn->t_ops->rdma_write(conn, buf, len, desc,
+					       desc_len / sizeof(*desc));
+	return conn->t_ops->rdma_read(conn, buf, len, desc,
+				      desc_len / sizeof(*desc));
+}
+
+/**
+ * smb2_read_rsp() - build the response of a read
+ * @work:	smb work containing read command buffer
+ * @fp:		file read from, its reference is dropped
+ * @length:	requested read length
+ * @mincount:	minimum length of a successful read
+ * @nbytes:	number of bytes read into the aux payload, or error
+ * @rdma:	the data goes over the RDMA channel, not in the response
+ *
+ * Return:	0 on success, otherwise error
+ */
+static int smb2_read_rsp(struct cifsd_work *work, struct cifsd_file *fp,
+			 size_t length, size_t mincount, ssize_t nbytes,
+			 bool rdma)
+{
+	struct smb2_read_rsp *rsp, *rsp_org;
+	int err;
+
+	rsp = (struct smb2_read_rsp *)RESPONSE_BUF(work);
+	rsp_org = rsp;
+
+	if (work->next_smb2_rcv_hdr_off) {
+		rsp = (struct smb2_read_rsp *)((char *)rsp +
+					work->next_smb2_rsp_hdr_off);
 	}
 
-	nbytes = cifsd_vfs_read(work, fp, length, &offset);
 	if (nbytes < 0) {
 		err = nbytes;
-		goto out;
+		if (err == -EISDIR)
+			rsp->hdr.Status = STATUS_INVALID_DEVICE_REQUEST;
+		else if (err == -EAGAIN)
+			rsp->hdr.Status = STATUS_FILE_LOCK_CONFLICT;
+		else if (err == -ENOENT)
+			rsp->hdr.Status = STATUS_FILE_CLOSED;
+		else if (err == -EACCES)
+			rsp->hdr.Status = STATUS_ACCESS_DENIED;
+		else if (err == -ESHARE)
+			rsp->hdr.Status = STATUS_SHARING_VIOLATION;
+		else if (err == -EINVAL)
+			rsp->hdr.Status = STATUS_INVALID_PARAMETER;
+		else
+			rsp->hdr.Status = STATUS_INVALID_HANDLE;
+
+		smb2_set_err_rsp(work);
+		cifsd_fd_put(fp);
+		return err;
 	}
 
 	if ((nbytes == 0 && length != 0) || nbytes < mincount) {
@@ -5340,42 +6070,326 @@ int smb2_read(struct cifsd_work *work)
 		INIT_AUX_PAYLOAD(work);
 		rsp->hdr.Status = STATUS_END_OF_FILE;
 		smb2_set_err_rsp(work);
+		cifsd_fd_put(fp);
 		return 0;
 	}
 
-	cifsd_debug("nbytes %zu, offset %lld mincount %zu\n",
-						nbytes, offset, mincount);
+	cifsd_debug("nbytes %zu, mincount %zu\n", nbytes, mincount);
+
+	if (rdma) {
+		err = smb2_rdma_channel(work, SMB2_READ_CHANNEL,
+					AUX_PAYLOAD(work), nbytes, true);
+		cifsd_free_response(AUX_PAYLOAD(work));
+		INIT_AUX_PAYLOAD(work);
+		if (err) {
+			if (err == -EINVAL)
+				rsp->hdr.Status = STATUS_INVALID_PARAMETER;
+			else
+				rsp->hdr.Status = STATUS_UNEXPECTED_IO_ERROR;
+			smb2_set_err_rsp(work);
+			cifsd_fd_put(fp);
+			return err;
+		}
+	}
 
 	rsp->StructureSize = cpu_to_le16(17);
 	rsp->DataOffset = 80;
 	rsp->Reserved = 0;
-	rsp->DataLength = cpu_to_le32(nbytes);
-	rsp->DataRemaining = 0;
+	/* the data of an RDMA channel is already in the client buffers */
+	rsp->DataLength = cpu_to_le32(rdma ? 0 : nbytes);
+	rsp->DataRemaining = cpu_to_le32(rdma ? nbytes : 0);
 	rsp->Reserved2 = 0;
 	inc_rfc1001_len(rsp_org, 16);
 	work->resp_hdr_sz = get_rfc1002_length(rsp_org) + 4;
-	work->aux_payload_sz = nbytes;
-	inc_rfc1001_len(rsp_org, nbytes);
+	if (!rdma) {
+		work->aux_payload_sz = nbytes;
+		inc_rfc1001_len(rsp_org, nbytes);
+	}
+	cifsd_fd_put(fp);
 	return 0;
+}
 
-out:
-	if (err) {
-		if (err == -EISDIR)
-			rsp->hdr.Status = STATUS_INVALID_DEVICE_REQUEST;
-		else if (err == -EAGAIN)
+static int smb2_write_data(struct cifsd_work *work, struct cifsd_file *fp,
+			   char *data_buf, size_t length, loff_t *offset,
+			   bool writethrough, ssize_t *nbytes)
+{
+	if (HAS_REQUEST_PAGES(work))
+		return cifsd_vfs_write_pages(work, fp, work->request_bvec,
+					     work->request_nr_bvec, length,
+					     offset, writethrough, nbytes);
+	return cifsd_vfs_write(work, fp, data_buf, length, offset,
+			       writethrough, nbytes);
+}
+
+/**
+ * smb2_write_rsp() - build the response of a write
+ * @work:	smb work containing write command buffer
+ * @fp:		file written to, its reference is dropped
+ * @err:	result of the write
+ * @nbytes:	number of bytes written
+ *
+ * Return:	0 on success, otherwise error
+ */
+static int smb2_write_rsp(struct cifsd_work *work, struct cifsd_file *fp,
+			  int err, ssize_t nbytes)
+{
+	struct smb2_write_rsp *rsp, *rsp_org;
+
+	rsp = (struct smb2_write_rsp *)RESPONSE_BUF(work);
+	rsp_org = rsp;
+
+	if (work->next_smb2_rcv_hdr_off) {
+		rsp = (struct smb2_write_rsp *)((char *)rsp +
+				work->next_smb2_rsp_hdr_off);
+	}
+
+	cifsd_fd_put(fp);
+	if (err < 0) {
+		if (err == -EAGAIN)
 			rsp->hdr.Status = STATUS_FILE_LOCK_CONFLICT;
+		else if (err == -ENOSPC || err == -EFBIG)
+			rsp->hdr.Status = STATUS_DISK_FULL;
 		else if (err == -ENOENT)
 			rsp->hdr.Status = STATUS_FILE_CLOSED;
 		else if (err == -EACCES)
 			rsp->hdr.Status = STATUS_ACCESS_DENIED;
 		else if (err == -ESHARE)
 			rsp->hdr.Status = STATUS_SHARING_VIOLATION;
+		else if (err == -EINVAL)
+			rsp->hdr.Status = STATUS_INVALID_PARAMETER;
 		else
 			rsp->hdr.Status = STATUS_INVALID_HANDLE;
 
 		smb2_set_err_rsp(work);
+		return err;
 	}
-	return err;
+
+	rsp->StructureSize = cpu_to_le16(17);
+	rsp->DataOffset = 0;
+	rsp->Reserved = 0;
+	rsp->DataLength = cpu_to_le32(nbytes);
+	rsp->DataRemaining = 0;
+	rsp->Reserved2 = 0;
+	inc_rfc1001_len(rsp_org, 16);
+	return 0;
+}
+
+/*
+ * A READ or WRITE running on system_long_wq, see smb2_io_submit(). The
+ * request worker waits for it up to async_io_msecs, after that the I/O
+ * and smb2_io_start() each drop a reference and the last one completes
+ * the request.
+ */
+struct smb2_io_job {
+	struct work_struct	wk;
+	struct cifsd_work	*work;
+	struct cifsd_file	*fp;
+	struct completion	io_done;
+	atomic_t		refcount;
+	bool			write;
+	bool			writethrough;
+	/* data in the request buffer or request pages of the work */
+	char			*data_buf;
+	loff_t			offset;
+	size_t			length;
+	size_t			mincount;
+	ssize_t			nbytes;
+	int			err;
+};
+
+/*
+ * Like a COPYCHUNK, only a request processed on its own can go pending:
+ * a compound response is sent at once and the interim response wouldn't
+ * be encrypted.
+ */
+static bool smb2_io_async(struct cifsd_work *work, struct smb2_hdr *hdr)
+{
+	if (!READ_ONCE(async_io_msecs))
+		return false;
+	if (work->next_smb2_rcv_hdr_off || hdr->NextCommand)
+		return false;
+	return !work->encrypted;
+}
+
+static int smb2_io_rsp(struct smb2_io_job *job)
+{
+	if (job->write)
+		return smb2_write_rsp(job->work, job->fp, job->err,
+				      job->nbytes);
+	return smb2_read_rsp(job->work, job->fp, job->length, job->mincount,
+			     job->nbytes, false);
+}
+
+static void smb2_io_put(struct smb2_io_job *job)
+{
+	struct cifsd_work *work = job->work;
+	struct smb2_hdr *rsp_hdr = RESPONSE_BUF(work);
+
+	if (!atomic_dec_and_test(&job->refcount))
+		return;
+
+	/* the interim response left an error body behind the header */
+	rsp_hdr->smb2_buf_length =
+		cpu_to_be32(HEADER_SIZE_NO_BUF_LEN(work->conn));
+	rsp_hdr->Status = STATUS_SUCCESS;
+	smb2_io_rsp(job);
+	kfree(job);
+	/* handle_cifsd_work() sends the final response */
+	cifsd_requeue_work(work);
+}
+
+static void smb2_io_work(struct work_struct *wk)
+{
+	struct smb2_io_job *job = container_of(wk, struct smb2_io_job, wk);
+
+	if (job->write)
+		job->err = smb2_write_data(job->work, job->fp, job->data_buf,
+					   job->length, &job->offset,
+					   job->writethrough, &job->nbytes);
+	else
+		job->nbytes = cifsd_vfs_read(job->work, job->fp, job->length,
+					     &job->offset);
+
+	complete(&job->io_done);
+	smb2_io_put(job);
+}
+
+static void smb2_io_start(struct cifsd_work *work)
+{
+	smb2_io_put(work->async_data);
+}
+
+/**
+ * smb2_io_submit() - run a read or write, going pending if it's slow
+ * @job:	job of a request for which smb2_io_async() is true
+ *
+ * The I/O runs on system_long_wq while the request worker waits for it.
+ * If it takes longer than async_io_msecs, the client is sent
+ * STATUS_PENDING and the worker is released: the work is marked
+ * async_pending and its final response built once the I/O is done.
+ *
+ * Return:	0 if the request went pending or succeeded, otherwise error
+ */
+static int smb2_io_submit(struct smb2_io_job *job)
+{
+	struct cifsd_work *work = job->work;
+	unsigned long timeout = msecs_to_jiffies(READ_ONCE(async_io_msecs));
+	int ret;
+
+	INIT_WORK(&job->wk, smb2_io_work);
+	init_completion(&job->io_done);
+	atomic_set(&job->refcount, 2);
+	queue_work(system_long_wq, &job->wk);
+
+	if (!wait_for_completion_timeout(&job->io_done, timeout)) {
+		/* credits are granted by the interim response */
+		smb2_set_rsp_credits(work);
+		if (!setup_async_work(work, NULL, NULL)) {
+			smb2_send_interim_resp(work, STATUS_PENDING);
+			work->async_pending = true;
+			work->async_start = smb2_io_start;
+			work->async_data = job;
+			return 0;
+		}
+		wait_for_completion(&job->io_done);
+	}
+
+	/* done in time, the I/O still holds a reference */
+	flush_work(&job->wk);
+	ret = smb2_io_rsp(job);
+	kfree(job);
+	return ret;
+}
+
+/**
+ * smb2_read() - handler for smb2 read from file
+ * @work:	smb work containing read command buffer
+ *
+ * Return:	0 on success, otherwise error
+ */
+int smb2_read(struct cifsd_work *work)
+{
+	struct smb2_read_req *req;
+	struct smb2_read_rsp *rsp;
+	struct smb2_io_job *job = NULL;
+	struct cifsd_file *fp;
+	loff_t offset;
+	size_t length, mincount;
+	ssize_t nbytes = 0;
+	int err = 0, rdma = 0;
+
+	req = work->req_view.hdr;
+	rsp = (struct smb2_read_rsp *)RESPONSE_BUF(work);
+
+	if (work->next_smb2_rcv_hdr_off) {
+		rsp = (struct smb2_read_rsp *)((char *)rsp +
+					work->next_smb2_rsp_hdr_off);
+	}
+
+	if (test_share_config_flag(work->tcon->share_conf,
+				   CIFSD_SHARE_FLAG_PIPE)) {
+		cifsd_debug("IPC pipe read request\n");
+		return smb2_read_pipe(work);
+	}
+
+	fp = cifsd_lookup_fd_slow(work,
+			le64_to_cpu(req->VolatileFileId),
+			le64_to_cpu(req->PersistentFileId));
+	if (!fp) {
+		rsp->hdr.Status = STATUS_FILE_CLOSED;
+		return -ENOENT;
+	}
+
+	offset = le64_to_cpu(req->Offset);
+	length = le32_to_cpu(req->Length);
+	mincount = le32_to_cpu(req->MinimumCount);
+
+	if (length > smb2_max_read_write_size(work->conn)) {
+		cifsd_debug("read size(%zu) exceeds max size(%u)\n",
+				length, smb2_max_read_write_size(work->conn));
+		err = -EINVAL;
+		goto out;
+	}
+
+	rdma = smb2_channel_rdma(work, req->Channel);
+	if (rdma < 0) {
+		err = rdma;
+		goto out;
+	}
+
+	cifsd_debug("filename %s, offset %lld, len %zu\n", FP_FILENAME(fp),
+		offset, length);
+
+	cifsd_vfs_readahead(fp, offset, length);
+
+	/* RDMA channel data is read into a buffer and pushed from there */
+	work->compress_rsp = !rdma && smb2_read_compressible(work, req);
+	if (!rdma && smb2_read_zerocopy(work, req, fp)) {
+		nbytes = cifsd_vfs_splice_read(work, fp, length, &offset);
+	} else {
+		work->aux_payload_buf = cifsd_alloc_request(length);
+		if (!work->aux_payload_buf) {
+			err = -ENOMEM;
+			goto out;
+		}
+
+		if (!rdma && smb2_io_async(work, &req->hdr))
+			job = kzalloc(sizeof(struct smb2_io_job), GFP_KERNEL);
+		if (job) {
+			job->work = work;
+			job->fp = fp;
+			job->offset = offset;
+			job->length = length;
+			job->mincount = mincount;
+			return smb2_io_submit(job);
+		}
+
+		nbytes = cifsd_vfs_read(work, fp, length, &offset);
+	}
+	return smb2_read_rsp(work, fp, length, mincount, nbytes, rdma);
+
+out:
+	return smb2_read_rsp(work, fp, length, mincount, err, false);
 }
 
 /**
@@ -5391,33 +6405,27 @@ static noinline int smb2_write_pipe(struct cifsd_work *work)
 	struct cifsd_rpc_command *rpc_resp;
 	uint64_t id = 0;
 	int err = 0, ret = 0;
+	unsigned int data_len;
 	char *data_buf;
 	size_t length;
 
-	req = (struct smb2_write_req *)REQUEST_BUF(work);
+	req = work->req_view.hdr;
 	rsp = (struct smb2_write_rsp *)RESPONSE_BUF(work);
 
 	length = le32_to_cpu(req->Length);
 	id = le64_to_cpu(req->VolatileFileId);
 
-	if (le16_to_cpu(req->DataOffset) ==
-			(offsetof(struct smb2_write_req, Buffer) - 4)) {
-		data_buf = (char *)&req->Buffer[0];
-	} else {
-		if ((le16_to_cpu(req->DataOffset) > get_rfc1002_length(req)) ||
-				(le16_to_cpu(req->DataOffset) +
-				 length > get_rfc1002_length(req))) {
-			cifsd_err("invalid write data offset %u, smb_len %u\n",
-					le16_to_cpu(req->DataOffset),
-					get_rfc1002_length(req));
-			err = -EINVAL;
-			goto out;
-		}
-
-		data_buf = (char *)(((char *)&req->hdr.ProtocolId) +
-				le16_to_cpu(req->DataOffset));
+	/* pipe data is expected to be small, not received into pages */
+	if (HAS_REQUEST_PAGES(work)) {
+		cifsd_err("pipe write of %zu bytes is too large\n", length);
+		err = -EINVAL;
+		goto out;
 	}
 
+	/* checked to lie within the request when it was decoded */
+	data_buf = smb2_req_area(work, SMB2_WRITE_DATA, &data_len) ?:
+		(char *)req->Buffer;
+
 	rpc_resp = cifsd_rpc_write(work->sess, id, data_buf, length);
 	if (rpc_resp) {
 		if (rpc_resp->flags == CIFSD_RPC_ENOTIMPLEMENTED) {
@@ -5452,6 +6460,35 @@ out:
 	return err;
 }
 
+/**
+ * smb2_bulk_write_len() - check if write data can be received into pages
+ * @buf:	first SMB2_WRITE_HDR_SIZE bytes of the PDU
+ *
+ * Only a plain, unsigned and non-compound write whose data directly
+ * follows the fixed request part qualifies, everything else has to be
+ * received into one linear request buffer.
+ *
+ * Return:	write data length, or 0 if the PDU must be received linearly
+ */
+unsigned int smb2_bulk_write_len(char *buf)
+{
+	struct smb2_write_req *req = (struct smb2_write_req *)buf;
+	unsigned int len = get_rfc1002_length(buf) + 4;
+
+	if (req->hdr.ProtocolId != SMB2_PROTO_NUMBER ||
+	    req->hdr.Command != SMB2_WRITE ||
+	    req->hdr.NextCommand ||
+	    req->hdr.Flags & SMB2_FLAGS_SIGNED)
+		return 0;
+
+	if (le16_to_cpu(req->StructureSize) != 49 || req->Channel ||
+	    le16_to_cpu(req->DataOffset) != SMB2_WRITE_HDR_SIZE - 4 ||
+	    le32_to_cpu(req->Length) != len - SMB2_WRITE_HDR_SIZE)
+		return 0;
+
+	return le32_to_cpu(req->Length);
+}
+
 /**
  * smb2_write() - handler for smb2 write from file
  * @work:	smb work containing write command buffer
@@ -5461,22 +6498,21 @@ out:
 int smb2_write(struct cifsd_work *work)
 {
 	struct smb2_write_req *req;
-	struct smb2_write_rsp *rsp, *rsp_org;
+	struct smb2_write_rsp *rsp;
+	struct smb2_io_job *job = NULL;
 	struct cifsd_file *fp;
 	loff_t offset;
 	size_t length;
-	ssize_t nbytes;
-	char *data_buf;
+	ssize_t nbytes = 0;
+	unsigned int data_len;
+	char *data_buf, *rdma_buf = NULL;
 	bool writethrough = false;
-	int err = 0;
+	int err = 0, rdma;
 
-	req = (struct smb2_write_req *)REQUEST_BUF(work);
+	req = work->req_view.hdr;
 	rsp = (struct smb2_write_rsp *)RESPONSE_BUF(work);
-	rsp_org = rsp;
 
 	if (work->next_smb2_rcv_hdr_off) {
-		req = (struct smb2_write_req *)((char *)req +
-				work->next_smb2_rcv_hdr_off);
 		rsp = (struct smb2_write_rsp *)((char *)rsp +
 				work->next_smb2_rsp_hdr_off);
 	}
@@ -5495,25 +6531,42 @@ int smb2_write(struct cifsd_work *work)
 		return -ENOENT;
 	}
 
+	rdma = smb2_channel_rdma(work, req->Channel);
+	if (rdma < 0 || (rdma && req->Length)) {
+		err = -EINVAL;
+		goto out;
+	}
+
 	offset = le64_to_cpu(req->Offset);
-	length = le32_to_cpu(req->Length);
+	/* the client doesn't send the data of an RDMA channel, we read it */
+	if (rdma)
+		length = le32_to_cpu(req->RemainingBytes);
+	else
+		length = le32_to_cpu(req->Length);
 
-	if (le16_to_cpu(req->DataOffset) ==
-			(offsetof(struct smb2_write_req, Buffer) - 4)) {
-		data_buf = (char *)&req->Buffer[0];
-	} else {
-		if ((le16_to_cpu(req->DataOffset) > get_rfc1002_length(req)) ||
-				(le16_to_cpu(req->DataOffset) +
-				 length > get_rfc1002_length(req))) {
-			cifsd_err("invalid write data offset %u, smb_len %u\n",
-					le16_to_cpu(req->DataOffset),
-					get_rfc1002_length(req));
-			err = -EINVAL;
+	if (length > smb2_max_read_write_size(work->conn)) {
+		cifsd_debug("write size(%zu) exceeds max size(%u)\n",
+				length, smb2_max_read_write_size(work->conn));
+		err = -EINVAL;
+		goto out;
+	}
+
+	if (rdma) {
+		rdma_buf = cifsd_alloc_request(length);
+		if (!rdma_buf) {
+			err = -ENOMEM;
 			goto out;
 		}
 
-		data_buf = (char *)(((char *)&req->hdr.ProtocolId) +
-				le16_to_cpu(req->DataOffset));
+		err = smb2_rdma_channel(work, SMB2_WRITE_CHANNEL, rdma_buf,
+					length, false);
+		if (err)
+			goto out;
+		data_buf = rdma_buf;
+	} else {
+		/* checked to lie within the request when it was decoded */
+		data_buf = smb2_req_area(work, SMB2_WRITE_DATA, &data_len) ?:
+			(char *)req->Buffer;
 	}
 
 	cifsd_debug("flags %u\n", le32_to_cpu(req->Flags));
@@ -5522,36 +6575,26 @@ int smb2_write(struct cifsd_work *work)
 
 	cifsd_debug("filename %s, offset %lld, len %zu\n", FP_FILENAME(fp),
 		offset, length);
-	err = cifsd_vfs_write(work, fp, data_buf, length, &offset,
-			      writethrough, &nbytes);
-	if (err < 0)
-		goto out;
-
-	rsp->StructureSize = cpu_to_le16(17);
-	rsp->DataOffset = 0;
-	rsp->Reserved = 0;
-	rsp->DataLength = cpu_to_le32(nbytes);
-	rsp->DataRemaining = 0;
-	rsp->Reserved2 = 0;
-	inc_rfc1001_len(rsp_org, 16);
-	return 0;
 
+	/* the job would outlive rdma_buf */
+	if (!rdma && smb2_io_async(work, &req->hdr))
+		job = kzalloc(sizeof(struct smb2_io_job), GFP_KERNEL);
+	if (job) {
+		job->work = work;
+		job->fp = fp;
+		job->write = true;
+		job->writethrough = writethrough;
+		job->data_buf = data_buf;
+		job->offset = offset;
+		job->length = length;
+		return smb2_io_submit(job);
+	}
+
+	err = smb2_write_data(work, fp, data_buf, length, &offset,
+			      writethrough, &nbytes);
 out:
-	if (err == -EAGAIN)
-		rsp->hdr.Status = STATUS_FILE_LOCK_CONFLICT;
-	else if (err == -ENOSPC || err == -EFBIG)
-		rsp->hdr.Status = STATUS_DISK_FULL;
-	else if (err == -ENOENT)
-		rsp->hdr.Status = STATUS_FILE_CLOSED;
-	else if (err == -EACCES)
-		rsp->hdr.Status = STATUS_ACCESS_DENIED;
-	else if (err == -ESHARE)
-		rsp->hdr.Status = STATUS_SHARING_VIOLATION;
-	else
-		rsp->hdr.Status = STATUS_INVALID_HANDLE;
-
-	smb2_set_err_rsp(work);
-	return err;
+	cifsd_free_request(rdma_buf);
+	return smb2_write_rsp(work, fp, err, nbytes);
 }
 
 /**
@@ -5690,6 +6733,8 @@ static struct cifsd_lock *smb2_lock_init(struct file_lock *flock,
 		lock->zero_len = 1;
 	INIT_LIST_HEAD(&lock->llist);
 	INIT_LIST_HEAD(&lock->glist);
+	INIT_LIST_HEAD(&lock->clist);
+	RB_CLEAR_NODE(&lock->rb);
 	list_add_tail(&lock->llist, lock_list);
 
 	return lock;
@@ -5727,8 +6772,9 @@ int smb2_lock(struct cifsd_work *work)
 	unsigned int cmd = 0;
 	int err = 0, i;
 	uint64_t lock_length;
-	struct cifsd_lock *smb_lock = NULL, *cmp_lock, *tmp;
+	struct cifsd_lock *smb_lock = NULL, *cmp_lock, *tmp, *unlocked;
 	int nolock = 0;
+	bool conflict;
 	LIST_HEAD(lock_list);
 	LIST_HEAD(rollback_list);
 	int prior_lock = 0;
@@ -5868,7 +6914,10 @@ int smb2_lock(struct cifsd_work *work)
 			goto no_check_gl;
 
 		nolock = 1;
+		conflict = false;
+		unlocked = NULL;
 		/* check locks in global list */
+		spin_lock(&global_lock_list_lock);
 		list_for_each_entry(cmp_lock, &global_lock_list, glist) {
 			if (file_inode(cmp_lock->fl->fl_file) !=
 				file_inode(smb_lock->fl->fl_file))
@@ -5881,9 +6930,8 @@ int smb2_lock(struct cifsd_work *work)
 					cmp_lock->end == smb_lock->end &&
 					!lock_defer_pending(cmp_lock->fl)) {
 					nolock = 0;
-					locks_free_lock(cmp_lock->fl);
 					list_del(&cmp_lock->glist);
-					kfree(cmp_lock);
+					unlocked = cmp_lock;
 					break;
 				}
 				continue;
@@ -5902,16 +6950,16 @@ int smb2_lock(struct cifsd_work *work)
 				cmp_lock->start > smb_lock->start &&
 				cmp_lock->start < smb_lock->end) {
 				cifsd_err("previous lock conflict with zero byte lock range\n");
-				rsp->hdr.Status = STATUS_LOCK_NOT_GRANTED;
-					goto out;
+				conflict = true;
+				break;
 			}
 
 			if (smb_lock->zero_len && !cmp_lock->zero_len &&
 				smb_lock->start > cmp_lock->start &&
 				smb_lock->start < cmp_lock->end) {
 				cifsd_err("current lock conflict with zero byte lock range\n");
-				rsp->hdr.Status = STATUS_LOCK_NOT_GRANTED;
-					goto out;
+				conflict = true;
+				break;
 			}
 
 			if (((cmp_lock->start <= smb_lock->start &&
@@ -5920,11 +6968,22 @@ int smb2_lock(struct cifsd_work *work)
 				cmp_lock->end >= smb_lock->end)) &&
 				!cmp_lock->zero_len && !smb_lock->zero_len) {
 				cifsd_err("Not allow lock operation on exclusive lock range\n");
-				rsp->hdr.Status =
-					STATUS_LOCK_NOT_GRANTED;
-				goto out;
+				conflict = true;
+				break;
 			}
 		}
+		spin_unlock(&global_lock_list_lock);
+
+		if (unlocked) {
+			cifsd_brl_release(fp, unlocked);
+			locks_free_lock(unlocked->fl);
+			kfree(unlocked);
+		}
+
+		if (conflict) {
+			rsp->hdr.Status = STATUS_LOCK_NOT_GRANTED;
+			goto out;
+		}
 
 		if (smb_lock->fl->fl_type == F_UNLCK && nolock) {
 			cifsd_err("Try to unlock nolocked range\n");
@@ -5958,8 +7017,10 @@ skip:
 
 				cifsd_debug("would have to wait for getting"
 						" lock\n");
+				spin_lock(&global_lock_list_lock);
 				list_add_tail(&smb_lock->glist,
 					&global_lock_list);
+				spin_unlock(&global_lock_list_lock);
 				list_add(&smb_lock->llist, &rollback_list);
 
 				argv = kmalloc(sizeof(void *), GFP_KERNEL);
@@ -5987,7 +7048,9 @@ skip:
 				if (work->state == WORK_STATE_CANCELLED ||
 					work->state == WORK_STATE_CLOSED) {
 					list_del(&smb_lock->llist);
+					spin_lock(&global_lock_list_lock);
 					list_del(&smb_lock->glist);
+					spin_unlock(&global_lock_list_lock);
 					locks_free_lock(flock);
 
 					if (work->state ==
@@ -6012,15 +7075,20 @@ skip:
 				}
 
 				list_del(&smb_lock->llist);
+				spin_lock(&global_lock_list_lock);
 				list_del(&smb_lock->glist);
+				spin_unlock(&global_lock_list_lock);
 				spin_lock(&fp->f_lock);
 				list_del(&work->fp_entry);
 				spin_unlock(&fp->f_lock);
 				goto retry;
 			} else if (!err) {
+				spin_lock(&global_lock_list_lock);
 				list_add_tail(&smb_lock->glist,
 					&global_lock_list);
+				spin_unlock(&global_lock_list_lock);
 				list_add(&smb_lock->llist, &rollback_list);
+				cifsd_brl_grant(fp, smb_lock);
 				cifsd_debug("successful in taking lock\n");
 			} else {
 				rsp->hdr.Status = STATUS_LOCK_NOT_GRANTED;
@@ -6038,6 +7106,7 @@ skip:
 	rsp->Reserved = 0;
 	inc_rfc1001_len(rsp, 4);
 
+	cifsd_fd_put(fp);
 	return err;
 
 out:
@@ -6059,7 +7128,10 @@ out:
 		if (err)
 			cifsd_err("rollback unlock fail : %d\n", err);
 		list_del(&smb_lock->llist);
+		spin_lock(&global_lock_list_lock);
 		list_del(&smb_lock->glist);
+		spin_unlock(&global_lock_list_lock);
+		cifsd_brl_release(fp, smb_lock);
 		locks_free_lock(smb_lock->fl);
 		locks_free_lock(rlock);
 		kfree(smb_lock);
@@ -6067,9 +7139,241 @@ out:
 out2:
 	cifsd_debug("failed in taking lock(flags : %x)\n", flags);
 	smb2_set_err_rsp(work);
+	cifsd_fd_put(fp);
+	return 0;
+}
+
+static void smb2_ioctl_set_rsp(struct smb2_ioctl_rsp *rsp, void *rsp_org,
+			       int cnt_code, int nbytes)
+{
+	rsp->CntCode = cpu_to_le32(cnt_code);
+	rsp->InputCount = cpu_to_le32(0);
+	rsp->InputOffset = cpu_to_le32(112);
+	rsp->OutputOffset = cpu_to_le32(112);
+	rsp->OutputCount = cpu_to_le32(nbytes);
+	rsp->StructureSize = cpu_to_le16(49);
+	rsp->Reserved = cpu_to_le16(0);
+	rsp->Flags = cpu_to_le32(0);
+	rsp->Reserved2 = cpu_to_le32(0);
+	inc_rfc1001_len(rsp_org, 48 + nbytes);
+}
+
+/**
+ * smb2_copychunk() - copy the chunks of a COPYCHUNK request
+ * @work:	smb work containing ioctl command buffer
+ * @rsp:	ioctl response the result is set in
+ * @src_fp:	source file, its reference is dropped
+ * @dst_fp:	destination file, its reference is dropped
+ * @chunks:	chunks to copy
+ * @chunk_count: number of @chunks
+ *
+ * Return:	-EACCES if the response is an error response, otherwise 0
+ */
+static int smb2_copychunk(struct cifsd_work *work, struct smb2_ioctl_rsp *rsp,
+			  struct cifsd_file *src_fp, struct cifsd_file *dst_fp,
+			  struct srv_copychunk *chunks,
+			  unsigned int chunk_count)
+{
+	struct copychunk_ioctl_rsp *ci_rsp;
+	unsigned int chunk_count_written, chunk_size_written;
+	loff_t total_size_written;
+	int ret;
+
+	ci_rsp = (struct copychunk_ioctl_rsp *)&rsp->Buffer[0];
+	ret = cifsd_vfs_copy_file_ranges(work, src_fp, dst_fp,
+			chunks, chunk_count,
+			&chunk_count_written, &chunk_size_written,
+			&total_size_written);
+	cifsd_fd_put(src_fp);
+	cifsd_fd_put(dst_fp);
+	if (ret < 0) {
+		if (ret == -EACCES) {
+			rsp->hdr.Status = STATUS_ACCESS_DENIED;
+			return ret;
+		}
+		if (ret == -EAGAIN)
+			rsp->hdr.Status = STATUS_FILE_LOCK_CONFLICT;
+		else if (ret == -EBADF)
+			rsp->hdr.Status = STATUS_INVALID_HANDLE;
+		else if (ret == -EFBIG || ret == -ENOSPC)
+			rsp->hdr.Status = STATUS_DISK_FULL;
+		else if (ret == -EINVAL)
+			rsp->hdr.Status = STATUS_INVALID_PARAMETER;
+		else if (ret == -EISDIR)
+			rsp->hdr.Status = STATUS_FILE_IS_A_DIRECTORY;
+		else if (ret == -E2BIG)
+			rsp->hdr.Status = STATUS_INVALID_VIEW_SIZE;
+		else if (ret == -ECANCELED)
+			rsp->hdr.Status = STATUS_CANCELLED;
+		else
+			rsp->hdr.Status = STATUS_UNEXPECTED_IO_ERROR;
+	}
+
+	ci_rsp->ChunksWritten = cpu_to_le32(chunk_count_written);
+	ci_rsp->ChunkBytesWritten = cpu_to_le32(chunk_size_written);
+	ci_rsp->TotalBytesWritten = cpu_to_le32(total_size_written);
 	return 0;
 }
 
+struct smb2_copychunk_job {
+	struct work_struct	wk;
+	struct cifsd_work	*work;
+	struct cifsd_file	*src_fp;
+	struct cifsd_file	*dst_fp;
+	/* chunks in the request buffer of the work */
+	struct srv_copychunk	*chunks;
+	unsigned int		chunk_count;
+	int			cnt_code;
+};
+
+/*
+ * Only a request processed on its own can go asynchronous: a compound
+ * response is sent at once and the interim response wouldn't be
+ * encrypted.
+ */
+static bool smb2_copychunk_async(struct cifsd_work *work,
+				 struct smb2_ioctl_req *req, loff_t total)
+{
+	unsigned int async_kb = READ_ONCE(copychunk_async_kb);
+
+	if (!async_kb || total <= (loff_t)async_kb << 10)
+		return false;
+	if (work->next_smb2_rcv_hdr_off || req->hdr.NextCommand)
+		return false;
+	return !work->encrypted;
+}
+
+static void smb2_copychunk_work(struct work_struct *wk)
+{
+	struct smb2_copychunk_job *job =
+		container_of(wk, struct smb2_copychunk_job, wk);
+	struct cifsd_work *work = job->work;
+	struct smb2_ioctl_rsp *rsp = RESPONSE_BUF(work);
+
+	/* the interim response left an error body behind the header */
+	rsp->hdr.smb2_buf_length =
+		cpu_to_be32(HEADER_SIZE_NO_BUF_LEN(work->conn));
+	rsp->hdr.Status = STATUS_SUCCESS;
+	rsp->VolatileFileId = cpu_to_le64(job->dst_fp->volatile_id);
+	rsp->PersistentFileId = cpu_to_le64(job->dst_fp->persistent_id);
+
+	if (smb2_copychunk(work, rsp, job->src_fp, job->dst_fp,
+			   job->chunks, job->chunk_count) == -EACCES)
+		smb2_set_err_rsp(work);
+	else
+		smb2_ioctl_set_rsp(rsp, rsp, job->cnt_code,
+				   sizeof(struct copychunk_ioctl_rsp));
+
+	kfree(job);
+	/* handle_cifsd_work() sends the final response */
+	cifsd_requeue_work(work);
+}
+
+/* work->async_start of a COPYCHUNK, the worker is done with the work */
+static void smb2_copychunk_start(struct cifsd_work *work)
+{
+	struct smb2_copychunk_job *job = work->async_data;
+
+	queue_work(system_long_wq, &job->wk);
+}
+
+/**
+ * smb2_copychunk_queue() - copy the chunks of a COPYCHUNK asynchronously
+ * @work:	smb work containing ioctl command buffer
+ * @src_fp:	source file, the job takes over its reference
+ * @dst_fp:	destination file, the job takes over its reference
+ * @chunks:	chunks to copy
+ * @chunk_count: number of @chunks
+ *
+ * The client is sent STATUS_PENDING and the copy runs on system_long_wq,
+ * so that a large copy doesn't hold a request worker. The work is marked
+ * async_pending and its final response sent once the copy is done.
+ *
+ * The job is not queued here: the worker still uses the work until
+ * processing returns, so __process_cifsd_work() queues it through
+ * smb2_copychunk_start() only after that.
+ *
+ * Return:	0 if the copy was queued, otherwise error
+ */
+static int smb2_copychunk_queue(struct cifsd_work *work,
+				struct cifsd_file *src_fp,
+				struct cifsd_file *dst_fp,
+				struct srv_copychunk *chunks,
+				unsigned int chunk_count)
+{
+	struct smb2_ioctl_req *req = REQUEST_BUF(work);
+	struct smb2_copychunk_job *job;
+
+	job = kmalloc(sizeof(struct smb2_copychunk_job), GFP_KERNEL);
+	if (!job)
+		return -ENOMEM;
+
+	/* credits are granted by the interim response */
+	smb2_set_rsp_credits(work);
+	if (setup_async_work(work, NULL, NULL)) {
+		kfree(job);
+		return -ENOMEM;
+	}
+	smb2_send_interim_resp(work, STATUS_PENDING);
+
+	INIT_WORK(&job->wk, smb2_copychunk_work);
+	job->work = work;
+	job->src_fp = src_fp;
+	job->dst_fp = dst_fp;
+	job->chunks = chunks;
+	job->chunk_count = chunk_count;
+	job->cnt_code = le32_to_cpu(req->CntCode);
+	work->async_pending = true;
+	work->async_start = smb2_copychunk_start;
+	work->async_data = job;
+	return 0;
+}
+
+/**
+ * smb2_netdev_caps() - fill the capabilities of an advertised interface
+ * @netdev:	network device, with the rtnl lock held
+ * @nii_rsp:	interface entry of FSCTL_QUERY_NETWORK_INTERFACE_INFO
+ *
+ * Clients open a channel per receive queue of an RSS capable interface,
+ * prefer an RDMA capable one for SMB Direct and weight interfaces by
+ * their link speed.
+ */
+static void smb2_netdev_caps(struct net_device *netdev,
+			     struct network_interface_info_ioctl_rsp *nii_rsp)
+{
+	u32 speed = SPEED_UNKNOWN;
+
+	nii_rsp->Capability = 0;
+	if (netdev->real_num_rx_queues > 1)
+		nii_rsp->Capability |= cpu_to_le32(RSS_CAPABLE);
+	if (cifsd_rdma_capable_netdev(netdev))
+		nii_rsp->Capability |= cpu_to_le32(RDMA_CAPABLE);
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 6, 0)
+	{
+		struct ethtool_link_ksettings cmd;
+
+		if (!__ethtool_get_link_ksettings(netdev, &cmd))
+			speed = cmd.base.speed;
+	}
+#else
+	{
+		struct ethtool_cmd cmd;
+
+		if (!__ethtool_get_settings(netdev, &cmd))
+			speed = ethtool_cmd_speed(&cmd);
+	}
+#endif
+	if (speed == SPEED_UNKNOWN || !speed) {
+		cifsd_debug("%s speed is unknown, defaulting to 1000\n",
+			    netdev->name);
+		speed = SPEED_1000;
+	}
+
+	/* in bits per second */
+	nii_rsp->LinkSpeed = cpu_to_le64((u64)speed * 1000000);
+}
+
 /**
  * smb2_ioctl() - handler for smb2 ioctl command
  * @work:	smb work containing ioctl command buffer
@@ -6082,18 +7386,17 @@ int smb2_ioctl(struct cifsd_work *work)
 	struct smb2_ioctl_rsp *rsp, *rsp_org;
 	int cnt_code, nbytes = 0;
 	int out_buf_len;
+	unsigned int in_buf_len;
 	char *data_buf;
 	uint64_t id = CIFSD_NO_FID;
 	struct cifsd_tcp_conn *conn = work->conn;
 	struct cifsd_rpc_command *rpc_resp;
 
-	req = (struct smb2_ioctl_req *)REQUEST_BUF(work);
+	req = work->req_view.hdr;
 	rsp = (struct smb2_ioctl_rsp *)RESPONSE_BUF(work);
 	rsp_org = rsp;
 
 	if (work->next_smb2_rcv_hdr_off) {
-		req = (struct smb2_ioctl_req *)((char *)req +
-				work->next_smb2_rcv_hdr_off);
 		rsp = (struct smb2_ioctl_rsp *)((char *)rsp +
 				work->next_smb2_rsp_hdr_off);
 		if (!HAS_FILE_ID(le64_to_cpu(req->VolatileFileId))) {
@@ -6114,7 +7417,9 @@ int smb2_ioctl(struct cifsd_work *work)
 	cnt_code = le32_to_cpu(req->CntCode);
 	out_buf_len = le32_to_cpu(req->MaxOutputResponse);
 	out_buf_len = min(NETLINK_CIFSD_MAX_PAYLOAD, out_buf_len);
-	data_buf = (char *)&req->Buffer[0];
+	/* checked to lie within the request when it was decoded */
+	data_buf = smb2_req_area(work, SMB2_IOCTL_INPUT, &in_buf_len) ?:
+		(char *)req->Buffer;
 
 	switch (cnt_code) {
 	case FSCTL_DFS_GET_REFERRALS:
@@ -6188,7 +7493,7 @@ int smb2_ioctl(struct cifsd_work *work)
 		struct validate_negotiate_info_rsp *neg_rsp;
 		int ret;
 
-		neg_req = (struct validate_negotiate_info_req *)&req->Buffer[0];
+		neg_req = (struct validate_negotiate_info_req *)data_buf;
 		ret = cifsd_lookup_dialect_by_id(neg_req->Dialects,
 					le16_to_cpu(neg_req->DialectCount));
 		if (ret == BAD_PROT_ID || ret != conn->dialect)
@@ -6218,9 +7523,10 @@ int smb2_ioctl(struct cifsd_work *work)
 	case FSCTL_QUERY_NETWORK_INTERFACE_INFO:
 	{
 		struct network_interface_info_ioctl_rsp *nii_rsp = NULL;
+		struct network_interface_info_ioctl_rsp *entry;
 		struct net_device *netdev;
 		struct sockaddr_storage_rsp *sockaddr_storage;
-		unsigned int speed, flags;
+		unsigned int flags;
 
 		rtnl_lock();
 		for_each_netdev(&init_net, netdev) {
@@ -6236,45 +7542,20 @@ int smb2_ioctl(struct cifsd_work *work)
 			if (!(flags & IFF_RUNNING))
 				continue;
 
-			nii_rsp = (struct network_interface_info_ioctl_rsp *)
-					&rsp->Buffer[nbytes];
-			nii_rsp->IfIndex = cpu_to_le32(netdev->ifindex);
-
-			/* TODO: specify the RDMA capabilities */
-			if (netdev->num_tx_queues > 1)
-				nii_rsp->Capability = cpu_to_le32(RSS_CAPABLE);
-			else
-				nii_rsp->Capability = 0;
-
-			nii_rsp->Next = cpu_to_le32(152);
-			nii_rsp->Reserved = 0;
-
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 6, 0)
-			if (netdev->ethtool_ops->get_link_ksettings) {
-				struct ethtool_link_ksettings cmd;
-
-				netdev->ethtool_ops->get_link_ksettings(netdev,
-					&cmd);
-				speed = cmd.base.speed;
-			}
-#else
-			if (netdev->ethtool_ops->get_settings) {
-				struct ethtool_cmd cmd;
-
-				netdev->ethtool_ops->get_settings(netdev, &cmd);
-				speed = cmd.speed;
-			}
-#endif
-			else {
-				cifsd_err("%s speed is unknown, defaulting to 100\n",
-					netdev->name);
-				speed = 1000;
+			if (nbytes + sizeof(*nii_rsp) > out_buf_len) {
+				rsp->hdr.Status = STATUS_BUFFER_OVERFLOW;
+				break;
 			}
 
-			nii_rsp->LinkSpeed = cpu_to_le64(speed * 1000000);
+			entry = (struct network_interface_info_ioctl_rsp *)
+					&rsp->Buffer[nbytes];
+			entry->IfIndex = cpu_to_le32(netdev->ifindex);
+			entry->Next = cpu_to_le32(sizeof(*entry));
+			entry->Reserved = 0;
+			smb2_netdev_caps(netdev, entry);
 
 			sockaddr_storage = (struct sockaddr_storage_rsp *)
-						nii_rsp->SockAddr_Storage;
+						entry->SockAddr_Storage;
 
 			memset(sockaddr_storage, 0, 128);
 
@@ -6320,6 +7601,7 @@ int smb2_ioctl(struct cifsd_work *work)
 				sockaddr_storage->addr6.ScopeId = 0;
 			}
 
+			nii_rsp = entry;
 			nbytes +=
 				sizeof(struct network_interface_info_ioctl_rsp);
 		}
@@ -6356,6 +7638,7 @@ int smb2_ioctl(struct cifsd_work *work)
 			rsp->hdr.Status = STATUS_FILE_CLOSED;
 			goto out;
 		}
+		cifsd_fd_put(fp);
 
 		nbytes = sizeof(struct resume_key_ioctl_rsp);
 		key_rsp = (struct resume_key_ioctl_rsp *)&rsp->Buffer[0];
@@ -6374,12 +7657,10 @@ int smb2_ioctl(struct cifsd_work *work)
 		struct copychunk_ioctl_rsp *ci_rsp;
 		struct cifsd_file *src_fp, *dst_fp;
 		struct srv_copychunk *chunks;
-		unsigned int i, chunk_count, chunk_count_written;
-		unsigned int chunk_size_written;
+		unsigned int i, chunk_count;
 		loff_t total_size_written;
-		int ret;
 
-		ci_req = (struct copychunk_ioctl_req *)&req->Buffer[0];
+		ci_req = (struct copychunk_ioctl_req *)data_buf;
 		ci_rsp = (struct copychunk_ioctl_rsp *)&rsp->Buffer[0];
 
 		rsp->VolatileFileId = req->VolatileFileId;
@@ -6432,11 +7713,11 @@ int smb2_ioctl(struct cifsd_work *work)
 		if (!src_fp || src_fp->persistent_id !=
 				le64_to_cpu(ci_req->ResumeKey[1])) {
 			rsp->hdr.Status = STATUS_OBJECT_NAME_NOT_FOUND;
-			goto out;
+			goto copychunk_out;
 		}
 		if (!dst_fp) {
 			rsp->hdr.Status = STATUS_FILE_CLOSED;
-			goto out;
+			goto copychunk_out;
 		}
 
 		/*
@@ -6446,60 +7727,139 @@ int smb2_ioctl(struct cifsd_work *work)
 		if (cnt_code == FSCTL_COPYCHUNK && !(dst_fp->daccess &
 				(FILE_READ_DATA_LE | FILE_GENERIC_READ_LE))) {
 			rsp->hdr.Status = STATUS_ACCESS_DENIED;
-			goto out;
+			goto copychunk_out;
 		} else if (cnt_code == FSCTL_COPYCHUNK_WRITE &&
 				dst_fp->daccess &
 				 (FILE_READ_DATA_LE |
 				FILE_GENERIC_READ_LE)) {
 			rsp->hdr.Status = STATUS_ACCESS_DENIED;
+			goto copychunk_out;
+		}
+
+		if (smb2_copychunk_async(work, req, total_size_written) &&
+		    !smb2_copychunk_queue(work, src_fp, dst_fp, chunks,
+					  chunk_count))
+			return 0;
+
+		if (smb2_copychunk(work, rsp, src_fp, dst_fp, chunks,
+				   chunk_count) == -EACCES)
+			goto out;
+		break;
+copychunk_out:
+		cifsd_fd_put(src_fp);
+		cifsd_fd_put(dst_fp);
+		goto out;
+	}
+	case FSCTL_DUPLICATE_EXTENTS_TO_FILE:
+	{
+		struct duplicate_extents_to_file *dup_ext;
+		struct cifsd_file *fp_in, *fp_out;
+		int ret;
+
+		if (le32_to_cpu(req->InputCount) <
+				sizeof(struct duplicate_extents_to_file)) {
+			rsp->hdr.Status = STATUS_INVALID_PARAMETER;
+			goto out;
+		}
+
+		dup_ext = (struct duplicate_extents_to_file *)data_buf;
+		fp_in = cifsd_lookup_fd_slow(work,
+				le64_to_cpu(dup_ext->VolatileFileHandle),
+				le64_to_cpu(dup_ext->PersistentFileHandle));
+		fp_out = cifsd_lookup_fd_slow(work, id,
+				le64_to_cpu(req->PersistentFileId));
+		if (!fp_in || !fp_out) {
+			cifsd_fd_put(fp_in);
+			cifsd_fd_put(fp_out);
+			rsp->hdr.Status = STATUS_FILE_CLOSED;
 			goto out;
 		}
 
-		ret = cifsd_vfs_copy_file_ranges(work, src_fp, dst_fp,
-				chunks, chunk_count,
-				&chunk_count_written, &chunk_size_written,
-				&total_size_written);
+		ret = cifsd_vfs_clone_file_range(work, fp_in, fp_out,
+				le64_to_cpu(dup_ext->SourceFileOffset),
+				le64_to_cpu(dup_ext->TargetFileOffset),
+				le64_to_cpu(dup_ext->ByteCount));
+		cifsd_fd_put(fp_in);
+		cifsd_fd_put(fp_out);
 		if (ret < 0) {
-			if (ret == -EACCES) {
+			if (ret == -EACCES)
 				rsp->hdr.Status = STATUS_ACCESS_DENIED;
-				goto out;
-			}
-			if (ret == -EAGAIN)
+			else if (ret == -EAGAIN)
 				rsp->hdr.Status = STATUS_FILE_LOCK_CONFLICT;
 			else if (ret == -EBADF)
 				rsp->hdr.Status = STATUS_INVALID_HANDLE;
 			else if (ret == -EFBIG || ret == -ENOSPC)
 				rsp->hdr.Status = STATUS_DISK_FULL;
+			else if (ret == -EOPNOTSUPP || ret == -EXDEV)
+				rsp->hdr.Status = STATUS_NOT_SUPPORTED;
 			else if (ret == -EINVAL)
 				rsp->hdr.Status = STATUS_INVALID_PARAMETER;
-			else if (ret == -EISDIR)
-				rsp->hdr.Status = STATUS_FILE_IS_A_DIRECTORY;
-			else if (ret == -E2BIG)
-				rsp->hdr.Status = STATUS_INVALID_VIEW_SIZE;
 			else
 				rsp->hdr.Status = STATUS_UNEXPECTED_IO_ERROR;
+			goto out;
+		}
+
+		rsp->VolatileFileId = req->VolatileFileId;
+		rsp->PersistentFileId = req->PersistentFileId;
+		break;
+	}
+	case FSCTL_SET_SPARSE:
+	{
+		struct file_sparse *sparse;
+		struct cifsd_file *fp;
+
+		sparse =
+			(struct file_sparse *)data_buf;
+
+		fp = cifsd_lookup_fd_fast(work, id);
+		if (!fp) {
+			rsp->hdr.Status = STATUS_OBJECT_NAME_NOT_FOUND;
+			goto out;
 		}
 
-		ci_rsp->ChunksWritten = cpu_to_le32(chunk_count_written);
-		ci_rsp->ChunkBytesWritten = cpu_to_le32(chunk_size_written);
-		ci_rsp->TotalBytesWritten = cpu_to_le32(total_size_written);
+		fp->f_ci->is_sparse = sparse->SetSparse;
+		cifsd_fd_put(fp);
 		break;
 	}
-	case FSCTL_SET_SPARSE:
+	case FSCTL_QUERY_ALLOCATED_RANGES:
 	{
-		struct file_sparse *sparse;
+		struct file_allocated_range_buffer *qar_req, *qar_rsp;
 		struct cifsd_file *fp;
+		int in_count, out_count;
+		int ret;
 
-		sparse =
-			(struct file_sparse *)&req->Buffer[0];
+		if (le32_to_cpu(req->InputCount) <
+				sizeof(struct file_allocated_range_buffer)) {
+			rsp->hdr.Status = STATUS_INVALID_PARAMETER;
+			goto out;
+		}
+
+		qar_req = (struct file_allocated_range_buffer *)data_buf;
+		qar_rsp = (struct file_allocated_range_buffer *)&rsp->Buffer[0];
+		in_count = out_buf_len /
+			sizeof(struct file_allocated_range_buffer);
 
 		fp = cifsd_lookup_fd_fast(work, id);
 		if (!fp) {
-			rsp->hdr.Status = STATUS_OBJECT_NAME_NOT_FOUND;
+			rsp->hdr.Status = STATUS_FILE_CLOSED;
 			goto out;
 		}
 
-		fp->f_ci->is_sparse = sparse->SetSparse;
+		ret = cifsd_vfs_fqar_lseek(fp,
+				le64_to_cpu(qar_req->file_offset),
+				le64_to_cpu(qar_req->length),
+				qar_rsp, in_count, &out_count);
+		cifsd_fd_put(fp);
+		if (ret == -E2BIG) {
+			rsp->hdr.Status = STATUS_BUFFER_OVERFLOW;
+		} else if (ret < 0) {
+			rsp->hdr.Status = STATUS_INVALID_PARAMETER;
+			goto out;
+		}
+
+		nbytes = out_count * sizeof(struct file_allocated_range_buffer);
+		rsp->VolatileFileId = req->VolatileFileId;
+		rsp->PersistentFileId = req->PersistentFileId;
 		break;
 	}
 	case FSCTL_SET_ZERO_DATA:
@@ -6510,7 +7870,7 @@ int smb2_ioctl(struct cifsd_work *work)
 		int ret;
 
 		zero_data =
-			(struct file_zero_data_information *)&req->Buffer[0];
+			(struct file_zero_data_information *)data_buf;
 
 		fp = cifsd_lookup_fd_fast(work, id);
 		if (!fp) {
@@ -6523,6 +7883,7 @@ int smb2_ioctl(struct cifsd_work *work)
 
 		ret = cifsd_vfs_zero_data(work, fp, off, len,
 			fp->f_ci->is_sparse);
+		cifsd_fd_put(fp);
 		if (ret == -EACCES)
 			rsp->hdr.Status = STATUS_ACCESS_DENIED;
 		else if (ret < 0)
@@ -6536,17 +7897,7 @@ int smb2_ioctl(struct cifsd_work *work)
 		goto out;
 	}
 
-	rsp->CntCode = cpu_to_le32(cnt_code);
-	rsp->InputCount = cpu_to_le32(0);
-	rsp->InputOffset = cpu_to_le32(112);
-	rsp->OutputOffset = cpu_to_le32(112);
-	rsp->OutputCount = cpu_to_le32(nbytes);
-	rsp->StructureSize = cpu_to_le16(49);
-	rsp->Reserved = cpu_to_le16(0);
-	rsp->Flags = cpu_to_le32(0);
-	rsp->Reserved2 = cpu_to_le32(0);
-	inc_rfc1001_len(rsp_org, 48 + nbytes);
-
+	smb2_ioctl_set_rsp(rsp, rsp_org, cnt_code, nbytes);
 	return 0;
 
 out:
@@ -6589,6 +7940,7 @@ static int smb20_oplock_break(struct cifsd_work *work)
 	}
 
 	opinfo = opinfo_get(fp);
+	cifsd_fd_put(fp);
 	if (!opinfo) {
 		cifsd_err("unexpected null oplock_info\n");
 		rsp->hdr.Status = STATUS_INVALID_OPLOCK_PROTOCOL;
@@ -6655,7 +8007,7 @@ static int smb20_oplock_break(struct cifsd_work *work)
 	}
 
 	opinfo->op_state = OPLOCK_STATE_NONE;
-	wake_up_interruptible(&opinfo->oplock_q);
+	opinfo_break_done(opinfo);
 
 	if (ret < 0) {
 		rsp->hdr.Status = err;
@@ -6798,7 +8150,7 @@ static int smb21_lease_break(struct cifsd_work *work)
 	lease_state = lease->state;
 	atomic_dec(&opinfo->breaking_cnt);
 	opinfo->op_state = OPLOCK_STATE_NONE;
-	wake_up_interruptible(&opinfo->oplock_q);
+	opinfo_break_done(opinfo);
 	opinfo_put(opinfo);
 
 	if (ret < 0) {
@@ -6852,57 +8204,215 @@ int smb2_oplock_break(struct cifsd_work *work)
 	if (err)
 		goto err_out;
 
+	trace_cifsd_oplock_break_ack(work,
+		req->StructureSize == cpu_to_le16(OP_BREAK_STRUCT_SIZE_21),
+		rsp->hdr.Status);
 	return 0;
 
 err_out:
 	rsp->hdr.Status = err;
 	smb2_set_err_rsp(work);
+	trace_cifsd_oplock_break_ack(work,
+		req->StructureSize == cpu_to_le16(OP_BREAK_STRUCT_SIZE_21),
+		rsp->hdr.Status);
 	return 0;
 }
 
+/**
+ * smb2_notify_fill() - respond with the changes buffered on a handle
+ * @work:	smb work containing notify command buffer
+ * @req:	notify request
+ * @rsp:	notify response
+ * @fp:		directory handle the changes are watched on
+ *
+ * Return:	true if changes were buffered, false if there were none
+ */
+static bool smb2_notify_fill(struct cifsd_work *work,
+			     struct smb2_notify_req *req,
+			     struct smb2_notify_rsp *rsp,
+			     struct cifsd_file *fp)
+{
+	unsigned int len = le32_to_cpu(req->OutputBufferLength);
+	size_t room = RESPONSE_SZ(work) -
+		((char *)rsp->Buffer - (char *)RESPONSE_BUF(work));
+	int nbytes;
+
+	len = min_t(size_t, len, room);
+	nbytes = cifsd_notify_read(fp, rsp->Buffer, len,
+				   work->conn->local_nls);
+	if (!nbytes)
+		return false;
+
+	if (nbytes < 0) {
+		/* the client has to enumerate the directory */
+		rsp->hdr.Status = STATUS_NOTIFY_ENUM_DIR;
+		nbytes = 0;
+	}
+
+	rsp->StructureSize = cpu_to_le16(9);
+	rsp->OutputBufferOffset = cpu_to_le16(nbytes ? 72 : 0);
+	rsp->OutputBufferLength = cpu_to_le32(nbytes);
+	inc_rfc1001_len(rsp, 8 + nbytes);
+	return true;
+}
+
+static void smb2_notify_done(struct cifsd_work *work, struct cifsd_file *fp,
+			     int reason)
+{
+	struct smb2_notify_req *req = REQUEST_BUF(work);
+	struct smb2_notify_rsp *rsp = RESPONSE_BUF(work);
+
+	/* the interim response left an error body behind the header */
+	rsp->hdr.smb2_buf_length =
+		cpu_to_be32(HEADER_SIZE_NO_BUF_LEN(work->conn));
+	rsp->hdr.Status = STATUS_SUCCESS;
+
+	if (reason == CIFSD_NOTIFY_CANCELLED) {
+		smb2_set_err_rsp(work);
+		rsp->hdr.Status = STATUS_CANCELLED;
+	} else if (reason == CIFSD_NOTIFY_CLEANUP ||
+		   !smb2_notify_fill(work, req, rsp, fp)) {
+		rsp->hdr.Status = STATUS_NOTIFY_CLEANUP;
+		rsp->StructureSize = cpu_to_le16(9);
+		rsp->OutputBufferOffset = 0;
+		rsp->OutputBufferLength = 0;
+		inc_rfc1001_len(rsp, 8);
+	}
+
+	/* handle_cifsd_work() sends the final response */
+	cifsd_requeue_work(work);
+}
+
+static void smb2_notify_start(struct cifsd_work *work)
+{
+	struct cifsd_file *fp = work->async_data;
+	struct smb2_notify_req *req = REQUEST_BUF(work);
+	struct smb2_notify_rsp *rsp = RESPONSE_BUF(work);
+	int err;
+
+	err = cifsd_notify_wait(fp, work, smb2_notify_done);
+	if (err) {
+		/* changes or a cancel came in before it could wait */
+		rsp->hdr.smb2_buf_length =
+			cpu_to_be32(HEADER_SIZE_NO_BUF_LEN(work->conn));
+		rsp->hdr.Status = STATUS_SUCCESS;
+		if (err != -EAGAIN || !smb2_notify_fill(work, req, rsp, fp)) {
+			smb2_set_err_rsp(work);
+			rsp->hdr.Status = err == -ECANCELED ? STATUS_CANCELLED :
+				STATUS_INSUFFICIENT_RESOURCES;
+		}
+		cifsd_requeue_work(work);
+	}
+	cifsd_fd_put(fp);
+}
+
 /**
  * smb2_notify() - handler for smb2 notify request
- * @cifsd_work:   smb work containing notify command buffer
+ * @work:	smb work containing notify command buffer
+ *
+ * Changes buffered on the directory handle are returned at once, else the
+ * request waits for them asynchronously. A request in a compound can't
+ * wait, the client is told to enumerate the directory instead.
  *
  * Return:      0
  */
-int smb2_notify(struct cifsd_work *cifsd_work)
+int smb2_notify(struct cifsd_work *work)
 {
 	struct smb2_notify_req *req;
-	struct smb2_notify_rsp *rsp, *rsp_org;
+	struct smb2_notify_rsp *rsp;
+	struct cifsd_file *fp;
+	int err;
 
-	req = (struct smb2_notify_req *)REQUEST_BUF(cifsd_work);
-	rsp = (struct smb2_notify_rsp *)RESPONSE_BUF(cifsd_work);
-	rsp_org = rsp;
+	req = work->req_view.hdr;
+	rsp = (struct smb2_notify_rsp *)RESPONSE_BUF(work);
 
-	if (cifsd_work->next_smb2_rcv_hdr_off) {
-		req = (struct smb2_notify_req *)((char *)req +
-			cifsd_work->next_smb2_rcv_hdr_off);
+	if (work->next_smb2_rcv_hdr_off) {
 		rsp = (struct smb2_notify_rsp *)((char *)rsp +
-			cifsd_work->next_smb2_rsp_hdr_off);
+			work->next_smb2_rsp_hdr_off);
 	}
 
-	if (cifsd_work->next_smb2_rcv_hdr_off &&
+	if (work->next_smb2_rcv_hdr_off &&
 		le32_to_cpu(req->hdr.NextCommand)) {
 		rsp->hdr.Status = STATUS_INTERNAL_ERROR;
-		smb2_set_err_rsp(cifsd_work);
+		smb2_set_err_rsp(work);
+		return 0;
+	}
+
+	fp = cifsd_lookup_fd_slow(work,
+			le64_to_cpu(req->VolatileFileId),
+			le64_to_cpu(req->PersistentFileId));
+	if (!fp) {
+		rsp->hdr.Status = STATUS_FILE_CLOSED;
+		smb2_set_err_rsp(work);
+		return 0;
+	}
+
+	if (!S_ISDIR(FP_INODE(fp)->i_mode)) {
+		rsp->hdr.Status = STATUS_INVALID_PARAMETER;
+		smb2_set_err_rsp(work);
+		cifsd_fd_put(fp);
+		return 0;
+	}
+
+	err = cifsd_notify_attach(fp, le32_to_cpu(req->CompletionFileter));
+	if (err == -EOPNOTSUPP) {
+		/*
+		 * Win7 send peoridically query_dir command if cifsd just
+		 * response with STATUS_NOT_IMPLEMENTED status. If
+		 * SMB2_WATCH_TREE flags is set in change notify command,
+		 * cifsd send async response with STATUS PENDING to avoid
+		 * peoridical query_dir.
+		 */
+		if (le16_to_cpu(req->Flags) == SMB2_WATCH_TREE) {
+			smb2_send_interim_resp(work, STATUS_PENDING);
+			work->send_no_response = 1;
+		} else {
+			smb2_set_err_rsp(work);
+			rsp->hdr.Status = STATUS_NOT_IMPLEMENTED;
+		}
+		cifsd_fd_put(fp);
+		return 0;
+	} else if (err) {
+		rsp->hdr.Status = STATUS_INSUFFICIENT_RESOURCES;
+		smb2_set_err_rsp(work);
+		cifsd_fd_put(fp);
+		return 0;
+	}
+
+	if (smb2_notify_fill(work, req, rsp, fp)) {
+		cifsd_fd_put(fp);
+		return 0;
+	}
+
+	if (work->next_smb2_rcv_hdr_off) {
+		rsp->hdr.Status = STATUS_NOTIFY_ENUM_DIR;
+		rsp->StructureSize = cpu_to_le16(9);
+		rsp->OutputBufferOffset = 0;
+		rsp->OutputBufferLength = 0;
+		inc_rfc1001_len(rsp, 8);
+		cifsd_fd_put(fp);
 		return 0;
 	}
 
 	/*
-	 * Win7 send peoridically query_dir command if cifsd just response
-	 * with STATUS_NOT_IMPLEMENTED status. If SMB2_WATCH_TREE flags
-	 * is set in change notify command, cifsd send async response with
-	 * STATUS PENDING to avoid peoridical query_dir.
+	 * An encrypted request waits without an interim response, which
+	 * couldn't be encrypted, and can be cancelled by its MessageId.
 	 */
-	if (le16_to_cpu(req->Flags) == SMB2_WATCH_TREE) {
-		smb2_send_interim_resp(cifsd_work, STATUS_PENDING);
-		cifsd_work->send_no_response = 1;
-	} else {
-		smb2_set_err_rsp(cifsd_work);
-		rsp->hdr.Status = STATUS_NOT_IMPLEMENTED;
+	if (!work->encrypted) {
+		smb2_set_rsp_credits(work);
+		if (setup_async_work(work, NULL, NULL)) {
+			rsp->hdr.Status = STATUS_INSUFFICIENT_RESOURCES;
+			smb2_set_err_rsp(work);
+			cifsd_fd_put(fp);
+			return 0;
+		}
+		smb2_send_interim_resp(work, STATUS_PENDING);
 	}
 
+	/* smb2_notify_start() parks it and drops the handle reference */
+	work->async_pending = true;
+	work->async_start = smb2_notify_start;
+	work->async_data = fp;
 	return 0;
 }
 
@@ -6923,8 +8433,8 @@ int smb2_is_sign_req(struct cifsd_work *work, unsigned int command)
 		return 1;
 
 	/* send session setup auth phase signed response */
-	if (work->sess->sign && command == SMB2_SESSION_SETUP_HE &&
-		work->sess)
+	if (command == SMB2_SESSION_SETUP_HE && work->sess &&
+	    (work->sess->sign || smb2_sess_setup_binding(rcv_hdr2)))
 		return 1;
 
 	return 0;
@@ -7023,15 +8533,14 @@ int smb3_check_sign_req(struct cifsd_work *work)
 		len = be32_to_cpu(hdr_org->smb2_buf_length) -
 			work->next_smb2_rcv_hdr_off;
 
+	conn = work->conn;
 	if (le16_to_cpu(hdr->Command) == SMB2_SESSION_SETUP_HE) {
 		signing_key = work->sess->smb3signingkey;
-		conn = work->sess->conn;
 	} else {
-		chann = lookup_chann_list(work->sess);
+		chann = lookup_chann_list(work->sess, conn);
 		if (!chann)
 			return 0;
 		signing_key = chann->smb3signingkey;
-		conn = chann->conn;
 	}
 
 	if (!signing_key) {
@@ -7093,15 +8602,16 @@ void smb3_set_sign_rsp(struct cifsd_work *work)
 		len = ((len + 7) & ~7);
 	}
 
-	if (le16_to_cpu(hdr->Command) == SMB2_SESSION_SETUP_HE) {
+	conn = work->conn;
+	if (le16_to_cpu(hdr->Command) == SMB2_SESSION_SETUP_HE &&
+	    !smb2_sess_setup_binding(req_hdr)) {
 		signing_key = work->sess->smb3signingkey;
-		conn = work->sess->conn;
 	} else {
-		chann = lookup_chann_list(work->sess);
+		/* the last response of a bind is signed with the channel key */
+		chann = lookup_chann_list(work->sess, conn);
 		if (!chann)
 			return;
 		signing_key = chann->smb3signingkey;
-		conn = chann->conn;
 	}
 
 	if (!signing_key)
@@ -7153,64 +8663,93 @@ void smb3_preauth_hash_rsp(struct cifsd_work *work)
 
 	if (le16_to_cpu(rsp->Command) == SMB2_SESSION_SETUP_HE &&
 			rsp->Status == STATUS_MORE_PROCESSING_REQUIRED) {
-		__u8 *hash_value;
-
-		if (multi_channel_enable &&
-				conn->dialect >= SMB311_PROT_ID &&
-				le32_to_cpu(req->Flags) &
-					SMB2_SESSION_REQ_FLAG_BINDING) {
-			struct preauth_session *preauth_sess;
-
-			preauth_sess = get_preauth_session(conn,
-					le64_to_cpu(req->SessionId));
-			hash_value = preauth_sess->Preauth_HashValue;
+		if (conn->dialect >= SMB311_PROT_ID &&
+				smb2_sess_setup_binding(req)) {
+			u64 id = le64_to_cpu(req->SessionId);
+			__u8 hash_value[PREAUTH_HASHVALUE_SIZE];
+
+			if (cifsd_preauth_session_lookup(conn, id, hash_value))
+				return;
+			cifsd_gen_preauth_integrity_hash(conn, (char *)rsp,
+					hash_value);
+			cifsd_preauth_session_update(conn, id, hash_value);
 		} else
-			hash_value = sess->Preauth_HashValue;
-
-		cifsd_gen_preauth_integrity_hash(conn, (char *)rsp,
-				hash_value);
+			cifsd_gen_preauth_integrity_hash(conn, (char *)rsp,
+					sess->Preauth_HashValue);
 	}
 }
 
-static void fill_transform_hdr(struct smb2_transform_hdr *tr_hdr, char *old_buf)
+static void fill_transform_hdr(struct smb2_transform_hdr *tr_hdr, char *old_buf,
+			       struct cifsd_session *sess)
 {
-	struct smb2_hdr *hdr = (struct smb2_hdr *)old_buf;
+	__le16 cipher_type = sess->cipher_type;
 	unsigned int orig_len = get_rfc1002_length(old_buf);
 
 	memset(tr_hdr, 0, sizeof(struct smb2_transform_hdr));
 	tr_hdr->ProtocolId = SMB2_TRANSFORM_PROTO_NUM;
 	tr_hdr->OriginalMessageSize = cpu_to_le32(orig_len);
 	tr_hdr->Flags = cpu_to_le16(0x01);
-	get_random_bytes(&tr_hdr->Nonce, SMB3_AES128CMM_NONCE);
-	memcpy(&tr_hdr->SessionId, &hdr->SessionId, 8);
+	if (cipher_type == SMB2_ENCRYPTION_AES128_GCM ||
+	    cipher_type == SMB2_ENCRYPTION_AES256_GCM)
+		get_random_bytes(&tr_hdr->Nonce, SMB3_AES128GCM_NONCE);
+	else
+		get_random_bytes(&tr_hdr->Nonce, SMB3_AES128CMM_NONCE);
+	/* the message may start with a compression transform header */
+	tr_hdr->SessionId = cpu_to_le64(sess->id);
 	inc_rfc1001_len(tr_hdr, sizeof(struct smb2_transform_hdr) - 4);
 	inc_rfc1001_len(tr_hdr, orig_len);
 }
 
+static void smb3_encrypt_resp_complete(void *data, int err)
+{
+	struct cifsd_work *work = data;
+
+	work->crypt_err = err;
+	cifsd_requeue_work(work);
+}
+
+/**
+ * smb3_encrypt_resp() - encrypt the response of a request
+ * @work:	smb work containing response buffer
+ *
+ * Requests which don't hold conn->srv_mutex don't wait for an
+ * asynchronous transform, they are put back on the work queue once it
+ * completes and smb3_encrypt_resp_done() finishes the response.
+ *
+ * Return:	0 on success, -EINPROGRESS if the transform completes
+ *		asynchronously, otherwise error
+ */
 int smb3_encrypt_resp(struct cifsd_work *work)
 {
 	char *buf = RESPONSE_BUF(work);
 	struct smb2_transform_hdr *tr_hdr;
 	struct kvec iov[3];
-	int rc = -ENOMEM;
+	int rc;
 	int buf_size = 0, rq_nvec = 2 + (HAS_AUX_PAYLOAD(work) ? 1 : 0);
 
 	if (ARRAY_SIZE(iov) < rq_nvec)
 		return -ENOMEM;
 
-	tr_hdr = cifsd_alloc_response(sizeof(struct smb2_transform_hdr));
-	if (!tr_hdr)
-		return rc;
+	/*
+	 * The transform header goes in the buffer headroom, replacing the
+	 * RFC1002 length in front of the message, which is encrypted in
+	 * place and sent right after it.
+	 */
+	BUILD_BUG_ON(sizeof(struct smb2_transform_hdr) - 4 >
+		     CIFSD_BUF_HEADROOM);
+	tr_hdr = (struct smb2_transform_hdr *)(buf + 4 -
+			sizeof(struct smb2_transform_hdr));
+
+	iov[1].iov_base = buf + 4;
+	iov[1].iov_len = get_rfc1002_length(buf);
 
 	/* fill transform header */
-	fill_transform_hdr(tr_hdr, buf);
+	fill_transform_hdr(tr_hdr, buf, work->sess);
 
 	iov[0].iov_base = tr_hdr;
 	iov[0].iov_len = sizeof(struct smb2_transform_hdr);
 	buf_size += iov[0].iov_len - 4;
 
-	iov[1].iov_base = buf + 4;
-	iov[1].iov_len = get_rfc1002_length(buf);
 	if (HAS_AUX_PAYLOAD(work)) {
 		iov[1].iov_len = RESP_HDR_SIZE(work) - 4;
 
@@ -7220,16 +8759,47 @@ int smb3_encrypt_resp(struct cifsd_work *work)
 	}
 	buf_size += iov[1].iov_len;
 	work->resp_hdr_sz = iov[1].iov_len;
-
-	rc = cifsd_crypt_message(work->conn, iov, rq_nvec, 1);
-	if (rc)
-		return rc;
-
-	memmove(buf, iov[1].iov_base, iov[1].iov_len);
 	tr_hdr->smb2_buf_length = cpu_to_be32(buf_size);
 	work->tr_buf = tr_hdr;
 
-	return rc;
+	if (work->serialized) {
+		rc = cifsd_crypt_message(work->conn, iov, rq_nvec, 1,
+					 NULL, NULL);
+	} else {
+		work->crypt_pending = true;
+		rc = cifsd_crypt_message(work->conn, iov, rq_nvec, 1,
+					 smb3_encrypt_resp_complete, work);
+		if (rc == -EINPROGRESS)
+			return rc;
+		work->crypt_pending = false;
+	}
+
+	work->crypt_err = rc;
+	return smb3_encrypt_resp_done(work);
+}
+
+/**
+ * smb3_encrypt_resp_done() - finish a response encrypted by
+ *		smb3_encrypt_resp()
+ * @work:	smb work containing response buffer
+ *
+ * Return:	0 on success, otherwise error of the transform
+ */
+int smb3_encrypt_resp_done(struct cifsd_work *work)
+{
+	struct smb2_transform_hdr *tr_hdr = work->tr_buf;
+	char *buf = RESPONSE_BUF(work);
+
+	work->crypt_pending = false;
+	if (work->crypt_err) {
+		/* restore the RFC1002 length the transform header replaced */
+		*(__be32 *)buf =
+			cpu_to_be32(le32_to_cpu(tr_hdr->OriginalMessageSize));
+		work->tr_buf = NULL;
+		return work->crypt_err;
+	}
+
+	return 0;
 }
 
 int smb3_is_transform_hdr(void *buf)
@@ -7259,6 +8829,7 @@ int smb3_decrypt_req(struct cifsd_work *work)
 		le64_to_cpu(tr_hdr->SessionId));
 		return -ECONNABORTED;
 	}
+	cifsd_session_put(sess);
 
 	if (pdu_length + 4 < sizeof(struct smb2_transform_hdr) +
 			sizeof(struct smb2_hdr)) {
@@ -7276,17 +8847,335 @@ int smb3_decrypt_req(struct cifsd_work *work)
 	iov[0].iov_len = sizeof(struct smb2_transform_hdr);
 	iov[1].iov_base = buf + sizeof(struct smb2_transform_hdr);
 	iov[1].iov_len = buf_data_size;
-	rc = cifsd_crypt_message(conn, iov, 2, 0);
+	rc = cifsd_crypt_message(conn, iov, 2, 0, NULL, NULL);
 	if (rc)
 		return rc;
 
-	memmove(buf + 4, iov[1].iov_base, buf_data_size);
-	hdr = (struct smb2_hdr *)buf;
+	/*
+	 * Process the message where it was decrypted, with its RFC1002
+	 * length over the end of the transform header.
+	 */
+	work->request_offset += sizeof(struct smb2_transform_hdr) - 4;
+	hdr = (struct smb2_hdr *)REQUEST_BUF(work);
 	hdr->smb2_buf_length = cpu_to_be32(buf_data_size);
 
 	return rc;
 }
 
+int smb3_is_compress_hdr(void *buf)
+{
+	struct smb2_compression_hdr *hdr = buf;
+
+	return hdr->ProtocolId == SMB2_COMPRESSION_TRANSFORM_ID;
+}
+
+static int smb3_decompress_payload(struct cifsd_tcp_conn *conn,
+				   __le16 algo,
+				   const char *in,
+				   unsigned int in_len,
+				   char *out,
+				   unsigned int out_len)
+{
+	int rc;
+
+	if (!(conn->compress_algos & SMB3_COMPRESS_BIT(algo)))
+		return -EINVAL;
+
+	if (algo == SMB3_COMPRESS_LZ77)
+		rc = cifsd_lz77_decompress(in, in_len, out, out_len);
+	else if (algo == SMB3_COMPRESS_LZ77_HUFF)
+		rc = cifsd_lz77_huff_decompress(in, in_len, out, out_len);
+	else
+		return -EINVAL;
+
+	if (rc < 0)
+		return rc;
+	return rc == out_len ? 0 : -EINVAL;
+}
+
+static int smb3_decompress_chained(struct cifsd_tcp_conn *conn,
+				   char *p,
+				   char *end,
+				   char *out,
+				   unsigned int out_len)
+{
+	struct smb2_compression_payload_hdr *phdr;
+	struct smb2_compression_pattern_v1 *pattern;
+	char *out_end = out + out_len;
+	unsigned int len, orig_len;
+	int rc;
+
+	while (p < end) {
+		if (end - p < sizeof(struct smb2_compression_payload_hdr))
+			return -EINVAL;
+		phdr = (struct smb2_compression_payload_hdr *)p;
+		p += sizeof(struct smb2_compression_payload_hdr);
+		len = le32_to_cpu(phdr->Length);
+		if (len > end - p)
+			return -EINVAL;
+
+		if (phdr->AlgorithmId == SMB3_COMPRESS_NONE) {
+			if (len > out_end - out)
+				return -EINVAL;
+			memcpy(out, p, len);
+			out += len;
+		} else if (phdr->AlgorithmId == SMB3_COMPRESS_PATTERN) {
+			pattern = (struct smb2_compression_pattern_v1 *)p;
+			if (!(conn->compress_algos &
+			      SMB3_COMPRESS_BIT(SMB3_COMPRESS_PATTERN)) ||
+			    len != sizeof(struct smb2_compression_pattern_v1))
+				return -EINVAL;
+			orig_len = le32_to_cpu(pattern->Repetitions);
+			if (orig_len > out_end - out)
+				return -EINVAL;
+			memset(out, pattern->Pattern, orig_len);
+			out += orig_len;
+		} else {
+			/* OriginalPayloadSize precedes the compressed data */
+			if (len < 4)
+				return -EINVAL;
+			orig_len = get_unaligned_le32(p);
+			if (orig_len > out_end - out)
+				return -EINVAL;
+			rc = smb3_decompress_payload(conn, phdr->AlgorithmId,
+						     p + 4, len - 4,
+						     out, orig_len);
+			if (rc)
+				return rc;
+			out += orig_len;
+		}
+		p += len;
+	}
+
+	return out == out_end ? 0 : -EINVAL;
+}
+
+/**
+ * smb3_decompress_req() - decompress a request with a compression
+ *		transform header
+ * @work:	smb work containing (decrypted) request buffer
+ *
+ * The request buffer is replaced by one holding the uncompressed message.
+ *
+ * Return:	0 on success, otherwise error
+ */
+int smb3_decompress_req(struct cifsd_work *work)
+{
+	struct cifsd_tcp_conn *conn = work->conn;
+	char *buf = REQUEST_BUF(work);
+	struct smb2_compression_hdr *hdr = (struct smb2_compression_hdr *)buf;
+	unsigned int pdu_length = get_rfc1002_length(buf);
+	char *end = buf + pdu_length + 4, *data = NULL, *nbuf;
+	unsigned int orig_len, offset = 0, max_len;
+	bool chained;
+	int rc;
+
+	if (!conn->compress_negotiated || HAS_REQUEST_PAGES(work)) {
+		cifsd_err("Unexpected compressed message\n");
+		return -ECONNABORTED;
+	}
+
+	if (pdu_length + 4 < sizeof(struct smb2_compression_hdr)) {
+		cifsd_err("Compressed message is too small (%u)\n",
+				pdu_length);
+		return -ECONNABORTED;
+	}
+
+	orig_len = le32_to_cpu(hdr->OriginalCompressedSegmentSize);
+	chained = !!(hdr->Flags & SMB2_COMPRESSION_FLAG_CHAINED);
+	if (!chained) {
+		offset = le32_to_cpu(hdr->Offset);
+		data = buf + sizeof(struct smb2_compression_hdr);
+		if (offset > end - data)
+			return -ECONNABORTED;
+	}
+
+	/* Neither the message nor the decompression may exceed a write */
+	max_len = cifsd_max_io_size() + MAX_SMB2_HDR_SIZE;
+	if (orig_len > max_len || offset > max_len - orig_len ||
+	    orig_len + offset < sizeof(struct smb2_hdr) - 4) {
+		cifsd_err("Compressed message is broken (%u)\n", orig_len);
+		return -ECONNABORTED;
+	}
+
+	nbuf = cifsd_alloc_request(orig_len + offset + 4);
+	if (!nbuf)
+		return -ENOMEM;
+
+	if (chained) {
+		/* the first payload header follows OriginalCompressedSegmentSize */
+		rc = smb3_decompress_chained(conn,
+				buf + offsetof(struct smb2_compression_hdr,
+					       CompressionAlgorithm),
+				end, nbuf + 4, orig_len);
+	} else {
+		memcpy(nbuf + 4, data, offset);
+		rc = smb3_decompress_payload(conn, hdr->CompressionAlgorithm,
+					     data + offset,
+					     end - data - offset,
+					     nbuf + 4 + offset, orig_len);
+	}
+	if (rc) {
+		cifsd_err("Failed to decompress message: %d\n", rc);
+		cifsd_free_request(nbuf);
+		return -ECONNABORTED;
+	}
+
+	*(__be32 *)nbuf = cpu_to_be32(orig_len + offset);
+	cifsd_free_request(work->request_buf);
+	work->request_buf = nbuf;
+	work->request_offset = 0;
+	return 0;
+}
+
+/* Read data smaller than this isn't worth compressing */
+#define SMB3_COMPRESS_MIN_SIZE		4096
+/* Data is probed this much at first, to give up early on incompressible data */
+#define SMB3_COMPRESS_PROBE_SIZE	4096
+
+/* Compressed data must save at least an eighth of @len */
+static inline unsigned int smb3_compress_budget(unsigned int len)
+{
+	return len - len / 8;
+}
+
+static void smb3_set_compressed_rsp(struct cifsd_work *work, char *nbuf,
+				    unsigned int size)
+{
+	cifsd_free_response(RESPONSE_BUF(work));
+	cifsd_free_response(AUX_PAYLOAD(work));
+	INIT_AUX_PAYLOAD(work);
+	work->aux_payload_sz = 0;
+	work->response_buf = nbuf;
+	work->response_sz = size;
+	work->resp_hdr_sz = get_rfc1002_length(nbuf) + 4;
+}
+
+/* Send the repeated byte of @pattern as a chained Pattern_V1 payload */
+static void smb3_compress_pattern_rsp(struct cifsd_work *work, u8 pattern)
+{
+	char *buf = RESPONSE_BUF(work), *p, *nbuf;
+	unsigned int hdr_len = RESP_HDR_SIZE(work) - 4;
+	struct smb2_compression_hdr *hdr;
+	struct smb2_compression_payload_hdr *phdr;
+	struct smb2_compression_pattern_v1 *pv1;
+	unsigned int size;
+
+	size = offsetof(struct smb2_compression_hdr, CompressionAlgorithm) +
+		2 * sizeof(struct smb2_compression_payload_hdr) + hdr_len +
+		sizeof(struct smb2_compression_pattern_v1);
+	nbuf = cifsd_alloc_response(size);
+	if (!nbuf)
+		return;
+
+	hdr = (struct smb2_compression_hdr *)nbuf;
+	hdr->smb2_buf_length = cpu_to_be32(size - 4);
+	hdr->ProtocolId = SMB2_COMPRESSION_TRANSFORM_ID;
+	hdr->OriginalCompressedSegmentSize =
+		cpu_to_le32(hdr_len + AUX_PAYLOAD_SIZE(work));
+
+	/* the response header goes uncompressed */
+	p = nbuf + offsetof(struct smb2_compression_hdr, CompressionAlgorithm);
+	phdr = (struct smb2_compression_payload_hdr *)p;
+	phdr->AlgorithmId = SMB3_COMPRESS_NONE;
+	phdr->Flags = SMB2_COMPRESSION_FLAG_CHAINED;
+	phdr->Length = cpu_to_le32(hdr_len);
+	p += sizeof(struct smb2_compression_payload_hdr);
+	memcpy(p, buf + 4, hdr_len);
+	p += hdr_len;
+
+	phdr = (struct smb2_compression_payload_hdr *)p;
+	phdr->AlgorithmId = SMB3_COMPRESS_PATTERN;
+	phdr->Flags = SMB2_COMPRESSION_FLAG_CHAINED;
+	phdr->Length = cpu_to_le32(sizeof(struct smb2_compression_pattern_v1));
+	pv1 = (struct smb2_compression_pattern_v1 *)
+		(p + sizeof(struct smb2_compression_payload_hdr));
+	pv1->Pattern = pattern;
+	pv1->Reserved1 = 0;
+	pv1->Reserved2 = 0;
+	pv1->Repetitions = cpu_to_le32(AUX_PAYLOAD_SIZE(work));
+
+	smb3_set_compressed_rsp(work, nbuf, size);
+}
+
+/* Send the read data as the LZ77 compressed segment of the response */
+static void smb3_compress_lz77_rsp(struct cifsd_work *work)
+{
+	char *buf = RESPONSE_BUF(work), *data = AUX_PAYLOAD(work);
+	unsigned int len = AUX_PAYLOAD_SIZE(work);
+	unsigned int hdr_len = RESP_HDR_SIZE(work) - 4;
+	unsigned int probe = min_t(unsigned int, len, SMB3_COMPRESS_PROBE_SIZE);
+	struct smb2_compression_hdr *hdr;
+	char *nbuf, *out;
+	unsigned int size;
+	int rc;
+
+	size = sizeof(struct smb2_compression_hdr) + hdr_len +
+		smb3_compress_budget(len);
+	nbuf = cifsd_alloc_response(size);
+	if (!nbuf)
+		return;
+	out = nbuf + sizeof(struct smb2_compression_hdr) + hdr_len;
+
+	if (probe < len) {
+		rc = cifsd_lz77_compress(data, probe, out,
+					 smb3_compress_budget(probe));
+		if (rc < 0)
+			goto out_free;
+	}
+
+	rc = cifsd_lz77_compress(data, len, out, smb3_compress_budget(len));
+	if (rc < 0)
+		goto out_free;
+
+	hdr = (struct smb2_compression_hdr *)nbuf;
+	hdr->smb2_buf_length = cpu_to_be32(sizeof(struct smb2_compression_hdr) -
+					   4 + hdr_len + rc);
+	hdr->ProtocolId = SMB2_COMPRESSION_TRANSFORM_ID;
+	hdr->OriginalCompressedSegmentSize = cpu_to_le32(len);
+	hdr->CompressionAlgorithm = SMB3_COMPRESS_LZ77;
+	hdr->Flags = SMB2_COMPRESSION_FLAG_NONE;
+	hdr->Offset = cpu_to_le32(hdr_len);
+	memcpy(nbuf + sizeof(struct smb2_compression_hdr), buf + 4, hdr_len);
+
+	smb3_set_compressed_rsp(work, nbuf, size);
+	return;
+
+out_free:
+	cifsd_debug("%u bytes of read data don't compress\n", len);
+	cifsd_free_response(nbuf);
+}
+
+/**
+ * smb3_compress_resp() - compress the read data of a response
+ * @work:	smb work containing signed response buffer
+ *
+ * Data repeating a single byte is sent as a Pattern_V1 payload if chained
+ * compression was negotiated, other data with LZ77. The response is sent
+ * as is if it doesn't get smaller by at least an eighth.
+ */
+void smb3_compress_resp(struct cifsd_work *work)
+{
+	struct cifsd_tcp_conn *conn = work->conn;
+	u8 pattern;
+
+	if (!work->compress_rsp || !HAS_AUX_PAYLOAD(work) ||
+	    HAS_AUX_PAYLOAD_PAGES(work) ||
+	    AUX_PAYLOAD_SIZE(work) < SMB3_COMPRESS_MIN_SIZE)
+		return;
+	work->compress_rsp = false;
+
+	if (conn->compress_algos & SMB3_COMPRESS_BIT(SMB3_COMPRESS_PATTERN) &&
+	    cifsd_pattern_v1_detect(AUX_PAYLOAD(work), AUX_PAYLOAD_SIZE(work),
+				    &pattern)) {
+		smb3_compress_pattern_rsp(work, pattern);
+		return;
+	}
+
+	if (conn->compress_algos & SMB3_COMPRESS_BIT(SMB3_COMPRESS_LZ77))
+		smb3_compress_lz77_rsp(work);
+}
+
 int smb3_final_sess_setup_resp(struct cifsd_work *work)
 {
 	struct cifsd_tcp_conn *conn = work->conn;
@@ -75,6 +75,22 @@
 
 #define NUMBER_OF_SMB2_COMMANDS	0x0013
 
+/* Variable areas of the requests, see smb2_req_area() */
+#define SMB2_NEGOTIATE_DIALECTS		0
+#define SMB2_NEGOTIATE_CONTEXTS		1
+#define SMB2_SESSION_SETUP_BLOB		0
+#define SMB2_TREE_CONNECT_PATH		0
+#define SMB2_CREATE_NAME		0
+#define SMB2_CREATE_CONTEXTS		1
+#define SMB2_READ_CHANNEL		0
+#define SMB2_WRITE_DATA			0
+#define SMB2_WRITE_CHANNEL		1
+#define SMB2_LOCK_ELEMENTS		0
+#define SMB2_IOCTL_INPUT		0
+#define SMB2_QUERY_DIRECTORY_NAME	0
+#define SMB2_QUERY_INFO_INPUT		0
+#define SMB2_SET_INFO_BUFFER		0
+
 /* BB FIXME - analyze following length BB */
 #define MAX_SMB2_HDR_SIZE 0x78 /* 4 len + 64 hdr + (2*24 wct) + 2 bct + 2 pad */
 
@@ -94,6 +110,11 @@
 #define SMB2_HEADER_STRUCTURE_SIZE				\
 	cpu_to_le16(__SMB2_HEADER_STRUCTURE_SIZE)
 
+/* Payload a single credit pays for with LargeMTU, see MS-SMB2 3.1.5.2 */
+#define SMB2_CREDIT_PAYLOAD_SIZE	65536
+/* Largest READ and WRITE payload advertised with LargeMTU */
+#define SMB2_MAX_IO_SIZE		(8 * 1024 * 1024)
+
 struct smb2_hdr {
 	__be32 smb2_buf_length;	/* big endian on wire */
 				/* length is only two or three bytes - with
@@ -128,6 +149,36 @@ extern bool encryption_enable;
 #define SMB3_AES128CMM_NONCE 11
 #define SMB3_AES128GCM_NONCE 12
 
+#define SMB2_COMPRESSION_TRANSFORM_ID	cpu_to_le32(0x424d53fc)
+
+/* Compression transform header flags */
+#define SMB2_COMPRESSION_FLAG_NONE	cpu_to_le16(0x0000)
+#define SMB2_COMPRESSION_FLAG_CHAINED	cpu_to_le16(0x0001)
+
+struct smb2_compression_hdr {
+	__be32 smb2_buf_length; /* big endian on wire */
+	__le32 ProtocolId;	/* 0xFC 'S' 'M' 'B' */
+	__le32 OriginalCompressedSegmentSize;
+	__le16 CompressionAlgorithm;
+	__le16 Flags;
+	/* Uncompressed data preceding the compressed segment */
+	__le32 Offset;
+} __packed;
+
+/* Payload header of SMB2_COMPRESSION_FLAG_CHAINED messages */
+struct smb2_compression_payload_hdr {
+	__le16 AlgorithmId;
+	__le16 Flags;
+	__le32 Length;	/* includes OriginalPayloadSize of LZ algorithms */
+} __packed;
+
+struct smb2_compression_pattern_v1 {
+	__u8   Pattern;
+	__u8   Reserved1;
+	__le16 Reserved2;
+	__le32 Repetitions;
+} __packed;
+
 struct smb2_transform_hdr {
 	__be32 smb2_buf_length; /* big endian on wire */
 	/* length is only two or three bytes - with
@@ -223,6 +274,8 @@ struct preauth_integrity_info {
 
 #define SMB2_PREAUTH_INTEGRITY_CAPABILITIES	cpu_to_le16(1)
 #define SMB2_ENCRYPTION_CAPABILITIES		cpu_to_le16(2)
+#define SMB2_COMPRESSION_CAPABILITIES		cpu_to_le16(3)
+#define SMB2_SIGNING_CAPABILITIES		cpu_to_le16(8)
 
 struct smb2_preauth_neg_context {
 	__le16	ContextType; /* 1 */
@@ -237,6 +290,8 @@ struct smb2_preauth_neg_context {
 /* Encryption Algorithms Ciphers */
 #define SMB2_ENCRYPTION_AES128_CCM	cpu_to_le16(0x0001)
 #define SMB2_ENCRYPTION_AES128_GCM	cpu_to_le16(0x0002)
+#define SMB2_ENCRYPTION_AES256_CCM	cpu_to_le16(0x0003)
+#define SMB2_ENCRYPTION_AES256_GCM	cpu_to_le16(0x0004)
 
 struct smb2_encryption_neg_context {
 	__le16	ContextType; /* 2 */
@@ -246,6 +301,40 @@ struct smb2_encryption_neg_context {
 	__le16	Ciphers[2]; /* Ciphers[0] since only one used now */
 } __packed;
 
+/* Signing Algorithms */
+#define SIGNING_ALG_HMAC_SHA256	cpu_to_le16(0x0000)
+#define SIGNING_ALG_AES_CMAC	cpu_to_le16(0x0001)
+#define SIGNING_ALG_AES_GMAC	cpu_to_le16(0x0002)
+
+struct smb2_signing_capabilities {
+	__le16	ContextType; /* 8 */
+	__le16	DataLength;
+	__le32	Reserved;
+	__le16	SigningAlgorithmCount;
+	__le16	SigningAlgorithms[];
+} __packed;
+
+/* Compression Algorithms */
+#define SMB3_COMPRESS_NONE	cpu_to_le16(0x0000)
+#define SMB3_COMPRESS_LZNT1	cpu_to_le16(0x0001)
+#define SMB3_COMPRESS_LZ77	cpu_to_le16(0x0002)
+#define SMB3_COMPRESS_LZ77_HUFF	cpu_to_le16(0x0003)
+#define SMB3_COMPRESS_PATTERN	cpu_to_le16(0x0004) /* Pattern_V1 */
+
+/* Compression capabilities flags */
+#define SMB2_COMPRESSION_CAPABILITIES_FLAG_NONE		cpu_to_le32(0x00000000)
+#define SMB2_COMPRESSION_CAPABILITIES_FLAG_CHAINED	cpu_to_le32(0x00000001)
+
+struct smb2_compression_ctx {
+	__le16	ContextType; /* 3 */
+	__le16	DataLength;
+	__le32	Reserved;
+	__le16	CompressionAlgorithmCount;
+	__u16	Padding;
+	__le32	Flags;
+	__le16	CompressionAlgorithms[];
+} __packed;
+
 struct smb2_negotiate_rsp {
 	struct smb2_hdr hdr;
 	__le16 StructureSize;	/* Must be 65 */
@@ -351,6 +440,7 @@ struct smb2_tree_connect_rsp {
 #define SMB2_SHAREFLAG_AUTO_CACHING			0x00000010
 #define SMB2_SHAREFLAG_VDO_CACHING			0x00000020
 #define SMB2_SHAREFLAG_NO_CACHING			0x00000030
+#define SMB2_SHAREFLAG_COMPRESS_DATA			0x00100000
 #define SHI1005_FLAGS_DFS				0x00000001
 #define SHI1005_FLAGS_DFS_ROOT				0x00000002
 #define SHI1005_FLAGS_RESTRICT_EXCLUSIVE_OPENS		0x00000100
@@ -620,6 +710,7 @@ struct create_disk_id_rsp {
 #define SMB2_LEASE_WRITE_CACHING	cpu_to_le32(0x04)
 
 #define SMB2_LEASE_FLAG_BREAK_IN_PROGRESS cpu_to_le32(0x02)
+#define SMB2_LEASE_FLAG_PARENT_LEASE_KEY_SET cpu_to_le32(0x04)
 
 struct lease_context {
 	__le64 LeaseKeyLow;
@@ -635,6 +726,26 @@ struct create_lease {
 	struct lease_context lcontext;
 } __packed;
 
+/* Lease context of SMB3, needed for directory leases */
+struct lease_context_v2 {
+	__le64 LeaseKeyLow;
+	__le64 LeaseKeyHigh;
+	__le32 LeaseState;
+	__le32 LeaseFlags;
+	__le64 LeaseDuration;
+	__le64 ParentLeaseKeyLow;
+	__le64 ParentLeaseKeyHigh;
+	__le16 Epoch;
+	__le16 Reserved;
+} __packed;
+
+struct create_lease_v2 {
+	struct create_context ccontext;
+	__u8   Name[8];
+	struct lease_context_v2 lcontext;
+	__u8   Pad[4];
+} __packed;
+
 /* Currently defined values for close flags */
 #define SMB2_CLOSE_FLAG_POSTQUERY_ATTRIB	cpu_to_le16(0x0001)
 struct smb2_close_req {
@@ -675,6 +786,18 @@ struct smb2_flush_rsp {
 	__le16 Reserved;
 } __packed;
 
+/* Channel field of read and write requests */
+#define SMB2_CHANNEL_NONE		cpu_to_le32(0x00000000)
+#define SMB2_CHANNEL_RDMA_V1		cpu_to_le32(0x00000001)
+#define SMB2_CHANNEL_RDMA_V1_INVALIDATE	cpu_to_le32(0x00000002)
+
+/* Read or write channel info of an RDMA channel, one per registered buffer */
+struct smb2_buffer_desc_v1 {
+	__le64 offset;
+	__le32 token;
+	__le32 length;
+} __packed;
+
 struct smb2_read_req {
 	struct smb2_hdr hdr;
 	__le16 StructureSize; /* Must be 49 */
@@ -685,10 +808,10 @@ struct smb2_read_req {
 	__u64  PersistentFileId; /* opaque endianness */
 	__u64  VolatileFileId; /* opaque endianness */
 	__le32 MinimumCount;
-	__le32 Channel; /* Reserved MBZ */
+	__le32 Channel; /* SMB2_CHANNEL_* */
 	__le32 RemainingBytes;
-	__le16 ReadChannelInfoOffset; /* Reserved MBZ */
-	__le16 ReadChannelInfoLength; /* Reserved MBZ */
+	__le16 ReadChannelInfoOffset;
+	__le16 ReadChannelInfoLength;
 	__u8   Buffer[1];
 } __packed;
 
@@ -714,14 +837,17 @@ struct smb2_write_req {
 	__le64 Offset;
 	__u64  PersistentFileId; /* opaque endianness */
 	__u64  VolatileFileId; /* opaque endianness */
-	__le32 Channel; /* Reserved MBZ */
-	__le32 RemainingBytes;
-	__le16 WriteChannelInfoOffset; /* Reserved MBZ */
-	__le16 WriteChannelInfoLength; /* Reserved MBZ */
+	__le32 Channel; /* SMB2_CHANNEL_* */
+	__le32 RemainingBytes; /* data length of an RDMA channel */
+	__le16 WriteChannelInfoOffset;
+	__le16 WriteChannelInfoLength;
 	__le32 Flags;
 	__u8   Buffer[1];
 } __packed;
 
+/* rfc1002 length and fixed part of a write request, up to the data */
+#define SMB2_WRITE_HDR_SIZE	offsetof(struct smb2_write_req, Buffer)
+
 struct smb2_write_rsp {
 	struct smb2_hdr hdr;
 	__le16 StructureSize; /* Must be 17 */
@@ -857,6 +983,22 @@ struct file_sparse {
 	__u8	SetSparse;
 } __packed;
 
+struct duplicate_extents_to_file {
+	__le64 PersistentFileHandle; /* source file handle, opaque endianness */
+	__le64 VolatileFileHandle;
+	__le64 SourceFileOffset;
+	__le64 TargetFileOffset;
+	__le64 ByteCount;  /* Bytes to be copied */
+} __packed;
+
+/* FileFsAttributeInformation of file systems that can share extents */
+#define FILE_SUPPORTS_BLOCK_REFCOUNTING	cpu_to_le32(0x08000000)
+
+struct file_allocated_range_buffer {
+	__le64	file_offset;
+	__le64	length;
+} __packed;
+
 struct file_zero_data_information {
 	__le64	FileOffset;
 	__le64	BeyondFinalZero;
@@ -910,6 +1052,13 @@ struct smb2_notify_rsp {
 #define FILE_ACTION_MODIFIED_STREAM	0x00000008
 #define FILE_ACTION_REMOVED_BY_DELETE	0x00000009
 
+struct file_notify_information {
+	__le32 NextEntryOffset;
+	__le32 Action;
+	__le32 FileNameLength;
+	__u8   FileName[];
+} __packed;
+
 #define SMB2_LOCKFLAG_SHARED		0x0001
 #define SMB2_LOCKFLAG_EXCLUSIVE		0x0002
 #define SMB2_LOCKFLAG_UNLOCK		0x0004
@@ -1114,7 +1263,7 @@ struct smb2_oplock_break {
 struct smb2_lease_break {
 	struct smb2_hdr hdr;
 	__le16 StructureSize; /* Must be 44 */
-	__le16 Reserved;
+	__le16 Epoch;
 	__le32 Flags;
 	__u8   LeaseKey[16];
 	__le32 CurrentLeaseState;
@@ -1412,7 +1561,10 @@ extern int get_smb2_cmd_val(struct cifsd_work *work);
 extern void set_smb2_rsp_status(struct cifsd_work *work, unsigned int err);
 extern int init_smb2_rsp_hdr(struct cifsd_work *work);
 extern int smb2_allocate_rsp_buf(struct cifsd_work *work);
+extern int smb2_next_compound_cmd(char *buf, unsigned int *off);
 extern bool is_chained_smb2_message(struct cifsd_work *work);
+extern unsigned int smb2_qos_cost(struct cifsd_work *work,
+	unsigned int *nr_ios);
 extern int init_smb2_neg_rsp(struct cifsd_work *work);
 extern void smb2_set_rsp_credits(struct cifsd_work *work);
 extern void smb2_set_err_rsp(struct cifsd_work *work);
@@ -1429,15 +1581,26 @@ extern struct file_lock *smb_flock_init(struct file *f);
 extern int setup_async_work(struct cifsd_work *work, void (*fn)(void **),
 	void **arg);
 extern void smb2_send_interim_resp(struct cifsd_work *work, __le32 status);
-extern struct channel *lookup_chann_list(struct cifsd_session *sess);
+extern struct channel *lookup_chann_list(struct cifsd_session *sess,
+					 struct cifsd_tcp_conn *conn);
 extern void smb3_preauth_hash_rsp(struct cifsd_work *work);
 extern int smb3_is_transform_hdr(void *buf);
 extern int smb3_decrypt_req(struct cifsd_work *work);
 extern int smb3_encrypt_resp(struct cifsd_work *work);
+extern int smb3_encrypt_resp_done(struct cifsd_work *work);
+extern int smb3_is_compress_hdr(void *buf);
+extern int smb3_decompress_req(struct cifsd_work *work);
+extern void smb3_compress_resp(struct cifsd_work *work);
 extern int smb3_final_sess_setup_resp(struct cifsd_work *work);
+extern unsigned int smb2_bulk_write_len(char *buf);
 
 /* smb2 misc functions */
+extern int smb2_decode_req(struct smb2_hdr *hdr, unsigned int len,
+			   struct smb2_req_view *view);
 extern int cifsd_smb2_check_message(struct cifsd_work *work);
+extern void *smb2_req_area(struct cifsd_work *work, int area,
+			   unsigned int *len);
+extern int smb2_check_credit_charge(struct cifsd_work *work);
 
 /* smb2 command handlers */
 extern int smb2_handle_negotiate(struct cifsd_work *work);
@@ -4,6 +4,8 @@
  *   Copyright (C) 2018 Namjae Jeon <linkinjeon@gmail.com>
  */
 
+#include <linux/moduleparam.h>
+
 #include "smb_common.h"
 #include "server.h"
 #include "misc.h"
@@ -23,7 +25,14 @@ static const char basechars[43] = "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ_-!@#$%";
 #define CIFSD_MIN_SUPPORTED_HEADER_SIZE	(sizeof(struct smb2_hdr))
 #endif
 
+/* Byte range locks of all files, protected by global_lock_list_lock */
 LIST_HEAD(global_lock_list);
+DEFINE_SPINLOCK(global_lock_list_lock);
+
+static unsigned int max_io_size = SMB2_MAX_IO_SIZE;
+module_param(max_io_size, uint, 0444);
+MODULE_PARM_DESC(max_io_size,
+	"Largest READ and WRITE size advertised with LargeMTU, in bytes. Default: 8388608");
 
 struct smb_protocol {
 	int		index;
@@ -89,6 +98,17 @@ unsigned int cifsd_default_io_size(void)
 	return (1024 * 1024);
 }
 
+/**
+ * cifsd_max_io_size() - largest READ and WRITE payload with LargeMTU
+ *
+ * Return:	max_io_size, between the max message size and SMB2_MAX_IO_SIZE
+ */
+unsigned int cifsd_max_io_size(void)
+{
+	return clamp_t(unsigned int, max_io_size, cifsd_max_msg_size(),
+		       SMB2_MAX_IO_SIZE);
+}
+
 unsigned int cifsd_small_buffer_size(void)
 {
 	return 448;
@@ -184,6 +204,41 @@ bool cifsd_smb_request(struct cifsd_tcp_conn *conn)
 	return false;
 }
 
+/**
+ * cifsd_bulk_write_hdr_size() - get the fixed part size of a write
+ * @buf:	first CIFSD_WRITE_HDR_MIN bytes of the PDU
+ *
+ * Return:	size of the fixed part if the PDU is an SMB1 or SMB2 write,
+ *		otherwise 0
+ */
+unsigned int cifsd_bulk_write_hdr_size(char *buf)
+{
+	struct smb2_hdr *hdr = (struct smb2_hdr *)buf;
+
+	if (hdr->ProtocolId == SMB2_PROTO_NUMBER)
+		return hdr->Command == SMB2_WRITE ? SMB2_WRITE_HDR_SIZE : 0;
+
+	if (hdr->ProtocolId == SMB1_PROTO_NUMBER &&
+	    ((struct smb_hdr *)buf)->Command == SMB_COM_WRITE_ANDX)
+		return SMB1_WRITE_HDR_SIZE;
+	return 0;
+}
+
+/**
+ * cifsd_bulk_write_len() - check if write data can be received into pages
+ * @buf:	first cifsd_bulk_write_hdr_size() bytes of the PDU
+ *
+ * Return:	write data length, or 0 if the PDU must be received linearly
+ */
+unsigned int cifsd_bulk_write_len(char *buf)
+{
+	struct smb2_hdr *hdr = (struct smb2_hdr *)buf;
+
+	if (hdr->ProtocolId == SMB2_PROTO_NUMBER)
+		return smb2_bulk_write_len(buf);
+	return smb1_bulk_write_len(buf);
+}
+
 static bool supported_protocol(int idx)
 {
 	return (server_conf.min_protocol <= idx &&
@@ -314,7 +369,7 @@ int cifsd_populate_dot_dotdot_entries(struct cifsd_tcp_conn *conn,
 				      int info_level,
 				      struct cifsd_file *dir,
 				      struct cifsd_dir_info *d_info,
-				      char *search_pattern,
+				      struct cifsd_search_pattern *search_pattern,
 				      int (*fn)(struct cifsd_tcp_conn *,
 						int,
 						struct cifsd_dir_info *,
@@ -332,7 +387,8 @@ int cifsd_populate_dot_dotdot_entries(struct cifsd_tcp_conn *conn,
 			else
 				d_info->name = "..";
 
-			if (!match_pattern(d_info->name, search_pattern)) {
+			if (!cifsd_search_pattern_match(search_pattern,
+							d_info->name)) {
 				dir->dot_dotdot[i] = 1;
 				continue;
 			}
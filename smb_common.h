@@ -40,11 +40,13 @@
 #define BAD_PROT_ID		0xFFFF
 
 extern struct list_head global_lock_list;
+extern spinlock_t global_lock_list_lock;
 
 struct cifsd_work;
 struct cifsd_tcp_conn;
 struct cifsd_dir_info;
 struct cifsd_file;
+struct cifsd_search_pattern;
 struct dir_context;
 
 #define IS_SMB2(x)		((x)->vals->protocol_id != SMB10_PROT_ID)
@@ -71,6 +73,7 @@ struct smb_version_values {
 	__u16		signing_enabled;
 	__u16		signing_required;
 	size_t		create_lease_size;
+	size_t		create_lease_v2_size;
 	size_t		create_durable_size;
 	size_t		create_durable_v2_size;
 	size_t		create_mxac_size;
@@ -83,17 +86,23 @@ struct smb_version_ops {
 	void (*set_rsp_status)(struct cifsd_work *swork, unsigned int err);
 	int (*allocate_rsp_buf)(struct cifsd_work *work);
 	void (*set_rsp_credits)(struct cifsd_work *swork);
+	int (*check_credit_charge)(struct cifsd_work *work);
 	int (*check_user_session)(struct cifsd_work *work);
 	int (*get_cifsd_tcon)(struct cifsd_work *work);
+	unsigned int (*qos_cost)(struct cifsd_work *work, unsigned int *nr_ios);
 	int (*is_sign_req)(struct cifsd_work *work, unsigned int command);
 	int (*check_sign_req)(struct cifsd_work *work);
 	void (*set_sign_rsp)(struct cifsd_work *work);
-	int (*generate_signingkey)(struct cifsd_session *sess, bool binding,
-		char *hash_value);
+	int (*generate_signingkey)(struct cifsd_session *sess,
+		struct cifsd_tcp_conn *conn, bool binding, char *hash_value);
 	int (*generate_encryptionkey)(struct cifsd_session *sess);
 	int (*is_transform_hdr)(void *buf);
 	int (*decrypt_req)(struct cifsd_work *work);
 	int (*encrypt_resp)(struct cifsd_work *work);
+	int (*encrypt_resp_done)(struct cifsd_work *work);
+	int (*is_compress_hdr)(void *buf);
+	int (*decompress_req)(struct cifsd_work *work);
+	void (*compress_resp)(struct cifsd_work *work);
 };
 
 struct smb_version_cmds {
@@ -108,6 +117,16 @@ int cifsd_lookup_protocol_idx(char *str);
 int cifsd_verify_smb_message(struct cifsd_work *work);
 bool cifsd_smb_request(struct cifsd_tcp_conn *conn);
 
+/*
+ * Bytes of a large PDU read to find out if it is a write, see
+ * cifsd_bulk_write_hdr_size(), and the largest fixed part of a write.
+ */
+#define CIFSD_WRITE_HDR_MIN	sizeof(struct smb2_hdr)
+#define CIFSD_WRITE_HDR_MAX	SMB2_WRITE_HDR_SIZE
+
+unsigned int cifsd_bulk_write_hdr_size(char *buf);
+unsigned int cifsd_bulk_write_len(char *buf);
+
 int cifsd_lookup_dialect_by_id(__le16 *cli_dialects, __le16 dialects_count);
 
 int cifsd_negotiate_smb_dialect(void *buf);
@@ -120,7 +139,7 @@ int cifsd_populate_dot_dotdot_entries(struct cifsd_tcp_conn *conn,
 				      int info_level,
 				      struct cifsd_file *dir,
 				      struct cifsd_dir_info *d_info,
-				      char *search_pattern,
+				      struct cifsd_search_pattern *search_pattern,
 				      int (*fn)(struct cifsd_tcp_conn *,
 						int,
 						struct cifsd_dir_info *,
@@ -144,6 +163,7 @@ int cifsd_smb_check_shared_mode(struct file *filp, struct cifsd_file *curr_fp);
 
 unsigned int cifsd_max_msg_size(void);
 unsigned int cifsd_default_io_size(void);
+unsigned int cifsd_max_io_size(void);
 unsigned int cifsd_small_buffer_size(void);
 unsigned int cifsd_server_side_copy_max_chunk_count(void);
 unsigned int cifsd_server_side_copy_max_chunk_size(void);
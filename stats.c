@@ -0,0 +1,511 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ *   Copyright (C) 2018 Samsung Electronics Co., Ltd.
+ */
+
+#include <linux/percpu.h>
+#include <linux/ktime.h>
+
+#include "glob.h"
+#include "stats.h"
+#include "smb_common.h"
+#include "mgmt/user_session.h"
+#include "mgmt/tree_connect.h"
+#include "mgmt/share_config.h"
+
+/*
+ * Requests are accounted per command, in per-CPU counters which are only
+ * summed when sysfs is read. The SMB1 commands which are implemented
+ * get a slot each, any other command shares the last slot.
+ *
+ * The I/O of each session and share is accounted the same way, and the
+ * daemon queries the top talkers through cifsd_io_top_add().
+ */
+static bool cmd_stats_enable = true;
+module_param(cmd_stats_enable, bool, 0644);
+MODULE_PARM_DESC(cmd_stats_enable,
+	"Account per command, session and share statistics. Default: y/Y/1");
+
+static const u8 smb1_stats_cmds[] = {
+	SMB_COM_CREATE_DIRECTORY,
+	SMB_COM_DELETE_DIRECTORY,
+	SMB_COM_CLOSE,
+	SMB_COM_FLUSH,
+	SMB_COM_DELETE,
+	SMB_COM_RENAME,
+	SMB_COM_QUERY_INFORMATION,
+	SMB_COM_SETATTR,
+	SMB_COM_WRITE,
+	SMB_COM_CHECK_DIRECTORY,
+	SMB_COM_PROCESS_EXIT,
+	SMB_COM_LOCKING_ANDX,
+	SMB_COM_TRANSACTION,
+	SMB_COM_ECHO,
+	SMB_COM_OPEN_ANDX,
+	SMB_COM_READ_ANDX,
+	SMB_COM_WRITE_ANDX,
+	SMB_COM_TRANSACTION2,
+	SMB_COM_FIND_CLOSE2,
+	SMB_COM_TREE_DISCONNECT,
+	SMB_COM_NEGOTIATE,
+	SMB_COM_SESSION_SETUP_ANDX,
+	SMB_COM_LOGOFF_ANDX,
+	SMB_COM_TREE_CONNECT_ANDX,
+	SMB_COM_NT_CREATE_ANDX,
+	SMB_COM_NT_CANCEL,
+	SMB_COM_NT_RENAME,
+};
+
+#define STATS_SMB1_SLOT		NUMBER_OF_SMB2_COMMANDS
+#define STATS_OTHER_SLOT	(STATS_SMB1_SLOT + ARRAY_SIZE(smb1_stats_cmds))
+#define STATS_NR_SLOTS		(STATS_OTHER_SLOT + 1)
+
+/* log2 of the latency in microseconds, the last bucket takes the rest */
+#define STATS_NR_BUCKETS	24
+#define STATS_BUCKET_SHIFT	10
+
+struct cifsd_cmd_stats {
+	u64	count;
+	u64	errors;
+	u64	ns[CIFSD_STATS_NR_PHASES];
+	u32	hist[CIFSD_STATS_NR_PHASES][STATS_NR_BUCKETS];
+};
+
+struct cifsd_cmd_stats_set {
+	struct cifsd_cmd_stats	slot[STATS_NR_SLOTS];
+};
+
+static struct cifsd_cmd_stats_set __percpu *cmd_stats;
+static u8 smb1_stats_slot[256];
+/* CIFSD_IO_OP_* of the commands of a slot */
+static u8 stats_slot_io_op[STATS_NR_SLOTS];
+
+static const char * const phase_names[CIFSD_STATS_NR_PHASES] = {
+	[CIFSD_STATS_QUEUE]	= "queue",
+	[CIFSD_STATS_PROCESS]	= "process",
+	[CIFSD_STATS_SEND]	= "send",
+};
+
+static unsigned int stats_slot(struct cifsd_work *work, unsigned int command)
+{
+	struct smb2_hdr *hdr = REQUEST_BUF(work);
+
+	if (hdr->ProtocolId == SMB2_PROTO_NUMBER) {
+		if (command < NUMBER_OF_SMB2_COMMANDS)
+			return command;
+		return STATS_OTHER_SLOT;
+	}
+
+	if (command < ARRAY_SIZE(smb1_stats_slot))
+		return smb1_stats_slot[command];
+	return STATS_OTHER_SLOT;
+}
+
+static unsigned int smb2_io_op(unsigned int command)
+{
+	switch (command) {
+	case SMB2_READ_HE:
+		return CIFSD_IO_OP_READ;
+	case SMB2_WRITE_HE:
+		return CIFSD_IO_OP_WRITE;
+	case SMB2_CREATE_HE:
+	case SMB2_CLOSE_HE:
+	case SMB2_QUERY_DIRECTORY_HE:
+	case SMB2_QUERY_INFO_HE:
+	case SMB2_SET_INFO_HE:
+		return CIFSD_IO_OP_META;
+	}
+	return CIFSD_IO_OP_OTHER;
+}
+
+static unsigned int smb1_io_op(unsigned int command)
+{
+	switch (command) {
+	case SMB_COM_READ_ANDX:
+		return CIFSD_IO_OP_READ;
+	case SMB_COM_WRITE:
+	case SMB_COM_WRITE_ANDX:
+		return CIFSD_IO_OP_WRITE;
+	case SMB_COM_CREATE_DIRECTORY:
+	case SMB_COM_DELETE_DIRECTORY:
+	case SMB_COM_CLOSE:
+	case SMB_COM_DELETE:
+	case SMB_COM_RENAME:
+	case SMB_COM_QUERY_INFORMATION:
+	case SMB_COM_SETATTR:
+	case SMB_COM_CHECK_DIRECTORY:
+	case SMB_COM_OPEN_ANDX:
+	case SMB_COM_TRANSACTION2:
+	case SMB_COM_FIND_CLOSE2:
+	case SMB_COM_NT_CREATE_ANDX:
+	case SMB_COM_NT_RENAME:
+		return CIFSD_IO_OP_META;
+	}
+	return CIFSD_IO_OP_OTHER;
+}
+
+static struct cifsd_share_config *stats_work_share(struct cifsd_work *work)
+{
+	return work->tcon ? work->tcon->share_conf : NULL;
+}
+
+static bool stats_nt_error(__le32 status)
+{
+	/* severity STATUS_SEVERITY_ERROR, warnings are not failures */
+	return (le32_to_cpu(status) >> 30) == 3;
+}
+
+static bool stats_rsp_failed(struct cifsd_work *work)
+{
+	struct smb2_hdr *rsp = RESPONSE_BUF(work);
+	struct smb_hdr *smb_rsp = RESPONSE_BUF(work);
+
+	if (rsp->ProtocolId == SMB2_PROTO_NUMBER) {
+		if (work->next_smb2_rcv_hdr_off)
+			rsp = (struct smb2_hdr *)((char *)rsp +
+					work->next_smb2_rsp_hdr_off);
+		return stats_nt_error(rsp->Status);
+	}
+
+	if (smb_rsp->Flags2 & SMBFLG2_ERR_STATUS)
+		return stats_nt_error(smb_rsp->Status.CifsError);
+	return smb_rsp->Status.DosError.ErrorClass != 0;
+}
+
+static void stats_add(struct cifsd_cmd_stats *st, int phase, u64 start)
+{
+	u64 ns = ktime_get_ns() - start;
+	u64 us = ns >> STATS_BUCKET_SHIFT;
+	unsigned int bucket = us ? fls64(us) : 0;
+
+	st->ns[phase] += ns;
+	st->hist[phase][min_t(unsigned int, bucket, STATS_NR_BUCKETS - 1)]++;
+}
+
+/**
+ * cifsd_stats_clock() - start of a phase of a request
+ *
+ * Return:	timestamp, 0 if accounting is disabled
+ */
+u64 cifsd_stats_clock(void)
+{
+	if (!cmd_stats_enable || !cmd_stats)
+		return 0;
+	return ktime_get_ns();
+}
+
+/**
+ * cifsd_stats_phase() - account a phase of a request to a command
+ * @work:	smb work of the request
+ * @command:	command the phase is accounted to
+ * @phase:	CIFSD_STATS_QUEUE or CIFSD_STATS_SEND
+ * @start:	cifsd_stats_clock() at the start of the phase
+ */
+void cifsd_stats_phase(struct cifsd_work *work, unsigned int command,
+		       int phase, u64 start)
+{
+	struct cifsd_cmd_stats_set *set;
+
+	if (!start)
+		return;
+
+	set = get_cpu_ptr(cmd_stats);
+	stats_add(&set->slot[stats_slot(work, command)], phase, start);
+	put_cpu_ptr(cmd_stats);
+}
+
+/**
+ * cifsd_stats_command() - account the processing of a command
+ * @work:	smb work, with the response of the command
+ * @command:	processed command
+ * @start:	cifsd_stats_clock() before the command was processed
+ * @ret:	return value of the command handler
+ *
+ * A command fails if its handler returns an error, or the status of
+ * its response is an error. An asynchronous command is accounted up to
+ * its interim response.
+ */
+void cifsd_stats_command(struct cifsd_work *work, unsigned int command,
+			 u64 start, int ret)
+{
+	struct cifsd_share_config *share = stats_work_share(work);
+	struct cifsd_cmd_stats_set *set;
+	struct cifsd_cmd_stats *st;
+	unsigned int slot;
+	bool failed;
+
+	if (!start)
+		return;
+
+	failed = ret < 0 || stats_rsp_failed(work);
+	slot = stats_slot(work, command);
+	set = get_cpu_ptr(cmd_stats);
+	st = &set->slot[slot];
+	st->count++;
+	if (failed)
+		st->errors++;
+	stats_add(st, CIFSD_STATS_PROCESS, start);
+	put_cpu_ptr(cmd_stats);
+
+	if (work->sess)
+		this_cpu_inc(work->sess->io_stats->ops[stats_slot_io_op[slot]]);
+	if (share)
+		this_cpu_inc(share->io_stats->ops[stats_slot_io_op[slot]]);
+}
+
+/**
+ * cifsd_stats_io() - account file data read or written by a request
+ * @work:	smb work of the request
+ * @write:	written, otherwise read
+ * @nbytes:	bytes transferred, or error
+ * @start:	cifsd_stats_clock() before the VFS was called
+ */
+void cifsd_stats_io(struct cifsd_work *work, bool write, ssize_t nbytes,
+		    u64 start)
+{
+	struct cifsd_share_config *share = stats_work_share(work);
+	struct cifsd_io_stats __percpu *st[2];
+	u64 ns;
+	int i;
+
+	if (!start)
+		return;
+
+	ns = ktime_get_ns() - start;
+	st[0] = work->sess ? work->sess->io_stats : NULL;
+	st[1] = share ? share->io_stats : NULL;
+	for (i = 0; i < ARRAY_SIZE(st); i++) {
+		if (!st[i])
+			continue;
+
+		this_cpu_add(st[i]->vfs_ns, ns);
+		if (nbytes <= 0)
+			continue;
+		if (write)
+			this_cpu_add(st[i]->bytes_written, nbytes);
+		else
+			this_cpu_add(st[i]->bytes_read, nbytes);
+	}
+}
+
+struct cifsd_io_stats __percpu *cifsd_io_stats_alloc(void)
+{
+	return alloc_percpu(struct cifsd_io_stats);
+}
+
+void cifsd_io_stats_free(struct cifsd_io_stats __percpu *st)
+{
+	free_percpu(st);
+}
+
+static u64 io_top_key(struct cifsd_io_top *top,
+		      struct cifsd_io_stats_entry *e)
+{
+	u64 key = 0;
+	int i;
+
+	switch (top->sort) {
+	case CIFSD_IO_STATS_SORT_OPS:
+		for (i = 0; i < CIFSD_IO_NR_OPS; i++)
+			key += e->ops[i];
+		return key;
+	case CIFSD_IO_STATS_SORT_VFS_TIME:
+		return e->vfs_ns;
+	}
+	return e->bytes_read + e->bytes_written;
+}
+
+/**
+ * cifsd_io_top_add() - offer a session or share to a top-N collection
+ * @top:	collection, entries sorted by the key of @top->sort
+ * @session_id:	session id, 0 for a share
+ * @name:	share name, NULL for a session
+ * @st:		I/O stats of the session or share
+ *
+ * Entries are kept sorted by insertion, which is cheap for the few
+ * entries userspace asks for. Must not sleep, sessions are walked under
+ * rcu_read_lock().
+ */
+void cifsd_io_top_add(struct cifsd_io_top *top, u64 session_id,
+		      const char *name, struct cifsd_io_stats __percpu *st)
+{
+	struct cifsd_io_stats_entry e = {0};
+	struct cifsd_io_stats *pcpu;
+	unsigned int pos;
+	u64 key;
+	int cpu, i;
+
+	if (!top->max || !st)
+		return;
+
+	e.session_id = session_id;
+	if (name)
+		strscpy((char *)e.name, name, sizeof(e.name));
+	for_each_possible_cpu(cpu) {
+		pcpu = per_cpu_ptr(st, cpu);
+		e.bytes_read += pcpu->bytes_read;
+		e.bytes_written += pcpu->bytes_written;
+		e.vfs_ns += pcpu->vfs_ns;
+		for (i = 0; i < CIFSD_IO_NR_OPS; i++)
+			e.ops[i] += pcpu->ops[i];
+	}
+
+	key = io_top_key(top, &e);
+	for (pos = 0; pos < top->nr; pos++) {
+		if (key > io_top_key(top, &top->entries[pos]))
+			break;
+	}
+	if (pos == top->max)
+		return;
+
+	if (top->nr < top->max)
+		top->nr++;
+	memmove(&top->entries[pos + 1], &top->entries[pos],
+		(top->nr - pos - 1) * sizeof(struct cifsd_io_stats_entry));
+	top->entries[pos] = e;
+}
+
+static void stats_sum_slot(unsigned int slot, struct cifsd_cmd_stats *sum)
+{
+	struct cifsd_cmd_stats *st;
+	int cpu, phase, i;
+
+	memset(sum, 0, sizeof(struct cifsd_cmd_stats));
+	for_each_possible_cpu(cpu) {
+		st = &per_cpu_ptr(cmd_stats, cpu)->slot[slot];
+		sum->count += st->count;
+		sum->errors += st->errors;
+		for (phase = 0; phase < CIFSD_STATS_NR_PHASES; phase++) {
+			sum->ns[phase] += st->ns[phase];
+			for (i = 0; i < STATS_NR_BUCKETS; i++)
+				sum->hist[phase][i] += st->hist[phase][i];
+		}
+	}
+}
+
+static bool stats_slot_used(struct cifsd_cmd_stats *sum)
+{
+	int phase;
+
+	for (phase = 0; phase < CIFSD_STATS_NR_PHASES; phase++) {
+		if (sum->ns[phase])
+			return true;
+	}
+	return sum->count != 0;
+}
+
+static ssize_t stats_slot_name(unsigned int slot, char *buf, size_t size)
+{
+	if (slot < STATS_SMB1_SLOT)
+		return scnprintf(buf, size, "smb2 0x%02x", slot);
+	if (slot < STATS_OTHER_SLOT)
+		return scnprintf(buf, size, "smb1 0x%02x",
+				 smb1_stats_cmds[slot - STATS_SMB1_SLOT]);
+	return scnprintf(buf, size, "other -");
+}
+
+/**
+ * cifsd_cmd_stats() - print the counters of the commands
+ * @buf:	output buffer
+ * @size:	size of @buf
+ *
+ * A line per command seen: dialect, command code, requests, failed
+ * requests and the total queue, process and send time in nanoseconds.
+ *
+ * Return:	number of bytes written to @buf
+ */
+ssize_t cifsd_cmd_stats(char *buf, size_t size)
+{
+	struct cifsd_cmd_stats sum;
+	unsigned int slot;
+	ssize_t sz = 0;
+
+	if (!cmd_stats)
+		return 0;
+
+	for (slot = 0; slot < STATS_NR_SLOTS; slot++) {
+		stats_sum_slot(slot, &sum);
+		if (!stats_slot_used(&sum))
+			continue;
+
+		sz += stats_slot_name(slot, buf + sz, size - sz);
+		sz += scnprintf(buf + sz, size - sz,
+				" %llu %llu %llu %llu %llu\n",
+				sum.count, sum.errors,
+				sum.ns[CIFSD_STATS_QUEUE],
+				sum.ns[CIFSD_STATS_PROCESS],
+				sum.ns[CIFSD_STATS_SEND]);
+	}
+	return sz;
+}
+
+/**
+ * cifsd_cmd_latency_stats() - print the latency histograms of the commands
+ * @buf:	output buffer
+ * @size:	size of @buf
+ *
+ * A line per command seen and phase: dialect, command code, phase and
+ * bucket:count for the buckets which are not empty. Bucket 0 counts
+ * latencies below 1us, bucket n those from 2^(n-1)us up to 2^n us.
+ *
+ * Return:	number of bytes written to @buf
+ */
+ssize_t cifsd_cmd_latency_stats(char *buf, size_t size)
+{
+	struct cifsd_cmd_stats sum;
+	unsigned int slot;
+	ssize_t sz = 0;
+	int phase, i;
+
+	if (!cmd_stats)
+		return 0;
+
+	for (slot = 0; slot < STATS_NR_SLOTS; slot++) {
+		stats_sum_slot(slot, &sum);
+		if (!stats_slot_used(&sum))
+			continue;
+
+		for (phase = 0; phase < CIFSD_STATS_NR_PHASES; phase++) {
+			if (!sum.ns[phase])
+				continue;
+
+			sz += stats_slot_name(slot, buf + sz, size - sz);
+			sz += scnprintf(buf + sz, size - sz, " %s",
+					phase_names[phase]);
+			for (i = 0; i < STATS_NR_BUCKETS; i++) {
+				if (!sum.hist[phase][i])
+					continue;
+				sz += scnprintf(buf + sz, size - sz, " %d:%u",
+						i, sum.hist[phase][i]);
+			}
+			sz += scnprintf(buf + sz, size - sz, "\n");
+		}
+	}
+	return sz;
+}
+
+int cifsd_stats_init(void)
+{
+	unsigned int i;
+
+	memset(smb1_stats_slot, STATS_OTHER_SLOT, sizeof(smb1_stats_slot));
+	for (i = 0; i < ARRAY_SIZE(smb1_stats_cmds); i++) {
+		smb1_stats_slot[smb1_stats_cmds[i]] = STATS_SMB1_SLOT + i;
+		stats_slot_io_op[STATS_SMB1_SLOT + i] =
+			smb1_io_op(smb1_stats_cmds[i]);
+	}
+	for (i = 0; i < STATS_SMB1_SLOT; i++)
+		stats_slot_io_op[i] = smb2_io_op(i);
+	stats_slot_io_op[STATS_OTHER_SLOT] = CIFSD_IO_OP_OTHER;
+
+	cmd_stats = alloc_percpu(struct cifsd_cmd_stats_set);
+	if (!cmd_stats)
+		return -ENOMEM;
+	return 0;
+}
+
+void cifsd_stats_destroy(void)
+{
+	free_percpu(cmd_stats);
+	cmd_stats = NULL;
+}
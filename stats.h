@@ -0,0 +1,65 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ *   Copyright (C) 2018 Samsung Electronics Co., Ltd.
+ */
+
+#ifndef __CIFSD_STATS_H__
+#define __CIFSD_STATS_H__
+
+#include <linux/types.h>
+
+#include "cifsd_server.h"
+
+struct cifsd_work;
+
+/*
+ * Phases of a request: from being received to the start of its
+ * processing, including the QoS wait, the processing of each command,
+ * and signing or encrypting and writing the response.
+ */
+enum {
+	CIFSD_STATS_QUEUE,
+	CIFSD_STATS_PROCESS,
+	CIFSD_STATS_SEND,
+	CIFSD_STATS_NR_PHASES,
+};
+
+u64 cifsd_stats_clock(void);
+void cifsd_stats_phase(struct cifsd_work *work, unsigned int command,
+		       int phase, u64 start);
+void cifsd_stats_command(struct cifsd_work *work, unsigned int command,
+			 u64 start, int ret);
+
+/*
+ * I/O of a session or a share, per-CPU. Bytes and VFS time are those of
+ * file data reads and writes, ops are all commands by CIFSD_IO_OP_*.
+ */
+struct cifsd_io_stats {
+	u64	bytes_read;
+	u64	bytes_written;
+	u64	ops[CIFSD_IO_NR_OPS];
+	u64	vfs_ns;
+};
+
+/* Top-N collection of cifsd_io_stats, see cifsd_io_top_add() */
+struct cifsd_io_top {
+	unsigned int			sort;
+	unsigned int			max;
+	unsigned int			nr;
+	struct cifsd_io_stats_entry	*entries;
+};
+
+struct cifsd_io_stats __percpu *cifsd_io_stats_alloc(void);
+void cifsd_io_stats_free(struct cifsd_io_stats __percpu *st);
+void cifsd_stats_io(struct cifsd_work *work, bool write, ssize_t nbytes,
+		    u64 start);
+void cifsd_io_top_add(struct cifsd_io_top *top, u64 session_id,
+		      const char *name, struct cifsd_io_stats __percpu *st);
+
+ssize_t cifsd_cmd_stats(char *buf, size_t size);
+ssize_t cifsd_cmd_latency_stats(char *buf, size_t size);
+
+int cifsd_stats_init(void);
+void cifsd_stats_destroy(void);
+
+#endif /* __CIFSD_STATS_H__ */
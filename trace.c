@@ -0,0 +1,128 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ *   Copyright (C) 2018 Samsung Electronics Co., Ltd.
+ */
+
+#include <asm-generic/unaligned.h>
+
+#include "glob.h"
+#include "smb_common.h"
+#include "oplock.h"
+#include "transport_tcp.h"
+#include "mgmt/user_session.h"
+
+static u64 trace_sess_id(struct cifsd_session *sess)
+{
+	return sess ? sess->id : 0;
+}
+
+/* Header of the current command of a compound */
+static void *trace_req_hdr(struct cifsd_work *work)
+{
+	return (char *)REQUEST_BUF(work) + work->next_smb2_rcv_hdr_off;
+}
+
+static u64 trace_msg_id(void *buf)
+{
+	struct smb2_hdr *hdr = buf;
+
+	if (hdr->ProtocolId == SMB2_PROTO_NUMBER)
+		return le64_to_cpu(hdr->MessageId);
+	return le16_to_cpu(((struct smb_hdr *)buf)->Mid);
+}
+
+static unsigned int trace_cmd(void *buf)
+{
+	struct smb2_hdr *hdr = buf;
+
+	if (hdr->ProtocolId == SMB2_PROTO_NUMBER)
+		return le16_to_cpu(hdr->Command);
+	return ((struct smb_hdr *)buf)->Command;
+}
+
+static void trace_zero_tail(u8 *pdu, unsigned int len, unsigned int from,
+			    unsigned int to)
+{
+	to = min(to, len);
+	if (from < to)
+		memset(pdu + from, 0, to - from);
+}
+
+/*
+ * Keep the headers and fixed parts a replay needs, but not signatures,
+ * security blobs, passwords or file data.
+ */
+static void trace_redact_smb2(u8 *pdu, unsigned int len)
+{
+	unsigned int off = 0, next, fixed;
+	struct smb2_hdr *hdr;
+
+	while (off + sizeof(struct smb2_hdr) + 2 <= len) {
+		hdr = (struct smb2_hdr *)(pdu + off);
+		memset(hdr->Signature, 0, sizeof(hdr->Signature));
+		next = le32_to_cpu(hdr->NextCommand);
+
+		switch (le16_to_cpu(hdr->Command)) {
+		case SMB2_SESSION_SETUP_HE:
+		case SMB2_WRITE_HE:
+		case SMB2_IOCTL_HE:
+		case SMB2_SET_INFO_HE:
+			fixed = sizeof(struct smb2_hdr) +
+				(get_unaligned_le16(hdr + 1) & ~1);
+			trace_zero_tail(pdu, len, off + fixed,
+					next ? off + next : len);
+			break;
+		}
+
+		if (!next || off + next <= off)
+			break;
+		off += next;
+	}
+}
+
+static void trace_redact_smb1(u8 *pdu, unsigned int len)
+{
+	struct smb_hdr *hdr = (struct smb_hdr *)pdu;
+
+	if (len < sizeof(struct smb_hdr))
+		return;
+
+	memset(hdr->Signature.SecuritySignature, 0,
+	       sizeof(hdr->Signature.SecuritySignature));
+	switch (hdr->Command) {
+	case SMB_COM_SESSION_SETUP_ANDX:
+	case SMB_COM_TREE_CONNECT_ANDX:
+	case SMB_COM_WRITE_ANDX:
+	case SMB_COM_WRITE:
+		/* parameter words and ByteCount are kept */
+		trace_zero_tail(pdu, len,
+				sizeof(struct smb_hdr) + hdr->WordCount * 2 + 2,
+				len);
+		break;
+	}
+}
+
+static void trace_redact_pdu(u8 *pdu, unsigned int len)
+{
+	__le32 proto;
+
+	if (len < 8)
+		return;
+
+	proto = ((struct smb2_hdr *)pdu)->ProtocolId;
+	if (proto == SMB2_PROTO_NUMBER)
+		trace_redact_smb2(pdu, len);
+	else if (proto == SMB1_PROTO_NUMBER)
+		trace_redact_smb1(pdu, len);
+	else if (proto == SMB2_TRANSFORM_PROTO_NUM)
+		trace_zero_tail(pdu, len, sizeof(struct smb2_transform_hdr),
+				len);
+	else if (proto == SMB2_COMPRESSION_TRANSFORM_ID)
+		trace_zero_tail(pdu, len, sizeof(struct smb2_compression_hdr),
+				len);
+	else
+		trace_zero_tail(pdu, len, 4, len);
+}
+
+#define CREATE_TRACE_POINTS
+#include "trace.h"
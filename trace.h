@@ -0,0 +1,277 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ *   Copyright (C) 2018 Samsung Electronics Co., Ltd.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM cifsd
+
+#if !defined(_CIFSD_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _CIFSD_TRACE_H
+
+#include <linux/tracepoint.h>
+
+struct cifsd_tcp_conn;
+struct cifsd_work;
+struct cifsd_file;
+struct oplock_info;
+
+/*
+ * The events are defined in trace.c, which knows the structures. Message
+ * ids and commands are those of the SMB2 header, or the SMB1 Mid and
+ * command, and session ids are 0 before a session is looked up.
+ */
+
+TRACE_EVENT(cifsd_pdu_recv,
+	TP_PROTO(struct cifsd_tcp_conn *conn, unsigned int len),
+	TP_ARGS(conn, len),
+	TP_STRUCT__entry(
+		__field(void *, conn)
+		__field(unsigned int, len)
+	),
+	TP_fast_assign(
+		__entry->conn = conn;
+		__entry->len = len;
+	),
+	TP_printk("conn=%p len=%u", __entry->conn, __entry->len)
+);
+
+/*
+ * Start of a received PDU, redacted in trace.c, for replaying a load.
+ * @len of @pdu_len bytes are recorded, the rest is in request pages or
+ * beyond pdu_capture_max.
+ */
+TRACE_EVENT(cifsd_pdu_capture,
+	TP_PROTO(struct cifsd_tcp_conn *conn, const void *buf,
+		 unsigned int len, unsigned int pdu_len),
+	TP_ARGS(conn, buf, len, pdu_len),
+	TP_STRUCT__entry(
+		__field(void *, conn)
+		__field(unsigned int, pdu_len)
+		__dynamic_array(u8, pdu, len)
+	),
+	TP_fast_assign(
+		__entry->conn = conn;
+		__entry->pdu_len = pdu_len;
+		memcpy(__get_dynamic_array(pdu), buf, len);
+		trace_redact_pdu(__get_dynamic_array(pdu), len);
+	),
+	TP_printk("conn=%p len=%u captured=%u", __entry->conn,
+		  __entry->pdu_len, __get_dynamic_array_len(pdu))
+);
+
+TRACE_EVENT(cifsd_work_queue,
+	TP_PROTO(struct cifsd_work *work, int cpu),
+	TP_ARGS(work, cpu),
+	TP_STRUCT__entry(
+		__field(void *, conn)
+		__field(void *, work)
+		__field(unsigned int, len)
+		__field(int, cpu)
+	),
+	TP_fast_assign(
+		__entry->conn = work->conn;
+		__entry->work = work;
+		__entry->len = get_rfc1002_length(REQUEST_BUF(work));
+		__entry->cpu = cpu;
+	),
+	TP_printk("conn=%p work=%p len=%u cpu=%d",
+		  __entry->conn, __entry->work, __entry->len, __entry->cpu)
+);
+
+DECLARE_EVENT_CLASS(cifsd_cmd_class,
+	TP_PROTO(struct cifsd_work *work, unsigned int command, int ret),
+	TP_ARGS(work, command, ret),
+	TP_STRUCT__entry(
+		__field(void *, work)
+		__field(u64, sess_id)
+		__field(u64, msg_id)
+		__field(unsigned int, command)
+		__field(unsigned int, len)
+		__field(int, ret)
+	),
+	TP_fast_assign(
+		__entry->work = work;
+		__entry->sess_id = trace_sess_id(work->sess);
+		__entry->msg_id = trace_msg_id(trace_req_hdr(work));
+		__entry->command = command;
+		__entry->len = get_rfc1002_length(REQUEST_BUF(work));
+		__entry->ret = ret;
+	),
+	TP_printk("work=%p sess=0x%llx mid=%llu cmd=0x%x len=%u ret=%d",
+		  __entry->work, __entry->sess_id, __entry->msg_id,
+		  __entry->command, __entry->len, __entry->ret)
+);
+
+DEFINE_EVENT(cifsd_cmd_class, cifsd_cmd_start,
+	TP_PROTO(struct cifsd_work *work, unsigned int command, int ret),
+	TP_ARGS(work, command, ret));
+
+DEFINE_EVENT(cifsd_cmd_class, cifsd_cmd_done,
+	TP_PROTO(struct cifsd_work *work, unsigned int command, int ret),
+	TP_ARGS(work, command, ret));
+
+TRACE_EVENT(cifsd_rsp_send,
+	TP_PROTO(struct cifsd_work *work, size_t len, int ret),
+	TP_ARGS(work, len, ret),
+	TP_STRUCT__entry(
+		__field(void *, work)
+		__field(u64, sess_id)
+		__field(u64, msg_id)
+		__field(unsigned int, command)
+		__field(size_t, len)
+		__field(int, ret)
+	),
+	TP_fast_assign(
+		__entry->work = work;
+		__entry->sess_id = trace_sess_id(work->sess);
+		__entry->msg_id = trace_msg_id(RESPONSE_BUF(work));
+		__entry->command = trace_cmd(RESPONSE_BUF(work));
+		__entry->len = len;
+		__entry->ret = ret;
+	),
+	TP_printk("work=%p sess=0x%llx mid=%llu cmd=0x%x len=%zu ret=%d",
+		  __entry->work, __entry->sess_id, __entry->msg_id,
+		  __entry->command, __entry->len, __entry->ret)
+);
+
+TRACE_EVENT(cifsd_vfs_open,
+	TP_PROTO(struct cifsd_work *work, struct cifsd_file *fp),
+	TP_ARGS(work, fp),
+	TP_STRUCT__entry(
+		__field(u64, sess_id)
+		__field(u64, fid)
+		__field(unsigned int, flags)
+		__string(name, FP_FILENAME(fp))
+	),
+	TP_fast_assign(
+		__entry->sess_id = trace_sess_id(work->sess);
+		__entry->fid = fp->volatile_id;
+		__entry->flags = fp->filp->f_flags;
+		__assign_str(name, FP_FILENAME(fp));
+	),
+	TP_printk("sess=0x%llx fid=%llu flags=0x%x name=%s",
+		  __entry->sess_id, __entry->fid, __entry->flags,
+		  __get_str(name))
+);
+
+DECLARE_EVENT_CLASS(cifsd_vfs_io_class,
+	TP_PROTO(struct cifsd_work *work, struct cifsd_file *fp, loff_t pos,
+		 size_t count, ssize_t ret),
+	TP_ARGS(work, fp, pos, count, ret),
+	TP_STRUCT__entry(
+		__field(u64, sess_id)
+		__field(u64, fid)
+		__field(loff_t, pos)
+		__field(size_t, count)
+		__field(ssize_t, ret)
+	),
+	TP_fast_assign(
+		__entry->sess_id = trace_sess_id(work->sess);
+		__entry->fid = fp->volatile_id;
+		__entry->pos = pos;
+		__entry->count = count;
+		__entry->ret = ret;
+	),
+	TP_printk("sess=0x%llx fid=%llu pos=%lld count=%zu ret=%zd",
+		  __entry->sess_id, __entry->fid, __entry->pos,
+		  __entry->count, __entry->ret)
+);
+
+DEFINE_EVENT(cifsd_vfs_io_class, cifsd_vfs_read,
+	TP_PROTO(struct cifsd_work *work, struct cifsd_file *fp, loff_t pos,
+		 size_t count, ssize_t ret),
+	TP_ARGS(work, fp, pos, count, ret));
+
+DEFINE_EVENT(cifsd_vfs_io_class, cifsd_vfs_write,
+	TP_PROTO(struct cifsd_work *work, struct cifsd_file *fp, loff_t pos,
+		 size_t count, ssize_t ret),
+	TP_ARGS(work, fp, pos, count, ret));
+
+TRACE_EVENT(cifsd_oplock_break_send,
+	TP_PROTO(struct oplock_info *opinfo),
+	TP_ARGS(opinfo),
+	TP_STRUCT__entry(
+		__field(u64, sess_id)
+		__field(u64, fid)
+		__field(int, level)
+		__field(bool, is_lease)
+		__field(unsigned int, lease_state)
+	),
+	TP_fast_assign(
+		__entry->sess_id = trace_sess_id(opinfo->sess);
+		__entry->fid = opinfo->fid;
+		__entry->level = opinfo->level;
+		__entry->is_lease = opinfo->is_lease;
+		__entry->lease_state = opinfo->is_lease ?
+			le32_to_cpu(opinfo->o_lease->state) : 0;
+	),
+	TP_printk("sess=0x%llx fid=%llu level=%d lease=%d state=0x%x",
+		  __entry->sess_id, __entry->fid, __entry->level,
+		  __entry->is_lease, __entry->lease_state)
+);
+
+TRACE_EVENT(cifsd_oplock_break_ack,
+	TP_PROTO(struct cifsd_work *work, bool is_lease, __le32 status),
+	TP_ARGS(work, is_lease, status),
+	TP_STRUCT__entry(
+		__field(u64, sess_id)
+		__field(u64, msg_id)
+		__field(bool, is_lease)
+		__field(unsigned int, status)
+	),
+	TP_fast_assign(
+		__entry->sess_id = trace_sess_id(work->sess);
+		__entry->msg_id = trace_msg_id(trace_req_hdr(work));
+		__entry->is_lease = is_lease;
+		__entry->status = le32_to_cpu(status);
+	),
+	TP_printk("sess=0x%llx mid=%llu lease=%d status=0x%x",
+		  __entry->sess_id, __entry->msg_id, __entry->is_lease,
+		  __entry->status)
+);
+
+TRACE_EVENT(cifsd_ipc_upcall_start,
+	TP_PROTO(unsigned int type, unsigned int handle, unsigned int sz),
+	TP_ARGS(type, handle, sz),
+	TP_STRUCT__entry(
+		__field(unsigned int, type)
+		__field(unsigned int, handle)
+		__field(unsigned int, sz)
+	),
+	TP_fast_assign(
+		__entry->type = type;
+		__entry->handle = handle;
+		__entry->sz = sz;
+	),
+	TP_printk("type=%u handle=%u sz=%u",
+		  __entry->type, __entry->handle, __entry->sz)
+);
+
+TRACE_EVENT(cifsd_ipc_upcall_done,
+	TP_PROTO(unsigned int type, unsigned int handle, int ret,
+		 bool response),
+	TP_ARGS(type, handle, ret, response),
+	TP_STRUCT__entry(
+		__field(unsigned int, type)
+		__field(unsigned int, handle)
+		__field(int, ret)
+		__field(bool, response)
+	),
+	TP_fast_assign(
+		__entry->type = type;
+		__entry->handle = handle;
+		__entry->ret = ret;
+		__entry->response = response;
+	),
+	TP_printk("type=%u handle=%u ret=%d response=%d",
+		  __entry->type, __entry->handle, __entry->ret,
+		  __entry->response)
+);
+
+#endif /* _CIFSD_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#define TRACE_INCLUDE_FILE trace
+#include <trace/define_trace.h>
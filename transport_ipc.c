@@ -5,10 +5,12 @@
 
 #include <linux/jhash.h>
 #include <linux/slab.h>
-#include <linux/rwsem.h>
+#include <linux/spinlock.h>
 #include <linux/mutex.h>
 #include <linux/wait.h>
 #include <linux/hashtable.h>
+#include <linux/moduleparam.h>
+#include <linux/string.h>
 #include <net/net_namespace.h>
 #include <net/genetlink.h>
 #include <linux/socket.h>
@@ -24,17 +26,61 @@
 #include "mgmt/user_session.h"
 #include "mgmt/tree_connect.h"
 #include "mgmt/cifsd_ida.h"
+#include "trace.h"
 
 /* @FIXME fix this code */
 extern int get_protocol_idx(char *str);
 
 #define IPC_WAIT_TIMEOUT	(2 * HZ)
 
-#define IPC_MSG_HASH_BITS	3
-static DEFINE_HASHTABLE(ipc_msg_table, IPC_MSG_HASH_BITS);
-static DECLARE_RWSEM(ipc_msg_table_lock);
+/*
+ * Requests waiting for the daemon, hashed by handle. Each bucket has its
+ * own lock so that concurrent upcalls don't serialize on the table.
+ */
+#define IPC_MSG_HASH_BITS	6
+static struct ipc_msg_bucket {
+	spinlock_t		lock;
+	struct hlist_head	head;
+} ipc_msg_table[1 << IPC_MSG_HASH_BITS];
 static DEFINE_MUTEX(startup_lock);
 
+/* Handle of requests sent without waiting, the ida never hands it out */
+#define CIFSD_IPC_NO_HANDLE	((unsigned int)-1)
+
+/*
+ * Successful login and tree connect responses are kept for
+ * ipc_cache_ttl seconds, so that a logon storm doesn't queue every
+ * session setup and tree connect behind the daemon. The daemon drops
+ * the entries of changed users and shares with
+ * CIFSD_EVENT_CACHE_INVALIDATE.
+ */
+static unsigned int ipc_cache_ttl;
+module_param(ipc_cache_ttl, uint, 0644);
+MODULE_PARM_DESC(ipc_cache_ttl,
+	"Seconds login and tree connect results are cached, 0 to disable. Default: 0");
+
+#define IPC_CACHE_HASH_BITS	8
+#define IPC_CACHE_MAX_ENTRIES	4096
+
+struct ipc_cache_entry {
+	struct hlist_node	hlist;
+	struct list_head	lru;
+	unsigned int		type;
+	unsigned int		hash;
+	unsigned long		expires;
+	char			account[CIFSD_REQ_MAX_ACCOUNT_NAME_SZ];
+	char			share[CIFSD_REQ_MAX_SHARE_NAME];
+	unsigned int		key_sz;
+	unsigned int		resp_sz;
+	/* request key, then the response */
+	unsigned char		data[0];
+};
+
+static DEFINE_HASHTABLE(ipc_cache_table, IPC_CACHE_HASH_BITS);
+static LIST_HEAD(ipc_cache_lru);
+static unsigned int ipc_cache_nr;
+static DEFINE_SPINLOCK(ipc_cache_lock);
+
 struct cifsd_ida *ida;
 
 static unsigned int cifsd_tools_pid;
@@ -46,8 +92,9 @@ static unsigned int cifsd_tools_pid;
 		int ret = 0;						\
 									\
 		if (m->genlhdr->version != CIFSD_GENL_VERSION) {	\
-			cifsd_err("IPC protocol version mismatch: %d\n",\
-				m->genlhdr->version);			\
+			cifsd_err("IPC protocol version mismatch: %d, expected %d\n",\
+				m->genlhdr->version,			\
+				CIFSD_GENL_VERSION);			\
 			ret = 1;					\
 		}							\
 		ret;							\
@@ -75,6 +122,11 @@ static int handle_startup_event(struct sk_buff *skb, struct genl_info *info);
 static int handle_unsupported_event(struct sk_buff *skb,
 				    struct genl_info *info);
 static int handle_generic_event(struct sk_buff *skb, struct genl_info *info);
+static int handle_cache_invalidate_event(struct sk_buff *skb,
+					 struct genl_info *info);
+static int handle_share_preload_event(struct sk_buff *skb,
+				      struct genl_info *info);
+static int handle_io_stats_event(struct sk_buff *skb, struct genl_info *info);
 
 static const struct nla_policy cifsd_nl_policy[CIFSD_EVENT_MAX] = {
 	[CIFSD_EVENT_UNSPEC] = {
@@ -117,6 +169,17 @@ static const struct nla_policy cifsd_nl_policy[CIFSD_EVENT_MAX] = {
 	},
 	[CIFSD_EVENT_RPC_RESPONSE] = {
 	},
+	[CIFSD_EVENT_CACHE_INVALIDATE] = {
+		.len = sizeof(struct cifsd_cache_invalidate_request),
+	},
+	[CIFSD_EVENT_SHARE_CONFIG_PRELOAD] = {
+		.len = sizeof(struct cifsd_share_config_preload),
+	},
+	[CIFSD_EVENT_IO_STATS_REQUEST] = {
+		.len = sizeof(struct cifsd_io_stats_request),
+	},
+	[CIFSD_EVENT_IO_STATS_RESPONSE] = {
+	},
 };
 
 static const struct genl_ops cifsd_genl_ops[] = {
@@ -190,6 +253,26 @@ static const struct genl_ops cifsd_genl_ops[] = {
 		.doit	= handle_generic_event,
 		.policy = cifsd_nl_policy,
 	},
+	{
+		.cmd	= CIFSD_EVENT_CACHE_INVALIDATE,
+		.doit	= handle_cache_invalidate_event,
+		.policy = cifsd_nl_policy,
+	},
+	{
+		.cmd	= CIFSD_EVENT_SHARE_CONFIG_PRELOAD,
+		.doit	= handle_share_preload_event,
+		.policy = cifsd_nl_policy,
+	},
+	{
+		.cmd	= CIFSD_EVENT_IO_STATS_REQUEST,
+		.doit	= handle_io_stats_event,
+		.policy = cifsd_nl_policy,
+	},
+	{
+		.cmd	= CIFSD_EVENT_IO_STATS_RESPONSE,
+		.doit	= handle_unsupported_event,
+		.policy = cifsd_nl_policy,
+	},
 };
 
 struct genl_family cifsd_genl_family = {
@@ -238,19 +321,32 @@ static void ipc_msg_handle_free(int handle)
 		cifds_release_id(ida, handle);
 }
 
+static inline struct ipc_msg_bucket *ipc_msg_bucket(unsigned int handle)
+{
+	return &ipc_msg_table[hash_32(handle, IPC_MSG_HASH_BITS)];
+}
+
 static int handle_response(int type, void *payload, size_t sz)
 {
-	int handle = CIFSD_IPC_MSG_HANDLE(payload);
+	unsigned int handle = CIFSD_IPC_MSG_HANDLE(payload);
+	struct ipc_msg_bucket *bucket = ipc_msg_bucket(handle);
 	struct ipc_msg_table_entry *entry;
-	int ret = 0;
+	void *response;
 
 	ipc_update_last_active();
-	down_read(&ipc_msg_table_lock);
-	hash_for_each_possible(ipc_msg_table, entry, ipc_table_hlist, handle) {
+	if (handle == CIFSD_IPC_NO_HANDLE)
+		return 0;
+
+	response = cifsd_alloc(sz);
+	if (!response)
+		return -ENOMEM;
+	memcpy(response, payload, sz);
+
+	spin_lock(&bucket->lock);
+	hlist_for_each_entry(entry, &bucket->head, ipc_table_hlist) {
 		if (handle != entry->handle)
 			continue;
 
-		entry->response = NULL;
 		/*
 		 * Response message type value should be equal to
 		 * request message type + 1.
@@ -260,20 +356,218 @@ static int handle_response(int type, void *payload, size_t sz)
 				entry->type + 1, type);
 		}
 
-		entry->response = cifsd_alloc(sz);
 		if (!entry->response) {
-			ret = -ENOMEM;
+			entry->response = response;
+			response = NULL;
+			wake_up_interruptible(&entry->wait);
+		}
+		break;
+	}
+	spin_unlock(&bucket->lock);
+
+	cifsd_free(response);
+	return 0;
+}
+
+static void ipc_cache_free(struct ipc_cache_entry *e)
+{
+	/* login responses carry the password hash */
+	memzero_explicit(e->data, e->key_sz + e->resp_sz);
+	kfree(e);
+}
+
+static void __ipc_cache_del(struct ipc_cache_entry *e)
+{
+	hash_del(&e->hlist);
+	list_del(&e->lru);
+	ipc_cache_nr--;
+	ipc_cache_free(e);
+}
+
+/**
+ * ipc_cache_lookup() - look up a cached daemon response
+ * @type:	request message type
+ * @key:	request with its per call fields cleared
+ * @key_sz:	size of @key
+ * @resp_sz:	size of the response
+ *
+ * Return:	copy of the response to free with cifsd_free(), or NULL
+ */
+static void *ipc_cache_lookup(unsigned int type, const void *key,
+			      unsigned int key_sz, unsigned int resp_sz)
+{
+	unsigned int hash = jhash(key, key_sz, type);
+	struct ipc_cache_entry *e;
+	void *resp;
+
+	if (!READ_ONCE(ipc_cache_ttl))
+		return NULL;
+
+	/* allocated up front, the lookup doesn't sleep */
+	resp = cifsd_alloc(resp_sz);
+	if (!resp)
+		return NULL;
+
+	spin_lock(&ipc_cache_lock);
+	hash_for_each_possible(ipc_cache_table, e, hlist, hash) {
+		if (e->hash != hash || e->type != type ||
+		    e->key_sz != key_sz || e->resp_sz != resp_sz ||
+		    memcmp(e->data, key, key_sz))
+			continue;
+
+		if (time_after(jiffies, e->expires)) {
+			__ipc_cache_del(e);
 			break;
 		}
 
-		memcpy(entry->response, payload, sz);
-		wake_up_interruptible(&entry->wait);
-		ret = 0;
-		break;
+		list_move_tail(&e->lru, &ipc_cache_lru);
+		memcpy(resp, e->data + key_sz, resp_sz);
+		spin_unlock(&ipc_cache_lock);
+		return resp;
 	}
-	up_read(&ipc_msg_table_lock);
+	spin_unlock(&ipc_cache_lock);
 
-	return ret;
+	cifsd_free(resp);
+	return NULL;
+}
+
+static void ipc_cache_store(unsigned int type, const void *key,
+			    unsigned int key_sz, const char *account,
+			    const char *share, const void *resp,
+			    unsigned int resp_sz)
+{
+	unsigned int ttl = READ_ONCE(ipc_cache_ttl);
+	unsigned int hash = jhash(key, key_sz, type);
+	struct ipc_cache_entry *e, *old;
+
+	if (!ttl)
+		return;
+
+	e = kzalloc(sizeof(*e) + key_sz + resp_sz, GFP_KERNEL);
+	if (!e)
+		return;
+
+	e->type = type;
+	e->hash = hash;
+	e->expires = jiffies + ttl * HZ;
+	strscpy(e->account, account, sizeof(e->account));
+	if (share)
+		strscpy(e->share, share, sizeof(e->share));
+	e->key_sz = key_sz;
+	e->resp_sz = resp_sz;
+	memcpy(e->data, key, key_sz);
+	memcpy(e->data + key_sz, resp, resp_sz);
+
+	spin_lock(&ipc_cache_lock);
+	hash_for_each_possible(ipc_cache_table, old, hlist, hash) {
+		if (old->hash == hash && old->type == type &&
+		    old->key_sz == key_sz && !memcmp(old->data, key, key_sz)) {
+			__ipc_cache_del(old);
+			break;
+		}
+	}
+
+	if (ipc_cache_nr >= IPC_CACHE_MAX_ENTRIES)
+		__ipc_cache_del(list_first_entry(&ipc_cache_lru,
+						 struct ipc_cache_entry, lru));
+
+	hash_add(ipc_cache_table, &e->hlist, hash);
+	list_add_tail(&e->lru, &ipc_cache_lru);
+	ipc_cache_nr++;
+	spin_unlock(&ipc_cache_lock);
+}
+
+/**
+ * ipc_cache_invalidate() - drop cached daemon responses
+ * @flags:	CIFSD_CACHE_INVALIDATE_* kinds of responses to drop
+ * @account:	user whose responses are dropped, NULL or empty for all
+ * @share:	share whose responses are dropped, NULL or empty for all
+ */
+static void ipc_cache_invalidate(unsigned int flags, const char *account,
+				 const char *share)
+{
+	struct ipc_cache_entry *e, *tmp;
+
+	spin_lock(&ipc_cache_lock);
+	list_for_each_entry_safe(e, tmp, &ipc_cache_lru, lru) {
+		if (e->type == CIFSD_EVENT_LOGIN_REQUEST &&
+		    !(flags & CIFSD_CACHE_INVALIDATE_LOGIN))
+			continue;
+		if (e->type == CIFSD_EVENT_TREE_CONNECT_REQUEST &&
+		    !(flags & CIFSD_CACHE_INVALIDATE_TREE_CONNECT))
+			continue;
+		if (account && account[0] &&
+		    strncasecmp(e->account, account, sizeof(e->account)))
+			continue;
+		/* a login isn't tied to a share */
+		if (share && share[0] &&
+		    (e->type == CIFSD_EVENT_LOGIN_REQUEST ||
+		     strncasecmp(e->share, share, sizeof(e->share))))
+			continue;
+
+		__ipc_cache_del(e);
+	}
+	spin_unlock(&ipc_cache_lock);
+}
+
+static int handle_cache_invalidate_event(struct sk_buff *skb,
+					 struct genl_info *info)
+{
+	struct cifsd_cache_invalidate_request *req;
+
+	if (CIFSD_INVALID_IPC_VERSION(info))
+		return -EINVAL;
+
+	if (!info->attrs[CIFSD_EVENT_CACHE_INVALIDATE])
+		return -EINVAL;
+
+	req = nla_data(info->attrs[CIFSD_EVENT_CACHE_INVALIDATE]);
+	req->account[sizeof(req->account) - 1] = 0x00;
+	req->share[sizeof(req->share) - 1] = 0x00;
+
+	ipc_update_last_active();
+	ipc_cache_invalidate(req->flags, req->account, req->share);
+	if (req->flags & CIFSD_CACHE_INVALIDATE_SHARE)
+		cifsd_share_config_invalidate(req->share);
+	return 0;
+}
+
+static int handle_share_preload_event(struct sk_buff *skb,
+				      struct genl_info *info)
+{
+	struct cifsd_share_config_preload *req;
+	struct nlattr *attr;
+	unsigned int payload_sz, path_off;
+	char *payload;
+
+	if (CIFSD_INVALID_IPC_VERSION(info))
+		return -EINVAL;
+
+	attr = info->attrs[CIFSD_EVENT_SHARE_CONFIG_PRELOAD];
+	if (!attr)
+		return -EINVAL;
+
+	req = nla_data(attr);
+	req->share_name[sizeof(req->share_name) - 1] = 0x00;
+	if (!req->share_name[0])
+		return -EINVAL;
+
+	/* the path follows the veto list and ends the payload */
+	payload_sz = nla_len(attr) - sizeof(struct cifsd_share_config_preload);
+	payload = CIFSD_SHARE_CONFIG_VETO_LIST(&req->config);
+	path_off = req->config.veto_list_sz;
+	if (path_off)
+		path_off++;
+	if (req->config.flags != CIFSD_SHARE_FLAG_INVALID &&
+	    (req->config.veto_list_sz >= payload_sz ||
+	     path_off >= payload_sz || payload[payload_sz - 1] != 0x00)) {
+		cifsd_err("Malformed share preload for %s\n",
+			  req->share_name);
+		return -EINVAL;
+	}
+
+	ipc_update_last_active();
+	return cifsd_share_config_preload(req->share_name, &req->config);
 }
 
 static int ipc_server_config_on_startup(struct cifsd_startup_request *req)
@@ -282,14 +576,25 @@ static int ipc_server_config_on_startup(struct cifsd_startup_request *req)
 
 	cifsd_set_fd_limit(req->file_max);
 	server_conf.signing = req->signing;
-	server_conf.tcp_port = req->tcp_port;
 	server_conf.ipc_timeout = req->ipc_timeout;
 	server_conf.deadtime = req->deadtime * SMB_ECHO_INTERVAL;
-
-	ret = cifsd_set_netbios_name(req->netbios_name);
-	ret |= cifsd_set_server_string(req->server_string);
-	ret |= cifsd_set_work_group(req->work_group);
-	ret |= cifsd_set_interfaces(CIFSD_STARTUP_CONFIG_INTERFACES(req));
+	server_conf.flags = req->flags;
+
+	/*
+	 * After a soft reset, the listeners and workers keep running, and
+	 * connections read the names without a lock, so they are kept too
+	 */
+	ret = 0;
+	if (!cifsd_server_running()) {
+		ret = cifsd_set_netbios_name(req->netbios_name);
+		ret |= cifsd_set_server_string(req->server_string);
+		ret |= cifsd_set_work_group(req->work_group);
+		server_conf.tcp_port = req->tcp_port;
+		server_conf.max_active = req->max_active;
+		server_conf.tcp_backlog = req->tcp_backlog;
+		ret |= cifsd_set_interfaces(
+				CIFSD_STARTUP_CONFIG_INTERFACES(req));
+	}
 	if (ret) {
 		cifsd_err("Server configuration error: %s %s %s\n",
 				req->netbios_name,
@@ -336,6 +641,11 @@ static int handle_startup_event(struct sk_buff *skb, struct genl_info *info)
 		}
 
 		cifsd_err("Reconnect to a new user space daemon\n");
+		/* the new daemon may have another configuration */
+		ipc_cache_invalidate(CIFSD_CACHE_INVALIDATE_LOGIN |
+				     CIFSD_CACHE_INVALIDATE_TREE_CONNECT,
+				     NULL, NULL);
+		cifsd_share_config_invalidate(NULL);
 	} else {
 		struct cifsd_startup_request *req;
 
@@ -417,9 +727,59 @@ out:
 	return ret;
 }
 
+/*
+ * The daemon asks for the top talkers, the sessions and shares are
+ * looked up in their tables rather than through the connections.
+ */
+static int handle_io_stats_event(struct sk_buff *skb, struct genl_info *info)
+{
+	struct cifsd_io_stats_request *req;
+	struct cifsd_io_stats_response *resp;
+	struct cifsd_ipc_msg *msg;
+	struct cifsd_io_top top;
+	int ret;
+
+	if (CIFSD_INVALID_IPC_VERSION(info))
+		return -EINVAL;
+
+	if (!info->attrs[CIFSD_EVENT_IO_STATS_REQUEST])
+		return -EINVAL;
+
+	req = nla_data(info->attrs[CIFSD_EVENT_IO_STATS_REQUEST]);
+	top.sort = req->sort;
+	top.max = min_t(unsigned int, req->top_n, CIFSD_IO_STATS_MAX_ENTRIES);
+	top.nr = 0;
+
+	msg = ipc_msg_alloc(sizeof(struct cifsd_io_stats_response) +
+			    top.max * sizeof(struct cifsd_io_stats_entry));
+	if (!msg)
+		return -ENOMEM;
+
+	msg->type = CIFSD_EVENT_IO_STATS_RESPONSE;
+	resp = CIFSD_IPC_MSG_PAYLOAD(msg);
+	resp->handle = req->handle;
+	resp->flags = req->flags;
+	top.entries = CIFSD_IO_STATS_ENTRIES(resp);
+
+	if (req->flags & CIFSD_IO_STATS_SHARES)
+		cifsd_shares_io_top(&top);
+	else
+		cifsd_sessions_io_top(&top);
+
+	resp->nr_entries = top.nr;
+	msg->sz = sizeof(struct cifsd_io_stats_response) +
+		  top.nr * sizeof(struct cifsd_io_stats_entry);
+
+	ipc_update_last_active();
+	ret = ipc_msg_send(msg);
+	ipc_msg_free(msg);
+	return ret;
+}
+
 static void *ipc_msg_send_request(struct cifsd_ipc_msg *msg,
 				  unsigned int handle)
 {
+	struct ipc_msg_bucket *bucket = ipc_msg_bucket(handle);
 	struct ipc_msg_table_entry entry;
 	int ret;
 
@@ -430,22 +790,25 @@ static void *ipc_msg_send_request(struct cifsd_ipc_msg *msg,
 	entry.response = NULL;
 	init_waitqueue_head(&entry.wait);
 
-	down_write(&ipc_msg_table_lock);
 	entry.handle = handle;
-	hash_add(ipc_msg_table, &entry.ipc_table_hlist, entry.handle);
-	up_write(&ipc_msg_table_lock);
+	spin_lock(&bucket->lock);
+	hlist_add_head(&entry.ipc_table_hlist, &bucket->head);
+	spin_unlock(&bucket->lock);
 
+	trace_cifsd_ipc_upcall_start(msg->type, handle, msg->sz);
 	ret = ipc_msg_send(msg);
 	if (ret)
 		goto out;
 
 	ret = wait_event_interruptible_timeout(entry.wait,
-					       entry.response != NULL,
+					       READ_ONCE(entry.response) != NULL,
 					       IPC_WAIT_TIMEOUT);
 out:
-	down_write(&ipc_msg_table_lock);
-	hash_del(&entry.ipc_table_hlist);
-	up_write(&ipc_msg_table_lock);
+	trace_cifsd_ipc_upcall_done(msg->type, handle, ret,
+				    entry.response != NULL);
+	spin_lock(&bucket->lock);
+	hlist_del(&entry.ipc_table_hlist);
+	spin_unlock(&bucket->lock);
 	return entry.response;
 }
 
@@ -453,7 +816,8 @@ int cifsd_ipc_heartbeat(void)
 {
 	unsigned long delta;
 
-	if (!server_conf.ipc_timeout)
+	/* no daemon to watch since a soft reset, until the next one starts */
+	if (!server_conf.ipc_timeout || !cifsd_tools_pid)
 		return 0;
 
 	if (time_after(jiffies, server_conf.ipc_last_active)) {
@@ -470,9 +834,26 @@ int cifsd_ipc_heartbeat(void)
 			return 0;
 		}
 
-		server_conf.state = SERVER_STATE_RESETTING;
 		server_conf.ipc_last_active = 0;
 		cifsd_tools_pid = 0;
+		if (server_conf.flags & CIFSD_GLOBAL_FLAG_SOFT_RESET) {
+			/*
+			 * Connections, sessions and open handles stay, logins
+			 * and tree connects wait for the next daemon, which
+			 * brings its configuration.
+			 */
+			ipc_cache_invalidate(CIFSD_CACHE_INVALIDATE_LOGIN |
+					     CIFSD_CACHE_INVALIDATE_TREE_CONNECT,
+					     NULL, NULL);
+			cifsd_share_config_invalidate(NULL);
+			mutex_unlock(&startup_lock);
+
+			cifsd_err("No IPC daemon response for %lus, keeping connections\n",
+				  delta);
+			return 0;
+		}
+
+		server_conf.state = SERVER_STATE_RESETTING;
 		mutex_unlock(&startup_lock);
 
 		cifsd_err("No IPC daemon response for %lus\n", delta);
@@ -493,11 +874,20 @@ struct cifsd_login_response *cifsd_ipc_login_request(const char *account)
 
 	msg->type = CIFSD_EVENT_LOGIN_REQUEST;
 	req = CIFSD_IPC_MSG_PAYLOAD(msg);
-	req->handle = cifds_acquire_id(ida);
 	strncpy(req->account, account, sizeof(req->account) - 1);
 
+	resp = ipc_cache_lookup(msg->type, req->account, sizeof(req->account),
+				sizeof(*resp));
+	if (resp)
+		goto out;
+
+	req->handle = cifds_acquire_id(ida);
 	resp = ipc_msg_send_request(msg, req->handle);
 	ipc_msg_handle_free(req->handle);
+	if (resp && resp->status & CIFSD_USER_FLAG_OK)
+		ipc_cache_store(msg->type, req->account, sizeof(req->account),
+				req->account, NULL, resp, sizeof(*resp));
+out:
 	ipc_msg_free(msg);
 	return resp;
 }
@@ -509,7 +899,7 @@ cifsd_ipc_tree_connect_request(struct cifsd_session *sess,
 			       struct sockaddr *peer_addr)
 {
 	struct cifsd_ipc_msg *msg;
-	struct cifsd_tree_connect_request *req;
+	struct cifsd_tree_connect_request *req, key;
 	struct cifsd_tree_connect_response *resp;
 
 	msg = ipc_msg_alloc(sizeof(struct cifsd_tree_connect_request));
@@ -532,8 +922,31 @@ cifsd_ipc_tree_connect_request(struct cifsd_session *sess,
 	if (test_session_flag(sess, CIFDS_SESSION_FLAG_SMB2))
 		req->flags |= CIFSD_TREE_CONN_FLAG_REQUEST_SMB2;
 
+	/* the ids differ between calls and don't change the answer */
+	key = *req;
+	key.handle = 0;
+	key.session_id = 0;
+	key.connect_id = 0;
+
+	resp = ipc_cache_lookup(msg->type, &key, sizeof(key), sizeof(*resp));
+	if (resp) {
+		/*
+		 * Still tell the daemon, which accounts the connections of
+		 * a share and gets the tree disconnect. Its answer is
+		 * dropped.
+		 */
+		ipc_msg_handle_free(req->handle);
+		req->handle = CIFSD_IPC_NO_HANDLE;
+		ipc_msg_send(msg);
+		goto out;
+	}
+
 	resp = ipc_msg_send_request(msg, req->handle);
 	ipc_msg_handle_free(req->handle);
+	if (resp && resp->status == CIFSD_TREE_CONN_STATUS_OK)
+		ipc_cache_store(msg->type, &key, sizeof(key), req->account,
+				req->share, resp, sizeof(*resp));
+out:
 	ipc_msg_free(msg);
 	return resp;
 }
@@ -777,14 +1190,22 @@ void cifsd_rpc_id_free(int handle)
 
 void cifsd_ipc_release(void)
 {
+	ipc_cache_invalidate(CIFSD_CACHE_INVALIDATE_LOGIN |
+			     CIFSD_CACHE_INVALIDATE_TREE_CONNECT, NULL, NULL);
 	cifsd_ida_free(ida);
 	genl_unregister_family(&cifsd_genl_family);
 }
 
 int cifsd_ipc_init(void)
 {
-	int ret = genl_register_family(&cifsd_genl_family);
+	int i, ret;
+
+	for (i = 0; i < ARRAY_SIZE(ipc_msg_table); i++) {
+		spin_lock_init(&ipc_msg_table[i].lock);
+		INIT_HLIST_HEAD(&ipc_msg_table[i].head);
+	}
 
+	ret = genl_register_family(&cifsd_genl_family);
 	if (ret) {
 		cifsd_err("Failed to register CIFSD netlink interface %d\n",
 				ret);
@@ -0,0 +1,1493 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ *   Copyright (C) 2018 Samsung Electronics Co., Ltd.
+ */
+
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/highmem.h>
+#include <linux/vmalloc.h>
+#include <linux/scatterlist.h>
+#include <linux/workqueue.h>
+#include <linux/netdevice.h>
+#include <linux/version.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 11, 0)
+#include <linux/sched/signal.h>
+#endif
+#include <net/net_namespace.h>
+#include <rdma/ib_verbs.h>
+#include <rdma/rdma_cm.h>
+#include <rdma/rw.h>
+
+#include "glob.h"
+#include "smb2pdu.h"
+#include "smbstatus.h"
+#include "transport_tcp.h"
+#include "transport_rdma.h"
+
+/* What we receive and send in one message, [MS-SMBD] 3.1.1.1 defaults */
+#define SMB_DIRECT_MAX_RECV_SIZE	1364
+#define SMB_DIRECT_MAX_SEND_SIZE	1364
+/* Largest PDU reassembled from data transfer messages */
+#define SMB_DIRECT_MAX_FRAGMENTED_SIZE	(1024 * 1024)
+/* Largest RDMA read or write of an SMB2 READ or WRITE channel */
+#define SMB_DIRECT_MAX_RW_SIZE		(1024 * 1024)
+
+#define SMB_DIRECT_SEND_CREDITS		255
+#define SMB_DIRECT_RECV_CREDITS		255
+/* RDMA read/write contexts in flight, and the pages of each */
+#define SMB_DIRECT_RW_CREDITS		16
+#define SMB_DIRECT_RW_PAGES		256
+#define SMB_DIRECT_MAX_SGE		16
+
+#define SMB_DIRECT_CM_INITIATOR_DEPTH	8
+#define SMB_DIRECT_CM_RETRY		6
+#define SMB_DIRECT_CM_RNR_RETRY		6
+
+#define SMB_DIRECT_NEGOTIATE_TIMEOUT	(120 * HZ)
+#define SMB_DIRECT_DISCONNECT_TIMEOUT	(5 * HZ)
+
+/* Header of a data transfer message without data */
+#define SMB_DIRECT_HDR_SIZE		\
+	offsetof(struct smb_direct_data_transfer, padding)
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 19, 0)
+#define SMB_DIRECT_DEV_MAX_SGE(dev)	((dev)->attrs.max_send_sge)
+#define SMB_DIRECT_BAD_WR		const
+#else
+#define SMB_DIRECT_DEV_MAX_SGE(dev)	((dev)->attrs.max_sge)
+#define SMB_DIRECT_BAD_WR
+#endif
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 0, 0)
+#define SMB_DIRECT_GET_NETDEV(dev)	((dev)->ops.get_netdev)
+#else
+#define SMB_DIRECT_GET_NETDEV(dev)	((dev)->get_netdev)
+#endif
+
+enum smb_direct_status {
+	SMB_DIRECT_CS_NEW = 0,
+	SMB_DIRECT_CS_CONNECTED,
+	SMB_DIRECT_CS_DISCONNECTING,
+	SMB_DIRECT_CS_DISCONNECTED,
+};
+
+struct smb_direct_transport {
+	struct rdma_cm_id		*cm_id;
+	struct ib_pd			*pd;
+	struct ib_cq			*send_cq;
+	struct ib_cq			*recv_cq;
+	struct ib_qp			*qp;
+
+	/* enum smb_direct_status, changes wake up all the waiters */
+	int				status;
+	wait_queue_head_t		wait_status;
+	/* In the connect request handler, the CM owns cm_id until it returns */
+	bool				connecting;
+	bool				negotiated;
+
+	unsigned int			max_send_size;
+	unsigned int			max_fragmented_recv_size;
+	unsigned int			max_rw_size;
+
+	/* Received messages with data not read yet, in order */
+	spinlock_t			reassembly_lock;
+	struct list_head		reassembly_queue;
+	wait_queue_head_t		wait_reassembly;
+	/* RFC1002 header of the PDU being read, and what is left of both */
+	__be32				rfc1002_hdr;
+	unsigned int			hdr_left;
+	unsigned int			pdu_left;
+
+	/* Send credits granted by the peer */
+	atomic_t			send_credits;
+	wait_queue_head_t		wait_send_credits;
+
+	/* Receives the peer holds credits for, and reposted ones to grant */
+	int				recv_credit_target;
+	atomic_t			recv_credits;
+	atomic_t			new_recv_credits;
+
+	/* RDMA read/write contexts, one per buffer descriptor chunk */
+	int				rw_credit_max;
+	unsigned int			rw_pages;
+	atomic_t			rw_credits;
+	wait_queue_head_t		wait_rw_credits;
+
+	/* Every receive message, they are freed with the transport */
+	struct list_head		recvmsgs;
+
+	struct work_struct		send_immediate_work;
+	struct work_struct		disconnect_work;
+};
+
+struct smb_direct_recvmsg {
+	struct smb_direct_transport	*t;
+	/* t->reassembly_queue, or the negotiate request */
+	struct list_head		list;
+	/* t->recvmsgs */
+	struct list_head		entry;
+	struct ib_cqe			cqe;
+	struct ib_sge			sge;
+	unsigned int			byte_len;
+	unsigned int			data_off;
+	unsigned int			data_left;
+	u8				packet[];
+};
+
+struct smb_direct_sendmsg {
+	struct smb_direct_transport	*t;
+	struct ib_cqe			cqe;
+	struct ib_sge			sge;
+	unsigned int			len;
+	u8				packet[];
+};
+
+/* RDMA read or write of an SMB2 READ or WRITE channel */
+struct smb_direct_rw_io {
+	atomic_t			pending;
+	int				status;
+	struct completion		done;
+};
+
+struct smb_direct_rw_msg {
+	struct smb_direct_rw_io		*io;
+	struct ib_cqe			cqe;
+	struct rdma_rw_ctx		rw_ctx;
+	bool				rw_ctx_inited;
+	unsigned int			nents;
+	struct scatterlist		sg[];
+};
+
+/* Cursor over the response kvecs and the read data pages, for writev */
+struct smb_direct_iter {
+	struct kvec			*iov;
+	int				nr_iov;
+	struct bio_vec			*bvec;
+	unsigned int			nr_bvec;
+	size_t				off;
+};
+
+struct smb_direct_device {
+	struct ib_device		*ib_dev;
+	struct list_head		list;
+};
+
+static LIST_HEAD(smb_direct_dev_list);
+static DEFINE_RWLOCK(smb_direct_dev_lock);
+static bool smb_direct_client_registered;
+static struct rdma_cm_id *smb_direct_listener;
+
+static struct cifsd_transport_ops cifsd_rdma_ops;
+
+static void smb_direct_set_status(struct smb_direct_transport *t, int status)
+{
+	WRITE_ONCE(t->status, status);
+	wake_up_all(&t->wait_status);
+	wake_up_all(&t->wait_reassembly);
+	wake_up_all(&t->wait_send_credits);
+	wake_up_all(&t->wait_rw_credits);
+}
+
+static inline bool smb_direct_connected(struct smb_direct_transport *t)
+{
+	return READ_ONCE(t->status) == SMB_DIRECT_CS_CONNECTED;
+}
+
+static void smb_direct_disconnect_work(struct work_struct *work)
+{
+	struct smb_direct_transport *t = container_of(work,
+			struct smb_direct_transport, disconnect_work);
+
+	if (smb_direct_connected(t))
+		smb_direct_set_status(t, SMB_DIRECT_CS_DISCONNECTING);
+	/* flushes the outstanding work requests of the queue pair too */
+	rdma_disconnect(t->cm_id);
+}
+
+/* Drop a broken connection, from completion and QP event context */
+static void smb_direct_disconnect_rdma(struct smb_direct_transport *t)
+{
+	queue_work(system_wq, &t->disconnect_work);
+}
+
+static void smb_direct_queue_recvmsg(struct smb_direct_transport *t,
+				     struct smb_direct_recvmsg *msg)
+{
+	spin_lock(&t->reassembly_lock);
+	list_add_tail(&msg->list, &t->reassembly_queue);
+	spin_unlock(&t->reassembly_lock);
+	wake_up(&t->wait_reassembly);
+}
+
+static struct smb_direct_recvmsg *
+smb_direct_first_recvmsg(struct smb_direct_transport *t)
+{
+	struct smb_direct_recvmsg *msg;
+
+	spin_lock(&t->reassembly_lock);
+	msg = list_first_entry_or_null(&t->reassembly_queue,
+				       struct smb_direct_recvmsg, list);
+	spin_unlock(&t->reassembly_lock);
+	return msg;
+}
+
+static void smb_direct_dequeue_recvmsg(struct smb_direct_transport *t,
+				       struct smb_direct_recvmsg *msg)
+{
+	spin_lock(&t->reassembly_lock);
+	list_del(&msg->list);
+	spin_unlock(&t->reassembly_lock);
+}
+
+static void smb_direct_recv_done(struct ib_cq *cq, struct ib_wc *wc);
+
+static int smb_direct_post_recv(struct smb_direct_transport *t,
+				struct smb_direct_recvmsg *msg)
+{
+	struct ib_recv_wr wr;
+	SMB_DIRECT_BAD_WR struct ib_recv_wr *bad_wr;
+	int ret;
+
+	ib_dma_sync_single_for_device(t->cm_id->device, msg->sge.addr,
+				      msg->sge.length, DMA_FROM_DEVICE);
+
+	msg->cqe.done = smb_direct_recv_done;
+	wr.wr_cqe = &msg->cqe;
+	wr.next = NULL;
+	wr.sg_list = &msg->sge;
+	wr.num_sge = 1;
+
+	ret = ib_post_recv(t->qp, &wr, &bad_wr);
+	if (ret) {
+		cifsd_err("Can't post recv: %d\n", ret);
+		smb_direct_disconnect_rdma(t);
+	}
+	return ret;
+}
+
+/*
+ * Give a consumed receive back to the queue pair. The peer learns of the
+ * credit with the next message we send, an empty one if it runs low.
+ */
+static void smb_direct_repost_recv(struct smb_direct_transport *t,
+				   struct smb_direct_recvmsg *msg)
+{
+	if (smb_direct_post_recv(t, msg))
+		return;
+
+	atomic_inc(&t->new_recv_credits);
+	if (atomic_read(&t->recv_credits) < t->recv_credit_target / 2)
+		queue_work(system_wq, &t->send_immediate_work);
+}
+
+static void smb_direct_recv_done(struct ib_cq *cq, struct ib_wc *wc)
+{
+	struct smb_direct_recvmsg *msg = container_of(wc->wr_cqe,
+			struct smb_direct_recvmsg, cqe);
+	struct smb_direct_transport *t = msg->t;
+	struct smb_direct_data_transfer *dt;
+	unsigned int data_off, data_len, credits;
+
+	if (wc->status != IB_WC_SUCCESS || wc->opcode != IB_WC_RECV) {
+		if (wc->status != IB_WC_WR_FLUSH_ERR) {
+			cifsd_err("Recv error. status='%s (%d)' opcode=%d\n",
+				  ib_wc_status_msg(wc->status), wc->status,
+				  wc->opcode);
+			smb_direct_disconnect_rdma(t);
+		}
+		return;
+	}
+
+	ib_dma_sync_single_for_cpu(t->cm_id->device, msg->sge.addr,
+				   msg->sge.length, DMA_FROM_DEVICE);
+	msg->byte_len = wc->byte_len;
+
+	/* the negotiate request, smb_direct_prepare() checks it */
+	if (!t->negotiated) {
+		smb_direct_queue_recvmsg(t, msg);
+		return;
+	}
+
+	if (wc->byte_len < SMB_DIRECT_HDR_SIZE) {
+		cifsd_err("Short data transfer message: %u\n", wc->byte_len);
+		smb_direct_disconnect_rdma(t);
+		return;
+	}
+
+	dt = (struct smb_direct_data_transfer *)msg->packet;
+	atomic_dec(&t->recv_credits);
+
+	credits = le16_to_cpu(dt->credits_granted);
+	if (credits) {
+		atomic_add(credits, &t->send_credits);
+		wake_up(&t->wait_send_credits);
+	}
+	if (le16_to_cpu(dt->flags) & SMB_DIRECT_RESPONSE_REQUESTED)
+		queue_work(system_wq, &t->send_immediate_work);
+
+	data_len = le32_to_cpu(dt->data_length);
+	if (!data_len) {
+		smb_direct_repost_recv(t, msg);
+		return;
+	}
+
+	data_off = le32_to_cpu(dt->data_offset);
+	if (data_off < SMB_DIRECT_HDR_SIZE || data_off > wc->byte_len ||
+	    data_len > wc->byte_len - data_off) {
+		cifsd_err("Bad data transfer message: offset %u length %u\n",
+			  data_off, data_len);
+		smb_direct_disconnect_rdma(t);
+		return;
+	}
+
+	msg->data_off = data_off;
+	msg->data_left = data_len;
+	smb_direct_queue_recvmsg(t, msg);
+}
+
+static int smb_direct_alloc_recvmsgs(struct smb_direct_transport *t,
+				     int count)
+{
+	struct ib_device *dev = t->cm_id->device;
+	struct smb_direct_recvmsg *msg;
+	int i;
+
+	for (i = 0; i < count; i++) {
+		msg = kzalloc(sizeof(*msg) + SMB_DIRECT_MAX_RECV_SIZE,
+			      GFP_KERNEL);
+		if (!msg)
+			return -ENOMEM;
+
+		msg->t = t;
+		/* mapped for good, synced around each receive */
+		msg->sge.addr = ib_dma_map_single(dev, msg->packet,
+						  SMB_DIRECT_MAX_RECV_SIZE,
+						  DMA_FROM_DEVICE);
+		if (ib_dma_mapping_error(dev, msg->sge.addr)) {
+			kfree(msg);
+			return -ENOMEM;
+		}
+		msg->sge.length = SMB_DIRECT_MAX_RECV_SIZE;
+		msg->sge.lkey = t->pd->local_dma_lkey;
+		list_add_tail(&msg->entry, &t->recvmsgs);
+
+		if (smb_direct_post_recv(t, msg))
+			return -EIO;
+	}
+	return 0;
+}
+
+static void smb_direct_free_recvmsgs(struct smb_direct_transport *t)
+{
+	struct smb_direct_recvmsg *msg, *tmp;
+
+	list_for_each_entry_safe(msg, tmp, &t->recvmsgs, entry) {
+		ib_dma_unmap_single(t->cm_id->device, msg->sge.addr,
+				    msg->sge.length, DMA_FROM_DEVICE);
+		list_del(&msg->entry);
+		kfree(msg);
+	}
+	INIT_LIST_HEAD(&t->reassembly_queue);
+}
+
+static void smb_direct_send_done(struct ib_cq *cq, struct ib_wc *wc)
+{
+	struct smb_direct_sendmsg *msg = container_of(wc->wr_cqe,
+			struct smb_direct_sendmsg, cqe);
+	struct smb_direct_transport *t = msg->t;
+
+	if (wc->status != IB_WC_SUCCESS || wc->opcode != IB_WC_SEND) {
+		if (wc->status != IB_WC_WR_FLUSH_ERR) {
+			cifsd_err("Send error. status='%s (%d)' opcode=%d\n",
+				  ib_wc_status_msg(wc->status), wc->status,
+				  wc->opcode);
+			smb_direct_disconnect_rdma(t);
+		}
+	}
+
+	ib_dma_unmap_single(t->cm_id->device, msg->sge.addr,
+			    msg->sge.length, DMA_TO_DEVICE);
+	kfree(msg);
+}
+
+static struct smb_direct_sendmsg *
+smb_direct_alloc_sendmsg(struct smb_direct_transport *t)
+{
+	struct smb_direct_sendmsg *msg;
+
+	msg = kmalloc(sizeof(*msg) + t->max_send_size, GFP_KERNEL);
+	if (msg)
+		msg->t = t;
+	return msg;
+}
+
+/* Post @msg, which is freed on completion. The caller frees it on error */
+static int smb_direct_post_send(struct smb_direct_transport *t,
+				struct smb_direct_sendmsg *msg)
+{
+	struct ib_device *dev = t->cm_id->device;
+	struct ib_send_wr wr;
+	SMB_DIRECT_BAD_WR struct ib_send_wr *bad_wr;
+	int ret;
+
+	msg->sge.addr = ib_dma_map_single(dev, msg->packet, msg->len,
+					  DMA_TO_DEVICE);
+	if (ib_dma_mapping_error(dev, msg->sge.addr))
+		return -ENOMEM;
+	msg->sge.length = msg->len;
+	msg->sge.lkey = t->pd->local_dma_lkey;
+
+	memset(&wr, 0, sizeof(wr));
+	msg->cqe.done = smb_direct_send_done;
+	wr.wr_cqe = &msg->cqe;
+	wr.sg_list = &msg->sge;
+	wr.num_sge = 1;
+	wr.opcode = IB_WR_SEND;
+	wr.send_flags = IB_SEND_SIGNALED;
+
+	ret = ib_post_send(t->qp, &wr, &bad_wr);
+	if (ret) {
+		cifsd_err("Can't post send: %d\n", ret);
+		ib_dma_unmap_single(dev, msg->sge.addr, msg->sge.length,
+				    DMA_TO_DEVICE);
+		smb_direct_disconnect_rdma(t);
+	}
+	return ret;
+}
+
+static int smb_direct_wait_send_credit(struct smb_direct_transport *t)
+{
+	for (;;) {
+		if (!smb_direct_connected(t))
+			return -ENOTCONN;
+		if (atomic_dec_if_positive(&t->send_credits) >= 0)
+			return 0;
+		wait_event(t->wait_send_credits,
+			   atomic_read(&t->send_credits) > 0 ||
+			   !smb_direct_connected(t));
+	}
+}
+
+/* Receives reposted since the last message, the peer may use them now */
+static u16 smb_direct_grant_credits(struct smb_direct_transport *t)
+{
+	int credits = atomic_xchg(&t->new_recv_credits, 0);
+
+	atomic_add(credits, &t->recv_credits);
+	return credits;
+}
+
+static void smb_direct_iter_copy(struct smb_direct_iter *it, void *dst,
+				 unsigned int len)
+{
+	struct bio_vec *bv;
+	unsigned int n;
+	void *src;
+
+	while (len) {
+		if (it->nr_iov) {
+			n = min_t(size_t, len, it->iov->iov_len - it->off);
+			memcpy(dst, it->iov->iov_base + it->off, n);
+			it->off += n;
+			if (it->off == it->iov->iov_len) {
+				it->iov++;
+				it->nr_iov--;
+				it->off = 0;
+			}
+		} else {
+			bv = it->bvec;
+			n = min_t(size_t, len, bv->bv_len - it->off);
+			src = kmap_atomic(bv->bv_page);
+			memcpy(dst, src + bv->bv_offset + it->off, n);
+			kunmap_atomic(src);
+			it->off += n;
+			if (it->off == bv->bv_len) {
+				it->bvec++;
+				it->nr_bvec--;
+				it->off = 0;
+			}
+		}
+		dst += n;
+		len -= n;
+	}
+}
+
+/* Send @data_len bytes of @it, with @remaining bytes of the PDU after it */
+static int smb_direct_send_data(struct smb_direct_transport *t,
+				struct smb_direct_iter *it,
+				unsigned int data_len,
+				unsigned int remaining)
+{
+	struct smb_direct_sendmsg *msg;
+	struct smb_direct_data_transfer *dt;
+	int ret;
+
+	msg = smb_direct_alloc_sendmsg(t);
+	if (!msg)
+		return -ENOMEM;
+
+	ret = smb_direct_wait_send_credit(t);
+	if (ret) {
+		kfree(msg);
+		return ret;
+	}
+
+	dt = (struct smb_direct_data_transfer *)msg->packet;
+	dt->credits_requested = cpu_to_le16(SMB_DIRECT_SEND_CREDITS);
+	dt->credits_granted = cpu_to_le16(smb_direct_grant_credits(t));
+	dt->flags = 0;
+	dt->reserved = 0;
+	dt->remaining_data_length = cpu_to_le32(remaining);
+	dt->padding = 0;
+	if (data_len) {
+		dt->data_offset = cpu_to_le32(sizeof(*dt));
+		dt->data_length = cpu_to_le32(data_len);
+		smb_direct_iter_copy(it, dt->buffer, data_len);
+		msg->len = sizeof(*dt) + data_len;
+	} else {
+		dt->data_offset = 0;
+		dt->data_length = 0;
+		msg->len = SMB_DIRECT_HDR_SIZE;
+	}
+
+	ret = smb_direct_post_send(t, msg);
+	if (ret)
+		kfree(msg);
+	return ret;
+}
+
+/* An empty message, to grant credits or answer RESPONSE_REQUESTED */
+static void smb_direct_send_immediate_work(struct work_struct *work)
+{
+	struct smb_direct_transport *t = container_of(work,
+			struct smb_direct_transport, send_immediate_work);
+
+	smb_direct_send_data(t, NULL, 0, 0);
+}
+
+static int smb_direct_writev(struct cifsd_tcp_conn *conn,
+			     struct cifsd_work *work,
+			     struct kvec *iov, int nr_segs, size_t len)
+{
+	struct smb_direct_transport *t = conn->transport;
+	struct smb_direct_iter it = {
+		.iov = iov,
+		.nr_iov = nr_segs,
+		/* the data transfer messages frame the PDU themselves */
+		.off = 4,
+	};
+	unsigned int payload, remaining, n, i;
+	int ret = 0;
+
+	if (len < 4)
+		return -EINVAL;
+	remaining = len - 4;
+
+	if (HAS_AUX_PAYLOAD_PAGES(work)) {
+		it.bvec = work->aux_payload_bvec;
+		it.nr_bvec = work->aux_payload_nr_bvec;
+		for (i = 0; i < it.nr_bvec; i++)
+			remaining += it.bvec[i].bv_len;
+	}
+
+	payload = t->max_send_size - sizeof(struct smb_direct_data_transfer);
+	mutex_lock(&conn->send_lock);
+	while (remaining) {
+		n = min(remaining, payload);
+		remaining -= n;
+		ret = smb_direct_send_data(t, &it, n, remaining);
+		if (ret)
+			break;
+	}
+	mutex_unlock(&conn->send_lock);
+
+	return ret ? ret : len;
+}
+
+static void smb_direct_copy_to_iov(struct kvec *iov, unsigned int *seg,
+				   size_t *seg_off, const void *src,
+				   unsigned int len)
+{
+	size_t n;
+
+	while (len) {
+		n = min_t(size_t, len, iov[*seg].iov_len - *seg_off);
+		memcpy(iov[*seg].iov_base + *seg_off, src, n);
+		*seg_off += n;
+		if (*seg_off == iov[*seg].iov_len) {
+			(*seg)++;
+			*seg_off = 0;
+		}
+		src += n;
+		len -= n;
+	}
+}
+
+/*
+ * The byte stream of the received PDUs, each behind an RFC1002 header
+ * made up from the data length of its first fragment.
+ */
+static int smb_direct_readv(struct cifsd_tcp_conn *conn, struct kvec *iov,
+			    unsigned int nr_segs, unsigned int to_read)
+{
+	struct smb_direct_transport *t = conn->transport;
+	struct smb_direct_recvmsg *msg;
+	struct smb_direct_data_transfer *dt;
+	unsigned int seg = 0, total = 0, n;
+	size_t seg_off = 0;
+	u64 pdu_len;
+	long rc;
+
+	while (total < to_read) {
+		try_to_freeze();
+
+		if (!cifsd_tcp_conn_alive(conn))
+			return -ESHUTDOWN;
+		if (conn->tcp_status == CIFSD_SESS_NEED_RECONNECT)
+			return -EAGAIN;
+
+		if (t->hdr_left) {
+			n = min(t->hdr_left, to_read - total);
+			smb_direct_copy_to_iov(iov, &seg, &seg_off,
+				(u8 *)&t->rfc1002_hdr + 4 - t->hdr_left, n);
+			t->hdr_left -= n;
+			total += n;
+			continue;
+		}
+
+		msg = smb_direct_first_recvmsg(t);
+		if (!msg) {
+			if (!smb_direct_connected(t))
+				return -ESHUTDOWN;
+
+			/* a timeout or a signal, the loop checks the conn */
+			rc = wait_event_interruptible_timeout(
+				t->wait_reassembly,
+				!list_empty(&t->reassembly_queue) ||
+				!smb_direct_connected(t),
+				cifsd_tcp_recv_timeout(conn));
+			if (rc == -ERESTARTSYS && signal_pending(current))
+				flush_signals(current);
+			continue;
+		}
+
+		if (!t->pdu_left) {
+			dt = (struct smb_direct_data_transfer *)msg->packet;
+			pdu_len = (u64)msg->data_left +
+				le32_to_cpu(dt->remaining_data_length);
+			if (pdu_len > t->max_fragmented_recv_size) {
+				cifsd_err("PDU of %llu bytes is too large\n",
+					  pdu_len);
+				return -EPROTO;
+			}
+			t->rfc1002_hdr = cpu_to_be32(pdu_len);
+			t->hdr_left = 4;
+			t->pdu_left = pdu_len;
+			continue;
+		}
+
+		n = min3(to_read - total, msg->data_left, t->pdu_left);
+		smb_direct_copy_to_iov(iov, &seg, &seg_off,
+				       msg->packet + msg->data_off, n);
+		msg->data_off += n;
+		msg->data_left -= n;
+		t->pdu_left -= n;
+		total += n;
+
+		if (!msg->data_left) {
+			smb_direct_dequeue_recvmsg(t, msg);
+			smb_direct_repost_recv(t, msg);
+		}
+	}
+	return total;
+}
+
+static int smb_direct_send_negotiate_resp(struct smb_direct_transport *t)
+{
+	struct smb_direct_sendmsg *msg;
+	struct smb_direct_negotiate_resp *resp;
+	int ret;
+
+	msg = smb_direct_alloc_sendmsg(t);
+	if (!msg)
+		return -ENOMEM;
+
+	resp = (struct smb_direct_negotiate_resp *)msg->packet;
+	resp->min_version = SMB_DIRECT_VERSION_LE;
+	resp->max_version = SMB_DIRECT_VERSION_LE;
+	resp->negotiated_version = SMB_DIRECT_VERSION_LE;
+	resp->reserved = 0;
+	resp->credits_requested = cpu_to_le16(SMB_DIRECT_SEND_CREDITS);
+	resp->credits_granted = cpu_to_le16(smb_direct_grant_credits(t));
+	resp->status = STATUS_SUCCESS;
+	resp->max_readwrite_size = cpu_to_le32(t->max_rw_size);
+	resp->preferred_send_size = cpu_to_le32(t->max_send_size);
+	resp->max_receive_size = cpu_to_le32(SMB_DIRECT_MAX_RECV_SIZE);
+	resp->max_fragmented_size = cpu_to_le32(t->max_fragmented_recv_size);
+	msg->len = sizeof(*resp);
+
+	ret = smb_direct_post_send(t, msg);
+	if (ret)
+		kfree(msg);
+	return ret;
+}
+
+static int smb_direct_negotiate(struct smb_direct_transport *t,
+				struct smb_direct_recvmsg *msg)
+{
+	struct smb_direct_negotiate_req *req;
+	int ret;
+
+	req = (struct smb_direct_negotiate_req *)msg->packet;
+	if (msg->byte_len < sizeof(*req)) {
+		cifsd_err("Short negotiate request: %u\n", msg->byte_len);
+		return -ECONNABORTED;
+	}
+
+	if (le16_to_cpu(req->min_version) > 0x0100 ||
+	    le16_to_cpu(req->max_version) < 0x0100) {
+		cifsd_err("No common SMB Direct version: %x-%x\n",
+			  le16_to_cpu(req->min_version),
+			  le16_to_cpu(req->max_version));
+		return -ECONNABORTED;
+	}
+
+	/* [MS-SMBD] 3.1.5.6 */
+	if (!le16_to_cpu(req->credits_requested) ||
+	    le32_to_cpu(req->max_receive_size) < 128 ||
+	    le32_to_cpu(req->max_fragmented_size) < 131072) {
+		cifsd_err("Bad negotiate request\n");
+		return -ECONNABORTED;
+	}
+
+	t->max_send_size = min_t(unsigned int, SMB_DIRECT_MAX_SEND_SIZE,
+				 le32_to_cpu(req->max_receive_size));
+	t->recv_credit_target = min_t(int, SMB_DIRECT_RECV_CREDITS,
+				      le16_to_cpu(req->credits_requested));
+	t->negotiated = true;
+
+	/* the negotiate request buffer takes data transfers from now on */
+	ret = smb_direct_alloc_recvmsgs(t, t->recv_credit_target - 1);
+	if (ret)
+		return ret;
+	ret = smb_direct_post_recv(t, msg);
+	if (ret)
+		return ret;
+	atomic_set(&t->new_recv_credits, t->recv_credit_target);
+
+	return smb_direct_send_negotiate_resp(t);
+}
+
+/* Wait for the connection to come up and negotiate, on the handler thread */
+static int smb_direct_prepare(struct cifsd_tcp_conn *conn)
+{
+	struct smb_direct_transport *t = conn->transport;
+	struct smb_direct_recvmsg *msg;
+	long rc;
+
+	/*
+	 * Not interruptible: ESTABLISHED follows the return of the connect
+	 * request handler, which still owns the CM ID until then.
+	 */
+	wait_event_timeout(t->wait_status,
+			   READ_ONCE(t->status) != SMB_DIRECT_CS_NEW,
+			   SMB_DIRECT_NEGOTIATE_TIMEOUT);
+	if (!smb_direct_connected(t))
+		return -ENOTCONN;
+
+	rc = wait_event_interruptible_timeout(t->wait_reassembly,
+			!list_empty(&t->reassembly_queue) ||
+			!smb_direct_connected(t),
+			SMB_DIRECT_NEGOTIATE_TIMEOUT);
+	if (rc <= 0)
+		return rc ? rc : -ETIMEDOUT;
+
+	msg = smb_direct_first_recvmsg(t);
+	if (!msg)
+		return -ENOTCONN;
+	smb_direct_dequeue_recvmsg(t, msg);
+
+	rc = smb_direct_negotiate(t, msg);
+	if (rc)
+		cifsd_err("SMB Direct negotiate failed: %ld\n", rc);
+	return rc;
+}
+
+/*
+ * With the status no longer connected, nothing posts work requests to the
+ * drained queue pair. The CM ID goes last, its events use the transport.
+ */
+static void smb_direct_free_transport(struct smb_direct_transport *t)
+{
+	if (t->qp) {
+		ib_drain_qp(t->qp);
+		/* queued by the last receives, they post nothing now */
+		cancel_work_sync(&t->send_immediate_work);
+		rdma_destroy_qp(t->cm_id);
+		t->qp = NULL;
+	}
+	cancel_work_sync(&t->disconnect_work);
+
+	/* the connect request handler returns an error to destroy it */
+	if (!t->connecting)
+		rdma_destroy_id(t->cm_id);
+
+	if (t->send_cq)
+		ib_free_cq(t->send_cq);
+	if (t->recv_cq)
+		ib_free_cq(t->recv_cq);
+	smb_direct_free_recvmsgs(t);
+	if (t->pd)
+		ib_dealloc_pd(t->pd);
+	kfree(t);
+}
+
+static void smb_direct_disconnect(struct cifsd_tcp_conn *conn)
+{
+	struct smb_direct_transport *t = conn->transport;
+
+	if (!t)
+		return;
+	conn->transport = NULL;
+
+	if (!t->connecting &&
+	    READ_ONCE(t->status) != SMB_DIRECT_CS_DISCONNECTED) {
+		rdma_disconnect(t->cm_id);
+		wait_event_timeout(t->wait_status,
+			READ_ONCE(t->status) == SMB_DIRECT_CS_DISCONNECTED,
+			SMB_DIRECT_DISCONNECT_TIMEOUT);
+	}
+	smb_direct_set_status(t, SMB_DIRECT_CS_DISCONNECTED);
+	cancel_work_sync(&t->send_immediate_work);
+
+	if (t->connecting)
+		t->cm_id->context = NULL;
+	smb_direct_free_transport(t);
+}
+
+/* Chunk of @len bytes of @buf, in at most @max page sized entries of @sg */
+static int smb_direct_buf_to_sg(void *buf, unsigned int len,
+				struct scatterlist *sg, unsigned int max)
+{
+	struct page *page;
+	unsigned int off, n, nents = 0;
+
+	sg_init_table(sg, max);
+	while (len) {
+		if (nents == max)
+			return -EINVAL;
+
+		off = offset_in_page(buf);
+		n = min_t(unsigned int, len, PAGE_SIZE - off);
+		if (is_vmalloc_addr(buf))
+			page = vmalloc_to_page(buf);
+		else
+			page = virt_to_page(buf);
+		sg_set_page(&sg[nents++], page, n, off);
+		buf += n;
+		len -= n;
+	}
+	sg_mark_end(&sg[nents - 1]);
+	return nents;
+}
+
+static void smb_direct_rw_done(struct ib_cq *cq, struct ib_wc *wc)
+{
+	struct smb_direct_rw_msg *msg = container_of(wc->wr_cqe,
+			struct smb_direct_rw_msg, cqe);
+	struct smb_direct_rw_io *io = msg->io;
+
+	if (wc->status != IB_WC_SUCCESS) {
+		if (wc->status != IB_WC_WR_FLUSH_ERR)
+			cifsd_err("RDMA read/write error. status='%s (%d)'\n",
+				  ib_wc_status_msg(wc->status), wc->status);
+		io->status = -EIO;
+	}
+
+	if (atomic_dec_and_test(&io->pending))
+		complete(&io->done);
+}
+
+static int smb_direct_wait_rw_credits(struct smb_direct_transport *t,
+				      int credits)
+{
+	for (;;) {
+		if (!smb_direct_connected(t))
+			return -ENOTCONN;
+		if (atomic_sub_return(credits, &t->rw_credits) >= 0)
+			return 0;
+		atomic_add(credits, &t->rw_credits);
+		wait_event(t->wait_rw_credits,
+			   atomic_read(&t->rw_credits) >= credits ||
+			   !smb_direct_connected(t));
+	}
+}
+
+/*
+ * Pull @len bytes from or push them to the buffers @desc registered by the
+ * client, straight between @buf and the wire.
+ */
+static int smb_direct_rdma_xfer(struct smb_direct_transport *t, void *buf,
+				unsigned int len,
+				struct smb2_buffer_desc_v1 *desc,
+				unsigned int nr_desc,
+				enum dma_data_direction dir)
+{
+	struct smb_direct_rw_msg **msgs;
+	struct smb_direct_rw_io io;
+	unsigned int chunk_max, left, desc_off, n, i, d, nr_msgs = 0;
+	u64 total = 0, remote;
+	int ret, posted = 0;
+
+	if (!len || len > t->max_rw_size)
+		return -EINVAL;
+
+	for (i = 0; i < nr_desc; i++)
+		total += le32_to_cpu(desc[i].length);
+	if (total < len)
+		return -EINVAL;
+
+	/* a chunk of at most rw_pages pages, whatever its page offset */
+	chunk_max = (t->rw_pages - 1) << PAGE_SHIFT;
+	for (d = 0, left = len; left; d++) {
+		n = min(left, le32_to_cpu(desc[d].length));
+		nr_msgs += DIV_ROUND_UP(n, chunk_max);
+		left -= n;
+	}
+	if (nr_msgs > t->rw_credit_max)
+		return -EINVAL;
+
+	msgs = kcalloc(nr_msgs, sizeof(*msgs), GFP_KERNEL);
+	if (!msgs)
+		return -ENOMEM;
+
+	ret = smb_direct_wait_rw_credits(t, nr_msgs);
+	if (ret) {
+		kfree(msgs);
+		return ret;
+	}
+
+	atomic_set(&io.pending, nr_msgs);
+	io.status = 0;
+	init_completion(&io.done);
+
+	i = 0;
+	left = len;
+	for (d = 0; left; d++) {
+		remote = le64_to_cpu(desc[d].offset);
+		desc_off = 0;
+		while (left && desc_off < le32_to_cpu(desc[d].length)) {
+			n = min3(left, chunk_max,
+				 le32_to_cpu(desc[d].length) - desc_off);
+
+			msgs[i] = kzalloc(sizeof(struct smb_direct_rw_msg) +
+					  t->rw_pages *
+					  sizeof(struct scatterlist),
+					  GFP_KERNEL);
+			if (!msgs[i]) {
+				ret = -ENOMEM;
+				goto out;
+			}
+			msgs[i]->io = &io;
+			msgs[i]->cqe.done = smb_direct_rw_done;
+
+			ret = smb_direct_buf_to_sg(buf, n, msgs[i]->sg,
+						   t->rw_pages);
+			if (ret < 0)
+				goto out;
+			msgs[i]->nents = ret;
+
+			ret = rdma_rw_ctx_init(&msgs[i]->rw_ctx, t->qp,
+					       t->cm_id->port_num,
+					       msgs[i]->sg, msgs[i]->nents, 0,
+					       remote + desc_off,
+					       le32_to_cpu(desc[d].token),
+					       dir);
+			if (ret < 0) {
+				cifsd_err("Can't init RDMA context: %d\n", ret);
+				goto out;
+			}
+			msgs[i]->rw_ctx_inited = true;
+
+			buf += n;
+			desc_off += n;
+			left -= n;
+			i++;
+		}
+	}
+
+	for (i = 0; i < nr_msgs; i++) {
+		ret = rdma_rw_ctx_post(&msgs[i]->rw_ctx, t->qp,
+				       t->cm_id->port_num, &msgs[i]->cqe,
+				       NULL);
+		if (ret) {
+			cifsd_err("Can't post RDMA read/write: %d\n", ret);
+			smb_direct_disconnect_rdma(t);
+			break;
+		}
+		posted++;
+	}
+
+	/* what wasn't posted never completes */
+	if (posted < nr_msgs &&
+	    atomic_sub_and_test(nr_msgs - posted, &io.pending))
+		complete(&io.done);
+	if (posted)
+		wait_for_completion(&io.done);
+	if (!ret)
+		ret = io.status;
+
+out:
+	for (i = 0; i < nr_msgs && msgs[i]; i++) {
+		if (msgs[i]->rw_ctx_inited)
+			rdma_rw_ctx_destroy(&msgs[i]->rw_ctx, t->qp,
+					    t->cm_id->port_num, msgs[i]->sg,
+					    msgs[i]->nents, dir);
+		kfree(msgs[i]);
+	}
+	kfree(msgs);
+
+	atomic_add(nr_msgs, &t->rw_credits);
+	wake_up(&t->wait_rw_credits);
+	return ret;
+}
+
+static int smb_direct_rdma_read(struct cifsd_tcp_conn *conn, void *buf,
+				unsigned int len,
+				struct smb2_buffer_desc_v1 *desc,
+				unsigned int nr_desc)
+{
+	return smb_direct_rdma_xfer(conn->transport, buf, len, desc, nr_desc,
+				    DMA_FROM_DEVICE);
+}
+
+static int smb_direct_rdma_write(struct cifsd_tcp_conn *conn, void *buf,
+				 unsigned int len,
+				 struct smb2_buffer_desc_v1 *desc,
+				 unsigned int nr_desc)
+{
+	return smb_direct_rdma_xfer(conn->transport, buf, len, desc, nr_desc,
+				    DMA_TO_DEVICE);
+}
+
+static void smb_direct_qp_event(struct ib_event *event, void *context)
+{
+	struct smb_direct_transport *t = context;
+
+	cifsd_debug("QP event %s (%d)\n", ib_event_msg(event->event),
+		    event->event);
+
+	switch (event->event) {
+	case IB_EVENT_CQ_ERR:
+	case IB_EVENT_QP_FATAL:
+	case IB_EVENT_QP_REQ_ERR:
+	case IB_EVENT_QP_ACCESS_ERR:
+		smb_direct_disconnect_rdma(t);
+		break;
+	default:
+		break;
+	}
+}
+
+static int smb_direct_create_qpair(struct smb_direct_transport *t)
+{
+	struct ib_device *dev = t->cm_id->device;
+	struct ib_qp_init_attr qp_attr;
+	int max_sge, wrs_per_rw, rw_credits, max_send_wr;
+	int ret;
+
+	max_sge = min_t(int, SMB_DIRECT_DEV_MAX_SGE(dev), SMB_DIRECT_MAX_SGE);
+	t->rw_pages = SMB_DIRECT_RW_PAGES;
+	if (rdma_protocol_iwarp(dev, t->cm_id->port_num) &&
+	    dev->attrs.max_fast_reg_page_list_len)
+		t->rw_pages = min_t(unsigned int, t->rw_pages,
+				    dev->attrs.max_fast_reg_page_list_len);
+
+	/*
+	 * Each RDMA context takes a work request per max_sge pages, and up to
+	 * three more the RDMA R/W API adds for memory registration.
+	 */
+	wrs_per_rw = DIV_ROUND_UP(t->rw_pages, max_sge);
+	rw_credits = SMB_DIRECT_RW_CREDITS;
+	max_send_wr = SMB_DIRECT_SEND_CREDITS + 1;
+	if (max_send_wr + rw_credits * (wrs_per_rw + 3) >
+	    dev->attrs.max_qp_wr)
+		rw_credits = (dev->attrs.max_qp_wr - max_send_wr) /
+			     (wrs_per_rw + 3);
+	if (rw_credits < 1 || t->rw_pages < 2) {
+		cifsd_err("Device %s is too small: max_qp_wr %d\n",
+			  dev->name, dev->attrs.max_qp_wr);
+		return -EINVAL;
+	}
+	t->rw_credit_max = rw_credits;
+	atomic_set(&t->rw_credits, rw_credits);
+	t->max_rw_size = min_t(unsigned int, SMB_DIRECT_MAX_RW_SIZE,
+			       rw_credits * ((t->rw_pages - 1) << PAGE_SHIFT));
+
+	t->pd = ib_alloc_pd(dev, 0);
+	if (IS_ERR(t->pd)) {
+		ret = PTR_ERR(t->pd);
+		t->pd = NULL;
+		return ret;
+	}
+
+	/* only signaled work requests complete, one per send or context */
+	t->send_cq = ib_alloc_cq(dev, t, max_send_wr + rw_credits, 0,
+				 IB_POLL_WORKQUEUE);
+	if (IS_ERR(t->send_cq)) {
+		ret = PTR_ERR(t->send_cq);
+		t->send_cq = NULL;
+		return ret;
+	}
+
+	/* one more of each for the drain at teardown */
+	t->recv_cq = ib_alloc_cq(dev, t, SMB_DIRECT_RECV_CREDITS + 1, 0,
+				 IB_POLL_WORKQUEUE);
+	if (IS_ERR(t->recv_cq)) {
+		ret = PTR_ERR(t->recv_cq);
+		t->recv_cq = NULL;
+		return ret;
+	}
+
+	memset(&qp_attr, 0, sizeof(qp_attr));
+	qp_attr.event_handler = smb_direct_qp_event;
+	qp_attr.qp_context = t;
+	qp_attr.cap.max_send_wr = max_send_wr + rw_credits * wrs_per_rw;
+	qp_attr.cap.max_recv_wr = SMB_DIRECT_RECV_CREDITS + 1;
+	qp_attr.cap.max_send_sge = max_sge;
+	qp_attr.cap.max_recv_sge = 1;
+	qp_attr.cap.max_rdma_ctxs = rw_credits;
+	qp_attr.sq_sig_type = IB_SIGNAL_REQ_WR;
+	qp_attr.qp_type = IB_QPT_RC;
+	qp_attr.send_cq = t->send_cq;
+	qp_attr.recv_cq = t->recv_cq;
+	qp_attr.port_num = t->cm_id->port_num;
+
+	ret = rdma_create_qp(t->cm_id, t->pd, &qp_attr);
+	if (ret) {
+		cifsd_err("Can't create QP: %d\n", ret);
+		return ret;
+	}
+	t->qp = t->cm_id->qp;
+	return 0;
+}
+
+static int smb_direct_accept(struct smb_direct_transport *t)
+{
+	struct ib_device *dev = t->cm_id->device;
+	struct rdma_conn_param param;
+	__be32 ird_ord_hdr[2];
+
+	memset(&param, 0, sizeof(param));
+	param.initiator_depth = min_t(u8, dev->attrs.max_qp_rd_atom,
+				      SMB_DIRECT_CM_INITIATOR_DEPTH);
+	/* clients never RDMA read from us */
+	param.responder_resources = 0;
+	param.retry_count = SMB_DIRECT_CM_RETRY;
+	param.rnr_retry_count = SMB_DIRECT_CM_RNR_RETRY;
+	param.flow_control = 0;
+
+	/* Windows expects IRD and ORD in the private data of iWARP */
+	if (rdma_protocol_iwarp(dev, t->cm_id->port_num)) {
+		ird_ord_hdr[0] = cpu_to_be32(param.responder_resources);
+		ird_ord_hdr[1] = cpu_to_be32(1);
+		param.private_data = ird_ord_hdr;
+		param.private_data_len = sizeof(ird_ord_hdr);
+	}
+
+	return rdma_accept(t->cm_id, &param);
+}
+
+static struct smb_direct_transport *
+smb_direct_alloc_transport(struct rdma_cm_id *cm_id)
+{
+	struct smb_direct_transport *t;
+
+	t = kzalloc(sizeof(*t), GFP_KERNEL);
+	if (!t)
+		return NULL;
+
+	t->cm_id = cm_id;
+	t->status = SMB_DIRECT_CS_NEW;
+	init_waitqueue_head(&t->wait_status);
+	spin_lock_init(&t->reassembly_lock);
+	INIT_LIST_HEAD(&t->reassembly_queue);
+	init_waitqueue_head(&t->wait_reassembly);
+	init_waitqueue_head(&t->wait_send_credits);
+	init_waitqueue_head(&t->wait_rw_credits);
+	INIT_LIST_HEAD(&t->recvmsgs);
+	INIT_WORK(&t->send_immediate_work, smb_direct_send_immediate_work);
+	INIT_WORK(&t->disconnect_work, smb_direct_disconnect_work);
+
+	/* until the negotiate request tells us what the peer takes */
+	t->max_send_size = SMB_DIRECT_MAX_SEND_SIZE;
+	t->max_fragmented_recv_size = SMB_DIRECT_MAX_FRAGMENTED_SIZE;
+	/* the negotiate response needs no credit */
+	atomic_set(&t->send_credits, 0);
+	return t;
+}
+
+/*
+ * A returned error makes the CM destroy @cm_id, the connection handler
+ * thread destroys it otherwise.
+ */
+static int smb_direct_handle_connect_request(struct rdma_cm_id *cm_id)
+{
+	struct smb_direct_transport *t;
+	struct cifsd_tcp_conn *conn;
+	int ret;
+
+	t = smb_direct_alloc_transport(cm_id);
+	if (!t)
+		return -ENOMEM;
+	t->connecting = true;
+	cm_id->context = t;
+
+	ret = smb_direct_create_qpair(t);
+	if (ret)
+		goto out_free;
+
+	ret = smb_direct_alloc_recvmsgs(t, 1);
+	if (ret)
+		goto out_free;
+
+	ret = smb_direct_accept(t);
+	if (ret) {
+		cifsd_err("Can't accept SMB Direct connection: %d\n", ret);
+		goto out_free;
+	}
+
+	conn = cifsd_tcp_conn_new(&cifsd_rdma_ops);
+	if (!conn) {
+		ret = -ENOMEM;
+		goto out_free;
+	}
+	conn->transport = t;
+	memcpy(&conn->peer_addr, &cm_id->route.addr.dst_addr,
+	       sizeof(conn->peer_addr));
+
+	/* a failed start frees the connection and the transport with it */
+	ret = cifsd_tcp_conn_run(conn);
+	if (ret)
+		return ret;
+	t->connecting = false;
+	return 0;
+
+out_free:
+	cm_id->context = NULL;
+	smb_direct_free_transport(t);
+	return ret;
+}
+
+static int smb_direct_cm_handler(struct rdma_cm_id *cm_id,
+				 struct rdma_cm_event *event)
+{
+	struct smb_direct_transport *t = cm_id->context;
+
+	cifsd_debug("RDMA CM event %s (%d), status %d\n",
+		    rdma_event_msg(event->event), event->event,
+		    event->status);
+
+	if (event->event == RDMA_CM_EVENT_CONNECT_REQUEST)
+		return smb_direct_handle_connect_request(cm_id);
+
+	/* the listener, or a connection which failed to start */
+	if (!t)
+		return 0;
+
+	switch (event->event) {
+	case RDMA_CM_EVENT_ESTABLISHED:
+		smb_direct_set_status(t, SMB_DIRECT_CS_CONNECTED);
+		break;
+	case RDMA_CM_EVENT_DISCONNECTED:
+	case RDMA_CM_EVENT_DEVICE_REMOVAL:
+	case RDMA_CM_EVENT_CONNECT_ERROR:
+	case RDMA_CM_EVENT_UNREACHABLE:
+	case RDMA_CM_EVENT_REJECTED:
+		smb_direct_set_status(t, SMB_DIRECT_CS_DISCONNECTED);
+		/* flushes what is in flight, the handler thread tears down */
+		rdma_disconnect(cm_id);
+		break;
+	default:
+		break;
+	}
+	return 0;
+}
+
+static struct cifsd_transport_ops cifsd_rdma_ops = {
+	.prepare	= smb_direct_prepare,
+	.readv		= smb_direct_readv,
+	.writev		= smb_direct_writev,
+	.disconnect	= smb_direct_disconnect,
+	.rdma_read	= smb_direct_rdma_read,
+	.rdma_write	= smb_direct_rdma_write,
+};
+
+static void smb_direct_ib_add_one(struct ib_device *ib_dev)
+{
+	struct smb_direct_device *smb_dev;
+
+	smb_dev = kzalloc(sizeof(*smb_dev), GFP_KERNEL);
+	if (!smb_dev)
+		return;
+	smb_dev->ib_dev = ib_dev;
+
+	write_lock(&smb_direct_dev_lock);
+	list_add(&smb_dev->list, &smb_direct_dev_list);
+	write_unlock(&smb_direct_dev_lock);
+}
+
+static void smb_direct_ib_remove_one(struct ib_device *ib_dev,
+				     void *client_data)
+{
+	struct smb_direct_device *smb_dev, *tmp;
+
+	write_lock(&smb_direct_dev_lock);
+	list_for_each_entry_safe(smb_dev, tmp, &smb_direct_dev_list, list) {
+		if (smb_dev->ib_dev == ib_dev) {
+			list_del(&smb_dev->list);
+			kfree(smb_dev);
+			break;
+		}
+	}
+	write_unlock(&smb_direct_dev_lock);
+}
+
+static struct ib_client smb_direct_ib_client = {
+	.name	= "cifsd_smb_direct_ib",
+	.add	= smb_direct_ib_add_one,
+	.remove	= smb_direct_ib_remove_one,
+};
+
+/**
+ * cifsd_rdma_capable_netdev() - check for an RDMA device behind a netdev
+ * @netdev:	network interface of the server
+ *
+ * Return:	true if SMB Direct clients can reach us through @netdev
+ */
+bool cifsd_rdma_capable_netdev(struct net_device *netdev)
+{
+	struct smb_direct_device *smb_dev;
+	struct ib_device *ib_dev;
+	struct net_device *ndev;
+	bool rdma_capable = false;
+	unsigned int port;
+
+	if (!smb_direct_listener)
+		return false;
+
+	read_lock(&smb_direct_dev_lock);
+	list_for_each_entry(smb_dev, &smb_direct_dev_list, list) {
+		ib_dev = smb_dev->ib_dev;
+		if (!SMB_DIRECT_GET_NETDEV(ib_dev))
+			continue;
+
+		for (port = rdma_start_port(ib_dev);
+		     port <= rdma_end_port(ib_dev); port++) {
+			ndev = SMB_DIRECT_GET_NETDEV(ib_dev)(ib_dev, port);
+			if (!ndev)
+				continue;
+			if (ndev == netdev)
+				rdma_capable = true;
+			dev_put(ndev);
+			if (rdma_capable)
+				goto out;
+		}
+	}
+out:
+	read_unlock(&smb_direct_dev_lock);
+	return rdma_capable;
+}
+
+/* iWARP shares the TCP port space, so it listens on a port of its own */
+static unsigned short smb_direct_port(void)
+{
+	struct smb_direct_device *smb_dev;
+	unsigned short port = SMB_DIRECT_PORT_INFINIBAND;
+
+	read_lock(&smb_direct_dev_lock);
+	list_for_each_entry(smb_dev, &smb_direct_dev_list, list) {
+		if (rdma_protocol_iwarp(smb_dev->ib_dev,
+					rdma_start_port(smb_dev->ib_dev))) {
+			port = SMB_DIRECT_PORT_IWARP;
+			break;
+		}
+	}
+	read_unlock(&smb_direct_dev_lock);
+	return port;
+}
+
+/**
+ * cifsd_rdma_init() - start the SMB Direct listener
+ * @backlog:	listen backlog of the TCP listeners
+ *
+ * Return:	0 on success, otherwise error
+ */
+int cifsd_rdma_init(int backlog)
+{
+	struct rdma_cm_id *cm_id;
+	struct sockaddr_in sin;
+	int ret;
+
+	if (smb_direct_listener)
+		return 0;
+
+	if (!smb_direct_client_registered) {
+		/* adds the present devices before it returns */
+		ret = ib_register_client(&smb_direct_ib_client);
+		if (ret)
+			return ret;
+		smb_direct_client_registered = true;
+	}
+
+	cm_id = rdma_create_id(&init_net, smb_direct_cm_handler, NULL,
+			       RDMA_PS_TCP, IB_QPT_RC);
+	if (IS_ERR(cm_id))
+		return PTR_ERR(cm_id);
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_ANY);
+	sin.sin_port = htons(smb_direct_port());
+
+	ret = rdma_bind_addr(cm_id, (struct sockaddr *)&sin);
+	if (ret) {
+		cifsd_err("Can't bind SMB Direct port %u: %d\n",
+			  ntohs(sin.sin_port), ret);
+		goto out_error;
+	}
+
+	ret = rdma_listen(cm_id, backlog);
+	if (ret) {
+		cifsd_err("Can't listen on SMB Direct port %u: %d\n",
+			  ntohs(sin.sin_port), ret);
+		goto out_error;
+	}
+
+	smb_direct_listener = cm_id;
+	cifsd_debug("SMB Direct listening on port %u\n", ntohs(sin.sin_port));
+	return 0;
+
+out_error:
+	rdma_destroy_id(cm_id);
+	return ret;
+}
+
+/**
+ * cifsd_rdma_destroy() - stop the SMB Direct listener
+ *
+ * The connections stay up, they are stopped with the TCP ones.
+ */
+void cifsd_rdma_destroy(void)
+{
+	if (smb_direct_listener) {
+		rdma_destroy_id(smb_direct_listener);
+		smb_direct_listener = NULL;
+	}
+	if (smb_direct_client_registered) {
+		ib_unregister_client(&smb_direct_ib_client);
+		smb_direct_client_registered = false;
+	}
+}
@@ -0,0 +1,81 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ *   Copyright (C) 2018 Samsung Electronics Co., Ltd.
+ */
+
+#ifndef __CIFSD_TRANSPORT_RDMA_H__
+#define __CIFSD_TRANSPORT_RDMA_H__
+
+#include <linux/types.h>
+
+/* SMB Direct ports, iWARP can't share 445 with TCP */
+#define SMB_DIRECT_PORT_INFINIBAND	445
+#define SMB_DIRECT_PORT_IWARP		5445
+
+#define SMB_DIRECT_VERSION_LE		cpu_to_le16(0x0100)
+
+/* SMB Direct negotiate request, [MS-SMBD] 2.2.1 */
+struct smb_direct_negotiate_req {
+	__le16 min_version;
+	__le16 max_version;
+	__le16 reserved;
+	__le16 credits_requested;
+	__le32 preferred_send_size;
+	__le32 max_receive_size;
+	__le32 max_fragmented_size;
+} __packed;
+
+/* SMB Direct negotiate response, [MS-SMBD] 2.2.2 */
+struct smb_direct_negotiate_resp {
+	__le16 min_version;
+	__le16 max_version;
+	__le16 negotiated_version;
+	__le16 reserved;
+	__le16 credits_requested;
+	__le16 credits_granted;
+	__le32 status;
+	__le32 max_readwrite_size;
+	__le32 preferred_send_size;
+	__le32 max_receive_size;
+	__le32 max_fragmented_size;
+} __packed;
+
+#define SMB_DIRECT_RESPONSE_REQUESTED	0x0001
+
+/* SMB Direct data transfer message, [MS-SMBD] 2.2.3 */
+struct smb_direct_data_transfer {
+	__le16 credits_requested;
+	__le16 credits_granted;
+	__le16 flags;
+	__le16 reserved;
+	__le32 remaining_data_length;
+	__le32 data_offset;
+	__le32 data_length;
+	/* the data offset is 8 byte aligned */
+	__le32 padding;
+	__u8   buffer[];
+} __packed;
+
+struct net_device;
+
+#ifdef CONFIG_CIFSD_SMB_DIRECT
+int cifsd_rdma_init(int backlog);
+void cifsd_rdma_destroy(void);
+bool cifsd_rdma_capable_netdev(struct net_device *netdev);
+#else
+static inline int cifsd_rdma_init(int backlog)
+{
+	return 0;
+}
+
+static inline void cifsd_rdma_destroy(void)
+{
+}
+
+static inline bool cifsd_rdma_capable_netdev(struct net_device *netdev)
+{
+	return false;
+}
+#endif /* CONFIG_CIFSD_SMB_DIRECT */
+
+#endif /* __CIFSD_TRANSPORT_RDMA_H__ */
@@ -5,16 +5,25 @@
  */
 
 #include <linux/mutex.h>
+#include <linux/bvec.h>
+#include <linux/version.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 11, 0)
+#include <linux/sched/signal.h>
+#include <linux/shrinker.h>
+#endif
 
 #include "server.h"
 #include "auth.h"
 #include "buffer_pool.h"
 #include "transport_tcp.h"
+#include "transport_rdma.h"
 #include "mgmt/cifsd_ida.h"
+#include "mgmt/user_session.h"
 #include "smb_common.h"
+#include "qos.h"
+#include "notify.h"
+#include "trace.h"
 
-static struct task_struct *cifsd_kthread;
-static struct socket *cifsd_socket = NULL;
 static struct cifsd_tcp_conn_ops default_tcp_conn_ops;
 
 static DEFINE_MUTEX(init_lock);
@@ -24,6 +33,111 @@ static DEFINE_RWLOCK(tcp_conn_list_lock);
 
 #define CIFSD_TCP_RECV_TIMEOUT	(7 * HZ)
 #define CIFSD_TCP_SEND_TIMEOUT	(5 * HZ)
+/* How long a blocked accept waits before the heartbeat is checked again */
+#define CIFSD_TCP_ACCEPT_TIMEOUT	(HZ)
+
+/*
+ * Listening sockets. All of them are bound to the server port with
+ * SO_REUSEPORT, so the stack spreads incoming connections over their
+ * accept queues, and each one has its own accept thread.
+ */
+static unsigned int tcp_listeners = 1;
+module_param(tcp_listeners, uint, 0644);
+MODULE_PARM_DESC(tcp_listeners,
+	"Listening sockets per interface, 0 for one per online CPU. Default: 1");
+
+struct cifsd_tcp_listener {
+	struct socket		*sock;
+	struct task_struct	*task;
+	/* interface the socket is bound to, empty for all of them */
+	char			ifname[IFNAMSIZ];
+	atomic64_t		accepted;
+};
+
+static struct cifsd_tcp_listener *listeners;
+static unsigned int nr_listeners;
+
+/* Time from accept to the first complete PDU of a connection */
+static atomic64_t first_pdu_count;
+static atomic64_t first_pdu_total_ns;
+static atomic64_t first_pdu_max_ns;
+
+/* Requests running on all connections, see cifsd_tcp_requests_running() */
+static atomic_t requests_running;
+
+/*
+ * Shared receive pool. Instead of a kthread per connection, a reader
+ * thread per online CPU is woken up from the socket callbacks and reads
+ * RFC1002 framed PDUs with non-blocking recvmsg for all connections
+ * assigned to it. The threads aren't bound, so that CPU hotplug doesn't
+ * strand them; wakeups tend to keep them near their sockets anyway.
+ */
+static bool rx_pool_enable;
+module_param(rx_pool_enable, bool, 0644);
+MODULE_PARM_DESC(rx_pool_enable,
+	"Use a shared receive thread pool, a thread per CPU. Default: n/N/0");
+
+/* Maximum number of PDUs read from one connection before yielding */
+#define CIFSD_TCP_RX_BUDGET	16
+
+#define CIFSD_TCP_RX_QUEUED	0
+#define CIFSD_TCP_RX_DEAD	1
+
+struct cifsd_tcp_rx_thread {
+	struct task_struct	*task;
+	spinlock_t		lock;
+	struct list_head	conns;
+};
+
+static struct cifsd_tcp_rx_thread *rx_pool;
+static unsigned int rx_pool_size;
+static atomic_t rx_pool_next;
+
+/*
+ * Receive the data of large SMB2 WRITE and SMB1 WRITE_ANDX requests into a
+ * page vector, which is handed to the VFS as is, instead of into one
+ * linear request buffer.
+ */
+static bool write_pages_enable;
+module_param(write_pages_enable, bool, 0644);
+MODULE_PARM_DESC(write_pages_enable,
+	"Receive large write data into pages. Default: n/N/0");
+
+/*
+ * Coalesce responses of one connection. While other requests of the
+ * connection are still queued or being processed, the socket stays corked
+ * after a send for at most this many microseconds, so their responses go
+ * out in the same segments. A response with nothing behind it is sent at
+ * once.
+ */
+static unsigned int tx_coalesce_usecs = 50;
+module_param(tx_coalesce_usecs, uint, 0644);
+MODULE_PARM_DESC(tx_coalesce_usecs,
+	"Response coalescing deadline in microseconds, 0 disables. Default: 50");
+
+/*
+ * A blocked receive returns after this many seconds without data, to
+ * re-check the connection. 0 waits until data arrives or the handler is
+ * signalled. The deadtime expiry of an idle connection is always honored.
+ */
+static unsigned int recv_idle_timeout = 7;
+module_param(recv_idle_timeout, uint, 0644);
+MODULE_PARM_DESC(recv_idle_timeout,
+	"Receive wait in seconds before re-checking an idle connection. Default: 7");
+
+/*
+ * Bytes of each received PDU recorded by the cifsd_pdu_capture trace
+ * event, when it is enabled.
+ */
+static unsigned int pdu_capture_max = 512;
+module_param(pdu_capture_max, uint, 0644);
+MODULE_PARM_DESC(pdu_capture_max,
+	"Bytes of a PDU recorded by the cifsd_pdu_capture event. Default: 512");
+
+/* Smallest PDU for which the request header is peeked at first */
+#define CIFSD_TCP_PAGES_MIN_PDU	(64 * 1024)
+
+static struct cifsd_transport_ops cifsd_tcp_sock_ops;
 
 static inline void cifsd_tcp_cork(struct socket *sock)
 {
@@ -41,6 +155,34 @@ static inline void cifsd_tcp_uncork(struct socket *sock)
 		(char *)&val, sizeof(val));
 }
 
+static void cifsd_tcp_tx_uncork(struct cifsd_tcp_conn *conn)
+{
+	hrtimer_try_to_cancel(&conn->tx_timer);
+	cifsd_tcp_uncork(conn->sock);
+	conn->tx_corked = false;
+}
+
+static void cifsd_tcp_tx_flush_work(struct work_struct *work)
+{
+	struct cifsd_tcp_conn *conn = container_of(work,
+			struct cifsd_tcp_conn, tx_flush_work);
+
+	mutex_lock(&conn->send_lock);
+	/* a pending sender flushes when it is done */
+	if (conn->tx_corked && !atomic_read(&conn->tx_pending))
+		cifsd_tcp_tx_uncork(conn);
+	mutex_unlock(&conn->send_lock);
+}
+
+static enum hrtimer_restart cifsd_tcp_tx_timer_fn(struct hrtimer *timer)
+{
+	struct cifsd_tcp_conn *conn = container_of(timer,
+			struct cifsd_tcp_conn, tx_timer);
+
+	queue_work(system_highpri_wq, &conn->tx_flush_work);
+	return HRTIMER_NORESTART;
+}
+
 static inline void cifsd_tcp_nodelay(struct socket *sock)
 {
 	int val = 1;
@@ -53,11 +195,19 @@ static inline void cifsd_tcp_reuseaddr(struct socket *sock)
 {
 	int val = 1;
 
-	kernel_setsockopt(sock, SOL_TCP, SO_REUSEADDR,
+	kernel_setsockopt(sock, SOL_SOCKET, SO_REUSEADDR,
+		(char *)&val, sizeof(val));
+}
+
+static inline int cifsd_tcp_reuseport(struct socket *sock)
+{
+	int val = 1;
+
+	return kernel_setsockopt(sock, SOL_SOCKET, SO_REUSEPORT,
 		(char *)&val, sizeof(val));
 }
 
-static bool cifsd_tcp_conn_alive(struct cifsd_tcp_conn *conn)
+bool cifsd_tcp_conn_alive(struct cifsd_tcp_conn *conn)
 {
 	if (!cifsd_server_running())
 		return false;
@@ -99,25 +249,38 @@ static void cifsd_tcp_conn_free(struct cifsd_tcp_conn *conn)
 	list_del(&conn->tcp_conns);
 	write_unlock(&tcp_conn_list_lock);
 
-	kernel_sock_shutdown(conn->sock, SHUT_RDWR);
-	sock_release(conn->sock);
-	conn->sock = NULL;
+	conn->t_ops->disconnect(conn);
 
 	cifsd_free_conn_secmech(conn);
+	kfree(conn->iov);
 	cifsd_free_request(conn->request_buf);
+	cifsd_free_pages(conn->request_bvec, conn->request_nr_bvec);
 	cifsd_ida_free(conn->async_ida);
+	cifsd_preauth_sessions_free(conn);
 	kfree(conn->preauth_info);
 	kfree(conn);
 }
 
+static void cifsd_tcp_sock_disconnect(struct cifsd_tcp_conn *conn)
+{
+	hrtimer_cancel(&conn->tx_timer);
+	cancel_work_sync(&conn->tx_flush_work);
+
+	kernel_sock_shutdown(conn->sock, SHUT_RDWR);
+	sock_release(conn->sock);
+	conn->sock = NULL;
+}
+
 /**
- * cifsd_tcp_conn_alloc() - initialize tcp server thread for a new connection
- * @conn:     TCP server instance of connection
- * @sock:	socket associated with new connection
+ * cifsd_tcp_conn_new() - allocate a connection of a transport
+ * @t_ops:	operations of the transport
+ *
+ * The connection is on the connection list until it is freed, the caller
+ * sets up the transport and starts it with cifsd_tcp_conn_run().
  *
- * Return:	0 on success, otherwise -ENOMEM
+ * Return:	connection on success, otherwise NULL
  */
-static struct cifsd_tcp_conn *cifsd_tcp_conn_alloc(struct socket *sock)
+struct cifsd_tcp_conn *cifsd_tcp_conn_new(struct cifsd_transport_ops *t_ops)
 {
 	struct cifsd_tcp_conn *conn;
 
@@ -127,7 +290,7 @@ static struct cifsd_tcp_conn *cifsd_tcp_conn_alloc(struct socket *sock)
 
 	conn->need_neg = true;
 	conn->tcp_status = CIFSD_SESS_NEW;
-	conn->sock = sock;
+	conn->t_ops = t_ops;
 	conn->local_nls = load_nls("utf8");
 	if (!conn->local_nls)
 		conn->local_nls = load_nls_default();
@@ -141,6 +304,17 @@ static struct cifsd_tcp_conn *cifsd_tcp_conn_alloc(struct socket *sock)
 	INIT_LIST_HEAD(&conn->requests);
 	INIT_LIST_HEAD(&conn->async_requests);
 	spin_lock_init(&conn->request_lock);
+	mutex_init(&conn->srv_mutex);
+	mutex_init(&conn->send_lock);
+	atomic_set(&conn->tx_pending, 0);
+	hrtimer_init(&conn->tx_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	conn->tx_timer.function = cifsd_tcp_tx_timer_fn;
+	INIT_WORK(&conn->tx_flush_work, cifsd_tcp_tx_flush_work);
+	mutex_init(&conn->secmech_lock);
+	spin_lock_init(&conn->credits_lock);
+	INIT_LIST_HEAD(&conn->rx_entry);
+	spin_lock_init(&conn->preauth_sess_lock);
+	hash_init(conn->preauth_sess_table);
 	conn->srv_cap = 0;
 	conn->async_ida = cifsd_ida_alloc();
 
@@ -150,6 +324,36 @@ static struct cifsd_tcp_conn *cifsd_tcp_conn_alloc(struct socket *sock)
 	return conn;
 }
 
+/**
+ * cifsd_tcp_conn_alloc() - initialize tcp server thread for a new connection
+ * @sock:	socket associated with new connection
+ *
+ * Return:	connection on success, otherwise NULL
+ */
+static struct cifsd_tcp_conn *cifsd_tcp_conn_alloc(struct socket *sock)
+{
+	struct cifsd_tcp_conn *conn;
+
+	conn = cifsd_tcp_conn_new(&cifsd_tcp_sock_ops);
+	if (conn)
+		conn->sock = sock;
+	return conn;
+}
+
+#if IS_ENABLED(CONFIG_CIFSD_KUNIT_TEST)
+/* A connection of @sock which no handler thread serves, for the KUnit suite */
+struct cifsd_tcp_conn *cifsd_tcp_test_conn_alloc(struct socket *sock)
+{
+	return cifsd_tcp_conn_alloc(sock);
+}
+
+void cifsd_tcp_test_conn_free(struct cifsd_tcp_conn *conn)
+{
+	unload_nls(conn->local_nls);
+	cifsd_tcp_conn_free(conn);
+}
+#endif
+
 /**
  * kvec_array_init() - initialize a IO vector segment
  * @new:	IO vector to be intialized
@@ -207,6 +411,155 @@ static struct kvec *get_conn_iovec(struct cifsd_tcp_conn *conn,
 	return new_iov;
 }
 
+/**
+ * cifsd_tcp_conn_release() - wait for in-flight requests and free conn
+ * @conn:     TCP conn instance of connection
+ */
+static void cifsd_tcp_conn_release(struct cifsd_tcp_conn *conn)
+{
+	/* Requests waiting for QoS admission or changes hold references too */
+	cifsd_qos_flush(conn, NULL);
+	cifsd_notify_flush(conn);
+
+	/* Keep other channels of its sessions from picking the connection */
+	conn->tcp_status = CIFSD_SESS_EXITING;
+	smp_mb();
+
+	/* Wait till all reference dropped to the Server object*/
+	while (atomic_read(&conn->r_count) > 0)
+		schedule_timeout(HZ);
+
+	unload_nls(conn->local_nls);
+	if (conn->conn_ops->terminate_fn)
+		conn->conn_ops->terminate_fn(conn);
+	cifsd_tcp_conn_free(conn);
+	module_put(THIS_MODULE);
+}
+
+/**
+ * cifsd_tcp_read_pages() - read a large PDU, bulk write data into pages
+ * @conn:     TCP conn instance of connection
+ * @hdr_buf:	RFC1002 header of the PDU
+ * @pdu_size:	PDU size from the RFC1002 header
+ *
+ * Reads the fixed part of the request first. If it is an SMB1 or SMB2
+ * write which qualifies, only that part goes to conn->request_buf and the
+ * data is read into conn->request_bvec. Otherwise the whole PDU is read
+ * into conn->request_buf as usual. conn->request_hdr_len is set to what
+ * request_buf holds either way.
+ *
+ * Return:	number of PDU bytes read, otherwise error
+ */
+static int cifsd_tcp_read_pages(struct cifsd_tcp_conn *conn,
+				char *hdr_buf,
+				unsigned int pdu_size)
+{
+	char buf[CIFSD_WRITE_HDR_MAX];
+	unsigned int len = CIFSD_WRITE_HDR_MIN, hdr_size;
+	unsigned int data_len = 0, i;
+	struct kvec *iov;
+	int size;
+
+	BUILD_BUG_ON(CIFSD_WRITE_HDR_MIN > SMB1_WRITE_HDR_SIZE);
+	BUILD_BUG_ON(SMB1_WRITE_HDR_SIZE > CIFSD_WRITE_HDR_MAX);
+
+	memcpy(buf, hdr_buf, 4);
+	size = cifsd_tcp_read(conn, buf + 4, len - 4);
+	if (size != len - 4)
+		return size < 0 ? size : -EAGAIN;
+
+	hdr_size = cifsd_bulk_write_hdr_size(buf);
+	if (hdr_size > len) {
+		size = cifsd_tcp_read(conn, buf + len, hdr_size - len);
+		if (size != hdr_size - len)
+			return size < 0 ? size : -EAGAIN;
+		len = hdr_size;
+	}
+
+	if (hdr_size)
+		data_len = cifsd_bulk_write_len(buf);
+	if (!data_len) {
+		conn->request_buf = cifsd_alloc_request(pdu_size + 4);
+		if (!conn->request_buf)
+			return -ENOMEM;
+
+		memcpy(conn->request_buf, buf, len);
+		if (!cifsd_smb_request(conn))
+			return -EPROTO;
+		conn->request_hdr_len = pdu_size + 4;
+
+		size = cifsd_tcp_read(conn, conn->request_buf + len,
+				      pdu_size + 4 - len);
+		return size < 0 ? size : size + len - 4;
+	}
+
+	conn->request_buf = cifsd_alloc_request(len);
+	if (!conn->request_buf)
+		return -ENOMEM;
+	memcpy(conn->request_buf, buf, len);
+	if (!cifsd_smb_request(conn))
+		return -EPROTO;
+	/* the RFC1002 length still covers the data */
+	conn->request_hdr_len = len;
+
+	conn->request_bvec = cifsd_alloc_pages(data_len,
+					       &conn->request_nr_bvec);
+	if (!conn->request_bvec)
+		return -ENOMEM;
+
+	iov = kmalloc_array(conn->request_nr_bvec, sizeof(*iov), GFP_KERNEL);
+	if (!iov)
+		return -ENOMEM;
+
+	for (i = 0; i < conn->request_nr_bvec; i++) {
+		iov[i].iov_base = page_address(conn->request_bvec[i].bv_page);
+		iov[i].iov_len = conn->request_bvec[i].bv_len;
+	}
+
+	size = conn->t_ops->readv(conn, iov, conn->request_nr_bvec, data_len);
+	kfree(iov);
+	return size < 0 ? size : size + len - 4;
+}
+
+/* Record the framed PDU in conn->request_buf, see pdu_capture_max */
+static void cifsd_tcp_capture_pdu(struct cifsd_tcp_conn *conn)
+{
+	unsigned int pdu_len, len;
+
+	if (!trace_cifsd_pdu_capture_enabled())
+		return;
+
+	pdu_len = get_rfc1002_length(conn->request_buf) + 4;
+	len = min(conn->request_hdr_len, READ_ONCE(pdu_capture_max));
+	trace_cifsd_pdu_capture(conn, conn->request_buf, len, pdu_len);
+}
+
+/**
+ * cifsd_tcp_conn_first_pdu() - account the accept to first PDU latency
+ * @conn:     TCP server instance of connection
+ */
+static void cifsd_tcp_conn_first_pdu(struct cifsd_tcp_conn *conn)
+{
+	s64 delta, max;
+
+	if (likely(!conn->accept_time))
+		return;
+
+	delta = ktime_to_ns(ktime_sub(ktime_get(), conn->accept_time));
+	conn->accept_time = 0;
+
+	atomic64_inc(&first_pdu_count);
+	atomic64_add(delta, &first_pdu_total_ns);
+	max = atomic64_read(&first_pdu_max_ns);
+	while (delta > max) {
+		s64 old = atomic64_cmpxchg(&first_pdu_max_ns, max, delta);
+
+		if (old == max)
+			break;
+		max = old;
+	}
+}
+
 /**
  * cifsd_tcp_conn_handler_loop() - session thread to listen on new smb requests
  * @p:     TCP conn instance of connection
@@ -222,16 +575,24 @@ static int cifsd_tcp_conn_handler_loop(void *p)
 	char hdr_buf[4] = {0,};
 	int size;
 
-	mutex_init(&conn->srv_mutex);
 	__module_get(THIS_MODULE);
+	/* tcp_stop_sessions() interrupts a blocked receive with SIGKILL */
+	allow_signal(SIGKILL);
 	conn->last_active = jiffies;
 
+	if (conn->t_ops->prepare && conn->t_ops->prepare(conn))
+		goto out;
+
 	while (cifsd_tcp_conn_alive(conn)) {
 		if (try_to_freeze())
 			continue;
 
 		cifsd_free_request(conn->request_buf);
 		conn->request_buf = NULL;
+		conn->request_hdr_len = 0;
+		cifsd_free_pages(conn->request_bvec, conn->request_nr_bvec);
+		conn->request_bvec = NULL;
+		conn->request_nr_bvec = 0;
 
 		size = cifsd_tcp_read(conn, hdr_buf, sizeof(hdr_buf));
 		if (size != sizeof(hdr_buf))
@@ -249,19 +610,26 @@ static int cifsd_tcp_conn_handler_loop(void *p)
 
 		/* 4 for rfc1002 length field */
 		size = pdu_size + 4;
-		conn->request_buf = cifsd_alloc_request(size);
-		if (!conn->request_buf)
-			continue;
-
-		memcpy(conn->request_buf, hdr_buf, sizeof(hdr_buf));
-		if (!cifsd_smb_request(conn))
-			break;
-
-		/*
-		 * We already read 4 bytes to find out PDU size, now
-		 * read in PDU
-		 */
-		size = cifsd_tcp_read(conn, conn->request_buf + 4, pdu_size);
+		if (write_pages_enable && size >= CIFSD_TCP_PAGES_MIN_PDU &&
+		    hdr_buf[0] == RFC1002_SESSION_MESSAGE) {
+			size = cifsd_tcp_read_pages(conn, hdr_buf, pdu_size);
+		} else {
+			conn->request_buf = cifsd_alloc_request(size);
+			if (!conn->request_buf)
+				continue;
+
+			memcpy(conn->request_buf, hdr_buf, sizeof(hdr_buf));
+			if (!cifsd_smb_request(conn))
+				break;
+			conn->request_hdr_len = size;
+
+			/*
+			 * We already read 4 bytes to find out PDU size, now
+			 * read in PDU
+			 */
+			size = cifsd_tcp_read(conn, conn->request_buf + 4,
+					      pdu_size);
+		}
 		if (size < 0) {
 			cifsd_err("sock_read failed: %d\n", size);
 			break;
@@ -279,21 +647,388 @@ static int cifsd_tcp_conn_handler_loop(void *p)
 			break;
 		}
 
+		cifsd_tcp_conn_first_pdu(conn);
+		trace_cifsd_pdu_recv(conn, pdu_size);
+		cifsd_tcp_capture_pdu(conn);
+
 		if (conn->conn_ops->process_fn(conn)) {
 			cifsd_err("Cannot handle request\n");
 			break;
 		}
 	}
 
-	/* Wait till all reference dropped to the Server object*/
-	while (atomic_read(&conn->r_count) > 0)
-		schedule_timeout(HZ);
+out:
+	cifsd_tcp_conn_release(conn);
+	return 0;
+}
 
-	unload_nls(conn->local_nls);
-	if (conn->conn_ops->terminate_fn)
-		conn->conn_ops->terminate_fn(conn);
-	cifsd_tcp_conn_free(conn);
-	module_put(THIS_MODULE);
+/**
+ * cifsd_tcp_rx_queue_conn() - queue connection on its receive thread
+ * @conn:     TCP conn instance of connection
+ *
+ * Can be called from the socket callbacks in softirq context.
+ */
+static void cifsd_tcp_rx_queue_conn(struct cifsd_tcp_conn *conn)
+{
+	struct cifsd_tcp_rx_thread *rx = conn->rx_thread;
+
+	if (test_and_set_bit(CIFSD_TCP_RX_QUEUED, &conn->rx_flags))
+		return;
+
+	spin_lock_bh(&rx->lock);
+	if (test_bit(CIFSD_TCP_RX_DEAD, &conn->rx_flags)) {
+		clear_bit(CIFSD_TCP_RX_QUEUED, &conn->rx_flags);
+		spin_unlock_bh(&rx->lock);
+		return;
+	}
+	list_add_tail(&conn->rx_entry, &rx->conns);
+	spin_unlock_bh(&rx->lock);
+	wake_up_process(rx->task);
+}
+
+static void cifsd_tcp_rx_data_ready(struct sock *sk)
+{
+	struct cifsd_tcp_conn *conn;
+
+	read_lock_bh(&sk->sk_callback_lock);
+	conn = sk->sk_user_data;
+	if (conn) {
+		cifsd_tcp_rx_queue_conn(conn);
+		conn->rx_orig_data_ready(sk);
+	}
+	read_unlock_bh(&sk->sk_callback_lock);
+}
+
+static void cifsd_tcp_rx_state_change(struct sock *sk)
+{
+	struct cifsd_tcp_conn *conn;
+
+	read_lock_bh(&sk->sk_callback_lock);
+	conn = sk->sk_user_data;
+	if (conn) {
+		cifsd_tcp_rx_queue_conn(conn);
+		conn->rx_orig_state_change(sk);
+	}
+	read_unlock_bh(&sk->sk_callback_lock);
+}
+
+static void cifsd_tcp_rx_set_callbacks(struct cifsd_tcp_conn *conn)
+{
+	struct sock *sk = conn->sock->sk;
+
+	write_lock_bh(&sk->sk_callback_lock);
+	conn->rx_orig_data_ready = sk->sk_data_ready;
+	conn->rx_orig_state_change = sk->sk_state_change;
+	sk->sk_user_data = conn;
+	sk->sk_data_ready = cifsd_tcp_rx_data_ready;
+	sk->sk_state_change = cifsd_tcp_rx_state_change;
+	write_unlock_bh(&sk->sk_callback_lock);
+}
+
+static void cifsd_tcp_rx_restore_callbacks(struct cifsd_tcp_conn *conn)
+{
+	struct sock *sk = conn->sock->sk;
+
+	write_lock_bh(&sk->sk_callback_lock);
+	sk->sk_user_data = NULL;
+	sk->sk_data_ready = conn->rx_orig_data_ready;
+	sk->sk_state_change = conn->rx_orig_state_change;
+	write_unlock_bh(&sk->sk_callback_lock);
+}
+
+static void cifsd_tcp_rx_release_work(struct work_struct *wk)
+{
+	struct cifsd_tcp_conn *conn;
+
+	conn = container_of(wk, struct cifsd_tcp_conn, rx_release_work);
+	cifsd_tcp_conn_release(conn);
+}
+
+/**
+ * cifsd_tcp_rx_detach() - detach a dead connection from the receive pool
+ * @conn:     TCP conn instance of connection
+ *
+ * Must be called from the receive thread owning @conn. Once the socket
+ * callbacks are restored and @conn is marked dead nobody can queue it
+ * again, so the rest of the teardown, which has to wait for in-flight
+ * works, is done from a work.
+ */
+static void cifsd_tcp_rx_detach(struct cifsd_tcp_conn *conn)
+{
+	struct cifsd_tcp_rx_thread *rx = conn->rx_thread;
+
+	cifsd_tcp_rx_restore_callbacks(conn);
+
+	spin_lock_bh(&rx->lock);
+	set_bit(CIFSD_TCP_RX_DEAD, &conn->rx_flags);
+	list_del_init(&conn->rx_entry);
+	clear_bit(CIFSD_TCP_RX_QUEUED, &conn->rx_flags);
+	spin_unlock_bh(&rx->lock);
+
+	INIT_WORK(&conn->rx_release_work, cifsd_tcp_rx_release_work);
+	queue_work(system_long_wq, &conn->rx_release_work);
+}
+
+/**
+ * cifsd_tcp_rx_recv() - non-blocking read from connection socket
+ * @conn:     TCP conn instance of connection
+ * @buf:	buffer to store read data from socket
+ * @to_read:	number of bytes to read from socket
+ *
+ * Return:	number of bytes read, -EAGAIN if no data is available,
+ *		otherwise error number
+ */
+static int cifsd_tcp_rx_recv(struct cifsd_tcp_conn *conn,
+			     char *buf,
+			     unsigned int to_read)
+{
+	struct msghdr cifsd_msg = {.msg_flags = MSG_DONTWAIT};
+	struct kvec iov;
+	int length;
+
+	iov.iov_base = buf;
+	iov.iov_len = to_read;
+
+	length = kernel_recvmsg(conn->sock, &cifsd_msg, &iov, 1, to_read,
+				MSG_DONTWAIT);
+	if (length == 0)
+		return -ESHUTDOWN;
+	if (length == -ERESTARTSYS)
+		return -EAGAIN;
+	return length;
+}
+
+/**
+ * cifsd_tcp_rx_pdu() - advance the framing state of a connection
+ * @conn:     TCP conn instance of connection
+ *
+ * Same framing rules as cifsd_tcp_conn_handler_loop(), but the state is
+ * kept in @conn so that a partially received PDU can be resumed on the
+ * next socket callback.
+ *
+ * Return:	0 when a PDU was handed to process_fn or dropped, -EAGAIN
+ *		when more data is needed, otherwise error number
+ */
+static int cifsd_tcp_rx_pdu(struct cifsd_tcp_conn *conn)
+{
+	int size;
+
+	if (conn->rx_hdr_len < sizeof(conn->rx_hdr)) {
+		size = cifsd_tcp_rx_recv(conn,
+					 conn->rx_hdr + conn->rx_hdr_len,
+					 sizeof(conn->rx_hdr) -
+					 conn->rx_hdr_len);
+		if (size < 0)
+			return size;
+
+		conn->rx_hdr_len += size;
+		if (conn->rx_hdr_len < sizeof(conn->rx_hdr))
+			return -EAGAIN;
+
+		conn->rx_pdu_size = get_rfc1002_length(conn->rx_hdr);
+		cifsd_debug("RFC1002 header %u bytes\n", conn->rx_pdu_size);
+
+		/* make sure we have enough to get to SMB header end */
+		if (!cifsd_pdu_size_has_room(conn->rx_pdu_size)) {
+			cifsd_debug("SMB request too short (%u bytes)\n",
+				    conn->rx_pdu_size);
+			conn->rx_hdr_len = 0;
+			return 0;
+		}
+
+		/* 4 for rfc1002 length field */
+		conn->request_buf = cifsd_alloc_request(conn->rx_pdu_size + 4);
+		if (!conn->request_buf) {
+			conn->rx_hdr_len = 0;
+			return 0;
+		}
+
+		memcpy(conn->request_buf, conn->rx_hdr, sizeof(conn->rx_hdr));
+		if (!cifsd_smb_request(conn))
+			return -EINVAL;
+		conn->request_hdr_len = conn->rx_pdu_size + 4;
+		conn->rx_pdu_len = 0;
+	}
+
+	while (conn->rx_pdu_len < conn->rx_pdu_size) {
+		size = cifsd_tcp_rx_recv(conn,
+					 conn->request_buf + 4 +
+					 conn->rx_pdu_len,
+					 conn->rx_pdu_size - conn->rx_pdu_len);
+		if (size < 0)
+			return size;
+		conn->rx_pdu_len += size;
+	}
+
+	conn->rx_hdr_len = 0;
+	if (!conn->conn_ops->process_fn) {
+		cifsd_err("No connection request callback\n");
+		return -EINVAL;
+	}
+
+	cifsd_tcp_conn_first_pdu(conn);
+	trace_cifsd_pdu_recv(conn, conn->rx_pdu_size);
+	cifsd_tcp_capture_pdu(conn);
+
+	if (conn->conn_ops->process_fn(conn)) {
+		cifsd_err("Cannot handle request\n");
+		return -EINVAL;
+	}
+
+	cifsd_free_request(conn->request_buf);
+	conn->request_buf = NULL;
+	conn->request_hdr_len = 0;
+	return 0;
+}
+
+/**
+ * cifsd_tcp_rx_conn() - read pending PDUs of a queued connection
+ * @conn:     TCP conn instance of connection
+ */
+static void cifsd_tcp_rx_conn(struct cifsd_tcp_conn *conn)
+{
+	int budget = CIFSD_TCP_RX_BUDGET;
+	int ret;
+
+	while (budget--) {
+		if (!cifsd_tcp_conn_alive(conn)) {
+			cifsd_tcp_rx_detach(conn);
+			return;
+		}
+
+		ret = cifsd_tcp_rx_pdu(conn);
+		if (ret == -EAGAIN)
+			return;
+		if (ret < 0) {
+			if (ret != -ESHUTDOWN)
+				cifsd_err("sock_read failed: %d\n", ret);
+			cifsd_tcp_rx_detach(conn);
+			return;
+		}
+	}
+
+	/* Out of budget, let other connections of this thread run */
+	cifsd_tcp_rx_queue_conn(conn);
+}
+
+/**
+ * cifsd_tcp_rx_scan_idle() - queue idle connections of a receive thread
+ * @rx:		receive thread
+ *
+ * Idle connections don't trigger socket callbacks, so deadtime and server
+ * shutdown are checked here every CIFSD_TCP_RECV_TIMEOUT, also while the
+ * thread is kept busy by other connections.
+ */
+static void cifsd_tcp_rx_scan_idle(struct cifsd_tcp_rx_thread *rx)
+{
+	struct cifsd_tcp_conn *conn;
+
+	read_lock(&tcp_conn_list_lock);
+	list_for_each_entry(conn, &tcp_conn_list, tcp_conns) {
+		if (conn->rx_thread == rx && !cifsd_tcp_conn_alive(conn))
+			cifsd_tcp_rx_queue_conn(conn);
+	}
+	read_unlock(&tcp_conn_list_lock);
+}
+
+static int cifsd_tcp_rx_thread_fn(void *p)
+{
+	struct cifsd_tcp_rx_thread *rx = p;
+	struct cifsd_tcp_conn *conn;
+	unsigned long next_scan = jiffies + CIFSD_TCP_RECV_TIMEOUT;
+
+	set_freezable();
+	while (!kthread_should_stop()) {
+		if (try_to_freeze())
+			continue;
+
+		if (time_after_eq(jiffies, next_scan)) {
+			cifsd_tcp_rx_scan_idle(rx);
+			next_scan = jiffies + CIFSD_TCP_RECV_TIMEOUT;
+		}
+
+		set_current_state(TASK_INTERRUPTIBLE);
+		spin_lock_bh(&rx->lock);
+		if (list_empty(&rx->conns)) {
+			spin_unlock_bh(&rx->lock);
+			schedule_timeout(max_t(long, next_scan - jiffies, 1));
+			continue;
+		}
+		__set_current_state(TASK_RUNNING);
+
+		conn = list_first_entry(&rx->conns,
+					struct cifsd_tcp_conn,
+					rx_entry);
+		list_del_init(&conn->rx_entry);
+		clear_bit(CIFSD_TCP_RX_QUEUED, &conn->rx_flags);
+		spin_unlock_bh(&rx->lock);
+
+		cifsd_tcp_rx_conn(conn);
+		cond_resched();
+	}
+	return 0;
+}
+
+static int cifsd_tcp_rx_attach(struct cifsd_tcp_conn *conn)
+{
+	unsigned int idx;
+
+	idx = (unsigned int)atomic_inc_return(&rx_pool_next) % rx_pool_size;
+	conn->rx_thread = &rx_pool[idx];
+
+	__module_get(THIS_MODULE);
+	conn->last_active = jiffies;
+	cifsd_tcp_rx_set_callbacks(conn);
+	/* Pick up data which arrived before the callbacks were installed */
+	cifsd_tcp_rx_queue_conn(conn);
+	return 0;
+}
+
+static void cifsd_tcp_rx_pool_stop(void)
+{
+	unsigned int i;
+
+	if (!rx_pool)
+		return;
+
+	for (i = 0; i < rx_pool_size; i++) {
+		if (rx_pool[i].task)
+			kthread_stop(rx_pool[i].task);
+	}
+	kfree(rx_pool);
+	rx_pool = NULL;
+	rx_pool_size = 0;
+}
+
+static int cifsd_tcp_rx_pool_start(void)
+{
+	struct cifsd_tcp_rx_thread *rx;
+	struct task_struct *task;
+	unsigned int nr = num_online_cpus(), i;
+
+	rx_pool = kcalloc(nr, sizeof(*rx_pool), GFP_KERNEL);
+	if (!rx_pool)
+		return -ENOMEM;
+
+	for (i = 0; i < nr; i++) {
+		rx = &rx_pool[i];
+		spin_lock_init(&rx->lock);
+		INIT_LIST_HEAD(&rx->conns);
+
+		task = kthread_create(cifsd_tcp_rx_thread_fn, rx,
+				      "kcifsd-rx/%u", i);
+		if (IS_ERR(task)) {
+			cifsd_err("cannot start rx thread: %ld\n",
+				  PTR_ERR(task));
+			rx_pool_size = i;
+			cifsd_tcp_rx_pool_stop();
+			return PTR_ERR(task);
+		}
+
+		rx->task = task;
+		rx_pool_size = i + 1;
+		wake_up_process(task);
+	}
 	return 0;
 }
 
@@ -308,6 +1043,33 @@ static unsigned short cifsd_tcp_get_port(const struct sockaddr *sa)
 	return 0;
 }
 
+/**
+ * cifsd_tcp_conn_run() - start the handler thread of a new connection
+ * @conn:     TCP server instance of connection, with its peer address set
+ *
+ * The connection is freed if the thread can't be started.
+ *
+ * Return:	0 on success, otherwise error
+ */
+int cifsd_tcp_conn_run(struct cifsd_tcp_conn *conn)
+{
+	struct sockaddr *csin = CIFSD_TCP_PEER_SOCKADDR(conn);
+	int rc;
+
+	conn->conn_ops = &default_tcp_conn_ops;
+	conn->handler = kthread_run(cifsd_tcp_conn_handler_loop,
+				    conn,
+				    "kcifsd:%u",
+				    cifsd_tcp_get_port(csin));
+	if (IS_ERR(conn->handler)) {
+		cifsd_err("cannot start conn thread\n");
+		rc = PTR_ERR(conn->handler);
+		cifsd_tcp_conn_free(conn);
+		return rc;
+	}
+	return 0;
+}
+
 /**
  * cifsd_tcp_new_connection() - create a new tcp session on mount
  * @sock:	socket associated with new connection
@@ -327,6 +1089,7 @@ static int cifsd_tcp_new_connection(struct socket *client_sk)
 	if (!conn)
 		return -ENOMEM;
 
+	conn->accept_time = ktime_get();
 	csin = CIFSD_TCP_PEER_SOCKADDR(conn);
 
 #if LINUX_VERSION_CODE < KERNEL_VERSION(4, 16, 0)
@@ -344,17 +1107,12 @@ static int cifsd_tcp_new_connection(struct socket *client_sk)
 	}
 #endif
 
-	conn->conn_ops = &default_tcp_conn_ops;
-	conn->handler = kthread_run(cifsd_tcp_conn_handler_loop,
-				    conn,
-				    "kcifsd:%u",
-				    cifsd_tcp_get_port(csin));
-	if (IS_ERR(conn->handler)) {
-		cifsd_err("cannot start conn thread\n");
-		rc = PTR_ERR(conn->handler);
-		cifsd_tcp_conn_free(conn);
+	if (rx_pool) {
+		conn->conn_ops = &default_tcp_conn_ops;
+		return cifsd_tcp_rx_attach(conn);
 	}
-	return rc;
+
+	return cifsd_tcp_conn_run(conn);
 
 out_error:
 	cifsd_tcp_conn_free(conn);
@@ -363,12 +1121,13 @@ out_error:
 
 /**
  * cifsd_kthread_fn() - listen to new SMB connections and callback server
- * @p:		arguments to forker thread
+ * @p:		listener the thread accepts connections on
  *
  * Return:	Returns a task_struct or ERR_PTR
  */
 static int cifsd_kthread_fn(void *p)
 {
+	struct cifsd_tcp_listener *l = (struct cifsd_tcp_listener *)p;
 	struct socket *client_sk = NULL;
 	int ret;
 
@@ -378,15 +1137,19 @@ static int cifsd_kthread_fn(void *p)
 			continue;
 		}
 
-		ret = kernel_accept(cifsd_socket, &client_sk, O_NONBLOCK);
+		/*
+		 * Blocks for at most CIFSD_TCP_ACCEPT_TIMEOUT, and returns
+		 * early once the listener is shut down.
+		 */
+		ret = kernel_accept(l->sock, &client_sk, 0);
 		if (ret) {
-			if (ret == -EAGAIN)
-				/* check for new connections every 100 msecs */
+			if (ret != -EAGAIN)
 				schedule_timeout_interruptible(HZ / 10);
 			continue;
 		}
 
 		cifsd_debug("connect success: accepted new connection\n");
+		atomic64_inc(&l->accepted);
 		client_sk->sk->sk_rcvtimeo = 7 * HZ;
 		client_sk->sk->sk_sndtimeo = 5 * HZ;
 
@@ -398,30 +1161,197 @@ static int cifsd_kthread_fn(void *p)
 }
 
 /**
- * cifsd_create_cifsd_kthread() - start forker thread
+ * cifsd_tcp_run_kthread() - start forker threads
  *
- * start forker thread(kcifsd/0) at module init time to listen
- * on port 445 for new SMB connection requests. It creates per connection
- * server threads(kcifsd/x)
+ * start one forker thread(kcifsd/N) per listening socket at module init
+ * time to listen on port 445 for new SMB connection requests. It creates
+ * per connection server threads(kcifsd/x)
  *
  * Return:	0 on success or error number
  */
 static int cifsd_tcp_run_kthread(void)
 {
+	struct cifsd_tcp_listener *l;
+	unsigned int i;
 	int rc;
 
-	cifsd_kthread = kthread_run(cifsd_kthread_fn, NULL, "kcifsd");
-	if (IS_ERR(cifsd_kthread)) {
-		rc = PTR_ERR(cifsd_kthread);
-		cifsd_kthread = NULL;
-		return rc;
+	for (i = 0; i < nr_listeners; i++) {
+		l = &listeners[i];
+		l->task = kthread_run(cifsd_kthread_fn, l, "kcifsd/%u", i);
+		if (IS_ERR(l->task)) {
+			rc = PTR_ERR(l->task);
+			l->task = NULL;
+			return rc;
+		}
 	}
 
 	return 0;
 }
 
 /**
- * cifsd_tcp_readv() - read data from socket in given iovec
+ * cifsd_tcp_listener_stats() - print listener statistics
+ * @buf:	output buffer
+ * @size:	size of @buf
+ *
+ * Return:	number of bytes written to @buf
+ */
+ssize_t cifsd_tcp_listener_stats(char *buf, size_t size)
+{
+	s64 count = atomic64_read(&first_pdu_count);
+	s64 avg = 0;
+	ssize_t sz = 0;
+	unsigned int i;
+
+	mutex_lock(&init_lock);
+	for (i = 0; i < nr_listeners; i++)
+		sz += scnprintf(buf + sz, size - sz, "listener%u %s %lld\n",
+				i,
+				listeners[i].ifname[0] ?
+					listeners[i].ifname : "*",
+				atomic64_read(&listeners[i].accepted));
+	mutex_unlock(&init_lock);
+
+	if (count)
+		avg = div64_s64(atomic64_read(&first_pdu_total_ns), count);
+	sz += scnprintf(buf + sz, size - sz, "first_pdu %lld %lld %lld\n",
+			count,
+			div_s64(avg, NSEC_PER_USEC),
+			div_s64(atomic64_read(&first_pdu_max_ns),
+				NSEC_PER_USEC));
+	return sz;
+}
+
+/**
+ * cifsd_tcp_credit_stats() - print the credit windows of connections
+ * @buf:	output buffer
+ * @size:	size of @buf
+ *
+ * One line per connection: peer address, credit window, outstanding
+ * credits and running requests.
+ *
+ * Return:	number of bytes written to @buf
+ */
+ssize_t cifsd_tcp_credit_stats(char *buf, size_t size)
+{
+	struct cifsd_tcp_conn *conn;
+	int window, granted;
+	ssize_t sz = 0;
+
+	read_lock(&tcp_conn_list_lock);
+	list_for_each_entry(conn, &tcp_conn_list, tcp_conns) {
+		spin_lock(&conn->credits_lock);
+		window = conn->credit_window;
+		granted = conn->credits_granted;
+		spin_unlock(&conn->credits_lock);
+
+		sz += scnprintf(buf + sz, size - sz, "%pISpc %d %d %d\n",
+				CIFSD_TCP_PEER_SOCKADDR(conn),
+				window,
+				granted,
+				atomic_read(&conn->req_running));
+	}
+	read_unlock(&tcp_conn_list_lock);
+	return sz;
+}
+
+static unsigned int conn_secmech_count(struct cifsd_tcp_conn *conn)
+{
+	return !!conn->secmech.hmacmd5 + !!conn->secmech.hmacsha256 +
+		!!conn->secmech.md5;
+}
+
+/**
+ * cifsd_tcp_memory_stats() - print memory held by connections
+ * @buf:	output buffer
+ * @size:	size of @buf
+ *
+ * Hash contexts kept for authentication and signing, and receive iovecs.
+ *
+ * Return:	number of bytes written to @buf
+ */
+ssize_t cifsd_tcp_memory_stats(char *buf, size_t size)
+{
+	unsigned long contexts = 0, iovs = 0;
+	struct cifsd_tcp_conn *conn;
+
+	read_lock(&tcp_conn_list_lock);
+	list_for_each_entry(conn, &tcp_conn_list, tcp_conns) {
+		contexts += conn_secmech_count(conn);
+		if (conn->iov)
+			iovs += conn->nr_iov;
+	}
+	read_unlock(&tcp_conn_list_lock);
+
+	return scnprintf(buf, size, "crypto_contexts %lu\niovecs %lu %zu\n",
+			 contexts, iovs, iovs * sizeof(struct kvec));
+}
+
+/*
+ * Hash contexts of connections are allocated on first use and kept for
+ * the connection's lifetime, reclaim frees the SMB1 signing context when
+ * it isn't in use.
+ */
+static unsigned long conn_shrink_count(struct shrinker *shrink,
+				       struct shrink_control *sc)
+{
+	struct cifsd_tcp_conn *conn;
+	unsigned long count = 0;
+
+	read_lock(&tcp_conn_list_lock);
+	list_for_each_entry(conn, &tcp_conn_list, tcp_conns)
+		count += !!conn->secmech.md5;
+	read_unlock(&tcp_conn_list_lock);
+	return count;
+}
+
+static unsigned long conn_shrink_scan(struct shrinker *shrink,
+				      struct shrink_control *sc)
+{
+	struct cifsd_tcp_conn *conn;
+	unsigned long freed = 0;
+
+	read_lock(&tcp_conn_list_lock);
+	list_for_each_entry(conn, &tcp_conn_list, tcp_conns) {
+		if (freed >= sc->nr_to_scan)
+			break;
+		freed += cifsd_shrink_conn_secmech(conn);
+	}
+	read_unlock(&tcp_conn_list_lock);
+	return freed ? freed : SHRINK_STOP;
+}
+
+static struct shrinker conn_shrinker = {
+	.count_objects	= conn_shrink_count,
+	.scan_objects	= conn_shrink_scan,
+	.seeks		= DEFAULT_SEEKS,
+};
+static bool conn_shrinker_registered;
+
+/**
+ * cifsd_tcp_recv_timeout() - get the receive timeout for a blocked read
+ * @conn:     TCP server instance of connection
+ *
+ * Return:	timeout in jiffies
+ */
+long cifsd_tcp_recv_timeout(struct cifsd_tcp_conn *conn)
+{
+	long timeo = MAX_SCHEDULE_TIMEOUT;
+	unsigned int secs = READ_ONCE(recv_idle_timeout);
+
+	if (secs)
+		timeo = (long)secs * HZ;
+
+	if (server_conf.deadtime > 0 && !conn->stats.open_files_count) {
+		long left = (long)(conn->last_active + server_conf.deadtime -
+				   jiffies);
+
+		timeo = min(timeo, max(left, 1L));
+	}
+	return timeo;
+}
+
+/**
+ * cifsd_tcp_sock_readv() - read data from socket in given iovec
  * @conn:     TCP server instance of connection
  * @iov_orig:	base IO vector
  * @nr_segs:	number of segments in base iov
@@ -430,10 +1360,10 @@ static int cifsd_tcp_run_kthread(void)
  * Return:	on success return number of bytes read from socket,
  *		otherwise return error number
  */
-static int cifsd_tcp_readv(struct cifsd_tcp_conn *conn,
-			   struct kvec *iov_orig,
-			   unsigned int nr_segs,
-			   unsigned int to_read)
+static int cifsd_tcp_sock_readv(struct cifsd_tcp_conn *conn,
+				struct kvec *iov_orig,
+				unsigned int nr_segs,
+				unsigned int to_read)
 {
 	int length = 0;
 	int total_read;
@@ -457,6 +1387,8 @@ static int cifsd_tcp_readv(struct cifsd_tcp_conn *conn,
 		}
 		segs = kvec_array_init(iov, iov_orig, nr_segs, total_read);
 
+		WRITE_ONCE(conn->sock->sk->sk_rcvtimeo,
+			   cifsd_tcp_recv_timeout(conn));
 		length = kernel_recvmsg(conn->sock, &cifsd_msg,
 					iov, segs, to_read, 0);
 
@@ -467,7 +1399,12 @@ static int cifsd_tcp_readv(struct cifsd_tcp_conn *conn,
 			total_read = -EAGAIN;
 			break;
 		} else if (length == -ERESTARTSYS || length == -EAGAIN) {
-			usleep_range(1000, 2000);
+			/*
+			 * Receive timeout or a wakeup signal, the loop
+			 * re-checks the connection before waiting again.
+			 */
+			if (signal_pending(current))
+				flush_signals(current);
 			length = 0;
 			continue;
 		} else if (length <= 0) {
@@ -496,7 +1433,43 @@ int cifsd_tcp_read(struct cifsd_tcp_conn *conn,
 	iov.iov_base = buf;
 	iov.iov_len = to_read;
 
-	return cifsd_tcp_readv(conn, &iov, 1, to_read);
+	return conn->t_ops->readv(conn, &iov, 1, to_read);
+}
+
+/**
+ * cifsd_tcp_sendpages() - send page cache backed read data of response
+ * @conn:     TCP server instance of connection
+ * @work:     smb work containing aux payload pages
+ *
+ * Called under conn->send_lock after the response header was sent.
+ *
+ * Return:	0 on success, otherwise error
+ */
+static int cifsd_tcp_sendpages(struct cifsd_tcp_conn *conn,
+			       struct cifsd_work *work)
+{
+	struct bio_vec *bv;
+	unsigned int i, off, len;
+	int flags, sent;
+
+	for (i = 0; i < work->aux_payload_nr_bvec; i++) {
+		bv = &work->aux_payload_bvec[i];
+		flags = MSG_NOSIGNAL;
+		if (i + 1 < work->aux_payload_nr_bvec)
+			flags |= MSG_MORE;
+
+		off = bv->bv_offset;
+		len = bv->bv_len;
+		while (len) {
+			sent = kernel_sendpage(conn->sock, bv->bv_page, off,
+					       len, flags);
+			if (sent <= 0)
+				return sent ? sent : -EPIPE;
+			off += sent;
+			len -= sent;
+		}
+	}
+	return 0;
 }
 
 /**
@@ -512,7 +1485,6 @@ int cifsd_tcp_write(struct cifsd_work *work)
 {
 	struct cifsd_tcp_conn *conn = work->conn;
 	struct smb_hdr *rsp_hdr = RESPONSE_BUF(work);
-	struct msghdr smb_msg = {.msg_flags = MSG_NOSIGNAL};
 	size_t len = 0;
 	int sent;
 	struct kvec iov[3];
@@ -525,32 +1497,34 @@ int cifsd_tcp_write(struct cifsd_work *work)
 	}
 
 	if (HAS_TRANSFORM_BUF(work)) {
+		/* the transform header is followed by the encrypted message */
 		iov[iov_idx] = (struct kvec) { work->tr_buf,
-				sizeof(struct smb2_transform_hdr) };
+				sizeof(struct smb2_transform_hdr) +
+				RESP_HDR_SIZE(work) };
 		len += iov[iov_idx++].iov_len;
-	}
-
-	if (HAS_AUX_PAYLOAD(work)) {
+		if (HAS_AUX_PAYLOAD(work) && !HAS_AUX_PAYLOAD_PAGES(work)) {
+			iov[iov_idx] = (struct kvec) { AUX_PAYLOAD(work),
+				AUX_PAYLOAD_SIZE(work) };
+			len += iov[iov_idx++].iov_len;
+		}
+	} else if (HAS_AUX_PAYLOAD_PAGES(work)) {
+		/* read data pages are sent by the transport */
+		iov[iov_idx] = (struct kvec) { rsp_hdr, RESP_HDR_SIZE(work) };
+		len += iov[iov_idx++].iov_len;
+	} else if (HAS_AUX_PAYLOAD(work)) {
 		iov[iov_idx] = (struct kvec) { rsp_hdr, RESP_HDR_SIZE(work) };
 		len += iov[iov_idx++].iov_len;
 		iov[iov_idx] = (struct kvec) { AUX_PAYLOAD(work),
 			AUX_PAYLOAD_SIZE(work) };
 		len += iov[iov_idx++].iov_len;
-
-		cifsd_tcp_cork(conn->sock);
 	} else {
-		if (HAS_TRANSFORM_BUF(work))
-			iov[iov_idx].iov_len = RESP_HDR_SIZE(work);
-		else
-			iov[iov_idx].iov_len =
-				get_rfc1002_length(rsp_hdr) + 4;
+		iov[iov_idx].iov_len = get_rfc1002_length(rsp_hdr) + 4;
 		iov[iov_idx].iov_base = rsp_hdr;
 		len += iov[iov_idx++].iov_len;
 	}
 
-	sent = kernel_sendmsg(conn->sock, &smb_msg, iov, iov_idx, len);
-	if (HAS_AUX_PAYLOAD(work))
-		cifsd_tcp_uncork(conn->sock);
+	sent = conn->t_ops->writev(conn, work, iov, iov_idx, len);
+	trace_cifsd_rsp_send(work, len, sent);
 	if (sent < 0) {
 		cifsd_err("Failed to send message: %d\n", sent);
 		return sent;
@@ -559,20 +1533,137 @@ int cifsd_tcp_write(struct cifsd_work *work)
 	return 0;
 }
 
+/**
+ * cifsd_tcp_sock_writev() - send a response over the connection socket
+ * @conn:     TCP server instance of connection
+ * @work:     smb work of the response
+ * @iov:	response buffers, without page cache backed read data
+ * @nr_segs:	number of segments in iov
+ * @len:	total length of iov
+ *
+ * Return:	number of bytes sent on success, otherwise error
+ */
+static int cifsd_tcp_sock_writev(struct cifsd_tcp_conn *conn,
+				 struct cifsd_work *work,
+				 struct kvec *iov,
+				 int nr_segs,
+				 size_t len)
+{
+	struct msghdr smb_msg = {.msg_flags = MSG_NOSIGNAL};
+	unsigned int usecs;
+	int sent;
+
+	/* read data follows from the page cache, see sendpages */
+	if (HAS_AUX_PAYLOAD_PAGES(work))
+		smb_msg.msg_flags |= MSG_MORE;
+
+	/* a lone response isn't worth the cork and uncork */
+	usecs = READ_ONCE(tx_coalesce_usecs);
+	atomic_inc(&conn->tx_pending);
+	mutex_lock(&conn->send_lock);
+	if (((usecs && atomic_read(&conn->r_count) > 1) ||
+	     HAS_AUX_PAYLOAD(work)) && !conn->tx_corked) {
+		cifsd_tcp_cork(conn->sock);
+		conn->tx_corked = true;
+	}
+	sent = kernel_sendmsg(conn->sock, &smb_msg, iov, nr_segs, len);
+	if (sent >= 0 && HAS_AUX_PAYLOAD_PAGES(work)) {
+		int ret = cifsd_tcp_sendpages(conn, work);
+
+		if (ret < 0)
+			sent = ret;
+	}
+
+	/*
+	 * The last sender flushes, unless other requests of the connection
+	 * are still queued or running and can add their responses before
+	 * the deadline. r_count covers requests waiting for a worker too,
+	 * req_running never gets above one when requests are serialized.
+	 */
+	if (atomic_dec_and_test(&conn->tx_pending) && conn->tx_corked) {
+		if (usecs && sent >= 0 &&
+		    atomic_read(&conn->r_count) > 1) {
+			if (!hrtimer_active(&conn->tx_timer))
+				hrtimer_start(&conn->tx_timer,
+					      ns_to_ktime(usecs * NSEC_PER_USEC),
+					      HRTIMER_MODE_REL);
+		} else {
+			cifsd_tcp_tx_uncork(conn);
+		}
+	}
+	mutex_unlock(&conn->send_lock);
+	return sent;
+}
+
+static struct cifsd_transport_ops cifsd_tcp_sock_ops = {
+	.readv		= cifsd_tcp_sock_readv,
+	.writev		= cifsd_tcp_sock_writev,
+	.disconnect	= cifsd_tcp_sock_disconnect,
+};
+
 void cifsd_tcp_conn_lock(struct cifsd_tcp_conn *conn)
 {
 	mutex_lock(&conn->srv_mutex);
 	atomic_inc(&conn->req_running);
+	atomic_inc(&requests_running);
 }
 
 void cifsd_tcp_conn_unlock(struct cifsd_tcp_conn *conn)
 {
+	atomic_dec(&requests_running);
 	atomic_dec(&conn->req_running);
 	mutex_unlock(&conn->srv_mutex);
 	if (waitqueue_active(&conn->req_running_q))
 		wake_up_all(&conn->req_running_q);
 }
 
+/**
+ * cifsd_tcp_conn_rx_cpu() - get the CPU which receives data for conn
+ * @conn:     TCP server instance of connection
+ *
+ * Return:	CPU where the socket RX softirq last ran, or -1 if unknown
+ */
+int cifsd_tcp_conn_rx_cpu(struct cifsd_tcp_conn *conn)
+{
+	int cpu;
+
+	if (!conn->sock)
+		return -1;
+
+	cpu = READ_ONCE(conn->sock->sk->sk_incoming_cpu);
+	if (cpu < 0 || cpu >= nr_cpu_ids || !cpu_online(cpu))
+		return -1;
+	return cpu;
+}
+
+/*
+ * Account a request which is processed without conn->srv_mutex, so that
+ * cifsd_tcp_conn_wait_idle() still waits for it.
+ */
+void cifsd_tcp_conn_start_request(struct cifsd_tcp_conn *conn)
+{
+	atomic_inc(&conn->req_running);
+	atomic_inc(&requests_running);
+}
+
+void cifsd_tcp_conn_end_request(struct cifsd_tcp_conn *conn)
+{
+	atomic_dec(&requests_running);
+	atomic_dec(&conn->req_running);
+	if (waitqueue_active(&conn->req_running_q))
+		wake_up_all(&conn->req_running_q);
+}
+
+/**
+ * cifsd_tcp_requests_running() - count the requests of all connections
+ *
+ * Return:	number of requests being processed or waiting for a worker
+ */
+unsigned int cifsd_tcp_requests_running(void)
+{
+	return max(atomic_read(&requests_running), 0);
+}
+
 void cifsd_tcp_conn_wait_idle(struct cifsd_tcp_conn *conn)
 {
 	wait_event(conn->req_running_q, atomic_read(&conn->req_running) < 2);
@@ -595,85 +1686,210 @@ int cifsd_tcp_for_each_conn(int (*match)(struct cifsd_tcp_conn *, void *),
 	return ret;
 }
 
-static void tcp_destroy_socket(void)
+static void tcp_shutdown_listeners(void)
 {
+	unsigned int i;
 	int ret;
 
-	if (!cifsd_socket)
-		return;
+	for (i = 0; i < nr_listeners; i++) {
+		ret = kernel_sock_shutdown(listeners[i].sock, SHUT_RDWR);
+		if (ret)
+			cifsd_err("Failed to shutdown socket: %d\n", ret);
+	}
+}
 
-	ret = kernel_sock_shutdown(cifsd_socket, SHUT_RDWR);
-	if (ret) {
-		cifsd_err("Failed to shutdown socket: %d\n", ret);
-	} else {
-		sock_release(cifsd_socket);
-		cifsd_socket = NULL;
+static void tcp_stop_kthread(void)
+{
+	unsigned int i;
+	int ret;
+
+	for (i = 0; i < nr_listeners; i++) {
+		if (!listeners[i].task)
+			continue;
+
+		ret = kthread_stop(listeners[i].task);
+		if (ret)
+			cifsd_err("failed to stop forker thread\n");
+		listeners[i].task = NULL;
 	}
 }
 
+static void tcp_destroy_socket(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < nr_listeners; i++)
+		sock_release(listeners[i].sock);
+	kfree(listeners);
+	listeners = NULL;
+	nr_listeners = 0;
+}
+
 /**
- * cifsd_tcp_init - create socket for kcifsd/0
+ * tcp_create_listener() - create a listening socket on the server port
+ * @l:		listener to set up
+ * @iface:	interface to bind the socket to, or NULL
+ * @backlog:	length of the accept queue
  *
- * Return:	Returns a task_struct or ERR_PTR
+ * Return:	0 on success, otherwise error
  */
-int cifsd_tcp_init(void)
+static int tcp_create_listener(struct cifsd_tcp_listener *l,
+			       struct interface *iface,
+			       int backlog)
 {
-	int ret;
 	struct sockaddr_in sin;
-	struct interface *iface;
-	struct list_head *tmp;
-
-	mutex_lock(&init_lock);
-	if (cifsd_socket) {
-		mutex_unlock(&init_lock);
-		return 0;
-	}
+	struct socket *sock;
+	int ret;
 
-	ret = sock_create(PF_INET, SOCK_STREAM, IPPROTO_TCP, &cifsd_socket);
+	ret = sock_create(PF_INET, SOCK_STREAM, IPPROTO_TCP, &sock);
 	if (ret) {
 		cifsd_err("Can't create socket: %d\n", ret);
-		goto out_error;
+		return ret;
 	}
 
 	sin.sin_addr.s_addr = htonl(INADDR_ANY);
 	sin.sin_family = PF_INET;
 	sin.sin_port = htons(server_conf.tcp_port);
 
-	cifsd_tcp_nodelay(cifsd_socket);
-	cifsd_tcp_reuseaddr(cifsd_socket);
+	cifsd_tcp_nodelay(sock);
+	cifsd_tcp_reuseaddr(sock);
+	ret = cifsd_tcp_reuseport(sock);
+	if (ret) {
+		cifsd_err("Failed to set SO_REUSEPORT: %d\n", ret);
+		goto out_error;
+	}
 
-	list_for_each(tmp, &server_conf.iface_list) {
-		iface = list_entry(tmp,  struct interface, entry);
-		ret = kernel_setsockopt(cifsd_socket, SOL_SOCKET,
-			SO_BINDTODEVICE, iface->name, strlen(iface->name));
-		if (ret != -ENODEV && ret < 0) {
-			cifsd_err("Failed to set SO_BINDTODEVICE: %d\n", ret);
+	if (iface) {
+		ret = kernel_setsockopt(sock, SOL_SOCKET, SO_BINDTODEVICE,
+					iface->name, strlen(iface->name));
+		if (ret < 0) {
+			if (ret != -ENODEV)
+				cifsd_err("Failed to set SO_BINDTODEVICE: %d\n",
+					  ret);
 			goto out_error;
 		}
-
+		strlcpy(l->ifname, iface->name, sizeof(l->ifname));
 	}
 
-	ret = kernel_bind(cifsd_socket, (struct sockaddr *)&sin, sizeof(sin));
+	ret = kernel_bind(sock, (struct sockaddr *)&sin, sizeof(sin));
 	if (ret) {
 		cifsd_err("Failed to bind socket: %d\n", ret);
 		goto out_error;
 	}
 
-	cifsd_socket->sk->sk_rcvtimeo = CIFSD_TCP_RECV_TIMEOUT;
-	cifsd_socket->sk->sk_sndtimeo = CIFSD_TCP_SEND_TIMEOUT;
+	sock->sk->sk_rcvtimeo = CIFSD_TCP_ACCEPT_TIMEOUT;
+	sock->sk->sk_sndtimeo = CIFSD_TCP_SEND_TIMEOUT;
 
-	ret = cifsd_socket->ops->listen(cifsd_socket, CIFSD_SOCKET_BACKLOG);
+	ret = sock->ops->listen(sock, backlog);
 	if (ret) {
 		cifsd_err("Port listen() error: %d\n", ret);
 		goto out_error;
 	}
 
+	l->sock = sock;
+	atomic64_set(&l->accepted, 0);
+	return 0;
+
+out_error:
+	sock_release(sock);
+	return ret;
+}
+
+/**
+ * cifsd_tcp_init - create listening sockets for kcifsd/N
+ *
+ * Return:	Returns a task_struct or ERR_PTR
+ */
+int cifsd_tcp_init(void)
+{
+	struct interface *iface;
+	unsigned int per_iface, nr_ifaces = 0, i;
+	int backlog, ret;
+
+	mutex_lock(&init_lock);
+	if (listeners) {
+		mutex_unlock(&init_lock);
+		return 0;
+	}
+
+	backlog = server_conf.tcp_backlog;
+	if (backlog <= 0)
+		backlog = CIFSD_SOCKET_BACKLOG;
+
+	per_iface = tcp_listeners;
+	if (!per_iface)
+		per_iface = num_online_cpus();
+
+	list_for_each_entry(iface, &server_conf.iface_list, entry)
+		nr_ifaces++;
+
+	listeners = kcalloc(max(nr_ifaces, 1U) * per_iface,
+			    sizeof(struct cifsd_tcp_listener),
+			    GFP_KERNEL);
+	if (!listeners) {
+		mutex_unlock(&init_lock);
+		return -ENOMEM;
+	}
+
+	if (!nr_ifaces) {
+		for (i = 0; i < per_iface; i++) {
+			ret = tcp_create_listener(&listeners[nr_listeners],
+						  NULL, backlog);
+			if (ret)
+				goto out_error;
+			nr_listeners++;
+		}
+	}
+
+	list_for_each_entry(iface, &server_conf.iface_list, entry) {
+		for (i = 0; i < per_iface; i++) {
+			ret = tcp_create_listener(&listeners[nr_listeners],
+						  iface, backlog);
+			/* skip interfaces which went away */
+			if (ret == -ENODEV)
+				break;
+			if (ret)
+				goto out_error;
+			nr_listeners++;
+		}
+	}
+
+	if (!nr_listeners) {
+		cifsd_err("No interface to listen on\n");
+		ret = -ENODEV;
+		goto out_error;
+	}
+
+	if (rx_pool_enable) {
+		ret = cifsd_tcp_rx_pool_start();
+		if (ret) {
+			cifsd_err("Can't start receive pool: %d\n", ret);
+			goto out_error;
+		}
+	}
+
 	ret = cifsd_tcp_run_kthread();
 	if (ret) {
 		cifsd_err("Can't start cifsd main kthread: %d\n", ret);
+		tcp_shutdown_listeners();
+		tcp_stop_kthread();
+		cifsd_tcp_rx_pool_stop();
 		goto out_error;
 	}
 
+	/* the TCP listeners serve clients without RDMA capable NICs too */
+	ret = cifsd_rdma_init(backlog);
+	if (ret)
+		cifsd_err("Can't start SMB Direct listener: %d\n", ret);
+
+	/* connections still work without it, they just keep their contexts */
+	if (!conn_shrinker_registered) {
+		if (register_shrinker(&conn_shrinker))
+			cifsd_err("Can't register connection shrinker\n");
+		else
+			conn_shrinker_registered = true;
+	}
+
 	mutex_unlock(&init_lock);
 	return 0;
 
@@ -691,9 +1907,14 @@ again:
 	read_lock(&tcp_conn_list_lock);
 	list_for_each_entry(conn, &tcp_conn_list, tcp_conns) {
 		conn->tcp_status = CIFSD_SESS_EXITING;
+		if (conn->rx_thread) {
+			cifsd_tcp_rx_queue_conn(conn);
+			continue;
+		}
 		cifsd_err("Stop session handler %s/%d\n",
 				conn->handler->comm,
 				task_pid_nr(conn->handler));
+		send_sig(SIGKILL, conn->handler, 0);
 	}
 	read_unlock(&tcp_conn_list_lock);
 
@@ -703,26 +1924,19 @@ again:
 	}
 }
 
-static void tcp_stop_kthread(void)
-{
-	int ret;
-
-	if (!cifsd_kthread)
-		return;
-
-	ret = kthread_stop(cifsd_kthread);
-	if (ret)
-		cifsd_err("failed to stop forker thread\n");
-	else
-		cifsd_kthread = NULL;
-}
-
 void cifsd_tcp_destroy(void)
 {
 	mutex_lock(&init_lock);
-	tcp_destroy_socket();
+	tcp_shutdown_listeners();
 	tcp_stop_kthread();
+	tcp_destroy_socket();
+	cifsd_rdma_destroy();
 	tcp_stop_sessions();
+	cifsd_tcp_rx_pool_stop();
+	if (conn_shrinker_registered) {
+		unregister_shrinker(&conn_shrinker);
+		conn_shrinker_registered = false;
+	}
 	mutex_unlock(&init_lock);
 }
 
@@ -7,6 +7,7 @@
 #define __CIFSD_TRANSPORT_TCP_H__
 
 #include <linux/list.h>
+#include <linux/hashtable.h>
 #include <linux/ip.h>
 #include <net/sock.h>
 #include <net/tcp.h>
@@ -18,6 +19,7 @@
 #include "glob.h" /* FIXME */
 
 #define CIFSD_SOCKET_BACKLOG		16
+#define PREAUTH_SESS_HASH_BITS		4
 
 /*
  * WARNING
@@ -39,36 +41,92 @@ struct cifsd_secmech {
 	struct crypto_shash *hmacmd5; /* hmac-md5 hash function */
 	struct crypto_shash *md5; /* md5 hash function */
 	struct crypto_shash *hmacsha256; /* hmac-sha256 hash function */
-	struct crypto_shash *cmacaes; /* block-cipher based MAC function */
-	struct crypto_shash *sha512; /* sha512 hash function */
 	struct sdesc *sdeschmacmd5;  /* ctxt to generate ntlmv2 hash, CR1 */
 	struct sdesc *sdescmd5; /* ctxt to generate cifs/smb signature */
-	struct sdesc *sdeschmacsha256;  /* ctxt to generate smb2 signature */
-	struct sdesc *sdesccmacaes;  /* ctxt to generate smb3 signature */
-	struct sdesc *sdescsha512;  /* ctxt to generate preauth integrity */
-	struct crypto_aead *ccmaesencrypt; /* smb3 encryption aead */
-	struct crypto_aead *ccmaesdecrypt; /* smb3 decryption aead */
+	struct sdesc *sdeschmacsha256;  /* ctxt to derive smb3 keys */
+};
+
+struct cifsd_tcp_conn;
+struct cifsd_work;
+struct cifsd_session;
+
+struct smb2_buffer_desc_v1;
+
+/*
+ * Transport specific I/O of a connection. Blocking reads, response sends
+ * and teardown go through these operations. The receive thread pool,
+ * cork handling and receive CPU steering still work on conn->sock, so
+ * they are only used by TCP connections.
+ *
+ * readv() returns the byte stream of RFC1002 framed PDUs, whatever the
+ * framing on the wire, and writev() gets responses framed the same way.
+ */
+struct cifsd_transport_ops {
+	/* set up the transport, first thing on the handler thread */
+	int	(*prepare)(struct cifsd_tcp_conn *conn);
+	/* blocking read of @to_read bytes into @iov */
+	int	(*readv)(struct cifsd_tcp_conn *conn, struct kvec *iov,
+			 unsigned int nr_segs, unsigned int to_read);
+	/* send the response of @work, described by @iov */
+	int	(*writev)(struct cifsd_tcp_conn *conn, struct cifsd_work *work,
+			  struct kvec *iov, int nr_segs, size_t len);
+	/* tear down and release the transport */
+	void	(*disconnect)(struct cifsd_tcp_conn *conn);
+	/* RDMA channel of SMB2 READ and WRITE, pull or push @len bytes */
+	int	(*rdma_read)(struct cifsd_tcp_conn *conn, void *buf,
+			     unsigned int len,
+			     struct smb2_buffer_desc_v1 *desc,
+			     unsigned int nr_desc);
+	int	(*rdma_write)(struct cifsd_tcp_conn *conn, void *buf,
+			      unsigned int len,
+			      struct smb2_buffer_desc_v1 *desc,
+			      unsigned int nr_desc);
 };
 
 struct cifsd_tcp_conn {
 	struct socket			*sock;
+	struct cifsd_transport_ops	*t_ops;
+	/* State of a transport other than the socket */
+	void				*transport;
 	struct smb_version_values	*vals;
 	struct smb_version_ops		*ops;
 	struct smb_version_cmds		*cmds;
 	unsigned int			max_cmds;
 	struct mutex			srv_mutex;
+	/* Serializes socket sends, including the cork/uncork pair */
+	struct mutex			send_lock;
+	/* Senders in cifsd_tcp_write(), including the send_lock waiters */
+	atomic_t			tx_pending;
+	/* Socket is corked, under send_lock */
+	bool				tx_corked;
+	/* Flush deadline of coalesced responses */
+	struct hrtimer			tx_timer;
+	struct work_struct		tx_flush_work;
+	/* Protects the SMB1 signing context in secmech */
+	struct mutex			secmech_lock;
+	/* Protects credits_granted */
+	spinlock_t			credits_lock;
 	int				tcp_status;
 	unsigned int			cli_cap;
 	unsigned int			srv_cap;
 	struct kvec			*iov;
 	unsigned int			nr_iov;
 	void 				*request_buf;
+	/* PDU bytes in request_buf, with the RFC1002 header */
+	unsigned int			request_hdr_len;
+	/* Bulk write data of request_buf, see cifsd_tcp_read_pages() */
+	struct bio_vec			*request_bvec;
+	unsigned int			request_nr_bvec;
 	struct nls_table		*local_nls;
 	struct list_head		tcp_conns;
 	/* smb session 1 per user */
 	struct list_head		sessions;
+	/* Session of the last request, see cifsd_session_lookup() */
+	struct cifsd_session		*last_sess;
 	struct task_struct		*handler;
 	unsigned long			last_active;
+	/* Accept time, cleared once the first PDU is received */
+	ktime_t				accept_time;
 	/* How many request are running currently */
 	atomic_t			req_running;
 	/* References which are made for this Server object*/
@@ -80,6 +138,8 @@ struct cifsd_tcp_conn {
 	struct list_head		async_requests;
 	int				max_credits;
 	int				credits_granted;
+	/* Outstanding credits allowed, adapted by smb2_set_rsp_credits() */
+	int				credit_window;
 	int				connection_type;
 	struct cifsd_stats		stats;
 	char				ClientGUID[SMB2_CLIENT_GUID_SIZE];
@@ -108,18 +168,41 @@ struct cifsd_tcp_conn {
 	__u16				srv_sec_mode;
 	/* dialect index that server chose */
 	__u16				dialect;
+	/* Negotiated SMB 3.1.1 cipher, 0 for AES-128-CCM */
+	__le16				cipher_type;
+	/* SMB3 signing algorithm, AES-CMAC unless negotiated by SMB 3.1.1 */
+	__le16				signing_algorithm;
+	bool				signing_negotiated;
+	/* SMB 3.1.1 compression algorithms in common, bit n for algorithm n */
+	unsigned int			compress_algos;
+	bool				compress_chained;
+	bool				compress_negotiated;
 
 	char				*mechToken;
 
 	struct cifsd_tcp_conn_ops	*conn_ops;
 
 	/* Preauth Session Table */
-	struct list_head		preauth_sess_table;
+	/* Hash values of SMB 3.1.1 session binds in progress */
+	spinlock_t			preauth_sess_lock;
+	DECLARE_HASHTABLE(preauth_sess_table, PREAUTH_SESS_HASH_BITS);
 
 	struct sockaddr_storage		peer_addr;
 
 	/* Identifier for async message */
 	struct cifsd_ida		*async_ida;
+
+	/* Shared receive pool state, unused by per-connection threads */
+	struct cifsd_tcp_rx_thread	*rx_thread;
+	struct list_head		rx_entry;
+	unsigned long			rx_flags;
+	char				rx_hdr[4];
+	unsigned int			rx_hdr_len;
+	unsigned int			rx_pdu_size;
+	unsigned int			rx_pdu_len;
+	void				(*rx_orig_data_ready)(struct sock *sk);
+	void				(*rx_orig_state_change)(struct sock *sk);
+	struct work_struct		rx_release_work;
 };
 
 struct cifsd_tcp_conn_ops {
@@ -129,9 +212,17 @@ struct cifsd_tcp_conn_ops {
 
 #define CIFSD_TCP_PEER_SOCKADDR(c)	((struct sockaddr *)&((c)->peer_addr))
 
+struct cifsd_tcp_conn *cifsd_tcp_conn_new(struct cifsd_transport_ops *t_ops);
+int cifsd_tcp_conn_run(struct cifsd_tcp_conn *conn);
+bool cifsd_tcp_conn_alive(struct cifsd_tcp_conn *conn);
+long cifsd_tcp_recv_timeout(struct cifsd_tcp_conn *conn);
 void cifsd_tcp_conn_lock(struct cifsd_tcp_conn *conn);
 void cifsd_tcp_conn_unlock(struct cifsd_tcp_conn *conn);
 void cifsd_tcp_conn_wait_idle(struct cifsd_tcp_conn *conn);
+int cifsd_tcp_conn_rx_cpu(struct cifsd_tcp_conn *conn);
+void cifsd_tcp_conn_start_request(struct cifsd_tcp_conn *conn);
+void cifsd_tcp_conn_end_request(struct cifsd_tcp_conn *conn);
+unsigned int cifsd_tcp_requests_running(void);
 
 int cifsd_tcp_for_each_conn(int (*match)(struct cifsd_tcp_conn *, void *),
 	void *arg);
@@ -147,6 +238,14 @@ void cifsd_tcp_init_server_callbacks(struct cifsd_tcp_conn_ops *ops);
 
 void cifsd_tcp_destroy(void);
 int cifsd_tcp_init(void);
+ssize_t cifsd_tcp_listener_stats(char *buf, size_t size);
+ssize_t cifsd_tcp_credit_stats(char *buf, size_t size);
+ssize_t cifsd_tcp_memory_stats(char *buf, size_t size);
+
+#if IS_ENABLED(CONFIG_CIFSD_KUNIT_TEST)
+struct cifsd_tcp_conn *cifsd_tcp_test_conn_alloc(struct socket *sock);
+void cifsd_tcp_test_conn_free(struct cifsd_tcp_conn *conn);
+#endif
 
 /*
  * WARNING
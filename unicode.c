@@ -37,6 +37,111 @@ int smb1_utf16_name_length(const __le16 *from, int maxbytes)
 }
 #endif
 
+/*
+ * Names are mostly ASCII, which every NLS codepage maps to itself, so
+ * runs of ASCII are converted four or eight characters at a time and
+ * only the other characters go through the codepage.
+ */
+#define UTF16_NON_ASCII		0xff80ff80ff80ff80ULL
+#define UTF16_LANE_LOW		0x007f007f007f007fULL
+#define UTF16_LANE_HIGH		0x0080008000800080ULL
+#define ASCII_NON_ASCII		0x8080808080808080ULL
+#define ASCII_LANE_LOW		0x7f7f7f7f7f7f7f7fULL
+
+/*
+ * utf16_to_ascii() - copy the leading ASCII characters of a utf16le string
+ * @to:		destination buffer, NULL to only count them
+ * @from:	source string
+ * @maxwords:	don't walk past this many characters of @from
+ *
+ * Return:	number of characters copied, the run stops before a NUL
+ */
+static int utf16_to_ascii(char *to, const __le16 *from, int maxwords)
+{
+	int i = 0;
+	u64 v, t;
+	__u16 c;
+
+	for (; i + 4 <= maxwords; i += 4) {
+		v = get_unaligned_le64(&from[i]);
+		/* non-ASCII, or a NUL: a lane which doesn't carry into 0x80 */
+		if ((v & UTF16_NON_ASCII) ||
+		    ((v + UTF16_LANE_LOW) & UTF16_LANE_HIGH) != UTF16_LANE_HIGH)
+			break;
+
+		if (to) {
+			t = (v & 0x000000ff000000ffULL) |
+			    ((v >> 8) & 0x0000ff000000ff00ULL);
+			put_unaligned_le32((u32)(t & 0xffff) |
+					   (u32)((t >> 16) & 0xffff0000),
+					   &to[i]);
+		}
+	}
+
+	for (; i < maxwords; i++) {
+		c = get_unaligned_le16(&from[i]);
+		if (!c || c >= 0x80)
+			break;
+		if (to)
+			to[i] = c;
+	}
+	return i;
+}
+
+/* Characters smbConvertToUTF16() remaps into the private use area */
+static inline bool is_mapped_char(char c)
+{
+	return c == ':' || c == '*' || c == '?' || c == '<' || c == '>' ||
+		c == '|';
+}
+
+/*
+ * ascii_to_utf16() - widen the leading ASCII characters of a string
+ * @to:		destination buffer
+ * @from:	source string
+ * @maxlen:	don't walk past this many bytes of @from
+ * @mapchars:	stop before the characters remapped by smbConvertToUTF16()
+ *
+ * Return:	number of characters converted, the run stops before a NUL
+ */
+static int ascii_to_utf16(__le16 *to, const char *from, int maxlen,
+			  bool mapchars)
+{
+	int i = 0, j;
+	u64 v, w;
+
+	for (; i + 8 <= maxlen; i += 8) {
+		v = get_unaligned_le64(&from[i]);
+		if ((v & ASCII_NON_ASCII) ||
+		    ((v + ASCII_LANE_LOW) & ASCII_NON_ASCII) != ASCII_NON_ASCII)
+			break;
+		if (mapchars) {
+			for (j = 0; j < 8; j++) {
+				if (is_mapped_char(from[i + j]))
+					goto tail;
+			}
+		}
+
+		w = v & 0xffffffff;
+		w = (w | w << 16) & 0x0000ffff0000ffffULL;
+		w = (w | w << 8) & 0x00ff00ff00ff00ffULL;
+		put_unaligned_le64(w, &to[i]);
+		w = v >> 32;
+		w = (w | w << 16) & 0x0000ffff0000ffffULL;
+		w = (w | w << 8) & 0x00ff00ff00ff00ffULL;
+		put_unaligned_le64(w, &to[i + 4]);
+	}
+
+tail:
+	for (; i < maxlen; i++) {
+		if (!from[i] || from[i] & 0x80 ||
+		    (mapchars && is_mapped_char(from[i])))
+			break;
+		put_unaligned_le16(from[i], &to[i]);
+	}
+	return i;
+}
+
 /*
  * smb_utf16_bytes() - how long will a string be after conversion?
  * @from:	pointer to input string
@@ -60,6 +165,12 @@ static int smb_utf16_bytes(const __le16 *from,
 	__u16 ftmp;
 
 	for (i = 0; i < maxwords; i++) {
+		charlen = utf16_to_ascii(NULL, &from[i], maxwords - i);
+		outlen += charlen;
+		i += charlen;
+		if (i == maxwords)
+			break;
+
 		ftmp = get_unaligned_le16(&from[i]);
 		if (ftmp == 0)
 			break;
@@ -202,6 +313,15 @@ static int smb_from_utf16(char *to,
 	safelen = tolen - (NLS_MAX_CHARSET_SIZE + nullsize);
 
 	for (i = 0; i < fromwords; i++) {
+		/* an ASCII character takes a byte */
+		charlen = utf16_to_ascii(&to[outlen], &from[i],
+					 min(fromwords - i,
+					     tolen - nullsize - outlen));
+		outlen += charlen;
+		i += charlen;
+		if (i == fromwords)
+			break;
+
 		ftmp = get_unaligned_le16(&from[i]);
 		if (ftmp == 0)
 			break;
@@ -242,9 +362,18 @@ smb_strtoUTF16(__le16 *to, const char *from, int len,
 	      const struct nls_table *codepage)
 {
 	int charlen;
-	int i;
+	int i, ascii;
 	wchar_t wchar_to; /* needed to quiet sparse */
 
+	ascii = ascii_to_utf16(to, from, len, false);
+	from += ascii;
+	len -= ascii;
+	to += ascii;
+	if (!len || !*from) {
+		i = 0;
+		goto success;
+	}
+
 	/* special case for utf8 to handle no plane0 chars */
 	if (!strcmp(codepage->charset, "utf8")) {
 		/*
@@ -278,7 +407,7 @@ smb_strtoUTF16(__le16 *to, const char *from, int len,
 
 success:
 	put_unaligned_le16(0, &to[i]);
-	return i;
+	return ascii + i;
 }
 
 /*
@@ -360,6 +489,14 @@ smbConvertToUTF16(__le16 *target, const char *source, int srclen,
 		return smb_strtoUTF16(target, source, srclen, cp);
 
 	for (i = 0, j = 0; i < srclen; j++) {
+		/* ASCII is the same in every codepage */
+		charlen = ascii_to_utf16(&target[j], &source[i], srclen - i,
+					 true);
+		i += charlen;
+		j += charlen;
+		if (i >= srclen)
+			break;
+
 		src_char = source[i];
 		charlen = 1;
 		switch (src_char) {
@@ -15,6 +15,12 @@
 #include <linux/genhd.h>
 #include <linux/blkdev.h>
 #include <linux/fsnotify.h>
+#include <linux/namei.h>
+#include <linux/fadvise.h>
+#include <linux/magic.h>
+#include <linux/splice.h>
+#include <linux/pipe_fs_i.h>
+#include <linux/bvec.h>
 
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 5, 0)
 #include <linux/sched/xacct.h>
@@ -35,6 +41,8 @@
 #include "mgmt/tree_connect.h"
 #include "mgmt/user_session.h"
 #include "mgmt/user_config.h"
+#include "stats.h"
+#include "trace.h"
 
 static void cifsd_vfs_inode_uid_gid(struct cifsd_work *work,
 				    struct inode *inode)
@@ -158,15 +166,15 @@ out:
 	return value_len;
 }
 
-static int cifsd_vfs_stream_read(struct cifsd_file *fp, char *buf, loff_t *pos,
-	size_t count)
+/* Caller holds the lock of @sb */
+static int cifsd_vfs_stream_load(struct cifsd_file *fp,
+				 struct cifsd_stream_buf *sb)
 {
 	ssize_t v_len;
 	char *stream_buf = NULL;
-	int err;
 
-	cifsd_debug("read stream data pos : %llu, count : %zd\n",
-			*pos, count);
+	if (sb->loaded)
+		return 0;
 
 	v_len = cifsd_vfs_getcasexattr(fp->filp->f_path.dentry,
 				       fp->stream.name,
@@ -174,58 +182,129 @@ static int cifsd_vfs_stream_read(struct cifsd_file *fp, char *buf, loff_t *pos,
 				       &stream_buf);
 	if (v_len == -ENOENT) {
 		cifsd_err("not found stream in xattr : %zd\n", v_len);
-		err = -ENOENT;
-		return err;
+		return -ENOENT;
 	}
+	if (v_len < 0)
+		return v_len;
 
-	memcpy(buf, &stream_buf[*pos], count);
-	return v_len > count ? count : v_len;
+	sb->data = stream_buf;
+	sb->len = sb->alloc = v_len;
+	sb->loaded = true;
+	return 0;
+}
+
+static int cifsd_vfs_stream_read(struct cifsd_file *fp, char *buf, loff_t *pos,
+	size_t count)
+{
+	struct cifsd_stream_buf *sb;
+	int err;
+
+	cifsd_debug("read stream data pos : %llu, count : %zd\n",
+			*pos, count);
+
+	sb = cifsd_stream_buf_lock(fp);
+	if (!sb)
+		return -ENOMEM;
+
+	err = cifsd_vfs_stream_load(fp, sb);
+	if (err)
+		goto out;
+
+	if (*pos >= sb->len)
+		goto out;
+
+	count = min_t(size_t, count, sb->len - *pos);
+	memcpy(buf, &sb->data[*pos], count);
+	err = count;
+out:
+	mutex_unlock(&sb->lock);
+	return err;
 }
 
 /**
  * check_lock_range() - vfs helper for smb byte range file locking
- * @filp:	the file to apply the lock to
+ * @fp:		cifsd file pointer doing the I/O
  * @start:	lock start byte offset
  * @end:	lock end byte offset
  * @type:	byte range type read/write
  *
  * Return:	0 on success, otherwise error
  */
-static int check_lock_range(struct file *filp,
+static int check_lock_range(struct cifsd_file *fp,
 			    loff_t start,
 			    loff_t end,
 			    unsigned char type)
 {
-	struct file_lock *flock;
-	struct file_lock_context *ctx = file_inode(filp)->i_flctx;
-	int error = 0;
-
-	if (!ctx || list_empty_careful(&ctx->flc_posix))
+	if (!cifsd_brl_conflict(fp, start, end, type))
 		return 0;
 
-	list_for_each_entry(flock, &ctx->flc_posix, fl_list) {
-		if (filp == flock->fl_owner)
+	if (type == WRITE)
+		cifsd_err("not allow write by lock from other opens\n");
+	else
+		cifsd_err("not allow read by exclusive lock from other opens\n");
+	return 1;
+}
+
+/* Files with fewer blocks than their size have holes */
+static bool cifsd_vfs_has_holes(struct inode *inode)
+{
+	return S_ISREG(inode->i_mode) &&
+		((loff_t)inode->i_blocks << 9) < i_size_read(inode);
+}
+
+/*
+ * Holes of sparse files are zero filled in the read buffer rather than
+ * read through the page cache, which would fill it with zero pages.
+ */
+static ssize_t cifsd_vfs_read_sparse(struct file *filp, char *buf,
+				     size_t count, loff_t *pos)
+{
+	loff_t isize = i_size_read(file_inode(filp));
+	loff_t data, hole;
+	size_t done = 0, n;
+	ssize_t nr;
+
+	if (*pos >= isize)
+		return 0;
+	count = min_t(loff_t, count, isize - *pos);
+
+	while (done < count) {
+		data = vfs_llseek(filp, *pos, SEEK_DATA);
+		if (data == -ENXIO)
+			data = isize;
+		else if (data < 0)
+			data = *pos;
+
+		if (data > *pos) {
+			n = min_t(loff_t, data - *pos, count - done);
+			memset(buf + done, 0, n);
+			done += n;
+			*pos += n;
 			continue;
-		/* check conflict locks */
-		if (flock->fl_end >= start && end >= flock->fl_start) {
-			if (flock->fl_type == F_RDLCK) {
-				if (type == WRITE) {
-					cifsd_err("not allow write by shared lock\n");
-					error = 1;
-					goto out;
-				}
-			} else if (flock->fl_type == F_WRLCK) {
-				/* check owner in lock */
-				if (flock->fl_file != filp) {
-					error = 1;
-					cifsd_err("not allow rw access by exclusive lock from other opens\n");
-					goto out;
-				}
-			}
 		}
+
+		hole = vfs_llseek(filp, *pos, SEEK_HOLE);
+		if (hole <= *pos)
+			hole = isize;
+		n = min_t(loff_t, hole - *pos, count - done);
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 14, 0)
+		{
+			mm_segment_t old_fs = get_fs();
+
+			set_fs(KERNEL_DS);
+			nr = vfs_read(filp, buf + done, n, pos);
+			set_fs(old_fs);
+		}
+#else
+		nr = kernel_read(filp, buf + done, n, pos);
+#endif
+		if (nr < 0)
+			return done ? done : nr;
+		done += nr;
+		if (nr < n)
+			break;
 	}
-out:
-	return error;
+	return done;
 }
 
 /**
@@ -247,6 +326,8 @@ int cifsd_vfs_read(struct cifsd_work *work,
 	char *rbuf, *name;
 	struct inode *inode;
 	char namebuf[NAME_MAX];
+	loff_t offset = *pos;
+	u64 start;
 	int ret;
 #if LINUX_VERSION_CODE < KERNEL_VERSION(4, 14, 0)
 	mm_segment_t old_fs;
@@ -273,7 +354,7 @@ int cifsd_vfs_read(struct cifsd_work *work,
 	if (cifsd_stream_fd(fp))
 		return cifsd_vfs_stream_read(fp, rbuf, pos, count);
 
-	ret = check_lock_range(filp, *pos, *pos + count - 1,
+	ret = check_lock_range(fp, *pos, *pos + count - 1,
 			READ);
 	if (ret) {
 		cifsd_err("%s: unable to read due to lock\n",
@@ -281,6 +362,12 @@ int cifsd_vfs_read(struct cifsd_work *work,
 		return -EAGAIN;
 	}
 
+	start = cifsd_stats_clock();
+	if (cifsd_vfs_has_holes(inode)) {
+		nbytes = cifsd_vfs_read_sparse(filp, rbuf, count, pos);
+		goto read_done;
+	}
+
 #if LINUX_VERSION_CODE < KERNEL_VERSION(4, 14, 0)
 	old_fs = get_fs();
 	set_fs(KERNEL_DS);
@@ -290,6 +377,9 @@ int cifsd_vfs_read(struct cifsd_work *work,
 #else
 	nbytes = kernel_read(filp, rbuf, count, pos);
 #endif
+read_done:
+	cifsd_stats_io(work, false, nbytes, start);
+	trace_cifsd_vfs_read(work, fp, offset, count, nbytes);
 	if (nbytes < 0) {
 		name = d_path(&filp->f_path, namebuf, sizeof(namebuf));
 		if (IS_ERR(name))
@@ -303,58 +393,330 @@ int cifsd_vfs_read(struct cifsd_work *work,
 	return nbytes;
 }
 
+struct cifsd_splice_data {
+	struct cifsd_work	*work;
+	unsigned int		max_bvec;
+};
+
+static int cifsd_vfs_splice_actor(struct pipe_inode_info *pipe,
+				  struct pipe_buffer *buf,
+				  struct splice_desc *sd)
+{
+	struct cifsd_splice_data *data = sd->u.data;
+	struct cifsd_work *work = data->work;
+	struct bio_vec *bv;
+
+	if (work->aux_payload_nr_bvec) {
+		bv = &work->aux_payload_bvec[work->aux_payload_nr_bvec - 1];
+		if (bv->bv_page == buf->page &&
+		    bv->bv_offset + bv->bv_len == buf->offset) {
+			bv->bv_len += sd->len;
+			return sd->len;
+		}
+	}
+
+	if (work->aux_payload_nr_bvec == data->max_bvec)
+		return -ENOSPC;
+
+	bv = &work->aux_payload_bvec[work->aux_payload_nr_bvec++];
+	get_page(buf->page);
+	bv->bv_page = buf->page;
+	bv->bv_offset = buf->offset;
+	bv->bv_len = sd->len;
+	return sd->len;
+}
+
+static int cifsd_vfs_direct_splice_actor(struct pipe_inode_info *pipe,
+					 struct splice_desc *sd)
+{
+	return __splice_from_pipe(pipe, sd, cifsd_vfs_splice_actor);
+}
+
+/*
+ * Send read data straight from the page cache. Only used when the response
+ * is neither signed nor encrypted, since both need a linear copy.
+ */
+static bool zerocopy_read_enable;
+module_param(zerocopy_read_enable, bool, 0644);
+MODULE_PARM_DESC(zerocopy_read_enable,
+	"Send read data from the page cache without a copy. Default: n/N/0");
+
+/**
+ * cifsd_vfs_zerocopy_read() - check if reads of a file can be spliced
+ * @fp:		open file
+ *
+ * The SMB1 and SMB2 read handlers check their responses can carry the
+ * data pages, see cifsd_vfs_splice_read().
+ *
+ * Return:	true if zero-copy reads are enabled and @fp supports them
+ */
+bool cifsd_vfs_zerocopy_read(struct cifsd_file *fp)
+{
+	if (!READ_ONCE(zerocopy_read_enable))
+		return false;
+	return !cifsd_stream_fd(fp) && fp->filp->f_op->splice_read;
+}
+
+/**
+ * cifsd_vfs_splice_read() - vfs helper for smb file read without a copy
+ * @work:	smb work
+ * @fp:		open file
+ * @count:	read byte count
+ * @pos:	file pos
+ *
+ * Takes references to the page cache pages backing the range and records
+ * them in work->aux_payload_bvec, so the transport can send them directly.
+ *
+ * Return:	number of read bytes on success, otherwise error
+ */
+int cifsd_vfs_splice_read(struct cifsd_work *work,
+			  struct cifsd_file *fp,
+			  size_t count,
+			  loff_t *pos)
+{
+	struct file *filp = fp->filp;
+	struct inode *inode = file_inode(filp);
+	struct cifsd_splice_data data;
+	struct splice_desc sd = {
+		.len		= 0,
+		.total_len	= count,
+		.pos		= *pos,
+		.u.data		= &data,
+	};
+	ssize_t nbytes;
+	u64 start;
+
+	if (S_ISDIR(inode->i_mode))
+		return -EISDIR;
+
+	if (unlikely(count == 0))
+		return 0;
+
+	if (work->conn->connection_type) {
+		if (!(fp->daccess & (FILE_READ_DATA_LE |
+		    FILE_GENERIC_READ_LE | FILE_MAXIMAL_ACCESS_LE |
+		    FILE_GENERIC_ALL_LE | FILE_EXECUTE))) {
+			cifsd_err("no right to read(%s)\n", FP_FILENAME(fp));
+			return -EACCES;
+		}
+	}
+
+	if (check_lock_range(fp, *pos, *pos + count - 1, READ)) {
+		cifsd_err("%s: unable to read due to lock\n", __func__);
+		return -EAGAIN;
+	}
+
+	data.work = work;
+	data.max_bvec = DIV_ROUND_UP(count, PAGE_SIZE) + 1;
+	work->aux_payload_bvec = cifsd_alloc(data.max_bvec *
+					     sizeof(struct bio_vec));
+	if (!work->aux_payload_bvec)
+		return -ENOMEM;
+
+	start = cifsd_stats_clock();
+	nbytes = splice_direct_to_actor(filp, &sd,
+					cifsd_vfs_direct_splice_actor);
+	cifsd_stats_io(work, false, nbytes, start);
+	trace_cifsd_vfs_read(work, fp, *pos, count, nbytes);
+	if (nbytes < 0) {
+		cifsd_err("smb splice read failed for (%s), err = %zd\n",
+				FP_FILENAME(fp), nbytes);
+		return nbytes;
+	}
+
+	*pos += nbytes;
+	filp->f_pos = *pos;
+	return nbytes;
+}
+
 static int cifsd_vfs_stream_write(struct cifsd_file *fp, char *buf, loff_t *pos,
-	size_t count)
+	size_t count, bool sync)
 {
-	char *stream_buf = NULL, *wbuf;
-	size_t size, v_len;
+	struct cifsd_stream_buf *sb;
+	char *wbuf;
+	size_t size, alloc;
 	int err = 0;
 
 	cifsd_debug("write stream data pos : %llu, count : %zd\n",
 			*pos, count);
 
+	if (*pos >= XATTR_SIZE_MAX)
+		return -ENOSPC;
+
 	size = *pos + count;
 	if (size > XATTR_SIZE_MAX) {
 		size = XATTR_SIZE_MAX;
-		count = (*pos + count) - XATTR_SIZE_MAX;
+		count = XATTR_SIZE_MAX - *pos;
 	}
 
-	v_len = cifsd_vfs_getcasexattr(fp->filp->f_path.dentry,
-				       fp->stream.name,
-				       fp->stream.size,
-				       &stream_buf);
-	if (v_len == -ENOENT) {
-		cifsd_err("not found stream in xattr : %zd\n", v_len);
-		err = -ENOENT;
+	sb = cifsd_stream_buf_lock(fp);
+	if (!sb)
+		return -ENOMEM;
+
+	err = cifsd_vfs_stream_load(fp, sb);
+	if (err)
 		goto out;
-	}
 
-	if (v_len < size) {
-		wbuf = cifsd_alloc(size);
+	if (size > sb->alloc) {
+		/* grow geometrically, small writes appending stay linear */
+		alloc = clamp_t(size_t, sb->alloc * 2, size, XATTR_SIZE_MAX);
+		wbuf = cifsd_alloc(alloc);
 		if (!wbuf) {
 			err = -ENOMEM;
 			goto out;
 		}
 
-		if (v_len > 0)
-			memcpy(wbuf, stream_buf, v_len);
-		stream_buf = wbuf;
+		if (sb->len)
+			memcpy(wbuf, sb->data, sb->len);
+		cifsd_free(sb->data);
+		sb->data = wbuf;
+		sb->alloc = alloc;
 	}
 
-	memcpy(&stream_buf[*pos], buf, count);
+	if (*pos > sb->len)
+		memset(&sb->data[sb->len], 0, *pos - sb->len);
+	memcpy(&sb->data[*pos], buf, count);
+	sb->len = max(sb->len, size);
+	sb->dirty = true;
+	mutex_unlock(&sb->lock);
 
-	err = cifsd_vfs_setxattr(fp->filp->f_path.dentry,
-				 fp->stream.name,
-				 (void *)stream_buf,
-				 size,
-				 0);
-	if (err < 0)
-		goto out;
+	if (sync) {
+		err = cifsd_stream_buf_flush(fp);
+		if (err < 0)
+			return err;
+	}
 
 	fp->filp->f_pos = *pos;
-	err = 0;
+	return count;
 out:
-	cifsd_free(stream_buf);
+	mutex_unlock(&sb->lock);
+	return err;
+}
+
+static int cifsd_vfs_may_write(struct cifsd_session *sess,
+			       struct cifsd_file *fp)
+{
+	if (sess->conn->connection_type) {
+		if (!(fp->daccess & (FILE_WRITE_DATA_LE |
+		   FILE_GENERIC_WRITE_LE | FILE_MAXIMAL_ACCESS_LE |
+		   FILE_GENERIC_ALL_LE))) {
+			cifsd_err("no right to write(%s)\n", FP_FILENAME(fp));
+			return -EACCES;
+		}
+	}
+	return 0;
+}
+
+static int cifsd_vfs_write_prepare(struct cifsd_session *sess,
+				   struct cifsd_file *fp,
+				   loff_t pos,
+				   size_t count)
+{
+	if (check_lock_range(fp, pos, pos + count - 1, WRITE)) {
+		cifsd_err("%s: unable to write due to lock\n",
+				__func__);
+		return -EAGAIN;
+	}
+
+	if (oplocks_enable) {
+		/* Do we need to break any of a levelII oplock? */
+		smb_break_all_levII_oplock(sess->conn, fp, 1);
+	}
+	return 0;
+}
+
+/*
+ * Flushes and write-through writes of an inode which arrive while a sync
+ * of it runs, or within group_commit_us of the first, are covered by the
+ * next single vfs_fsync_range() over all their ranges.
+ */
+static unsigned int group_commit_us;
+module_param(group_commit_us, uint, 0644);
+MODULE_PARM_DESC(group_commit_us,
+	"Time a sync waits for more syncs of the inode to join it in us. Default: 0");
+
+/**
+ * cifsd_vfs_fsync_range() - sync a range of a file with group commit
+ * @fp:		handle of the file
+ * @start:	first byte to sync
+ * @end:	last byte to sync
+ *
+ * The first caller finding no sync running on the inode syncs the ranges
+ * of all callers queued until it starts, later callers wait for the sync
+ * that covers them.
+ *
+ * Return:	0 on success, otherwise the error of the covering sync
+ */
+static int cifsd_vfs_fsync_range(struct cifsd_file *fp, loff_t start,
+				 loff_t end)
+{
+	struct cifsd_sync_group *sg = &fp->f_ci->m_sync;
+	unsigned int delay;
+	u64 ticket, target;
+	int err;
+
+	spin_lock(&sg->lock);
+	sg->start = min(sg->start, start);
+	sg->end = max(sg->end, end);
+	ticket = ++sg->queued;
+
+	while (sg->running) {
+		spin_unlock(&sg->lock);
+		wait_event(sg->wait, READ_ONCE(sg->done) >= ticket ||
+			   !READ_ONCE(sg->running));
+		spin_lock(&sg->lock);
+		if (sg->done >= ticket) {
+			err = sg->err;
+			spin_unlock(&sg->lock);
+			return err;
+		}
+	}
+	sg->running = true;
+	spin_unlock(&sg->lock);
+
+	delay = READ_ONCE(group_commit_us);
+	if (delay)
+		usleep_range(delay, delay + delay / 4 + 1);
+
+	spin_lock(&sg->lock);
+	target = sg->queued;
+	start = sg->start;
+	end = sg->end;
+	sg->start = LLONG_MAX;
+	sg->end = 0;
+	spin_unlock(&sg->lock);
+
+	err = vfs_fsync_range(fp->filp, start, end, 0);
+
+	spin_lock(&sg->lock);
+	sg->done = target;
+	sg->err = err;
+	sg->running = false;
+	spin_unlock(&sg->lock);
+	wake_up_all(&sg->wait);
+	return err;
+}
+
+static int cifsd_vfs_write_done(struct cifsd_file *fp, loff_t offset,
+	loff_t *pos, ssize_t nbytes, bool sync, ssize_t *written)
+{
+	struct file *filp = fp->filp;
+	int err;
+
+	if (nbytes < 0) {
+		cifsd_debug("smb write failed, err = %zd\n", nbytes);
+		return nbytes;
+	}
+
+	filp->f_pos = *pos;
+	*written = nbytes;
+	if (!sync)
+		return 0;
+
+	err = cifsd_vfs_fsync_range(fp, offset, offset + *written);
+	if (err < 0)
+		cifsd_err("fsync failed for filename = %s, err = %d\n",
+				FP_FILENAME(fp), err);
 	return err;
 }
 
@@ -376,69 +738,123 @@ int cifsd_vfs_write(struct cifsd_work *work, struct cifsd_file *fp,
 	struct cifsd_session *sess = work->sess;
 	struct file *filp;
 	loff_t	offset = *pos;
+	ssize_t nbytes;
+	u64 start;
 	int err = 0;
 #if LINUX_VERSION_CODE < KERNEL_VERSION(4, 14, 0)
 	mm_segment_t old_fs;
 #endif
 
-	if (sess->conn->connection_type) {
-		if (!(fp->daccess & (FILE_WRITE_DATA_LE |
-		   FILE_GENERIC_WRITE_LE | FILE_MAXIMAL_ACCESS_LE |
-		   FILE_GENERIC_ALL_LE))) {
-			cifsd_err("no right to write(%s)\n", FP_FILENAME(fp));
-			err = -EACCES;
-			goto out;
-		}
-	}
+	err = cifsd_vfs_may_write(sess, fp);
+	if (err)
+		goto out;
 
 	filp = fp->filp;
 
 	if (cifsd_stream_fd(fp)) {
-		err = cifsd_vfs_stream_write(fp, buf, pos, count);
-		if (!err)
-			*written = count;
+		err = cifsd_vfs_stream_write(fp, buf, pos, count, sync);
+		if (err >= 0) {
+			*written = err;
+			err = 0;
+		}
 		goto out;
 	}
 
-	err = check_lock_range(filp, *pos, *pos + count - 1,
-			WRITE);
-	if (err) {
-		cifsd_err("%s: unable to write due to lock\n",
-				__func__);
-		err = -EAGAIN;
+	err = cifsd_vfs_write_prepare(sess, fp, *pos, count);
+	if (err)
 		goto out;
-	}
-
-	if (oplocks_enable) {
-		/* Do we need to break any of a levelII oplock? */
-		smb_break_all_levII_oplock(sess->conn, fp, 1);
-	}
 
+	start = cifsd_stats_clock();
 #if LINUX_VERSION_CODE < KERNEL_VERSION(4, 14, 0)
 	old_fs = get_fs();
 	set_fs(KERNEL_DS);
-	err = vfs_write(filp, buf, count, pos);
+	nbytes = vfs_write(filp, buf, count, pos);
 	set_fs(old_fs);
 #else
-	err = kernel_write(filp, buf, count, pos);
+	nbytes = kernel_write(filp, buf, count, pos);
 #endif
 
-	if (err < 0) {
-		cifsd_debug("smb write failed, err = %d\n", err);
-		goto out;
-	}
+	err = cifsd_vfs_write_done(fp, offset, pos, nbytes, sync, written);
+	cifsd_stats_io(work, true, err ? err : *written, start);
+out:
+	trace_cifsd_vfs_write(work, fp, offset, count, err ? err : *written);
+	return err;
+}
 
-	filp->f_pos = *pos;
-	*written = err;
-	err = 0;
-	if (sync) {
-		err = vfs_fsync_range(filp, offset, offset + *written, 0);
-		if (err < 0)
-			cifsd_err("fsync failed for filename = %s, err = %d\n",
-					FP_FILENAME(fp), err);
+/**
+ * cifsd_vfs_write_pages() - vfs helper for smb file write from pages
+ * @work:	work
+ * @fp:		open file
+ * @bvec:	pages containing data for writing
+ * @nr_bvec:	number of entries in @bvec
+ * @count:	write byte count
+ * @pos:	file pos
+ * @sync:	fsync after write
+ * @written:	number of bytes written
+ *
+ * Return:	0 on success, otherwise error
+ */
+int cifsd_vfs_write_pages(struct cifsd_work *work, struct cifsd_file *fp,
+	struct bio_vec *bvec, unsigned int nr_bvec, size_t count, loff_t *pos,
+	bool sync, ssize_t *written)
+{
+	struct cifsd_session *sess = work->sess;
+	struct file *filp = fp->filp;
+	struct iov_iter iter;
+	loff_t	offset = *pos;
+	ssize_t nbytes;
+	u64 start;
+	int err;
+
+	if (cifsd_stream_fd(fp)) {
+		/* stream data lives in an xattr, which needs a linear buffer */
+		char *buf = cifsd_alloc(count);
+		unsigned int i;
+		size_t off = 0;
+
+		if (!buf)
+			return -ENOMEM;
+
+		for (i = 0; i < nr_bvec && off < count; i++) {
+			size_t len = min_t(size_t, bvec[i].bv_len,
+					   count - off);
+
+			memcpy(buf + off, page_address(bvec[i].bv_page) +
+			       bvec[i].bv_offset, len);
+			off += len;
+		}
+
+		err = cifsd_vfs_write(work, fp, buf, count, pos, sync, written);
+		cifsd_free(buf);
+		return err;
 	}
 
-out:
+	err = cifsd_vfs_may_write(sess, fp);
+	if (err)
+		return err;
+
+	err = cifsd_vfs_write_prepare(sess, fp, *pos, count);
+	if (err)
+		return err;
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 20, 0)
+	iov_iter_bvec(&iter, ITER_BVEC | WRITE, bvec, nr_bvec, count);
+#else
+	iov_iter_bvec(&iter, WRITE, bvec, nr_bvec, count);
+#endif
+
+	start = cifsd_stats_clock();
+	file_start_write(filp);
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 13, 0)
+	nbytes = vfs_iter_write(filp, &iter, pos);
+#else
+	nbytes = vfs_iter_write(filp, &iter, pos, 0);
+#endif
+	file_end_write(filp);
+
+	err = cifsd_vfs_write_done(fp, offset, pos, nbytes, sync, written);
+	cifsd_stats_io(work, true, err ? err : *written, start);
+	trace_cifsd_vfs_write(work, fp, offset, count, err ? err : *written);
 	return err;
 }
 
@@ -564,6 +980,7 @@ int cifsd_vfs_setattr(struct cifsd_work *work, const char *name,
 out:
 	if (name)
 		path_put(&path);
+	cifsd_fd_put(fp);
 	return err;
 }
 
@@ -597,6 +1014,7 @@ int cifsd_vfs_getattr(struct cifsd_work *work, uint64_t fid,
 #endif
 	if (err)
 		cifsd_err("getattr failed for fid %llu, err %d\n", fid, err);
+	cifsd_fd_put(fp);
 	return err;
 }
 
@@ -704,10 +1122,16 @@ int cifsd_vfs_fsync(struct cifsd_work *work, uint64_t fid, uint64_t p_id)
 		cifsd_err("failed to get filp for fid %llu\n", fid);
 		return -ENOENT;
 	}
-	err = vfs_fsync(fp->filp, 0);
+	if (cifsd_stream_fd(fp)) {
+		err = cifsd_stream_buf_flush(fp);
+		if (err < 0)
+			cifsd_err("stream write back failed, err = %d\n", err);
+	}
+	err = cifsd_vfs_fsync_range(fp, 0, LLONG_MAX);
 	if (err < 0)
 		cifsd_err("smb fsync failed, err = %d\n", err);
 
+	cifsd_fd_put(fp);
 	return err;
 }
 
@@ -770,6 +1194,8 @@ int cifsd_vfs_remove_file(char *name)
 		if (err)
 			cifsd_debug("%s: unlink failed, err %d\n", name, err);
 	}
+	if (!err)
+		smb_break_dir_lease(dir->d_inode, NULL);
 
 	dput(dentry);
 out_err:
@@ -820,6 +1246,8 @@ int cifsd_vfs_link(const char *oldname, const char *newname)
 	err = vfs_link(oldpath.dentry, newpath.dentry->d_inode, dentry, NULL);
 	if (err)
 		cifsd_debug("vfs_link failed err %d\n", err);
+	else
+		smb_break_dir_lease(newpath.dentry->d_inode, NULL);
 
 out3:
 	done_path_create(&newpath, dentry);
@@ -961,8 +1389,13 @@ int cifsd_vfs_rename(char *abs_oldname, char *abs_newname, struct cifsd_file *fp
 		goto out4;
 
 	err = vfs_rename(dold_p->d_inode, dold, dnew_p->d_inode, dnew, NULL, 0);
-	if (err)
+	if (err) {
 		cifsd_err("vfs_rename failed err %d\n", err);
+	} else {
+		smb_break_dir_lease(dold_p->d_inode, fp);
+		if (dnew_p != dold_p)
+			smb_break_dir_lease(dnew_p->d_inode, fp);
+	}
 out4:
 	dput(dnew);
 out3:
@@ -1016,10 +1449,10 @@ int cifsd_vfs_truncate(struct cifsd_work *work, const char *name,
 		} else {
 			inode = file_inode(filp);
 			if (size < inode->i_size) {
-				err = check_lock_range(filp, size,
+				err = check_lock_range(fp, size,
 					inode->i_size - 1, WRITE);
 			} else {
-				err = check_lock_range(filp, inode->i_size,
+				err = check_lock_range(fp, inode->i_size,
 					size - 1, WRITE);
 			}
 
@@ -1049,10 +1482,18 @@ ssize_t cifsd_vfs_listxattr(struct dentry *dentry, char **list, int size)
 {
 	ssize_t err;
 	char *vlist = NULL;
+	u64 stamp;
+
+	if (size > XATTR_LIST_MAX)
+		size = XATTR_LIST_MAX;
+
+	*list = NULL;
+	err = cifsd_inode_meta_get(d_inode(dentry), CIFSD_META_XATTR_LIST,
+				   list, size, &stamp);
+	if (err != -EAGAIN)
+		return err;
 
 	if (size) {
-		if (size > XATTR_LIST_MAX)
-			size = XATTR_LIST_MAX;
 		vlist = vmalloc(size);
 		if (!vlist)
 			return -ENOMEM;
@@ -1066,6 +1507,9 @@ ssize_t cifsd_vfs_listxattr(struct dentry *dentry, char **list, int size)
 		 */
 		err = -E2BIG;
 		cifsd_debug("listxattr failed\n");
+	} else if (vlist) {
+		cifsd_inode_meta_set(d_inode(dentry), CIFSD_META_XATTR_LIST,
+				     stamp, vlist, err);
 	}
 
 	return err;
@@ -1089,12 +1533,26 @@ ssize_t cifsd_vfs_getxattr(struct dentry *dentry,
 			   char *xattr_name,
 			   char **xattr_buf)
 {
+	struct inode *inode = d_inode(dentry);
+	int item = cifsd_inode_meta_item(xattr_name);
 	ssize_t xattr_len;
+	u64 stamp = 0;
 	char *buf;
 
+	if (item >= 0) {
+		xattr_len = cifsd_inode_meta_get(inode, item, xattr_buf,
+						 XATTR_SIZE_MAX, &stamp);
+		if (xattr_len != -EAGAIN)
+			return xattr_len;
+	}
+
 	xattr_len = cifsd_vfs_xattr_len(dentry, xattr_name);
-	if (xattr_len < 0)
+	if (xattr_len < 0) {
+		if (item >= 0)
+			cifsd_inode_meta_set(inode, item, stamp, NULL,
+					     xattr_len);
 		return xattr_len;
+	}
 
 	buf = kmalloc(xattr_len + 1, GFP_KERNEL);
 	if (!buf)
@@ -1103,6 +1561,8 @@ ssize_t cifsd_vfs_getxattr(struct dentry *dentry,
 	xattr_len = vfs_getxattr(dentry, xattr_name, (void *)buf, xattr_len);
 	if (xattr_len)
 		*xattr_buf = buf;
+	if (item >= 0)
+		cifsd_inode_meta_set(inode, item, stamp, buf, xattr_len);
 	return xattr_len;
 }
 
@@ -1122,6 +1582,7 @@ int cifsd_vfs_setxattr(struct dentry *dentry,
 		       size_t attr_size,
 		       int flags)
 {
+	u64 stamp = cifsd_inode_meta_stamp(d_inode(dentry));
 	int err;
 
 	err = vfs_setxattr(dentry,
@@ -1131,6 +1592,9 @@ int cifsd_vfs_setxattr(struct dentry *dentry,
 			   flags);
 	if (err)
 		cifsd_debug("setxattr failed, err %d\n", err);
+	else
+		cifsd_inode_meta_update(d_inode(dentry), stamp, attr_name,
+					attr_value, attr_size);
 	return err;
 }
 
@@ -1177,6 +1641,9 @@ int cifsd_vfs_truncate_xattr(struct dentry *dentry, int wo_streams)
 	ssize_t xattr_list_len;
 	int err = 0;
 
+	if (!wo_streams)
+		cifsd_stream_bufs_discard(d_inode(dentry));
+
 	xattr_list_len = cifsd_vfs_listxattr(dentry, &xattr_list,
 		XATTR_LIST_MAX);
 	if (xattr_list_len < 0) {
@@ -1251,6 +1718,116 @@ void cifsd_vfs_set_fadvise(struct file *filp, int option)
 	}
 }
 
+/*
+ * Reads within a few request sizes of the end of the previous ones count as
+ * sequential, so that reads a client has in flight at once may arrive in
+ * any order.
+ */
+#define CIFSD_RA_SLACK		4
+
+static unsigned int readahead_min_run = 3;
+module_param(readahead_min_run, uint, 0644);
+MODULE_PARM_DESC(readahead_min_run,
+	"Sequential reads of a handle before reading ahead of them, 0 to disable. Default: 3");
+
+static unsigned int readahead_max_kb = 8192;
+module_param(readahead_max_kb, uint, 0644);
+MODULE_PARM_DESC(readahead_max_kb,
+	"Largest window read ahead of sequential reads in KiB. Default: 8192");
+
+static void cifsd_vfs_willneed(struct file *filp, loff_t start, loff_t len)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 19, 0)
+	vfs_fadvise(filp, start, len, POSIX_FADV_WILLNEED);
+#else
+	pgoff_t index = start >> PAGE_SHIFT;
+	unsigned long nr = DIV_ROUND_UP(start + len, PAGE_SIZE) - index;
+
+	page_cache_sync_readahead(filp->f_mapping, &filp->f_ra, filp,
+				  index, nr);
+#endif
+}
+
+static void cifsd_vfs_set_random(struct file *filp, bool random)
+{
+	spin_lock(&filp->f_lock);
+	if (random)
+		filp->f_mode |= FMODE_RANDOM;
+	else
+		filp->f_mode &= ~FMODE_RANDOM;
+	spin_unlock(&filp->f_lock);
+}
+
+/**
+ * cifsd_vfs_readahead() - follow the read pattern of a handle
+ * @fp:		handle read from
+ * @offset:	offset of the read
+ * @len:	length of the read
+ *
+ * Clients rarely pass access hints at CREATE. Runs of sequential reads
+ * start a readahead window past the furthest read, growing with the run
+ * so that the page cache stays ahead of the reads the client's credits
+ * allow in flight, and runs of random reads turn the page cache readahead
+ * of the file off until reads turn sequential again.
+ */
+void cifsd_vfs_readahead(struct cifsd_file *fp, loff_t offset, size_t len)
+{
+	struct cifsd_readahead *ra = &fp->ra;
+	struct file *filp = fp->filp;
+	unsigned int min_run = READ_ONCE(readahead_min_run);
+	loff_t slack = (loff_t)len * CIFSD_RA_SLACK;
+	loff_t end = offset + len, start = 0, window = 0;
+	int set_random = -1;
+	bool seq;
+
+	if (!min_run || !len || cifsd_stream_fd(fp) ||
+	    fp->coption & FILE_RANDOM_ACCESS_LE)
+		return;
+
+	spin_lock(&fp->f_lock);
+	seq = end + slack >= ra->next && offset <= ra->next + slack;
+	if (seq) {
+		ra->seq_reads++;
+		ra->run++;
+		ra->misses = 0;
+		ra->next = max(ra->next, end);
+		if (ra->random) {
+			ra->random = false;
+			set_random = 0;
+		}
+
+		window = min_t(loff_t, (loff_t)len << min(ra->run, 8U),
+			       (loff_t)READ_ONCE(readahead_max_kb) << 10);
+		/* refill once half of the window was read */
+		if (ra->run >= min_run && end + window / 2 > ra->ra_end) {
+			start = max(ra->ra_end, end);
+			window = end + window - start;
+			ra->ra_end = start + window;
+			ra->ra_calls++;
+			ra->ra_bytes += window;
+		} else {
+			window = 0;
+		}
+	} else {
+		ra->random_reads++;
+		ra->misses++;
+		ra->run = 0;
+		ra->next = end;
+		ra->ra_end = 0;
+		if (ra->misses >= min_run && !ra->random &&
+		    !(filp->f_mode & FMODE_RANDOM)) {
+			ra->random = true;
+			set_random = 1;
+		}
+	}
+	spin_unlock(&fp->f_lock);
+
+	if (set_random >= 0)
+		cifsd_vfs_set_random(filp, set_random);
+	if (window > 0)
+		cifsd_vfs_willneed(filp, start, window);
+}
+
 /**
  * cifsd_vfs_lock() - vfs helper for smb file locking
  * @filp:	the file to apply the lock to
@@ -1304,7 +1881,14 @@ int cifsd_vfs_zero_data(struct cifsd_work *work,
 
 int cifsd_vfs_remove_xattr(struct dentry *dentry, char *attr_name)
 {
-	return vfs_removexattr(dentry, attr_name);
+	u64 stamp = cifsd_inode_meta_stamp(d_inode(dentry));
+	int err;
+
+	err = vfs_removexattr(dentry, attr_name);
+	if (!err)
+		cifsd_inode_meta_update(d_inode(dentry), stamp, attr_name,
+					NULL, -ENODATA);
+	return err;
 }
 
 int cifsd_vfs_unlink(struct dentry *dir, struct dentry *dentry)
@@ -1326,6 +1910,8 @@ int cifsd_vfs_unlink(struct dentry *dir, struct dentry *dentry)
 		err = vfs_rmdir(dir->d_inode, dentry);
 	else
 		err = vfs_unlink(dir->d_inode, dentry, NULL);
+	if (!err)
+		smb_break_dir_lease(dir->d_inode, NULL);
 
 out:
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 2, 0)
@@ -1514,6 +2100,9 @@ bool cifsd_vfs_empty_dir(struct cifsd_file *fp)
  * @dirname:	directory name
  * @filename:	filename to lookup
  *
+ * The directory is read once into its caseless index, lookups in an
+ * unchanged directory are then answered by the index.
+ *
  * Return:	0 on success, otherwise error
  */
 static int cifsd_vfs_lookup_in_dir(char *dirname, char *filename)
@@ -1525,31 +2114,43 @@ static int cifsd_vfs_lookup_in_dir(char *dirname, char *filename)
 	int used_count, reclen;
 	int iter;
 	struct cifsd_dirent *buf_p;
+	struct cifsd_dir_index *di;
+	const char *match;
 	int namelen = strlen(filename);
 	int dirnamelen = strlen(dirname);
 	bool match_found = false;
 	struct cifsd_readdir_data readdir_data = {
 		.ctx.actor = cifsd_fill_dirent,
-		.dirent = (void *)__get_free_page(GFP_KERNEL)
 	};
 
-	if (!readdir_data.dirent) {
-		ret = -ENOMEM;
-		goto out;
-	}
-
 	ret = cifsd_vfs_kern_path(dirname, 0, &dir_path, true);
 	if (ret)
 		goto out;
 
+	di = cifsd_dir_index_get(dir_path.dentry->d_inode);
+	if (di) {
+		match = cifsd_dir_index_find(di, filename, namelen);
+		if (match)
+			memcpy(dirname + dirnamelen + 1, match, namelen);
+		cifsd_dir_index_put(di);
+		goto out2;
+	}
+
+	readdir_data.dirent = (void *)__get_free_page(GFP_KERNEL);
+	if (!readdir_data.dirent) {
+		ret = -ENOMEM;
+		goto out2;
+	}
+
 	dfilp = dentry_open(&dir_path, flags, current_cred());
 	if (IS_ERR(dfilp)) {
 		cifsd_err("cannot open directory %s\n", dirname);
 		ret = -EINVAL;
-		goto out2;
+		goto out3;
 	}
 
-	while (!ret && !match_found) {
+	di = cifsd_dir_index_alloc(dir_path.dentry->d_inode);
+	while (!ret && (!match_found || di)) {
 		readdir_data.used = 0;
 		readdir_data.full = 0;
 		ret = cifsd_vfs_readdir(dfilp,
@@ -1566,18 +2167,30 @@ static int cifsd_vfs_lookup_in_dir(char *dirname, char *filename)
 			reclen = ALIGN(sizeof(struct cifsd_dirent) +
 				       buf_p->namelen, sizeof(__le64));
 			length = buf_p->namelen;
-			if (length != namelen ||
+			/* an index which can't be completed is given up */
+			if (di && cifsd_dir_index_add(di, buf_p->name, length)) {
+				cifsd_dir_index_put(di);
+				di = NULL;
+			}
+			if (match_found || length != namelen ||
 				strncasecmp(filename, buf_p->name, namelen))
 				continue;
 			/* got match, make absolute name */
 			memcpy(dirname + dirnamelen + 1, buf_p->name, namelen);
 			match_found = true;
-			break;
+			if (!di)
+				break;
 		}
 	}
 
-	free_page((unsigned long)(readdir_data.dirent));
+	if (di) {
+		if (!ret)
+			cifsd_dir_index_publish(di, dir_path.dentry->d_inode);
+		cifsd_dir_index_put(di);
+	}
 	fput(dfilp);
+out3:
+	free_page((unsigned long)(readdir_data.dirent));
 out2:
 	path_put(&dir_path);
 out:
@@ -1621,6 +2234,96 @@ int cifsd_vfs_kern_path(char *name, unsigned int flags, struct path *path,
 		return err;
 }
 
+/* Look up @dir, relative to the share root, through the tree connect cache */
+static int share_lookup_dir(struct cifsd_tree_connect *tcon, char *dir,
+			    struct path *path)
+{
+	unsigned int len = strlen(dir), seq;
+	int err;
+
+	if (!len) {
+		*path = tcon->share_path;
+		path_get(path);
+		return 0;
+	}
+
+	if (!cifsd_tree_conn_lookup_dir(tcon, dir, len, path))
+		return 0;
+
+	seq = read_seqbegin(&rename_lock);
+	err = vfs_path_lookup(tcon->share_path.dentry, tcon->share_path.mnt,
+			      dir, LOOKUP_FOLLOW | LOOKUP_DIRECTORY, path);
+	if (!err)
+		cifsd_tree_conn_cache_dir(tcon, dir, len, path, seq);
+	return err;
+}
+
+/**
+ * cifsd_vfs_share_kern_path() - lookup a file in the share of a request
+ * @work:	smb work
+ * @name:	absolute name of the file, below the share path
+ * @flags:	lookup flags
+ * @path:	if lookup succeed, return path info
+ * @caseless:	caseless filename lookup
+ *
+ * Same as cifsd_vfs_kern_path(), but the walk starts from the share root
+ * of the tree connect, and from the parent directory when a recent
+ * request already looked it up, instead of resolving every component
+ * of the share path again.
+ *
+ * Return:	0 on success, otherwise error
+ */
+int cifsd_vfs_share_kern_path(struct cifsd_work *work, char *name,
+			      unsigned int flags, struct path *path,
+			      bool caseless)
+{
+	struct cifsd_tree_connect *tcon = work->tcon;
+	struct path parent;
+	char *rel, *last;
+	size_t root_len;
+	int err;
+
+	if (!tcon || !tcon->share_path.dentry)
+		return cifsd_vfs_kern_path(name, flags, path, caseless);
+
+	root_len = strlen(tcon->share_conf->path);
+	if (strncmp(name, tcon->share_conf->path, root_len) ||
+	    (name[root_len] != '/' && name[root_len] != '\0'))
+		return cifsd_vfs_kern_path(name, flags, path, caseless);
+
+	rel = name + root_len;
+	while (*rel == '/')
+		rel++;
+	if (!*rel) {
+		*path = tcon->share_path;
+		path_get(path);
+		return 0;
+	}
+
+	last = strrchr(rel, '/');
+	if (last && !last[1])
+		return cifsd_vfs_kern_path(name, flags, path, caseless);
+
+	if (last) {
+		*last = '\0';
+		err = share_lookup_dir(tcon, rel, &parent);
+		*last++ = '/';
+	} else {
+		err = share_lookup_dir(tcon, "", &parent);
+		last = rel;
+	}
+
+	if (!err) {
+		err = vfs_path_lookup(parent.dentry, parent.mnt, last, flags,
+				      path);
+		path_put(&parent);
+	}
+
+	if (err == -ENOENT && caseless)
+		err = cifsd_vfs_kern_path(name, flags, path, caseless);
+	return err;
+}
+
 /**
  * fill_create_time() - fill create time of directory entry in cifsd_kstat
  * if related config is not yes, create time is same with change time
@@ -1726,6 +2429,20 @@ static void fill_file_attributes(struct cifsd_work *work,
 	}
 }
 
+/**
+ * cifsd_vfs_fill_dentry_attrs() - fill stat information of a directory entry
+ * @work:	smb work containing share config
+ * @path:	path of the entry, not followed if it is a symlink
+ * @cifsd_kstat:	cifsd kstat wrapper to fill
+ */
+void cifsd_vfs_fill_dentry_attrs(struct cifsd_work *work, struct path *path,
+				 struct cifsd_kstat *cifsd_kstat)
+{
+	generic_fillattr(path->dentry->d_inode, cifsd_kstat->kstat);
+	fill_create_time(work, path, cifsd_kstat);
+	fill_file_attributes(work, path, cifsd_kstat);
+}
+
 /**
  * read_next_entry() - read next directory entry and return absolute name
  * @work:	smb work containing share config
@@ -1767,9 +2484,7 @@ char *cifsd_vfs_readdir_name(struct cifsd_work *work,
 		return ERR_PTR(rc);
 	}
 
-	generic_fillattr(path.dentry->d_inode, cifsd_kstat->kstat);
-	fill_create_time(work, &path, cifsd_kstat);
-	fill_file_attributes(work, &path, cifsd_kstat);
+	cifsd_vfs_fill_dentry_attrs(work, &path, cifsd_kstat);
 	memcpy(name, de->name, de->namelen);
 	name[de->namelen] = '\0';
 	path_put(&path);
@@ -1923,10 +2638,10 @@ int cifsd_vfs_copy_file_ranges(struct cifsd_work *work,
 		dst_off = le64_to_cpu(chunks[i].TargetOffset);
 		len = le32_to_cpu(chunks[i].Length);
 
-		if (check_lock_range(src_fp->filp, src_off,
+		if (check_lock_range(src_fp, src_off,
 				src_off + len - 1, READ))
 			return -EAGAIN;
-		if (check_lock_range(dst_fp->filp, dst_off,
+		if (check_lock_range(dst_fp, dst_off,
 				dst_off + len - 1, WRITE))
 			return -EAGAIN;
 	}
@@ -1940,6 +2655,9 @@ int cifsd_vfs_copy_file_ranges(struct cifsd_work *work,
 
 		if (src_off + len > src_file_size)
 			return -E2BIG;
+		/* asynchronous copies can be cancelled between chunks */
+		if (work->state == WORK_STATE_CANCELLED)
+			return -ECANCELED;
 
 		ret = cifsd_vfs_copy_file_range(src_fp->filp, src_off,
 				dst_fp->filp, dst_off, len);
@@ -1952,6 +2670,148 @@ int cifsd_vfs_copy_file_ranges(struct cifsd_work *work,
 	return 0;
 }
 
+/**
+ * cifsd_vfs_can_clone() - check if a file system can share extents
+ * @sb:		super block of the file system
+ *
+ * Return:	true for file systems FSCTL_DUPLICATE_EXTENTS_TO_FILE is
+ *		advertised on
+ */
+bool cifsd_vfs_can_clone(struct super_block *sb)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 5, 0)
+	return sb->s_magic == XFS_SUPER_MAGIC ||
+		sb->s_magic == BTRFS_SUPER_MAGIC;
+#else
+	return false;
+#endif
+}
+
+/**
+ * cifsd_vfs_clone_file_range() - share extents of one file with another
+ * @work:	smb work
+ * @src_fp:	source file
+ * @dst_fp:	destination file
+ * @src_off:	offset in the source file
+ * @dst_off:	offset in the destination file
+ * @len:	length of the range to share
+ *
+ * Return:	0 on success, otherwise error
+ */
+int cifsd_vfs_clone_file_range(struct cifsd_work *work,
+			       struct cifsd_file *src_fp,
+			       struct cifsd_file *dst_fp,
+			       loff_t src_off, loff_t dst_off, loff_t len)
+{
+	loff_t ret;
+
+	if (!(src_fp->daccess & (FILE_READ_DATA_LE | FILE_GENERIC_READ_LE |
+			FILE_GENERIC_ALL_LE | FILE_MAXIMAL_ACCESS_LE |
+			FILE_EXECUTE_LE))) {
+		cifsd_err("no right to read(%s)\n", FP_FILENAME(src_fp));
+		return -EACCES;
+	}
+	if (!(dst_fp->daccess & (FILE_WRITE_DATA_LE | FILE_APPEND_DATA_LE |
+			FILE_GENERIC_WRITE_LE | FILE_GENERIC_ALL_LE |
+			FILE_MAXIMAL_ACCESS_LE))) {
+		cifsd_err("no right to write(%s)\n", FP_FILENAME(dst_fp));
+		return -EACCES;
+	}
+
+	if (cifsd_stream_fd(src_fp) || cifsd_stream_fd(dst_fp))
+		return -EBADF;
+	/* a length of 0 would clone to the end of the file */
+	if (len <= 0)
+		return len ? -EINVAL : 0;
+
+	if (check_lock_range(src_fp, src_off, src_off + len - 1, READ) ||
+	    check_lock_range(dst_fp, dst_off, dst_off + len - 1, WRITE))
+		return -EAGAIN;
+
+	if (oplocks_enable)
+		smb_break_all_levII_oplock(work->sess->conn, dst_fp, 1);
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 20, 0)
+	ret = vfs_clone_file_range(src_fp->filp, src_off, dst_fp->filp,
+				   dst_off, len, 0);
+	if (ret >= 0 && ret != len)
+		ret = -EINVAL;
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(4, 5, 0)
+	ret = vfs_clone_file_range(src_fp->filp, src_off, dst_fp->filp,
+				   dst_off, len);
+#else
+	ret = -EOPNOTSUPP;
+#endif
+	return ret < 0 ? ret : 0;
+}
+
+/**
+ * cifsd_vfs_fqar_lseek() - list the allocated ranges of a file
+ * @fp:		file to query
+ * @start:	start of the range to query
+ * @length:	length of the range to query
+ * @ranges:	destination of the allocated ranges
+ * @in_count:	number of @ranges
+ * @out_count:	number of ranges set
+ *
+ * Return:	0 on success, -E2BIG if @ranges was too small for all the
+ *		allocated ranges, otherwise error
+ */
+int cifsd_vfs_fqar_lseek(struct cifsd_file *fp, loff_t start, loff_t length,
+			 struct file_allocated_range_buffer *ranges,
+			 int in_count, int *out_count)
+{
+	struct file *f = fp->filp;
+	struct inode *inode = FP_INODE(fp);
+	loff_t maxbytes = (u64)inode->i_sb->s_maxbytes, end;
+	loff_t extent_start, extent_end;
+	int ret = 0;
+
+	*out_count = 0;
+	if (start < 0 || length < 0)
+		return -EINVAL;
+	if (start >= maxbytes)
+		return -EFBIG;
+
+	if (!length || start >= i_size_read(inode))
+		return 0;
+
+	if (length > maxbytes || (maxbytes - length) < start)
+		end = maxbytes;
+	else
+		end = start + length;
+	end = min(end, i_size_read(inode));
+
+	while (start < end) {
+		extent_start = vfs_llseek(f, start, SEEK_DATA);
+		if (extent_start < 0) {
+			if (extent_start != -ENXIO)
+				ret = (int)extent_start;
+			break;
+		}
+		if (extent_start >= end)
+			break;
+
+		extent_end = vfs_llseek(f, extent_start, SEEK_HOLE);
+		if (extent_end < 0) {
+			if (extent_end != -ENXIO)
+				ret = (int)extent_end;
+			break;
+		}
+
+		if (*out_count >= in_count) {
+			ret = -E2BIG;
+			break;
+		}
+
+		ranges[*out_count].file_offset = cpu_to_le64(extent_start);
+		ranges[(*out_count)++].length =
+			cpu_to_le64(min(extent_end, end) - extent_start);
+		start = extent_end;
+	}
+	return ret;
+}
+
 int cifsd_vfs_posix_lock_wait(struct file_lock *flock)
 {
 #if LINUX_VERSION_CODE < KERNEL_VERSION(5, 0, 0)
@@ -82,6 +82,7 @@
 
 struct cifsd_work;
 struct cifsd_file;
+struct bio_vec;
 
 struct cifsd_dir_info {
 	char		*name;
@@ -127,8 +128,14 @@ int cifsd_vfs_create(struct cifsd_work *work, const char *name, umode_t mode);
 int cifsd_vfs_mkdir(struct cifsd_work *work, const char *name, umode_t mode);
 int cifsd_vfs_read(struct cifsd_work *work, struct cifsd_file *fp,
 		 size_t count, loff_t *pos);
+bool cifsd_vfs_zerocopy_read(struct cifsd_file *fp);
+int cifsd_vfs_splice_read(struct cifsd_work *work, struct cifsd_file *fp,
+			  size_t count, loff_t *pos);
 int cifsd_vfs_write(struct cifsd_work *work, struct cifsd_file *fp,
 	char *buf, size_t count, loff_t *pos, bool sync, ssize_t *written);
+int cifsd_vfs_write_pages(struct cifsd_work *work, struct cifsd_file *fp,
+	struct bio_vec *bvec, unsigned int nr_bvec, size_t count, loff_t *pos,
+	bool sync, ssize_t *written);
 int cifsd_vfs_getattr(struct cifsd_work *work, uint64_t fid,
 		struct kstat *stat);
 int cifsd_vfs_setattr(struct cifsd_work *work, const char *name,
@@ -152,6 +159,15 @@ int cifsd_vfs_copy_file_ranges(struct cifsd_work *work,
 				unsigned int *chunk_count_written,
 				unsigned int *chunk_size_written,
 				loff_t  *total_size_written);
+int cifsd_vfs_clone_file_range(struct cifsd_work *work,
+			       struct cifsd_file *src_fp,
+			       struct cifsd_file *dst_fp,
+			       loff_t src_off, loff_t dst_off, loff_t len);
+bool cifsd_vfs_can_clone(struct super_block *sb);
+struct file_allocated_range_buffer;
+int cifsd_vfs_fqar_lseek(struct cifsd_file *fp, loff_t start, loff_t length,
+			 struct file_allocated_range_buffer *ranges,
+			 int in_count, int *out_count);
 
 struct cifsd_file *cifsd_vfs_dentry_open(struct cifsd_work *work,
 					 const struct path *path,
@@ -188,8 +204,12 @@ int cifsd_vfs_remove_xattr(struct dentry *dentry, char *attr_name);
 
 int cifsd_vfs_kern_path(char *name, unsigned int flags, struct path *path,
 		bool caseless);
+int cifsd_vfs_share_kern_path(struct cifsd_work *work, char *name,
+			      unsigned int flags, struct path *path,
+			      bool caseless);
 bool cifsd_vfs_empty_dir(struct cifsd_file *fp);
 void cifsd_vfs_set_fadvise(struct file *filp, int option);
+void cifsd_vfs_readahead(struct cifsd_file *fp, loff_t offset, size_t len);
 int cifsd_vfs_lock(struct file *filp, int cmd, struct file_lock *flock);
 int cifsd_vfs_readdir(struct file *file, struct cifsd_readdir_data *rdata);
 int cifsd_vfs_alloc_size(struct cifsd_work *work,
@@ -210,6 +230,8 @@ char *cifsd_vfs_readdir_name(struct cifsd_work *work,
 			     struct cifsd_dirent *de,
 			     char *dirpath);
 void *cifsd_vfs_init_kstat(char **p, struct cifsd_kstat *cifsd_kstat);
+void cifsd_vfs_fill_dentry_attrs(struct cifsd_work *work, struct path *path,
+				 struct cifsd_kstat *cifsd_kstat);
 
 int cifsd_vfs_posix_lock_wait(struct file_lock *flock);
 int cifsd_vfs_posix_lock_wait_timeout(struct file_lock *flock, long timeout);
@@ -5,6 +5,16 @@
  */
 
 #include <linux/fs.h>
+#include <linux/namei.h>
+#include <linux/moduleparam.h>
+#include <linux/rculist.h>
+#include <linux/percpu.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/interval_tree_generic.h>
+#include <linux/hashtable.h>
+#include <linux/jhash.h>
+#include <linux/shrinker.h>
 
 /* @FIXME */
 #include "glob.h"
@@ -12,13 +22,19 @@
 #include "buffer_pool.h"
 
 #include "oplock.h"
+#include "notify.h"
 #include "vfs.h"
+#include "smb_common.h"
 #include "transport_tcp.h"
 #include "mgmt/tree_connect.h"
 #include "mgmt/user_session.h"
+#include "mgmt/share_config.h"
 
 /* @FIXME */
 #include "smb_common.h"
+#include "misc.h"
+#include "time_wrappers.h"
+#include "trace.h"
 
 #define S_DEL_PENDING			1
 #define S_DEL_ON_CLS			2
@@ -27,7 +43,34 @@
 static unsigned int inode_hash_mask __read_mostly;
 static unsigned int inode_hash_shift __read_mostly;
 static struct hlist_head *inode_hashtable __read_mostly;
-static DEFINE_RWLOCK(inode_hash_lock);
+
+/*
+ * Lookups walk the inode hash under RCU and take a reference with
+ * m_count; inserts and removals take the lock of their bucket.
+ */
+#define CIFSD_INODE_HASH_LOCKS		256
+
+static spinlock_t inode_hash_locks[CIFSD_INODE_HASH_LOCKS];
+
+struct cifsd_inode_hash_stats {
+	u64	lookups;
+	u64	lookup_ns;
+	u64	updates;
+	u64	lock_ns;
+};
+
+static DEFINE_PER_CPU(struct cifsd_inode_hash_stats, inode_hash_stats);
+static atomic_long_t inode_hash_nr;
+
+static struct hlist_head *dir_index_hashtable __read_mostly;
+static DEFINE_SPINLOCK(dir_index_lock);
+static LIST_HEAD(dir_index_lru);
+static unsigned long dir_index_nr_names;
+
+static unsigned int caseless_index_max_names = 524288;
+module_param(caseless_index_max_names, uint, 0644);
+MODULE_PARM_DESC(caseless_index_max_names,
+	"Names kept in the caseless lookup indexes of directories, 0 to disable. Default: 524288");
 
 static struct cifsd_file_table global_ft;
 static atomic_long_t fd_limit;
@@ -67,51 +110,62 @@ static unsigned long inode_hash(struct super_block *sb, unsigned long hashval)
 	return tmp & inode_hash_mask;
 }
 
+static spinlock_t *inode_hash_bucket_lock(unsigned long bucket)
+{
+	return &inode_hash_locks[bucket & (CIFSD_INODE_HASH_LOCKS - 1)];
+}
+
+/* Caller holds rcu_read_lock() or the lock of the bucket */
 static struct cifsd_inode *__cifsd_inode_lookup(struct inode *inode)
 {
 	struct hlist_head *head = inode_hashtable +
 		inode_hash(inode->i_sb, inode->i_ino);
-	struct cifsd_inode *ci = NULL, *ret_ci = NULL;
+	struct cifsd_inode *ci;
 
-	hlist_for_each_entry(ci, head, m_hash) {
-		if (ci->m_inode == inode) {
-			if (atomic_inc_not_zero(&ci->m_count))
-				ret_ci = ci;
-			break;
-		}
+	hlist_for_each_entry_rcu(ci, head, m_hash) {
+		/* a cifsd_inode being freed may still be hashed */
+		if (ci->m_inode == inode && atomic_inc_not_zero(&ci->m_count))
+			return ci;
 	}
-	return ret_ci;
-}
-
-static struct cifsd_inode *cifsd_inode_lookup(struct cifsd_file *fp)
-{
-	return __cifsd_inode_lookup(FP_INODE(fp));
+	return NULL;
 }
 
-static struct cifsd_inode *cifsd_inode_lookup_by_vfsinode(struct inode *inode)
+static struct cifsd_inode *cifsd_inode_lookup_rcu(struct inode *inode)
 {
 	struct cifsd_inode *ci;
+	u64 start = ktime_get_ns();
 
-	read_lock(&inode_hash_lock);
+	rcu_read_lock();
 	ci = __cifsd_inode_lookup(inode);
-	read_unlock(&inode_hash_lock);
+	rcu_read_unlock();
+
+	this_cpu_inc(inode_hash_stats.lookups);
+	this_cpu_add(inode_hash_stats.lookup_ns, ktime_get_ns() - start);
 	return ci;
 }
 
+static struct cifsd_inode *cifsd_inode_lookup(struct cifsd_file *fp)
+{
+	return cifsd_inode_lookup_rcu(FP_INODE(fp));
+}
+
+struct cifsd_inode *cifsd_inode_lookup_by_vfsinode(struct inode *inode)
+{
+	return cifsd_inode_lookup_rcu(inode);
+}
+
 int cifsd_query_inode_status(struct inode *inode)
 {
 	struct cifsd_inode *ci;
 	int ret = CIFSD_INODE_STATUS_UNKNOWN;
 
-	read_lock(&inode_hash_lock);
-	ci = __cifsd_inode_lookup(inode);
+	ci = cifsd_inode_lookup_rcu(inode);
 	if (ci) {
 		ret = CIFSD_INODE_STATUS_OK;
 		if (ci->m_flags & S_DEL_PENDING)
 			ret = CIFSD_INODE_STATUS_PENDING_DELETE;
 		atomic_dec(&ci->m_count);
 	}
-	read_unlock(&inode_hash_lock);
 	return ret;
 }
 
@@ -143,24 +197,33 @@ void cifsd_fd_set_delete_on_close(struct cifsd_file *fp,
 		fp->f_ci->m_flags |= S_DEL_ON_CLS;
 }
 
-static void cifsd_inode_hash(struct cifsd_inode *ci)
+static void cifsd_inode_hash_account(u64 start)
 {
-	struct hlist_head *b = inode_hashtable +
-		inode_hash(ci->m_inode->i_sb, ci->m_inode->i_ino);
-
-	hlist_add_head(&ci->m_hash, b);
+	this_cpu_inc(inode_hash_stats.updates);
+	this_cpu_add(inode_hash_stats.lock_ns, ktime_get_ns() - start);
 }
 
 static void cifsd_inode_unhash(struct cifsd_inode *ci)
 {
-	write_lock(&inode_hash_lock);
-	hlist_del_init(&ci->m_hash);
-	write_unlock(&inode_hash_lock);
+	unsigned long bucket = inode_hash(ci->m_inode->i_sb,
+					  ci->m_inode->i_ino);
+	spinlock_t *lock = inode_hash_bucket_lock(bucket);
+	u64 start;
+
+	spin_lock(lock);
+	start = ktime_get_ns();
+	if (!hlist_unhashed(&ci->m_hash)) {
+		hlist_del_init_rcu(&ci->m_hash);
+		atomic_long_dec(&inode_hash_nr);
+	}
+	cifsd_inode_hash_account(start);
+	spin_unlock(lock);
 }
 
 static int cifsd_inode_init(struct cifsd_inode *ci, struct cifsd_file *fp)
 {
 	ci->m_inode = FP_INODE(fp);
+	INIT_HLIST_NODE(&ci->m_hash);
 	atomic_set(&ci->m_count, 1);
 	atomic_set(&ci->op_count, 0);
 	ci->m_flags = 0;
@@ -169,89 +232,1537 @@ static int cifsd_inode_init(struct cifsd_inode *ci, struct cifsd_file *fp)
 	INIT_LIST_HEAD(&ci->m_op_list);
 	rwlock_init(&ci->m_lock);
 	ci->stream_name = NULL;
+	ci->m_dir_enum = NULL;
+	spin_lock_init(&ci->m_meta_lock);
+	memset(ci->m_meta, 0, sizeof(ci->m_meta));
+	INIT_LIST_HEAD(&ci->m_streams);
+	atomic_set(&ci->m_stream_gen, 0);
+	rwlock_init(&ci->m_brl_lock);
+	ci->m_brl_tree = CIFSD_BRL_ROOT_INIT;
+	atomic_set(&ci->m_brl_nr, 0);
+	memset(&ci->m_sync, 0, sizeof(ci->m_sync));
+	ci->m_sync.start = LLONG_MAX;
+	spin_lock_init(&ci->m_sync.lock);
+	init_waitqueue_head(&ci->m_sync.wait);
+
+	if (cifsd_stream_fd(fp)) {
+		ci->stream_name = kmalloc(fp->stream.size + 1, GFP_KERNEL);
+		if (!ci->stream_name)
+			return -ENOMEM;
+		strncpy(ci->stream_name, fp->stream.name, fp->stream.size);
+	}
+
+	return 0;
+}
+
+static struct cifsd_inode *cifsd_inode_get(struct cifsd_file *fp)
+{
+	struct cifsd_inode *ci, *tmpci;
+	unsigned long bucket;
+	spinlock_t *lock;
+	u64 start;
+	int rc;
+
+	ci = cifsd_inode_lookup(fp);
+	if (ci)
+		return ci;
+
+	ci = kmalloc(sizeof(struct cifsd_inode), GFP_KERNEL);
+	if (!ci)
+		return NULL;
+
+	rc = cifsd_inode_init(ci, fp);
+	if (rc) {
+		cifsd_err("inode initialized failed\n");
+		kfree(ci);
+		return NULL;
+	}
+
+	bucket = inode_hash(ci->m_inode->i_sb, ci->m_inode->i_ino);
+	lock = inode_hash_bucket_lock(bucket);
+	spin_lock(lock);
+	start = ktime_get_ns();
+	tmpci = __cifsd_inode_lookup(ci->m_inode);
+	if (!tmpci) {
+		hlist_add_head_rcu(&ci->m_hash, inode_hashtable + bucket);
+		atomic_long_inc(&inode_hash_nr);
+	}
+	cifsd_inode_hash_account(start);
+	spin_unlock(lock);
+
+	if (tmpci) {
+		kfree(ci->stream_name);
+		kfree(ci);
+		ci = tmpci;
+	}
+	return ci;
+}
+
+static void cifsd_dir_enum_put(struct cifsd_dir_enum *de);
+
+static void cifsd_inode_free(struct cifsd_inode *ci)
+{
+	int i;
+
+	cifsd_inode_unhash(ci);
+	cifsd_dir_enum_put(ci->m_dir_enum);
+	for (i = 0; i < CIFSD_META_NR; i++)
+		kfree(ci->m_meta[i].value);
+	kfree(ci->stream_name);
+	/* lookups may still be looking at m_inode and m_count */
+	kfree_rcu(ci, m_rcu);
+}
+
+void cifsd_inode_put(struct cifsd_inode *ci)
+{
+	if (atomic_dec_and_test(&ci->m_count))
+		cifsd_inode_free(ci);
+}
+
+int __init cifsd_inode_hash_init(void)
+{
+	unsigned int loop;
+	unsigned long numentries = 16384;
+	unsigned long bucketsize = sizeof(struct hlist_head);
+	unsigned long size;
+
+	inode_hash_shift = ilog2(numentries);
+	inode_hash_mask = (1 << inode_hash_shift) - 1;
+
+	size = bucketsize << inode_hash_shift;
+
+	/* init master fp hash table */
+	inode_hashtable = __vmalloc(size, GFP_ATOMIC, PAGE_KERNEL);
+	if (!inode_hashtable)
+		return -ENOMEM;
+
+	/* directory indexes are hashed on the inode like cifsd_inode */
+	dir_index_hashtable = __vmalloc(size, GFP_ATOMIC, PAGE_KERNEL);
+	if (!dir_index_hashtable) {
+		vfree(inode_hashtable);
+		return -ENOMEM;
+	}
+
+	for (loop = 0; loop < (1U << inode_hash_shift); loop++) {
+		INIT_HLIST_HEAD(&inode_hashtable[loop]);
+		INIT_HLIST_HEAD(&dir_index_hashtable[loop]);
+	}
+	for (loop = 0; loop < CIFSD_INODE_HASH_LOCKS; loop++)
+		spin_lock_init(&inode_hash_locks[loop]);
+	return 0;
+}
+
+/**
+ * cifsd_inode_hash_stats() - print statistics of the inode hash
+ * @buf:	output buffer
+ * @size:	size of @buf
+ *
+ * One line: hashed inodes, lookups and their average latency in ns,
+ * inserts and removals and their average bucket lock hold time in ns.
+ *
+ * Return:	number of bytes written to @buf
+ */
+ssize_t cifsd_inode_hash_stats(char *buf, size_t size)
+{
+	struct cifsd_inode_hash_stats *st, sum = {0};
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		st = per_cpu_ptr(&inode_hash_stats, cpu);
+		sum.lookups += st->lookups;
+		sum.lookup_ns += st->lookup_ns;
+		sum.updates += st->updates;
+		sum.lock_ns += st->lock_ns;
+	}
+
+	return scnprintf(buf, size, "%ld %llu %llu %llu %llu\n",
+			 atomic_long_read(&inode_hash_nr),
+			 sum.lookups,
+			 sum.lookups ? div64_u64(sum.lookup_ns, sum.lookups) : 0,
+			 sum.updates,
+			 sum.updates ? div64_u64(sum.lock_ns, sum.updates) : 0);
+}
+
+/**
+ * cifsd_readahead_stats() - list the read pattern of open handles
+ * @buf:	destination buffer
+ * @size:	size of @buf
+ *
+ * One line per handle that was read from: sequential reads, random
+ * reads, readaheads issued, KiB read ahead and the name of the file.
+ *
+ * Return:	length of the listing
+ */
+ssize_t cifsd_readahead_stats(char *buf, size_t size)
+{
+	struct cifsd_inode *ci;
+	struct cifsd_file *fp;
+	unsigned int i;
+	ssize_t len = 0;
+
+	rcu_read_lock();
+	for (i = 0; i <= inode_hash_mask && len < size; i++) {
+		hlist_for_each_entry_rcu(ci, &inode_hashtable[i], m_hash) {
+			read_lock(&ci->m_lock);
+			list_for_each_entry(fp, &ci->m_fp_list, node) {
+				if (!fp->ra.seq_reads && !fp->ra.random_reads)
+					continue;
+				len += scnprintf(buf + len, size - len,
+						 "%llu %llu %llu %llu %s\n",
+						 fp->ra.seq_reads,
+						 fp->ra.random_reads,
+						 fp->ra.ra_calls,
+						 fp->ra.ra_bytes >> 10,
+						 FP_FILENAME(fp));
+			}
+			read_unlock(&ci->m_lock);
+		}
+	}
+	rcu_read_unlock();
+	return len;
+}
+
+static void cifsd_dir_index_purge(void);
+
+void __exit cifsd_release_inode_hash(void)
+{
+	/* wait for kfree_rcu() of the last inodes */
+	rcu_barrier();
+	cifsd_dir_index_purge();
+	vfree(dir_index_hashtable);
+	vfree(inode_hashtable);
+}
+
+/*
+ * Caseless name index of a directory
+ *
+ * A caseless lookup of a name kern_path() can't find reads the whole
+ * directory. The names read are kept in an index hashed on their
+ * lowercase form, so that later lookups in an unchanged directory don't
+ * read it again. An index is valid while the mtime and ctime of its
+ * directory are those it was built with; a directory changed within the
+ * last second isn't indexed, since a change in the same timestamp tick
+ * wouldn't be noticed.
+ */
+
+#define CIFSD_DIR_CHUNK_SIZE	(64 * 1024)
+
+struct cifsd_dir_name {
+	struct cifsd_dir_name		*next;
+	unsigned int			hash;
+	unsigned int			len;
+	char				name[];
+};
+
+struct cifsd_dir_chunk {
+	struct cifsd_dir_chunk		*next;
+	unsigned int			used;
+	char				data[];
+};
+
+struct cifsd_dir_index {
+	struct hlist_node		d_hash;
+	struct list_head		d_lru;
+	atomic_t			d_count;
+	struct super_block		*d_sb;
+	unsigned long			d_ino;
+	u32				d_generation;
+	u64				d_mtime;
+	u64				d_ctime;
+	unsigned int			nr_names;
+	unsigned int			nr_buckets;
+	struct cifsd_dir_name		**buckets;
+	struct cifsd_dir_chunk		*chunks;
+};
+
+static unsigned int dir_name_hash(const char *name, unsigned int len)
+{
+	unsigned int hash = 2166136261U;
+
+	while (len--)
+		hash = (hash ^ tolower(*name++)) * 16777619U;
+	return hash;
+}
+
+static void dir_stamp(struct inode *dir, u64 *mtime, u64 *ctime)
+{
+	*mtime = cifs_UnixTimeToNT(from_kern_timespec(dir->i_mtime));
+	*ctime = cifs_UnixTimeToNT(from_kern_timespec(dir->i_ctime));
+}
+
+/* Changed within the last second, a change in the same tick may follow */
+static bool dir_stamp_fresh(u64 mtime, u64 ctime)
+{
+	u64 now = (u64)ktime_get_real_seconds() * 10000000 + NTFS_TIME_OFFSET;
+
+	return max(mtime, ctime) + 10000000 >= now;
+}
+
+/*
+ * METADATA cache
+ *
+ * The DOS attribute and creation time xattrs and the xattr list of files
+ * with an open handle are kept on their cifsd_inode, and so is the security
+ * descriptor built from the owner and mode. A value is used while the
+ * inode ctime is the one it was read at, any xattr change moves ctime,
+ * and not before the second it was read in is over, as with directory
+ * enumerations.
+ */
+static bool inode_meta_cache = true;
+module_param(inode_meta_cache, bool, 0644);
+MODULE_PARM_DESC(inode_meta_cache,
+	"Cache DOS attributes, creation times, xattr lists and security descriptors of open files. Default: Y");
+
+/* Larger xattr lists are read from the file system every time */
+#define CIFSD_META_MAX_LEN		4096
+
+int cifsd_inode_meta_item(const char *name)
+{
+	if (!strcmp(name, XATTR_NAME_FILE_ATTRIBUTE))
+		return CIFSD_META_FILE_ATTRIBUTE;
+	if (!strcmp(name, XATTR_NAME_CREATION_TIME))
+		return CIFSD_META_CREATION_TIME;
+	return -1;
+}
+
+u64 cifsd_inode_meta_stamp(struct inode *inode)
+{
+	return cifs_UnixTimeToNT(from_kern_timespec(inode->i_ctime));
+}
+
+static bool meta_valid(struct cifsd_inode_meta *m, u64 stamp)
+{
+	return m->ctime && m->ctime == stamp &&
+		!dir_stamp_fresh(m->ctime, m->ctime);
+}
+
+static void meta_drop(struct cifsd_inode_meta *m)
+{
+	kfree(m->value);
+	m->value = NULL;
+	m->ctime = 0;
+	m->len = 0;
+}
+
+static bool meta_list_has(struct cifsd_inode_meta *m, const char *name)
+{
+	char *p;
+
+	if (m->len <= 0)
+		return false;
+	for (p = m->value; p - m->value < m->len; p += strlen(p) + 1)
+		if (!strcmp(p, name))
+			return true;
+	return false;
+}
+
+/**
+ * cifsd_inode_meta_get() - look up a cached xattr of an open file
+ * @inode:	inode of the file
+ * @item:	CIFSD_META_* value to look up
+ * @value:	set to a copy of the value
+ * @size:	largest value the caller takes, 0 to only query the length
+ * @stamp:	set to the stamp to cache the value read on a miss with
+ *
+ * Return:	value length or -ENODATA on a hit, -EAGAIN on a miss
+ */
+ssize_t cifsd_inode_meta_get(struct inode *inode, int item, char **value,
+			     size_t size, u64 *stamp)
+{
+	struct cifsd_inode *ci;
+	struct cifsd_inode_meta *m;
+	ssize_t len = -EAGAIN;
+	char *buf = NULL;
+
+	*stamp = 0;
+	if (!READ_ONCE(inode_meta_cache))
+		return -EAGAIN;
+
+	ci = cifsd_inode_lookup_by_vfsinode(inode);
+	if (!ci)
+		return -EAGAIN;
+
+	*stamp = cifsd_inode_meta_stamp(inode);
+	m = &ci->m_meta[item];
+	spin_lock(&ci->m_meta_lock);
+	if (meta_valid(m, *stamp))
+		len = m->len;
+	spin_unlock(&ci->m_meta_lock);
+
+	if (len <= 0 || !size)
+		goto out;
+	if (len > size) {
+		len = -EAGAIN;
+		goto out;
+	}
+
+	/* callers vfree() xattr lists and kfree() values */
+	if (item == CIFSD_META_XATTR_LIST)
+		buf = vmalloc(len + 1);
+	else
+		buf = kmalloc(len + 1, GFP_KERNEL);
+	if (!buf) {
+		len = -EAGAIN;
+		goto out;
+	}
+
+	spin_lock(&ci->m_meta_lock);
+	/* the value may have been replaced while allocating */
+	if (meta_valid(m, *stamp) && m->len == len) {
+		memcpy(buf, m->value, len);
+		buf[len] = '\0';
+		*value = buf;
+		buf = NULL;
+	} else {
+		len = -EAGAIN;
+	}
+	spin_unlock(&ci->m_meta_lock);
+	cifsd_free(buf);
+out:
+	cifsd_inode_put(ci);
+	return len;
+}
+
+/**
+ * cifsd_inode_meta_set() - cache an xattr read from the file system
+ * @inode:	inode of the file
+ * @item:	CIFSD_META_* value read
+ * @stamp:	stamp cifsd_inode_meta_get() returned before the read
+ * @value:	value read
+ * @len:	value length or error of the read
+ */
+void cifsd_inode_meta_set(struct inode *inode, int item, u64 stamp,
+			  const char *value, ssize_t len)
+{
+	struct cifsd_inode *ci;
+	struct cifsd_inode_meta *m;
+	char *buf = NULL;
+
+	if (!stamp || len > CIFSD_META_MAX_LEN ||
+	    (len < 0 && len != -ENODATA) || (len > 0 && !value))
+		return;
+
+	ci = cifsd_inode_lookup_by_vfsinode(inode);
+	if (!ci)
+		return;
+
+	if (len > 0) {
+		buf = kmemdup(value, len, GFP_KERNEL);
+		if (!buf)
+			goto out;
+	}
+
+	m = &ci->m_meta[item];
+	spin_lock(&ci->m_meta_lock);
+	kfree(m->value);
+	m->value = buf;
+	m->len = len;
+	m->ctime = stamp;
+	spin_unlock(&ci->m_meta_lock);
+out:
+	cifsd_inode_put(ci);
+}
+
+/**
+ * cifsd_inode_meta_update() - write an xattr change through to the cache
+ * @inode:	inode of the file
+ * @stamp:	cifsd_inode_meta_stamp() of the inode before the change
+ * @name:	name of the xattr set or removed
+ * @value:	new value of the xattr
+ * @len:	new value length, negative if the xattr was removed
+ *
+ * Values cached at @stamp are moved to the ctime the change left, values
+ * of other stamps went stale before the change and are dropped.
+ */
+void cifsd_inode_meta_update(struct inode *inode, u64 stamp,
+			     const char *name, const void *value,
+			     ssize_t len)
+{
+	struct cifsd_inode *ci;
+	struct cifsd_inode_meta *m;
+	int item = cifsd_inode_meta_item(name);
+	char *buf = NULL;
+	u64 now;
+	int i;
+
+	ci = cifsd_inode_lookup_by_vfsinode(inode);
+	if (!ci)
+		return;
+
+	if (item >= 0 && len > 0 && len <= CIFSD_META_MAX_LEN)
+		buf = kmemdup(value, len, GFP_KERNEL);
+
+	now = cifsd_inode_meta_stamp(inode);
+	spin_lock(&ci->m_meta_lock);
+	for (i = 0; i < CIFSD_META_NR; i++) {
+		m = &ci->m_meta[i];
+		if (m->ctime != stamp)
+			meta_drop(m);
+		else
+			m->ctime = now;
+	}
+
+	/* only setting an xattr already listed keeps the list */
+	m = &ci->m_meta[CIFSD_META_XATTR_LIST];
+	if (len < 0 || !meta_list_has(m, name))
+		meta_drop(m);
+
+	if (item >= 0) {
+		m = &ci->m_meta[item];
+		meta_drop(m);
+		if (len < 0 || buf) {
+			m->value = buf;
+			m->len = len < 0 ? -ENODATA : len;
+			m->ctime = now;
+		}
+	}
+	spin_unlock(&ci->m_meta_lock);
+	cifsd_inode_put(ci);
+}
+
+/*
+ * STREAM buffers
+ *
+ * Alternate data streams live in a single xattr each. Handles on a stream
+ * share a buffer of its contents on the cifsd_inode, reads and writes go
+ * to the buffer and the xattr is written back once at flush or close
+ * rather than on every write.
+ */
+static struct cifsd_stream_buf *cifsd_stream_buf_attach(struct cifsd_file *fp)
+{
+	struct cifsd_inode *ci = fp->f_ci;
+	struct cifsd_stream_buf *sb, *new;
+
+	new = kzalloc(sizeof(struct cifsd_stream_buf), GFP_KERNEL);
+	if (!new)
+		return NULL;
+	new->name = kstrndup(fp->stream.name, fp->stream.size, GFP_KERNEL);
+	if (!new->name) {
+		kfree(new);
+		return NULL;
+	}
+	mutex_init(&new->lock);
+
+	write_lock(&ci->m_lock);
+	/* another request on the handle may have attached it */
+	sb = fp->stream_buf;
+	if (sb)
+		goto out;
+
+	list_for_each_entry(sb, &ci->m_streams, list) {
+		if (strlen(sb->name) == fp->stream.size &&
+		    !strncasecmp(sb->name, fp->stream.name, fp->stream.size)) {
+			sb->refcount++;
+			goto attach;
+		}
+	}
+
+	sb = new;
+	new = NULL;
+	sb->refcount = 1;
+	list_add(&sb->list, &ci->m_streams);
+attach:
+	fp->stream_buf = sb;
+out:
+	write_unlock(&ci->m_lock);
+
+	if (new) {
+		kfree(new->name);
+		kfree(new);
+	}
+	return sb;
+}
+
+/**
+ * cifsd_stream_buf_lock() - lock the stream buffer of a handle
+ * @fp:		handle on an alternate data stream
+ *
+ * The buffer is attached on the first call. It is emptied if the streams
+ * of the file were discarded since it was read, so the caller reads the
+ * stream again when it isn't loaded.
+ *
+ * Return:	locked stream buffer, or NULL if out of memory
+ */
+struct cifsd_stream_buf *cifsd_stream_buf_lock(struct cifsd_file *fp)
+{
+	struct cifsd_stream_buf *sb = READ_ONCE(fp->stream_buf);
+	int gen;
+
+	if (!sb)
+		sb = cifsd_stream_buf_attach(fp);
+	if (!sb)
+		return NULL;
+
+	mutex_lock(&sb->lock);
+	gen = atomic_read(&fp->f_ci->m_stream_gen);
+	if (sb->loaded && sb->gen != gen) {
+		cifsd_free(sb->data);
+		sb->data = NULL;
+		sb->len = sb->alloc = 0;
+		sb->loaded = sb->dirty = false;
+	}
+	sb->gen = gen;
+	return sb;
+}
+
+static int __cifsd_stream_buf_flush(struct cifsd_file *fp,
+				    struct cifsd_stream_buf *sb)
+{
+	int err;
+
+	if (!sb->dirty || sb->gen != atomic_read(&fp->f_ci->m_stream_gen))
+		return 0;
+
+	err = cifsd_vfs_setxattr(fp->filp->f_path.dentry, sb->name,
+				 sb->data, sb->len, 0);
+	if (!err)
+		sb->dirty = false;
+	return err;
+}
+
+/**
+ * cifsd_stream_buf_flush() - write buffered stream contents back
+ * @fp:		handle on an alternate data stream
+ *
+ * Return:	0 on success, otherwise error
+ */
+int cifsd_stream_buf_flush(struct cifsd_file *fp)
+{
+	struct cifsd_stream_buf *sb = READ_ONCE(fp->stream_buf);
+	int err;
+
+	if (!sb)
+		return 0;
+
+	mutex_lock(&sb->lock);
+	err = __cifsd_stream_buf_flush(fp, sb);
+	mutex_unlock(&sb->lock);
+	return err;
+}
+
+static void cifsd_stream_buf_detach(struct cifsd_file *fp)
+{
+	struct cifsd_stream_buf *sb = fp->stream_buf;
+	struct cifsd_inode *ci = fp->f_ci;
+	bool last;
+	int err;
+
+	if (!sb)
+		return;
+
+	err = cifsd_stream_buf_flush(fp);
+	if (err)
+		cifsd_err("write back of stream %s failed, err %d\n",
+			  sb->name, err);
+
+	write_lock(&ci->m_lock);
+	last = !--sb->refcount;
+	if (last)
+		list_del(&sb->list);
+	fp->stream_buf = NULL;
+	write_unlock(&ci->m_lock);
+
+	if (last) {
+		cifsd_free(sb->data);
+		kfree(sb->name);
+		kfree(sb);
+	}
+}
+
+/**
+ * cifsd_stream_bufs_discard() - drop buffered streams of a file
+ * @inode:	inode whose stream xattrs are removed
+ *
+ * Buffers, dirty or not, are emptied on their next use.
+ */
+void cifsd_stream_bufs_discard(struct inode *inode)
+{
+	struct cifsd_inode *ci;
+
+	ci = cifsd_inode_lookup_by_vfsinode(inode);
+	if (!ci)
+		return;
+	atomic_inc(&ci->m_stream_gen);
+	cifsd_inode_put(ci);
+}
+
+/*
+ * Granted byte range locks of an inode are kept in an interval tree, so
+ * the I/O paths find the locks overlapping a range without walking all
+ * locks of the file. Zero length locks are never taken on the vfs and
+ * don't conflict with I/O, they are only kept on the list of the handle.
+ */
+#define BRL_START(lock)		((lock)->fl->fl_start)
+#define BRL_LAST(lock)		((lock)->fl->fl_end)
+
+INTERVAL_TREE_DEFINE(struct cifsd_lock, rb, unsigned long long,
+		     subtree_last, BRL_START, BRL_LAST, static, brl_tree)
+
+/**
+ * cifsd_brl_grant() - account a lock granted on a handle
+ * @fp:		cifsd file pointer the lock was taken on
+ * @lock:	the granted lock
+ */
+void cifsd_brl_grant(struct cifsd_file *fp, struct cifsd_lock *lock)
+{
+	struct cifsd_inode *ci = fp->f_ci;
+
+	write_lock(&ci->m_brl_lock);
+	if (!lock->zero_len) {
+		brl_tree_insert(lock, &ci->m_brl_tree);
+		atomic_inc(&ci->m_brl_nr);
+	}
+	list_add(&lock->clist, &fp->lock_list);
+	write_unlock(&ci->m_brl_lock);
+}
+
+static void __cifsd_brl_release(struct cifsd_inode *ci,
+				struct cifsd_lock *lock)
+{
+	if (list_empty(&lock->clist))
+		return;
+
+	if (!lock->zero_len) {
+		brl_tree_remove(lock, &ci->m_brl_tree);
+		atomic_dec(&ci->m_brl_nr);
+	}
+	list_del_init(&lock->clist);
+}
+
+/**
+ * cifsd_brl_release() - forget a lock of a handle before it is freed
+ * @fp:		cifsd file pointer the lock was taken on
+ * @lock:	the lock, granted or not
+ */
+void cifsd_brl_release(struct cifsd_file *fp, struct cifsd_lock *lock)
+{
+	struct cifsd_inode *ci = fp->f_ci;
+
+	write_lock(&ci->m_brl_lock);
+	__cifsd_brl_release(ci, lock);
+	write_unlock(&ci->m_brl_lock);
+}
+
+/**
+ * cifsd_brl_conflict() - check I/O of a handle against granted locks
+ * @fp:		cifsd file pointer doing the I/O
+ * @start:	first byte of the I/O
+ * @end:	last byte of the I/O
+ * @type:	READ or WRITE
+ *
+ * Shared locks conflict with writes, exclusive locks with any I/O, both
+ * only when taken on another handle.
+ *
+ * Return:	true if a lock conflicts with the I/O
+ */
+bool cifsd_brl_conflict(struct cifsd_file *fp, loff_t start, loff_t end,
+			int type)
+{
+	struct cifsd_inode *ci = fp->f_ci;
+	struct cifsd_lock *lock;
+	bool conflict = false;
+
+	if (!atomic_read(&ci->m_brl_nr))
+		return false;
+
+	read_lock(&ci->m_brl_lock);
+	for (lock = brl_tree_iter_first(&ci->m_brl_tree, start, end); lock;
+	     lock = brl_tree_iter_next(lock, start, end)) {
+		if (lock->fl->fl_file == fp->filp)
+			continue;
+		if (lock->fl->fl_type == F_WRLCK || type == WRITE) {
+			conflict = true;
+			break;
+		}
+	}
+	read_unlock(&ci->m_brl_lock);
+	return conflict;
+}
+
+/* Locks of a closed handle go away with its file */
+static void cifsd_brl_close(struct cifsd_file *fp)
+{
+	struct cifsd_inode *ci = fp->f_ci;
+	struct cifsd_lock *lock, *tmp;
+	LIST_HEAD(dispose);
+
+	if (list_empty_careful(&fp->lock_list))
+		return;
+
+	write_lock(&ci->m_brl_lock);
+	list_for_each_entry_safe(lock, tmp, &fp->lock_list, clist) {
+		__cifsd_brl_release(ci, lock);
+		list_add(&lock->clist, &dispose);
+	}
+	write_unlock(&ci->m_brl_lock);
+
+	spin_lock(&global_lock_list_lock);
+	list_for_each_entry(lock, &dispose, clist)
+		list_del(&lock->glist);
+	spin_unlock(&global_lock_list_lock);
+
+	list_for_each_entry_safe(lock, tmp, &dispose, clist) {
+		locks_free_lock(lock->fl);
+		kfree(lock);
+	}
+}
+
+static bool dir_index_valid(struct cifsd_dir_index *di, struct inode *dir)
+{
+	u64 mtime, ctime;
+
+	if (di->d_sb != dir->i_sb || di->d_ino != dir->i_ino ||
+	    di->d_generation != dir->i_generation)
+		return false;
+
+	dir_stamp(dir, &mtime, &ctime);
+	return di->d_mtime == mtime && di->d_ctime == ctime;
+}
+
+static void cifsd_dir_index_free(struct cifsd_dir_index *di)
+{
+	struct cifsd_dir_chunk *chunk;
+
+	while (di->chunks) {
+		chunk = di->chunks;
+		di->chunks = chunk->next;
+		cifsd_free(chunk);
+	}
+	cifsd_free(di->buckets);
+	kfree(di);
+}
+
+void cifsd_dir_index_put(struct cifsd_dir_index *di)
+{
+	if (di && atomic_dec_and_test(&di->d_count))
+		cifsd_dir_index_free(di);
+}
+
+/*
+ * Called under dir_index_lock, the cache reference of @di is dropped by
+ * dir_index_dispose() once the lock is released.
+ */
+static void __dir_index_unhash(struct cifsd_dir_index *di,
+			       struct list_head *dispose)
+{
+	hlist_del_init(&di->d_hash);
+	list_move(&di->d_lru, dispose);
+	dir_index_nr_names -= di->nr_names;
+}
+
+static void dir_index_dispose(struct list_head *dispose)
+{
+	struct cifsd_dir_index *di;
+
+	while (!list_empty(dispose)) {
+		di = list_first_entry(dispose, struct cifsd_dir_index, d_lru);
+		list_del_init(&di->d_lru);
+		cifsd_dir_index_put(di);
+	}
+}
+
+/**
+ * cifsd_dir_index_get() - get the valid caseless index of a directory
+ * @dir:	directory inode
+ *
+ * Return:	index to be released by cifsd_dir_index_put(), or NULL
+ */
+struct cifsd_dir_index *cifsd_dir_index_get(struct inode *dir)
+{
+	struct hlist_head *head = dir_index_hashtable +
+		inode_hash(dir->i_sb, dir->i_ino);
+	struct cifsd_dir_index *di, *ret = NULL;
+	LIST_HEAD(dispose);
+
+	spin_lock(&dir_index_lock);
+	hlist_for_each_entry(di, head, d_hash) {
+		if (di->d_sb != dir->i_sb || di->d_ino != dir->i_ino)
+			continue;
+
+		if (dir_index_valid(di, dir)) {
+			list_move(&di->d_lru, &dir_index_lru);
+			atomic_inc(&di->d_count);
+			ret = di;
+		} else {
+			__dir_index_unhash(di, &dispose);
+		}
+		break;
+	}
+	spin_unlock(&dir_index_lock);
+	dir_index_dispose(&dispose);
+	return ret;
+}
+
+/**
+ * cifsd_dir_index_alloc() - start a caseless index of a directory
+ * @dir:	directory inode, to be read with cifsd_dir_index_add()
+ *
+ * Return:	new index, or NULL if indexes are disabled or out of memory
+ */
+struct cifsd_dir_index *cifsd_dir_index_alloc(struct inode *dir)
+{
+	struct cifsd_dir_index *di;
+
+	if (!READ_ONCE(caseless_index_max_names))
+		return NULL;
+
+	di = kzalloc(sizeof(struct cifsd_dir_index), GFP_KERNEL);
+	if (!di)
+		return NULL;
+
+	INIT_HLIST_NODE(&di->d_hash);
+	INIT_LIST_HEAD(&di->d_lru);
+	atomic_set(&di->d_count, 1);
+	di->d_sb = dir->i_sb;
+	di->d_ino = dir->i_ino;
+	di->d_generation = dir->i_generation;
+	/* stamped before reading, a change while reading invalidates it */
+	dir_stamp(dir, &di->d_mtime, &di->d_ctime);
+	return di;
+}
+
+/**
+ * cifsd_dir_index_add() - add a directory entry name to an index
+ * @di:		index being built
+ * @name:	name of the entry
+ * @len:	length of @name
+ *
+ * Return:	0 on success, otherwise -ENOMEM or -E2BIG
+ */
+int cifsd_dir_index_add(struct cifsd_dir_index *di, const char *name,
+			unsigned int len)
+{
+	struct cifsd_dir_chunk *chunk = di->chunks;
+	struct cifsd_dir_name *dn;
+	size_t sz = ALIGN(sizeof(struct cifsd_dir_name) + len, sizeof(void *));
+
+	if (di->nr_names >= READ_ONCE(caseless_index_max_names))
+		return -E2BIG;
+
+	if (!chunk || chunk->used + sz > CIFSD_DIR_CHUNK_SIZE -
+	    sizeof(struct cifsd_dir_chunk)) {
+		chunk = cifsd_alloc(CIFSD_DIR_CHUNK_SIZE);
+		if (!chunk)
+			return -ENOMEM;
+		chunk->next = di->chunks;
+		di->chunks = chunk;
+	}
+
+	dn = (struct cifsd_dir_name *)(chunk->data + chunk->used);
+	dn->hash = dir_name_hash(name, len);
+	dn->len = len;
+	memcpy(dn->name, name, len);
+	chunk->used += sz;
+	di->nr_names++;
+	return 0;
+}
+
+/**
+ * cifsd_dir_index_publish() - hash a fully built index into the cache
+ * @di:		index whose directory was read without error
+ * @dir:	directory inode
+ *
+ * The index isn't cached if its directory is being changed or if it
+ * would take more than half of caseless_index_max_names.
+ */
+void cifsd_dir_index_publish(struct cifsd_dir_index *di, struct inode *dir)
+{
+	struct cifsd_dir_chunk *chunk;
+	struct cifsd_dir_name *dn;
+	struct cifsd_dir_index *old;
+	struct hlist_head *head;
+	unsigned int off, b;
+	unsigned int max_names = READ_ONCE(caseless_index_max_names);
+	LIST_HEAD(dispose);
+
+	di->nr_buckets = roundup_pow_of_two(max(di->nr_names, 16U));
+	di->buckets = cifsd_alloc(di->nr_buckets * sizeof(*di->buckets));
+	if (!di->buckets)
+		return;
+
+	for (chunk = di->chunks; chunk; chunk = chunk->next) {
+		for (off = 0; off < chunk->used;
+		     off += ALIGN(sizeof(*dn) + dn->len, sizeof(void *))) {
+			dn = (struct cifsd_dir_name *)(chunk->data + off);
+			b = dn->hash & (di->nr_buckets - 1);
+			dn->next = di->buckets[b];
+			di->buckets[b] = dn;
+		}
+	}
+
+	if (dir_stamp_fresh(di->d_mtime, di->d_ctime) ||
+	    di->nr_names > max_names / 2)
+		return;
+
+	head = dir_index_hashtable + inode_hash(dir->i_sb, dir->i_ino);
+	spin_lock(&dir_index_lock);
+	hlist_for_each_entry(old, head, d_hash) {
+		if (old->d_sb == di->d_sb && old->d_ino == di->d_ino) {
+			__dir_index_unhash(old, &dispose);
+			break;
+		}
+	}
+
+	while (dir_index_nr_names + di->nr_names > max_names &&
+	       !list_empty(&dir_index_lru)) {
+		old = list_last_entry(&dir_index_lru, struct cifsd_dir_index,
+				      d_lru);
+		__dir_index_unhash(old, &dispose);
+	}
+
+	atomic_inc(&di->d_count);
+	hlist_add_head(&di->d_hash, head);
+	list_add(&di->d_lru, &dir_index_lru);
+	dir_index_nr_names += di->nr_names;
+	spin_unlock(&dir_index_lock);
+	dir_index_dispose(&dispose);
+}
+
+/**
+ * cifsd_dir_index_find() - caseless lookup of a name in an index
+ * @di:		published index
+ * @name:	name to look up
+ * @len:	length of @name
+ *
+ * Return:	name of the directory entry, as stored on disk, or NULL
+ */
+const char *cifsd_dir_index_find(struct cifsd_dir_index *di,
+				 const char *name, unsigned int len)
+{
+	unsigned int hash = dir_name_hash(name, len);
+	struct cifsd_dir_name *dn;
+
+	for (dn = di->buckets[hash & (di->nr_buckets - 1)]; dn;
+	     dn = dn->next) {
+		if (dn->hash == hash && dn->len == len &&
+		    !strncasecmp(dn->name, name, len))
+			return dn->name;
+	}
+	return NULL;
+}
+
+static void cifsd_dir_index_purge(void)
+{
+	struct cifsd_dir_index *di;
+	LIST_HEAD(dispose);
+
+	spin_lock(&dir_index_lock);
+	while (!list_empty(&dir_index_lru)) {
+		di = list_first_entry(&dir_index_lru, struct cifsd_dir_index,
+				      d_lru);
+		__dir_index_unhash(di, &dispose);
+	}
+	spin_unlock(&dir_index_lock);
+	dir_index_dispose(&dispose);
+}
+
+/*
+ * Enumeration cache of a directory
+ *
+ * QUERY_DIRECTORY used to look up, stat and read the xattrs of each entry
+ * by its full path. The enumeration cache reads the directory a page of
+ * entries at a time, looks up the entries of a page relative to the
+ * directory under one lock of it and keeps their dentries, create time
+ * and attributes. It hangs off the cifsd_inode of the directory, so every
+ * handle which starts enumerating the unchanged directory shares it, and
+ * goes away with the last handle. Stat information is taken from the live
+ * inode when an entry is returned, the xattrs are read again only when
+ * the ctime of the entry changed.
+ */
+
+#define CIFSD_DIR_ENUM_BLOCK	256
+
+static unsigned int readdir_cache_max_entries = 65536;
+module_param(readdir_cache_max_entries, uint, 0644);
+MODULE_PARM_DESC(readdir_cache_max_entries,
+	"Entries kept in the enumeration cache of a directory, 0 to disable. Default: 65536");
+
+struct cifsd_dir_enum_entry {
+	/* NULL for a symlink, which is looked up again to be followed */
+	struct dentry			*dentry;
+	char				*name;
+	u64				create_time;
+	/* ctime of the entry when create_time and attributes were read */
+	u64				ctime;
+	__le32				file_attributes;
+};
+
+struct cifsd_dir_enum {
+	atomic_t			de_count;
+	struct mutex			de_mutex;
+	struct path			de_path;
+	u64				de_mtime;
+	u64				de_ctime;
+	bool				de_dos_attrs;
+	/* reader of the directory, NULL once all of it is cached */
+	struct file			*de_filp;
+	struct cifsd_readdir_data	de_rdata;
+	/* directory offset of the first entry that didn't fit the cache */
+	loff_t				de_resume;
+	bool				de_overflow;
+	unsigned int			nr_entries;
+	unsigned int			nr_blocks;
+	struct cifsd_dir_enum_entry	**blocks;
+};
+
+static struct cifsd_dir_enum_entry *dir_enum_entry(struct cifsd_dir_enum *de,
+						   unsigned int pos)
+{
+	return &de->blocks[pos / CIFSD_DIR_ENUM_BLOCK][pos %
+		CIFSD_DIR_ENUM_BLOCK];
+}
+
+static void dir_enum_close_reader(struct cifsd_dir_enum *de)
+{
+	if (de->de_filp) {
+		fput(de->de_filp);
+		de->de_filp = NULL;
+	}
+	if (de->de_rdata.dirent) {
+		free_page((unsigned long)de->de_rdata.dirent);
+		de->de_rdata.dirent = NULL;
+	}
+}
+
+static void cifsd_dir_enum_put(struct cifsd_dir_enum *de)
+{
+	struct cifsd_dir_enum_entry *e;
+	unsigned int i;
+
+	if (!de || !atomic_dec_and_test(&de->de_count))
+		return;
+
+	for (i = 0; i < de->nr_entries; i++) {
+		e = dir_enum_entry(de, i);
+		if (e->dentry)
+			dput(e->dentry);
+		kfree(e->name);
+	}
+	for (i = 0; i < de->nr_blocks; i++)
+		cifsd_free(de->blocks[i]);
+	kfree(de->blocks);
+	dir_enum_close_reader(de);
+	path_put(&de->de_path);
+	kfree(de);
+}
+
+static struct cifsd_dir_enum *dir_enum_alloc(struct cifsd_file *dir_fp,
+					     bool dos_attrs)
+{
+	struct cifsd_dir_enum *de;
+
+	de = kzalloc(sizeof(struct cifsd_dir_enum), GFP_KERNEL);
+	if (!de)
+		return NULL;
+
+	de->de_rdata.ctx.actor = cifsd_fill_dirent;
+	de->de_rdata.dirent = (void *)__get_free_page(GFP_KERNEL);
+	if (!de->de_rdata.dirent) {
+		kfree(de);
+		return NULL;
+	}
+
+	de->de_path = dir_fp->filp->f_path;
+	path_get(&de->de_path);
+	/* stamped before reading, a change while reading invalidates it */
+	dir_stamp(FP_INODE(dir_fp), &de->de_mtime, &de->de_ctime);
+	de->de_filp = dentry_open(&de->de_path, O_RDONLY | O_LARGEFILE,
+				  current_cred());
+	if (IS_ERR(de->de_filp)) {
+		de->de_filp = NULL;
+		dir_enum_close_reader(de);
+		path_put(&de->de_path);
+		kfree(de);
+		return NULL;
+	}
+
+	atomic_set(&de->de_count, 1);
+	mutex_init(&de->de_mutex);
+	de->de_dos_attrs = dos_attrs;
+	return de;
+}
+
+static int dir_enum_grow(struct cifsd_dir_enum *de)
+{
+	struct cifsd_dir_enum_entry **blocks;
+
+	if (de->nr_entries < de->nr_blocks * CIFSD_DIR_ENUM_BLOCK)
+		return 0;
+
+	blocks = krealloc(de->blocks, (de->nr_blocks + 1) * sizeof(*blocks),
+			  GFP_KERNEL);
+	if (!blocks)
+		return -ENOMEM;
+	de->blocks = blocks;
+
+	blocks[de->nr_blocks] = cifsd_alloc(CIFSD_DIR_ENUM_BLOCK *
+					    sizeof(struct cifsd_dir_enum_entry));
+	if (!blocks[de->nr_blocks])
+		return -ENOMEM;
+	de->nr_blocks++;
+	return 0;
+}
+
+static void dir_enum_fill_entry(struct cifsd_work *work,
+				struct cifsd_dir_enum *de,
+				struct cifsd_dir_enum_entry *e)
+{
+	struct path path = { .mnt = de->de_path.mnt, .dentry = e->dentry };
+	struct kstat kstat;
+	struct cifsd_kstat cifsd_kstat = { .kstat = &kstat };
+
+	cifsd_vfs_fill_dentry_attrs(work, &path, &cifsd_kstat);
+	e->create_time = cifsd_kstat.create_time;
+	e->file_attributes = cifsd_kstat.file_attributes;
+	e->ctime = cifs_UnixTimeToNT(from_kern_timespec(kstat.ctime));
+}
+
+/*
+ * Cache the next page of entries of the directory, called under
+ * de_mutex. The entries of the page are looked up under one lock of the
+ * directory, their create time and attributes are read after it.
+ */
+static int dir_enum_fill(struct cifsd_work *work, struct cifsd_dir_enum *de)
+{
+	struct dentry *dir = de->de_path.dentry;
+	struct cifsd_readdir_data *rdata = &de->de_rdata;
+	struct cifsd_dir_enum_entry *e;
+	struct cifsd_dirent *dirent;
+	struct dentry *dentry;
+	unsigned int first = de->nr_entries, i, off, max_entries;
+	int rc;
+
+	rdata->used = 0;
+	rdata->full = 0;
+	rc = cifsd_vfs_readdir(de->de_filp, rdata);
+	if (rc < 0)
+		return rc;
+	if (!rdata->used) {
+		dir_enum_close_reader(de);
+		return 0;
+	}
+
+	max_entries = READ_ONCE(readdir_cache_max_entries);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 2, 0)
+	inode_lock(dir->d_inode);
+#else
+	mutex_lock(&dir->d_inode->i_mutex);
+#endif
+	for (off = 0; off < rdata->used; off += ALIGN(sizeof(*dirent) +
+	     dirent->namelen, sizeof(__le64))) {
+		dirent = (struct cifsd_dirent *)(rdata->dirent + off);
+		if (de->nr_entries >= max_entries || dir_enum_grow(de)) {
+			de->de_resume = dirent->offset;
+			de->de_overflow = true;
+			break;
+		}
+
+		if ((dirent->namelen == 1 && dirent->name[0] == '.') ||
+		    (dirent->namelen == 2 && dirent->name[0] == '.' &&
+		     dirent->name[1] == '.'))
+			continue;
+
+		dentry = lookup_one_len(dirent->name, dir, dirent->namelen);
+		if (IS_ERR(dentry))
+			continue;
+		if (!dentry->d_inode) {
+			dput(dentry);
+			continue;
+		}
+
+		e = dir_enum_entry(de, de->nr_entries);
+		e->name = kstrndup(dirent->name, dirent->namelen, GFP_KERNEL);
+		if (!e->name) {
+			dput(dentry);
+			continue;
+		}
+		if (S_ISLNK(dentry->d_inode->i_mode)) {
+			dput(dentry);
+			dentry = NULL;
+		}
+		e->dentry = dentry;
+		de->nr_entries++;
+	}
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 2, 0)
+	inode_unlock(dir->d_inode);
+#else
+	mutex_unlock(&dir->d_inode->i_mutex);
+#endif
+
+	for (i = first; i < de->nr_entries; i++) {
+		e = dir_enum_entry(de, i);
+		if (e->dentry)
+			dir_enum_fill_entry(work, de, e);
+	}
+
+	if (de->de_overflow)
+		dir_enum_close_reader(de);
+	return 0;
+}
+
+/**
+ * cifsd_dir_enum_attach() - start enumerating a directory from its cache
+ * @work:	smb work containing share config
+ * @dir_fp:	directory handle at the start of the directory
+ *
+ * Return:	0 on success, otherwise error and @dir_fp reads the directory
+ *		itself
+ */
+int cifsd_dir_enum_attach(struct cifsd_work *work, struct cifsd_file *dir_fp)
+{
+	struct cifsd_inode *ci = dir_fp->f_ci;
+	struct cifsd_dir_enum *de, *old = NULL;
+	bool dos_attrs;
+	u64 mtime, ctime;
+
+	if (!READ_ONCE(readdir_cache_max_entries) || !ci)
+		return -EOPNOTSUPP;
+
+	dos_attrs = test_share_config_flag(work->tcon->share_conf,
+					   CIFSD_SHARE_FLAG_STORE_DOS_ATTRS);
+	dir_stamp(FP_INODE(dir_fp), &mtime, &ctime);
+
+	read_lock(&ci->m_lock);
+	de = ci->m_dir_enum;
+	if (de && de->de_dos_attrs == dos_attrs &&
+	    de->de_mtime == mtime && de->de_ctime == ctime)
+		atomic_inc(&de->de_count);
+	else
+		de = NULL;
+	read_unlock(&ci->m_lock);
+
+	if (!de) {
+		de = dir_enum_alloc(dir_fp, dos_attrs);
+		if (!de)
+			return -ENOMEM;
+
+		/* only an enumeration of a settled directory is shared */
+		if (!dir_stamp_fresh(de->de_mtime, de->de_ctime)) {
+			atomic_inc(&de->de_count);
+			write_lock(&ci->m_lock);
+			old = ci->m_dir_enum;
+			ci->m_dir_enum = de;
+			write_unlock(&ci->m_lock);
+			cifsd_dir_enum_put(old);
+		}
+	}
+
+	dir_fp->dir_enum = de;
+	dir_fp->dir_enum_pos = 0;
+	return 0;
+}
+
+/**
+ * cifsd_dir_enum_detach() - stop enumerating a directory from its cache
+ * @dir_fp:	directory handle
+ */
+void cifsd_dir_enum_detach(struct cifsd_file *dir_fp)
+{
+	cifsd_dir_enum_put(dir_fp->dir_enum);
+	dir_fp->dir_enum = NULL;
+	dir_fp->dir_enum_pos = 0;
+}
+
+/**
+ * cifsd_dir_enum_next() - get the next entry of a cached enumeration
+ * @work:	smb work containing share config
+ * @dir_fp:	directory handle attached to an enumeration cache
+ * @cifsd_kstat:	filled with the stat information of the entry
+ * @name:	set to the allocated name of the entry
+ *
+ * Return:	0 on success, -ENODATA at the end of the directory, or
+ *		-EOVERFLOW once the entries past the cache are to be read by
+ *		@dir_fp itself, which is then detached and positioned at them
+ */
+int cifsd_dir_enum_next(struct cifsd_work *work, struct cifsd_file *dir_fp,
+			struct cifsd_kstat *cifsd_kstat, char **name)
+{
+	struct cifsd_dir_enum *de = dir_fp->dir_enum;
+	struct cifsd_dir_enum_entry *e;
+	struct path path;
+	u64 ctime;
+	int rc = 0;
+
+	mutex_lock(&de->de_mutex);
+	while (dir_fp->dir_enum_pos >= de->nr_entries && de->de_filp) {
+		rc = dir_enum_fill(work, de);
+		if (rc < 0)
+			break;
+	}
+	if (!rc && dir_fp->dir_enum_pos >= de->nr_entries)
+		rc = de->de_overflow ? -EOVERFLOW : -ENODATA;
+	if (rc) {
+		mutex_unlock(&de->de_mutex);
+		if (rc == -EOVERFLOW) {
+			generic_file_llseek(dir_fp->filp, de->de_resume,
+					    SEEK_SET);
+			cifsd_dir_enum_detach(dir_fp);
+		}
+		return rc;
+	}
+	e = dir_enum_entry(de, dir_fp->dir_enum_pos++);
+	mutex_unlock(&de->de_mutex);
 
-	if (cifsd_stream_fd(fp)) {
-		ci->stream_name = kmalloc(fp->stream.size + 1, GFP_KERNEL);
-		if (!ci->stream_name)
-			return -ENOMEM;
-		strncpy(ci->stream_name, fp->stream.name, fp->stream.size);
+	*name = kstrdup(e->name, GFP_KERNEL);
+	if (!*name)
+		return -ENOMEM;
+
+	if (!e->dentry) {
+		rc = vfs_path_lookup(de->de_path.dentry, de->de_path.mnt,
+				     e->name, LOOKUP_FOLLOW, &path);
+		if (rc) {
+			kfree(*name);
+			*name = NULL;
+			return rc;
+		}
+		cifsd_vfs_fill_dentry_attrs(work, &path, cifsd_kstat);
+		path_put(&path);
+		return 0;
 	}
 
+	generic_fillattr(e->dentry->d_inode, cifsd_kstat->kstat);
+	ctime = cifs_UnixTimeToNT(from_kern_timespec(cifsd_kstat->kstat->ctime));
+
+	mutex_lock(&de->de_mutex);
+	if (e->ctime != ctime)
+		dir_enum_fill_entry(work, de, e);
+	cifsd_kstat->create_time = e->create_time;
+	cifsd_kstat->file_attributes = e->file_attributes;
+	mutex_unlock(&de->de_mutex);
 	return 0;
 }
 
-static struct cifsd_inode *cifsd_inode_get(struct cifsd_file *fp)
+/**
+ * cifsd_dir_read_entry() - get the next entry of a directory handle
+ * @work:	smb work containing share config
+ * @dir_fp:	directory handle
+ * @dirpath:	path of the directory
+ * @cifsd_kstat:	filled with the stat information of the entry
+ * @name:	set to the allocated name of the entry, or NULL for an entry
+ *		which can't be read and is skipped
+ * @reclen:	set to the dirent size of an entry of the page read ahead
+ *		on @dir_fp, or 0 for an entry of the enumeration cache
+ *
+ * Entries come from the enumeration cache @dir_fp is attached to, then
+ * from the page of dirents @dir_fp reads itself, which is allocated on
+ * first use. SMB1 and SMB2 directory queries enumerate through this.
+ *
+ * Return:	0 on success, -ENODATA at the end of the directory, otherwise
+ *		error
+ */
+int cifsd_dir_read_entry(struct cifsd_work *work, struct cifsd_file *dir_fp,
+			 char *dirpath, struct cifsd_kstat *cifsd_kstat,
+			 char **name, int *reclen)
 {
-	struct cifsd_inode *ci, *tmpci;
+	struct cifsd_readdir_data *rdata = &dir_fp->readdir_data;
+	struct cifsd_readdir_data r_data = {
+		.ctx.actor = cifsd_fill_dirent,
+	};
+	struct cifsd_dirent *de;
 	int rc;
 
-	read_lock(&inode_hash_lock);
-	ci = cifsd_inode_lookup(fp);
-	read_unlock(&inode_hash_lock);
-	if (ci)
-		return ci;
+	*name = NULL;
+	*reclen = 0;
+	if (dir_fp->dir_enum) {
+		rc = cifsd_dir_enum_next(work, dir_fp, cifsd_kstat, name);
+		if (rc == -ENODATA || rc == -ENOMEM)
+			return rc;
+		if (rc && rc != -EOVERFLOW)
+			cifsd_debug("Can't read cached dirent: %d\n", rc);
+		if (rc != -EOVERFLOW)
+			return 0;
+
+		/* past the cache, the handle reads the rest itself */
+		rdata->used = 0;
+		dir_fp->dirent_offset = 0;
+	}
 
-	ci = kmalloc(sizeof(struct cifsd_inode), GFP_KERNEL);
-	if (!ci)
-		return NULL;
+	if (!rdata->dirent || dir_fp->dirent_offset >= rdata->used) {
+		if (!rdata->dirent) {
+			rdata->dirent = (void *)__get_free_page(GFP_KERNEL);
+			if (!rdata->dirent)
+				return -ENOMEM;
+		}
 
-	rc = cifsd_inode_init(ci, fp);
-	if (rc) {
-		cifsd_err("inode initialized failed\n");
-		kfree(ci);
-		return NULL;
-	}
+		r_data.dirent = rdata->dirent;
+		rc = cifsd_vfs_readdir(dir_fp->filp, &r_data);
+		if (rc < 0) {
+			cifsd_debug("err : %d\n", rc);
+			return rc;
+		}
 
-	write_lock(&inode_hash_lock);
-	tmpci = cifsd_inode_lookup(fp);
-	if (!tmpci) {
-		cifsd_inode_hash(ci);
-	} else {
-		kfree(ci);
-		ci = tmpci;
+		rdata->used = r_data.used;
+		rdata->full = r_data.full;
+		dir_fp->dirent_offset = 0;
+		if (!rdata->used) {
+			free_page((unsigned long)rdata->dirent);
+			rdata->dirent = NULL;
+			return -ENODATA;
+		}
 	}
-	write_unlock(&inode_hash_lock);
-	return ci;
-}
 
-static void cifsd_inode_free(struct cifsd_inode *ci)
-{
-	cifsd_inode_unhash(ci);
-	kfree(ci->stream_name);
-	kfree(ci);
+	de = (struct cifsd_dirent *)(rdata->dirent + dir_fp->dirent_offset);
+	*reclen = ALIGN(sizeof(struct cifsd_dirent) + de->namelen,
+			sizeof(__le64));
+	dir_fp->dirent_offset += *reclen;
+
+	*name = cifsd_vfs_readdir_name(work, cifsd_kstat, de, dirpath);
+	if (IS_ERR(*name)) {
+		cifsd_debug("Can't read dirent: %d\n", (int)PTR_ERR(*name));
+		*name = NULL;
+	}
+	return 0;
 }
 
-static void cifsd_inode_put(struct cifsd_inode *ci)
+/**
+ * cifsd_dir_unread_entry() - give back the last entry of a directory handle
+ * @dir_fp:	directory handle
+ * @reclen:	dirent size returned by cifsd_dir_read_entry() for the entry
+ *
+ * The entry is returned again by the next cifsd_dir_read_entry(), e.g.
+ * when it didn't fit in the response.
+ */
+void cifsd_dir_unread_entry(struct cifsd_file *dir_fp, int reclen)
 {
-	if (atomic_dec_and_test(&ci->m_count))
-		cifsd_inode_free(ci);
+	if (!reclen)
+		dir_fp->dir_enum_pos--;
+	else
+		dir_fp->dirent_offset -= reclen;
 }
 
-int __init cifsd_inode_hash_init(void)
+/**
+ * cifsd_dir_release_page() - free the dirents read ahead on a handle
+ * @dir_fp:	directory handle
+ *
+ * The page of dirents is kept on the handle for the entries which didn't
+ * fit in the response. It's freed once all of them were returned, and
+ * under memory pressure before that, after the directory is seeked back
+ * to the first entry not returned yet.
+ */
+void cifsd_dir_release_page(struct cifsd_file *dir_fp)
 {
-	unsigned int loop;
-	unsigned long numentries = 16384;
-	unsigned long bucketsize = sizeof(struct hlist_head);
-	unsigned long size;
-
-	inode_hash_shift = ilog2(numentries);
-	inode_hash_mask = (1 << inode_hash_shift) - 1;
+	struct cifsd_readdir_data *rdata = &dir_fp->readdir_data;
+	struct cifsd_dirent *de;
 
-	size = bucketsize << inode_hash_shift;
+	if (!rdata->dirent)
+		return;
 
-	/* init master fp hash table */
-	inode_hashtable = __vmalloc(size, GFP_ATOMIC, PAGE_KERNEL);
-	if (!inode_hashtable)
-		return -ENOMEM;
+	if (dir_fp->dirent_offset < rdata->used) {
+		if (!cifsd_buffer_pool_pressure())
+			return;
 
-	for (loop = 0; loop < (1U << inode_hash_shift); loop++)
-		INIT_HLIST_HEAD(&inode_hashtable[loop]);
-	return 0;
-}
+		de = (struct cifsd_dirent *)(rdata->dirent +
+					     dir_fp->dirent_offset);
+		if (generic_file_llseek(dir_fp->filp, de->offset,
+					SEEK_SET) < 0)
+			return;
+	}
 
-void __exit cifsd_release_inode_hash(void)
-{
-	vfree(inode_hashtable);
+	free_page((unsigned long)rdata->dirent);
+	rdata->dirent = NULL;
+	rdata->used = 0;
+	rdata->full = 0;
+	dir_fp->dirent_offset = 0;
 }
 
 /*
@@ -344,22 +1855,364 @@ static void __cifsd_remove_durable_fd(struct cifsd_file *fp)
 
 	write_lock(&global_ft.lock);
 	idr_remove(global_ft.idr, fp->persistent_id);
+	hash_del(&fp->cguid_hlist);
+	hash_del(&fp->app_id_hlist);
 	write_unlock(&global_ft.lock);
 }
 
-static void __cifsd_remove_fd(struct cifsd_file_table *ft,
+/* Return:	false if the handle was already closed by someone else */
+static bool __cifsd_remove_fd(struct cifsd_file_table *ft,
 			      struct cifsd_file *fp)
 {
-	if (!HAS_FILE_ID(fp->volatile_id))
-		return;
+	bool removed;
 
-	write_lock(&fp->f_ci->m_lock);
-	list_del_init(&fp->node);
-	write_unlock(&fp->f_ci->m_lock);
+	if (!HAS_FILE_ID(fp->volatile_id))
+		return true;
 
 	write_lock(&ft->lock);
-	idr_remove(ft->idr, fp->volatile_id);
+	removed = idr_find(ft->idr, fp->volatile_id) == fp;
+	if (removed)
+		idr_remove(ft->idr, fp->volatile_id);
 	write_unlock(&ft->lock);
+
+	if (removed) {
+		write_lock(&fp->f_ci->m_lock);
+		list_del_init(&fp->node);
+		write_unlock(&fp->f_ci->m_lock);
+	}
+	return removed;
+}
+
+/*
+ * Deferred close
+ *
+ * Clients open, query and close the same files over and over. The file
+ * of a closed handle is kept open for a while, so that the next CREATE
+ * of the same tree connect with the same access doesn't have to open it
+ * again. Kept files hold no handle, oplock or byte range lock, so
+ * sharing modes and delete on close of other opens see them as closed.
+ */
+static unsigned int deferred_close_ms = 1000;
+module_param(deferred_close_ms, uint, 0644);
+MODULE_PARM_DESC(deferred_close_ms,
+	"Milliseconds the file of a closed handle is kept for reopening, 0 to disable. Default: 1000");
+
+static unsigned int deferred_close_max = 256;
+module_param(deferred_close_max, uint, 0644);
+MODULE_PARM_DESC(deferred_close_max,
+	"Files of closed handles kept for reopening. Default: 256");
+
+/* Open flags which stick to the file, a kept file has to match them */
+#define DEFERRED_CLOSE_FLAGS	(O_ACCMODE | O_APPEND | O_DIRECT | O_SYNC)
+
+struct cifsd_deferred_close {
+	struct list_head		list;
+	struct cifsd_tree_connect	*tcon;
+	struct file			*filp;
+	unsigned long			expires;
+};
+
+static void deferred_close_reap(struct work_struct *wk);
+
+static DEFINE_SPINLOCK(deferred_close_lock);
+/* oldest first */
+static LIST_HEAD(deferred_close_list);
+static unsigned int deferred_close_nr;
+static DECLARE_DELAYED_WORK(deferred_close_work, deferred_close_reap);
+
+static void deferred_close_dispose(struct list_head *dispose)
+{
+	struct cifsd_deferred_close *dc;
+
+	while (!list_empty(dispose)) {
+		dc = list_first_entry(dispose, struct cifsd_deferred_close,
+				      list);
+		list_del(&dc->list);
+		filp_close(dc->filp, (struct files_struct *)dc->filp);
+		kfree(dc);
+	}
+}
+
+static void deferred_close_reap(struct work_struct *wk)
+{
+	struct cifsd_deferred_close *dc, *tmp;
+	LIST_HEAD(dispose);
+
+	spin_lock(&deferred_close_lock);
+	list_for_each_entry_safe(dc, tmp, &deferred_close_list, list) {
+		if (time_before(jiffies, dc->expires)) {
+			schedule_delayed_work(&deferred_close_work,
+					      dc->expires - jiffies);
+			break;
+		}
+		list_move_tail(&dc->list, &dispose);
+		deferred_close_nr--;
+	}
+	spin_unlock(&deferred_close_lock);
+
+	deferred_close_dispose(&dispose);
+}
+
+static bool fd_deferrable(struct cifsd_file *fp)
+{
+	bool ret;
+
+	if (!READ_ONCE(deferred_close_ms) || !READ_ONCE(deferred_close_max))
+		return false;
+	/* don't keep files the shrinker would close right away */
+	if (cifsd_buffer_pool_pressure())
+		return false;
+	if (IS_ERR_OR_NULL(fp->filp) || !fp->tcon || cifsd_stream_fd(fp))
+		return false;
+	if (!S_ISREG(file_inode(fp->filp)->i_mode))
+		return false;
+	if (fp->delete_on_close || fp->is_durable || fp->is_resilient ||
+	    fp->is_persistent)
+		return false;
+	/* vfs locks of the file are only dropped by closing it */
+	if (!list_empty_careful(&fp->lock_list))
+		return false;
+	/* cifsd_vfs_set_fadvise() changes of the file stick to it */
+	if (fp->coption & (FILE_WRITE_THROUGH_LE | FILE_SEQUENTIAL_ONLY_LE |
+			   FILE_RANDOM_ACCESS_LE))
+		return false;
+
+	read_lock(&fp->f_ci->m_lock);
+	ret = !(fp->f_ci->m_flags & (S_DEL_ON_CLS | S_DEL_PENDING));
+	read_unlock(&fp->f_ci->m_lock);
+	return ret;
+}
+
+static bool deferred_close_add(struct cifsd_tree_connect *tcon,
+			       struct file *filp)
+{
+	struct cifsd_deferred_close *dc;
+	LIST_HEAD(dispose);
+
+	if (d_unhashed(filp->f_path.dentry))
+		return false;
+
+	dc = kmalloc(sizeof(struct cifsd_deferred_close), GFP_KERNEL);
+	if (!dc)
+		return false;
+
+	/* byte range locks are owned by the file, see smb2_lock() */
+	locks_remove_posix(filp, filp);
+
+	dc->tcon = tcon;
+	dc->filp = filp;
+	dc->expires = jiffies + msecs_to_jiffies(READ_ONCE(deferred_close_ms));
+
+	spin_lock(&deferred_close_lock);
+	if (list_empty(&deferred_close_list))
+		schedule_delayed_work(&deferred_close_work,
+				      dc->expires - jiffies);
+	list_add_tail(&dc->list, &deferred_close_list);
+	deferred_close_nr++;
+	while (deferred_close_nr > READ_ONCE(deferred_close_max)) {
+		list_move_tail(deferred_close_list.next, &dispose);
+		deferred_close_nr--;
+	}
+	spin_unlock(&deferred_close_lock);
+
+	deferred_close_dispose(&dispose);
+	return true;
+}
+
+/**
+ * cifsd_deferred_close_reuse() - take a kept file for an open
+ * @tcon:	tree connect of the open
+ * @path:	path being opened
+ * @open_flags:	unix open flags of the open
+ *
+ * Return:	file of a closed handle on @path opened with the same access
+ *		and DEFERRED_CLOSE_FLAGS, or NULL if the file has to be opened
+ */
+struct file *cifsd_deferred_close_reuse(struct cifsd_tree_connect *tcon,
+					struct path *path, int open_flags)
+{
+	struct cifsd_deferred_close *dc, *found = NULL;
+	struct file *filp = NULL;
+
+	if (open_flags & (O_CREAT | O_TRUNC))
+		return NULL;
+
+	spin_lock(&deferred_close_lock);
+	list_for_each_entry_reverse(dc, &deferred_close_list, list) {
+		if (dc->tcon != tcon ||
+		    dc->filp->f_path.dentry != path->dentry ||
+		    dc->filp->f_path.mnt != path->mnt ||
+		    (dc->filp->f_flags & DEFERRED_CLOSE_FLAGS) !=
+		    (open_flags & DEFERRED_CLOSE_FLAGS))
+			continue;
+
+		list_del(&dc->list);
+		deferred_close_nr--;
+		found = dc;
+		break;
+	}
+	spin_unlock(&deferred_close_lock);
+
+	if (found) {
+		filp = found->filp;
+		kfree(found);
+	}
+	return filp;
+}
+
+/**
+ * cifsd_deferred_close_flush() - close kept files of a tree connect
+ * @tcon:	tree connect going away, or NULL for all kept files
+ */
+void cifsd_deferred_close_flush(struct cifsd_tree_connect *tcon)
+{
+	struct cifsd_deferred_close *dc, *tmp;
+	LIST_HEAD(dispose);
+
+	spin_lock(&deferred_close_lock);
+	list_for_each_entry_safe(dc, tmp, &deferred_close_list, list) {
+		if (tcon && dc->tcon != tcon)
+			continue;
+		list_move_tail(&dc->list, &dispose);
+		deferred_close_nr--;
+	}
+	spin_unlock(&deferred_close_lock);
+
+	deferred_close_dispose(&dispose);
+}
+
+/* Kept files pin their dentry, inode and page cache, oldest go first */
+static unsigned long deferred_close_shrink_count(struct shrinker *shrink,
+						 struct shrink_control *sc)
+{
+	return READ_ONCE(deferred_close_nr);
+}
+
+static unsigned long deferred_close_shrink_scan(struct shrinker *shrink,
+						struct shrink_control *sc)
+{
+	unsigned long freed = 0;
+	LIST_HEAD(dispose);
+
+	spin_lock(&deferred_close_lock);
+	while (freed < sc->nr_to_scan && !list_empty(&deferred_close_list)) {
+		list_move_tail(deferred_close_list.next, &dispose);
+		deferred_close_nr--;
+		freed++;
+	}
+	spin_unlock(&deferred_close_lock);
+
+	deferred_close_dispose(&dispose);
+	return freed ? freed : SHRINK_STOP;
+}
+
+static struct shrinker deferred_close_shrinker = {
+	.count_objects	= deferred_close_shrink_count,
+	.scan_objects	= deferred_close_shrink_scan,
+	.seeks		= DEFAULT_SEEKS,
+};
+
+/**
+ * cifsd_fd_memory_stats() - print memory held by open and closed handles
+ * @buf:	output buffer
+ * @size:	size of @buf
+ *
+ * Directory handles with a page of dirents read ahead, and files of
+ * closed handles kept for reopening.
+ *
+ * Return:	number of bytes written to @buf
+ */
+ssize_t cifsd_fd_memory_stats(char *buf, size_t size)
+{
+	unsigned long readdir_pages = 0;
+	struct cifsd_inode *ci;
+	struct cifsd_file *fp;
+	unsigned int i;
+
+	rcu_read_lock();
+	for (i = 0; i <= inode_hash_mask; i++) {
+		hlist_for_each_entry_rcu(ci, &inode_hashtable[i], m_hash) {
+			read_lock(&ci->m_lock);
+			list_for_each_entry(fp, &ci->m_fp_list, node)
+				if (fp->readdir_data.dirent)
+					readdir_pages++;
+			read_unlock(&ci->m_lock);
+		}
+	}
+	rcu_read_unlock();
+
+	return scnprintf(buf, size, "readdir_pages %lu %lu\n"
+			 "deferred_closes %u\n",
+			 readdir_pages,
+			 readdir_pages * (PAGE_SIZE >> 10),
+			 READ_ONCE(deferred_close_nr));
+}
+
+static void cifsd_fd_free_rcu(struct rcu_head *head)
+{
+	cifsd_free_file_struct(container_of(head, struct cifsd_file, f_rcu));
+}
+
+/*
+ * Last reference of a closed handle is gone, @defer keeps its file for
+ * a while if it can be. The tree connect of the handle has to be pinned
+ * by the caller then, the file is parked under it.
+ */
+static void __put_fd_final(struct cifsd_file *fp, bool defer)
+{
+	struct file *filp = fp->filp;
+
+	cifsd_dir_enum_detach(fp);
+	cifsd_notify_detach(fp);
+	cifsd_stream_buf_detach(fp);
+	cifsd_search_pattern_free(fp->search_pattern);
+	fp->search_pattern = NULL;
+	if (fp->readdir_data.dirent) {
+		free_page((unsigned long)fp->readdir_data.dirent);
+		fp->readdir_data.dirent = NULL;
+	}
+	defer = defer && fd_deferrable(fp);
+	cifsd_brl_close(fp);
+	__cifsd_inode_close(fp);
+	if (!IS_ERR_OR_NULL(filp) &&
+	    !(defer && deferred_close_add(fp->tcon, filp)))
+		filp_close(filp, (struct files_struct *)filp);
+	/* lookups find the handle without holding the table lock */
+	call_rcu(&fp->f_rcu, cifsd_fd_free_rcu);
+}
+
+/**
+ * cifsd_fd_put() - drop a reference to a handle
+ * @fp:		handle returned by a lookup, or NULL
+ *
+ * The file of a handle is closed when its last reference is dropped
+ * after the handle was closed.
+ */
+void cifsd_fd_put(struct cifsd_file *fp)
+{
+	if (fp && atomic_dec_and_test(&fp->refcount))
+		__put_fd_final(fp, false);
+}
+
+/**
+ * cifsd_compound_fp_set() - keep the handle opened by a compound CREATE
+ * @work:	smb work of the compound request
+ * @fp:		opened handle
+ *
+ * The related operations following the CREATE get @fp without looking it
+ * up in the file table, until the compound ends or the handle is closed.
+ */
+void cifsd_compound_fp_set(struct cifsd_work *work, struct cifsd_file *fp)
+{
+	cifsd_compound_fp_put(work);
+	atomic_inc(&fp->refcount);
+	work->compound_fp = fp;
+}
+
+void cifsd_compound_fp_put(struct cifsd_work *work)
+{
+	cifsd_fd_put(work->compound_fp);
+	work->compound_fp = NULL;
 }
 
 /* copy-pasted from old fh */
@@ -367,15 +2220,14 @@ static void __cifsd_close_fd(struct cifsd_file_table *ft,
 			     struct cifsd_file *fp,
 			     unsigned int id)
 {
-	struct file *filp;
 	struct cifsd_work *cancel_work, *ctmp;
 
+	if (!__cifsd_remove_fd(ft, fp))
+		return;
+
 	fd_limit_close();
 	__cifsd_remove_durable_fd(fp);
-	__cifsd_remove_fd(ft, fp);
-
 	close_id_del_oplock(fp);
-	filp = fp->filp;
 
 	spin_lock(&fp->f_lock);
 	list_for_each_entry_safe(cancel_work, ctmp, &fp->blocked_works,
@@ -386,33 +2238,25 @@ static void __cifsd_close_fd(struct cifsd_file_table *ft,
 	}
 	spin_unlock(&fp->f_lock);
 
-	__cifsd_inode_close(fp);
-	if (!IS_ERR_OR_NULL(filp))
-		filp_close(filp, (struct files_struct *)filp);
-	cifsd_free_file_struct(fp);
+	/* drop the reference of the file table */
+	cifsd_fd_put(fp);
 }
 
 static struct cifsd_file *__cifsd_lookup_fd(struct cifsd_file_table *ft,
 					    unsigned int id)
 {
-	bool unclaimed = true;
 	struct cifsd_file *fp;
 
-	read_lock(&ft->lock);
+	rcu_read_lock();
 	fp = idr_find(ft->idr, id);
-	if (fp && fp->f_ci) {
-		read_lock(&fp->f_ci->m_lock);
-		unclaimed = list_empty(&fp->node);
-		read_unlock(&fp->f_ci->m_lock);
-	}
-	read_unlock(&ft->lock);
-
-	if (unclaimed)
-		return NULL;
+	if (fp && !atomic_inc_not_zero(&fp->refcount))
+		fp = NULL;
+	rcu_read_unlock();
 	return fp;
 }
 
-int cifsd_close_fd(struct cifsd_work *work, unsigned int id)
+static int __close_fd_id(struct cifsd_work *work, unsigned int id,
+			 bool defer)
 {
 	struct cifsd_file	*fp;
 
@@ -424,9 +2268,35 @@ int cifsd_close_fd(struct cifsd_work *work, unsigned int id)
 		return -EINVAL;
 
 	__cifsd_close_fd(&work->sess->file_table, fp, id);
+	/*
+	 * The file is only kept if this is the last reference: the tree
+	 * connect it is parked under is pinned by this request, but may be
+	 * gone by the time a later holder drops the handle.
+	 */
+	if (defer && atomic_cmpxchg(&fp->refcount, 1, 0) == 1)
+		__put_fd_final(fp, true);
+	else
+		cifsd_fd_put(fp);
 	return 0;
 }
 
+int cifsd_close_fd(struct cifsd_work *work, unsigned int id)
+{
+	return __close_fd_id(work, id, false);
+}
+
+/**
+ * cifsd_close_fd_deferred() - close a handle, keeping its file for a while
+ * @work:	smb work
+ * @id:		volatile id of the handle
+ *
+ * Return:	0 on success, otherwise -EINVAL
+ */
+int cifsd_close_fd_deferred(struct cifsd_work *work, unsigned int id)
+{
+	return __close_fd_id(work, id, true);
+}
+
 static bool __sanity_check(struct cifsd_tree_connect *tcon,
 			   struct cifsd_file *fp)
 {
@@ -450,6 +2320,7 @@ struct cifsd_file *cifsd_lookup_fd_fast(struct cifsd_work *work,
 
 	if (__sanity_check(work->tcon, fp))
 		return fp;
+	cifsd_fd_put(fp);
 	return NULL;
 }
 
@@ -462,31 +2333,99 @@ struct cifsd_file *cifsd_lookup_fd_slow(struct cifsd_work *work,
 	if (!HAS_FILE_ID(id)) {
 		id = work->compound_fid;
 		pid = work->compound_pfid;
+
+		fp = work->compound_fp;
+		if (fp && fp->volatile_id == id && fp->persistent_id == pid &&
+		    __sanity_check(work->tcon, fp)) {
+			atomic_inc(&fp->refcount);
+			return fp;
+		}
 	}
 
 	if (!HAS_FILE_ID(id))
 		return NULL;
 
 	fp = __cifsd_lookup_fd(&work->sess->file_table, id);
-	if (!__sanity_check(work->tcon, fp))
-		return NULL;
-	if (fp->persistent_id != pid)
+	if (!__sanity_check(work->tcon, fp) || fp->persistent_id != pid) {
+		cifsd_fd_put(fp);
 		return NULL;
+	}
 	return fp;
 }
 
+/* Durable handles are looked up without taking a reference */
 struct cifsd_file *cifsd_lookup_durable_fd(unsigned long long id)
 {
-	return __cifsd_lookup_fd(&global_ft, id);
+	bool unclaimed = true;
+	struct cifsd_file *fp;
+
+	read_lock(&global_ft.lock);
+	fp = idr_find(global_ft.idr, id);
+	if (fp && fp->f_ci) {
+		read_lock(&fp->f_ci->m_lock);
+		unclaimed = list_empty(&fp->node);
+		read_unlock(&fp->f_ci->m_lock);
+	}
+	read_unlock(&global_ft.lock);
+
+	if (unclaimed)
+		return NULL;
+	return fp;
+}
+
+/*
+ * Durable handles of the global file table by CreateGuid and ClientGUID,
+ * for reconnects and replays, and by AppInstanceId, for the failover of
+ * an application to another client. Under global_ft.lock, handles without
+ * the GUID aren't indexed.
+ */
+#define CIFSD_DURABLE_HASH_BITS		10
+
+static DEFINE_HASHTABLE(durable_cguid_hash, CIFSD_DURABLE_HASH_BITS);
+static DEFINE_HASHTABLE(durable_app_id_hash, CIFSD_DURABLE_HASH_BITS);
+
+static u32 durable_guid_hash(const char *guid, const char *client_guid)
+{
+	u32 hash = jhash(guid, SMB2_CREATE_GUID_SIZE, 0);
+
+	if (client_guid)
+		hash = jhash(client_guid, SMB2_CLIENT_GUID_SIZE, hash);
+	return hash;
+}
+
+static bool durable_guid_set(const char *guid)
+{
+	return memchr_inv(guid, 0, SMB2_CREATE_GUID_SIZE) != NULL;
+}
+
+/**
+ * cifsd_index_durable_fd() - index a handle by its durable GUIDs
+ * @fp:		handle with a persistent id, once its GUIDs are set
+ */
+void cifsd_index_durable_fd(struct cifsd_file *fp)
+{
+	if (!HAS_FILE_ID(fp->persistent_id))
+		return;
+
+	write_lock(&global_ft.lock);
+	if (durable_guid_set(fp->create_guid) &&
+	    hlist_unhashed(&fp->cguid_hlist))
+		hash_add(durable_cguid_hash, &fp->cguid_hlist,
+			 durable_guid_hash(fp->create_guid, fp->client_guid));
+	if (durable_guid_set(fp->app_instance_id) &&
+	    hlist_unhashed(&fp->app_id_hlist))
+		hash_add(durable_app_id_hash, &fp->app_id_hlist,
+			 durable_guid_hash(fp->app_instance_id, NULL));
+	write_unlock(&global_ft.lock);
 }
 
 struct cifsd_file *cifsd_lookup_fd_app_id(char *app_id)
 {
-	struct cifsd_file	*fp = NULL;
-	unsigned int		id;
+	struct cifsd_file	*fp;
 
 	read_lock(&global_ft.lock);
-	idr_for_each_entry(global_ft.idr, fp, id) {
+	hash_for_each_possible(durable_app_id_hash, fp, app_id_hlist,
+			       durable_guid_hash(app_id, NULL)) {
 		if (!memcmp(fp->app_instance_id,
 			    app_id,
 			    SMB2_CREATE_GUID_SIZE))
@@ -497,16 +2436,19 @@ struct cifsd_file *cifsd_lookup_fd_app_id(char *app_id)
 	return fp;
 }
 
-struct cifsd_file *cifsd_lookup_fd_cguid(char *cguid)
+struct cifsd_file *cifsd_lookup_fd_cguid(char *client_guid, char *cguid)
 {
-	struct cifsd_file	*fp = NULL;
-	unsigned int		id;
+	struct cifsd_file	*fp;
 
 	read_lock(&global_ft.lock);
-	idr_for_each_entry(global_ft.idr, fp, id) {
+	hash_for_each_possible(durable_cguid_hash, fp, cguid_hlist,
+			       durable_guid_hash(cguid, client_guid)) {
 		if (!memcmp(fp->create_guid,
 			    cguid,
-			    SMB2_CREATE_GUID_SIZE))
+			    SMB2_CREATE_GUID_SIZE) &&
+		    !memcmp(fp->client_guid,
+			    client_guid,
+			    SMB2_CLIENT_GUID_SIZE))
 			break;
 	}
 	read_unlock(&global_ft.lock);
@@ -619,8 +2561,11 @@ struct cifsd_file *cifsd_open_fd(struct cifsd_work *work,
 	}
 
 	INIT_LIST_HEAD(&fp->blocked_works);
+	INIT_LIST_HEAD(&fp->lock_list);
 	INIT_LIST_HEAD(&fp->node);
 	spin_lock_init(&fp->f_lock);
+	/* reference of the file table, dropped at close */
+	atomic_set(&fp->refcount, 1);
 
 	fp->filp		= filp;
 	fp->conn		= work->sess->conn;
@@ -645,6 +2590,7 @@ struct cifsd_file *cifsd_open_fd(struct cifsd_work *work,
 	list_add(&fp->node, &fp->f_ci->m_fp_list);
 	write_unlock(&fp->f_ci->m_lock);
 
+	trace_cifsd_vfs_open(work, fp);
 	return fp;
 }
 
@@ -734,7 +2680,16 @@ void cifsd_close_session_fds(struct cifsd_work *work)
 
 int cifsd_init_global_file_table(void)
 {
-	return cifsd_init_file_table(&global_ft);
+	int ret;
+
+	ret = cifsd_init_file_table(&global_ft);
+	if (ret)
+		return ret;
+
+	ret = register_shrinker(&deferred_close_shrinker);
+	if (ret)
+		cifsd_destroy_file_table(&global_ft);
+	return ret;
 }
 
 void cifsd_free_global_file_table(void)
@@ -742,12 +2697,19 @@ void cifsd_free_global_file_table(void)
 	struct cifsd_file	*fp = NULL;
 	unsigned int		id;
 
+	if (global_ft.idr)
+		unregister_shrinker(&deferred_close_shrinker);
+	cancel_delayed_work_sync(&deferred_close_work);
+	cifsd_deferred_close_flush(NULL);
+
 	idr_for_each_entry(global_ft.idr, fp, id) {
 		__cifsd_remove_durable_fd(fp);
 		cifsd_free_file_struct(fp);
 	}
 
 	cifsd_destroy_file_table(&global_ft);
+	/* wait for the last handles to be freed */
+	rcu_barrier();
 }
 
 int cifsd_reopen_durable_fd(struct cifsd_work *work,
@@ -9,9 +9,13 @@
 #include <linux/file.h>
 #include <linux/fs.h>
 #include <linux/rwsem.h>
+#include <linux/mutex.h>
+#include <linux/wait.h>
 #include <linux/spinlock.h>
 #include <linux/idr.h>
+#include <linux/rbtree.h>
 #include <linux/workqueue.h>
+#include <linux/version.h>
 
 #include "vfs.h"
 
@@ -36,11 +40,26 @@
 
 struct cifsd_tcp_conn;
 struct cifsd_session;
+struct cifsd_dir_enum;
+struct cifsd_notify_handle;
+struct cifsd_search_pattern;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 14, 0)
+#define CIFSD_BRL_ROOT		struct rb_root_cached
+#define CIFSD_BRL_ROOT_INIT	RB_ROOT_CACHED
+#else
+#define CIFSD_BRL_ROOT		struct rb_root
+#define CIFSD_BRL_ROOT_INIT	RB_ROOT
+#endif
 
 struct cifsd_lock {
 	struct file_lock *fl;
 	struct list_head glist;
 	struct list_head llist;
+	/* granted locks: on the lock tree of the inode and list of the handle */
+	struct rb_node rb;
+	unsigned long long subtree_last;
+	struct list_head clist;
 	unsigned int flags;
 	unsigned int cmd;
 	int zero_len;
@@ -48,6 +67,72 @@ struct cifsd_lock {
 	unsigned long long end;
 };
 
+/* xattrs of open files cached on their cifsd_inode */
+enum {
+	CIFSD_META_FILE_ATTRIBUTE,
+	CIFSD_META_CREATION_TIME,
+	CIFSD_META_XATTR_LIST,
+	/* security descriptor built by build_sec_desc() */
+	CIFSD_META_SEC_DESC,
+	CIFSD_META_NR,
+};
+
+struct cifsd_inode_meta {
+	/* NT time of the inode ctime the value is valid at, 0 if unset */
+	u64				ctime;
+	/* value length, or -ENODATA if the xattr doesn't exist */
+	ssize_t				len;
+	char				*value;
+};
+
+/* contents of an alternate data stream, shared by its open handles */
+struct cifsd_stream_buf {
+	struct list_head		list;
+	/* handles attached, under m_lock of the cifsd_inode */
+	int				refcount;
+	struct mutex			lock;
+	/* xattr the stream is written back to */
+	char				*name;
+	char				*data;
+	size_t				len;
+	size_t				alloc;
+	/* m_stream_gen of the cifsd_inode when the stream was read */
+	int				gen;
+	bool				loaded;
+	bool				dirty;
+};
+
+/* fsyncs of an inode coalesced into one, see cifsd_vfs_fsync_range() */
+struct cifsd_sync_group {
+	spinlock_t			lock;
+	wait_queue_head_t		wait;
+	/* tickets handed out and covered by a finished sync */
+	u64				queued;
+	u64				done;
+	/* range of the tickets no sync has started for yet */
+	loff_t				start;
+	loff_t				end;
+	bool				running;
+	int				err;
+};
+
+/* access pattern of reads on a handle, see cifsd_vfs_readahead() */
+struct cifsd_readahead {
+	/* end of the furthest read and of the readahead issued */
+	loff_t				next;
+	loff_t				ra_end;
+	/* sequential and random reads in a row */
+	unsigned int			run;
+	unsigned int			misses;
+	/* FMODE_RANDOM was set by the detection, not by the client */
+	bool				random;
+
+	u64				seq_reads;
+	u64				random_reads;
+	u64				ra_calls;
+	u64				ra_bytes;
+};
+
 struct stream {
 	char *name;
 	int type;
@@ -61,11 +146,24 @@ struct cifsd_inode {
 	struct inode			*m_inode;
 	unsigned int			m_flags;
 	struct hlist_node		m_hash;
+	struct rcu_head			m_rcu;
 	struct list_head		m_fp_list;
 	struct list_head		m_op_list;
 	struct oplock_info		*m_opinfo;
 	char				*stream_name;
 	bool				is_sparse;
+	/* enumeration cache shared by handles on the directory */
+	struct cifsd_dir_enum		*m_dir_enum;
+	spinlock_t			m_meta_lock;
+	struct cifsd_inode_meta		m_meta[CIFSD_META_NR];
+	struct cifsd_sync_group		m_sync;
+	/* stream buffers, dropped when m_stream_gen moves */
+	struct list_head		m_streams;
+	atomic_t			m_stream_gen;
+	/* granted byte range locks, m_brl_nr is read without m_brl_lock */
+	rwlock_t			m_brl_lock;
+	CIFSD_BRL_ROOT			m_brl_tree;
+	atomic_t			m_brl_nr;
 };
 
 struct cifsd_file {
@@ -75,6 +173,9 @@ struct cifsd_file {
 	unsigned int			volatile_id;
 
 	spinlock_t			f_lock;
+	/* references of lookups and of the file table */
+	atomic_t			refcount;
+	struct rcu_head			f_rcu;
 
 	struct cifsd_inode		*f_ci;
 	struct cifsd_inode		*f_parent_ci;
@@ -99,10 +200,19 @@ struct cifsd_file {
 	char				client_guid[16];
 	char				create_guid[16];
 	char				app_instance_id[16];
+	/* durable handle indexes, see cifsd_index_durable_fd() */
+	struct hlist_node		cguid_hlist;
+	struct hlist_node		app_id_hlist;
 
 	struct stream			stream;
+	/* read pattern, under f_lock */
+	struct cifsd_readahead		ra;
+	/* buffered contents of the stream, written back at flush and close */
+	struct cifsd_stream_buf		*stream_buf;
 	struct list_head		node;
 	struct list_head		blocked_works;
+	/* granted byte range locks, under m_brl_lock of f_ci */
+	struct list_head		lock_list;
 
 	int				durable_timeout;
 
@@ -120,6 +230,13 @@ struct cifsd_file {
 	struct cifsd_readdir_data	readdir_data;
 	int				dot_dotdot[2];
 	int				dirent_offset;
+	/* search pattern of the last QUERY_DIRECTORY */
+	struct cifsd_search_pattern	*search_pattern;
+	/* or enumeration cache of the directory and position in it */
+	struct cifsd_dir_enum		*dir_enum;
+	unsigned int			dir_enum_pos;
+	/* changes watched by CHANGE_NOTIFY requests on the directory */
+	struct cifsd_notify_handle	*notify;
 };
 
 #define CIFSD_NR_OPEN_DEFAULT BITS_PER_LONG
@@ -145,6 +262,16 @@ int cifsd_init_file_table(struct cifsd_file_table *ft);
 void cifsd_destroy_file_table(struct cifsd_file_table *ft);
 
 int cifsd_close_fd(struct cifsd_work *work, unsigned int id);
+int cifsd_close_fd_deferred(struct cifsd_work *work, unsigned int id);
+
+struct file *cifsd_deferred_close_reuse(struct cifsd_tree_connect *tcon,
+					struct path *path, int open_flags);
+void cifsd_deferred_close_flush(struct cifsd_tree_connect *tcon);
+ssize_t cifsd_fd_memory_stats(char *buf, size_t size);
+
+void cifsd_fd_put(struct cifsd_file *fp);
+void cifsd_compound_fp_set(struct cifsd_work *work, struct cifsd_file *fp);
+void cifsd_compound_fp_put(struct cifsd_work *work);
 
 struct cifsd_file *cifsd_lookup_fd_fast(struct cifsd_work *work,
 					unsigned int id);
@@ -156,12 +283,13 @@ struct cifsd_file *cifsd_lookup_fd_slow(struct cifsd_work *work,
 
 struct cifsd_file *cifsd_lookup_durable_fd(unsigned long long id);
 struct cifsd_file *cifsd_lookup_fd_app_id(char *app_id);
-struct cifsd_file *cifsd_lookup_fd_cguid(char *cguid);
+struct cifsd_file *cifsd_lookup_fd_cguid(char *client_guid, char *cguid);
 struct cifsd_file *cifsd_lookup_fd_filename(struct cifsd_work *work,
 					    char *filename);
 struct cifsd_file *cifsd_lookup_fd_inode(struct inode *inode);
 
 unsigned int cifsd_open_durable_fd(struct cifsd_file *fp);
+void cifsd_index_durable_fd(struct cifsd_file *fp);
 
 struct cifsd_file *cifsd_open_fd(struct cifsd_work *work,
 				 struct file *filp);
@@ -187,6 +315,48 @@ void cifsd_set_fd_limit(unsigned long limit);
 
 int __init cifsd_inode_hash_init(void);
 void __exit cifsd_release_inode_hash(void);
+ssize_t cifsd_inode_hash_stats(char *buf, size_t size);
+ssize_t cifsd_readahead_stats(char *buf, size_t size);
+
+struct cifsd_dir_index;
+
+struct cifsd_dir_index *cifsd_dir_index_get(struct inode *dir);
+void cifsd_dir_index_put(struct cifsd_dir_index *di);
+struct cifsd_dir_index *cifsd_dir_index_alloc(struct inode *dir);
+int cifsd_dir_index_add(struct cifsd_dir_index *di, const char *name,
+			unsigned int len);
+void cifsd_dir_index_publish(struct cifsd_dir_index *di, struct inode *dir);
+const char *cifsd_dir_index_find(struct cifsd_dir_index *di,
+				 const char *name, unsigned int len);
+
+int cifsd_dir_enum_attach(struct cifsd_work *work, struct cifsd_file *dir_fp);
+void cifsd_dir_enum_detach(struct cifsd_file *dir_fp);
+int cifsd_dir_enum_next(struct cifsd_work *work, struct cifsd_file *dir_fp,
+			struct cifsd_kstat *cifsd_kstat, char **name);
+int cifsd_dir_read_entry(struct cifsd_work *work, struct cifsd_file *dir_fp,
+			 char *dirpath, struct cifsd_kstat *cifsd_kstat,
+			 char **name, int *reclen);
+void cifsd_dir_unread_entry(struct cifsd_file *dir_fp, int reclen);
+void cifsd_dir_release_page(struct cifsd_file *dir_fp);
+
+int cifsd_inode_meta_item(const char *name);
+ssize_t cifsd_inode_meta_get(struct inode *inode, int item, char **value,
+			     size_t size, u64 *stamp);
+void cifsd_inode_meta_set(struct inode *inode, int item, u64 stamp,
+			  const char *value, ssize_t len);
+u64 cifsd_inode_meta_stamp(struct inode *inode);
+void cifsd_inode_meta_update(struct inode *inode, u64 stamp,
+			     const char *name, const void *value,
+			     ssize_t len);
+
+struct cifsd_stream_buf *cifsd_stream_buf_lock(struct cifsd_file *fp);
+int cifsd_stream_buf_flush(struct cifsd_file *fp);
+void cifsd_stream_bufs_discard(struct inode *inode);
+
+void cifsd_brl_grant(struct cifsd_file *fp, struct cifsd_lock *lock);
+void cifsd_brl_release(struct cifsd_file *fp, struct cifsd_lock *lock);
+bool cifsd_brl_conflict(struct cifsd_file *fp, loff_t start, loff_t end,
+			int type);
 
 enum CIFSD_INODE_STATUS {
 	CIFSD_INODE_STATUS_OK,
@@ -196,6 +366,9 @@ enum CIFSD_INODE_STATUS {
 
 int cifsd_query_inode_status(struct inode *inode);
 
+struct cifsd_inode *cifsd_inode_lookup_by_vfsinode(struct inode *inode);
+void cifsd_inode_put(struct cifsd_inode *ci);
+
 bool cifsd_inode_pending_delete(struct cifsd_file *fp);
 void cifsd_set_inode_pending_delete(struct cifsd_file *fp);
 void cifsd_clear_inode_pending_delete(struct cifsd_file *fp);